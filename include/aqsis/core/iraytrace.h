@@ -0,0 +1,90 @@
+//------------------------------------------------------------------------------
+/**
+ *	@file	iraytrace.h
+ *	@author	Paul Gregory
+ *	@brief	Declare the interface class for common raytracer access.
+ *
+ *	Last change by:		$Author$
+ *	Last change date:	$Date$
+ */
+//------------------------------------------------------------------------------
+
+
+#ifndef	___iraytrace_Loaded___
+#define	___iraytrace_Loaded___
+
+#include	<aqsis/aqsis.h>
+#include	<boost/shared_ptr.hpp>
+
+#include	<aqsis/math/color.h>
+#include	<aqsis/math/vector3d.h>
+
+namespace Aqsis {
+
+struct IqSurface;
+
+/** \brief Information about the nearest intersection of a ray with the scene.
+ *
+ * All positions and directions are in "current" (camera) space.
+ */
+struct SqRayHit
+{
+	TqFloat		distance;	///< Distance along the (unit length) ray to the hit.
+	CqVector3D	P;			///< Position of the hit.
+	CqVector3D	Ng;			///< Geometric normal of the hit triangle.
+	CqColor		Cs;			///< Surface colour of the primitive which was hit.
+	CqColor		Os;			///< Surface opacity of the primitive which was hit.
+};
+
+struct IqRaytrace
+{
+	virtual ~IqRaytrace()
+	{}
+
+
+	/** Initialise the raytracing subsystem.
+	 */
+	virtual	void	Initialise()=0;
+
+	/** Add a primitive to the raytracing space subdivision structure.
+	 */
+	virtual	void	AddPrimitive(const boost::shared_ptr<IqSurface>& pSurface)=0;
+
+	/** Prepare the structure for raytrace queries.
+	 */
+	virtual void	Finalise()=0;
+
+	/** Return true if there is no geometry to trace rays against.
+	 */
+	virtual bool	IsEmpty() const=0;
+
+	/** Return true while Finalise() is expanding procedurals.  Primitives
+	 * created in the meantime belong to the raytracer alone, and mustn't be
+	 * posted to the main pipeline.
+	 */
+	virtual bool	IsExpanding() const=0;
+
+	/** Find the nearest intersection of a ray with the scene.
+	 *
+	 * May be called concurrently from several threads once Finalise() has
+	 * been called.
+	 *
+	 * \param origin - ray origin in camera space.
+	 * \param direction - unit ray direction in camera space.
+	 * \param minDist - hits nearer to the origin than this are ignored.
+	 * \param maxDist - hits further from the origin than this are ignored.
+	 * \param hit - if non-null, filled in with details of the nearest hit.
+	 *              When null, any hit terminates the search, which is
+	 *              considerably cheaper for shadow and occlusion rays.
+	 * \return true if the ray hit something.
+	 */
+	virtual bool	Intersect(const CqVector3D& origin, const CqVector3D& direction,
+							TqFloat minDist, TqFloat maxDist, SqRayHit* hit) const=0;
+};
+
+
+//-----------------------------------------------------------------------
+
+} // namespace Aqsis
+
+#endif	//	___iraytrace_Loaded___
@@ -25,6 +25,7 @@ namespace Aqsis {
 
 struct IqTextureMapOld;
 struct IqTextureCache;
+struct IqRaytrace;
 
 struct IqRenderer
 {
@@ -77,6 +78,12 @@ struct IqRenderer
 	virtual	IqTextureMapOld* GetLatLongMap( const CqString& fileName ) = 0;
 	//@}
 
+	/** \brief Get the raytracing subsystem.
+	 *
+	 * \return the raytracer, or null if there is none.
+	 */
+	virtual	IqRaytrace*	pRaytracer() const = 0;
+
 	virtual	bool	GetBasisMatrix( CqMatrix& matBasis, const CqString& name ) = 0;
 
 	virtual TqInt	RegisterOutputData( const char* name ) = 0;
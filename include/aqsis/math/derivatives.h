@@ -82,6 +82,17 @@ class CqGridDiff
 		template<typename T>
 		T diffV(const T* data, TqInt u, TqInt v) const;
 
+		/// u-resolution of the grid.
+		TqInt uRes() const { return m_uRes; }
+		/// v-resolution of the grid.
+		TqInt vRes() const { return m_vRes; }
+		/// True if derivatives in the u-direction are assumed to be zero.
+		bool uDiffZero() const { return m_uDiffZero; }
+		/// True if derivatives in the v-direction are assumed to be zero.
+		bool vDiffZero() const { return m_vDiffZero; }
+		/// True if centred differences are used.
+		bool useCentred() const { return m_useCentred; }
+
 	private:
 		template<typename T>
 		static T diff(const T* data, bool useCentred, TqInt stride,
@@ -39,7 +39,9 @@
 
 #include <aqsis/config.h>
 
-#include <iosfwd>
+#include <istream>
+
+#include <boost/scoped_ptr.hpp>
 
 namespace Aqsis
 {
@@ -72,6 +74,37 @@ class AQSIS_RIUTIL_SHARE RibParser
         virtual ~RibParser() {}
 };
 
+
+//------------------------------------------------------------------------------
+/// Input stream for RIB files on disk.
+///
+/// Regular files are memory mapped.  When such a stream is given to the RIB
+/// parser, it tokenizes directly from the mapped bytes rather than copying
+/// them through the stream buffer a few characters at a time.  Files which
+/// can't be mapped (eg, named pipes) are read as normal file streams instead.
+///
+/// To everything else, this is an ordinary std::istream.
+class AQSIS_RIUTIL_SHARE RibInputFile : public std::istream
+{
+    public:
+        /// Open the given file.  On failure, the stream's failbit is set.
+        explicit RibInputFile(const char* fileName);
+        virtual ~RibInputFile();
+
+        /// Take the unread part of the file if it's memory mapped.
+        ///
+        /// On success, [begin,end) is set to the unread bytes, which remain
+        /// valid for the lifetime of the stream, and the stream position is
+        /// moved to the end of the file.
+        ///
+        /// \return false if the file isn't mapped.
+        bool takeMappedInput(const char*& begin, const char*& end);
+
+    private:
+        struct Impl;
+        boost::scoped_ptr<Impl> m_impl;
+};
+
 } // namespace Aqsis
 
 #endif // AQSIS_RIBPARSER_H_INCLUDED
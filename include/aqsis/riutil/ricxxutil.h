@@ -41,6 +41,7 @@
 
 #include <cassert>
 #include <climits>
+#include <ctime>
 #include <deque>
 #include <string.h> // for strcmp
 
@@ -216,6 +217,9 @@ SqInterpClassCounts curvesIClassCounts(const char* type,
 
 //------------------------------------------------------------------------------
 typedef boost::function<bool(const char*)> IfElseTestCallback;
+/// Callback told when the replay of an object instance starts (with true)
+/// and ends (with false).
+typedef boost::function<void (bool)> ObjectInstanceCallback;
 
 /// Create a "Renderer utility filter"
 ///
@@ -240,9 +244,140 @@ typedef boost::function<bool(const char*)> IfElseTestCallback;
 /// string, and return a bool indicating whether the condition evaluated to
 /// true or false.
 ///
+/// The instance callback, if any, is called around each replay of an object
+/// instance.  The calls made during the replay pass the same parameter
+/// arrays every time, which lets the renderer share their values between
+/// instances.
+///
 AQSIS_RIUTIL_SHARE
 Ri::Filter* createRenderUtilFilter(const IfElseTestCallback& callback =
-                                   IfElseTestCallback());
+                                   IfElseTestCallback(),
+                                   const ObjectInstanceCallback&
+                                   instanceCallback = ObjectInstanceCallback());
+
+//------------------------------------------------------------------------------
+/// Callback which runs a procedural, making its calls to the given context.
+typedef boost::function<void (Ri::Renderer& context)> ProceduralGenerator;
+
+/// Cache of RIB archive files parsed into memory.
+///
+/// Set dressing often reads the same few archives many times over.  An
+/// archive which is read a second time is parsed into memory, and further
+/// reads replay the cached interface calls instead of parsing the file again.
+/// Entries are keyed by file name and modification time, so an archive which
+/// changes on disk is parsed afresh.
+///
+/// When prefetch threads are enabled, archives may also be parsed ahead of
+/// time on worker threads.  The core prefetches the archive of a
+/// DelayedReadArchive procedural once the procedural survives culling, and
+/// the cache prefetches every archive read with ReadArchive from an archive
+/// it's parsing or about to replay.  The parsed calls are replayed in order
+/// on the calling thread when the archive is actually read.
+///
+/// The cache also holds the interface calls made by procedurals, so that a
+/// procedural which is expanded again in a later frame can be replayed rather
+/// than run.  These may be saved to disk to be reused by later renders.
+class RibArchiveCache
+{
+    public:
+        /// Insert the contents of an archive file into the given context.
+        ///
+        /// \param fileName - resolved path to the archive file
+        /// \param services - services used to parse the file
+        /// \param context - sink for the archive contents
+        virtual void readArchive(const char* fileName,
+                                 Ri::RendererServices& services,
+                                 Ri::Renderer& context) = 0;
+        /// Start parsing an archive file on a worker thread.
+        ///
+        /// Does nothing if there are no prefetch threads, or the archive is
+        /// already cached.  The lookup functions of services (getBasis() etc)
+        /// are called from the worker threads, so must be thread safe.
+        ///
+        /// \param fileName - resolved path to the archive file
+        /// \param services - services used to parse the file
+        virtual void prefetch(const char* fileName,
+                              Ri::RendererServices& services) = 0;
+        /// Insert the calls made by a previously recorded procedural.
+        ///
+        /// Calls saved on disk by recordProcedural() are loaded if they
+        /// aren't already in memory.  Calls are discarded if any of the
+        /// archives read through readArchive() while recording them have
+        /// changed since, or can no longer be found.
+        ///
+        /// \param key - identifies the procedural and its arguments
+        /// \param modifiedTime - modification time of the files the
+        ///                       procedural depends on; calls recorded with a
+        ///                       different time are discarded.
+        /// \param services - services used to parse calls saved on disk
+        /// \param context - sink for the procedural's calls
+        /// \return false if no current calls are cached under key.
+        virtual bool replayProcedural(const char* key,
+                                      std::time_t modifiedTime,
+                                      Ri::RendererServices& services,
+                                      Ri::Renderer& context) = 0;
+        /// Record the calls made by a procedural, and insert them into context.
+        ///
+        /// generate is called with a context which records the calls made to
+        /// it.  Archives it reads through readArchive(), including nested
+        /// ones, are noted along with their modification times so that
+        /// replayProcedural() can check them.  If generate throws, nothing is
+        /// cached.
+        ///
+        /// \param key, modifiedTime - as for replayProcedural()
+        /// \param generate - runs the procedural
+        /// \param saveToDisk - also save the calls in the procedural cache
+        ///                     directory if one is set.  Calls are never saved
+        ///                     if they include non-standard procedurals.
+        /// \param services - services used to report errors
+        /// \param context - sink for the procedural's calls
+        virtual void recordProcedural(const char* key, std::time_t modifiedTime,
+                                      const ProceduralGenerator& generate,
+                                      bool saveToDisk,
+                                      Ri::RendererServices& services,
+                                      Ri::Renderer& context) = 0;
+        /// Set the directory in which recorded procedurals are saved.
+        ///
+        /// An empty name disables saving to disk.
+        virtual void setProceduralCacheDir(const char* dirName) = 0;
+        /// Record a declaration for use when parsing prefetched archives.
+        ///
+        /// A null declaration forgets any earlier declaration of name, as
+        /// for RiDeclare.  Archives and procedurals cached under different
+        /// declarations are parsed or run again rather than replayed, since
+        /// their tokens may now have different types.
+        virtual void declare(const char* name, const char* declaration) = 0;
+        /// Set the number of threads used to prefetch archives.
+        ///
+        /// Zero disables prefetching.  Has no effect unless aqsis was built
+        /// with threading support.
+        virtual void setPrefetchThreads(int numThreads) = 0;
+        /// Discard all cached archives and procedurals held in memory.
+        virtual void clear() = 0;
+        /// Discard the least recently used archives and procedurals.
+        ///
+        /// At most maxEntries archives and procedurals are kept.  Procedurals
+        /// replaced by newer versions are always discarded, so this must only
+        /// be called when no procedurals created from the cached calls are
+        /// waiting to be expanded, such as after the world is rendered.
+        virtual void trim(int maxEntries) = 0;
+
+        virtual ~RibArchiveCache() {}
+};
+
+/// Callback to find an archive file from the name given in the RIB stream.
+///
+/// Should return the resolved path, or an empty string if the file isn't
+/// found.
+typedef boost::function<std::string (const char* name)> ArchiveResolver;
+
+/// Create an empty archive cache.
+///
+/// \param resolver - used to find the archives read from cached archives so
+///                   that they can be prefetched.
+AQSIS_RIUTIL_SHARE
+RibArchiveCache* createRibArchiveCache(const ArchiveResolver& resolver =
+                                       ArchiveResolver());
 
 //------------------------------------------------------------------------------
 /// Empty implementation of Ri::Renderer
@@ -168,12 +168,17 @@ struct AQSIS_SHADERVM_SHARE IqShader
  * \param renderContext - Context within which the shader will operate
  * \param programFile - file from which to read the shader program
  * \param dsoPath - search path for DSO shadeops.
+ * \param fuseInstructions - whether to replace common instruction sequences
+ *                           in the program with single fused instructions.
+ *                           Turning this off allows fused programs to be
+ *                           checked against the original instructions.
  */
 AQSIS_SHADERVM_SHARE boost::shared_ptr<IqShader> createShaderVM(IqRenderer* renderContext);
 
 AQSIS_SHADERVM_SHARE boost::shared_ptr<IqShader> createShaderVM(IqRenderer* renderContext,
 										   std::istream& programFile,
-										   const std::string& dsoPath);
+										   const std::string& dsoPath,
+										   bool fuseInstructions = true);
 //@}
 
 /** \brief Reset ShaderVM static variables
@@ -75,6 +75,71 @@ class AQSIS_SLCOMP_SHARE CqCodeGenGraphviz : public IqCodeGen
 		virtual void OutputTree( IqParseNode* pNode, std::string strOutName );
 };
 
+
+//-----------------------------------------------------------------------
+/** \brief Version number for the interface of native compiled shaders.
+ *
+ * A native shader library exports the following C functions:
+ *
+ * \verbatim
+ * int aqsis_native_version();
+ * const char* const* aqsis_native_variables();
+ * const char* aqsis_native_types();
+ * void aqsis_native_shade(float* const* vars, const int* varying,
+ *                         int count, const unsigned char* running,
+ *                         const SqNativeShadingEnv* env);
+ * \endverbatim
+ *
+ * aqsis_native_variables() returns the null terminated list of shader
+ * parameters and standard variables used by the shader.  aqsis_native_types()
+ * gives a character for each of them: 'f' for a float, 't' for a point,
+ * vector, normal or color, in upper case if the shader writes the variable.
+ * aqsis_native_shade() runs the shader on the first count shading points for
+ * which running is nonzero; vars holds the data for each variable, and
+ * varying is zero for variables with a single value for all points.
+ *
+ * env describes the grid, for derivatives, and gives the shadeops which the
+ * native code calls back into the renderer for.  It has the layout:
+ *
+ * \verbatim
+ * struct SqNativeShadingEnv
+ * {
+ *     int uSize, vSize;          // shading points in u and v
+ *     int uDiffZero, vDiffZero;  // nonzero if derivatives are zero
+ *     int centred;               // nonzero for centred differences
+ *     float (*fnoise)(const float* args, int numArgs);
+ *     void (*pnoise)(const float* args, int numArgs, float* result);
+ *     void (*cnoise)(const float* args, int numArgs, float* result);
+ * };
+ * \endverbatim
+ *
+ * The noise functions take 1 to 4 floats, being the arguments of the
+ * shading language noise() with a point passed as three floats.
+ */
+#define AQSIS_NATIVE_SHADER_VERSION 2
+
+/** \brief Compiler backend to output native code alongside VM code.
+ *
+ * The main code of the shader is translated to C++, and compiled into a
+ * shared library with the system compiler.  The libraries are cached in a
+ * directory by a hash of the generated source and the compiler command, so
+ * unchanged shaders aren't recompiled.  The .slx file is written as usual, with a reference to the
+ * library which the VM runs in place of the bytecode when it can.  Shaders
+ * which can't be translated get a plain .slx file.
+ */
+class AQSIS_SLCOMP_SHARE CqCodeGenNative : public IqCodeGen
+{
+	public:
+		/** \param cacheDir - directory in which to keep the compiled shaders.
+		 * \param compiler - command to run the C++ compiler.
+		 */
+		CqCodeGenNative( const std::string& cacheDir, const std::string& compiler );
+		virtual void OutputTree( IqParseNode* pNode, std::string strOutName );
+	private:
+		std::string	m_cacheDir;
+		std::string	m_compiler;
+};
+
 //-----------------------------------------------------------------------
 
 } // namespace Aqsis
@@ -0,0 +1,195 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/**
+ * \file
+ *
+ * \brief Deep shadow map buffer, holding a visibility function per pixel.
+ */
+
+#ifndef DEEPSHADOWMAP_H_INCLUDED
+#define DEEPSHADOWMAP_H_INCLUDED
+
+#include <aqsis/aqsis.h>
+
+#include <vector>
+
+#include <aqsis/math/matrix.h>
+#include <aqsis/util/file.h>
+
+namespace Aqsis {
+
+//------------------------------------------------------------------------------
+/** \brief A vertex of a piecewise linear visibility function.
+ *
+ * Visibility is the fraction of light which passes through to the given depth.
+ * A vertical step in the function is represented by two nodes at the same
+ * depth.
+ */
+struct SqVisibilityNode
+{
+	TqFloat depth;
+	TqFloat visibility;
+
+	SqVisibilityNode(TqFloat depth = 0, TqFloat visibility = 1);
+};
+
+//------------------------------------------------------------------------------
+/** \brief A deep shadow map.
+ *
+ * Rather than a single depth, each pixel holds the visibility as a function of
+ * depth from the light.  This captures partial occlusion by semitransparent
+ * surfaces and by thin geometry such as hair, which covers only part of a
+ * pixel, so deep maps need far less resolution and filtering than depth maps
+ * to shadow such objects without aliasing.
+ *
+ * The functions are stored as piecewise linear curves, which are simplified
+ * with compress() before being added to the map.  Before the first node the
+ * visibility is the visibility of the first node, and after the last node it
+ * is that of the last.  Pixels without any nodes are fully visible.
+ *
+ * The file format is a simple platform-dependent binary format similar to
+ * the aqsis z-file:
+ *
+ * \verbatim
+ * "Aqsis DeepShadow"      - magic number
+ * TqUint width, height    - map resolution
+ * TqFloat[16]             - world -> light camera matrix
+ * TqFloat[16]             - world -> light screen matrix
+ * TqUint[width*height+1]  - start of each pixel function in the node array
+ * TqFloat[2*numNodes]     - (depth, visibility) nodes
+ * \endverbatim
+ */
+class AQSIS_TEX_SHARE CqDeepShadowMap
+{
+	public:
+		/** \brief Create a map where all pixels are fully visible.
+		 *
+		 * \param width, height - map resolution
+		 * \param worldToCamera - transformation from world to light camera
+		 *                        coordinates
+		 * \param worldToScreen - transformation from world to light screen
+		 *                        coordinates, which cover [-1,1]x[-1,1]
+		 */
+		CqDeepShadowMap(TqInt width, TqInt height, const CqMatrix& worldToCamera,
+				const CqMatrix& worldToScreen);
+		/** \brief Load a map from file.
+		 *
+		 * \throw XqInvalidFile if the file can't be opened.
+		 * \throw XqBadTexture if the file isn't a valid deep shadow map.
+		 */
+		CqDeepShadowMap(const boostfs::path& fileName);
+
+		/// Write the map to file.
+		void write(const boostfs::path& fileName) const;
+
+		TqInt width() const;
+		TqInt height() const;
+		const CqMatrix& worldToCamera() const;
+		const CqMatrix& worldToScreen() const;
+		/// Total number of nodes in all the pixel functions.
+		std::size_t numNodes() const;
+
+		/** \brief Set the visibility function for a pixel.
+		 *
+		 * Each pixel should be set at most once.  Nodes must be sorted by
+		 * depth.  Pixels may be set in any order, but the map is not safe for
+		 * concurrent modification.
+		 */
+		void setPixel(TqInt x, TqInt y, const std::vector<SqVisibilityNode>& nodes);
+		/** \brief Get the visibility through a pixel up to the given depth.
+		 *
+		 * As with a depth map comparison, occluders lying exactly at the
+		 * depth don't count.
+		 */
+		TqFloat visibility(TqInt x, TqInt y, TqFloat depth) const;
+
+		/** \brief Simplify a piecewise linear visibility function.
+		 *
+		 * The greedy algorithm of Lokovic & Veach drops vertices of the
+		 * function while the result stays within the given tolerance of the
+		 * original at all the input vertices.  Steps larger than the
+		 * tolerance are kept exactly.
+		 *
+		 * \param nodes - input function, sorted by depth.
+		 * \param tolerance - maximum error in the visibility.
+		 * \param result - the simplified function is placed in here.
+		 */
+		static void compress(const std::vector<SqVisibilityNode>& nodes,
+				TqFloat tolerance, std::vector<SqVisibilityNode>& result);
+	private:
+		TqInt m_width;
+		TqInt m_height;
+		CqMatrix m_worldToCamera;
+		CqMatrix m_worldToScreen;
+		/// Start and number of nodes for each pixel, in m_nodes.
+		std::vector<TqUint> m_pixelStart;
+		std::vector<TqUint> m_pixelSize;
+		/// Nodes for all pixels.
+		std::vector<SqVisibilityNode> m_nodes;
+};
+
+
+//==============================================================================
+// Implementation details
+//==============================================================================
+inline SqVisibilityNode::SqVisibilityNode(TqFloat depth, TqFloat visibility)
+	: depth(depth),
+	visibility(visibility)
+{ }
+
+inline TqInt CqDeepShadowMap::width() const
+{
+	return m_width;
+}
+
+inline TqInt CqDeepShadowMap::height() const
+{
+	return m_height;
+}
+
+inline const CqMatrix& CqDeepShadowMap::worldToCamera() const
+{
+	return m_worldToCamera;
+}
+
+inline const CqMatrix& CqDeepShadowMap::worldToScreen() const
+{
+	return m_worldToScreen;
+}
+
+inline std::size_t CqDeepShadowMap::numNodes() const
+{
+	return m_nodes.size();
+}
+
+} // namespace Aqsis
+
+#endif // DEEPSHADOWMAP_H_INCLUDED
@@ -45,14 +45,12 @@
 
 #include <boost/intrusive_ptr.hpp>
 #include <boost/scoped_ptr.hpp>
-#include <boost/scoped_array.hpp>
 #include <boost/noncopyable.hpp>
 
-//#include <aqsis/util/memorysentry.h>
 #include <aqsis/tex/io/itiledtexinputfile.h>
 #include <aqsis/tex/buffers/texturebuffer.h>
+#include <aqsis/tex/buffers/tilecache.h>
 #include "randomtable.h"
-#include <aqsis/util/smartptr.h>
 
 namespace Aqsis {
 
@@ -83,9 +81,14 @@ class CqTextureTile;
  * iterator mechanism for traversing all pixels within a given region.  This
  * allows for efficient filtering to be performed over the texture, without
  * worrying about the underlying tiled structure.
+ *
+ * Tiles are loaded from file on demand and held in the global CqTileCache,
+ * which may discard them again when texture memory runs short.  Pixel
+ * iterators keep the tile they're currently traversing alive.  Lookups may be
+ * made from several threads at once.
  */
 template<typename T>
-class CqTileArray : boost::noncopyable //, public CqMemoryMonitored
+class CqTileArray : boost::noncopyable
 {
 	private:
 		typedef CqTextureTile<CqTextureBuffer<T> > TqTile;
@@ -129,6 +132,10 @@ class CqTileArray : boost::noncopyable //, public CqMemoryMonitored
 		 * tile has to be deduced for each invocation, which involves two
 		 * integer divisions.
 		 *
+		 * The returned view doesn't keep the tile in the cache, so it may be
+		 * invalidated by tile lookups from other threads.  Use the pixel
+		 * iterators for concurrent access.
+		 *
 		 * \param x - pixel index in width direction (column index)
 		 * \param y - pixel index in height direction (row index)
 		 * \return a lightweight vector holding a reference to the channels data
@@ -180,7 +187,7 @@ class CqTileArray : boost::noncopyable //, public CqMemoryMonitored
 		/// Height of the array
 		TqInt m_heightInTiles;
 		/// "2D" array of tiles.  Tiles may be founnd in O(1) time using this array.
-		boost::scoped_array<boost::intrusive_ptr<TqTile> > m_tiles;
+		mutable CqTileSlots m_tiles;
 };
 
 
@@ -243,6 +250,8 @@ class CqTileArray<T>::CqIterator
 		/// Current tile y-coordinate
 		TqInt m_tileY;
 
+		/// Current tile, held to stop it being evicted from the cache.
+		boost::intrusive_ptr<TqTile> m_currTile;
 		/// Current position in the underlying tiles.
 		TqBaseIter m_currPos;
 
@@ -321,6 +330,8 @@ class CqTileArray<T>::CqStochasticIterator
 		TqFloat m_remainingArea;
 		/// Number of samples remaining for tiles yet to be filtered over.
 		TqInt m_remainingSamples;
+		/// Current tile, held to stop it being evicted from the cache.
+		boost::intrusive_ptr<TqTile> m_currTile;
 		/// Current position in the underlying tiles.
 		TqBaseIter m_currPos;
 
@@ -339,12 +350,11 @@ class CqTileArray<T>::CqStochasticIterator
  *
  * The wrapper adds two things to the underlying array:
  *   - Adjust the origin of the array to some point (x0, y0)
- *   - Facilities to enable being held by a tiled array (intrusive reference
- *     counting, and support for determining recent usage for tile cache
- *     rejection (FIXME coming soon) )
+ *   - Facilities to enable being held by a tiled array and the tile cache
+ *     (atomic intrusive reference counting and recent usage tracking)
  */
 template<typename ArrayT>
-class CqTextureTile : public CqIntrusivePtrCounted
+class CqTextureTile : public CqCachedTile
 {
 	private:
 		/// Underlying array of pixels
@@ -487,7 +497,7 @@ CqTileArray<T>::CqTileArray(const boost::shared_ptr<IqTiledTexInputFile>& inFile
 	m_tileHeight(inFile->tileInfo().height),
 	m_widthInTiles((m_width-1)/m_tileWidth + 1), // "ceil(m_width/m_tileWidth)"
 	m_heightInTiles((m_height-1)/m_tileHeight + 1),
-	m_tiles(new boost::intrusive_ptr<TqTile>[m_widthInTiles*m_heightInTiles])
+	m_tiles(CqTileCache::instance(), m_widthInTiles*m_heightInTiles)
 { }
 
 template<typename T>
@@ -537,14 +547,21 @@ boost::intrusive_ptr<typename CqTileArray<T>::TqTile> CqTileArray<T>::getTile(
 {
 	assert(x < m_widthInTiles);
 	assert(y < m_heightInTiles);
-	boost::intrusive_ptr<TqTile>& tilePtr = m_tiles[y*m_widthInTiles + x];
-	if(!tilePtr)
+	TqInt index = y*m_widthInTiles + x;
+	boost::intrusive_ptr<CqCachedTile> cached = m_tiles.find(index);
+	if(!cached)
 	{
-		tilePtr = boost::intrusive_ptr<TqTile>(
+		boost::intrusive_ptr<TqTile> newTile(
 				new TqTile(x*m_tileWidth, y*m_tileHeight));
-		m_inFile->readTile(tilePtr->pixels(), x, y, m_subImageIdx);
+		{
+			CqTileCache::CqFileLock lock(m_inFile.get());
+			m_inFile->readTile(newTile->pixels(), x, y, m_subImageIdx);
+		}
+		const CqTextureBuffer<T>& pixels = newTile->pixels();
+		cached = m_tiles.insert(index, newTile, sizeof(T)*pixels.numChannels()
+				*pixels.width()*pixels.height());
 	}
-	return tilePtr;
+	return boost::static_pointer_cast<TqTile>(cached);
 }
 
 
@@ -578,7 +595,8 @@ void CqTileArray<T>::CqIterator::nextTile()
 	{
 		// Grab the next tile as long as we're within the overall
 		// filter support.
-		m_currPos = m_tileArray->getTile(m_tileX,m_tileY)->begin(m_support);
+		m_currTile = m_tileArray->getTile(m_tileX,m_tileY);
+		m_currPos = m_currTile->begin(m_support);
 	}
 }
 
@@ -619,8 +637,9 @@ CqTileArray<T>::CqIterator::CqIterator(const CqTileArray<T>& tileArray,
 	m_tileY(support.sy.start/tileArray.m_tileHeight),
 	// Check support.sx.empty() etc in order to make sure the tile
 	// index is still valid when the support is outside the buffer
-	m_currPos(m_tileArray->getTile(support.sx.isEmpty() ? 0 : m_tileX,
-				support.sy.isEmpty() ? 0 : m_tileY)->begin(m_support))
+	m_currTile(m_tileArray->getTile(support.sx.isEmpty() ? 0 : m_tileX,
+				support.sy.isEmpty() ? 0 : m_tileY)),
+	m_currPos(m_currTile->begin(m_support))
 {
 	// Make sure that inSupport() works correctly when the support is empty.
 	if(support.isEmpty())
@@ -689,8 +708,8 @@ void CqTileArray<T>::CqStochasticIterator::nextTile()
 		m_remainingArea -= area;
 	}
 	// Grab the underlying iterator for the next tile
-	m_currPos = m_tileArray->getTile(m_tileX,m_tileY)->beginStochastic(m_support,
-			numSamples);
+	m_currTile = m_tileArray->getTile(m_tileX,m_tileY);
+	m_currPos = m_currTile->beginStochastic(m_support, numSamples);
 	m_remainingSamples -= numSamples;
 }
 
@@ -731,6 +750,7 @@ CqTileArray<T>::CqStochasticIterator::CqStochasticIterator(const CqTileArray<T>&
 	m_tileY(support.sy.start/tileArray.m_tileHeight),
 	m_remainingArea(support.area()),
 	m_remainingSamples(numSamps),
+	m_currTile(),
 	m_currPos()
 {
 	// Make sure that inSupport() works correctly when the support region is
@@ -0,0 +1,280 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/**
+ * \file
+ *
+ * \brief Memory bounded cache of texture tiles, shared by all tiled arrays.
+ */
+
+#ifndef TILECACHE_H_INCLUDED
+#define TILECACHE_H_INCLUDED
+
+#include <aqsis/aqsis.h>
+
+#include <cstddef>
+#include <vector>
+
+#include <boost/detail/atomic_count.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#ifdef ENABLE_THREADING
+#	include <boost/thread/mutex.hpp>
+#endif
+
+namespace Aqsis {
+
+class CqTileCache;
+class CqTileSlots;
+class IqTiledTexInputFile;
+
+//------------------------------------------------------------------------------
+/** \brief Base class for tiles which may be held in a CqTileCache.
+ *
+ * Tiles are reference counted with boost::intrusive_ptr.  The count is
+ * atomic, so tiles may be shared between threads.  A tile which is referenced
+ * from anywhere other than its slot in a CqTileSlots table is "pinned", and
+ * is never evicted from the cache.
+ */
+class AQSIS_TEX_SHARE CqCachedTile : boost::noncopyable
+{
+	public:
+		virtual ~CqCachedTile() {}
+	protected:
+		CqCachedTile();
+	private:
+		friend class CqTileCache;
+		friend class CqTileSlots;
+		friend void intrusive_ptr_add_ref(const CqCachedTile* tile);
+		friend void intrusive_ptr_release(const CqCachedTile* tile);
+
+		mutable boost::detail::atomic_count m_refCount;
+		/// Memory used by the tile, as given to the cache on insertion.
+		std::size_t m_bytes;
+		/// Slot index of the tile in its table.
+		TqInt m_index;
+		/// Table holding the tile.
+		CqTileSlots* m_owner;
+		/// Neighbours in the cache usage list; m_prev is more recently used.
+		CqCachedTile* m_prev;
+		CqCachedTile* m_next;
+};
+
+//------------------------------------------------------------------------------
+/** \brief A table of tiles belonging to a single tiled array.
+ *
+ * The table holds the only long-lived reference to each of its tiles.  All
+ * access goes through the owning cache, which may empty any unpinned slot
+ * when it needs to free memory.
+ */
+class AQSIS_TEX_SHARE CqTileSlots : boost::noncopyable
+{
+	public:
+		/** \brief Create a table with the given number of empty slots.
+		 *
+		 * \param cache - the cache which manages the tiles.
+		 * \param numSlots - number of slots.
+		 */
+		CqTileSlots(CqTileCache& cache, TqInt numSlots);
+		/// Remove all the tiles in the table from the cache.
+		~CqTileSlots();
+
+		/** \brief Look up the tile in a slot and mark it as recently used.
+		 *
+		 * \return The tile, or null if the slot is empty.
+		 */
+		boost::intrusive_ptr<CqCachedTile> find(TqInt index);
+		/** \brief Put a newly loaded tile into a slot.
+		 *
+		 * If another thread filled the slot in the meantime, the existing
+		 * tile is kept and returned instead.  Other tiles may be evicted to
+		 * keep the cache within its memory limit.
+		 *
+		 * \param index - slot index
+		 * \param tile - the new tile
+		 * \param bytes - memory used by the tile
+		 * \return The tile now held in the slot.
+		 */
+		boost::intrusive_ptr<CqCachedTile> insert(TqInt index,
+				const boost::intrusive_ptr<CqCachedTile>& tile,
+				std::size_t bytes);
+	private:
+		friend class CqTileCache;
+		CqTileCache& m_cache;
+		std::vector<boost::intrusive_ptr<CqCachedTile> > m_slots;
+};
+
+//------------------------------------------------------------------------------
+/** \brief A memory bounded cache of texture tiles.
+ *
+ * Tiles from all tiled arrays are kept in a single least recently used list.
+ * When the memory used by the tiles exceeds the limit, unpinned tiles are
+ * evicted from the cold end of the list.  Evicted tiles are simply reloaded
+ * from file when next needed.
+ *
+ * The cache also limits the number of texture files which hold an open
+ * operating system handle.  Files which can release their handles register
+ * themselves with fileOpened(), and are asked to close with
+ * IqTiledTexInputFile::closeHandle() when too many are open.
+ *
+ * All methods are safe to call concurrently from several threads.
+ */
+class AQSIS_TEX_SHARE CqTileCache : boost::noncopyable
+{
+	public:
+		/// Cache usage statistics
+		struct SqStats
+		{
+			TqUlong hits;			///< Tile lookups satisfied from the cache.
+			TqUlong misses;			///< Tile lookups which loaded from file.
+			TqUlong evictions;		///< Tiles evicted to free memory.
+			std::size_t bytesUsed;	///< Memory currently used by tiles.
+			std::size_t peakBytes;	///< Peak memory used by tiles.
+			TqInt openFiles;		///< Files currently holding a handle.
+			TqUlong fileCloses;		///< File handles closed by the limit.
+		};
+
+		/// Default memory limit for texture tiles in bytes.
+		static const std::size_t defaultMemoryLimit;
+		/// Default limit on open texture file handles.
+		static const TqInt defaultMaxOpenFiles;
+
+		/** \brief Create an empty cache.
+		 *
+		 * \param memoryLimit - memory limit in bytes; zero means no limit.
+		 * \param maxOpenFiles - open file handle limit; zero means no limit.
+		 */
+		CqTileCache(std::size_t memoryLimit, TqInt maxOpenFiles);
+
+		/// Get the cache shared by all tiled texture arrays.
+		static CqTileCache& instance();
+
+		/** \brief Set the memory limit in bytes, evicting tiles if necessary.
+		 *
+		 * Zero means no limit.  The limit may be exceeded when every tile is
+		 * pinned.
+		 */
+		void setMemoryLimit(std::size_t bytes);
+		/// Get the memory limit in bytes.
+		std::size_t memoryLimit() const;
+		/// Set the maximum number of open file handles (zero means no limit).
+		void setMaxOpenFiles(TqInt maxFiles);
+
+		/// Get a snapshot of the usage statistics.
+		SqStats stats() const;
+		/// Reset the hit, miss, eviction and close counts and the peak memory.
+		void resetStats();
+
+		//--------------------------------------------------
+		/// \name Open file handle management
+		//@{
+		/** \brief Register a file which has just opened its handle.
+		 *
+		 * If this takes the number of open files over the limit, the least
+		 * recently used files are asked to close their handles.  Files which
+		 * are busy reading are skipped.
+		 */
+		void fileOpened(const IqTiledTexInputFile* file);
+		/// Mark a registered file as recently used.
+		void fileUsed(const IqTiledTexInputFile* file);
+		/// Unregister a file, which must be done before it is destroyed.
+		void fileClosed(const IqTiledTexInputFile* file);
+
+		/** \brief Lock serialising reads from a texture file.
+		 *
+		 * Texture files are not safe for concurrent reads, so tiled arrays
+		 * hold this lock while reading a tile.  It's also held while the cache
+		 * closes a file's handle.
+		 */
+		class AQSIS_TEX_SHARE CqFileLock : boost::noncopyable
+		{
+			public:
+				CqFileLock(const IqTiledTexInputFile* file);
+				~CqFileLock();
+			private:
+#				ifdef ENABLE_THREADING
+				boost::mutex& m_mutex;
+#				endif
+		};
+		//@}
+
+	private:
+		friend class CqTileSlots;
+
+		void link(CqCachedTile* tile);
+		void unlink(CqCachedTile* tile);
+		/// Evict tiles until under the memory limit; caller holds m_mutex.
+		void evict(std::vector<boost::intrusive_ptr<CqCachedTile> >& evicted);
+		void closeExcessFiles();
+
+		/// Most and least recently used tiles.
+		CqCachedTile* m_head;
+		CqCachedTile* m_tail;
+		std::size_t m_memoryLimit;
+		SqStats m_stats;
+		/// Files holding open handles, most recently used first.
+		std::vector<const IqTiledTexInputFile*> m_openFiles;
+		TqInt m_maxOpenFiles;
+		TqUlong m_fileCloses;
+#		ifdef ENABLE_THREADING
+		/// Protects the tile list, all slot tables and the statistics.
+		mutable boost::mutex m_mutex;
+		/// Protects the open file list and close count.
+		mutable boost::mutex m_fileMutex;
+#		endif
+};
+
+
+//==============================================================================
+// Implementation details
+//==============================================================================
+inline CqCachedTile::CqCachedTile()
+	: m_refCount(0),
+	m_bytes(0),
+	m_index(-1),
+	m_owner(0),
+	m_prev(0),
+	m_next(0)
+{ }
+
+inline void intrusive_ptr_add_ref(const CqCachedTile* tile)
+{
+	++tile->m_refCount;
+}
+
+inline void intrusive_ptr_release(const CqCachedTile* tile)
+{
+	if(--tile->m_refCount == 0)
+		delete tile;
+}
+
+} // namespace Aqsis
+
+#endif // TILECACHE_H_INCLUDED
@@ -48,6 +48,7 @@
 
 namespace Aqsis {
 
+class CqDeepShadowMap;
 class IqTiledTexInputFile;
 
 //------------------------------------------------------------------------------
@@ -93,6 +94,13 @@ class AQSIS_TEX_SHARE IqShadowSampler
 		static boost::shared_ptr<IqShadowSampler> create(
 				const boost::shared_ptr<IqTiledTexInputFile>& file,
 				const CqMatrix& camToWorld);
+		/** \brief Create a sampler for a deep shadow map.
+		 *
+		 * \param map - deep shadow map which the sampler should use.
+		 */
+		static boost::shared_ptr<IqShadowSampler> create(
+				const boost::shared_ptr<CqDeepShadowMap>& map,
+				const CqMatrix& camToWorld);
 		/** \brief Create a dummy shadow texture sampler.
 		 *
 		 * Dummy samplers are useful when a texture file cannot be found but
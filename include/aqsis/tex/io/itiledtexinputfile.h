@@ -106,6 +106,16 @@ class AQSIS_TEX_SHARE IqTiledTexInputFile
 		virtual SqTileInfo tileInfo() const = 0;
 		//@}
 
+		/** \brief Release the underlying operating system file handle.
+		 *
+		 * Files which support this reopen the handle as needed when reading
+		 * the next tile.  The caller must hold the CqTileCache::CqFileLock for
+		 * the file.
+		 *
+		 * \return true if the handle was closed.
+		 */
+		virtual bool closeHandle() const { return false; }
+
 		//--------------------------------------------------
 		/// \name Access to information about sub-images.
 		//@{
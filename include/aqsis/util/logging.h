@@ -43,6 +43,9 @@ AQSIS_UTIL_SHARE std::ostream& notice(std::ostream&);
 AQSIS_UTIL_SHARE std::ostream& info(std::ostream&);
 AQSIS_UTIL_SHARE std::ostream& debug(std::ostream&);
 
+/// Returns the priority set on a stream by the last of the manipulators above
+AQSIS_UTIL_SHARE long& log_level(std::ostream&);
+
 } // namespace Aqsis
 
 #endif //	___logging_Loaded___
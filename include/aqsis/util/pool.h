@@ -20,7 +20,8 @@
 
 /** \file
 		\brief A simple, efficient object pool based on code from Stroustrups
-		"The C++ Programming Language - Third Edition"
+		"The C++ Programming Language - Third Edition", extended to keep a
+		separate set of chunks for each rendering thread.
 */
 
 //? Is .h included already?
@@ -29,58 +30,367 @@
 
 #include	<aqsis/aqsis.h>
 
+#include	<algorithm>
+#include	<vector>
+
+#ifdef	ENABLE_THREADING
+#	include	<boost/thread/mutex.hpp>
+#	include	<boost/thread/tss.hpp>
+#endif
+
 namespace Aqsis {
 
+//-----------------------------------------------------------------------
+/** \brief Registry of all object pools, so they can be trimmed together.
+ *
+ * Pools are expected to be static objects; they register themselves on
+ * construction, before any threads are started.
+ */
+class CqObjectPoolBase
+{
+	public:
+		/** \brief Return unused memory held by the calling thread.
+		 *
+		 * Any chunk of a pool in which all objects have been freed is given
+		 * back to the system, except for one chunk per pool which is kept to
+		 * avoid thrashing.  This is intended to be called by each rendering
+		 * thread whenever it retires a bucket.
+		 */
+		static void trimAll()
+		{
+			std::vector<CqObjectPoolBase*>& pools = registry();
+			for(std::vector<CqObjectPoolBase*>::iterator i = pools.begin(); i != pools.end(); ++i)
+				(*i)->trim();
+		}
+		/** \brief Sum the chunk counters of all registered pools.
+		 *
+		 * \param allocated - number of chunks allocated from the system.
+		 * \param recycled - number of chunks given back to the system by
+		 *                   trimAll().
+		 */
+		static void chunkCounts(TqInt& allocated, TqInt& recycled)
+		{
+			allocated = 0;
+			recycled = 0;
+			std::vector<CqObjectPoolBase*>& pools = registry();
+			for(std::vector<CqObjectPoolBase*>::iterator i = pools.begin(); i != pools.end(); ++i)
+			{
+				TqInt a = 0, r = 0;
+				(*i)->counts(a, r);
+				allocated += a;
+				recycled += r;
+			}
+		}
+
+	protected:
+		CqObjectPoolBase()
+		{
+			registry().push_back(this);
+		}
+		virtual ~CqObjectPoolBase()
+		{
+			std::vector<CqObjectPoolBase*>& pools = registry();
+			pools.erase(std::remove(pools.begin(), pools.end(), this), pools.end());
+		}
+
+		/// Trim the calling thread's chunks.
+		virtual void trim() = 0;
+		/// Get the chunk counters summed over all threads.
+		virtual void counts(TqInt& allocated, TqInt& recycled) = 0;
+
+	private:
+		static std::vector<CqObjectPoolBase*>& registry()
+		{
+			static std::vector<CqObjectPoolBase*> pools;
+			return pools;
+		}
+};
+
+
+//-----------------------------------------------------------------------
+/** \brief Pool allocator for fixed size objects.
+ *
+ * Objects are carved out of chunks of CS kilobytes.  Each thread allocates
+ * from its own set of chunks without locking.  An object may be freed by any
+ * thread: it is returned directly to the free list when freed by the thread
+ * which owns its chunk, and otherwise queued under a lock for the owner to
+ * collect.  When a thread exits its chunks are kept, and are adopted by the
+ * next thread which needs a pool.
+ */
 template <class T, TqInt CS=8>
-class /*AQSIS_UTIL_SHARE*/ CqObjectPool
+class /*AQSIS_UTIL_SHARE*/ CqObjectPool : public CqObjectPoolBase
 {
 		struct SqLink
 		{
 			SqLink* m_next;
 		};
+		/// Union of the types with the strictest alignment requirements.
+		union SqMaxAlign
+		{
+			long double m_longDouble;
+			double m_double;
+			void* m_pointer;
+			long m_long;
+		};
+		struct SqAlignTest
+		{
+			char m_char;
+			SqMaxAlign m_align;
+		};
+		/// Alignment which suits any object.
+		enum { maxAlign = sizeof(SqAlignTest) - sizeof(SqMaxAlign) };
+		/// Round a size up to a multiple of maxAlign.
+		static unsigned int alignUp(unsigned int size)
+		{
+			return (size + maxAlign - 1)/maxAlign*maxAlign;
+		}
+		struct SqThreadPool;
 		struct SqChunk
 		{
-			enum { size = CS*1024-16, };
+			enum { size = CS*1024-32, };
 			SqChunk* m_next;
-			char m_mem[size];
+			SqThreadPool* m_owner;	///< Pool which allocates from this chunk.
+			TqInt m_live;			///< Number of objects currently allocated.
+			bool m_release;			///< Chunk is about to be given back.
+			union
+			{
+				char m_mem[size];
+				SqMaxAlign m_align;	///< Aligns m_mem for any object.
+			};
+		};
+		/** Each object slot is preceded by a pointer to its chunk, so that it
+		 * can be returned to the right free list.  The header is padded to
+		 * maxAlign, so that the objects following it are aligned.
+		 */
+		struct SqSlotHeader
+		{
+			SqChunk* m_chunk;
+		};
+		/// The chunks and free list belonging to a single thread.
+		struct SqThreadPool
+		{
+			SqChunk* m_chunks;
+			SqLink* m_head;
+			TqInt m_numChunks;
+			TqInt m_chunksAllocated;
+			TqInt m_chunksRecycled;
+#			ifdef ENABLE_THREADING
+			CqObjectPool* m_parent;
+			bool m_inUse;			///< Pool is attached to a live thread.
+			boost::mutex m_remoteMutex;
+			SqLink* m_remoteHead;	///< Objects freed by other threads.
+#			endif
+
+			SqThreadPool()
+				: m_chunks(0),
+				m_head(0),
+				m_numChunks(0),
+				m_chunksAllocated(0),
+				m_chunksRecycled(0)
+#			ifdef ENABLE_THREADING
+				, m_parent(0),
+				m_inUse(true),
+				m_remoteMutex(),
+				m_remoteHead(0)
+#			endif
+			{ }
+			~SqThreadPool() // free all chunks
+			{
+				SqChunk* n = m_chunks;
+				while(n)
+				{
+					SqChunk* p = n;
+					n = n->m_next;
+					delete(p);
+				}
+			}
 		};
-		SqChunk* m_chunks;
 
 		const unsigned int m_esize;
-		SqLink* m_head;
+#		ifdef ENABLE_THREADING
+		/// All pools ever created, protected by m_poolsMutex.
+		std::vector<SqThreadPool*> m_pools;
+		boost::mutex m_poolsMutex;
+		boost::thread_specific_ptr<SqThreadPool> m_localPool;
+#		else
+		SqThreadPool m_pool;
+#		endif
 
-		void grow()	// Allocate new 'chunk', organize it as a linked list of elements of size 'm_esize'
+		static SqChunk*& chunkOf(void* b)
+		{
+			return (reinterpret_cast<SqSlotHeader*>(b) - 1)->m_chunk;
+		}
+
+		void grow(SqThreadPool& pool)	// Allocate new 'chunk', organize it as a linked list of elements of size 'm_esize'
 		{
 			SqChunk* n = new SqChunk;
-			n->m_next = m_chunks;
-			m_chunks = n;
+			n->m_next = pool.m_chunks;
+			n->m_owner = &pool;
+			n->m_live = 0;
+			n->m_release = false;
+			pool.m_chunks = n;
+			++pool.m_numChunks;
+			++pool.m_chunksAllocated;
 
 			const int nelem = SqChunk::size/m_esize;
-			char* start = n->m_mem;
+			char* start = n->m_mem + alignUp(sizeof(SqSlotHeader));
 			char* last = &start[(nelem-1)*m_esize];
-			for (char* p = start; p<last; p+=m_esize)	// assume sizeof(SqLink)<=m_esize
+			for (char* p = start; p<=last; p+=m_esize)	// assume sizeof(SqLink)<=m_esize
+			{
+				chunkOf(p) = n;
 				reinterpret_cast<SqLink*>(p)->m_next = reinterpret_cast<SqLink*>(p+m_esize);
-			reinterpret_cast<SqLink*>(last)->m_next = 0;
-			m_head = reinterpret_cast<SqLink*>(start);
+			}
+			reinterpret_cast<SqLink*>(last)->m_next = pool.m_head;
+			pool.m_head = reinterpret_cast<SqLink*>(start);
+		}
+
+		/// Push an object onto the free list of the pool which owns it.
+		static void localFree(SqThreadPool& pool, SqLink* p)
+		{
+			--chunkOf(p)->m_live;
+			p->m_next = pool.m_head;
+			pool.m_head = p;
+		}
+
+#		ifdef ENABLE_THREADING
+		/// Move objects freed by other threads onto the local free list.
+		static void collectRemote(SqThreadPool& pool)
+		{
+			SqLink* p = 0;
+			{
+				boost::mutex::scoped_lock lock(pool.m_remoteMutex);
+				p = pool.m_remoteHead;
+				pool.m_remoteHead = 0;
+			}
+			while(p)
+			{
+				SqLink* next = p->m_next;
+				localFree(pool, p);
+				p = next;
+			}
+		}
+
+		/// Called on thread exit to make the pool available for adoption.
+		static void detachPool(SqThreadPool* pool)
+		{
+			boost::mutex::scoped_lock lock(pool->m_parent->m_poolsMutex);
+			pool->m_inUse = false;
+		}
+#		endif
+
+		/// Get the calling thread's pool, creating or adopting one if needed.
+		SqThreadPool& localPool()
+		{
+#			ifdef ENABLE_THREADING
+			SqThreadPool* pool = m_localPool.get();
+			if(!pool)
+			{
+				boost::mutex::scoped_lock lock(m_poolsMutex);
+				for(typename std::vector<SqThreadPool*>::iterator i = m_pools.begin();
+						i != m_pools.end() && !pool; ++i)
+				{
+					if(!(*i)->m_inUse)
+						pool = *i;
+				}
+				if(!pool)
+				{
+					pool = new SqThreadPool();
+					pool->m_parent = this;
+					m_pools.push_back(pool);
+				}
+				pool->m_inUse = true;
+				m_localPool.reset(pool);
+			}
+			return *pool;
+#			else
+			return m_pool;
+#			endif
+		}
+
+		virtual void trim()
+		{
+			SqThreadPool& pool = localPool();
+#			ifdef ENABLE_THREADING
+			collectRemote(pool);
+#			endif
+			// Find empty chunks, keeping the first one for reuse.
+			bool keptOne = false;
+			bool anyReleased = false;
+			for(SqChunk* c = pool.m_chunks; c; c = c->m_next)
+			{
+				if(c->m_live == 0)
+				{
+					c->m_release = keptOne;
+					anyReleased |= keptOne;
+					keptOne = true;
+				}
+			}
+			if(!anyReleased)
+				return;
+			// Remove objects in released chunks from the free list...
+			SqLink** link = &pool.m_head;
+			while(*link)
+			{
+				if(chunkOf(*link)->m_release)
+					*link = (*link)->m_next;
+				else
+					link = &(*link)->m_next;
+			}
+			// ...then give the chunks back.
+			SqChunk** chunk = &pool.m_chunks;
+			while(*chunk)
+			{
+				if((*chunk)->m_release)
+				{
+					SqChunk* c = *chunk;
+					*chunk = c->m_next;
+					delete c;
+					--pool.m_numChunks;
+					++pool.m_chunksRecycled;
+				}
+				else
+					chunk = &(*chunk)->m_next;
+			}
+		}
+
+		virtual void counts(TqInt& allocated, TqInt& recycled)
+		{
+#			ifdef ENABLE_THREADING
+			boost::mutex::scoped_lock lock(m_poolsMutex);
+			for(typename std::vector<SqThreadPool*>::iterator i = m_pools.begin();
+					i != m_pools.end(); ++i)
+			{
+				allocated += (*i)->m_chunksAllocated;
+				recycled += (*i)->m_chunksRecycled;
+			}
+#			else
+			allocated += m_pool.m_chunksAllocated;
+			recycled += m_pool.m_chunksRecycled;
+#			endif
 		}
 
 	public:
 		CqObjectPool()
-				: m_esize(sizeof(T)<sizeof(SqLink*)?sizeof(SqLink*):sizeof(T))
+				: m_esize(alignUp(sizeof(SqSlotHeader))
+						+ alignUp(sizeof(T) < sizeof(SqLink) ? sizeof(SqLink) : sizeof(T)))
+#				ifdef ENABLE_THREADING
+				, m_pools(),
+				m_poolsMutex(),
+				m_localPool(&detachPool)
+#				endif
 		{
-			m_head = 0;
-			m_chunks = 0;
 		}
 
 		~CqObjectPool() // free all chunks
 		{
-			SqChunk* n = m_chunks;
-			while(n)
-			{
-				SqChunk* p = n;
-				n = n->m_next;
-				delete(p);
-			}
+#			ifdef ENABLE_THREADING
+			// Don't run the thread exit handler for the calling thread; its
+			// pool is deleted below along with the rest.
+			m_localPool.release();
+			for(typename std::vector<SqThreadPool*>::iterator i = m_pools.begin();
+					i != m_pools.end(); ++i)
+				delete *i;
+#			endif
 		}
 
 		// The following is a workaround for a bug which arises when using
@@ -107,18 +417,33 @@ class /*AQSIS_UTIL_SHARE*/ CqObjectPool
 #		endif
 		void* alloc()
 		{
-			if (m_head==0)
-				grow();
-			SqLink* p = m_head;
-			m_head = p->m_next;
+			SqThreadPool& pool = localPool();
+#			ifdef ENABLE_THREADING
+			if (pool.m_head==0)
+				collectRemote(pool);
+#			endif
+			if (pool.m_head==0)
+				grow(pool);
+			SqLink* p = pool.m_head;
+			pool.m_head = p->m_next;
+			++chunkOf(p)->m_live;
 			return(p);
 		}
 
 		void free(void* b)
 		{
 			SqLink* p = static_cast<SqLink*>(b);
-			p->m_next = m_head;
-			m_head = p;
+			SqThreadPool& owner = *chunkOf(p)->m_owner;
+#			ifdef ENABLE_THREADING
+			if(&owner != m_localPool.get())
+			{
+				boost::mutex::scoped_lock lock(owner.m_remoteMutex);
+				p->m_next = owner.m_remoteHead;
+				owner.m_remoteHead = p;
+				return;
+			}
+#			endif
+			localFree(owner, p);
 		}
 
 };
@@ -27,12 +27,17 @@
 #include	<aqsis/aqsis.h>
 
 #include	<fstream>
+#include	<map>
 #include	<stdarg.h>
 #include	<math.h>
 #include	<stdio.h>
 #include    <stdlib.h>
 
+#include	<boost/bind.hpp>
 #include	<boost/filesystem/fstream.hpp>
+#include	<boost/functional/hash.hpp>
+#include	<boost/noncopyable.hpp>
+#include	<boost/scoped_ptr.hpp>
 
 #include	"imagebuffer.h"
 #include	"lights.h"
@@ -61,6 +66,7 @@
 #include	<aqsis/util/logging_streambufs.h>
 #include	<aqsis/util/smartptr.h>
 #include	<aqsis/tex/maketexture.h>
+#include	<aqsis/tex/buffers/tilecache.h>
 #include	"stats.h"
 #include	<aqsis/math/random.h>
 #include	"../../riutil/errorhandlerimpl.h"
@@ -96,10 +102,139 @@ extern "C" __declspec(dllimport) void report_refcounts();
 
 namespace Aqsis {
 
+class CqInstancePrimvars;
 static RtBoolean ProcessPrimitiveVariables(CqSurface * pSurface,
-										   const Ri::ParamList& pList);
+										   const Ri::ParamList& pList,
+										   CqInstancePrimvars& instancePrimvars);
 RtVoid	CreateGPrim( const boost::shared_ptr<CqSurface>& pSurface );
 
+/// Find an archive to be prefetched, returning an empty string on failure.
+static std::string findArchiveFile(const char* name)
+{
+	return native(QGetRenderContext()->poptCurrent()->findRiFileNothrow(
+				name, "archive"));
+}
+
+/// Number of archives and procedurals kept in the archive cache between
+/// worlds, unless set by Option "limits" "archivecache".
+static const TqInt defaultArchiveCacheEntries = 1024;
+
+
+//------------------------------------------------------------------------------
+/// Primitive variables shared between the surfaces of object instances.
+///
+/// Each replay of an object instance passes the same parameter arrays, so a
+/// primitive variable converted for the first instance can share its values
+/// with the same variable of every later one (see CqParameter::CloneShared).
+/// Variables are found by the address of their values, with a hash of the
+/// values to catch an address reused after an object is redefined.  String
+/// variables aren't shared, since their values are only pointers.
+///
+/// The shared values are copied by any surface which modifies them, so
+/// variables transformed into camera space still end up with their own
+/// copy.
+class CqInstancePrimvars : boost::noncopyable
+{
+	public:
+		CqInstancePrimvars()
+			: m_params(),
+			m_replaying(0)
+		{ }
+
+		/// Note the start (true) or end (false) of an instance replay.
+		void replaying(bool start)
+		{
+			m_replaying += start ? 1 : -1;
+		}
+
+		/** \brief Find a variable converted from the same values.
+		 *
+		 * \return a new parameter sharing the values of the earlier one, or
+		 * null if the values haven't been seen in an instance.
+		 */
+		CqParameter* find(const Ri::Param& param, TqInt cValues) const
+		{
+			if(!shareable(param))
+				return 0;
+			TqParamMap::const_iterator i = m_params.find(SqKey(param, cValues));
+			if(i == m_params.end() || i->second.hash != hashValues(param))
+				return 0;
+			return i->second.param->CloneShared();
+		}
+
+		/// Remember a newly converted variable, so later instances can share it.
+		void add(const Ri::Param& param, TqInt cValues, const CqParameter& newParam)
+		{
+			if(!shareable(param))
+				return;
+			SqEntry& entry = m_params[SqKey(param, cValues)];
+			entry.hash = hashValues(param);
+			entry.param.reset(newParam.CloneShared());
+		}
+
+		/// Forget all variables, releasing any values no longer in use.
+		void clear()
+		{
+			m_params.clear();
+		}
+
+	private:
+		struct SqKey
+		{
+			const void* data;
+			std::string name;
+			Ri::TypeSpec spec;
+			TqInt cValues;
+
+			SqKey(const Ri::Param& param, TqInt cValues)
+				: data(param.data()),
+				name(param.name()),
+				spec(param.spec()),
+				cValues(cValues)
+			{ }
+			bool operator<(const SqKey& rhs) const
+			{
+				if(data != rhs.data)
+					return data < rhs.data;
+				if(cValues != rhs.cValues)
+					return cValues < rhs.cValues;
+				if(spec.iclass != rhs.spec.iclass)
+					return spec.iclass < rhs.spec.iclass;
+				if(spec.type != rhs.spec.type)
+					return spec.type < rhs.spec.type;
+				if(spec.arraySize != rhs.spec.arraySize)
+					return spec.arraySize < rhs.spec.arraySize;
+				return name < rhs.name;
+			}
+		};
+		struct SqEntry
+		{
+			std::size_t hash;
+			boost::shared_ptr<CqParameter> param;
+		};
+		typedef std::map<SqKey, SqEntry> TqParamMap;
+
+		bool shareable(const Ri::Param& param) const
+		{
+			Ri::TypeSpec::Type type = param.spec().storageType();
+			return m_replaying > 0
+				&& (type == Ri::TypeSpec::Float || type == Ri::TypeSpec::Integer);
+		}
+		static std::size_t hashValues(const Ri::Param& param)
+		{
+			if(param.spec().storageType() == Ri::TypeSpec::Float)
+			{
+				Ri::FloatArray values = param.floatData();
+				return boost::hash_range(values.begin(), values.begin() + values.size());
+			}
+			Ri::IntArray values = param.intData();
+			return boost::hash_range(values.begin(), values.begin() + values.size());
+		}
+
+		TqParamMap m_params;
+		TqInt m_replaying;
+};
+
 
 //------------------------------------------------------------------------------
 /// API for the core renderer
@@ -108,9 +243,32 @@ class RiCxxCore : public Ri::Renderer
 	public:
 		RiCxxCore(Ri::RendererServices& apiServices)
 			: m_apiServices(apiServices),
-			m_archiveCallback(0)
+			m_archiveCallback(0),
+			m_archiveCache(createRibArchiveCache(&findArchiveFile)),
+			m_subdivTopologyCache(),
+			m_instancePrimvars()
 		{ }
 
+		/// Cache of archives and procedurals, kept between frames.
+		RibArchiveCache& archiveCache()
+		{
+			return *m_archiveCache;
+		}
+
+		/// Start parsing an archive on a prefetch thread, if it can be found.
+		void prefetchArchive(const char* name)
+		{
+			std::string fileName = findArchiveFile(name);
+			if(!fileName.empty())
+				m_archiveCache->prefetch(fileName.c_str(), m_apiServices);
+		}
+
+		/// Note the start (true) or end (false) of an object instance replay.
+		void replayingInstance(bool start)
+		{
+			m_instancePrimvars.replaying(start);
+		}
+
         virtual RtVoid ArchiveRecord(RtConstToken type, const char* string)
 		{
 			if(m_archiveCallback)
@@ -318,6 +476,13 @@ class RiCxxCore : public Ri::Renderer
 
 		Ri::RendererServices& m_apiServices;
 		RtArchiveCallback m_archiveCallback;
+		/// Archive files which have been read more than once, and the calls
+		/// made by procedurals when the procedural cache is enabled.
+		boost::scoped_ptr<RibArchiveCache> m_archiveCache;
+		/// Topology of subdivision meshes, kept between frames.
+		CqSubdivisionTopologyCache m_subdivTopologyCache;
+		/// Primitive variables shared between object instances in this world.
+		CqInstancePrimvars m_instancePrimvars;
 };
 
 //------------------------------------------------------------------------------
@@ -334,6 +499,71 @@ void setShaderArguments(const boost::shared_ptr<IqShader>& pShader,
 	}
 }
 
+//------------------------------------------------------------------------------
+/** \brief Build a key identifying a shader instance.
+ *
+ * Instances with the same shader, arguments and transformation, declared on
+ * the same side of WorldBegin, behave identically.
+ */
+static std::string shaderInstanceKey(RtConstToken name, EqShaderType type,
+									 const Ri::ParamList& pList)
+{
+	std::ostringstream key;
+	key << name << '\0' << type << '\0'
+		<< QGetRenderContext()->ptransCurrent().get() << '\0'
+		<< QGetRenderContext()->IsWorldBegin();
+	for(size_t i = 0; i < pList.size(); ++i)
+	{
+		const Ri::Param& param = pList[i];
+		const Ri::TypeSpec& spec = param.spec();
+		key << '\0' << param.name() << '\0' << spec.iclass << ' ' << spec.type
+			<< ' ' << spec.arraySize << ' ' << param.size() << '\0';
+		if(spec.storageType() == Ri::TypeSpec::String)
+		{
+			Ri::StringArray strings = param.stringData();
+			for(size_t j = 0; j < strings.size(); ++j)
+				key << strings[j] << '\0';
+		}
+		else
+		{
+			std::size_t elemSize = spec.storageType() == Ri::TypeSpec::Pointer
+				? sizeof(void*) : sizeof(RtFloat);
+			key.write(static_cast<const char*>(param.data()),
+					  param.size()*elemSize);
+		}
+	}
+	return key.str();
+}
+
+//------------------------------------------------------------------------------
+/** \brief Create a shader instance with the given arguments.
+ *
+ * Scenes often give many primitives their own copy of the same shader with
+ * the same arguments, so identical instances are shared.  This saves running
+ * the initialisation code and storing the variables for each copy.
+ */
+static boost::shared_ptr<IqShader> createShaderInstance(RtConstToken name,
+		EqShaderType type, const Ri::ParamList& pList)
+{
+	std::string key = shaderInstanceKey(name, type, pList);
+	boost::shared_ptr<IqShader> pShader = QGetRenderContext()->findSharedShader(key);
+	if(pShader)
+		return pShader;
+	pShader = QGetRenderContext()->CreateShader( name, type );
+	if ( pShader )
+	{
+		pShader->SetTransform( QGetRenderContext() ->ptransCurrent() );
+		// Execute the intiialisation code here, as we now have our shader context complete.
+		pShader->PrepareDefArgs();
+		setShaderArguments(pShader, pList);
+		const TqInt* pMultipass = QGetRenderContext()->poptCurrent()->GetIntegerOption("Render", "multipass");
+		if(pMultipass && !pMultipass[0])
+			pShader->PrepareShaderForUse();
+		QGetRenderContext()->addSharedShader(key, pShader);
+	}
+	return pShader;
+}
+
 
 //----------------------------------------------------------------------
 // CreateGPrim
@@ -355,6 +585,8 @@ RtVoid RiCxxCore::Declare(RtConstString name, RtConstString declaration)
 		QGetRenderContext()->tokenDict().declare(name, declaration);
 	else // declaration is allowed to be RI_NULL
 		QGetRenderContext()->tokenDict().declare(name, Ri::TypeSpec());
+	// Archives parsed in the background need to see it too.
+	m_archiveCache->declare(name, declaration);
 }
 
 
@@ -624,6 +856,30 @@ RtVoid RiCxxCore::WorldBegin()
 	CqMatrix currToWorldMat;
 	QGetRenderContext()->matSpaceToSpace("current", "world", NULL, NULL, 0, currToWorldMat);
 	QGetRenderContext()->textureCache().setCurrToWorldMatrix(currToWorldMat);
+	// Apply the texture memory limits, which are given in kB.
+	const TqInt* textureMemory = QGetRenderContext()->poptCurrent()->GetIntegerOption( "limits", "texturememory" );
+	CqTileCache::instance().setMemoryLimit(textureMemory
+			? static_cast<std::size_t>(std::max(textureMemory[0], 0))*1024
+			: CqTileCache::defaultMemoryLimit);
+	const TqInt* textureFiles = QGetRenderContext()->poptCurrent()->GetIntegerOption( "limits", "texturefiles" );
+	CqTileCache::instance().setMaxOpenFiles(textureFiles ? textureFiles[0]
+			: CqTileCache::defaultMaxOpenFiles);
+	// Start the threads for parsing archives ahead of time.
+	const TqInt* archiveThreads = QGetRenderContext()->poptCurrent()->GetIntegerOption( "limits", "archivethreads" );
+	m_archiveCache->setPrefetchThreads(archiveThreads
+			? std::max(archiveThreads[0], 0) : 0);
+	// Set where the procedural cache keeps procedurals between renders.
+	const CqString* procCacheDir = QGetRenderContext()->poptCurrent()->GetStringOption( "limits", "proceduralcachedir" );
+	m_archiveCache->setProceduralCacheDir(procCacheDir
+			? procCacheDir[0].c_str() : "");
+	// Set the number of processes started for each RunProgram procedural.
+	const TqInt* runPrograms = QGetRenderContext()->poptCurrent()->GetIntegerOption( "limits", "runprograms" );
+	QGetRenderContext()->runPrograms().setMaxProcesses(runPrograms ? runPrograms[0] : 1);
+	// Apply the subdivision topology cache limit, which is given in kB.
+	const TqInt* subdivMemory = QGetRenderContext()->poptCurrent()->GetIntegerOption( "limits", "subdivmemory" );
+	m_subdivTopologyCache.setMemoryLimit(subdivMemory
+			? static_cast<std::size_t>(std::max(subdivMemory[0], 0))*1024
+			: CqSubdivisionTopologyCache::defaultMemoryLimit);
 
 	// Reset the current transformation to identity, this now represents the object-->world transform.
 	QGetRenderContext() ->ptransSetTime( CqMatrix() );
@@ -679,10 +935,6 @@ RtVoid RiCxxCore::WorldEnd()
 	if( NULL != poptGridSize )
 		QGetRenderContext() ->poptWriteCurrent()->GetFloatOptionWrite( "System", "SqrtGridSize" )[0] = sqrt( static_cast<float>(poptGridSize[0]) );
 
-	// Finalise the raytracer database now that all primitives are in.
-	if(QGetRenderContext()->pRaytracer())
-		QGetRenderContext()->pRaytracer()->Finalise();
-
 	// Render the world
 	try
 	{
@@ -697,9 +949,24 @@ RtVoid RiCxxCore::WorldEnd()
 	// Remove all cached textures.
 	QGetRenderContext()->textureCache().flush();
 
+	// Forget the RIB generated by RunProgram procedurals for this frame.
+	QGetRenderContext()->runPrograms().clearCache();
+
+	// Release the primitive variables shared between object instances.
+	m_instancePrimvars.clear();
+
+	// Discard the archives and procedurals which haven't been used lately.
+	const TqInt* archiveCacheEntries = QGetRenderContext()->poptCurrent()->GetIntegerOption( "limits", "archivecache" );
+	m_archiveCache->trim(archiveCacheEntries
+			? std::max(archiveCacheEntries[0], 0) : defaultArchiveCacheEntries);
+
 	// Clear out point cloud caches, etc.
 	clearShaderSystemCaches();
 
+	// Discard the raytracer database.
+	if(QGetRenderContext()->pRaytracer())
+		QGetRenderContext()->pRaytracer()->Initialise();
+
 	// Delete the world context
 	QGetRenderContext() ->EndWorldModeBlock();
 
@@ -1327,21 +1594,10 @@ RtVoid RiCxxCore::Illuminate(RtConstToken name, RtBoolean onoff)
 RtVoid RiCxxCore::Surface(RtConstToken name, const ParamList& pList)
 {
 	// Find the shader.
-	boost::shared_ptr<IqShader> pshadSurface = QGetRenderContext()->CreateShader( name, Type_Surface );
+	boost::shared_ptr<IqShader> pshadSurface = createShaderInstance( name, Type_Surface, pList );
 
 	if ( pshadSurface )
-	{
-		pshadSurface->SetTransform( QGetRenderContext() ->ptransCurrent() );
-		// Execute the intiialisation code here, as we now have our shader context complete.
-		pshadSurface->PrepareDefArgs();
-		setShaderArguments(pshadSurface, pList);
-
-		const TqInt* pMultipass = QGetRenderContext()->poptCurrent()->GetIntegerOption("Render", "multipass");
-		if(pMultipass && !pMultipass[0])
-			pshadSurface->PrepareShaderForUse();
-
 		QGetRenderContext() ->pattrWriteCurrent() ->SetpshadSurface( pshadSurface, QGetRenderContext() ->Time() );
-	}
 	QGetRenderContext() ->AdvanceTime();
 }
 
@@ -1352,18 +1608,7 @@ RtVoid RiCxxCore::Surface(RtConstToken name, const ParamList& pList)
 RtVoid RiCxxCore::Atmosphere(RtConstToken name, const ParamList& pList)
 {
 	// Find the shader.
-	boost::shared_ptr<IqShader> pshadAtmosphere = QGetRenderContext()->CreateShader( name, Type_Volume );
-
-	if ( pshadAtmosphere )
-	{
-		pshadAtmosphere->SetTransform( QGetRenderContext() ->ptransCurrent() );
-		// Execute the intiialisation code here, as we now have our shader context complete.
-		pshadAtmosphere->PrepareDefArgs();
-		setShaderArguments(pshadAtmosphere, pList);
-		const TqInt* pMultipass = QGetRenderContext()->poptCurrent()->GetIntegerOption("Render", "multipass");
-		if(pMultipass && !pMultipass[0])
-			pshadAtmosphere->PrepareShaderForUse();
-	}
+	boost::shared_ptr<IqShader> pshadAtmosphere = createShaderInstance( name, Type_Volume, pList );
 
 	QGetRenderContext() ->pattrWriteCurrent() ->SetpshadAtmosphere( pshadAtmosphere, QGetRenderContext() ->Time() );
 	QGetRenderContext() ->AdvanceTime();
@@ -1676,18 +1921,7 @@ RtVoid RiCxxCore::Skew(RtFloat angle, RtFloat dx1, RtFloat dy1, RtFloat dz1, RtF
 RtVoid RiCxxCore::Displacement(RtConstToken name, const ParamList& pList)
 {
 	// Find the shader.
-	boost::shared_ptr<IqShader> pshadDisplacement = QGetRenderContext() ->CreateShader( name, Type_Displacement );
-
-	if ( pshadDisplacement )
-	{
-		pshadDisplacement->SetTransform( QGetRenderContext() ->ptransCurrent() );
-		// Execute the intiialisation code here, as we now have our shader context complete.
-		pshadDisplacement->PrepareDefArgs();
-		setShaderArguments(pshadDisplacement, pList);
-		const TqInt* pMultipass = QGetRenderContext()->poptCurrent()->GetIntegerOption("Render", "multipass");
-		if(pMultipass && !pMultipass[0])
-			pshadDisplacement->PrepareShaderForUse();
-	}
+	boost::shared_ptr<IqShader> pshadDisplacement = createShaderInstance( name, Type_Displacement, pList );
 
 	QGetRenderContext() ->pattrWriteCurrent() ->SetpshadDisplacement( pshadDisplacement, QGetRenderContext() ->Time() );
 	QGetRenderContext() ->AdvanceTime();
@@ -1849,7 +2083,7 @@ RtVoid RiCxxCore::Polygon(const ParamList& pList)
 	boost::shared_ptr<CqSurfacePolygon> pSurface( new CqSurfacePolygon( nvertices ) );
 
 	// Process any specified primitive variables.
-	if ( ProcessPrimitiveVariables( pSurface.get(), pList ) )
+	if ( ProcessPrimitiveVariables( pSurface.get(), pList, m_instancePrimvars ) )
 	{
 		if ( !pSurface->CheckDegenerate() )
 		{
@@ -1897,7 +2131,7 @@ RtVoid RiCxxCore::GeneralPolygon(const IntArray& nverts, const ParamList& pList)
 	// Create a storage class for all the points.
 	boost::shared_ptr<CqPolygonPoints> pPointsClass( new CqPolygonPoints( cVerts, 1, cVerts ) );
 	// Process any specified primitive variables
-	if ( ProcessPrimitiveVariables( pPointsClass.get(), pList ) )
+	if ( ProcessPrimitiveVariables( pPointsClass.get(), pList, m_instancePrimvars ) )
 	{
 		pPointsClass->SetDefaultPrimitiveVariables( RI_FALSE );
 
@@ -2176,7 +2410,7 @@ RtVoid RiCxxCore::Points(const ParamList& pList)
 	boost::shared_ptr<CqPoints> pSurface;
 
 	// read in the parameter list
-	if ( ProcessPrimitiveVariables( pPointsClass.get(), pList ) )
+	if ( ProcessPrimitiveVariables( pPointsClass.get(), pList, m_instancePrimvars ) )
 	{
 		// Transform the points into camera space for processing,
 		// This needs to be done before initialising the KDTree as the tree must be formulated in 'current' (camera) space.
@@ -2257,7 +2491,7 @@ RtVoid RiCxxCore::Curves(RtConstToken type, const IntArray& nvertices, RtConstTo
 		boost::shared_ptr<CqCubicCurvesGroup> pSurface(
 				new CqCubicCurvesGroup( ncurves, const_cast<TqInt*>(nvertices.begin()), periodic ) );
 		// read in the parameter list
-		if ( ProcessPrimitiveVariables( pSurface.get(), pList ) )
+		if ( ProcessPrimitiveVariables( pSurface.get(), pList, m_instancePrimvars ) )
 		{
 			// set the default primitive variables
 			pSurface->SetDefaultPrimitiveVariables();
@@ -2280,7 +2514,7 @@ RtVoid RiCxxCore::Curves(RtConstToken type, const IntArray& nvertices, RtConstTo
 				new CqLinearCurvesGroup( ncurves, const_cast<TqInt*>(nvertices.begin()), periodic ) );
 
 		// read in the parameter list
-		if ( ProcessPrimitiveVariables( pSurface.get(), pList ) )
+		if ( ProcessPrimitiveVariables( pSurface.get(), pList, m_instancePrimvars ) )
 		{
 			// set the default primitive variables
 			pSurface->SetDefaultPrimitiveVariables();
@@ -2327,7 +2561,7 @@ RtVoid RiCxxCore::PointsPolygons(const IntArray& nverts, const IntArray& verts,
 	// Create a storage class for all the points.
 	boost::shared_ptr<CqPolygonPoints> pPointsClass( new CqPolygonPoints( cVerts, npolys, sumnVerts ) );
 	// Process any specified primitive variables
-	if ( ProcessPrimitiveVariables( pPointsClass.get(), pList ) )
+	if ( ProcessPrimitiveVariables( pPointsClass.get(), pList, m_instancePrimvars ) )
 	{
 		boost::shared_ptr<CqSurfacePointsPolygons> pPsPs(
 				new CqSurfacePointsPolygons(pPointsClass, npolys, const_cast<TqInt*>(nverts.begin()),
@@ -2390,7 +2624,7 @@ RtVoid RiCxxCore::PointsGeneralPolygons(const IntArray& nloops, const IntArray&
 	// Create a storage class for all the points.
 	boost::shared_ptr<CqPolygonPoints> pPointsClass( new CqPolygonPoints( cVerts, npolys, sumnVerts ) );
 	// Process any specified primitive variables
-	if ( ProcessPrimitiveVariables( pPointsClass.get(), pList ) )
+	if ( ProcessPrimitiveVariables( pPointsClass.get(), pList, m_instancePrimvars ) )
 	{
 		pPointsClass->SetDefaultPrimitiveVariables( RI_FALSE );
 
@@ -2629,7 +2863,7 @@ RtVoid RiCxxCore::Patch(RtConstToken type, const ParamList& pList)
 		// Create a surface patch
 		boost::shared_ptr<CqSurfacePatchBicubic> pSurface( new CqSurfacePatchBicubic() );
 		// Fill in primitive variables specified.
-		if ( ProcessPrimitiveVariables( pSurface.get(), pList ) )
+		if ( ProcessPrimitiveVariables( pSurface.get(), pList, m_instancePrimvars ) )
 		{
 			// Fill in default values for all primitive variables not explicitly specified.
 			pSurface->SetDefaultPrimitiveVariables();
@@ -2653,7 +2887,7 @@ RtVoid RiCxxCore::Patch(RtConstToken type, const ParamList& pList)
 		// Create a surface patch
 		boost::shared_ptr<CqSurfacePatchBilinear> pSurface( new CqSurfacePatchBilinear() );
 		// Fill in primitive variables specified.
-		if ( ProcessPrimitiveVariables( pSurface.get(), pList ) )
+		if ( ProcessPrimitiveVariables( pSurface.get(), pList, m_instancePrimvars ) )
 		{
 			// Fill in default values for all primitive variables not explicitly specified.
 			pSurface->SetDefaultPrimitiveVariables();
@@ -2694,7 +2928,7 @@ RtVoid RiCxxCore::PatchMesh(RtConstToken type, RtInt nu, RtConstToken uwrap, RtI
 
 		boost::shared_ptr<CqSurfacePatchMeshBicubic> pSurface( new CqSurfacePatchMeshBicubic( nu, nv, uPeriodic, vPeriodic ) );
 		// Fill in primitive variables specified.
-		if ( ProcessPrimitiveVariables( pSurface.get(), pList ) )
+		if ( ProcessPrimitiveVariables( pSurface.get(), pList, m_instancePrimvars ) )
 		{
 			// Fill in default values for all primitive variables not explicitly specified.
 			pSurface->SetDefaultPrimitiveVariables();
@@ -2718,7 +2952,7 @@ RtVoid RiCxxCore::PatchMesh(RtConstToken type, RtInt nu, RtConstToken uwrap, RtI
 
 		boost::shared_ptr<CqSurfacePatchMeshBilinear> pSurface( new CqSurfacePatchMeshBilinear( nu, nv, uPeriodic, vPeriodic ) );
 		// Fill in primitive variables specified.
-		if ( ProcessPrimitiveVariables( pSurface.get(), pList ) )
+		if ( ProcessPrimitiveVariables( pSurface.get(), pList, m_instancePrimvars ) )
 		{
 			// Fill in default values for all primitive variables not explicitly specified.
 			pSurface->SetDefaultPrimitiveVariables();
@@ -2762,7 +2996,7 @@ RtVoid RiCxxCore::NuPatch(RtInt nu, RtInt uorder, const FloatArray& uknot, RtFlo
 		pSurface->avKnots() [ i ] = vknot[ i ];
 
 	// Process any specified parameters
-	if ( ProcessPrimitiveVariables( pSurface.get(), pList ) )
+	if ( ProcessPrimitiveVariables( pSurface.get(), pList, m_instancePrimvars ) )
 	{
 		// Set up the default primitive variables.
 		pSurface->SetDefaultPrimitiveVariables();
@@ -2835,7 +3069,7 @@ RtVoid RiCxxCore::Sphere(RtFloat radius, RtFloat zmin, RtFloat zmax, RtFloat the
 {
 	// Create a sphere
 	boost::shared_ptr<CqSphere> pSurface( new CqSphere( radius, zmin, zmax, 0, thetamax ) );
-	ProcessPrimitiveVariables( pSurface.get(), pList );
+	ProcessPrimitiveVariables( pSurface.get(), pList, m_instancePrimvars );
 	pSurface->SetDefaultPrimitiveVariables();
 
 	TqFloat time = QGetRenderContext()->Time();
@@ -2860,7 +3094,7 @@ RtVoid RiCxxCore::Cone(RtFloat height, RtFloat radius, RtFloat thetamax, const P
 
 	// Create a cone
 	boost::shared_ptr<CqCone> pSurface( new CqCone( height, radius, 0, thetamax, 0, 1.0f ) );
-	ProcessPrimitiveVariables( pSurface.get(), pList );
+	ProcessPrimitiveVariables( pSurface.get(), pList, m_instancePrimvars );
 	pSurface->SetDefaultPrimitiveVariables();
 
 	TqFloat time = QGetRenderContext()->Time();
@@ -2881,7 +3115,7 @@ RtVoid RiCxxCore::Cylinder(RtFloat radius, RtFloat zmin, RtFloat zmax, RtFloat t
 {
 	// Create a cylinder
 	boost::shared_ptr<CqCylinder> pSurface( new CqCylinder( radius, zmin, zmax, 0, thetamax ) );
-	ProcessPrimitiveVariables( pSurface.get(), pList );
+	ProcessPrimitiveVariables( pSurface.get(), pList, m_instancePrimvars );
 	pSurface->SetDefaultPrimitiveVariables();
 
 	TqFloat time = QGetRenderContext()->Time();
@@ -2904,7 +3138,7 @@ RtVoid RiCxxCore::Hyperboloid(RtConstPoint point1, RtConstPoint point2, RtFloat
 	CqVector3D v0( point1[ 0 ], point1[ 1 ], point1[ 2 ] );
 	CqVector3D v1( point2[ 0 ], point2[ 1 ], point2[ 2 ] );
 	boost::shared_ptr<CqHyperboloid> pSurface( new CqHyperboloid( v0, v1, 0, thetamax ) );
-	ProcessPrimitiveVariables( pSurface.get(), pList );
+	ProcessPrimitiveVariables( pSurface.get(), pList, m_instancePrimvars );
 	pSurface->SetDefaultPrimitiveVariables();
 
 	TqFloat time = QGetRenderContext()->Time();
@@ -2925,7 +3159,7 @@ RtVoid RiCxxCore::Paraboloid(RtFloat rmax, RtFloat zmin, RtFloat zmax, RtFloat t
 {
 	// Create a paraboloid
 	boost::shared_ptr<CqParaboloid> pSurface( new CqParaboloid( rmax, zmin, zmax, 0, thetamax ) );
-	ProcessPrimitiveVariables( pSurface.get(), pList );
+	ProcessPrimitiveVariables( pSurface.get(), pList, m_instancePrimvars );
 	pSurface->SetDefaultPrimitiveVariables();
 
 	TqFloat time = QGetRenderContext()->Time();
@@ -2946,7 +3180,7 @@ RtVoid RiCxxCore::Disk(RtFloat height, RtFloat radius, RtFloat thetamax, const P
 {
 	// Create a disk
 	boost::shared_ptr<CqDisk> pSurface( new CqDisk( height, 0, radius, 0, thetamax ) );
-	ProcessPrimitiveVariables( pSurface.get(), pList );
+	ProcessPrimitiveVariables( pSurface.get(), pList, m_instancePrimvars );
 	pSurface->SetDefaultPrimitiveVariables();
 
 	TqFloat time = QGetRenderContext()->Time();
@@ -2968,7 +3202,7 @@ RtVoid RiCxxCore::Torus(RtFloat majorrad, RtFloat minorrad, RtFloat phimin, RtFl
 {
 	// Create a torus
 	boost::shared_ptr<CqTorus> pSurface( new CqTorus( majorrad, minorrad, phimin, phimax, 0, thetamax ) );
-	ProcessPrimitiveVariables( pSurface.get(), pList );
+	ProcessPrimitiveVariables( pSurface.get(), pList, m_instancePrimvars );
 	pSurface->SetDefaultPrimitiveVariables();
 
 	TqFloat time = QGetRenderContext()->Time();
@@ -2988,6 +3222,8 @@ RtVoid RiCxxCore::Torus(RtFloat majorrad, RtFloat minorrad, RtFloat phimin, RtFl
 //
 RtVoid RiCxxCore::Procedural(RtPointer data, RtConstBound bound, RtProcSubdivFunc refineproc, RtProcFreeFunc freeproc)
 {
+	// DelayedReadArchive procedurals are prefetched once they survive
+	// culling; see CqProcedural::CacheRasterBound().
 	CqBound B(bound);
 	boost::shared_ptr<CqProcedural> pProc( new CqProcedural(data, B, refineproc, freeproc ) );
 	TqFloat time = QGetRenderContext()->Time();
@@ -3013,7 +3249,7 @@ RtVoid RiCxxCore::Geometry(RtConstToken type, const ParamList& pList)
 		boost::shared_ptr<CqTeapot> pSurface( new CqTeapot( true ) ); // add a bottom if true/false otherwise
 
 		pSurface->SetSurfaceParameters( *pSurface );
-		ProcessPrimitiveVariables( pSurface.get(), pList );
+		ProcessPrimitiveVariables( pSurface.get(), pList, m_instancePrimvars );
 		pSurface->SetDefaultPrimitiveVariables();
 
 		// I don't use the original teapot primitives as defined by T. Burge
@@ -3045,7 +3281,7 @@ RtVoid RiCxxCore::Geometry(RtConstToken type, const ParamList& pList)
 		// \todo <b>Code Review</b> Do we really need this when we have RiSphere?
 		// Create a sphere
 		boost::shared_ptr<CqSphere> pSurface( new CqSphere( 1, -1, 1, 0, 360.0 ) );
-		ProcessPrimitiveVariables( pSurface.get(), pList );
+		ProcessPrimitiveVariables( pSurface.get(), pList, m_instancePrimvars );
 		pSurface->SetDefaultPrimitiveVariables();
 
 		TqFloat time = QGetRenderContext()->Time();
@@ -3306,7 +3542,7 @@ RtVoid RiCxxCore::SubdivisionMesh(RtConstToken scheme, const IntArray& nvertices
 
 	std::vector<boost::shared_ptr<CqPolygonPoints> >	apPoints;
 	// Process any specified primitive variables
-	if ( ProcessPrimitiveVariables( pPointsClass.get(), pList ) )
+	if ( ProcessPrimitiveVariables( pPointsClass.get(), pList, m_instancePrimvars ) )
 	{
 		// Create experimental version
 		if ( strcmp( scheme, "catmull-clark" ) == 0 )
@@ -3320,17 +3556,36 @@ RtVoid RiCxxCore::SubdivisionMesh(RtConstToken scheme, const IntArray& nvertices
 			pPointsClass->Transform( matOtoW, matNOtoW, matVOtoW);
 
 			boost::shared_ptr<CqSubdivision2> pSubd2( new CqSubdivision2( pPointsClass ) );
-			pSubd2->Prepare( cVerts );
-
 			boost::shared_ptr<CqSurfaceSubdivisionMesh> pMesh( new CqSurfaceSubdivisionMesh(pSubd2, nfaces ) );
 
-			RtInt	iP = 0;
-			for ( face = 0; face < nfaces; ++face )
+			// Look for the hull topology from an earlier mesh with the same
+			// connectivity and tags.
+			CqSubdivisionTopologyKey topologyKey;
+			topologyKey.addInts( nvertices.begin(), nvertices.size() );
+			topologyKey.addInts( vertices.begin(), vertices.size() );
+			for ( TqInt i = 0; i < ntags; ++i )
+				topologyKey.addString( tags[ i ] );
+			topologyKey.addInts( nargs.begin(), nargs.size() );
+			topologyKey.addInts( intargs.begin(), intargs.size() );
+			topologyKey.addFloats( floatargs.begin(), floatargs.size() );
+			boost::shared_ptr<const SqSubdivisionTopology> topology
+				= m_subdivTopologyCache.find( topologyKey );
+
+			bool validHull = true;
+			if ( topology )
+				pSubd2->RestoreTopology( *topology );
+			else
 			{
-				pSubd2->AddFacet( nvertices[face], const_cast<TqInt*>(&vertices[iP]), iP );
-				iP += nvertices[ face ];
+				pSubd2->Prepare( cVerts );
+				RtInt	iP = 0;
+				for ( face = 0; face < nfaces; ++face )
+				{
+					pSubd2->AddFacet( nvertices[face], const_cast<TqInt*>(&vertices[iP]), iP );
+					iP += nvertices[ face ];
+				}
+				validHull = pSubd2->Finalise();
 			}
-			if ( pSubd2->Finalise() )
+			if ( validHull )
 			{
 				// Process tags.
 				TqInt argcIndex = 0;
@@ -3339,7 +3594,10 @@ RtVoid RiCxxCore::SubdivisionMesh(RtConstToken scheme, const IntArray& nvertices
 				for ( TqInt i = 0; i < ntags; ++i )
 				{
 					if ( strcmp( tags[ i ], "interpolateboundary" ) == 0 )
-						pSubd2->SetInterpolateBoundary( true );
+					{
+						if ( !topology )
+							pSubd2->SetInterpolateBoundary( true );
+					}
 					else if ( strcmp( tags [ i ], "crease" ) == 0 )
 					{
 						TqFloat creaseSharpness = floatargs[ floatargIndex ];
@@ -3357,6 +3615,11 @@ RtVoid RiCxxCore::SubdivisionMesh(RtConstToken scheme, const IntArray& nvertices
 							{
 								// Store the sharp edge information in the top level mesh.
 								pMesh->AddSharpEdge(intargs[ iEdge + intargIndex ], intargs[ iEdge + intargIndex + 1 ], creaseSharpness);
+							}
+							if ( !topology &&
+							        intargs[ iEdge + intargIndex ] < pSubd2->cVertices() &&
+							        intargs[ iEdge + intargIndex + 1 ] < pSubd2->cVertices() )
+							{
 								// Store the crease sharpness.
 								CqLath* pEdge = pSubd2->pVertex( intargs[ iEdge + intargIndex ] );
 								std::vector<CqLath*> aQve;
@@ -3385,13 +3648,16 @@ RtVoid RiCxxCore::SubdivisionMesh(RtConstToken scheme, const IntArray& nvertices
 								// Store the sharp edge information in the top level mesh.
 								pMesh->AddSharpCorner(intargs[ iVertex + intargIndex ], RI_INFINITY);
 								// Store the corner sharpness.
-								CqLath* pVertex = pSubd2->pVertex( intargs[ iVertex + intargIndex ] );
-								pSubd2->AddSharpCorner( pVertex, RI_INFINITY );
+								if ( !topology )
+								{
+									CqLath* pVertex = pSubd2->pVertex( intargs[ iVertex + intargIndex ] );
+									pSubd2->AddSharpCorner( pVertex, RI_INFINITY );
+								}
 							}
 							iVertex++;
 						}
 					}
-					else if ( strcmp( tags [ i ], "hole" ) == 0 )
+					else if ( strcmp( tags [ i ], "hole" ) == 0 && !topology )
 					{
 						TqInt iFace = 0;
 						while ( iFace < nargs[ argcIndex ] )
@@ -3405,6 +3671,16 @@ RtVoid RiCxxCore::SubdivisionMesh(RtConstToken scheme, const IntArray& nvertices
 					floatargIndex += nargs[ argcIndex++ ];
 				}
 
+				// Hulls which needed non-manifold vertices duplicating have
+				// extra vertex data, so can't be rebuilt from the topology
+				// alone.
+				if ( !topology && pSubd2->cVertices() == cVerts )
+				{
+					boost::shared_ptr<SqSubdivisionTopology> newTopology( new SqSubdivisionTopology() );
+					pSubd2->StoreTopology( *newTopology );
+					m_subdivTopologyCache.insert( topologyKey, newTopology );
+				}
+
 				CreateGPrim(pMesh);
 			}
 			else
@@ -3422,14 +3698,22 @@ RtVoid RiCxxCore::SubdivisionMesh(RtConstToken scheme, const IntArray& nvertices
 
 RtVoid RiCxxCore::ReadArchive(RtConstToken name, RtArchiveCallback callback, const ParamList& pList)
 {
-	// Open the archive file
-	boost::filesystem::ifstream archiveFile(
-			QGetRenderContext()->poptCurrent()->findRiFile(name, "archive"),
-			std::ios::binary);
-	// Parse the archive
+	boostfs::path fileName
+		= QGetRenderContext()->poptCurrent()->findRiFile(name, "archive");
 	RtArchiveCallback savedCallback = m_archiveCallback;
 	m_archiveCallback = callback;
-	m_apiServices.parseRib(archiveFile, name);
+	if(callback)
+	{
+		// Parse the archive directly so that the callback sees its comments.
+		RibInputFile archiveFile(native(fileName).c_str());
+		m_apiServices.parseRib(archiveFile, name);
+	}
+	else
+	{
+		// Otherwise it may be replayed from memory if it's been read before.
+		m_archiveCache->readArchive(native(fileName).c_str(), m_apiServices,
+									m_apiServices.firstFilter());
+	}
 	m_archiveCallback = savedCallback;
 }
 
@@ -3574,7 +3858,8 @@ RtVoid RiCxxCore::ConnectShaderLayers(RtConstToken type, RtConstToken layer1, Rt
 // Process and fill in any primitive variables.
 // return	:	RI_TRUE if position specified, RI_FALSE otherwise.
 static RtBoolean ProcessPrimitiveVariables(CqSurface * pSurface,
-										   const Ri::ParamList& pList)
+										   const Ri::ParamList& pList,
+										   CqInstancePrimvars& instancePrimvars)
 {
 	std::vector<TqInt>	aUserParams;
 
@@ -3658,7 +3943,6 @@ static RtBoolean ProcessPrimitiveVariables(CqSurface * pSurface,
 			const Ri::Param& param = pList[*iUserParam];
 			CqPrimvarToken tok(param.spec(), param.name());
 
-			CqParameter* pNewParam = CqParameter::Create(tok);
 			// Now go across all values and fill in the parameter variable.
 			TqInt cValues = 1;
 			switch ( tok.Class() )
@@ -3686,6 +3970,15 @@ static RtBoolean ProcessPrimitiveVariables(CqSurface * pSurface,
 				default:
 					break;
 			}
+
+			// Object instances share the values converted by earlier ones.
+			if ( CqParameter* pSharedParam = instancePrimvars.find( param, cValues ) )
+			{
+				pSurface->AddPrimitiveVariable( pSharedParam );
+				continue;
+			}
+
+			CqParameter* pNewParam = CqParameter::Create(tok);
 			pNewParam->SetSize( cValues );
 
 			const void* value = param.data();
@@ -3788,6 +4081,7 @@ static RtBoolean ProcessPrimitiveVariables(CqSurface * pSurface,
 						break;
 					}
 			}
+			instancePrimvars.add( param, cValues, *pNewParam );
 			pSurface->AddPrimitiveVariable( pNewParam );
 		}
 	}
@@ -3834,6 +4128,29 @@ RtVoid	CreateGPrim( const boost::shared_ptr<CqSurface>& pSurface )
 }
 
 
+//==============================================================================
+/// Front of the filter chain while the calls of a procedural are recorded.
+///
+/// Archives are read in place rather than recorded, so that the procedural
+/// cache holds the contents of a DelayedReadArchive rather than just a
+/// ReadArchive call.
+class ProceduralRecordingFilter : public PassthroughFilter
+{
+	public:
+		ProceduralRecordingFilter(RiCxxCore& core)
+			: m_core(core)
+		{ }
+
+		virtual RtVoid ReadArchive(RtConstToken name, RtArchiveCallback callback,
+								   const ParamList& pList)
+		{
+			m_core.ReadArchive(name, callback, pList);
+		}
+
+	private:
+		RiCxxCore& m_core;
+};
+
 //==============================================================================
 /// Api services for the core renderer.
 class CoreRendererServices : public Ri::RendererServices
@@ -3844,13 +4161,15 @@ class CoreRendererServices : public Ri::RendererServices
 			m_api(),
 			m_parser(),
 			m_filterChain(),
-			m_errorHandler()
+			m_errorHandler(),
+			m_divertedFilter(0)
 		{
 			m_api.reset(new RiCxxCore(*this));
 			// Add renderer utility filter.  We do this here rather than in
 			// addFilter() because this is a special filter which should only
 			// be added once.
-			Ri::Filter* utilFilter = createRenderUtilFilter(TestCondition);
+			Ri::Filter* utilFilter = createRenderUtilFilter(TestCondition,
+					boost::bind(&RiCxxCore::replayingInstance, m_api.get(), _1));
 			utilFilter->setNextFilter(*m_api);
 			utilFilter->setRendererServices(*this);
 			m_filterChain.push_back(boost::shared_ptr<Ri::Renderer>(utilFilter));
@@ -3863,6 +4182,31 @@ class CoreRendererServices : public Ri::RendererServices
 			return *m_renderContext;
 		}
 
+		/// Start parsing an archive ahead of time.
+		///
+		/// See prefetchArchive() in procedural.h.
+		void prefetchArchive(const char* name)
+		{
+			m_api->prefetchArchive(name);
+		}
+
+		/// Make the calls of a procedural through the procedural cache.
+		///
+		/// See cacheProceduralCalls() in procedural.h.
+		void cacheProceduralCalls(const std::string& key,
+				std::time_t modifiedTime, bool saveToDisk,
+				const boost::function<void ()>& generate)
+		{
+			RibArchiveCache& cache = m_api->archiveCache();
+			Ri::Renderer& context = firstFilter();
+			if(cache.replayProcedural(key.c_str(), modifiedTime, *this, context))
+				return;
+			cache.recordProcedural(key.c_str(), modifiedTime,
+					boost::bind(&CoreRendererServices::divertCalls, this, _1,
+								boost::cref(generate)),
+					saveToDisk, *this, context);
+		}
+
 		//--------------------------------------------------
 		// from Ri::RenderServices
 		virtual Ri::ErrorHandler& errorHandler()
@@ -3897,6 +4241,8 @@ class CoreRendererServices : public Ri::RendererServices
 
         virtual Ri::Renderer& firstFilter()
         {
+            if(m_divertedFilter)
+                return *m_divertedFilter;
             if(!m_filterChain.empty())
                 return *m_filterChain.back();
             return *m_api;
@@ -3954,6 +4300,27 @@ class CoreRendererServices : public Ri::RendererServices
         }
 
     private:
+        /// Run generate with all interface calls diverted to recorder.
+        void divertCalls(Ri::Renderer& recorder,
+                         const boost::function<void ()>& generate)
+        {
+            ProceduralRecordingFilter filter(*m_api);
+            filter.setNextFilter(recorder);
+            filter.setRendererServices(*this);
+            Ri::Renderer* savedFilter = m_divertedFilter;
+            m_divertedFilter = &filter;
+            try
+            {
+                generate();
+            }
+            catch(...)
+            {
+                m_divertedFilter = savedFilter;
+                throw;
+            }
+            m_divertedFilter = savedFilter;
+        }
+
         /// Core render context
         boost::shared_ptr<CqRenderer> m_renderContext;
         /// Core renderer API
@@ -3966,6 +4333,8 @@ class CoreRendererServices : public Ri::RendererServices
         std::vector<boost::shared_ptr<Ri::Renderer> > m_filterChain;
         /// Error handler.
         AqsisLogErrorHandler m_errorHandler;
+        /// Replaces the filter chain while a procedural is recorded.
+        Ri::Renderer* m_divertedFilter;
 };
 
 } // namespace Aqsis;
@@ -3984,12 +4353,15 @@ struct CoreContext
 	boost::shared_ptr<Ri::RendererServices> apiServices;
 	boost::shared_ptr<std::ofstream> writerOutput;
 	CqRenderer* renderContext;
+	/// Services of the core renderer, or null when writing RIB.
+	CoreRendererServices* coreServices;
 	void* riToRiCxxData;
 
 	CoreContext(RtToken name)
 		: apiServices(),
 		writerOutput(),
 		renderContext(0),
+		coreServices(0),
 		riToRiCxxData(0)
 	{
 		if(!name || *name == '\0')
@@ -3998,6 +4370,7 @@ struct CoreContext
 			CoreRendererServices* serv = new CoreRendererServices();
 			apiServices.reset(serv);
 			renderContext = &serv->renderContext();
+			coreServices = serv;
 		}
 		else
 		{
@@ -4024,6 +4397,25 @@ static CoreContext* g_context = 0;
 typedef std::vector<CoreContext*> ContextList;
 static ContextList g_validContexts;
 
+namespace Aqsis {
+void cacheProceduralCalls(const std::string& key, std::time_t modifiedTime,
+		bool saveToDisk, const boost::function<void ()>& generate)
+{
+	// Procedurals are only subdivided by the core renderer.
+	assert(g_context && g_context->coreServices);
+	g_context->coreServices->cacheProceduralCalls(key, modifiedTime,
+			saveToDisk, generate);
+}
+
+void prefetchArchive(const char* name)
+{
+	// Prefetching is only an optimisation, so quietly do nothing outside a
+	// core render.
+	if(g_context && g_context->coreServices)
+		g_context->coreServices->prefetchArchive(name);
+}
+}
+
 RtVoid RiBegin(RtToken name)
 {
 	// Make a context
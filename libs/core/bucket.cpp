@@ -55,6 +55,8 @@ namespace Aqsis {
 //----------------------------------------------------------------------
 CqBucket::CqBucket()
 	: m_bProcessed(false),
+	m_bStarted(false),
+	m_liveSurfaces(0),
 	m_col(0),
 	m_row(0),
 	m_xPosition(0),
@@ -127,6 +127,42 @@ class CqBucket
 		/** Mark this bucket as processed
 		 */
 		void SetProcessed( bool bProc =  true);
+		/** Get the flag that indicates if a bucket processor has started
+		 * work on this bucket.
+		 *
+		 * A bucket which has been started can no longer accept cache
+		 * segments from its neighbours.
+		 */
+		bool IsStarted() const
+		{
+			return( m_bStarted );
+		}
+		/** Mark this bucket as started
+		 */
+		void SetStarted( bool bStarted = true )
+		{
+			m_bStarted = bStarted;
+		}
+
+		/** \brief Get the number of live surfaces which may still contribute
+		 * geometry to this bucket.
+		 *
+		 * This counts all surfaces waiting in, or being rendered by, this
+		 * bucket or an earlier one whose raster bound touches the bucket.  It
+		 * is only maintained when buckets are rendered concurrently, in which
+		 * case a bucket can't be finished until the count drops to zero.
+		 */
+		TqInt liveSurfaceCount() const
+		{
+			return( m_liveSurfaces );
+		}
+		/** Adjust the number of live surfaces touching this bucket.
+		 */
+		void adjustLiveSurfaceCount( TqInt delta )
+		{
+			m_liveSurfaces += delta;
+			assert( m_liveSurfaces >= 0 );
+		}
 
 		/** Get the column of the bucket in the image */
 		TqInt getCol() const;
@@ -177,6 +213,10 @@ class CqBucket
 
 		/// Flag indicating if this bucket has been processed yet.
 		bool	m_bProcessed;
+		/// Flag indicating if a bucket processor has started on this bucket.
+		bool	m_bStarted;
+		/// Number of live surfaces which may still post geometry to this bucket.
+		TqInt	m_liveSurfaces;
 
 		/// Bucket column in the image
 		TqInt m_col;
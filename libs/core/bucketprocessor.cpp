@@ -21,6 +21,7 @@
 #include	<valarray>
 
 #include	<aqsis/math/math.h>
+#include	<aqsis/util/pool.h>
 #include	"bucket.h"
 #include	"imagebuffer.h"
 #include	<aqsis/util/timer.h>
@@ -90,11 +91,16 @@ void CqBucketProcessor::reset()
 
 	m_bucket = 0;
 	m_hasValidSamples = false;
+
+	// Give back any pool memory this thread no longer needs now that the
+	// bucket has been retired.
+	CqObjectPoolBase::trimAll();
 }
 
 void CqBucketProcessor::preProcess(IqSampler* sampler)
 {
 	assert(m_bucket);
+	m_bucket->SetStarted();
 
 	{
 		AQSIS_TIME_SCOPE(Prepare_bucket);
@@ -247,6 +253,7 @@ void CqBucketProcessor::postProcess()
 	// micropolygons rendered to that pixel.
 	{
 		AQSIS_TIME_SCOPE(Combine_samples);
+		BuildVisibility();
 		CombineElements();
 	}
 
@@ -256,11 +263,95 @@ void CqBucketProcessor::postProcess()
 		ExposeBucket();
 	}
 
+	ShareCacheSegments();
+
+	assert(!m_bucket->IsProcessed());
+	m_bucket->SetProcessed();
+}
+
+#ifdef	ENABLE_THREADING
+void CqBucketProcessor::processConcurrent()
+{
+	if (!m_bucket)
+		return;
+
+	boost::mutex::scoped_lock lock(m_imageBuf.geometryMutex());
+	while(true)
+	{
+		if(!m_bucket->micropolygons().empty())
+		{
+			// Sample the waiting micropolygons without holding the lock, so
+			// that other buckets can be diced and shaded meanwhile.  New
+			// micropolygons may be added to the bucket in the meantime.
+			std::vector<boost::shared_ptr<CqMicroPolygon> > micropolygons;
+			micropolygons.swap(m_bucket->micropolygons());
+			lock.unlock();
+			for(std::vector<boost::shared_ptr<CqMicroPolygon> >::iterator
+					itMP = micropolygons.begin(); itMP != micropolygons.end(); ++itMP)
+				RenderMicroPoly(itMP->get());
+			m_OcclusionTree.updateTree();
+			lock.lock();
+			// Micropolygons and their grids come from shared pools, so
+			// they must be released while holding the lock.
+			micropolygons.clear();
+		}
+		else if(m_bucket->hasPendingSurfaces())
+		{
+			boost::shared_ptr<CqSurface> surface = m_bucket->pTopSurface();
+			m_bucket->popSurface();
+			// RenderSurface() takes the split and shader locks, and only
+			// takes the geometry lock to post its results, so other buckets
+			// can sample and fetch their surfaces meanwhile.  The surface still
+			// counts as live in this bucket until surfaceRendered().
+			lock.unlock();
+			RenderSurface(surface);
+			lock.lock();
+			m_imageBuf.surfaceRendered(*m_bucket, surface);
+			m_imageBuf.geometryChanged().notify_all();
+		}
+		else if(m_bucket->liveSurfaceCount() == 0)
+		{
+			// No surface anywhere can contribute to this bucket any more.
+			// Marking the bucket as processed right away makes sure that no
+			// stray geometry is posted to it while it's being filtered.
+			m_bucket->SetProcessed();
+			break;
+		}
+		else
+		{
+			// Wait for other buckets to render surfaces which touch this one.
+			m_imageBuf.geometryChanged().wait(lock);
+		}
+	}
+}
+
+void CqBucketProcessor::postProcessConcurrent()
+{
+	if (!m_bucket)
+		return;
+
+	BuildVisibility();
+	CombineElements();
+	{
+		// The imager shader is shared by all buckets.
+		CqImageBuffer::CqShaderLock imagerLock(m_imageBuf,
+				QGetRenderContext()->poptCurrent()->pshadImager().get());
+		FilterBucket();
+	}
+	ExposeBucket();
+
+	boost::mutex::scoped_lock lock(m_imageBuf.geometryMutex());
+	ShareCacheSegments();
+}
+#endif
+
+void CqBucketProcessor::ShareCacheSegments()
+{
 	boost::shared_ptr<SqBucketCacheSegment> top_left, top_right, bottom_left, bottom_right;
 
 	std::vector<CqBucket*> neighbours;
 	m_imageBuf.axialNeighbours(*m_bucket, neighbours);
-	if(neighbours[CqImageBuffer::left] && !neighbours[CqImageBuffer::left]->IsProcessed())
+	if(neighbours[CqImageBuffer::left] && !neighbours[CqImageBuffer::left]->IsStarted())
 	{
 		boost::shared_ptr<SqBucketCacheSegment> cacheSegment(new SqBucketCacheSegment);
 		buildCacheSegment(SqBucketCacheSegment::left, cacheSegment);
@@ -279,7 +370,7 @@ void CqBucketProcessor::postProcess()
 			neighbours[CqImageBuffer::left]->setCacheSegment(SqBucketCacheSegment::bottom_right, bottom_left);
 		}
 	}
-	if(neighbours[CqImageBuffer::right] && !neighbours[CqImageBuffer::right]->IsProcessed())
+	if(neighbours[CqImageBuffer::right] && !neighbours[CqImageBuffer::right]->IsStarted())
 	{
 		boost::shared_ptr<SqBucketCacheSegment> cacheSegment(new SqBucketCacheSegment);
 		buildCacheSegment(SqBucketCacheSegment::right, cacheSegment);
@@ -297,7 +388,7 @@ void CqBucketProcessor::postProcess()
 			neighbours[CqImageBuffer::right]->setCacheSegment(SqBucketCacheSegment::bottom_left, bottom_right);
 		}
 	}
-	if(neighbours[CqImageBuffer::above] && !neighbours[CqImageBuffer::above]->IsProcessed())
+	if(neighbours[CqImageBuffer::above] && !neighbours[CqImageBuffer::above]->IsStarted())
 	{
 		boost::shared_ptr<SqBucketCacheSegment> cacheSegment(new SqBucketCacheSegment);
 		buildCacheSegment(SqBucketCacheSegment::top, cacheSegment);
@@ -321,7 +412,7 @@ void CqBucketProcessor::postProcess()
 			neighbours[CqImageBuffer::above]->setCacheSegment(SqBucketCacheSegment::bottom_right, top_right);
 		}
 	}
-	if(neighbours[CqImageBuffer::below] && !neighbours[CqImageBuffer::below]->IsProcessed())
+	if(neighbours[CqImageBuffer::below] && !neighbours[CqImageBuffer::below]->IsStarted())
 	{
 		boost::shared_ptr<SqBucketCacheSegment> cacheSegment(new SqBucketCacheSegment);
 		buildCacheSegment(SqBucketCacheSegment::bottom, cacheSegment);
@@ -353,9 +444,101 @@ void CqBucketProcessor::postProcess()
 	}
 
 	m_bucket->clearCache();
+}
 
-	assert(!m_bucket->IsProcessed());
-	m_bucket->SetProcessed();
+namespace {
+
+/// A sample hit, as seen by a visibility function.
+struct SqVisibilityHit
+{
+	TqFloat depth;
+	TqFloat opacity;
+	/// Index of the sample within its pixel.
+	TqInt sample;
+
+	SqVisibilityHit(const TqFloat* hitData, TqInt sample)
+		: depth(hitData[Sample_Depth]),
+		opacity(clamp((hitData[Sample_ORed] + hitData[Sample_OGreen]
+					+ hitData[Sample_OBlue]) / 3.0f, 0.0f, 1.0f)),
+		sample(sample)
+	{ }
+	bool operator<(const SqVisibilityHit& rhs) const
+	{
+		return depth < rhs.depth;
+	}
+};
+
+} // unnamed namespace
+
+//----------------------------------------------------------------------
+/** Build the visibility function of each display pixel.
+ *
+ * The visibility of a pixel at some depth is the mean over its samples of the
+ * light transmitted through all hits in front of that depth.  Each hit is a
+ * step in the function.  Colored opacities are averaged to a single channel,
+ * and the samples are box filtered over the pixel regardless of the pixel
+ * filter.
+ */
+
+void CqBucketProcessor::BuildVisibility()
+{
+	m_visibilityOffsets.clear();
+	m_visibilityNodes.clear();
+	TqFloat tolerance = QGetRenderContext()->pDDmanager()->VisibilityTolerance();
+	if(tolerance < 0)
+		return;
+	m_visibilityOffsets.assign(DisplayRegion().area() + 1, 0);
+	if(!m_hasValidSamples)
+		return;
+
+	std::vector<SqVisibilityHit> hits;
+	std::vector<TqFloat> transmittance;
+	std::vector<SqVisibilityNode> nodes;
+	std::vector<SqVisibilityNode> compressed;
+	TqInt i = 0;
+	for(TqInt y = DisplayRegion().yMin(); y < DisplayRegion().yMax(); ++y)
+	{
+		for(TqInt x = DisplayRegion().xMin(); x < DisplayRegion().xMax(); ++x, ++i)
+		{
+			CqImagePixelPtr* pie;
+			ImageElement(x, y, pie);
+			const CqImagePixel& pixel = **pie;
+			TqInt numSamples = pixel.numSamples();
+			// Gather the hits from all the samples, front to back.
+			hits.clear();
+			for(TqInt s = 0; s < numSamples; ++s)
+			{
+				const SqSampleData& sampleData = pixel.SampleData(s);
+				if(sampleData.occludingHit.flags & SqImageSample::Flag_Valid)
+					hits.push_back(SqVisibilityHit(
+						pixel.sampleHitData(sampleData.occludingHit), s));
+				for(std::vector<SqImageSample>::const_iterator hit = sampleData.data.begin(),
+						end = sampleData.data.end(); hit != end; ++hit)
+					hits.push_back(SqVisibilityHit(pixel.sampleHitData(*hit), s));
+			}
+			if(!hits.empty())
+			{
+				std::sort(hits.begin(), hits.end());
+				transmittance.assign(numSamples, 1.0f);
+				nodes.clear();
+				TqFloat visibility = 1;
+				for(std::vector<SqVisibilityHit>::const_iterator hit = hits.begin(),
+						end = hits.end(); hit != end && visibility > 0; ++hit)
+				{
+					TqFloat& sampleTrans = transmittance[hit->sample];
+					nodes.push_back(SqVisibilityNode(hit->depth, visibility));
+					visibility = max(0.0f, visibility
+							- sampleTrans*hit->opacity/numSamples);
+					sampleTrans *= 1 - hit->opacity;
+					nodes.push_back(SqVisibilityNode(hit->depth, visibility));
+				}
+				CqDeepShadowMap::compress(nodes, tolerance, compressed);
+				m_visibilityNodes.insert(m_visibilityNodes.end(),
+						compressed.begin(), compressed.end());
+			}
+			m_visibilityOffsets[i+1] = m_visibilityNodes.size();
+		}
+	}
 }
 
 //----------------------------------------------------------------------
@@ -937,6 +1120,10 @@ void CqBucketProcessor::RenderWaitingMPs()
  */
 void CqBucketProcessor::RenderSurface( boost::shared_ptr<CqSurface>& surface )
 {
+#ifdef	ENABLE_THREADING
+	// Held until the surface is diced; shading only locks its shaders.
+	CqImageBuffer::CqConcurrentLock splitLock( m_imageBuf, m_imageBuf.splitMutex() );
+#endif
 	// Cull surface if it's hidden
 	if ( !surface->pCSGNode() && !( (m_optCache.displayMode & DMode_Z) &&
 	                                (m_optCache.depthFilter == Filter_Max ||
@@ -1020,11 +1207,26 @@ void CqBucketProcessor::RenderSurface( boost::shared_ptr<CqSurface>& surface )
 		if ( NULL != pGrid )
 		{
 			ADDREF( pGrid );
-			// Only shade in all cases since the Displacement could be called in the shadow map creation too.
-			// \note Timings for shading are broken down into component parts within this function.
-			pGrid->Shade();
-			pGrid->TransferOutputVariables();
+#ifdef	ENABLE_THREADING
+			splitLock.unlock();
+#endif
+			{
+#ifdef	ENABLE_THREADING
+				// The output variables are copied from the shaders, so
+				// are transferred under the same lock.
+				CqImageBuffer::CqShaderLock shaderLock( m_imageBuf, pGrid->pAttributes().get() );
+#endif
+				// Only shade in all cases since the Displacement could be called in the shadow map creation too.
+				// \note Timings for shading are broken down into component parts within this function.
+				pGrid->Shade();
+				pGrid->TransferOutputVariables();
+			}
 
+#ifdef	ENABLE_THREADING
+			// The micropolygons are added to the buckets, and reference the
+			// grid, so the grid must be split and released under the lock.
+			CqImageBuffer::CqConcurrentLock geometryLock( m_imageBuf, m_imageBuf.geometryMutex() );
+#endif
 			if ( pGrid->vfCulled() == false )
 			{
 				AQSIS_TIME_SCOPE(Bust_grids);
@@ -28,7 +28,10 @@
 
 #include	<aqsis/aqsis.h>
 
+#include	<vector>
+
 #include	<boost/array.hpp>
+#include	<aqsis/tex/buffers/deepshadowmap.h>
 
 #include	"bucket.h"
 #include	"channelbuffer.h"
@@ -81,9 +84,32 @@ class CqBucketProcessor
 		 */
 		void postProcess();
 
+#ifdef	ENABLE_THREADING
+		/** Process the bucket while other processors work on other buckets.
+		 *
+		 * Surfaces are split, diced and shaded while holding the image
+		 * buffer's geometry lock, but micropolygons are sampled without it.
+		 * Returns once no live surface can contribute to the bucket any
+		 * more, at which point the bucket is marked as processed.
+		 */
+		void processConcurrent();
+
+		/** Post-process the bucket while other processors work on other
+		 * buckets.  The counterpart of postProcess() for processConcurrent().
+		 */
+		void postProcessConcurrent();
+#endif
+
 		//-------------- Reorganise -------------------------
 		
 		CqChannelBuffer& getChannelBuffer();
+		/** Get the start of the visibility function of each display region
+		 * pixel in visibilityNodes(), plus the end of the last.  This is
+		 * empty unless a deep display wants visibility functions.
+		 */
+		const std::vector<TqUint>& visibilityOffsets() const;
+		/// Get the compressed visibility functions for the display region.
+		const std::vector<SqVisibilityNode>& visibilityNodes() const;
 
 		const SqOptionCache& optCache() const;
 
@@ -104,9 +130,18 @@ class CqBucketProcessor
 
 		void	InitialiseFilterValues();
 		void	CalculateDofBounds();
+		/** Build compressed visibility functions for the display region
+		 * pixels from the sample hits, for deep displays.  Must be called
+		 * before CombineElements(), which overwrites the hit opacities.
+		 */
+		void	BuildVisibility();
 		void	CombineElements();
 		void	FilterBucket();
 		void	ExposeBucket();
+		/** Hand the overlapping parts of the sample data to neighbouring
+		 * buckets which haven't been started yet.
+		 */
+		void	ShareCacheSegments();
 
 		void	buildCacheSegment(SqBucketCacheSegment::EqBucketCacheSide side, boost::shared_ptr<SqBucketCacheSegment>& seg);
 		void	applyCacheSegment(SqBucketCacheSegment::EqBucketCacheSide side, const boost::shared_ptr<SqBucketCacheSegment>& seg);
@@ -177,6 +212,9 @@ class CqBucketProcessor
 		bool	m_hasValidSamples;
 
 		CqChannelBuffer	m_channelBuffer;
+		/// Visibility functions for deep displays.
+		std::vector<TqUint>	m_visibilityOffsets;
+		std::vector<SqVisibilityNode>	m_visibilityNodes;
 
 		boost::array<CqRegion, SqBucketCacheSegment::last> m_cacheRegions;
 };
@@ -278,6 +316,16 @@ inline CqChannelBuffer& CqBucketProcessor::getChannelBuffer()
 	return m_channelBuffer;
 }
 
+inline const std::vector<TqUint>& CqBucketProcessor::visibilityOffsets() const
+{
+	return m_visibilityOffsets;
+}
+
+inline const std::vector<SqVisibilityNode>& CqBucketProcessor::visibilityNodes() const
+{
+	return m_visibilityNodes;
+}
+
 inline const CqBound& CqBucketProcessor::DofSubBound(TqInt index) const
 {
 	assert(index < m_NumDofBounds);
@@ -62,6 +62,7 @@ class CqChannelBuffer : public IqChannelBuffer
 		virtual TqInt width() const;
 		virtual TqInt height() const;
 		virtual TqInt getChannelIndex(const std::string& name) const;
+		virtual TqInt pixelSize() const;
 		virtual TqConstChannelPtr operator()(TqInt x, TqInt y, TqInt index) const;
 	
 	private:
@@ -138,6 +139,11 @@ inline TqInt CqChannelBuffer::height() const
 	return m_height;
 }
 
+inline TqInt CqChannelBuffer::pixelSize() const
+{
+	return m_elementSize;
+}
+
 inline TqInt CqChannelBuffer::indexOffset(TqInt x, TqInt y, TqInt index) const
 {
 	assert(index >= 0 && index < static_cast<TqInt>(m_elementSize));
@@ -30,6 +30,7 @@
 #include	"winsock2.h"
 #endif
 
+#include	<algorithm>
 #include	<cstring>
 
 #include	<boost/static_assert.hpp>
@@ -39,6 +40,7 @@
 #include	"ddmanager.h"
 #include	"imagebuffer.h"
 #include	<aqsis/shadervm/ishaderexecenv.h>
+#include	<aqsis/util/exception.h>
 #include	<aqsis/util/logging.h>
 #include	<aqsis/ri/ndspy.h>
 #include	<aqsis/version.h>
@@ -68,8 +70,7 @@ TqInt CqDDManager::AddDisplay( const TqChar* name, const TqChar* type, const TqC
 	/// \todo The shared_ptr should be declared before the if-else block and initialized inside,
 	// then the last 2 lines in the if-else blocks should follow afterward. I couldn't figure out
 	// how to declare the boost pointer separately from its initialization.
-	//if (std::string(type) == "dsm")
-	if (false)  // Removed until DSM is integrated after aqsis-1.4
+	if (std::string(type) == "dsm")
 	{
 		boost::shared_ptr<CqDisplayRequest> req(new CqDeepDisplayRequest(false, name, type, mode, CqString::hash( mode ), modeID,
 		                                        dataOffset,	dataSize, 0.0f, 255.0f, 0.0f, 0.0f, 0.0f, false, false));
@@ -170,6 +171,28 @@ TqInt CqDDManager::DisplayBucket( const CqRegion& DRegion, const IqChannelBuffer
 
 }
 
+TqFloat CqDDManager::VisibilityTolerance()
+{
+	// Use the finest tolerance wanted by any display.
+	TqFloat tolerance = -1;
+	std::vector< boost::shared_ptr<CqDisplayRequest> >::iterator i;
+	for ( i = m_displayRequests.begin(); i != m_displayRequests.end(); ++i )
+	{
+		TqFloat displayTolerance = (*i)->VisibilityTolerance();
+		if ( displayTolerance >= 0 && (tolerance < 0 || displayTolerance < tolerance) )
+			tolerance = displayTolerance;
+	}
+	return tolerance;
+}
+
+TqInt CqDDManager::DisplayVisibility( const CqRegion& DRegion, const std::vector<TqUint>& pixelOffsets, const std::vector<SqVisibilityNode>& nodes )
+{
+	std::vector< boost::shared_ptr<CqDisplayRequest> >::iterator i;
+	for ( i = m_displayRequests.begin(); i != m_displayRequests.end(); ++i )
+		(*i)->DisplayVisibility(DRegion, pixelOffsets, nodes);
+	return ( 0 );
+}
+
 bool CqDDManager::fDisplayNeeds( const TqChar* var )
 {
 	static TqUlong rgb = CqString::hash( "rgb" );
@@ -420,8 +443,11 @@ void CqDisplayRequest::LoadDisplayLibrary( SqDDMemberData& ddMemberData, CqSimpl
 	}
 
 	// Nullified the data part
-	m_DataRow = 0;
 	m_DataBucket = 0;
+	m_scanlineRing.clear();
+	m_scanlineRingRows = 0;
+	m_scanlinePixels.assign(m_height, 0);
+	m_nextScanline = 0;
 
 	if ( NULL != m_OpenMethod )
 	{
@@ -623,6 +649,7 @@ void CqDisplayRequest::LoadDisplayLibrary( SqDDMemberData& ddMemberData, CqSimpl
 					break;
 			}
 		}
+		BuildChannelPlan();
 
 		if ( NULL != m_QueryMethod )
 		{
@@ -650,11 +677,9 @@ void CqDisplayRequest::CloseDisplayLibrary()
 		delete [] m_DataBucket;
 		m_DataBucket = 0;
 	}
-	if (m_DataRow != 0)
-	{
-		delete [] m_DataRow;
-		m_DataRow = 0;
-	}
+	// Release the scanline memory; clear() alone would keep it allocated.
+	std::vector<unsigned char>().swap(m_scanlineRing);
+	m_scanlineRingRows = 0;
 
 	// Empty out the display request data
 	m_CloseMethod = NULL;
@@ -1007,8 +1032,14 @@ void CqDisplayRequest::DisplayBucket( const CqRegion& DRegion, const IqChannelBu
 	{
 		if (CollapseBucketsToScanlines( DRegion ))
 		{
-			// Filled a scan line: time to send complete rows to display
-			SendToDisplay(ymin, ymaxplus1);
+			// Buckets may be retired out of order when rendering with
+			// several threads, so send every complete row which follows
+			// on from the last one sent.
+			TqInt firstRow = m_nextScanline;
+			while(m_nextScanline < m_height && m_scanlinePixels[m_nextScanline] >= m_width)
+				++m_nextScanline;
+			TqInt cropYMin = QGetRenderContext()->cropWindowYMin();
+			SendToDisplay(cropYMin + firstRow, cropYMin + m_nextScanline);
 		}
 	}
 	else
@@ -1019,164 +1050,332 @@ void CqDisplayRequest::DisplayBucket( const CqRegion& DRegion, const IqChannelBu
 
 }
 
+namespace {
+
+/// Convert a quantized value to a display format.
+template<typename T>
+inline T convertToDisplay(double value)
+{
+	return static_cast<T>(value);
+}
+
+/** \note: We need to do this extra clamp as the quantisation values are stored
+    single precision floats, as mandated by the spec.,
+    but single precision floats cannot accurately represent the maximum
+    PtDspyUnsigned32 value of 4294967295. Doing this ensures that the
+    PtDspyUnsigned32 value is clamped before being cast, and the clamp is
+    performed in double precision math to retain accuracy.
+*/
+template<>
+inline PtDspyUnsigned32 convertToDisplay<PtDspyUnsigned32>(double value)
+{
+	return static_cast<PtDspyUnsigned32>(clamp<double>(value, 0,
+			std::numeric_limits<PtDspyUnsigned32>::max()));
+}
+
+template<>
+inline PtDspySigned32 convertToDisplay<PtDspySigned32>(double value)
+{
+	return static_cast<PtDspySigned32>(clamp<double>(value,
+			std::numeric_limits<PtDspySigned32>::min(),
+			std::numeric_limits<PtDspySigned32>::max()));
+}
+
+/** Channel converter for a given display type and quantization mode.
+ *
+ * The mode is fixed for the lifetime of the display, so it's chosen once
+ * when the display is opened rather than tested for every value.
+ */
+template<typename T, bool quantize, bool dither>
+void convertChannel(const TqFloat* src, TqInt srcStride, TqInt numPixels,
+		unsigned char* dest, TqInt destStride,
+		const CqDisplayRequest::SqQuantizer& quantizer, const TqFloat* ditherSamples)
+{
+	double scale = quantizer.one - quantizer.zero;
+	for ( TqInt i = 0; i < numPixels; ++i )
+	{
+		double value = src[i*srcStride];
+		if ( quantize )
+		{
+			value = quantizer.zero + value * scale;
+			if ( dither )
+				value += quantizer.dither * ditherSamples[i];
+			value = clamp<double>(lround(value), quantizer.min, quantizer.max);
+		}
+		reinterpret_cast<T*>(dest + i*destStride)[0] = convertToDisplay<T>(value);
+	}
+}
+
+template<typename T>
+CqDisplayRequest::TqChannelConverter channelConverter(bool quantize, bool dither)
+{
+	if ( !quantize )
+		return &convertChannel<T, false, false>;
+	else if ( !dither )
+		return &convertChannel<T, true, false>;
+	else
+		return &convertChannel<T, true, true>;
+}
+
+} // unnamed namespace
+
+void CqDisplayRequest::BuildChannelPlan()
+{
+	bool quantize = m_QuantizeOneVal != 0;
+	bool dither = quantize && m_QuantizeDitherVal != 0;
+	m_channelPlan.clear();
+	TqInt byteOffset = 0;
+	for ( std::vector<PtDspyDevFormat>::const_iterator iformat = m_formats.begin();
+			iformat != m_formats.end(); ++iformat )
+	{
+		SqChannelPlan channel;
+		const std::pair<std::string, TqInt>& source = m_bufferMap[iformat->name];
+		channel.bufferChannel = source.first;
+		channel.channelOffset = source.second;
+		channel.byteOffset = byteOffset;
+		switch ( iformat->type & PkDspyMaskType )
+		{
+			case PkDspyFloat32:
+				channel.convert = channelConverter<PtDspyFloat32>(quantize, dither);
+				byteOffset += sizeof(PtDspyFloat32);
+				break;
+			case PkDspyUnsigned32:
+				channel.convert = channelConverter<PtDspyUnsigned32>(quantize, dither);
+				byteOffset += sizeof(PtDspyUnsigned32);
+				break;
+			case PkDspySigned32:
+				channel.convert = channelConverter<PtDspySigned32>(quantize, dither);
+				byteOffset += sizeof(PtDspySigned32);
+				break;
+			case PkDspyUnsigned16:
+				channel.convert = channelConverter<PtDspyUnsigned16>(quantize, dither);
+				byteOffset += sizeof(PtDspyUnsigned16);
+				break;
+			case PkDspySigned16:
+				channel.convert = channelConverter<PtDspySigned16>(quantize, dither);
+				byteOffset += sizeof(PtDspySigned16);
+				break;
+			case PkDspyUnsigned8:
+				channel.convert = channelConverter<PtDspyUnsigned8>(quantize, dither);
+				byteOffset += sizeof(PtDspyUnsigned8);
+				break;
+			case PkDspySigned8:
+				channel.convert = channelConverter<PtDspySigned8>(quantize, dither);
+				byteOffset += sizeof(PtDspySigned8);
+				break;
+			default:
+				// Unknown types take no space in the element.
+				continue;
+		}
+		m_channelPlan.push_back(channel);
+	}
+}
+
 void CqDisplayRequest::FormatBucketForDisplay( const CqRegion& DRegion, const IqChannelBuffer* pBuffer )
 {
 	static CqRandom random( 61 );
 
 	if (m_DataBucket == 0)
-		m_DataBucket = new unsigned char[m_elementSize * static_cast<int>(DRegion.area())];
-	if ((m_flags.flags & PkDspyFlagsWantsScanLineOrder) && m_DataRow == 0)
 	{
-		m_DataRow = new unsigned char[m_elementSize * m_width * m_height];
+		// Size the buffer for a full bucket; the first bucket to arrive may
+		// be a smaller one from the image edge.
+		TqInt bucketArea = 16*16;
+		if(const TqInt* bktSize = QGetRenderContext()->poptCurrent()->GetIntegerOption("limits", "bucketsize"))
+			bucketArea = bktSize[0]*bktSize[1];
+		bucketArea = std::max(bucketArea, static_cast<TqInt>(DRegion.area()));
+		m_DataBucket = new unsigned char[m_elementSize * bucketArea];
 	}
 
-	// Fill in the bucket data for each channel in each element, honoring the requested order and formats.
-	unsigned char* pdata = m_DataBucket;
-
-	std::vector<std::pair<TqInt, TqInt> > offsets;
-	std::vector<PtDspyDevFormat>::iterator iformat;
-	// Get and cache the offsets, so that the lookup isn't done for every pixel.
-	for (iformat = m_formats.begin(); iformat != m_formats.end(); ++iformat)
+	TqInt numPixels = pBuffer->width() * pBuffer->height();
+	// One dither sample per pixel, shared by all its channels.
+	const TqFloat* dither = 0;
+	if ( m_QuantizeOneVal != 0 && m_QuantizeDitherVal != 0 )
 	{
-		std::string bufferChannelName = m_bufferMap[iformat->name].first;
-		TqInt offset = m_bufferMap[iformat->name].second;
-		offsets.push_back(std::make_pair(pBuffer->getChannelIndex(bufferChannelName), offset));
+		m_ditherSamples.resize(numPixels);
+		for ( TqInt i = 0; i < numPixels; ++i )
+			m_ditherSamples[i] = random.RandomFloat();
+		dither = &m_ditherSamples[0];
 	}
-
-	for ( TqInt y = 0, endy = pBuffer->height(); y < endy; ++y )
+	SqQuantizer quantizer = { m_QuantizeZeroVal, m_QuantizeOneVal,
+		m_QuantizeMinVal, m_QuantizeMaxVal, m_QuantizeDitherVal };
+
+	// Fill in the bucket data one channel at a time, in the order and
+	// formats requested by the display.
+	const TqFloat* pixels = &*(*pBuffer)(0, 0, 0);
+	TqInt pixelSize = pBuffer->pixelSize();
+	for ( std::vector<SqChannelPlan>::const_iterator channel = m_channelPlan.begin();
+			channel != m_channelPlan.end(); ++channel )
 	{
-		for ( TqInt x = 0, endx = pBuffer->width(); x < endx; ++x )
-		{
-			double s = random.RandomFloat();
-			TqInt index = 0;
-			for (iformat = m_formats.begin(); iformat != m_formats.end(); ++iformat, ++index)
-			{
-				// NOTE: This needs to be optimised, the lookup is expensive.
-				std::string bufferChannelName = m_bufferMap[iformat->name].first;
-				double value = 0.0;
-				try
-				{
-					value = (*pBuffer)(x, y, offsets[index].first)[offsets[index].second];
-				}
-				catch(std::string v)
-				{
-					std::cout << "Invalid channel name " << iformat->name << std::endl;
-				}
-				if ( m_QuantizeOneVal != 0 )
-				{
-					// Perform the quantization
-					value = lround(m_QuantizeZeroVal + value * (m_QuantizeOneVal - m_QuantizeZeroVal) + ( m_QuantizeDitherVal * s ) );
-					value = clamp<double>(value, m_QuantizeMinVal, m_QuantizeMaxVal) ;
-				}
-				TqInt type = iformat->type & PkDspyMaskType;
-				switch (type)
-				{
-					case PkDspyFloat32:
-						reinterpret_cast<PtDspyFloat32*>(pdata)[0] = value;
-						pdata += sizeof(PtDspyFloat32);
-						break;
-					case PkDspyUnsigned32:
-						/** \note: We need to do this extra clamp as the quantisation values are stored
-						    single precision floats, as mandated by the spec.,
-						    but single precision floats cannot accurately represent the maximum
-						    PtDspyUnsigned32 value of 4294967295. Doing this ensures that the
-						    PtDspyUnsigned32 value is clamped before being cast, and the clamp is
-						    performed in double precision math to retain accuracy.
-						*/
-						value = clamp<double>(value, 0,
-								std::numeric_limits<PtDspyUnsigned32>::max());
-						reinterpret_cast<PtDspyUnsigned32*>(pdata)[0] = static_cast<PtDspyUnsigned32>( value );
-						pdata += sizeof(PtDspyUnsigned32);
-						break;
-					case PkDspySigned32:
-						value = clamp<double>(value,
-								std::numeric_limits<PtDspySigned32>::min(),
-								std::numeric_limits<PtDspySigned32>::max());
-						reinterpret_cast<PtDspySigned32*>(pdata)[0] = static_cast<PtDspySigned32>( value );
-						pdata += sizeof(PtDspySigned32);
-						break;
-					case PkDspyUnsigned16:
-						reinterpret_cast<PtDspyUnsigned16*>(pdata)[0] = static_cast<PtDspyUnsigned16>( value );
-						pdata += sizeof(PtDspyUnsigned16);
-						break;
-					case PkDspySigned16:
-						reinterpret_cast<PtDspySigned16*>(pdata)[0] = static_cast<PtDspySigned16>( value );
-						pdata += sizeof(PtDspySigned16);
-						break;
-					case PkDspyUnsigned8:
-						reinterpret_cast<PtDspyUnsigned8*>(pdata)[0] = static_cast<PtDspyUnsigned8>( value );
-						pdata += sizeof(PtDspyUnsigned8);
-						break;
-					case PkDspySigned8:
-						reinterpret_cast<PtDspySigned8*>(pdata)[0] = static_cast<PtDspySigned8>( value );
-						pdata += sizeof(PtDspySigned8);
-						break;
-				}
-			}
-		}
+		TqInt index = pBuffer->getChannelIndex(channel->bufferChannel)
+			+ channel->channelOffset;
+		channel->convert(pixels + index, pixelSize, numPixels,
+				m_DataBucket + channel->byteOffset, m_elementSize,
+				quantizer, dither);
 	}
 }
 
 
-void CqDeepDisplayRequest::FormatBucketForDisplay( const CqRegion& DRegion, const IqChannelBuffer* pBuffer )
+TqFloat CqDisplayRequest::VisibilityTolerance() const
 {
+	return -1;
+}
 
+void CqDisplayRequest::DisplayVisibility( const CqRegion& DRegion,
+		const std::vector<TqUint>& pixelOffsets,
+		const std::vector<SqVisibilityNode>& nodes )
+{
 }
 
 //-----------------------------------------------------------------------------
-// Return true if a scanline of buckets has been accumulated, false otherwise.
+// Return true if the next scanline due at the display has been completed,
+// false otherwise.
 //-----------------------------------------------------------------------------
 bool CqDisplayRequest::CollapseBucketsToScanlines( const CqRegion& DRegion )
 {
+	// Rows are stored relative to the crop window, which is the region the
+	// display was opened with.
+	TqInt cropXMin = QGetRenderContext()->cropWindowXMin();
+	TqInt cropYMin = QGetRenderContext()->cropWindowYMin();
+	TqInt	xmin = std::max(DRegion.xMin(), cropXMin);
+	TqInt	ymin = std::max(DRegion.yMin(), cropYMin);
+	TqInt	xmaxplus1 = std::min(DRegion.xMax(), cropXMin + m_width);
+	TqInt	ymaxplus1 = std::min(DRegion.yMax(), cropYMin + m_height);
+	if(xmin >= xmaxplus1 || ymin >= ymaxplus1)
+		return false;
+	TqInt bucketWidth = DRegion.width();
+	TqInt rowSize = (xmaxplus1 - xmin) * m_elementSize;
+
+	ReserveScanlines(ymaxplus1 - cropYMin);
+	for (TqInt y = ymin; y < ymaxplus1; y++)
+	{
+		const unsigned char* pdata = m_DataBucket + m_elementSize *
+			((y - DRegion.yMin())*bucketWidth + xmin - DRegion.xMin());
+		memcpy(ScanlineRow(y - cropYMin) + m_elementSize * (xmin - cropXMin),
+			   pdata, rowSize);
+		m_scanlinePixels[y - cropYMin] += xmaxplus1 - xmin;
+	}
 
-	unsigned char* pdata = m_DataBucket;
-	TqInt	xmin = DRegion.xMin();
-	TqInt	ymin = DRegion.yMin();
-	TqInt	xmaxplus1 = DRegion.xMax();
-	TqInt	ymaxplus1 = DRegion.yMax();
-	TqInt x, y;
+	return m_nextScanline < m_height && m_scanlinePixels[m_nextScanline] >= m_width;
+}
+
+void CqDisplayRequest::SendToDisplay(TqInt ymin, TqInt ymaxplus1)
+{
+	//Aqsis::log() << debug << "CqDisplayRequest::SendToDisplay()" << std::endl;
+	TqInt y;
+	PtDspyError err;
+	TqInt cropYMin = QGetRenderContext()->cropWindowYMin();
 
+	// send to the display one line at a time
 	for (y = ymin; y < ymaxplus1; y++)
 	{
-		for (x = xmin; x < xmaxplus1; x++)
-		{
-			memcpy(&(m_DataRow[m_width * m_elementSize * (y - ymin) + m_elementSize * x]), pdata, m_elementSize);
-			pdata += m_elementSize;
-		}
+		err = (m_DataMethod)(m_imageHandle, 0, m_width, y, y+1, m_elementSize,
+				ScanlineRow(y - cropYMin));
 	}
+}
+
+unsigned char* CqDisplayRequest::ScanlineRow(TqInt row)
+{
+	return &m_scanlineRing[m_elementSize * m_width * (row % m_scanlineRingRows)];
+}
 
-	if (xmaxplus1 >= m_width)
+void CqDisplayRequest::ReserveScanlines(TqInt rowEnd)
+{
+	TqInt rowsNeeded = rowEnd - m_nextScanline;
+	if(rowsNeeded <= m_scanlineRingRows)
+		return;
+	// Buckets normally arrive a row at a time, so the ring starts out one
+	// bucket high.  It grows when buckets retired out of order by several
+	// threads start a new row before the previous one is finished.
+	TqInt newRows = std::min(std::max(rowsNeeded, 2*m_scanlineRingRows), m_height);
+	TqInt rowSize = m_elementSize * m_width;
+	std::vector<unsigned char> newRing(rowSize * newRows);
+	for(TqInt row = m_nextScanline,
+			end = std::min(m_nextScanline + m_scanlineRingRows, m_height);
+			row < end; ++row)
 	{
-		// Filled a scan line
-		Aqsis::log() << debug << "filled a scanline" << std::endl;
-		return true;
+		if(m_scanlinePixels[row] > 0)
+			memcpy(&newRing[rowSize * (row % newRows)], ScanlineRow(row), rowSize);
 	}
-	return false;
+	m_scanlineRing.swap(newRing);
+	m_scanlineRingRows = newRows;
 }
 
-bool CqDeepDisplayRequest::CollapseBucketsToScanlines( const CqRegion& DRegion )
+//-----------------------------------------------------------------------------
+// CqDeepDisplayRequest
+
+const TqFloat CqDeepDisplayRequest::defaultTolerance = 0.02f;
+
+void CqDeepDisplayRequest::LoadDisplayLibrary( SqDDMemberData& ddMemberData, CqSimplePlugin& dspyPlugin, TqInt dspNo, TqInt width, TqInt height )
 {
-	return false;
+	m_width = width;
+	m_height = height;
+	for ( std::vector<UserParameter>::const_iterator param = m_customParams.begin();
+			param != m_customParams.end(); ++param )
+	{
+		if ( param->vtype == 'f' && param->vcount > 0 && std::string(param->name) == "tolerance" )
+			m_tolerance = std::max(static_cast<const TqFloat*>(param->value)[0], 0.0f);
+	}
+	CqMatrix matWorldToScreen;
+	QGetRenderContext() ->matSpaceToSpace( "world", "screen", NULL, NULL, QGetRenderContextI()->Time(), matWorldToScreen );
+	CqMatrix matWorldToCamera;
+	QGetRenderContext() ->matSpaceToSpace( "world", "camera", NULL, NULL, QGetRenderContextI()->Time(), matWorldToCamera );
+	m_map.reset(new CqDeepShadowMap(width, height, matWorldToCamera, matWorldToScreen));
+	m_isLoaded = true;
+	m_valid = true;
 }
 
-void CqDisplayRequest::SendToDisplay(TqInt ymin, TqInt ymaxplus1)
+void CqDeepDisplayRequest::CloseDisplayLibrary()
 {
-	//Aqsis::log() << debug << "CqDisplayRequest::SendToDisplay()" << std::endl;
-	TqInt y;
-	PtDspyError err;
-	unsigned char* pdata = m_DataRow;
-
-	// send to the display one line at a time
-	for (y = ymin; y < ymaxplus1; y++)
+	if ( !m_map )
+		return;
+	try
+	{
+		m_map->write(m_name);
+		Aqsis::log() << info << "Wrote deep shadow map \"" << m_name << "\" with "
+			<< m_map->numNodes() << " visibility nodes" << std::endl;
+	}
+	catch ( XqException& e )
 	{
-		err = (m_DataMethod)(m_imageHandle, 0, m_width, y, y+1, m_elementSize, pdata);
-		pdata += m_elementSize * m_width;
+		Aqsis::log() << error << e.what() << std::endl;
 	}
+	m_map.reset();
+	m_isLoaded = false;
 }
 
-void CqDeepDisplayRequest::SendToDisplay(TqInt ymin, TqInt ymaxplus1)
+void CqDeepDisplayRequest::DisplayBucket( const CqRegion& DRegion, const IqChannelBuffer* pBuffer )
 {
+}
 
+TqFloat CqDeepDisplayRequest::VisibilityTolerance() const
+{
+	return m_tolerance;
+}
+
+void CqDeepDisplayRequest::DisplayVisibility( const CqRegion& DRegion,
+		const std::vector<TqUint>& pixelOffsets,
+		const std::vector<SqVisibilityNode>& nodes )
+{
+	if ( !m_map )
+		return;
+	// Buckets are in raster coordinates, while the map covers the crop window.
+	TqInt cropXMin = QGetRenderContext()->cropWindowXMin();
+	TqInt cropYMin = QGetRenderContext()->cropWindowYMin();
+	std::vector<SqVisibilityNode> pixelNodes;
+	TqInt i = 0;
+	for ( TqInt y = DRegion.yMin(); y < DRegion.yMax(); ++y )
+	{
+		for ( TqInt x = DRegion.xMin(); x < DRegion.xMax(); ++x, ++i )
+		{
+			TqInt mapX = x - cropXMin;
+			TqInt mapY = y - cropYMin;
+			if ( mapX < 0 || mapX >= m_width || mapY < 0 || mapY >= m_height
+				|| pixelOffsets[i] == pixelOffsets[i+1] )
+				continue;
+			pixelNodes.assign(nodes.begin() + pixelOffsets[i],
+					nodes.begin() + pixelOffsets[i+1]);
+			m_map->setPixel(mapX, mapY, pixelNodes);
+		}
+	}
 }
 
 bool CqDisplayRequest::ThisDisplayNeeds( const TqUlong& htoken, const TqUlong& rgb, const TqUlong& rgba,
@@ -33,6 +33,7 @@
 #include	<aqsis/math/matrix.h>
 #include	<aqsis/ri/ri.h>
 #include	"iddmanager.h"
+#include	<aqsis/tex/buffers/deepshadowmap.h>
 #include	<aqsis/util/plugins.h>
 #define		DSPY_INTERNAL
 #include	<aqsis/ri/ndspy.h>
@@ -115,8 +116,8 @@ class CqDisplayRequest : public IqDisplayRequest
 		 */
 		virtual	void ThisDisplayUses( TqInt& Uses );
 
-		void LoadDisplayLibrary( SqDDMemberData& ddMemberData, CqSimplePlugin& dspyPlugin, TqInt dspNo, TqInt width, TqInt height );
-		void CloseDisplayLibrary();
+		virtual void LoadDisplayLibrary( SqDDMemberData& ddMemberData, CqSimplePlugin& dspyPlugin, TqInt dspNo, TqInt width, TqInt height );
+		virtual void CloseDisplayLibrary();
 		void ConstructStringsParameter(const char* name, const char** strings, TqInt count, UserParameter& parameter);
 		void ConstructIntsParameter(const char* name, const TqInt* ints, TqInt count, UserParameter& parameter);
 		void ConstructFloatsParameter(const char* name, const TqFloat* floats, TqInt count, UserParameter& parameter);
@@ -129,6 +130,17 @@ class CqDisplayRequest : public IqDisplayRequest
 		 * to override.
 		 */
 		virtual void DisplayBucket( const CqRegion& DRegion, const IqChannelBuffer* pBuffer);
+		/* Get the error tolerance for the compressed visibility functions
+		 * wanted by this display, or a negative value if it doesn't want
+		 * them.  Only deep displays want visibility.
+		 */
+		virtual TqFloat VisibilityTolerance() const;
+		/* Send the visibility functions for the pixels of a bucket to the
+		 * display.
+		 */
+		virtual void DisplayVisibility( const CqRegion& DRegion,
+				const std::vector<TqUint>& pixelOffsets,
+				const std::vector<SqVisibilityNode>& nodes );
 
 		//----------------------------------------------
 		// Pure virtual functions
@@ -143,14 +155,54 @@ class CqDisplayRequest : public IqDisplayRequest
 		/* Collapses a row of buckets into a scanline by copying the
 		 * quantized data into a format readable by the display.
 		 * Used when the display wants scanline order.
-		 * Return true if a full row is ready, false otherwise.
+		 * Buckets may arrive in any order.  Return true if the next row
+		 * due at the display is complete, false otherwise.
 		 */
 		virtual bool CollapseBucketsToScanlines(const CqRegion& DRegion);
 		/* Sends the data to the display.
 		*/
 		virtual void SendToDisplay(TqInt ymin, TqInt ymaxplus1);
 
+		/// Quantization settings, as used by the channel converters.
+		struct SqQuantizer
+		{
+			TqFloat zero;
+			TqFloat one;
+			TqFloat min;
+			TqFloat max;
+			TqFloat dither;
+		};
+		/* Convert one display channel for every pixel of a bucket, from the
+		 * channel buffer floats into the display format.  dither holds one
+		 * random sample per pixel, or is null when dithering is off.
+		 */
+		typedef void (*TqChannelConverter)(const TqFloat* src, TqInt srcStride,
+				TqInt numPixels, unsigned char* dest, TqInt destStride,
+				const SqQuantizer& quantizer, const TqFloat* dither);
+
 	protected:
+		/* Get the storage for a scanline which hasn't yet been sent, given as
+		 * a row index relative to the crop window.
+		 */
+		unsigned char* ScanlineRow(TqInt row);
+		/* Make sure the scanline ring can hold all rows from the next one
+		 * due at the display up to rowEnd.
+		 */
+		void ReserveScanlines(TqInt rowEnd);
+
+		/// How to fill in one channel of the data sent to the display.
+		struct SqChannelPlan
+		{
+			std::string bufferChannel;	///< Channel buffer channel name
+			TqInt channelOffset;		///< Component of the buffer channel
+			TqInt byteOffset;			///< Offset into the display element
+			TqChannelConverter convert;
+		};
+		/* Work out how to fill each channel of the display data, once the
+		 * display has settled the channel order and formats.
+		 */
+		void BuildChannelPlan();
+
 		bool			m_valid;
 		std::string 	m_name;
 		std::string 	m_type;
@@ -167,6 +219,7 @@ class CqDisplayRequest : public IqDisplayRequest
 		PtFlagStuff		m_flags;
 		std::vector<PtDspyDevFormat> m_formats;
 		std::map<std::string, std::pair<std::string, TqInt> > m_bufferMap;
+		std::vector<SqChannelPlan> m_channelPlan;
 		TqInt			m_elementSize;
 		TqFloat			m_QuantizeZeroVal;
 		TqFloat			m_QuantizeOneVal;
@@ -187,20 +240,33 @@ class CqDisplayRequest : public IqDisplayRequest
 		//  SqFormattedBucketData.
 		//  Specifically, the stuff which deals with holding the data
 		//  which has been copied out of the bucket and quantized:
-		unsigned char  *m_DataRow;    // A row of bucket's data
 		unsigned char  *m_DataBucket; // A bucket's data
+		std::vector<TqFloat> m_ditherSamples; // Per pixel dither for a bucket
+		// Rows of bucket data waiting to go to a scanline display.  Row y
+		// lives in slot y % m_scanlineRingRows; rows are reused once sent, so
+		// only the band of rows being rendered is held in memory.
+		std::vector<unsigned char> m_scanlineRing;
+		TqInt			m_scanlineRingRows;
+		std::vector<TqInt> m_scanlinePixels; // Pixels received for each row
+		TqInt			m_nextScanline; // Next row to send to a scanline display
 
 };
 
 //---------------------------------------------------------------------
 /** \class CqDeepDisplayRequest
  * Class representing a DSM display request
+ *
+ * Rather than loading a display driver, a deep display collects the
+ * visibility functions computed from the hider's sample hits into a deep
+ * shadow map, which is written to file when the display is closed.  The error
+ * tolerance for the functions may be given with the "tolerance" parameter.
  */
 class CqDeepDisplayRequest : virtual public CqDisplayRequest
 {
 	public:
 		CqDeepDisplayRequest() :
-				CqDisplayRequest()
+				CqDisplayRequest(),
+				m_tolerance(defaultTolerance)
 		{}
 
 		CqDeepDisplayRequest(bool valid, const TqChar* name, const TqChar* type, const TqChar* mode,
@@ -208,25 +274,31 @@ class CqDeepDisplayRequest : virtual public CqDisplayRequest
 		                     TqFloat quantizeMinVal, TqFloat quantizeMaxVal, TqFloat quantizeDitherVal, bool quantizeSpecified, bool quantizeDitherSpecified) :
 				CqDisplayRequest(valid, name, type, mode, modeHash,
 				                 modeID, dataOffset, dataSize, quantizeZeroVal, quantizeOneVal,
-				                 quantizeMinVal, quantizeMaxVal, quantizeDitherVal, quantizeSpecified, quantizeDitherSpecified)
+				                 quantizeMinVal, quantizeMaxVal, quantizeDitherVal, quantizeSpecified, quantizeDitherSpecified),
+				m_tolerance(defaultTolerance)
 		{}
 
-		/* Does quantization, or in the case of DSM does the compression.
+		/// Default error tolerance for the visibility functions.
+		static const TqFloat defaultTolerance;
+
+		/* Create an empty deep shadow map of the given size.
 		 */
-		virtual void FormatBucketForDisplay( const CqRegion& DRegion, const IqChannelBuffer* pBuffer);
-		/* Collapses a row of buckets into a scanline by copying the
-		 * quantized data into a format readable by the display.
-		 * Used when the display wants scanline order.
-		 * Return true if a full row is ready, false otherwise.
+		virtual void LoadDisplayLibrary( SqDDMemberData& ddMemberData, CqSimplePlugin& dspyPlugin, TqInt dspNo, TqInt width, TqInt height );
+		/* Write the deep shadow map to file.
 		 */
-		virtual bool CollapseBucketsToScanlines(const CqRegion& DRegion );
-		/*
-		 * Sends the data to the display.
+		virtual void CloseDisplayLibrary();
+		/* Deep displays ignore the filtered pixel data.
 		 */
-		virtual void SendToDisplay(TqInt ymin, TqInt ymaxplus1);
+		virtual void DisplayBucket( const CqRegion& DRegion, const IqChannelBuffer* pBuffer);
+		virtual TqFloat VisibilityTolerance() const;
+		virtual void DisplayVisibility( const CqRegion& DRegion,
+				const std::vector<TqUint>& pixelOffsets,
+				const std::vector<SqVisibilityNode>& nodes );
 
 	private:
-
+		/// The map being built, while the display is open.
+		boost::shared_ptr<CqDeepShadowMap> m_map;
+		TqFloat m_tolerance;
 };
 
 //---------------------------------------------------------------------
@@ -261,6 +333,8 @@ class CqDDManager : public IqDDManager
 		virtual	TqInt	OpenDisplays(TqInt width, TqInt height);
 		virtual	TqInt	CloseDisplays();
 		virtual	TqInt	DisplayBucket( const CqRegion& DRegion, const IqChannelBuffer* pBucket );
+		virtual	TqFloat	VisibilityTolerance();
+		virtual	TqInt	DisplayVisibility( const CqRegion& DRegion, const std::vector<TqUint>& pixelOffsets, const std::vector<SqVisibilityNode>& nodes );
 		virtual	bool	fDisplayNeeds( const TqChar* var );
 		virtual	TqInt	Uses();
 
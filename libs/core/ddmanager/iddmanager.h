@@ -30,12 +30,14 @@
 #include	<aqsis/aqsis.h>
 
 #include	<map>
+#include	<vector>
 #include	<boost/shared_ptr.hpp>
 
 
 namespace Aqsis {
 
 struct SqImageSample;
+struct SqVisibilityNode;
 struct IqRenderer;
 class CqRegion;
 class CqParameter;
@@ -48,6 +50,8 @@ struct IqChannelBuffer
 		virtual TqInt width() const = 0;
 		virtual TqInt height() const = 0;
 		virtual TqInt getChannelIndex(const std::string& name) const = 0;
+		/// Number of floats stored for each pixel; pixels are contiguous.
+		virtual TqInt pixelSize() const = 0;
 
 		typedef std::vector<TqFloat> TqChannelValues;
 		typedef TqChannelValues::iterator TqChannelPtr;
@@ -96,6 +100,17 @@ struct IqDDManager
 	/** Display a bucket.
 	 */
 	virtual	TqInt	DisplayBucket( const CqRegion& DRegion, const IqChannelBuffer* pBuffer ) = 0;
+	/** Get the error tolerance for the visibility functions wanted by deep
+	 * displays, or a negative value if no display wants them.
+	 */
+	virtual	TqFloat	VisibilityTolerance() = 0;
+	/** Display the visibility functions for the pixels of a bucket.
+	 *
+	 * \param pixelOffsets - start of the function for each pixel of the
+	 *                       region in nodes, plus the end of the last.
+	 * \param nodes - compressed visibility functions for all the pixels.
+	 */
+	virtual	TqInt	DisplayVisibility( const CqRegion& DRegion, const std::vector<TqUint>& pixelOffsets, const std::vector<SqVisibilityNode>& nodes ) = 0;
 	/** Determine if any of the displays need the named shader variable.
 	 */
 	virtual bool	fDisplayNeeds( const TqChar* var) = 0;
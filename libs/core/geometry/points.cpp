@@ -582,6 +582,7 @@ void CqMicroPolyGridPoints::Split( long xmin, long xmax, long ymin, long ymax )
 
 				pNew->AppendKey( Point, radius, keyTimes[iTime] );
 			}
+			pNew->BuildBoundList( 0 );
 			boost::shared_ptr<CqMicroPolygon> pMP( pNew );
 			QGetRenderContext()->pImage()->AddMPG( pMP );
 		}
@@ -815,6 +816,7 @@ void CqMotionMicroPolyGridPoints::Split( long xmin, long xmax, long ymin, long y
 
 			pNew->AppendKey( Point, radius, Time( iTime ) );
 		}
+		pNew->BuildBoundList( 0 );
 		boost::shared_ptr<CqMicroPolygon> pMP( pNew );
 		QGetRenderContext()->pImage()->AddMPG( pMP );
 	}
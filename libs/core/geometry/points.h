@@ -465,20 +465,22 @@ class CqMicroPolygonMotionPoints : public CqMicroPolygon
 		void	DeleteVariables( bool all )
 		{}
 
+		/** The bound list is built by the grid once all the keys have been
+		 * added, rather than on demand, as the micropolygon may be sampled by
+		 * several buckets at once.
+		 */
 		virtual	TqInt	cSubBounds( TqUint timeRanges )
 		{
-			if ( !m_BoundReady )
-				BuildBoundList( timeRanges );
 			return ( m_BoundList.Size() );
 		}
-		virtual	CqBound			SubBound( TqInt iIndex, TqFloat& time )
+		virtual	CqBound			SubBound( TqInt iIndex, TqFloat& time ) const
 		{
 			if ( !m_BoundReady )
 			{
 				Aqsis::log() << error << "MP Bound list not ready" << std::endl;
 				AQSIS_THROW_XQERROR(XqInternal, EqE_Bug, "MP error");
 			}
-			assert( iIndex < m_BoundList.Size() );
+			assert( iIndex < static_cast<TqInt>(m_BoundList.Size()) );
 			time = m_BoundList.GetTime( iIndex );
 			return ( m_BoundList.GetBound( iIndex ) );
 		}
@@ -30,13 +30,24 @@
 
 #include "procedural.h"
 
+#include <cmath>
 #include <cstdio>
 #include <cstring>
+#include <ctime>
+#include <deque>
 #include <list>
+#include <sstream>
 
+#include <boost/bind.hpp>
+#include <boost/filesystem/operations.hpp>
 #include <boost/tokenizer.hpp>
+#ifdef ENABLE_THREADING
+#	include <boost/scoped_ptr.hpp>
+#	include <boost/thread/thread.hpp>
+#endif
 
 #include "renderer.h"
+#include "ribstreamend.h"
 #include <aqsis/util/file.h>
 #include <aqsis/util/plugins.h>
 #include <aqsis/core/corecontext.h>
@@ -79,11 +90,7 @@ TqInt CqProcedural::Split( std::vector<boost::shared_ptr<CqSurface> >& aSplits )
 
 	m_pconStored->m_ptransCurrent = m_pTransform;
 
-	/// \note: The bound is in "raster" coordinates by now, as during posting to the imagebuffer
-	/// the the Culling routines do the job for us, see CqSurface::CacheRasterBound.
-	CqBound bound = m_Bound;
-	//    bound.Transform(QGetRenderContext()->matSpaceToSpace("camera", "raster"));
-	float detail = ( bound.vecMax().x() - bound.vecMin().x() ) * ( bound.vecMax().y() - bound.vecMin().y() );
+	float detail = Detail();
 	//std::cout << "detail: " << detail << std::endl;
 
 	// Call the procedural secific Split()
@@ -113,6 +120,31 @@ void    CqProcedural::Transform( const CqMatrix& matTx, const CqMatrix& matITTx,
 }
 
 
+void CqProcedural::CacheRasterBound( CqBound& pBound )
+{
+	CqSurface::CacheRasterBound( pBound );
+	if( m_pSubdivFunc == &RiProcRunProgram )
+	{
+		char** args = reinterpret_cast<char**>( m_pData );
+		QGetRenderContext()->runPrograms().prefetch( args[0], args[1], Detail() );
+	}
+	else if( m_pSubdivFunc == &RiProcDelayedReadArchive )
+	{
+		char** args = reinterpret_cast<char**>( m_pData );
+		prefetchArchive( args[0] );
+	}
+}
+
+
+TqFloat CqProcedural::Detail() const
+{
+	/// \note: The bound is in "raster" coordinates by now, as during posting to the imagebuffer
+	/// the the Culling routines do the job for us, see CqSurface::CacheRasterBound.
+	const CqBound& bound = m_Bound;
+	return ( bound.vecMax().x() - bound.vecMin().x() ) * ( bound.vecMax().y() - bound.vecMin().y() );
+}
+
+
 /**
  * CqProcedural destructor.
  */
@@ -222,33 +254,55 @@ class CqRiProceduralPlugin : CqPluginBase
 // they must remain linked in.
 static std::list<boost::shared_ptr<CqRiProceduralPlugin> > ActiveProcDLList;
 
+namespace {
 
+/// Check whether Option "limits" "proceduralcache" is turned on.
+bool proceduralCacheEnabled()
+{
+	const TqInt* enabled = QGetRenderContext()->poptCurrent()->GetIntegerOption(
+			"limits", "proceduralcache");
+	return enabled && enabled[0] > 0;
+}
 
+/// Get the modification time of a file used by a cached procedural.
+///
+/// Returns false if the time can't be read, in which case the procedural
+/// should be run without the cache.
+bool cacheModifiedTime(const boostfs::path& path, std::time_t& modifiedTime)
+{
+	try
+	{
+		modifiedTime = boostfs::last_write_time(path);
+		return true;
+	}
+	catch(std::exception& e)
+	{
+		Aqsis::log() << warning << "Could not check \"" << native(path)
+			<< "\" for the procedural cache: " << e.what() << std::endl;
+		return false;
+	}
+}
 
-
-} // namespace Aqsis
-
-using namespace Aqsis;
-
-//----------------------------------------------------------------------
-// RiProcFree()
-//
-extern "C" RtVoid	RiProcFree( RtPointer data )
+/// Find a procedural DSO in the same way as CqRiProceduralPlugin.
+boostfs::path findProceduralDso(const std::string& dsoName)
 {
-	free(data);
+	boostfs::path dsoPath = QGetRenderContext()->poptCurrent()
+		->findRiFileNothrow(dsoName, "procedural");
+	if(dsoPath.empty())
+		dsoPath = QGetRenderContext()->poptCurrent()->findRiFileNothrow(
+				dsoName + SHARED_LIBRARY_SUFFIX, "procedural");
+	return dsoPath;
 }
 
-//----------------------------------------------------------------------
-// RiProcDynamicLoad() subdivide function
-//
-extern "C" RtVoid	RiProcDynamicLoad( RtPointer data, RtFloat detail )
+/// Load a procedural DSO, and use it to subdivide.
+void runDynamicLoad(const char* name, char* args, RtFloat detail)
 {
-	CqString dsoname = CqString( (( char** ) data)[0] );
+	CqString dsoname = CqString(name);
 	boost::shared_ptr<CqRiProceduralPlugin> plugin(new CqRiProceduralPlugin(dsoname));
 
 	if( !plugin->IsValid() )
 	{
-		dsoname = CqString( (( char** ) data)[0] ) + CqString(SHARED_LIBRARY_SUFFIX);
+		dsoname = CqString(name) + CqString(SHARED_LIBRARY_SUFFIX);
 		plugin.reset(new CqRiProceduralPlugin(dsoname));
 
 		if( !plugin->IsValid() )
@@ -258,7 +312,7 @@ extern "C" RtVoid	RiProcDynamicLoad( RtPointer data, RtFloat detail )
 		}
 	}
 
-	plugin->ConvertParameters( (( char** ) data)[1] );
+	plugin->ConvertParameters( args );
 	plugin->Subdivide( detail );
 	plugin->Free();
 
@@ -267,12 +321,78 @@ extern "C" RtVoid	RiProcDynamicLoad( RtPointer data, RtFloat detail )
 	STATS_INC( GEO_prc_created_dl );
 }
 
+/// Read the archive of a DelayedReadArchive procedural.
+void runDelayedReadArchive(const char* name)
+{
+	RiReadArchive( const_cast<RtToken>(name), NULL, RI_NULL );
+}
+
+} // unnamed namespace
+
+
+
+
+
+} // namespace Aqsis
+
+using namespace Aqsis;
+
+//----------------------------------------------------------------------
+// RiProcFree()
+//
+extern "C" RtVoid	RiProcFree( RtPointer data )
+{
+	free(data);
+}
+
+//----------------------------------------------------------------------
+// RiProcDynamicLoad() subdivide function
+//
+extern "C" RtVoid	RiProcDynamicLoad( RtPointer data, RtFloat detail )
+{
+	const char* name = (( char** ) data)[0];
+	char* args = (( char** ) data)[1];
+	if(proceduralCacheEnabled())
+	{
+		boostfs::path dsoPath = findProceduralDso(name);
+		std::time_t modifiedTime = 0;
+		if(!dsoPath.empty() && cacheModifiedTime(dsoPath, modifiedTime))
+		{
+			// Details within a factor of two share their calls, so that small
+			// changes in screen size between frames still use the cache.
+			int detailLevel = 0;
+			std::frexp(detail, &detailLevel);
+			std::ostringstream key;
+			key << "DynamicLoad\n" << native(dsoPath) << "\n" << args << "\n"
+				<< detailLevel;
+			cacheProceduralCalls(key.str(), modifiedTime, true,
+					boost::bind(runDynamicLoad, name, args, detail));
+			return;
+		}
+	}
+	runDynamicLoad(name, args, detail);
+}
+
 //----------------------------------------------------------------------
 // RiProcDelayedReadArchive()
 //
 extern "C" RtVoid	RiProcDelayedReadArchive( RtPointer data, RtFloat detail )
 {
-	RiReadArchive( (RtToken) ((char**) data)[0], NULL, RI_NULL );
+	const char* name = ((char**) data)[0];
+	boostfs::path archivePath;
+	if(proceduralCacheEnabled())
+		archivePath = QGetRenderContext()->poptCurrent()->findRiFileNothrow(
+				name, "archive");
+	std::time_t modifiedTime = 0;
+	if(!archivePath.empty() && cacheModifiedTime(archivePath, modifiedTime))
+	{
+		// Archives are already files, so aren't saved in the cache directory.
+		cacheProceduralCalls("DelayedReadArchive\n" + native(archivePath),
+				modifiedTime, false,
+				boost::bind(runDelayedReadArchive, name));
+	}
+	else
+		runDelayedReadArchive(name);
 	STATS_INC( GEO_prc_created_dra );
 }
 
@@ -280,21 +400,390 @@ extern "C" RtVoid	RiProcDelayedReadArchive( RtPointer data, RtFloat detail )
 //------------------------------------------------------------------------------
 // CqRunProgramRepository implementation
 //
-std::iostream* CqRunProgramRepository::find(const std::string& command)
+namespace Aqsis {
+
+/// A request for RIB from a RunProgram child process.
+struct CqRunProgramRepository::SqRequest
 {
-	TqRunProgramMap::iterator pos = m_activeRunPrograms.find(command);
-	if(pos == m_activeRunPrograms.end())
-		return startNewRunProgram(command);
+	enum EqState
+	{
+		State_Pending,
+		State_Done,
+		State_Failed
+	};
+
+	/// Line written to the child stdin.
+	std::string input;
+	/// RIB written by the child, once done.
+	boost::shared_ptr<const std::string> rib;
+	EqState state;
+	/// Child which answers the request.
+	CqChild* child;
+	/// True once the result has been used.
+	bool used;
+	/// Position in CqRunProgramRepository::m_used, once used.
+	TqUsedList::iterator usedPos;
+
+	SqRequest(const std::string& input, CqChild* child)
+		: input(input),
+		rib(),
+		state(State_Pending),
+		child(child),
+		used(false),
+		usedPos()
+	{ }
+};
+
+/** \brief A RunProgram child process and the requests sent to it.
+ *
+ * Requests are answered in the order they are sent, so the child keeps them
+ * in a queue until their RIB has been read.
+ */
+class CqRunProgramRepository::CqChild : boost::noncopyable
+{
+	public:
+		/// Start the child process, throwing XqEnvironment on failure.
+		CqChild(CqRunProgramRepository& repository, const std::string& progName,
+				const std::vector<std::string>& argv);
+		/// Close the child stdin, and wait for the outstanding requests.
+		~CqChild();
+
+		/// Number of requests not yet answered; the caller holds m_mutex.
+		TqInt numPending() const;
+		/// True once the child has exited; the caller holds m_mutex.
+		bool broken() const;
+		/// True once the child has answered a request; the caller holds m_mutex.
+		bool answered() const;
+
+		/** \brief Queue a request; the caller holds m_mutex.
+		 *
+		 * The request is written to the child stdin by the next call to
+		 * send(), which keeps the order of the input and output the same.
+		 */
+		void queue(const TqRequestPtr& request);
+		/// Write the queued requests to the child process.
+		void send();
+		/** \brief Read the RIB for the oldest unanswered request.
+		 *
+		 * \return false if there were no more requests, or the child exited.
+		 */
+		bool readNext();
+
+	private:
+		/// Read RIB up to the '\377' byte which ends it into rib.
+		bool readRib(std::string& rib);
+#		ifdef ENABLE_THREADING
+		/// Read RIB for requests until the child is closed or exits.
+		void readLoop();
+#		endif
+
+		CqRunProgramRepository& m_repository;
+		CqPopenDevice m_pipe;
+		/// Requests sent or queued, but not yet answered.
+		std::deque<TqRequestPtr> m_pending;
+		/// Requests queued to be written to the child.
+		std::deque<TqRequestPtr> m_unsent;
+		/// Characters read beyond the end of the last RIB.
+		std::string m_readBuf;
+		/// Scanner for the end of the RIB in m_readBuf.
+		CqRibStreamEnd m_ribEnd;
+		bool m_broken;
+		bool m_answered;
+		bool m_closing;
+#		ifdef ENABLE_THREADING
+		/// Held while writing to the child stdin.
+		boost::mutex m_sendMutex;
+		/// Signalled when a request is queued or the child is closed.
+		boost::condition m_requestQueued;
+		/// Thread reading the child stdout.
+		boost::scoped_ptr<boost::thread> m_reader;
+#		endif
+};
+
+CqRunProgramRepository::CqChild::CqChild(CqRunProgramRepository& repository,
+		const std::string& progName, const std::vector<std::string>& argv)
+	: m_repository(repository),
+	m_pipe(progName, argv),
+	m_pending(),
+	m_unsent(),
+	m_readBuf(),
+	m_ribEnd(),
+	m_broken(false),
+	m_answered(false),
+	m_closing(false)
+{
+#	ifdef ENABLE_THREADING
+	m_reader.reset(new boost::thread(boost::bind(&CqChild::readLoop, this)));
+#	endif
+}
+
+CqRunProgramRepository::CqChild::~CqChild()
+{
+	{
+#		ifdef ENABLE_THREADING
+		boost::mutex::scoped_lock lock(m_repository.m_mutex);
+#		endif
+		m_closing = true;
+#		ifdef ENABLE_THREADING
+		m_requestQueued.notify_all();
+#		endif
+	}
+	// The child should exit when it sees the end of its input.
+	m_pipe.close(std::ios_base::out);
+#	ifdef ENABLE_THREADING
+	m_reader->join();
+#	endif
+}
+
+inline TqInt CqRunProgramRepository::CqChild::numPending() const
+{
+	return m_pending.size();
+}
+
+inline bool CqRunProgramRepository::CqChild::broken() const
+{
+	return m_broken;
+}
+
+inline bool CqRunProgramRepository::CqChild::answered() const
+{
+	return m_answered;
+}
+
+void CqRunProgramRepository::CqChild::queue(const TqRequestPtr& request)
+{
+	m_pending.push_back(request);
+	m_unsent.push_back(request);
+#	ifdef ENABLE_THREADING
+	m_requestQueued.notify_one();
+#	endif
+}
+
+void CqRunProgramRepository::CqChild::send()
+{
+#	ifdef ENABLE_THREADING
+	// m_repository.m_mutex isn't held while writing: the child may not read
+	// more input until the reader thread has taken some of its output, which
+	// needs the lock.
+	boost::mutex::scoped_lock sendLock(m_sendMutex);
+#	endif
+	while(true)
+	{
+		TqRequestPtr request;
+		{
+#			ifdef ENABLE_THREADING
+			boost::mutex::scoped_lock lock(m_repository.m_mutex);
+#			endif
+			if(m_unsent.empty())
+				return;
+			request = m_unsent.front();
+			m_unsent.pop_front();
+		}
+		try
+		{
+			m_pipe.write(request->input.c_str(), request->input.size());
+		}
+		catch(std::ios_base::failure& /*e*/)
+		{
+			// The child has exited, which is detected when reading its
+			// output, so the request fails there.
+		}
+	}
+}
+
+bool CqRunProgramRepository::CqChild::readNext()
+{
+	TqRequestPtr request;
+	{
+#		ifdef ENABLE_THREADING
+		boost::mutex::scoped_lock lock(m_repository.m_mutex);
+		while(m_pending.empty() && !m_closing)
+			m_requestQueued.wait(lock);
+#		endif
+		if(m_pending.empty() || m_broken)
+			return false;
+		request = m_pending.front();
+	}
+	boost::shared_ptr<std::string> rib(new std::string());
+	bool ok = readRib(*rib);
+#	ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_repository.m_mutex);
+#	endif
+	if(ok)
+	{
+		m_pending.pop_front();
+		m_answered = true;
+		request->rib = rib;
+		request->state = SqRequest::State_Done;
+	}
 	else
 	{
-		std::iostream* pipe = pos->second.get();
-		if(pipe && (pipe->fail() || pipe->eof()))
+		// The child has exited, so none of the outstanding requests will be
+		// answered.
+		m_broken = true;
+		for(std::deque<TqRequestPtr>::iterator i = m_pending.begin();
+				i != m_pending.end(); ++i)
+			(*i)->state = SqRequest::State_Failed;
+		m_pending.clear();
+	}
+#	ifdef ENABLE_THREADING
+	m_repository.m_resultReady.notify_all();
+#	endif
+	return ok;
+}
+
+bool CqRunProgramRepository::CqChild::readRib(std::string& rib)
+{
+	const std::streamsize bufSize = 4096;
+	char buf[bufSize];
+	while(true)
+	{
+		// Anything after the end of the RIB is the start of the RIB for the
+		// next request.
+		std::string::size_type end = m_ribEnd.find(m_readBuf);
+		if(end != std::string::npos)
 		{
-			pos->second.reset();
-			pipe = 0;
+			rib.assign(m_readBuf, 0, end);
+			m_readBuf.erase(0, end + 1);
+			return true;
 		}
-		return pipe;
+		std::streamsize nRead = -1;
+		try
+		{
+			nRead = m_pipe.read(buf, bufSize);
+		}
+		catch(std::ios_base::failure& /*e*/)
+		{ }
+		if(nRead <= 0)
+			return false;
+		m_readBuf.append(buf, nRead);
+	}
+}
+
+#ifdef ENABLE_THREADING
+void CqRunProgramRepository::CqChild::readLoop()
+{
+	while(readNext())
+	{ }
+}
+#endif
+
+
+//------------------------------------------------------------------------------
+CqRunProgramRepository::SqRequestKey::SqRequestKey(const std::string& command,
+		const std::string& data, TqFloat detail)
+	: command(command),
+	data(data),
+	detail(detail)
+{ }
+
+bool CqRunProgramRepository::SqRequestKey::operator<(
+		const SqRequestKey& rhs) const
+{
+	if(detail != rhs.detail)
+		return detail < rhs.detail;
+	if(command != rhs.command)
+		return command < rhs.command;
+	return data < rhs.data;
+}
+
+CqRunProgramRepository::SqPool::SqPool()
+	: children(),
+	exited(),
+	answered(false),
+	error(),
+	errorCode(0),
+	errorReported(false)
+{ }
+
+
+//------------------------------------------------------------------------------
+CqRunProgramRepository::CqRunProgramRepository()
+	: m_maxProcesses(1),
+	m_pools(),
+	m_requests(),
+	m_used(),
+	m_usedSize(0)
+{ }
+
+CqRunProgramRepository::~CqRunProgramRepository()
+{
+	// The children refer to m_mutex, so must go first.
+	m_requests.clear();
+	m_pools.clear();
+}
+
+void CqRunProgramRepository::setMaxProcesses(TqInt maxProcesses)
+{
+#	ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_mutex);
+#	endif
+	m_maxProcesses = std::max(maxProcesses, 1);
+}
+
+void CqRunProgramRepository::prefetch(const std::string& command,
+		const std::string& data, TqFloat detail)
+{
+	// Without a reader thread, nothing takes the output of a busy child, so
+	// it could block forever writing RIB while we wait to write it the next
+	// request.  Requests are then only made when the RIB is needed.
+#	ifdef ENABLE_THREADING
+	CqChild* sendTo = 0;
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+		findRequest(SqRequestKey(command, data, detail), false, sendTo);
+	}
+	if(sendTo)
+		sendTo->send();
+#	endif
+}
+
+boost::shared_ptr<const std::string> CqRunProgramRepository::generate(
+		const std::string& command, const std::string& data, TqFloat detail)
+{
+	CqChild* sendTo = 0;
+	TqRequestPtr request;
+	SqRequestKey key(command, data, detail);
+	{
+#		ifdef ENABLE_THREADING
+		boost::mutex::scoped_lock lock(m_mutex);
+#		endif
+		request = findRequest(key, true, sendTo);
+	}
+	if(!request)
+		return boost::shared_ptr<const std::string>();
+	if(sendTo)
+		sendTo->send();
+	{
+#		ifdef ENABLE_THREADING
+		boost::mutex::scoped_lock lock(m_mutex);
+		while(request->state == SqRequest::State_Pending)
+			m_resultReady.wait(lock);
+#		else
+		// Read the answers to earlier requests sent to the same child first.
+		while(request->state == SqRequest::State_Pending
+				&& request->child->readNext())
+		{ }
+#		endif
+		if(request->state == SqRequest::State_Done)
+			markUsed(key, request);
+	}
+	if(request->state == SqRequest::State_Failed)
+	{
+		Aqsis::log() << error << "RiProcRunProgram: Broken pipe for RunProgram ["
+			<< command << "]  (premature exit?)\n";
 	}
+	return request->rib;
+}
+
+void CqRunProgramRepository::clearCache()
+{
+#	ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_mutex);
+#	endif
+	m_requests.clear();
+	m_used.clear();
+	m_usedSize = 0;
 }
 
 /** \brief Split the given command line up into a set of tokens seperated with
@@ -312,10 +801,112 @@ void CqRunProgramRepository::splitCommandLine(const std::string& command,
 		argv.push_back(*i);
 }
 
-/** \brief Start a new child process for the given RunProgram command
- */
-TqPopenStream* CqRunProgramRepository::startNewRunProgram(
-		const std::string& command)
+CqRunProgramRepository::TqRequestPtr CqRunProgramRepository::findRequest(
+		const SqRequestKey& key, bool reportErrors, CqChild*& sendTo)
+{
+	sendTo = 0;
+	TqRequestMap::iterator cached = m_requests.find(key);
+	if(cached != m_requests.end())
+		return cached->second;
+	SqPool& pool = m_pools[key.command];
+	if(!pool.error.empty())
+	{
+		// Report errors from starting the child once only.
+		if(reportErrors && !pool.errorReported)
+		{
+			pool.errorReported = true;
+			throw XqEnvironment(pool.errorCode, pool.error, __FILE__, __LINE__);
+		}
+		return TqRequestPtr();
+	}
+	// Children which have exited are replaced, unless none has ever
+	// answered a request, which means the program itself is broken.
+	for(std::vector<boost::shared_ptr<CqChild> >::iterator
+			i = pool.children.begin(); i != pool.children.end();)
+	{
+		if((*i)->answered())
+			pool.answered = true;
+		if((*i)->broken())
+		{
+			pool.exited.push_back(*i);
+			i = pool.children.erase(i);
+		}
+		else
+			++i;
+	}
+	if(!pool.exited.empty() && !pool.answered)
+	{
+		// The failed requests have already been reported.
+		pool.error = "RunProgram [" + key.command + "] exited prematurely";
+		pool.errorCode = EqE_System;
+		pool.errorReported = true;
+		return TqRequestPtr();
+	}
+	// Choose the least busy child.
+	CqChild* child = 0;
+	for(TqInt i = 0, end = pool.children.size(); i < end; ++i)
+	{
+		CqChild* c = pool.children[i].get();
+		if(!child || c->numPending() < child->numPending())
+			child = c;
+	}
+	if(!child || (child->numPending() > 0
+			&& static_cast<TqInt>(pool.children.size()) < m_maxProcesses))
+	{
+		try
+		{
+			pool.children.push_back(startChild(key.command));
+			child = pool.children.back().get();
+		}
+		catch(XqException& e)
+		{
+			// Remember the error, so that we don't try to run this procedural
+			// again, and report it now if possible.
+			pool.error = e.what();
+			pool.errorCode = e.code();
+			if(reportErrors)
+			{
+				pool.errorReported = true;
+				throw;
+			}
+			return TqRequestPtr();
+		}
+	}
+	std::ostringstream input;
+	input << key.detail << " " << key.data << "\n";
+	TqRequestPtr request(new SqRequest(input.str(), child));
+	child->queue(request);
+	m_requests.insert(std::make_pair(key, request));
+	sendTo = child;
+	return request;
+}
+
+void CqRunProgramRepository::markUsed(const SqRequestKey& key,
+		const TqRequestPtr& request)
+{
+	if(request->used)
+	{
+		m_used.splice(m_used.end(), m_used, request->usedPos);
+		return;
+	}
+	// The cache may have been cleared while the request was answered.
+	TqRequestMap::iterator cached = m_requests.find(key);
+	if(cached == m_requests.end() || cached->second != request)
+		return;
+	request->used = true;
+	request->usedPos = m_used.insert(m_used.end(), key);
+	m_usedSize += request->rib->size();
+	while(m_usedSize > maxCachedRib)
+	{
+		TqRequestMap::iterator oldest = m_requests.find(m_used.front());
+		m_usedSize -= oldest->second->rib->size();
+		m_requests.erase(oldest);
+		m_used.pop_front();
+	}
+}
+
+boost::shared_ptr<CqRunProgramRepository::CqChild>
+CqRunProgramRepository::startChild(const std::string& command)
 {
 	// Get the program name and command line arguments.
 	std::vector<std::string> argv;
@@ -335,52 +926,36 @@ TqPopenStream* CqRunProgramRepository::startNewRunProgram(
 	try
 	{
 		// Attempt to open a pipe to the new procedural.
-		TqPopenStreamPtr newPipe(new TqPopenStream(progName, argv));
-		newPipe->exceptions(std::ios::badbit | std::ios::failbit | std::ios::eofbit);
-		m_activeRunPrograms.insert(std::make_pair(command, newPipe));
-		return newPipe.get();
+		return boost::shared_ptr<CqChild>(new CqChild(*this, progName, argv));
 	}
 	catch(XqEnvironment& e)
 	{
-		// Install a null pointer to indicate that we shouldn't try to run this
-		// procedural again, and rethrow.
-		m_activeRunPrograms.insert(std::make_pair(command, TqPopenStreamPtr()));
 		AQSIS_THROW_XQERROR(XqEnvironment, e.code(),
 			"error starting runprogram [" << command << "] : " << e.what() );
 	}
 }
 
+} // namespace Aqsis
 
-//------------------------------------------------------------------------------
 
-// Global runprogram repository.
-// TODO: Make this a member of CqRenderer, making sure that runprogram file
-// handles and processes get correctly closed at destruction time.
-static CqRunProgramRepository g_activeRunPrograms;
+//------------------------------------------------------------------------------
 
 extern "C" RtVoid	RiProcRunProgram( RtPointer data, RtFloat detail )
 {
 	try
 	{
 		char** args = reinterpret_cast<char**>(data);
-		// Get a pipe connected to the procedural
 		std::string command = args[0];
-		std::iostream* pipe = g_activeRunPrograms.find(command);
-		if(!pipe)
+		// Get the RIB generated by the procedural, waiting for it if it was
+		// started ahead of time.
+		boost::shared_ptr<const std::string> rib
+			= QGetRenderContext()->runPrograms().generate(command, args[1], detail);
+		if(!rib)
 			return;
-		try
-		{
-			// Push in the procedural arguments
-			(*pipe) << detail << " " << args[1] << "\n" << std::flush;
-			// And parse the resulting RIB from the pipe.
-			cxxRenderContext()->parseRib(*pipe, ("[" + command + "]").c_str());
-			STATS_INC( GEO_prc_created_prp );
-		}
-		catch(std::ios_base::failure& /*e*/)
-		{
-			Aqsis::log() << error << "RiProcRunProgram: Broken pipe for RunProgram ["
-				<< command << "]  (premature exit?)\n";
-		}
+		// And parse the resulting RIB.
+		std::istringstream ribStream(*rib);
+		cxxRenderContext()->parseRib(ribStream, ("[" + command + "]").c_str());
+		STATS_INC( GEO_prc_created_prp );
 	}
 	// TODO: Replace the following catches with a catch guard.
 	catch(const XqValidation& e)
@@ -404,4 +979,3 @@ extern "C" RtVoid	RiProcRunProgram( RtPointer data, RtFloat detail )
 				const_cast<char*>("unknown exception encountered"));
 	}
 }
-
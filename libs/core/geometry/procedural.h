@@ -29,9 +29,19 @@
 
 #include <aqsis/aqsis.h>
 
+#include <ctime>
+#include <list>
 #include <map>
+#include <string>
+#include <vector>
 
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
+#ifdef ENABLE_THREADING
+#	include <boost/thread/condition.hpp>
+#	include <boost/thread/mutex.hpp>
+#endif
 
 #include <aqsis/math/matrix.h>
 #include <aqsis/util/popen.h>
@@ -55,6 +65,12 @@ class CqProcedural : public CqSurface
 		 */
 		virtual	TqInt	Split( std::vector<boost::shared_ptr<CqSurface> >& aSplits );
 		virtual ~CqProcedural();
+		/** Cache the raster bound.  RunProgram procedurals also start
+		 * generating their RIB here, since the detail is now known, and
+		 * DelayedReadArchive procedurals start parsing their archive, since
+		 * they've survived culling.
+		 */
+		virtual void CacheRasterBound( CqBound& pBound );
 
 		//---------------------------------------------- Inlined Public Methods
 	public:
@@ -113,6 +129,9 @@ class CqProcedural : public CqSurface
 		}
 		//------------------------------------------------------ Protexted
 	protected:
+		/// Detail passed to the subdivide function: the raster area of the bound.
+		TqFloat Detail() const;
+
 		/* Contexy saved when the Procedural was declared */
 		boost::shared_ptr<CqModeBlock> m_pconStored;
 
@@ -125,27 +144,61 @@ class CqProcedural : public CqSurface
 
 
 //------------------------------------------------------------------------------
-/** \brief Manager for child process streams created by RiProcRunProgram invocations.
+/** \brief Manager for child processes created by RiProcRunProgram invocations.
+ *
+ * The repository keeps a pool of child processes for each distinct RunProgram
+ * command.  Each request of the form "detail data\n" is written to the least
+ * busy child as soon as it's made, without waiting for the answers to earlier
+ * requests, so several children may be generating RIB at once.  A new child
+ * is started whenever all the existing ones are busy, up to a limit set with
+ * setMaxProcesses().  The RIB is read up to the terminating '\377' byte,
+ * skipping over binary encoded data which may contain the same byte; with
+ * threading enabled this is done by a reader thread for each child, otherwise
+ * when the result is asked for.
  *
- * The repository keeps track of a seperate child process stream for each
- * distinct RunProgram command.  These can be retrieved using the find()
- * function in order to generate further RIB.
+ * Results are cached by command, data and detail until clearCache() is called
+ * at the end of the frame, so repeated identical requests only run the
+ * program once; the raytracer and the main pipeline both expand the same
+ * procedurals, for instance.  Results which have been used are kept until
+ * they take up more than maxCachedRib bytes, after which the least recently
+ * used ones are dropped.  Results made by prefetch() are always kept until
+ * they're used.
+ *
+ * All methods are safe to call concurrently.
  */
-class CqRunProgramRepository
+class CqRunProgramRepository : boost::noncopyable
 {
 	public:
-		/** \brief Get an iostream pipe connected to the stdin and stdout of
-		 * a child RunProgram process.
+		CqRunProgramRepository();
+		/// Close the pipes to all child processes, and wait for them to finish.
+		~CqRunProgramRepository();
+
+		/** \brief Set the maximum number of child processes for each command.
+		 *
+		 * Commands which already have more children keep them.
+		 */
+		void setMaxProcesses(TqInt maxProcesses);
+
+		/** \brief Start generating RIB for a request without waiting.
+		 *
+		 * Any error is reported by a later call to generate() for the same
+		 * command.
+		 */
+		void prefetch(const std::string& command, const std::string& data,
+				TqFloat detail);
+
+		/** \brief Get the RIB generated by a child RunProgram process.
 		 *
-		 * If no child process corresponding to 'command' is currently running,
-		 * a new process is started and the stdin and stdout connected to a
-		 * pipe stream which is returned.
+		 * Waits for the RIB if the request is still being answered, and
+		 * makes the request first if it hasn't been made before.
 		 *
-		 * If an error occurs during creation of the child process, an
-		 * XqEnvironment exception will be throw.  Subsequent calls to find()
-		 * will then result in a null pointer being returned.  In addition,
-		 * streams which have their eof() or fail() bits set will be deleted
-		 * and a null pointer returned.
+		 * If an error occurs during creation of the child processes for a
+		 * command, an XqEnvironment exception will be thrown.  Subsequent calls
+		 * for the command will then return a null pointer.  If a child exits
+		 * prematurely, the requests sent to it return null, and later
+		 * requests go to the other children or a replacement.  A child which
+		 * exits before any child for the command has answered a request
+		 * means the program is broken, so all later calls return null.
 		 *
 		 * \param command - command line for the child process.  The command
 		 * line will be split up into arguments delimited by whitespace, with
@@ -153,23 +206,125 @@ class CqRunProgramRepository
 		 * mechanism for whitespace is currently supported.  The program is
 		 * searched for in the procedural searchpath, with the system path as a
 		 * fallback.
+		 * \param data - data string passed to the program.
+		 * \param detail - detail passed to the program.
 		 */
-		std::iostream* find(const std::string& command);
+		boost::shared_ptr<const std::string> generate(const std::string& command,
+				const std::string& data, TqFloat detail);
+
+		/// Forget all cached results.  Child processes are kept running.
+		void clearCache();
+
+		/// Total size of the used results which are kept in the cache.
+		static const TqUint maxCachedRib = 64*1024*1024;
 
 	private:
-		typedef boost::shared_ptr<TqPopenStream> TqPopenStreamPtr;
-		typedef std::map<std::string, TqPopenStreamPtr> TqRunProgramMap;
+		class CqChild;
+		struct SqRequest;
+		typedef boost::shared_ptr<SqRequest> TqRequestPtr;
+
+		/// Key under which requests are cached.
+		struct SqRequestKey
+		{
+			std::string command;
+			std::string data;
+			TqFloat detail;
+
+			SqRequestKey(const std::string& command, const std::string& data,
+					TqFloat detail);
+			bool operator<(const SqRequestKey& rhs) const;
+		};
+		typedef std::map<SqRequestKey, TqRequestPtr> TqRequestMap;
+		/// Keys of the used requests, least recently used first.
+		typedef std::list<SqRequestKey> TqUsedList;
+
+		/// Child processes for a single command.
+		struct SqPool
+		{
+			std::vector<boost::shared_ptr<CqChild> > children;
+			/** Children which have exited.  They're kept until the
+			 * repository is destroyed, since waiting for their reader
+			 * threads needs m_mutex, which is held when they're found.
+			 */
+			std::vector<boost::shared_ptr<CqChild> > exited;
+			/// True once any child has answered a request.
+			bool answered;
+			/// Error from starting a child; the pool isn't used once set.
+			std::string error;
+			TqInt errorCode;
+			bool errorReported;
+
+			SqPool();
+		};
+		typedef std::map<std::string, SqPool> TqPoolMap;
 
 		static void splitCommandLine(const std::string& command,
 				std::vector<std::string>& argv);
 
-		TqPopenStream* startNewRunProgram(const std::string& command);
+		/** \brief Find a cached request, or make a new one.
+		 *
+		 * The caller should hold m_mutex, and pass any new request to
+		 * sendTo->send() once the lock is released.
+		 */
+		TqRequestPtr findRequest(const SqRequestKey& key, bool reportErrors,
+				CqChild*& sendTo);
+		/// Start a new child process for the given RunProgram command.
+		boost::shared_ptr<CqChild> startChild(const std::string& command);
+		/** \brief Note that the result of a request has been used.
+		 *
+		 * Drops the least recently used results if there are too many; the
+		 * caller holds m_mutex.
+		 */
+		void markUsed(const SqRequestKey& key, const TqRequestPtr& request);
 
-		/// Set of active pipes for child processes.
-		TqRunProgramMap m_activeRunPrograms;
+		TqInt m_maxProcesses;
+		TqPoolMap m_pools;
+		TqRequestMap m_requests;
+		TqUsedList m_used;
+		/// Total size of the results of the requests in m_used.
+		TqUint m_usedSize;
+#		ifdef ENABLE_THREADING
+		/// Protects the pools, cache, requests and child request queues.
+		boost::mutex m_mutex;
+		/// Signalled whenever a request is answered.
+		boost::condition m_resultReady;
+#		endif
 };
 
 
+/** \brief Make the interface calls of a procedural through the procedural cache.
+ *
+ * If calls were recorded under key in an earlier frame with the same
+ * modification time, they're replayed without calling generate.  Otherwise
+ * generate is called, with the calls it makes through the C or C++ interfaces
+ * recorded on their way to the renderer.  Archives read by generate are
+ * recorded in full.
+ *
+ * This lives with the interface in ri.cpp, which owns the cache.
+ *
+ * \param key - identifies the procedural and its arguments
+ * \param modifiedTime - modification time of the files the calls depend on
+ * \param saveToDisk - also keep the calls in the cache directory set with
+ *                     Option "limits" "proceduralcachedir"
+ * \param generate - makes the calls of the procedural
+ */
+void cacheProceduralCalls(const std::string& key, std::time_t modifiedTime,
+		bool saveToDisk, const boost::function<void ()>& generate);
+
+/** \brief Start parsing an archive in the background.
+ *
+ * Used for the archives of DelayedReadArchive procedurals which have
+ * survived culling, so that with luck they're parsed by the time the
+ * procedural is split.  Does nothing if archive prefetching is disabled or
+ * the archive can't be found.
+ *
+ * This lives with the interface in ri.cpp, which owns the archive cache.
+ *
+ * \param name - archive name as given to the procedural
+ */
+void prefetchArchive(const char* name);
+
+
 } // namespace Aqsis
 
 // The built in RiProcedurals
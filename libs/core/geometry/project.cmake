@@ -13,6 +13,7 @@ set(geometry_srcs
 	polygon.cpp
 	procedural.cpp
 	quadrics.cpp
+	ribstreamend.cpp
 	subdivision2.cpp
 	surface.cpp
 	teapot.cpp
@@ -35,6 +36,7 @@ set(geometry_hdrs
 	polygon.h
 	procedural.h
 	quadrics.h
+	ribstreamend.h
 	subdivision2.h
 	surface.h
 	teapot.h
@@ -42,5 +44,10 @@ set(geometry_hdrs
 )
 make_absolute(geometry_hdrs ${geometry_SOURCE_DIR})
 
+set(geometry_test_srcs
+	ribstreamend_test.cpp
+)
+make_absolute(geometry_test_srcs ${geometry_SOURCE_DIR})
+
 include_directories(${geometry_SOURCE_DIR})
 
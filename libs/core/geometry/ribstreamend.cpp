@@ -0,0 +1,139 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+/** \file
+ *
+ * \brief Scanner for the end of the RIB written by RunProgram procedurals.
+ */
+
+#include "ribstreamend.h"
+
+namespace Aqsis {
+
+CqRibStreamEnd::CqRibStreamEnd()
+	: m_pos(0),
+	m_state(State_Token)
+{ }
+
+bool CqRibStreamEnd::dataLength(const std::string& rib,
+		std::string::size_type pos, std::string::size_type& length)
+{
+	TqUint8 c = rib[pos];
+	// Number of bytes in a length field following the token byte.
+	TqInt lengthBytes = 0;
+	TqInt elementSize = 1;
+	if(c >= 0200 && c <= 0203)
+		length = c - 0200 + 1;
+	else if(c >= 0204 && c <= 0217)
+		length = ((c - 0200) & 0x03) + 1;
+	else if(c >= 0220 && c <= 0237)
+		length = c - 0220;
+	else if(c >= 0240 && c <= 0243)
+		lengthBytes = c - 0240 + 1;
+	else if(c == 0244)
+		length = 4;
+	else if(c == 0245)
+		length = 8;
+	else if(c == 0246 || c == 0314)
+		length = 1;
+	else if(c >= 0310 && c <= 0313)
+	{
+		lengthBytes = c - 0310 + 1;
+		elementSize = 4;
+	}
+	else if(c == 0315 || c == 0316)
+		length = c - 0315 + 1;
+	else if(c == 0317 || c == 0320)
+		length = c - 0317 + 1;
+	else
+		// Reserved bytes are reported by the parser.
+		length = 0;
+	if(lengthBytes > 0)
+	{
+		if(pos + lengthBytes >= rib.size())
+			return false;
+		length = 0;
+		for(TqInt i = 1; i <= lengthBytes; ++i)
+			length = 256*length + static_cast<TqUint8>(rib[pos + i]);
+		length = lengthBytes + elementSize*length;
+	}
+	return true;
+}
+
+std::string::size_type CqRibStreamEnd::find(const std::string& rib)
+{
+	while(m_pos < rib.size())
+	{
+		TqUint8 c = rib[m_pos];
+		switch(m_state)
+		{
+			case State_String:
+				if(c == '\\')
+				{
+					// Any escaped character is part of the string.
+					if(m_pos + 1 == rib.size())
+						return std::string::npos;
+					m_pos += 2;
+				}
+				else if(c == 0377)
+				{
+					// The end of the stream also ends an unterminated string.
+					m_state = State_Token;
+				}
+				else
+				{
+					if(c == '"')
+						m_state = State_Token;
+					++m_pos;
+				}
+				break;
+			case State_Comment:
+				if(c == '\n' || c == '\r' || c == 0377)
+					m_state = State_Token;
+				else
+					++m_pos;
+				break;
+			case State_Token:
+				if(c == 0377)
+				{
+					std::string::size_type end = m_pos;
+					m_pos = 0;
+					return end;
+				}
+				else if(c == '"')
+					m_state = State_String;
+				else if(c == '#')
+					m_state = State_Comment;
+				else if(c >= 0200)
+				{
+					std::string::size_type length = 0;
+					if(!dataLength(rib, m_pos, length) || m_pos + length >= rib.size())
+						return std::string::npos;
+					m_pos += length;
+				}
+				// Other ASCII characters can't be followed by data, so are
+				// skipped one at a time.
+				++m_pos;
+				break;
+		}
+	}
+	return std::string::npos;
+}
+
+} // namespace Aqsis
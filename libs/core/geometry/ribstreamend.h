@@ -0,0 +1,81 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+/** \file
+ *
+ * \brief Scanner for the end of the RIB written by RunProgram procedurals.
+ */
+
+#ifndef RIBSTREAMEND_H_INCLUDED
+#define RIBSTREAMEND_H_INCLUDED
+
+#include <aqsis/aqsis.h>
+
+#include <string>
+
+namespace Aqsis {
+
+/** \brief Finder for the end of each RIB stream written by a RunProgram child.
+ *
+ * A RunProgram procedural ends its RIB with a '\377' byte.  That byte may
+ * also turn up inside binary encoded data, so the input is followed token by
+ * token with the same decoding rules as RibTokenizer (RISpec Appendix C.2),
+ * far enough to skip the data of each token.
+ *
+ * The input may arrive in pieces, so scanning stops at the end of the
+ * characters read so far, and carries on from there when there are more.
+ */
+class CqRibStreamEnd
+{
+	public:
+		CqRibStreamEnd();
+		/** \brief Scan on through rib, looking for the end of the stream.
+		 *
+		 * \return the position of the terminating '\377', or npos if it
+		 * hasn't been read yet.  After a stream is found, scanning starts
+		 * again at the beginning of rib.
+		 */
+		std::string::size_type find(const std::string& rib);
+
+		/** \brief Find the number of bytes following a binary encoded token.
+		 *
+		 * \param rib - input holding the token
+		 * \param pos - position of the token byte in rib
+		 * \param length - returns the number of bytes after the token byte,
+		 * including any length field
+		 * \return false if more input is needed to find the length.
+		 */
+		static bool dataLength(const std::string& rib, std::string::size_type pos,
+				std::string::size_type& length);
+	private:
+		enum EqState
+		{
+			State_Token,
+			State_String,
+			State_Comment
+		};
+
+		/// Position of the next character to scan.
+		std::string::size_type m_pos;
+		EqState m_state;
+};
+
+} // namespace Aqsis
+
+#endif // RIBSTREAMEND_H_INCLUDED
@@ -0,0 +1,123 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+/** \file
+ *
+ * \brief Unit tests for finding the end of RunProgram RIB.
+ */
+
+#include "ribstreamend.h"
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace Aqsis;
+
+namespace {
+
+/// Make a string from characters which may include nulls.
+template<int n>
+std::string bytes(const char (&chars)[n])
+{
+	return std::string(chars, n - 1);
+}
+
+std::string::size_type dataLength(const std::string& rib)
+{
+	std::string::size_type length = 0;
+	BOOST_REQUIRE(CqRibStreamEnd::dataLength(rib, 0, length));
+	return length;
+}
+
+} // unnamed namespace
+
+BOOST_AUTO_TEST_CASE(CqRibStreamEnd_dataLength_test)
+{
+	// Integers and fixed point numbers.
+	BOOST_CHECK_EQUAL(dataLength("\200"), 1U);
+	BOOST_CHECK_EQUAL(dataLength("\203"), 4U);
+	BOOST_CHECK_EQUAL(dataLength("\206"), 3U);
+	// Strings with the length in the token, or in a length field.
+	BOOST_CHECK_EQUAL(dataLength("\220"), 0U);
+	BOOST_CHECK_EQUAL(dataLength("\237"), 15U);
+	BOOST_CHECK_EQUAL(dataLength(bytes("\240\005")), 6U);
+	BOOST_CHECK_EQUAL(dataLength(bytes("\241\001\000")), 258U);
+	// Floats and doubles.
+	BOOST_CHECK_EQUAL(dataLength("\244"), 4U);
+	BOOST_CHECK_EQUAL(dataLength("\245"), 8U);
+	// Float arrays count four bytes per element.
+	BOOST_CHECK_EQUAL(dataLength(bytes("\310\003")), 13U);
+	BOOST_CHECK_EQUAL(dataLength(bytes("\311\000\002")), 10U);
+	// Request and string definitions and references.
+	BOOST_CHECK_EQUAL(dataLength("\246"), 1U);
+	BOOST_CHECK_EQUAL(dataLength("\314"), 1U);
+	BOOST_CHECK_EQUAL(dataLength("\316"), 2U);
+	BOOST_CHECK_EQUAL(dataLength("\317"), 1U);
+	BOOST_CHECK_EQUAL(dataLength("\320"), 2U);
+
+	// Length fields which haven't been read yet.
+	std::string::size_type length = 0;
+	BOOST_CHECK(!CqRibStreamEnd::dataLength("\241\001", 0, length));
+	BOOST_CHECK(!CqRibStreamEnd::dataLength("\310", 0, length));
+}
+
+BOOST_AUTO_TEST_CASE(CqRibStreamEnd_ascii_test)
+{
+	CqRibStreamEnd ribEnd;
+	std::string rib = "Sphere 1 -1 1 360\n\377";
+	BOOST_CHECK_EQUAL(ribEnd.find(rib), rib.size() - 1);
+	// Scanning starts again for the next stream.
+	rib = "# comment\nAttribute \"identifier\" \"name\" \"a\\\"b\"\377";
+	BOOST_CHECK_EQUAL(ribEnd.find(rib), rib.size() - 1);
+	// The end of the stream also ends strings and comments.
+	rib = "Attribute \"identifier\" \"name\" \"abc\377";
+	BOOST_CHECK_EQUAL(ribEnd.find(rib), rib.size() - 1);
+	rib = "# comment\377";
+	BOOST_CHECK_EQUAL(ribEnd.find(rib), rib.size() - 1);
+}
+
+BOOST_AUTO_TEST_CASE(CqRibStreamEnd_binary_test)
+{
+	CqRibStreamEnd ribEnd;
+	// '\377' bytes in the data of binary tokens don't end the stream.
+	std::string rib = bytes("\244\377\377\377\377"
+		"\222a\377"
+		"\310\001\377\377\377\377"
+		"\241\000\002\377\377"
+		"\377");
+	BOOST_CHECK_EQUAL(ribEnd.find(rib), rib.size() - 1);
+	// Nor do binary encoded strings containing quotes.
+	rib = bytes("\221\"Sphere\377");
+	BOOST_CHECK_EQUAL(ribEnd.find(rib), rib.size() - 1);
+}
+
+BOOST_AUTO_TEST_CASE(CqRibStreamEnd_pieces_test)
+{
+	CqRibStreamEnd ribEnd;
+	std::string rib = bytes("Sphere \244\377\377");
+	BOOST_CHECK_EQUAL(ribEnd.find(rib), std::string::npos);
+	rib += bytes("\377\377 \"a");
+	BOOST_CHECK_EQUAL(ribEnd.find(rib), std::string::npos);
+	rib += bytes("\\");
+	BOOST_CHECK_EQUAL(ribEnd.find(rib), std::string::npos);
+	rib += bytes("\"\" \310");
+	BOOST_CHECK_EQUAL(ribEnd.find(rib), std::string::npos);
+	rib += bytes("\001\377\377\377\377\377next");
+	BOOST_CHECK_EQUAL(ribEnd.find(rib), rib.size() - 5);
+}
@@ -25,6 +25,7 @@
 
 #include	"subdivision2.h"
 
+#include	<cstring>
 #include	<fstream>
 #include	<vector>
 
@@ -1402,6 +1403,137 @@ bool CqSubdivision2::Finalise()
 }
 
 
+//------------------------------------------------------------------------------
+/**
+ *	Approximate memory used by a saved topology.
+ */
+std::size_t SqSubdivisionTopology::memoryUsage() const
+{
+	return sizeof(SqSubdivisionTopology)
+		+ laths.size()*sizeof(SqLath)
+		+ (facets.size() + vertexLaths.size() + vertexStarts.size()
+		   + holes.size())*sizeof(TqInt)
+		+ (sharpEdges.size() + sharpCorners.size())
+			*sizeof(std::pair<TqInt, TqFloat>);
+}
+
+
+//------------------------------------------------------------------------------
+/**
+ *	Save the linkage of the control hull laths by index.
+ *
+ *	@param	topology	Storage for the saved topology.
+ */
+void CqSubdivision2::StoreTopology(SqSubdivisionTopology& topology) const
+{
+	assert(m_fFinalised);
+	std::map<const CqLath*, TqInt> lathIndices;
+	for(TqInt i = 0; i < cLaths(); ++i)
+		lathIndices[m_apLaths[i]] = i;
+	lathIndices[0] = -1;
+
+	topology.laths.resize(cLaths());
+	for(TqInt i = 0; i < cLaths(); ++i)
+	{
+		const CqLath* lath = m_apLaths[i];
+		// Subdivided laths reference the next level, which isn't saved.
+		assert(!lath->pFaceVertex() && !lath->pMidVertex() && !lath->pChildVertex());
+		SqSubdivisionTopology::SqLath& flat = topology.laths[i];
+		flat.vertexIndex = lath->VertexIndex();
+		flat.faceVertexIndex = lath->FaceVertexIndex();
+		flat.clockwiseFacet = lathIndices[lath->cf()];
+		flat.clockwiseVertex = lathIndices[lath->cv()];
+	}
+
+	topology.facets.resize(cFacets());
+	for(TqInt i = 0; i < cFacets(); ++i)
+		topology.facets[i] = lathIndices[m_apFacets[i]];
+
+	topology.vertexLaths.clear();
+	topology.vertexStarts.resize(cVertices() + 1);
+	for(TqInt i = 0; i < cVertices(); ++i)
+	{
+		topology.vertexStarts[i] = topology.vertexLaths.size();
+		for(std::vector<CqLath*>::const_iterator lath = m_aapVertices[i].begin();
+				lath != m_aapVertices[i].end(); ++lath)
+			topology.vertexLaths.push_back(lathIndices[*lath]);
+	}
+	topology.vertexStarts[cVertices()] = topology.vertexLaths.size();
+
+	topology.sharpEdges.clear();
+	for(std::map<CqLath*, TqFloat>::const_iterator edge = m_mapSharpEdges.begin();
+			edge != m_mapSharpEdges.end(); ++edge)
+		topology.sharpEdges.push_back(std::make_pair(lathIndices[edge->first], edge->second));
+	topology.sharpCorners.clear();
+	for(TqSharpnessMap::const_iterator corner = m_mapSharpCorners.begin();
+			corner != m_mapSharpCorners.end(); ++corner)
+		topology.sharpCorners.push_back(std::make_pair(lathIndices[corner->first], corner->second));
+
+	topology.holes.clear();
+	for(std::map<TqInt, bool>::const_iterator hole = m_mapHoles.begin();
+			hole != m_mapHoles.end(); ++hole)
+		topology.holes.push_back(hole->first);
+	topology.interpolateBoundary = m_bInterpolateBoundary;
+}
+
+
+//------------------------------------------------------------------------------
+/**
+ *	Create the control hull laths and link them as described by a saved
+ *	topology.  The hull must be empty.
+ *
+ *	@param	topology	Topology saved by StoreTopology().
+ */
+void CqSubdivision2::RestoreTopology(const SqSubdivisionTopology& topology)
+{
+	assert(m_apLaths.empty());
+	TqInt numLaths = topology.laths.size();
+	m_apLaths.resize(numLaths);
+	for(TqInt i = 0; i < numLaths; ++i)
+	{
+		m_apLaths[i] = new CqLath(topology.laths[i].vertexIndex,
+				topology.laths[i].faceVertexIndex);
+	}
+	for(TqInt i = 0; i < numLaths; ++i)
+	{
+		const SqSubdivisionTopology::SqLath& flat = topology.laths[i];
+		if(flat.clockwiseFacet >= 0)
+			m_apLaths[i]->SetpClockwiseFacet(m_apLaths[flat.clockwiseFacet]);
+		if(flat.clockwiseVertex >= 0)
+			m_apLaths[i]->SetpClockwiseVertex(m_apLaths[flat.clockwiseVertex]);
+	}
+
+	m_apFacets.resize(topology.facets.size());
+	for(TqInt i = 0, end = topology.facets.size(); i < end; ++i)
+		m_apFacets[i] = m_apLaths[topology.facets[i]];
+
+	TqInt numVerts = topology.vertexStarts.size() - 1;
+	m_aapVertices.assign(numVerts, std::vector<CqLath*>());
+	for(TqInt i = 0; i < numVerts; ++i)
+	{
+		TqInt begin = topology.vertexStarts[i];
+		TqInt end = topology.vertexStarts[i+1];
+		m_aapVertices[i].reserve(end - begin);
+		for(TqInt j = begin; j < end; ++j)
+			m_aapVertices[i].push_back(m_apLaths[topology.vertexLaths[j]]);
+	}
+
+	m_mapSharpEdges.clear();
+	for(TqInt i = 0, end = topology.sharpEdges.size(); i < end; ++i)
+		m_mapSharpEdges[m_apLaths[topology.sharpEdges[i].first]] = topology.sharpEdges[i].second;
+	m_mapSharpCorners.clear();
+	for(TqInt i = 0, end = topology.sharpCorners.size(); i < end; ++i)
+		m_mapSharpCorners[m_apLaths[topology.sharpCorners[i].first]] = topology.sharpCorners[i].second;
+
+	m_mapHoles.clear();
+	for(TqInt i = 0, end = topology.holes.size(); i < end; ++i)
+		m_mapHoles[topology.holes[i]] = true;
+	m_bInterpolateBoundary = topology.interpolateBoundary;
+
+	m_fFinalised = true;
+}
+
+
 #define modulo(a, b) (a * b >= 0 ? a % b : (a % b) + b)
 struct SqFaceLathList
 {
@@ -2930,4 +3062,134 @@ CqSurface* CqSurfaceSubdivisionMesh::Clone() const
 }
 
 
+//------------------------------------------------------------------------------
+// CqSubdivisionTopologyKey implementation
+
+CqSubdivisionTopologyKey::CqSubdivisionTopologyKey()
+	: m_ints(),
+	m_floats(),
+	m_strings(),
+	m_hash(2166136261UL)
+{ }
+
+void CqSubdivisionTopologyKey::addInts(const TqInt* values, TqInt count)
+{
+	m_ints.push_back(count);
+	m_ints.insert(m_ints.end(), values, values + count);
+	hashBytes(&count, sizeof(TqInt));
+	hashBytes(values, count*sizeof(TqInt));
+}
+
+void CqSubdivisionTopologyKey::addFloats(const TqFloat* values, TqInt count)
+{
+	m_ints.push_back(count);
+	m_floats.insert(m_floats.end(), values, values + count);
+	hashBytes(&count, sizeof(TqInt));
+	hashBytes(values, count*sizeof(TqFloat));
+}
+
+void CqSubdivisionTopologyKey::addString(const char* str)
+{
+	// Include the terminating null to separate consecutive strings.
+	std::size_t size = std::strlen(str) + 1;
+	m_strings.append(str, size);
+	hashBytes(str, size);
+}
+
+bool CqSubdivisionTopologyKey::operator==(const CqSubdivisionTopologyKey& rhs) const
+{
+	return m_hash == rhs.m_hash && m_ints == rhs.m_ints
+		&& m_floats == rhs.m_floats && m_strings == rhs.m_strings;
+}
+
+std::size_t CqSubdivisionTopologyKey::memoryUsage() const
+{
+	return sizeof(CqSubdivisionTopologyKey) + m_ints.size()*sizeof(TqInt)
+		+ m_floats.size()*sizeof(TqFloat) + m_strings.size();
+}
+
+void CqSubdivisionTopologyKey::hashBytes(const void* data, std::size_t size)
+{
+	// 32 bit FNV-1a hash.
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	TqUlong hash = m_hash;
+	for(std::size_t i = 0; i < size; ++i)
+		hash = ((hash ^ bytes[i]) * 16777619UL) & 0xFFFFFFFFUL;
+	m_hash = hash;
+}
+
+
+//------------------------------------------------------------------------------
+// CqSubdivisionTopologyCache implementation
+
+const std::size_t CqSubdivisionTopologyCache::defaultMemoryLimit = 64*1024*1024;
+
+CqSubdivisionTopologyCache::CqSubdivisionTopologyCache(std::size_t memoryLimit)
+	: m_entries(),
+	m_index(),
+	m_memoryLimit(memoryLimit),
+	m_memoryUsed(0)
+{ }
+
+boost::shared_ptr<const SqSubdivisionTopology> CqSubdivisionTopologyCache::find(
+		const CqSubdivisionTopologyKey& key)
+{
+	std::pair<TqEntryIndex::iterator, TqEntryIndex::iterator> range
+		= m_index.equal_range(key.hash());
+	for(TqEntryIndex::iterator i = range.first; i != range.second; ++i)
+	{
+		if(i->second->key == key)
+		{
+			// Move to the front of the usage list.
+			m_entries.splice(m_entries.begin(), m_entries, i->second);
+			return i->second->topology;
+		}
+	}
+	return boost::shared_ptr<const SqSubdivisionTopology>();
+}
+
+void CqSubdivisionTopologyCache::insert(const CqSubdivisionTopologyKey& key,
+		const boost::shared_ptr<const SqSubdivisionTopology>& topology)
+{
+	std::size_t bytes = key.memoryUsage() + topology->memoryUsage();
+	// Don't flush the whole cache for a topology which wouldn't fit anyway.
+	if(bytes > m_memoryLimit)
+		return;
+	SqEntry entry;
+	entry.key = key;
+	entry.topology = topology;
+	entry.bytes = bytes;
+	m_entries.push_front(entry);
+	m_index.insert(std::make_pair(key.hash(), m_entries.begin()));
+	m_memoryUsed += bytes;
+	evict();
+}
+
+void CqSubdivisionTopologyCache::setMemoryLimit(std::size_t bytes)
+{
+	m_memoryLimit = bytes;
+	evict();
+}
+
+void CqSubdivisionTopologyCache::evict()
+{
+	while(m_memoryUsed > m_memoryLimit && !m_entries.empty())
+	{
+		TqEntryList::iterator last = --m_entries.end();
+		std::pair<TqEntryIndex::iterator, TqEntryIndex::iterator> range
+			= m_index.equal_range(last->key.hash());
+		for(TqEntryIndex::iterator i = range.first; i != range.second; ++i)
+		{
+			if(i->second == last)
+			{
+				m_index.erase(i);
+				break;
+			}
+		}
+		m_memoryUsed -= last->bytes;
+		m_entries.erase(last);
+	}
+}
+
+
 } // namespace Aqsis
@@ -28,6 +28,16 @@
 #define	SUBDIVISION2_H_LOADED
 
 #include <aqsis/aqsis.h>
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
 #include "lath.h"
 #include <aqsis/math/vector3d.h>
 #include "surface.h"
@@ -35,6 +45,42 @@
 
 namespace Aqsis {
 
+//------------------------------------------------------------------------------
+/**
+ *	Flattened copy of the control hull topology of a CqSubdivision2.
+ *
+ *	Laths are referred to by their index in CqSubdivision2::apLaths(), with -1
+ *	standing for a null pointer.  Rebuilding a hull from this skips the vertex
+ *	neighbourhood search done by CqSubdivision2::Finalise().
+ */
+struct SqSubdivisionTopology
+{
+	struct SqLath
+	{
+		TqInt vertexIndex;
+		TqInt faceVertexIndex;
+		TqInt clockwiseFacet;
+		TqInt clockwiseVertex;
+	};
+
+	/// All laths of the control hull.
+	std::vector<SqLath> laths;
+	/// Index of the lath representing each facet.
+	std::vector<TqInt> facets;
+	/// Laths referencing each vertex, stored contiguously.
+	std::vector<TqInt> vertexLaths;
+	/// Start of the laths for each vertex in vertexLaths, plus an end marker.
+	std::vector<TqInt> vertexStarts;
+	/// Sharp edges and corners as (lath index, sharpness) pairs.
+	std::vector<std::pair<TqInt, TqFloat> > sharpEdges;
+	std::vector<std::pair<TqInt, TqFloat> > sharpCorners;
+	std::vector<TqInt> holes;
+	bool interpolateBoundary;
+
+	/// Approximate memory used by the topology, in bytes.
+	std::size_t memoryUsage() const;
+};
+
 //------------------------------------------------------------------------------
 /**
  *	Container for the topology description of a mesh.
@@ -186,6 +232,19 @@ class CqSubdivision2 : public CqMotionSpec<boost::shared_ptr<CqPolygonPoints> >
 
 		CqSubdivision2* Clone() const;
 
+		/** \brief Save the control hull topology.
+		 *
+		 * Must be called after Finalise() and before any facet has been
+		 * subdivided.
+		 */
+		void StoreTopology(SqSubdivisionTopology& topology) const;
+		/** \brief Rebuild the control hull from a saved topology.
+		 *
+		 * This replaces the calls to Prepare(), AddFacet(), Finalise() and the
+		 * hole, crease and corner setup for a new, empty hull.
+		 */
+		void RestoreTopology(const SqSubdivisionTopology& topology);
+
 	private:
 		template<class TypeA, class TypeB>
 		void CreateVertex(CqParameter* pParamToModify, CqLath* pVertex,
@@ -227,6 +286,89 @@ class CqSubdivision2 : public CqMotionSpec<boost::shared_ptr<CqPolygonPoints> >
 
 
 
+//------------------------------------------------------------------------------
+/**
+ *	Key identifying the topology of a SubdivisionMesh.
+ *
+ *	The key holds a copy of all the integer, float and string data describing
+ *	the mesh connectivity and tags, so that equal keys are guaranteed to give
+ *	equal topology.
+ */
+class CqSubdivisionTopologyKey
+{
+	public:
+		CqSubdivisionTopologyKey();
+
+		void addInts(const TqInt* values, TqInt count);
+		void addFloats(const TqFloat* values, TqInt count);
+		void addString(const char* str);
+
+		TqUlong hash() const
+		{
+			return m_hash;
+		}
+		bool operator==(const CqSubdivisionTopologyKey& rhs) const;
+		/// Approximate memory used by the key, in bytes.
+		std::size_t memoryUsage() const;
+
+	private:
+		void hashBytes(const void* data, std::size_t size);
+
+		std::vector<TqInt> m_ints;
+		std::vector<TqFloat> m_floats;
+		std::string m_strings;
+		TqUlong m_hash;
+};
+
+//------------------------------------------------------------------------------
+/**
+ *	Memory bounded cache of control hull topology.
+ *
+ *	Animated subdivision meshes usually keep the same connectivity from frame
+ *	to frame, with only the vertex data changing.  Keeping their topology
+ *	between frames saves rebuilding it from the facet lists each time.  When
+ *	the cache is over its memory limit, the least recently used topologies are
+ *	discarded.
+ */
+class CqSubdivisionTopologyCache
+{
+	public:
+		/// Default memory limit in bytes.
+		static const std::size_t defaultMemoryLimit;
+
+		CqSubdivisionTopologyCache(std::size_t memoryLimit = defaultMemoryLimit);
+
+		/// Find the topology for a key, or return null.
+		boost::shared_ptr<const SqSubdivisionTopology> find(
+				const CqSubdivisionTopologyKey& key);
+		/// Add the topology for a key which isn't already in the cache.
+		void insert(const CqSubdivisionTopologyKey& key,
+				const boost::shared_ptr<const SqSubdivisionTopology>& topology);
+
+		/// Set the memory limit in bytes; zero disables the cache.
+		void setMemoryLimit(std::size_t bytes);
+
+	private:
+		struct SqEntry
+		{
+			CqSubdivisionTopologyKey key;
+			boost::shared_ptr<const SqSubdivisionTopology> topology;
+			std::size_t bytes;
+		};
+		typedef std::list<SqEntry> TqEntryList;
+		typedef std::multimap<TqUlong, TqEntryList::iterator> TqEntryIndex;
+
+		void evict();
+
+		/// Entries, most recently used first.
+		TqEntryList m_entries;
+		/// Entries by key hash.
+		TqEntryIndex m_index;
+		std::size_t m_memoryLimit;
+		std::size_t m_memoryUsed;
+};
+
+
 class CqSurfaceSubdivisionPatch : public CqSurface
 {
 	public:
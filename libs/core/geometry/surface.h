@@ -199,7 +199,7 @@ class CqSurface : public IqSurface, private boost::noncopyable, public boost::en
 		/** Cache the calculated bound for further reference
 		 * \param pBound The calculated bound in hybrid raster/camera space
 		 */
-		void CacheRasterBound( CqBound& pBound )
+		virtual void CacheRasterBound( CqBound& pBound )
 		{
 			m_Bound = pBound;
 			m_CachedBound = true;
@@ -25,12 +25,15 @@
 
 #include	"imagebuffer.h"
 
+#include	<algorithm>
+
 #ifdef WIN32
 #include    <windows.h>
 #endif
 #include	<math.h>
 
 #include	<aqsis/math/math.h>
+#include	<aqsis/core/ilightsource.h>
 #include	"stats.h"
 #include	"options.h"
 #include	"renderer.h"
@@ -47,113 +50,69 @@ namespace Aqsis {
 static TqInt bucketmodulo = -1;
 //static TqInt bucketdirection = -1;
 
-#define MULTIPROCESSING_NBUCKETS 1
-/** Implementing a work unit for a boost::thread (the operator()()
- * method), that is, a piece of code that will run in parallel.
+//----------------------------------------------------------------------
+/** \brief Worker rendering buckets on one thread of a concurrent render.
+ *
+ * Each worker owns a bucket processor and a sample pattern generator, and
+ * repeatedly takes the next unstarted bucket from the image buffer until there
+ * are none left.  Buckets are handed out in raster order, which guarantees
+ * that the earliest unfinished bucket is always being worked on, but they may
+ * finish and be sent to the display in any order.  Whichever worker becomes
+ * free first takes the next bucket, so the load balances itself even when
+ * some buckets are much more expensive than others.
  */
-class CqThreadProcessor
+class CqBucketWorker
 {
-public:
-	CqThreadProcessor(CqBucketProcessor* bucketProcessor) :
-		m_bucketProcessor(bucketProcessor) { }
-	void operator()()
-	{
-		// printf("%p > start\n", m_bucketProcessor);
-		m_bucketProcessor->process();
-		// printf("%p < stop\n", m_bucketProcessor);
-	}
-
-private:
-	CqBucketProcessor* m_bucketProcessor;
+	public:
+		CqBucketWorker(CqImageBuffer& imageBuf, EqBucketOrder order, bool jitter)
+			: m_imageBuf(imageBuf),
+			m_order(order),
+			m_jitter(jitter)
+		{ }
+
+		void operator()();
+
+	private:
+		CqImageBuffer& m_imageBuf;
+		EqBucketOrder m_order;
+		bool m_jitter;
 };
 
-
-/* mafm: implementation of a processor (work unit for a boost::thread)
- * where it takes buckets ready to process and does so continuously.
- * One simple addition would be to wait for new available buckets
- * which are provided dynamically.  This is not applicable at the
- * moment though, it would need RenderSurfaces() to process all of the
- * surfaces of the buckets before assigning them as ready; but at the
- * moment RenderSurfaces() can't run before assigning the bucket to
- * the bucket processor, and it doesn't seem possible to break this
- * interdependency.
-
-boost::mutex displayMutex;
-
-class CqThreadProcessor2
+void CqBucketWorker::operator()()
 {
-public:
-	CqThreadProcessor2(const CqImageBuffer* imageBuffer,
-			   std::vector<CqBucket*>& bucketList,
-			   bool fImager,
-			   const CqColor& zThreshold,
-			   EqDepthFilter depthfilter,
-			   const CqVector2D& bHalf) :
-		m_imageBuffer(imageBuffer),
-		m_bucketList(bucketList),
-		m_fImager(fImager),
-		m_zThreshold(zThreshold),
-		m_depthfilter(depthfilter),
-		m_bHalf(bHalf) { }
-
-	void operator()()
-	{
-		while ( !m_bucketList.empty() )
+#ifdef	ENABLE_THREADING
+	const SqOptionCache& optCache = m_imageBuf.m_optCache;
+	CqBucketProcessor processor(m_imageBuf, optCache);
+	// Sample generators carry random state, so each worker needs its own.
+	CqMultiJitteredSampler jitteredSampler(optCache.xSamps, optCache.ySamps);
+	CqGridSampler gridSampler(optCache.xSamps, optCache.ySamps);
+	IqSampler* sampler = &gridSampler;
+	if(m_jitter)
+		sampler = &jitteredSampler;
+
+	while(true)
+	{
 		{
-			CqBucket* bucket = m_bucketList.front();
-			m_bucketList.erase( m_bucketList.begin() );
-
-			m_bucketProcessor.setBucket( bucket );
-			if ( m_fImager )
-				m_bucketProcessor.setInitiallyEmpty(false);
-			
-			// Set up some bounds for the bucket.
-			const CqVector2D bPos = m_imageBuffer->BucketPosition( bucket->getCol(),
-									       bucket->getRow() );
-			const CqVector2D bSize = m_imageBuffer->BucketSize( bucket->getCol(),
-									    bucket->getRow() );
-			const CqVector2D vecMin = bPos - m_bHalf;
-			const CqVector2D vecMax = bPos + bSize + m_bHalf;
-
-			TqInt xmin = static_cast<TqInt>( vecMin.x() );
-			TqInt ymin = static_cast<TqInt>( vecMin.y() );
-			TqInt xmax = static_cast<TqInt>( vecMax.x() );
-			TqInt ymax = static_cast<TqInt>( vecMax.y() );
-			if ( xmin < m_imageBuffer->CropWindowXMin() - m_imageBuffer->FilterXWidth() / 2 )
-				xmin = static_cast<TqInt>(m_imageBuffer->CropWindowXMin() - m_imageBuffer->FilterXWidth() / 2.0f);
-			if ( ymin < m_imageBuffer->CropWindowYMin() - m_imageBuffer->FilterYWidth() / 2 )
-				ymin = static_cast<TqInt>(m_imageBuffer->CropWindowYMin() - m_imageBuffer->FilterYWidth() / 2.0f);
-			if ( xmax > m_imageBuffer->CropWindowXMax() + m_imageBuffer->FilterXWidth() / 2 )
-				xmax = static_cast<TqInt>(m_imageBuffer->CropWindowXMax() + m_imageBuffer->FilterXWidth() / 2.0f);
-			if ( ymax > m_imageBuffer->CropWindowYMax() + m_imageBuffer->FilterYWidth() / 2 )
-				ymax = static_cast<TqInt>(m_imageBuffer->CropWindowYMax() + m_imageBuffer->FilterYWidth() / 2.0f);
-
-			m_bucketProcessor.preProcess( bPos, bSize,
-						      m_imageBuffer->PixelXSamples(), m_imageBuffer->PixelYSamples(), m_imageBuffer->FilterXWidth(), m_imageBuffer->FilterYWidth(),
-						      xmin, xmax, ymin, ymax,
-						      m_imageBuffer->ClippingNear(), m_imageBuffer->ClippingFar() );
-			m_bucketProcessor.process();
-			m_bucketProcessor.postProcess( m_fImager, m_depthfilter, m_zThreshold );
-			{
-				TIME_SCOPE("Display bucket");
-				boost::mutex::scoped_lock lock(displayMutex);
-				QGetRenderContext() ->pDDmanager() ->DisplayBucket( bucket );
-			}
-			m_bucketProcessor.reset();
+			boost::mutex::scoped_lock lock(m_imageBuf.m_geometryMutex);
+			if(!m_imageBuf.m_pendingBuckets || m_imageBuf.m_fQuit)
+				return;
+			processor.setBucket(&m_imageBuf.CurrentBucket());
+			m_imageBuf.m_pendingBuckets = m_imageBuf.NextBucket(m_order);
+			// Preparing the bucket picks up the cache segments of any
+			// finished neighbours, so must be done while holding the lock.
+			processor.preProcess(sampler);
+#if ENABLE_MPDUMP
+			if(m_imageBuf.m_mpdump.IsOpen())
+				m_imageBuf.m_mpdump.dumpPixelSamples(processor);
+#endif
 		}
+		processor.processConcurrent();
+		processor.postProcessConcurrent();
+		m_imageBuf.RetireBucket(processor);
+		processor.reset();
 	}
-
-private:
-	CqBucketProcessor m_bucketProcessor;
-	const CqImageBuffer* m_imageBuffer;
-	std::vector<CqBucket*> m_bucketList;
-	bool m_fImager;
-	CqColor m_zThreshold;
-	EqDepthFilter m_depthfilter;
-	CqVector2D m_bHalf;
-};
-
-*/
+#endif
+}
 
 
 //----------------------------------------------------------------------
@@ -209,6 +168,8 @@ void	CqImageBuffer::SetImage()
 		for ( b = i->begin(); b!=i->end(); b++ )
 		{
 			b->SetProcessed( false );
+			b->SetStarted( false );
+			b->adjustLiveSurfaceCount( -b->liveSurfaceCount() );
 			b->setCol( column );
 			b->setRow( row );
 			TqInt colSize = xRes - colPos;
@@ -225,6 +186,17 @@ void	CqImageBuffer::SetImage()
 
 	m_CurrentBucketCol = m_bucketRegion.xMin();
 	m_CurrentBucketRow = m_bucketRegion.yMin();
+
+	// Decide now whether buckets will be rendered concurrently, since the
+	// bookkeeping needed for it starts as soon as surfaces are posted.
+	m_concurrentBuckets = false;
+#ifdef	ENABLE_THREADING
+	m_concurrentBuckets = m_optCache.numThreads > 1;
+#else
+	if(m_optCache.numThreads > 1)
+		Aqsis::log() << warning << "Option \"limits\" \"threads\" ignored: "
+			"aqsis was built without threading support" << std::endl;
+#endif
 }
 
 
@@ -415,6 +387,9 @@ void CqImageBuffer::PostSurface( const boost::shared_ptr<CqSurface>& pSurface )
 	XMaxb = clamp( XMaxb, m_bucketRegion.xMin(), m_bucketRegion.xMax()-1 );
 	YMaxb = clamp( YMaxb, m_bucketRegion.yMin(), m_bucketRegion.yMax()-1 );
 
+#ifdef	ENABLE_THREADING
+	CqConcurrentLock lock( *this, m_geometryMutex );
+#endif
 	// Sanity check we are not putting into a bucket that has already been processed.
 	CqBucket* bucket = &Bucket( XMinb, YMinb );
 	if ( bucket->IsProcessed() )
@@ -430,7 +405,7 @@ void CqImageBuffer::PostSurface( const boost::shared_ptr<CqSurface>& pSurface )
 				CqBucket& availBucket = Bucket(xb, yb);
 				if(!availBucket.IsProcessed())
 				{
-					availBucket.AddGPrim(pSurface);
+					AddGPrimToBucket(availBucket, pSurface);
 					done = true;
 				}
 				++xb;
@@ -441,16 +416,76 @@ void CqImageBuffer::PostSurface( const boost::shared_ptr<CqSurface>& pSurface )
 	}
 	else
 	{
-		bucket->AddGPrim( pSurface );
+		AddGPrimToBucket( *bucket, pSurface );
+	}
+}
+
+
+void CqImageBuffer::AddGPrimToBucket( CqBucket& bucket,
+                                      const boost::shared_ptr<CqSurface>& pSurface )
+{
+	bucket.AddGPrim( pSurface );
+	if(m_concurrentBuckets)
+		AdjustSurfaceFootprint( bucket, *pSurface, 1 );
+}
+
+
+void CqImageBuffer::AdjustSurfaceFootprint( const CqBucket& host,
+                                            CqSurface& surface, TqInt delta )
+{
+	// Find the range of buckets touched by the surface, exactly as in
+	// PostSurface().  Surfaces spanning the eye plane don't have a useful
+	// raster bound, so conservatively assume they touch everything.
+	TqInt XMinb = m_bucketRegion.xMin();
+	TqInt YMinb = m_bucketRegion.yMin();
+	TqInt XMaxb = m_bucketRegion.xMax()-1;
+	TqInt YMaxb = m_bucketRegion.yMax()-1;
+	if( !surface.IsUndiceable() )
+	{
+		const CqBound& bound = surface.GetCachedRasterBound();
+		XMinb = clamp( static_cast<TqInt>( bound.vecMin().x() ) / m_optCache.xBucketSize,
+				m_bucketRegion.xMin(), m_bucketRegion.xMax()-1 );
+		YMinb = clamp( static_cast<TqInt>( bound.vecMin().y() ) / m_optCache.yBucketSize,
+				m_bucketRegion.yMin(), m_bucketRegion.yMax()-1 );
+		XMaxb = clamp( static_cast<TqInt>( bound.vecMax().x() ) / m_optCache.xBucketSize,
+				m_bucketRegion.xMin(), m_bucketRegion.xMax()-1 );
+		YMaxb = clamp( static_cast<TqInt>( bound.vecMax().y() ) / m_optCache.yBucketSize,
+				m_bucketRegion.yMin(), m_bucketRegion.yMax()-1 );
+	}
+
+	// Buckets before the host in raster order can't receive geometry from
+	// the surface, so only count the host and those after it.
+	for( TqInt yb = max( YMinb, host.getRow() ); yb <= YMaxb; ++yb )
+	{
+		TqInt xb = XMinb;
+		if( yb == host.getRow() )
+			xb = max( XMinb, host.getCol() );
+		for( ; xb <= XMaxb; ++xb )
+		{
+			CqBucket& bucket = Bucket( xb, yb );
+			if( !bucket.IsProcessed() )
+				bucket.adjustLiveSurfaceCount( delta );
+		}
 	}
 }
 
 
+void CqImageBuffer::surfaceRendered( const CqBucket& host,
+                                     const boost::shared_ptr<CqSurface>& surface )
+{
+	if(m_concurrentBuckets)
+		AdjustSurfaceFootprint( host, *surface, -1 );
+}
+
+
 void CqImageBuffer::RepostSurface(const CqBucket& oldBucket,
                                   const boost::shared_ptr<CqSurface>& surface)
 {
 	const CqBound rasterBound = surface->GetCachedRasterBound();
 
+#ifdef	ENABLE_THREADING
+	CqConcurrentLock lock( *this, m_geometryMutex );
+#endif
 	bool wasPosted = false;
 	// Surface is behind everying in this bucket but it may be visible in other
 	// buckets it overlaps.
@@ -461,7 +496,7 @@ void CqImageBuffer::RepostSurface(const CqBucket& oldBucket,
 	TqInt xpos = oldBucket.getXPosition() + oldBucket.getXSize();
 	if ( nextBucketX < m_bucketRegion.xMax() && rasterBound.vecMax().x() >= xpos )
 	{
-		Bucket( nextBucketX, nextBucketY ).AddGPrim( surface );
+		AddGPrimToBucket( Bucket( nextBucketX, nextBucketY ), surface );
 		wasPosted = true;
 	}
 	else
@@ -477,7 +512,7 @@ void CqImageBuffer::RepostSurface(const CqBucket& oldBucket,
 			( nextBucketY  < m_bucketRegion.yMax() ) &&
 			( rasterBound.vecMax().y() >= ypos ) )
 		{
-			Bucket( nextBucketX, nextBucketY ).AddGPrim( surface );
+			AddGPrimToBucket( Bucket( nextBucketX, nextBucketY ), surface );
 			wasPosted = true;
 		}
 	}
@@ -506,6 +541,59 @@ void CqImageBuffer::RepostSurface(const CqBucket& oldBucket,
 #endif
 }
 
+#ifdef	ENABLE_THREADING
+//----------------------------------------------------------------------
+CqImageBuffer::CqShaderLock::CqShaderLock( CqImageBuffer& imageBuf,
+		const IqAttributes* attributes )
+	: m_imageBuf( imageBuf ),
+	m_locks()
+{
+	if( !imageBuf.concurrentBuckets() )
+		return;
+	TqFloat time = QGetRenderContext()->Time();
+	std::vector<const void*> shaders;
+	shaders.push_back( attributes->pshadDisplacement( time ).get() );
+	shaders.push_back( attributes->pshadSurface( time ).get() );
+	shaders.push_back( attributes->pshadAtmosphere( time ).get() );
+	// Lights are run by the illuminance loops of the surface shader, and keep
+	// their results for it, so they're held for the whole grid.
+	const TqInt* enableLighting = QGetRenderContext()->GetIntegerOption( "EnableShaders", "lighting" );
+	if( !enableLighting || enableLighting[0] != 0 )
+	{
+		for( TqUint i = 0; i < attributes->cLights(); ++i )
+			shaders.push_back( attributes->pLight( i ) );
+	}
+	lockAll( shaders );
+}
+
+CqImageBuffer::CqShaderLock::CqShaderLock( CqImageBuffer& imageBuf,
+		const void* shader )
+	: m_imageBuf( imageBuf ),
+	m_locks()
+{
+	if( !imageBuf.concurrentBuckets() )
+		return;
+	lockAll( std::vector<const void*>( 1, shader ) );
+}
+
+void CqImageBuffer::CqShaderLock::lockAll( const std::vector<const void*>& shaders )
+{
+	std::vector<TqInt> mutexes;
+	for( std::vector<const void*>::const_iterator i = shaders.begin();
+			i != shaders.end(); ++i )
+	{
+		if( *i )
+			mutexes.push_back( reinterpret_cast<std::size_t>( *i )
+					/ sizeof( void* ) % numShaderMutexes );
+	}
+	// Always lock in index order, so shader locks can't deadlock.
+	std::sort( mutexes.begin(), mutexes.end() );
+	mutexes.erase( std::unique( mutexes.begin(), mutexes.end() ), mutexes.end() );
+	for( std::vector<TqInt>::iterator i = mutexes.begin(); i != mutexes.end(); ++i )
+		m_locks.push_back( new boost::mutex::scoped_lock( m_imageBuf.m_shaderMutexes[*i] ) );
+}
+#endif
+
 //----------------------------------------------------------------------
 /** Add a new micro polygon to the list of waiting ones.
  * \param pmpgNew Pointer to a CqMicroPolygon derived class.
@@ -656,111 +744,56 @@ void CqImageBuffer::RenderImage()
 #endif
 	}
 
-	// A counter for the number of processed buckets (used for progress reporting)
-	TqInt iBucket = 0;
-
-	std::vector<boost::shared_ptr<CqBucketProcessor> > bucketProcessors;
-	TqInt numConcurrentBuckets = 1;
-
-/* mafm: Sample code to use with the CqThreadProcessor2 alternative
- * approach.
-
-	std::vector<std::vector<CqBucket*> > bucketLists;
-	bucketLists.resize(MULTIPROCESSING_NBUCKETS);
-	int index = 0;
-	do
-	{
-		bucketLists[index % MULTIPROCESSING_NBUCKETS].push_back( &(CurrentBucket()) );
-		++index;
-	} while ( NextBucket(order) );
-	boost::thread_group threadGroup;
-	for (int i = 0; i < MULTIPROCESSING_NBUCKETS; ++i)
+	// Determine whether the user has asked for sample jittering
+	bool jitter = true;
+	if(const TqInt* jitterOpt = QGetRenderContext()->poptCurrent()->
+			GetIntegerOption("Hider", "jitter"))
 	{
-		threadGroup.create_thread( CqThreadProcessor2(this, bucketLists[i], fImager, zThreshold, depthfilter, bHalf) );
+		jitter = jitterOpt[0] != 0;
 	}
-	threadGroup.join_all();
-	return;
-*/
 
-#ifdef		ENABLE_THREADING
-	numConcurrentBuckets = MULTIPROCESSING_NBUCKETS;
-#endif
-
-	for(int i = 0; i < numConcurrentBuckets; ++i)
-	{
-		bucketProcessors.push_back(boost::shared_ptr<CqBucketProcessor>(
-					new CqBucketProcessor(*this, m_optCache)));
-	}
-	CqMultiJitteredSampler jitteredSampler(m_optCache.xSamps, m_optCache.ySamps);
-	CqGridSampler gridSampler(m_optCache.xSamps, m_optCache.ySamps);
+	// A counter for the number of retired buckets (used for progress reporting)
+	m_bucketsRetired = 0;
 
-	// Determine whether the user has asked for sample jittering
-	IqSampler* sampler = &jitteredSampler;
-	if(const TqInt* jitter = QGetRenderContext()->poptCurrent()->
-			GetIntegerOption("Hider", "jitter"))
+	if(m_concurrentBuckets)
 	{
-		if(jitter[0] == 0)
-			sampler = &gridSampler;
+		RenderImageConcurrent(order, jitter);
 	}
-
-	// Iterate over all buckets...
-	bool pendingBuckets = true;
-	while ( pendingBuckets && !m_fQuit )
+	else
 	{
-		CqThreadScheduler threadScheduler(numConcurrentBuckets);
-		std::vector<CqThreadProcessor> threadProcessors;
-
-		for (int i = 0; pendingBuckets && i < numConcurrentBuckets; ++i)
+		CqBucketProcessor bucketProcessor(*this, m_optCache);
+		CqMultiJitteredSampler jitteredSampler(m_optCache.xSamps, m_optCache.ySamps);
+		CqGridSampler gridSampler(m_optCache.xSamps, m_optCache.ySamps);
+		IqSampler* sampler = &gridSampler;
+		if(jitter)
+			sampler = &jitteredSampler;
+
+		// Iterate over all buckets...
+		bool pendingBuckets = true;
+		while ( pendingBuckets && !m_fQuit )
 		{
-			bucketProcessors[i]->setBucket(&CurrentBucket());
+			bucketProcessor.setBucket(&CurrentBucket());
 
 			// Prepare the bucket processor
-			bucketProcessors[i]->preProcess(sampler);
+			bucketProcessor.preProcess(sampler);
 
 #if ENABLE_MPDUMP
 			// Dump the pixel sample positions into a dump file
 			if(m_mpdump.IsOpen())
-				m_mpdump.dumpPixelSamples(*bucketProcessors[i]);
+				m_mpdump.dumpPixelSamples(bucketProcessor);
 #endif
 
-			// Kick off a thread to process this bucket.
-			threadProcessors.push_back( CqThreadProcessor( bucketProcessors[i].get() ) );
-			threadScheduler.addWorkUnit( threadProcessors.back() );
+			bucketProcessor.process();
 
 			// Advance to next bucket, quit if nothing left
-			iBucket += 1;
 			pendingBuckets = NextBucket(order);
-		}
-
-		// Wait for all current buckets to complete before allocating more to the available threads.
-		threadScheduler.joinAll();
-		threadProcessors.clear();
 
-		for (int i = 0; !m_fQuit && i < numConcurrentBuckets; ++i)
-		{
-			bucketProcessors[i]->postProcess();
+			if ( !m_fQuit )
 			{
-				AQSIS_TIME_SCOPE(Display_bucket);
-				const CqBucket* bucket = bucketProcessors[i]->getBucket();
-				if (bucket)
-				{
-					QGetRenderContext() ->pDDmanager() ->DisplayBucket( bucketProcessors[i]->DisplayRegion(), &(bucketProcessors[i]->getChannelBuffer()) );
-				}
+				bucketProcessor.postProcess();
+				RetireBucket(bucketProcessor);
 			}
-			bucketProcessors[i]->reset();
-
-			if ( pProgressHandler )
-			{
-				// Inform the status class how far we have got, and update UI.
-				float Complete = (100.0f * iBucket) / static_cast<float> ( m_bucketRegion.area() );
-				QGetRenderContext() ->Stats().SetComplete( Complete );
-				( *pProgressHandler ) ( Complete, QGetRenderContext() ->CurrentFrame() );
-			}
-
-#ifdef WIN32
-			if ( !( iBucket % bucketmodulo ) )
-				SetProcessWorkingSetSize( GetCurrentProcess(), 0xffffffff, 0xffffffff );
-#endif
+			bucketProcessor.reset();
 		}
 	}
 
@@ -772,6 +805,64 @@ void CqImageBuffer::RenderImage()
 }
 
 
+//----------------------------------------------------------------------
+/** Render the image using a pool of worker threads.
+ 
+    Each of the Option "limits" "threads" workers owns a bucket processor and
+    takes buckets in order as it becomes free.  Splitting, dicing and shading
+    are serialised through the shading lock, and the bucket queues have a
+    separate geometry lock which is only held briefly.  Sampling, filtering
+    and display formatting run in parallel with each other and with shading.  A bucket is finished as soon as no
+    live surface can contribute to it any more, so buckets are retired to the
+    display out of order.
+ */
+void CqImageBuffer::RenderImageConcurrent( EqBucketOrder order, bool jitter )
+{
+	m_pendingBuckets = true;
+
+	CqThreadScheduler threadScheduler(m_optCache.numThreads);
+	for(TqInt i = 0; i < m_optCache.numThreads; ++i)
+		threadScheduler.addWorkUnit(CqBucketWorker(*this, order, jitter));
+	threadScheduler.joinAll();
+}
+
+
+//----------------------------------------------------------------------
+/** Send the bucket held by a processor to the display manager and update the
+ * render progress.
+ */
+void CqImageBuffer::RetireBucket( CqBucketProcessor& processor )
+{
+#ifdef	ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_displayMutex);
+#endif
+	{
+		AQSIS_TIME_SCOPE(Display_bucket);
+		if (processor.getBucket())
+		{
+			QGetRenderContext() ->pDDmanager() ->DisplayBucket( processor.DisplayRegion(), &(processor.getChannelBuffer()) );
+			if ( !processor.visibilityOffsets().empty() )
+				QGetRenderContext() ->pDDmanager() ->DisplayVisibility( processor.DisplayRegion(),
+						processor.visibilityOffsets(), processor.visibilityNodes() );
+		}
+	}
+
+	++m_bucketsRetired;
+	if ( RtProgressFunc pProgressHandler = QGetRenderContext()->pProgressHandler() )
+	{
+		// Inform the status class how far we have got, and update UI.
+		float Complete = (100.0f * m_bucketsRetired) / static_cast<float> ( m_bucketRegion.area() );
+		QGetRenderContext() ->Stats().SetComplete( Complete );
+		( *pProgressHandler ) ( Complete, QGetRenderContext() ->CurrentFrame() );
+	}
+
+#ifdef WIN32
+	if ( !( m_bucketsRetired % bucketmodulo ) )
+		SetProcessWorkingSetSize( GetCurrentProcess(), 0xffffffff, 0xffffffff );
+#endif
+}
+
+
 //----------------------------------------------------------------------
 /** Stop rendering.
  */
@@ -32,6 +32,14 @@
 
 #include	<vector>
 
+#ifdef	ENABLE_THREADING
+#include	<boost/ptr_container/ptr_vector.hpp>
+#include	<boost/scoped_ptr.hpp>
+#include	<boost/thread/mutex.hpp>
+#include	<boost/utility.hpp>
+#include	<boost/thread/condition.hpp>
+#endif
+
 #include	"surface.h"
 #include	<aqsis/math/vector2d.h>
 #include   	"bucket.h"
@@ -42,6 +50,7 @@ namespace Aqsis {
 
 
 class CqMicroPolygon;
+class CqBucketProcessor;
 
 
 // Enumeration of the type of rendering order of the buckets (experimental)
@@ -71,7 +80,9 @@ enum EqBucketOrder {
   the first bucket that touches its bound.
  
   Once all the gprims are posted to the buffer the image can be rendered by calling
-  RenderImage(). Now all buckets will be processed one after another. 
+  RenderImage(). Now all buckets will be processed one after another, or, when
+  Option "limits" "threads" asks for more than one thread, by a set of worker
+  threads which each own a CqBucketProcessor and finish buckets out of order.
  
   \see CqBucket, CqSurface, CqRenderer
  */
@@ -84,7 +95,10 @@ class CqImageBuffer
 				m_cXBuckets( 0 ),
 				m_cYBuckets( 0 ),
 				m_CurrentBucketCol( 0 ),
-				m_CurrentBucketRow( 0 )
+				m_CurrentBucketRow( 0 ),
+				m_concurrentBuckets( false ),
+				m_pendingBuckets( false ),
+				m_bucketsRetired( 0 )
 		{}
 		~CqImageBuffer();
 
@@ -122,7 +136,115 @@ class CqImageBuffer
 		 */
 		void	axialNeighbours(CqBucket const& bucket, std::vector<CqBucket*>& neighbours);
 
+		/** \brief Determine whether buckets are being rendered concurrently.
+		 *
+		 * When true, bucket processors must hold the shading lock while
+		 * splitting, dicing or shading, must hold the geometry lock while
+		 * using the bucket queues, and must notify the image buffer via
+		 * surfaceRendered() when they are done with a surface.
+		 */
+		bool	concurrentBuckets() const
+		{
+			return m_concurrentBuckets;
+		}
+		/** \brief Notify the image buffer that a surface has been rendered.
+		 *
+		 * This releases the hold which the surface had on the buckets its
+		 * bound touches, allowing them to be finished once no other live
+		 * surface can contribute to them.
+		 *
+		 * \param host - bucket which the surface was posted to.
+		 * \param surface - the surface which has been rendered, culled or split.
+		 */
+		void	surfaceRendered( const CqBucket& host, const boost::shared_ptr<CqSurface>& surface );
+#ifdef	ENABLE_THREADING
+		/** \brief Lock protecting the surface and micropolygon queues.
+		 *
+		 * This covers the queues and live surface counts of all buckets.
+		 * PostSurface() and RepostSurface() take it themselves; micropolygons
+		 * must be added and released while holding it, as they share the
+		 * reference counts of their grids.
+		 */
+		boost::mutex&	geometryMutex()
+		{
+			return m_geometryMutex;
+		}
+		/** \brief Lock serialising splitting and dicing.
+		 *
+		 * Splitting expands procedurals through the shared RI context, and
+		 * the patches of a surface may share state such as subdivision
+		 * topology, so only one bucket processor at a time may split or
+		 * dice.  Shading isn't covered; see CqShaderLock.  When both this and
+		 * the geometry lock are needed, this one must be taken first.
+		 */
+		boost::mutex&	splitMutex()
+		{
+			return m_splitMutex;
+		}
+		/** \brief Scoped lock which is only taken when buckets are rendered
+		 * concurrently.
+		 */
+		class CqConcurrentLock
+		{
+			public:
+				CqConcurrentLock( const CqImageBuffer& imageBuf, boost::mutex& mutex )
+					: m_lock()
+				{
+					if( imageBuf.concurrentBuckets() )
+						m_lock.reset( new boost::mutex::scoped_lock( mutex ) );
+				}
+				/// Release the lock before the end of the scope.
+				void	unlock()
+				{
+					m_lock.reset();
+				}
+			private:
+				boost::scoped_ptr<boost::mutex::scoped_lock> m_lock;
+		};
+		/** \brief Scoped lock on the shaders which run on a grid.
+		 *
+		 * A shader instance holds the variables of the grid it is running
+		 * on, as does a light source, so each may only shade one grid at a
+		 * time.  This locks all the shaders used by a grid, so grids with
+		 * different shaders are shaded concurrently.  Shaders are locked
+		 * through a fixed set of mutexes chosen by address, always in the
+		 * same order, so two shader locks can't deadlock.  Like
+		 * CqConcurrentLock, nothing is locked unless buckets are rendered
+		 * concurrently.  No other lock may be taken while holding this one.
+		 */
+		class CqShaderLock : boost::noncopyable
+		{
+			public:
+				/** Lock the surface, displacement, atmosphere and light
+				 * shaders of the given attributes.  Light shaders are
+				 * skipped when lighting is turned off.
+				 */
+				CqShaderLock( CqImageBuffer& imageBuf, const IqAttributes* attributes );
+				/// Lock a single shader, such as an imager.
+				CqShaderLock( CqImageBuffer& imageBuf, const void* shader );
+			private:
+				void	lockAll( const std::vector<const void*>& shaders );
+
+				CqImageBuffer&	m_imageBuf;
+				boost::ptr_vector<boost::mutex::scoped_lock>	m_locks;
+		};
+		/** \brief Condition signalled whenever a surface has been rendered.
+		 *
+		 * Bucket processors waiting for geometry from other buckets wait on
+		 * this condition using geometryMutex().
+		 */
+		boost::condition&	geometryChanged()
+		{
+			return m_geometryChanged;
+		}
+#endif
+
 	private:
+		friend class CqBucketWorker;
+#ifdef	ENABLE_THREADING
+		friend class CqShaderLock;
+#endif
+
 		/// Get a pointer to the bucket at position x,y in the grid.
 		CqBucket& Bucket( TqInt x, TqInt y)
 		{
@@ -144,6 +266,19 @@ class CqImageBuffer
 		TqInt	m_CurrentBucketCol;	///< Column index of the bucket currently being processed.
 		TqInt	m_CurrentBucketRow;	///< Row index of the bucket currently being processed.
 
+		bool	m_concurrentBuckets;	///< True if buckets are rendered by several threads.
+		bool	m_pendingBuckets;	///< True while there are buckets left to hand out to workers.
+		TqInt	m_bucketsRetired;	///< Number of buckets sent to the display (for progress reporting).
+#ifdef	ENABLE_THREADING
+		boost::mutex	m_geometryMutex;	///< Protects the bucket queues.
+		boost::mutex	m_splitMutex;	///< Serialises split/dice.
+		/// Number of mutexes shared between all the shaders.
+		static const TqInt numShaderMutexes = 61;
+		boost::mutex	m_shaderMutexes[numShaderMutexes];	///< Lock shaders by address, see CqShaderLock.
+		boost::condition	m_geometryChanged;	///< Signalled when a surface has been rendered.
+		boost::mutex	m_displayMutex;	///< Serialises retirement of buckets to the display manager.
+#endif
+
 #if ENABLE_MPDUMP
 		CqMPDump	m_mpdump;
 #endif
@@ -151,6 +286,27 @@ class CqImageBuffer
 		bool	CullSurface( CqBound& Bound, const boost::shared_ptr<CqSurface>& pSurface );
 		void	DeleteImage();
 
+		/** Add a surface to the queue of the given bucket, keeping track of
+		 * the buckets it touches when rendering concurrently.
+		 */
+		void	AddGPrimToBucket( CqBucket& bucket, const boost::shared_ptr<CqSurface>& pSurface );
+		/** Adjust the live surface count of the buckets touched by a surface.
+		 *
+		 * Only buckets touched by the surface bound which are not before the
+		 * host bucket in raster order, and which have not been processed, are
+		 * adjusted.  Counted buckets can't be processed while the count is
+		 * nonzero, so a later call with the opposite delta adjusts exactly
+		 * the same set of buckets.
+		 */
+		void	AdjustSurfaceFootprint( const CqBucket& host, CqSurface& surface, TqInt delta );
+
+		/** Render the image using several worker threads.
+		 */
+		void	RenderImageConcurrent( EqBucketOrder order, bool jitter );
+		/** Send a finished bucket to the display and report progress.
+		 */
+		void	RetireBucket( CqBucketProcessor& processor );
+
 		/** Move to the next bucket to process.
 		 */
 		bool NextBucket(EqBucketOrder order);
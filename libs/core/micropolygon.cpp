@@ -1681,6 +1681,10 @@ void CqMicroPolygon::CalculateBound()
 void CqMicroPolygonMotion::Initialise()
 {
 	ComputeVertexOrder();
+	// Use as many time ranges as there are samples in a pixel, as the
+	// sampler does.
+	const TqInt* pixelSamps = QGetRenderContext()->poptCurrent()->GetIntegerOption( "System", "PixelSamples" );
+	BuildBoundList( max( 4, pixelSamps[ 0 ] * pixelSamps[ 1 ] ) );
 }
 
 //---------------------------------------------------------------------
@@ -1968,26 +1972,23 @@ void CqMicroPolygonMotion::AppendKey( const CqVector3D& vA, const CqVector3D& vB
 
 
 //---------------------------------------------------------------------
-/** Calculate the 2D boundary of this micropolygon,
+/** Construct a key, calculating its boundary.
  */
 
-const CqBound& CqMovingMicroPolygonKey::GetBound()
+CqMovingMicroPolygonKey::CqMovingMicroPolygonKey( const CqVector3D& vA, const CqVector3D& vB, const CqVector3D& vC, const CqVector3D& vD )
+	: m_Point0( vA ),
+	m_Point1( vB ),
+	m_Point2( vC ),
+	m_Point3( vD ),
+	m_Bound()
 {
-	if(m_BoundReady)
-		return m_Bound;
-
-	// Calculate the boundary, and store the indexes in the cache.
 	m_Bound.vecMin().x( min( m_Point0.x(), min( m_Point1.x(), min( m_Point2.x(), m_Point3.x() ) ) ) );
 	m_Bound.vecMin().y( min( m_Point0.y(), min( m_Point1.y(), min( m_Point2.y(), m_Point3.y() ) ) ) );
 	m_Bound.vecMin().z( min( m_Point0.z(), min( m_Point1.z(), min( m_Point2.z(), m_Point3.z() ) ) ) );
 	m_Bound.vecMax().x( max( m_Point0.x(), max( m_Point1.x(), max( m_Point2.x(), m_Point3.x() ) ) ) );
 	m_Bound.vecMax().y( max( m_Point0.y(), max( m_Point1.y(), max( m_Point2.y(), m_Point3.y() ) ) ) );
 	m_Bound.vecMax().z( max( m_Point0.z(), max( m_Point1.z(), max( m_Point2.z(), m_Point3.z() ) ) ) );
-
-	m_BoundReady = true;
-	return ( m_Bound );
 }
 
-
 } // namespace Aqsis
 //---------------------------------------------------------------------
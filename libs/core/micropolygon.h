@@ -826,14 +826,7 @@ class CqMicroPolygon : boost::noncopyable
 class CqMovingMicroPolygonKey
 {
 	public:
-		CqMovingMicroPolygonKey( const CqVector3D& vA, const CqVector3D& vB, const CqVector3D& vC, const CqVector3D& vD )
-			: m_Point0(vA),
-			m_Point1(vB),
-			m_Point2(vC),
-			m_Point3(vD),
-			m_Bound(),
-			m_BoundReady(false)
-		{ }
+		CqMovingMicroPolygonKey( const CqVector3D& vA, const CqVector3D& vB, const CqVector3D& vC, const CqVector3D& vD );
 
 		/** Overridden operator new to allocate micropolys from a pool.
 		 * \todo Review: Unused parameter size
@@ -852,7 +845,13 @@ class CqMovingMicroPolygonKey
 
 
 	public:
-		const CqBound&	GetBound();
+		/** Get the bound of the key.  This is computed on construction, as a
+		 * micropolygon may be sampled by several buckets at once.
+		 */
+		const CqBound&	GetBound() const
+		{
+			return ( m_Bound );
+		}
 
 		CqVector3D	m_Point0;
 		CqVector3D	m_Point1;
@@ -861,7 +860,6 @@ class CqMovingMicroPolygonKey
 
 	protected:
 		CqBound m_Bound;
-		bool	m_BoundReady;
 
 		static	CqObjectPool<CqMovingMicroPolygonKey>	m_thePool;
 }
@@ -888,7 +886,9 @@ class CqMicroPolygonMotion : public CqMicroPolygon
 
 		/** \brief Initialise some micropolygon member data.
 		 *
-		 * Initialise the vertex ordering based on the primary (first) key frame.
+		 * Initialise the vertex ordering based on the primary (first) key
+		 * frame, and build the list of bounds over the shutter interval.
+		 * Must be called once all the keys have been added.
 		 */
 		virtual void Initialise();
 
@@ -911,10 +911,11 @@ class CqMicroPolygonMotion : public CqMicroPolygon
 		void	AppendKey( const CqVector3D& vA, const CqVector3D& vB, const CqVector3D& vC, const CqVector3D& vD, TqFloat time );
 
 		// Overrides from CqMicroPolygon
+		/** The bound list is built by Initialise() rather than on demand, as
+		 * the micropolygon may be sampled by several buckets at once.
+		 */
 		virtual	TqInt	cSubBounds( TqUint timeRanges )
 		{
-			if ( !m_BoundReady )
-				BuildBoundList( timeRanges );
 			return ( m_BoundList.Size() );
 		}
 		virtual	CqBound	SubBound( TqInt iIndex, TqFloat& time ) const
@@ -21,6 +21,10 @@
 
 #include "optioncache.h"
 
+#include <algorithm>
+
+#include <boost/thread/thread.hpp>
+
 #include <aqsis/util/logging.h>
 #include <aqsis/util/sstring.h>
 
@@ -40,6 +44,7 @@ SqOptionCache::SqOptionCache()
 	xBucketSize(16),
 	yBucketSize(16),
 	maxEyeSplits(1),
+	numThreads(1),
 	displayMode(DMode_None),
 	depthFilter(Filter_Min),
 	zThreshold()
@@ -86,6 +91,15 @@ void SqOptionCache::cacheOptions(const IqOptions& opts)
 	maxEyeSplits = 10;
 	if(const TqInt* splits = opts.GetIntegerOption("limits", "eyesplits"))
 		maxEyeSplits = splits[0];
+	// Number of bucket rendering threads.  Zero or less means "use all the
+	// available cores".
+	numThreads = 1;
+	if(const TqInt* threads = opts.GetIntegerOption("limits", "threads"))
+	{
+		numThreads = threads[0];
+		if(numThreads <= 0)
+			numThreads = std::max<TqInt>(1, boost::thread::hardware_concurrency());
+	}
 
 	// Display mode.
 	const TqInt* dMode = opts.GetIntegerOption("System", "DisplayMode");
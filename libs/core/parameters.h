@@ -55,6 +55,86 @@ namespace Aqsis {
 template<typename SLT, typename T>
 SLT paramToShaderType(const T& paramVal);
 
+//----------------------------------------------------------------------
+/** \brief Parameter values, which may share their storage with other
+ * parameters.
+ *
+ * Values behave like a std::vector: copies are deep, and only share() makes
+ * two sets of values use the same storage.  Shared values are copied before
+ * any non-const access, so a parameter never sees changes made through
+ * another one.  Pointers and references obtained through non-const access
+ * must therefore not be kept across a call to share().
+ */
+template<typename T>
+class CqSharedValues
+{
+	public:
+		explicit CqSharedValues( TqUint size = 0 ) :
+				m_values( new std::vector<T>( size ) )
+		{}
+		CqSharedValues( const CqSharedValues<T>& From ) :
+				m_values( new std::vector<T>( *From.m_values ) )
+		{}
+		CqSharedValues<T>& operator=( const CqSharedValues<T>& From )
+		{
+			if ( m_values != From.m_values )
+				m_values.reset( new std::vector<T>( *From.m_values ) );
+			return ( *this );
+		}
+
+		/// Use the same storage as From, without copying it.
+		void share( const CqSharedValues<T>& From )
+		{
+			m_values = From.m_values;
+		}
+
+		TqUint size() const
+		{
+			return ( m_values->size() );
+		}
+		void resize( TqUint size )
+		{
+			values().resize( size );
+		}
+		void clear()
+		{
+			values().clear();
+		}
+		template<typename InputIterator>
+		void assign( InputIterator first, InputIterator last )
+		{
+			values().assign( first, last );
+		}
+		typename std::vector<T>::const_iterator begin() const
+		{
+			return ( m_values->begin() );
+		}
+		typename std::vector<T>::const_iterator end() const
+		{
+			return ( m_values->end() );
+		}
+		const T& operator[]( TqUint i ) const
+		{
+			return ( ( *m_values ) [ i ] );
+		}
+		T& operator[]( TqUint i )
+		{
+			return ( values() [ i ] );
+		}
+
+	private:
+		/// Get the values for modification, copying them first if shared.
+		std::vector<T>& values()
+		{
+			if ( !m_values.unique() )
+				m_values.reset( new std::vector<T>( *m_values ) );
+			return ( *m_values );
+		}
+
+		boost::shared_ptr<std::vector<T> > m_values;
+};
+
+
 //----------------------------------------------------------------------
 /** \class CqParameter
  * Class storing a parameter with a name and value.
@@ -84,6 +164,17 @@ class CqParameter : public IqParameter
 		 * \return A pointer to a new parameter with the same name and value.
 		 */
 		virtual	CqParameter* Clone() const = 0;
+		/** Duplicate the parameter, sharing the storage for its values.
+		 *
+		 * The result behaves exactly like Clone(), but parameters with many
+		 * values use the same storage until either one is modified.  This
+		 * lets object instances share their primitive variables.
+		 * \return A pointer to a new parameter with the same name and value.
+		 */
+		virtual	CqParameter* CloneShared() const
+		{
+			return ( Clone() );
+		}
 		/** Pure virtual, get value class.
 		 * \return Class as an EqVariableClass.
 		 */
@@ -248,6 +339,14 @@ class CqParameterTypedVarying : public CqParameterTyped<T, SLT>
 		{
 			return ( new CqParameterTypedVarying<T, I, SLT>( *this ) );
 		}
+		virtual	CqParameter* CloneShared() const
+		{
+			// CloneType() gives the derived vertex and facevarying types.
+			CqParameterTypedVarying<T, I, SLT>* pParam
+				= static_cast<CqParameterTypedVarying<T, I, SLT>*>( this->CloneType( this->strName().c_str(), this->Count() ) );
+			pParam->m_aValues.share( m_aValues );
+			return ( pParam );
+		}
 		virtual	EqVariableClass	Class() const
 		{
 			return ( class_varying );
@@ -355,7 +454,7 @@ class CqParameterTypedVarying : public CqParameterTyped<T, SLT>
 		}
 
 	private:
-		std::vector<T>	m_aValues;		///< Vector of values, one per varying index.
+		CqSharedValues<T>	m_aValues;		///< Vector of values, one per varying index.
 }
 ;
 
@@ -390,6 +489,13 @@ class CqParameterTypedUniform : public CqParameterTyped<T, SLT>
 		{
 			return ( new CqParameterTypedUniform<T, I, SLT>( *this ) );
 		}
+		virtual	CqParameter* CloneShared() const
+		{
+			CqParameterTypedUniform<T, I, SLT>* pParam
+				= new CqParameterTypedUniform<T, I, SLT>( this->strName().c_str(), this->Count() );
+			pParam->m_aValues.share( m_aValues );
+			return ( pParam );
+		}
 		virtual	EqVariableClass	Class() const
 		{
 			return ( class_uniform );
@@ -498,7 +604,7 @@ class CqParameterTypedUniform : public CqParameterTyped<T, SLT>
 			return ( new CqParameterTypedUniform<T, I, SLT>( strName, Count ) );
 		}
 	private:
-		std::vector<T>	m_aValues;		///< Vector of values, one per uniform index.
+		CqSharedValues<T>	m_aValues;		///< Vector of values, one per uniform index.
 }
 ;
 
@@ -818,6 +924,15 @@ class CqParameterTypedVaryingArray : public CqParameterTyped<T, SLT>
 		{
 			return ( new CqParameterTypedVaryingArray<T, I, SLT>( *this ) );
 		}
+		virtual	CqParameter* CloneShared() const
+		{
+			// CloneType() gives the derived vertex and facevarying types.
+			CqParameterTypedVaryingArray<T, I, SLT>* pParam
+				= static_cast<CqParameterTypedVaryingArray<T, I, SLT>*>( this->CloneType( this->strName().c_str(), this->Count() ) );
+			pParam->m_size = m_size;
+			pParam->m_aValues.share( m_aValues );
+			return ( pParam );
+		}
 		virtual	EqVariableClass	Class() const
 		{
 			return ( class_varying );
@@ -934,7 +1049,7 @@ class CqParameterTypedVaryingArray : public CqParameterTyped<T, SLT>
 
 	private:
 		TqInt m_size;  ///< number of values stored ( == m_aValues.size()/m_Count )
-		std::vector<T>	m_aValues;		///< Array of varying values.
+		CqSharedValues<T>	m_aValues;		///< Array of varying values.
 }
 ;
 
@@ -0,0 +1,397 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+		\brief Bounding volume hierarchy over triangles, for ray queries.
+*/
+
+#include	"bvh.h"
+
+#include	<algorithm>
+#include	<cfloat>
+
+namespace Aqsis {
+
+namespace {
+
+/// Number of bins used when evaluating the surface area heuristic.
+const TqInt numSahBins = 16;
+/// Nodes with at most this many triangles are always made into leaves.
+const TqInt minLeafSize = 2;
+/// Nodes with more than this many triangles are always split.
+const TqInt maxLeafSize = 16;
+/// Maximum depth of the tree; deeper nodes are made into leaves.
+const TqInt maxDepth = 64;
+
+/// Axis aligned box used during the build.
+struct SqBox
+{
+	TqFloat min[3];
+	TqFloat max[3];
+
+	SqBox()
+	{
+		for(TqInt i = 0; i < 3; ++i)
+		{
+			min[i] = FLT_MAX;
+			max[i] = -FLT_MAX;
+		}
+	}
+	void extend(const SqBox& b)
+	{
+		for(TqInt i = 0; i < 3; ++i)
+		{
+			min[i] = std::min(min[i], b.min[i]);
+			max[i] = std::max(max[i], b.max[i]);
+		}
+	}
+	void extend(const TqFloat* p)
+	{
+		for(TqInt i = 0; i < 3; ++i)
+		{
+			min[i] = std::min(min[i], p[i]);
+			max[i] = std::max(max[i], p[i]);
+		}
+	}
+	/// Half the surface area, which is all the heuristic needs.
+	TqFloat halfArea() const
+	{
+		if(min[0] > max[0])
+			return 0;
+		TqFloat dx = max[0] - min[0];
+		TqFloat dy = max[1] - min[1];
+		TqFloat dz = max[2] - min[2];
+		return dx*dy + dy*dz + dz*dx;
+	}
+};
+
+/// A node waiting to be built.
+struct SqPendingNode
+{
+	TqInt node;
+	TqInt begin;
+	TqInt end;
+	TqInt depth;
+};
+
+} // unnamed namespace
+
+/// Triangle bound and centroid, used during the build.
+struct CqTriangleBvh::SqBuildPrim
+{
+	SqBox box;
+	TqFloat centroid[3];
+	TqInt triangle;
+	TqInt bin;
+};
+
+CqTriangleBvh::CqTriangleBvh()
+	: m_triangles(),
+	m_nodes()
+{ }
+
+void CqTriangleBvh::addTriangle(const CqVector3D& a, const CqVector3D& b,
+		const CqVector3D& c, TqInt tag)
+{
+	SqTriangle tri;
+	tri.v0 = a;
+	tri.e1 = b - a;
+	tri.e2 = c - a;
+	tri.tag = tag;
+	m_triangles.push_back(tri);
+}
+
+void CqTriangleBvh::clear()
+{
+	std::vector<SqTriangle>().swap(m_triangles);
+	std::vector<SqNode>().swap(m_nodes);
+}
+
+void CqTriangleBvh::build()
+{
+	m_nodes.clear();
+	TqInt numTris = m_triangles.size();
+	if(numTris == 0)
+		return;
+
+	std::vector<SqBuildPrim> prims(numTris);
+	for(TqInt i = 0; i < numTris; ++i)
+	{
+		const SqTriangle& tri = m_triangles[i];
+		CqVector3D verts[3] = { tri.v0, tri.v0 + tri.e1, tri.v0 + tri.e2 };
+		SqBuildPrim& prim = prims[i];
+		for(TqInt j = 0; j < 3; ++j)
+		{
+			TqFloat p[3] = { verts[j].x(), verts[j].y(), verts[j].z() };
+			prim.box.extend(p);
+		}
+		for(TqInt j = 0; j < 3; ++j)
+			prim.centroid[j] = 0.5f*(prim.box.min[j] + prim.box.max[j]);
+		prim.triangle = i;
+		prim.bin = 0;
+	}
+
+	// A binary tree with at least one triangle per leaf has fewer than
+	// 2*numTris nodes.
+	m_nodes.reserve(2*numTris);
+	m_nodes.push_back(SqNode());
+	buildNode(0, prims, 0, numTris);
+
+	// Reorder the triangles so that leaves refer to contiguous ranges.
+	std::vector<SqTriangle> sorted(numTris);
+	for(TqInt i = 0; i < numTris; ++i)
+		sorted[i] = m_triangles[prims[i].triangle];
+	m_triangles.swap(sorted);
+}
+
+void CqTriangleBvh::buildNode(TqInt nodeIndex, std::vector<SqBuildPrim>& prims,
+		TqInt begin, TqInt end)
+{
+	// Explicit stack of pending nodes, to avoid deep recursion on badly
+	// distributed input.
+	std::vector<SqPendingNode> pending;
+	SqPendingNode root = { nodeIndex, begin, end, 0 };
+	pending.push_back(root);
+
+	while(!pending.empty())
+	{
+		SqPendingNode job = pending.back();
+		pending.pop_back();
+
+		SqBox bound;
+		SqBox centroidBound;
+		for(TqInt i = job.begin; i < job.end; ++i)
+		{
+			bound.extend(prims[i].box);
+			centroidBound.extend(prims[i].centroid);
+		}
+		SqNode& node = m_nodes[job.node];
+		for(TqInt i = 0; i < 3; ++i)
+		{
+			node.min[i] = bound.min[i];
+			node.max[i] = bound.max[i];
+		}
+		node.index = job.begin;
+		node.count = job.end - job.begin;
+		node.axis = 0;
+
+		TqInt count = job.end - job.begin;
+		if(count <= minLeafSize || job.depth >= maxDepth)
+			continue;
+
+		// Split along the axis of greatest centroid extent.
+		TqInt axis = 0;
+		TqFloat extent = centroidBound.max[0] - centroidBound.min[0];
+		for(TqInt i = 1; i < 3; ++i)
+		{
+			TqFloat e = centroidBound.max[i] - centroidBound.min[i];
+			if(e > extent)
+			{
+				extent = e;
+				axis = i;
+			}
+		}
+		if(extent <= 0)
+		{
+			// All centroids coincide, so no split can separate them.
+			if(count <= maxLeafSize)
+				continue;
+			axis = -1;
+		}
+
+		TqInt mid = job.begin;
+		if(axis >= 0)
+		{
+			// Bin the centroids and sweep to find the cheapest split.
+			SqBox binBoxes[numSahBins];
+			TqInt binCounts[numSahBins] = {0};
+			TqFloat binScale = numSahBins*(1 - 1e-5f)/extent;
+			for(TqInt i = job.begin; i < job.end; ++i)
+			{
+				TqInt b = static_cast<TqInt>(
+						binScale*(prims[i].centroid[axis] - centroidBound.min[axis]));
+				b = std::min(std::max(b, 0), numSahBins - 1);
+				prims[i].bin = b;
+				++binCounts[b];
+				binBoxes[b].extend(prims[i].box);
+			}
+			TqFloat rightCost[numSahBins];
+			SqBox acc;
+			TqInt accCount = 0;
+			for(TqInt b = numSahBins - 1; b > 0; --b)
+			{
+				acc.extend(binBoxes[b]);
+				accCount += binCounts[b];
+				rightCost[b] = accCount*acc.halfArea();
+			}
+			TqFloat bestCost = FLT_MAX;
+			TqInt bestSplit = -1;
+			acc = SqBox();
+			accCount = 0;
+			for(TqInt b = 0; b < numSahBins - 1; ++b)
+			{
+				acc.extend(binBoxes[b]);
+				accCount += binCounts[b];
+				if(accCount == 0 || accCount == count)
+					continue;
+				TqFloat cost = accCount*acc.halfArea() + rightCost[b+1];
+				if(cost < bestCost)
+				{
+					bestCost = cost;
+					bestSplit = b;
+				}
+			}
+			// Compare against the cost of intersecting every triangle in a
+			// leaf, taking a node traversal to cost about as much as a
+			// triangle test.
+			TqFloat leafCost = count*bound.halfArea();
+			if(bestSplit >= 0 && (bestCost + bound.halfArea() < leafCost
+						|| count > maxLeafSize))
+			{
+				TqInt lo = job.begin;
+				TqInt hi = job.end;
+				while(lo < hi)
+				{
+					if(prims[lo].bin <= bestSplit)
+						++lo;
+					else
+						std::swap(prims[lo], prims[--hi]);
+				}
+				mid = lo;
+			}
+			else if(count <= maxLeafSize)
+				continue;
+		}
+		if(mid == job.begin || mid == job.end)
+		{
+			// No useful split was found; fall back to splitting in the
+			// middle of the list.
+			mid = (job.begin + job.end)/2;
+		}
+
+		TqInt child = m_nodes.size();
+		m_nodes.push_back(SqNode());
+		m_nodes.push_back(SqNode());
+		// m_nodes may have been reallocated, so don't use the node reference.
+		m_nodes[job.node].index = child;
+		m_nodes[job.node].count = 0;
+		m_nodes[job.node].axis = std::max(axis, 0);
+		SqPendingNode left = { child, job.begin, mid, job.depth + 1 };
+		SqPendingNode right = { child + 1, mid, job.end, job.depth + 1 };
+		pending.push_back(right);
+		pending.push_back(left);
+	}
+}
+
+bool CqTriangleBvh::intersect(const CqVector3D& origin,
+		const CqVector3D& direction, TqFloat minDist, TqFloat maxDist,
+		SqHit* hit) const
+{
+	if(m_nodes.empty())
+		return false;
+
+	const TqFloat org[3] = { origin.x(), origin.y(), origin.z() };
+	const TqFloat dir[3] = { direction.x(), direction.y(), direction.z() };
+	TqFloat invDir[3];
+	bool dirNeg[3];
+	for(TqInt i = 0; i < 3; ++i)
+	{
+		invDir[i] = dir[i] != 0 ? 1/dir[i] : FLT_MAX;
+		dirNeg[i] = dir[i] < 0;
+	}
+
+	bool found = false;
+	TqFloat closest = maxDist;
+	TqInt stack[maxDepth + 2];
+	TqInt stackSize = 0;
+	TqInt nodeIndex = 0;
+	while(true)
+	{
+		const SqNode& node = m_nodes[nodeIndex];
+		// Ray-box slab test.
+		TqFloat t0 = minDist;
+		TqFloat t1 = closest;
+		for(TqInt i = 0; i < 3; ++i)
+		{
+			TqFloat tNear = (node.min[i] - org[i])*invDir[i];
+			TqFloat tFar = (node.max[i] - org[i])*invDir[i];
+			if(dirNeg[i])
+				std::swap(tNear, tFar);
+			t0 = tNear > t0 ? tNear : t0;
+			t1 = tFar < t1 ? tFar : t1;
+		}
+		if(t0 <= t1)
+		{
+			if(node.count > 0)
+			{
+				for(TqInt i = node.index, end = node.index + node.count;
+						i < end; ++i)
+				{
+					// Moller-Trumbore ray-triangle test.
+					const SqTriangle& tri = m_triangles[i];
+					CqVector3D p = direction % tri.e2;
+					TqFloat det = tri.e1 * p;
+					if(det == 0)
+						continue;
+					TqFloat invDet = 1/det;
+					CqVector3D s = origin - tri.v0;
+					TqFloat u = (s * p)*invDet;
+					if(u < 0 || u > 1)
+						continue;
+					CqVector3D q = s % tri.e1;
+					TqFloat v = (direction * q)*invDet;
+					if(v < 0 || u + v > 1)
+						continue;
+					TqFloat t = (tri.e2 * q)*invDet;
+					if(t < minDist || t > closest)
+						continue;
+					if(!hit)
+						return true;
+					found = true;
+					closest = t;
+					hit->distance = t;
+					hit->triangle = i;
+				}
+			}
+			else
+			{
+				// Visit the nearer child first, so that the closest hit
+				// shrinks the search interval as early as possible.
+				if(dirNeg[node.axis])
+				{
+					stack[stackSize++] = node.index;
+					nodeIndex = node.index + 1;
+				}
+				else
+				{
+					stack[stackSize++] = node.index + 1;
+					nodeIndex = node.index;
+				}
+				continue;
+			}
+		}
+		if(stackSize == 0)
+			break;
+		nodeIndex = stack[--stackSize];
+	}
+	return found;
+}
+
+} // namespace Aqsis
@@ -0,0 +1,154 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+		\brief Bounding volume hierarchy over triangles, for ray queries.
+*/
+
+#ifndef BVH_H_INCLUDED
+#define BVH_H_INCLUDED 1
+
+#include	<aqsis/aqsis.h>
+
+#include	<vector>
+
+#include	<boost/noncopyable.hpp>
+
+#include	<aqsis/math/vector3d.h>
+
+namespace Aqsis {
+
+//----------------------------------------------------------------------
+/** \brief A bounding volume hierarchy of triangles.
+ *
+ * The hierarchy is built top down with a binned surface area heuristic, and
+ * stored as a flat array of nodes with the two children of each interior node
+ * adjacent to each other.  Triangles are reordered during the build so that
+ * each leaf refers to a contiguous range of them.
+ *
+ * Once built, the hierarchy is immutable and intersect() may be called from
+ * several threads at once.
+ */
+class CqTriangleBvh : boost::noncopyable
+{
+	public:
+		/// Details of a ray-triangle intersection.
+		struct SqHit
+		{
+			TqFloat distance;	///< Ray parameter of the hit.
+			TqInt triangle;		///< Index of the triangle which was hit.
+		};
+
+		CqTriangleBvh();
+
+		/** \brief Add a triangle to the set which will be built into the tree.
+		 *
+		 * \param tag - user data identifying the triangle, retrieved by tag().
+		 */
+		void addTriangle(const CqVector3D& a, const CqVector3D& b,
+				const CqVector3D& c, TqInt tag);
+		/// Build the hierarchy from the triangles added so far.
+		void build();
+		/// Remove all triangles and nodes.
+		void clear();
+
+		/// Return the number of triangles.
+		TqInt numTriangles() const;
+		/// Return the number of nodes in the hierarchy.
+		TqInt numNodes() const;
+
+		/// Get the tag of the given triangle.
+		TqInt tag(TqInt triangle) const;
+		/// Get the (unnormalised) geometric normal of the given triangle.
+		CqVector3D normal(TqInt triangle) const;
+
+		/** \brief Intersect a ray with the triangles in the tree.
+		 *
+		 * Triangles are double sided.  The ray direction need not be
+		 * normalised; hit distances are in units of the direction length.
+		 *
+		 * \param origin - ray origin
+		 * \param direction - ray direction
+		 * \param minDist - ignore hits nearer than this
+		 * \param maxDist - ignore hits further than this
+		 * \param hit - if non-null, receives the nearest hit.  If null, the
+		 *              search stops at the first hit found.
+		 * \return true if the ray hit a triangle.
+		 */
+		bool intersect(const CqVector3D& origin, const CqVector3D& direction,
+				TqFloat minDist, TqFloat maxDist, SqHit* hit) const;
+
+	private:
+		struct SqTriangle
+		{
+			CqVector3D v0;
+			CqVector3D e1;
+			CqVector3D e2;
+			TqInt tag;
+		};
+		/// A node; leaves have count > 0.
+		struct SqNode
+		{
+			TqFloat min[3];
+			TqFloat max[3];
+			/// First triangle for leaves, first child for interior nodes.
+			TqInt index;
+			TqInt count;
+			/// Split axis for interior nodes.
+			TqInt axis;
+		};
+		struct SqBuildPrim;
+
+		void buildNode(TqInt nodeIndex, std::vector<SqBuildPrim>& prims,
+				TqInt begin, TqInt end);
+
+		std::vector<SqTriangle> m_triangles;
+		std::vector<SqNode> m_nodes;
+};
+
+
+//==============================================================================
+// Implementation details
+//==============================================================================
+
+inline TqInt CqTriangleBvh::numTriangles() const
+{
+	return m_triangles.size();
+}
+
+inline TqInt CqTriangleBvh::numNodes() const
+{
+	return m_nodes.size();
+}
+
+inline TqInt CqTriangleBvh::tag(TqInt triangle) const
+{
+	return m_triangles[triangle].tag;
+}
+
+inline CqVector3D CqTriangleBvh::normal(TqInt triangle) const
+{
+	const SqTriangle& tri = m_triangles[triangle];
+	return tri.e1 % tri.e2;
+}
+
+} // namespace Aqsis
+
+#endif // BVH_H_INCLUDED
@@ -0,0 +1,133 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+/** \file
+ *
+ * \brief Unit tests for the triangle bounding volume hierarchy.
+ */
+
+#include "bvh.h"
+
+#include <cfloat>
+#include <cmath>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+#include <aqsis/math/random.h>
+
+using namespace Aqsis;
+
+namespace {
+
+CqVector3D randomPoint(CqRandom& rand, TqFloat scale)
+{
+	return CqVector3D(scale*(2*rand.RandomFloat() - 1),
+			scale*(2*rand.RandomFloat() - 1),
+			scale*(2*rand.RandomFloat() - 1));
+}
+
+// Brute force nearest hit against a list of triangles.
+TqFloat bruteForceHit(const std::vector<CqVector3D>& verts,
+		const CqVector3D& org, const CqVector3D& dir)
+{
+	TqFloat closest = FLT_MAX;
+	for(TqInt i = 0, n = verts.size()/3; i < n; ++i)
+	{
+		CqTriangleBvh single;
+		single.addTriangle(verts[3*i], verts[3*i+1], verts[3*i+2], i);
+		single.build();
+		CqTriangleBvh::SqHit hit;
+		if(single.intersect(org, dir, 0, closest, &hit))
+			closest = hit.distance;
+	}
+	return closest;
+}
+
+} // unnamed namespace
+
+BOOST_AUTO_TEST_SUITE(bvh_tests)
+
+BOOST_AUTO_TEST_CASE(CqTriangleBvh_single_triangle_test)
+{
+	CqTriangleBvh bvh;
+	bvh.addTriangle(CqVector3D(0,0,1), CqVector3D(1,0,1), CqVector3D(0,1,1), 42);
+	bvh.build();
+
+	CqTriangleBvh::SqHit hit;
+	BOOST_REQUIRE(bvh.intersect(CqVector3D(0.25,0.25,0), CqVector3D(0,0,1),
+				0, FLT_MAX, &hit));
+	BOOST_CHECK_CLOSE(hit.distance, 1.0f, 1e-4f);
+	BOOST_CHECK_EQUAL(bvh.tag(hit.triangle), 42);
+	// Triangles are double sided.
+	BOOST_CHECK(bvh.intersect(CqVector3D(0.25,0.25,2), CqVector3D(0,0,-1),
+				0, FLT_MAX, 0));
+	// Misses and out of range hits.
+	BOOST_CHECK(!bvh.intersect(CqVector3D(0.75,0.75,0), CqVector3D(0,0,1),
+				0, FLT_MAX, 0));
+	BOOST_CHECK(!bvh.intersect(CqVector3D(0.25,0.25,0), CqVector3D(0,0,1),
+				0, 0.5, 0));
+	BOOST_CHECK(!bvh.intersect(CqVector3D(0.25,0.25,0), CqVector3D(0,0,1),
+				1.5, FLT_MAX, 0));
+}
+
+BOOST_AUTO_TEST_CASE(CqTriangleBvh_matches_brute_force_test)
+{
+	CqRandom rand(1);
+	std::vector<CqVector3D> verts;
+	CqTriangleBvh bvh;
+	for(TqInt i = 0; i < 500; ++i)
+	{
+		CqVector3D c = randomPoint(rand, 10);
+		CqVector3D a = c + randomPoint(rand, 1);
+		CqVector3D b = c + randomPoint(rand, 1);
+		CqVector3D d = c + randomPoint(rand, 1);
+		verts.push_back(a);
+		verts.push_back(b);
+		verts.push_back(d);
+		bvh.addTriangle(a, b, d, i);
+	}
+	bvh.build();
+	BOOST_CHECK_EQUAL(bvh.numTriangles(), 500);
+	BOOST_CHECK(bvh.numNodes() < 2*500);
+
+	for(TqInt i = 0; i < 200; ++i)
+	{
+		CqVector3D org = randomPoint(rand, 12);
+		CqVector3D dir = randomPoint(rand, 1);
+		dir.Unit();
+		TqFloat expected = bruteForceHit(verts, org, dir);
+		CqTriangleBvh::SqHit hit;
+		bool didHit = bvh.intersect(org, dir, 0, FLT_MAX, &hit);
+		BOOST_CHECK_EQUAL(didHit, expected != FLT_MAX);
+		BOOST_CHECK_EQUAL(bvh.intersect(org, dir, 0, FLT_MAX, 0), didHit);
+		if(didHit)
+			BOOST_CHECK_CLOSE(hit.distance, expected, 1e-3f);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(CqTriangleBvh_empty_test)
+{
+	CqTriangleBvh bvh;
+	bvh.build();
+	BOOST_CHECK(!bvh.intersect(CqVector3D(0,0,0), CqVector3D(0,0,1), 0,
+				FLT_MAX, 0));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
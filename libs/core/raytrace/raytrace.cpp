@@ -26,8 +26,30 @@
 #include	<aqsis/aqsis.h>
 #include	"raytrace.h"
 
+#include	<cmath>
+
+#include	<aqsis/util/logging.h>
+#include	"micropolygon.h"
+#include	"points.h"
+#include	"procedural.h"
+#include	"renderer.h"
+#include	"surface.h"
+
 namespace Aqsis {
 
+namespace {
+
+/** Scale applied to the dicing coordinates when tessellating for the
+ * raytracer.  Rays rarely need the full shading resolution, so dice at half
+ * the rate in each direction, giving a quarter as many triangles.
+ */
+const TqFloat traceDiceScale = 0.5f;
+
+/// Maximum number of times a primitive is split while tessellating it.
+const TqInt maxTraceSplits = 20;
+
+} // unnamed namespace
+
 
 /// Required function that implements Class Factory design pattern for Raytrace libraries
 IqRaytrace* CreateRaytracer()
@@ -36,14 +58,224 @@ IqRaytrace* CreateRaytracer()
 }
 
 
-void CqRaytrace::Initialise()
+CqRaytrace::CqRaytrace()
+	: m_aPending(),
+	m_expanding(false),
+	m_finalised(false),
+	m_aPrimInfo(),
+	m_bvh()
 {}
 
-void CqRaytrace::AddPrimitive(const boost::shared_ptr<IqSurface>& pSurface)
+CqRaytrace::~CqRaytrace()
 {}
 
+void CqRaytrace::Initialise()
+{
+	m_aPending.clear();
+	m_expanding = false;
+	m_finalised = false;
+	m_aPrimInfo.clear();
+	m_bvh.clear();
+}
+
+void CqRaytrace::AddPrimitive(const boost::shared_ptr<IqSurface>& pSurface)
+{
+	// Procedurals split by the main pipeline after Finalise() were already
+	// expanded for the raytracer.
+	if(m_finalised && !m_expanding)
+		return;
+	if(pSurface->pAttributes()->GetIntegerAttributeDef("visibility", "trace", 0) == 0)
+		return;
+	boost::shared_ptr<CqSurface> surface = boost::static_pointer_cast<CqSurface>(pSurface);
+	// Points are diced into grids of unconnected vertices, which can't be
+	// turned into triangles.
+	if(dynamic_cast<CqPoints*>(surface.get())
+		|| dynamic_cast<CqDeformingPointsSurface*>(surface.get()))
+		return;
+	m_aPending.push_back(surface);
+}
+
+/** Tessellate all pending primitives and build the acceleration structure.
+ *
+ * Must be called once the primitives have been transformed into camera
+ * space and the camera has been initialised, since dicing rates are based
+ * on the camera to raster transformation.
+ */
 void CqRaytrace::Finalise()
-{}
+{
+	// Dice copies of the primitives so that the dicing state of the
+	// originals, which are also in the main pipeline, is left alone.
+	// Procedurals can't be copied, so are expanded here instead, giving
+	// children which belong to the raytracer alone.
+	std::vector<boost::shared_ptr<CqSurface> > aPending;
+	aPending.swap(m_aPending);
+	std::vector<boost::shared_ptr<CqSurface> > aSurfaces;
+	TqInt numSkipped = 0;
+	for(TqInt i = 0, n = aPending.size(); i < n; ++i)
+	{
+		if(dynamic_cast<CqProcedural*>(aPending[i].get()))
+		{
+			ExpandProcedural(aPending[i], 0, aSurfaces);
+			continue;
+		}
+		CqSurface* surface = aPending[i]->Clone();
+		if(surface)
+			aSurfaces.push_back(boost::shared_ptr<CqSurface>(surface));
+		else
+			++numSkipped;
+	}
+	m_finalised = true;
+	if(numSkipped > 0)
+	{
+		Aqsis::log() << warning << "Raytracer can't trace " << numSkipped
+			<< " primitive(s) which can't be copied" << std::endl;
+	}
+	if(aSurfaces.empty())
+		return;
+
+	CqMatrix rasterCoords;
+	QGetRenderContext()->matSpaceToSpace("camera", "raster", NULL, NULL,
+										 QGetRenderContextI()->Time(), rasterCoords);
+	bool perspective = QGetRenderContext()->GetIntegerOption("System", "Projection")[0]
+		== ProjectionPerspective;
+
+	for(TqInt i = 0, n = aSurfaces.size(); i < n; ++i)
+	{
+		const boost::shared_ptr<CqSurface>& surface = aSurfaces[i];
+
+		// Rays can see geometry from any direction, so dice in a scaled
+		// version of camera space rather than raster space, as for
+		// Attribute "dice" "rasterorient" [0].
+		TqFloat xscale = rasterCoords[0][0];
+		TqFloat yscale = rasterCoords[1][1];
+		if(perspective)
+		{
+			CqBound bound;
+			surface->Bound(&bound);
+			TqFloat midz = 0.5f*(bound.vecMin().z() + bound.vecMax().z());
+			midz = std::max(std::fabs(midz), 1e-3f);
+			xscale /= midz;
+			yscale /= midz;
+		}
+		xscale = std::fabs(xscale)*traceDiceScale;
+		yscale = std::fabs(yscale)*traceDiceScale;
+		CqMatrix diceCoords(xscale, yscale, std::max(xscale, yscale));
+
+		SqPrimInfo primInfo;
+		const CqColor* Cs = surface->pAttributes()->GetColorAttribute("System", "Color");
+		const CqColor* Os = surface->pAttributes()->GetColorAttribute("System", "Opacity");
+		primInfo.Cs = Cs ? Cs[0] : CqColor(1, 1, 1);
+		primInfo.Os = Os ? Os[0] : CqColor(1, 1, 1);
+		m_aPrimInfo.push_back(primInfo);
+
+		Tessellate(surface, diceCoords, m_aPrimInfo.size() - 1, 0);
+	}
+
+	m_bvh.build();
+	Aqsis::log() << info << "Raytracer built " << m_bvh.numNodes()
+		<< " BVH nodes over " << m_bvh.numTriangles() << " triangles" << std::endl;
+}
+
+bool CqRaytrace::IsEmpty() const
+{
+	return m_bvh.numNodes() == 0;
+}
+
+bool CqRaytrace::IsExpanding() const
+{
+	return m_expanding;
+}
+
+/** Run the subdivision function of a procedural, collecting the primitives
+ * it creates.
+ *
+ * The main pipeline expands its own copy of the procedural later, so the
+ * children created here are handed back through AddPrimitive() without
+ * being posted.  Nested procedurals are expanded in turn, up to the same
+ * depth limit as the splitting in Tessellate().
+ */
+void CqRaytrace::ExpandProcedural(const boost::shared_ptr<CqSurface>& pProcedural,
+		TqInt depth, std::vector<boost::shared_ptr<CqSurface> >& aSurfaces)
+{
+	std::vector<boost::shared_ptr<CqSurface> > aSplits;
+	m_expanding = true;
+	pProcedural->Split(aSplits);
+	m_expanding = false;
+
+	std::vector<boost::shared_ptr<CqSurface> > aChildren;
+	aChildren.swap(m_aPending);
+	for(TqInt i = 0, n = aChildren.size(); i < n; ++i)
+	{
+		if(!dynamic_cast<CqProcedural*>(aChildren[i].get()))
+			aSurfaces.push_back(aChildren[i]);
+		else if(depth < maxTraceSplits)
+			ExpandProcedural(aChildren[i], depth + 1, aSurfaces);
+	}
+}
+
+bool CqRaytrace::Intersect(const CqVector3D& origin, const CqVector3D& direction,
+		TqFloat minDist, TqFloat maxDist, SqRayHit* hit) const
+{
+	if(!hit)
+		return m_bvh.intersect(origin, direction, minDist, maxDist, 0);
+
+	CqTriangleBvh::SqHit bvhHit;
+	if(!m_bvh.intersect(origin, direction, minDist, maxDist, &bvhHit))
+		return false;
+	const SqPrimInfo& primInfo = m_aPrimInfo[m_bvh.tag(bvhHit.triangle)];
+	hit->distance = bvhHit.distance;
+	hit->P = origin + bvhHit.distance*direction;
+	hit->Ng = m_bvh.normal(bvhHit.triangle);
+	hit->Ng.Unit();
+	hit->Cs = primInfo.Cs;
+	hit->Os = primInfo.Os;
+	return true;
+}
+
+/** Split the surface until it is diceable, then add the diced micropolygons
+ * to the triangle hierarchy as pairs of triangles.
+ */
+void CqRaytrace::Tessellate(const boost::shared_ptr<CqSurface>& pSurface,
+		const CqMatrix& diceCoords, TqInt primIndex, TqInt depth)
+{
+	if(pSurface->Diceable(diceCoords))
+	{
+		CqMicroPolyGridBase* pGrid = pSurface->Dice();
+		if(!pGrid)
+			return;
+		ADDREF(pGrid);
+		const CqVector3D* P = 0;
+		IqShaderData* pVarP = pGrid->pVar(EnvVars_P);
+		if(pVarP)
+			pVarP->GetPointPtr(P);
+		if(P)
+		{
+			TqInt uRes = pGrid->uGridRes();
+			TqInt vRes = pGrid->vGridRes();
+			TqInt uSize = uRes + 1;
+			for(TqInt v = 0; v < vRes; ++v)
+			{
+				for(TqInt u = 0; u < uRes; ++u)
+				{
+					const CqVector3D& p00 = P[v*uSize + u];
+					const CqVector3D& p10 = P[v*uSize + u + 1];
+					const CqVector3D& p01 = P[(v+1)*uSize + u];
+					const CqVector3D& p11 = P[(v+1)*uSize + u + 1];
+					m_bvh.addTriangle(p00, p10, p11, primIndex);
+					m_bvh.addTriangle(p00, p11, p01, primIndex);
+				}
+			}
+		}
+		RELEASEREF(pGrid);
+	}
+	else if(!pSurface->fDiscard() && depth < maxTraceSplits)
+	{
+		std::vector<boost::shared_ptr<CqSurface> > aSplits;
+		TqInt cSplits = pSurface->Split(aSplits);
+		for(TqInt i = 0; i < cSplits; ++i)
+			Tessellate(aSplits[i], diceCoords, primIndex, depth + 1);
+	}
+}
 
 
 //---------------------------------------------------------------------
@@ -14,23 +14,62 @@
 #define	___raytrace_Loaded___
 
 #include	<aqsis/aqsis.h>
-#include	"iraytrace.h"
+
+#include	<vector>
+
+#include	<aqsis/core/iraytrace.h>
+#include	<aqsis/math/matrix.h>
+#include	"bvh.h"
 
 namespace Aqsis {
 
+class CqSurface;
 
+/** \brief Raytracer over a tessellated copy of the scene geometry.
+ *
+ * Primitives with Attribute "visibility" "trace" set are collected by
+ * AddPrimitive().  Finalise() dices copies of them into micropolygon grids,
+ * splits each grid into triangles and builds a bounding volume hierarchy
+ * over the lot, in camera space.  Procedurals can't be copied, so Finalise()
+ * expands them itself and dices their children.
+ */
 struct CqRaytrace : public IqRaytrace
 {
-	CqRaytrace()
-	{}
-	virtual ~CqRaytrace()
-	{}
+	CqRaytrace();
+	virtual ~CqRaytrace();
 
 
 	// Interface functions overridden from IqRaytrace
 	virtual	void	Initialise();
 	virtual	void	AddPrimitive(const boost::shared_ptr<IqSurface>& pSurface);
 	virtual void	Finalise();
+	virtual bool	IsEmpty() const;
+	virtual bool	IsExpanding() const;
+	virtual bool	Intersect(const CqVector3D& origin, const CqVector3D& direction,
+							TqFloat minDist, TqFloat maxDist, SqRayHit* hit) const;
+
+	private:
+		/// Shading information for each traced primitive.
+		struct SqPrimInfo
+		{
+			CqColor	Cs;
+			CqColor	Os;
+		};
+
+		void	ExpandProcedural(const boost::shared_ptr<CqSurface>& pProcedural,
+						TqInt depth, std::vector<boost::shared_ptr<CqSurface> >& aSurfaces);
+		void	Tessellate(const boost::shared_ptr<CqSurface>& pSurface,
+						const CqMatrix& diceCoords, TqInt primIndex, TqInt depth);
+
+		/// Primitives waiting to be tessellated by Finalise().
+		std::vector<boost::shared_ptr<CqSurface> >	m_aPending;
+		/// True while the children of a procedural are being collected.
+		bool	m_expanding;
+		/// True once Finalise() has been called, after which primitives
+		/// from procedurals expanded by the main pipeline are ignored.
+		bool	m_finalised;
+		std::vector<SqPrimInfo>	m_aPrimInfo;
+		CqTriangleBvh	m_bvh;
 };
 
 
@@ -0,0 +1,84 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+/** \file
+ *
+ * \brief Unit tests for collecting the raytraced primitives.
+ */
+
+#include "raytrace.h"
+
+#include <aqsis/ri/ri.h>
+
+#include "procedural.h"
+#include "renderer.h"
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace Aqsis;
+
+namespace {
+
+inline char* tok(const char* str)
+{
+	return const_cast<char*>(str);
+}
+
+/// Subdivision function which counts the number of times it's called.
+RtVoid countSubdivisions(RtPointer data, RtFloat /*detail*/)
+{
+	++*static_cast<TqInt*>(data);
+}
+
+} // unnamed namespace
+
+BOOST_AUTO_TEST_SUITE(raytrace_tests)
+
+BOOST_AUTO_TEST_CASE(Raytrace_procedural_test)
+{
+	RiBegin(RI_NULL);
+	RtInt trace = 1;
+	RiAttribute(tok("visibility"), tok("integer trace"), &trace, RI_NULL);
+
+	// Procedurals can't be cloned, so the raytracer expands them itself.
+	TqInt numSubdivisions = 0;
+	CqBound bound(-1, -1, -1, 1, 1, 1);
+	boost::shared_ptr<CqProcedural> proc(new CqProcedural(&numSubdivisions,
+				bound, &countSubdivisions, 0));
+	BOOST_REQUIRE(proc->Clone() == 0);
+
+	CqRaytrace raytracer;
+	raytracer.Initialise();
+	raytracer.AddPrimitive(proc);
+	raytracer.Finalise();
+	BOOST_CHECK_EQUAL(numSubdivisions, 1);
+	BOOST_CHECK(!raytracer.IsExpanding());
+	// The procedural made no geometry.
+	BOOST_CHECK(raytracer.IsEmpty());
+
+	// Primitives from the main pipeline's expansion are ignored.
+	raytracer.AddPrimitive(proc);
+	raytracer.Finalise();
+	BOOST_CHECK_EQUAL(numSubdivisions, 1);
+
+	RiEnd();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
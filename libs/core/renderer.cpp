@@ -29,6 +29,7 @@
 #include	<time.h>
 #include	<boost/bind.hpp>
 #include	<boost/filesystem/fstream.hpp>
+#include	<boost/functional/hash.hpp>
 
 #include	"imagebuffer.h"
 #include	"lights.h"
@@ -36,9 +37,11 @@
 #include	"shaders.h"
 #include	"nurbs.h"
 #include	"points.h"
+#include	"procedural.h"
 #include	"lath.h"
 #include	"transform.h"
 #include	"texturemap_old.h"
+#include	"threadscheduler.h"
 #include	<aqsis/shadervm/ishader.h>
 #include	"tiffio.h"
 
@@ -81,8 +84,10 @@ CqRenderer::CqRenderer()
 	m_Mode(RenderMode_Image),
 	m_Shaders(),
 	m_InstancedShaders(),
+	m_SharedShaders(),
 	m_lights(),
 	m_textureCache(),
+	m_runPrograms(new CqRunProgramRepository()),
 	m_fSaveGPrims(false),
 	m_pTransCamera(new CqTransform()),
 	m_pTransDefObj(new CqTransform()),
@@ -221,6 +226,11 @@ boost::shared_ptr<CqModeBlock>	CqRenderer::BeginWorldModeBlock()
 		if ( pconNew )
 		{
 			m_pconCurrent = pconNew;
+			// Start each world with an empty raytracer database, dropping
+			// anything from the last frame, including the primitives that
+			// procedurals produced after it was finalised.
+			if ( m_pRaytracer )
+				m_pRaytracer->Initialise();
 			return ( pconNew );
 		}
 		else
@@ -668,6 +678,17 @@ void	CqRenderer::ptransConcatCurrentTime( const CqMatrix& matTrans )
  */
 
 void CqRenderer::RenderWorld(bool clone)
+{
+	renderWorldImage(clone);
+	m_pDDManager->CloseDisplays();
+}
+
+
+//----------------------------------------------------------------------
+/** Render the world into the current displays, leaving them open.
+ */
+
+void CqRenderer::renderWorldImage(bool clone)
 {
 	// While rendering, all primitives should fasttrack straight into the pipeline, 
 	// and shaders should automatically initialise, the easiest way to ensure this
@@ -691,19 +712,49 @@ void CqRenderer::RenderWorld(bool clone)
 	if(clone)
 		PostCloneOfWorld();
 	else
+	{
 		PostWorld();
+		// Finalise the raytracer database now that all primitives are in
+		// camera space.  Shadow passes (which clone the world) see the scene
+		// from a different camera, so don't get raytraced geometry.
+		if(m_pRaytracer)
+			m_pRaytracer->Finalise();
+	}
 
 	m_pDDManager->OpenDisplays(m_cropWindowXMax - m_cropWindowXMin, m_cropWindowYMax - m_cropWindowYMin);
 	pImage() ->RenderImage();
-	m_pDDManager->CloseDisplays();
 
 	if(NULL != pMultipass)
 		pMultipass[0] = multiPass;
 }
 
 
+namespace {
+
+/// Write out the displays of a finished shadow pass, and destroy its manager.
+void closeShadowDisplays(IqDDManager* manager)
+{
+	manager->CloseDisplays();
+	manager->Shutdown();
+	delete manager;
+}
+
+} // unnamed namespace
+
 //----------------------------------------------------------------------
 /** Render any automatic shadow passes.
+ *
+ * The passes are rendered one after another, each into its own display
+ * manager; only writing the maps to disk is concurrent.  The shadow map from
+ * one pass is written in the background while the next pass renders, and all
+ * the maps are finished before this returns, even if a pass fails.
+ *
+ * \note Passes aren't rendered concurrently with each other.  Dicing and
+ * sampling find the image buffer, options, camera transform and crop window
+ * through QGetRenderContext(), which has only one of each, so a pass can't
+ * own them.  Each pass already renders its buckets on all the
+ * "limits" "threads" workers, so running passes side by side would mostly add
+ * the memory of another image buffer rather than speed.
  */
 
 void CqRenderer::RenderAutoShadows()
@@ -712,86 +763,116 @@ void CqRenderer::RenderAutoShadows()
 	const TqInt* pMultipass = GetIntegerOption("Render", "multipass");
 	if(pMultipass && pMultipass[0])
 	{
-		// Check all the lightsources for any with an attribute indicating autoshadows.
-		for(TqLightMap::iterator ilight = m_lights.begin(),
-			lend = m_lights.end(); ilight != lend; ++ilight)
+		// Only one map is written at a time, which bounds the memory held by
+		// finished passes to a single image.
+		CqThreadScheduler displayClosers(1);
+		bool renderedShadows = false;
+		try
 		{
-			CqLightsourcePtr light = ilight->second;
-			const CqString* pMapName = light->pAttributes()->GetStringAttribute("autoshadows", "shadowmapname");
-			const CqString* pattrName = light->pAttributes()->GetStringAttribute( "identifier", "name" );
-			if(NULL != pMapName)
+			// Check all the lightsources for any with an attribute indicating autoshadows.
+			for(TqLightMap::iterator ilight = m_lights.begin(),
+				lend = m_lights.end(); ilight != lend; ++ilight)
 			{
-				if(NULL != pattrName)
-					Aqsis::log() << info << "Rendering automatic shadow pass for lightsource : \"" << pattrName[0].c_str() << "\" to shadow map file \"" << pMapName[0].c_str() << "\"" << std::endl;
-				else
-					Aqsis::log() << info << "Rendering automatic shadow pass for lightsource : \"unnamed\" to shadow map file \"" << pMapName[0].c_str() << "\"" << std::endl;
-
-				const TqInt* pRes = light->pAttributes()->GetIntegerAttribute("autoshadows", "res");
-				TqInt res = 300;
-				if(NULL != pRes)
-					res = pRes[0];
-				// Setup a new set of options based on the current ones.
-				IqOptionsPtr opts = pushOptions();
-				opts->GetIntegerOptionWrite( "System", "Resolution" ) [ 0 ] = res;
-				opts->GetIntegerOptionWrite( "System", "Resolution" ) [ 1 ] = res;
-				opts->GetFloatOptionWrite( "System", "PixelAspectRatio" ) [ 0 ] = 1.0f;
-
-				// Now that the options have all been set, setup any undefined camera parameters.
-				opts->GetFloatOptionWrite( "System", "FrameAspectRatio" ) [ 0 ] = 1.0;
-				opts->GetFloatOptionWrite( "System", "ScreenWindow" ) [ 0 ] = -1.0 ;
-				opts->GetFloatOptionWrite( "System", "ScreenWindow" ) [ 1 ] = 1.0;
-				opts->GetFloatOptionWrite( "System", "ScreenWindow" ) [ 2 ] = 1.0;
-				opts->GetFloatOptionWrite( "System", "ScreenWindow" ) [ 3 ] = -1.0;
-				opts->GetIntegerOptionWrite( "System", "DisplayMode" ) [ 0 ] = DMode_Z;
-
-				// Set the pixel samples to 1,1 for shadow rendering.
-				opts->GetIntegerOptionWrite( "System", "PixelSamples" ) [ 0 ] = 1;
-				opts->GetIntegerOptionWrite( "System", "PixelSamples" ) [ 1 ] = 1;
-
-				// Set the pixel filter to box, 1,1 for shadow rendering.
-				opts->SetfuncFilter( RiBoxFilter );
-				opts->GetFloatOptionWrite( "System", "FilterWidth" ) [ 0 ] = 1;
-				opts->GetFloatOptionWrite( "System", "FilterWidth" ) [ 1 ] = 1;
-
-				// Turn off jitter for shadow rendering.
-				opts->GetIntegerOptionWrite("Hider", "jitter")[0] = 0;
-
-				// Make sure the depthFilter is set to "midpoint".
-				opts->GetStringOptionWrite( "Hider", "depthfilter" ) [ 0 ] = CqString("midpoint");
-
-				// Don't bother doing lighting calcualations.
-				opts->GetIntegerOptionWrite( "EnableShaders", "lighting" ) [ 0 ] = 0;
-
-				// Now set the camera transform the to light transform (inverse because the camera transform is transforming the world into camera space).
-				CqTransformPtr lightTrans(light->pTransform()->Inverse());
-
-				// Cache the current DDManager, and replace it for the purposes of our shadow render.
-				IqDDManager* realDDManager = m_pDDManager;
-				m_pDDManager = CreateDisplayDriverManager();
-				m_pDDManager->Initialise();
-				std::map<std::string, void*> args;
-				AddDisplayRequest(pMapName[0].c_str(), "shadow", "z", DMode_Z, 0, 1, args);
-
-				// Store the current camera transform for later.
-				CqTransformPtr defaultCamera;
-				defaultCamera = GetCameraTransform();
-				SetCameraTransform(lightTrans);
+				CqLightsourcePtr light = ilight->second;
+				const CqString* pMapName = light->pAttributes()->GetStringAttribute("autoshadows", "shadowmapname");
+				const CqString* pattrName = light->pAttributes()->GetStringAttribute( "identifier", "name" );
+				if(NULL != pMapName)
+				{
+					if(NULL != pattrName)
+						Aqsis::log() << info << "Rendering automatic shadow pass for lightsource : \"" << pattrName[0].c_str() << "\" to shadow map file \"" << pMapName[0].c_str() << "\"" << std::endl;
+					else
+						Aqsis::log() << info << "Rendering automatic shadow pass for lightsource : \"unnamed\" to shadow map file \"" << pMapName[0].c_str() << "\"" << std::endl;
+
+					const TqInt* pRes = light->pAttributes()->GetIntegerAttribute("autoshadows", "res");
+					TqInt res = 300;
+					if(NULL != pRes)
+						res = pRes[0];
+					const TqInt* pDeep = light->pAttributes()->GetIntegerAttribute("autoshadows", "deep");
+					bool deep = pDeep && pDeep[0];
+					// Setup a new set of options based on the current ones.
+					IqOptionsPtr opts = pushOptions();
+					opts->GetIntegerOptionWrite( "System", "Resolution" ) [ 0 ] = res;
+					opts->GetIntegerOptionWrite( "System", "Resolution" ) [ 1 ] = res;
+					opts->GetFloatOptionWrite( "System", "PixelAspectRatio" ) [ 0 ] = 1.0f;
+
+					// Now that the options have all been set, setup any undefined camera parameters.
+					opts->GetFloatOptionWrite( "System", "FrameAspectRatio" ) [ 0 ] = 1.0;
+					opts->GetFloatOptionWrite( "System", "ScreenWindow" ) [ 0 ] = -1.0 ;
+					opts->GetFloatOptionWrite( "System", "ScreenWindow" ) [ 1 ] = 1.0;
+					opts->GetFloatOptionWrite( "System", "ScreenWindow" ) [ 2 ] = 1.0;
+					opts->GetFloatOptionWrite( "System", "ScreenWindow" ) [ 3 ] = -1.0;
+					opts->GetIntegerOptionWrite( "System", "DisplayMode" ) [ 0 ] = DMode_Z;
+
+					// Set the pixel samples to 1,1 for shadow rendering.  Deep
+					// maps keep the pixel samples of the main render, since
+					// they record the partial coverage of each pixel.
+					if(!deep)
+					{
+						opts->GetIntegerOptionWrite( "System", "PixelSamples" ) [ 0 ] = 1;
+						opts->GetIntegerOptionWrite( "System", "PixelSamples" ) [ 1 ] = 1;
+					}
+
+					// Set the pixel filter to box, 1,1 for shadow rendering.
+					opts->SetfuncFilter( RiBoxFilter );
+					opts->GetFloatOptionWrite( "System", "FilterWidth" ) [ 0 ] = 1;
+					opts->GetFloatOptionWrite( "System", "FilterWidth" ) [ 1 ] = 1;
+
+					// Turn off jitter for shadow rendering.
+					opts->GetIntegerOptionWrite("Hider", "jitter")[0] = 0;
+
+					// Make sure the depthFilter is set to "midpoint".  Deep maps
+					// are built from the nearest hits, so need "min".
+					opts->GetStringOptionWrite( "Hider", "depthfilter" ) [ 0 ] = CqString(deep ? "min" : "midpoint");
+
+					// Don't bother doing lighting calcualations.
+					opts->GetIntegerOptionWrite( "EnableShaders", "lighting" ) [ 0 ] = 0;
+
+					// Now set the camera transform the to light transform (inverse because the camera transform is transforming the world into camera space).
+					CqTransformPtr lightTrans(light->pTransform()->Inverse());
+
+					// Cache the current DDManager, and replace it for the purposes of our shadow render.
+					IqDDManager* realDDManager = m_pDDManager;
+					IqDDManager* shadowDDManager = CreateDisplayDriverManager();
+					m_pDDManager = shadowDDManager;
+					m_pDDManager->Initialise();
+					std::map<std::string, void*> args;
+					AddDisplayRequest(pMapName[0].c_str(), deep ? "dsm" : "shadow", "z", DMode_Z, 0, 1, args);
+
+					// Store the current camera transform for later.
+					CqTransformPtr defaultCamera;
+					defaultCamera = GetCameraTransform();
+					SetCameraTransform(lightTrans);
 				
-				// Render the world
-				RenderWorld(true);
-
-				popOptions();
-				SetCameraTransform(defaultCamera);
-
-				m_pDDManager->Shutdown();
-				delete(m_pDDManager);
-				m_pDDManager = realDDManager;
-
-				CqTextureMapOld::FlushCache();
-				m_textureCache->flush();
-				clippingVolume().clear();
+					// Render the world
+					renderWorldImage(true);
+
+					popOptions();
+					SetCameraTransform(defaultCamera);
+					m_pDDManager = realDDManager;
+					clippingVolume().clear();
+
+					displayClosers.addWorkUnit(boost::bind(&closeShadowDisplays,
+								shadowDDManager));
+					renderedShadows = true;
+				}
 			}
 		}
+		catch(...)
+		{
+			// The scheduler doesn't join its threads when destroyed, so wait
+			// for the maps already being written before passing the error on.
+			displayClosers.joinAll();
+			throw;
+		}
+
+		// Make sure the maps are complete, and that textures read by the
+		// shadow passes are dropped before the main render.
+		displayClosers.joinAll();
+		if(renderedShadows)
+		{
+			CqTextureMapOld::FlushCache();
+			m_textureCache->flush();
+		}
 	}
 }
 
@@ -1251,6 +1332,26 @@ boost::shared_ptr<IqShader> CqRenderer::CreateShader(
 	}
 }
 
+boost::shared_ptr<IqShader> CqRenderer::findSharedShader(
+		const std::string& key ) const
+{
+	std::pair<TqSharedShaderMap::const_iterator, TqSharedShaderMap::const_iterator>
+		range = m_SharedShaders.equal_range(boost::hash<std::string>()(key));
+	for(TqSharedShaderMap::const_iterator i = range.first; i != range.second; ++i)
+	{
+		if(i->second.first == key)
+			return i->second.second;
+	}
+	return boost::shared_ptr<IqShader>();
+}
+
+void CqRenderer::addSharedShader( const std::string& key,
+		const boost::shared_ptr<IqShader>& shader )
+{
+	m_SharedShaders.insert(std::make_pair(boost::hash<std::string>()(key),
+				std::make_pair(key, shader)));
+}
+
 //----------------------------------------------------------------------
 /** Add a new surface to the list of surfaces in the world.
  * \param pSurface A pointer to a CqSurface derived class, surface should at this point be in world space.
@@ -1258,9 +1359,12 @@ boost::shared_ptr<IqShader> CqRenderer::CreateShader(
 
 void CqRenderer::StorePrimitive( const boost::shared_ptr<CqSurface>& pSurface )
 {
+	// Primitives from procedurals which the raytracer is expanding belong to
+	// it alone; they only need moving into camera space.
+	bool forRaytracer = m_pRaytracer && m_pRaytracer->IsExpanding();
 	// If we are not in a mode that allows 'extra' passes, then fasttrack the primitive directly into the pipeline.
 	const TqInt* pMultipass = GetIntegerOption("Render", "multipass");
-	if(pMultipass && pMultipass[0])
+	if(pMultipass && pMultipass[0] && !forRaytracer)
 		m_aWorld.push_back(pSurface);
 	else
 	{
@@ -1270,7 +1374,8 @@ void CqRenderer::StorePrimitive( const boost::shared_ptr<CqSurface>& pSurface )
 		QGetRenderContext() ->matVSpaceToSpace( "world", "camera", NULL, pSurface->pTransform().get(), 0, matVWtoC );
 		pSurface->Transform( matWtoC, matNWtoC, matVWtoC);
 		pSurface->PrepareTrimCurve();
-		PostSurface(pSurface);
+		if(!forRaytracer)
+			PostSurface(pSurface);
 	}
 }
 
@@ -1419,6 +1524,11 @@ IqTextureCache& CqRenderer::textureCache()
 	return *m_textureCache;
 }
 
+CqRunProgramRepository& CqRenderer::runPrograms()
+{
+	return *m_runPrograms;
+}
+
 IqTextureMapOld* CqRenderer::GetEnvironmentMap( const CqString& strFileName )
 {
 	return ( CqTextureMapOld::GetEnvironmentMap( strFileName ) );
@@ -28,6 +28,7 @@
 //{
 #define RENDERER_H_INCLUDED 1
 
+#include	<map>
 #include	<vector>
 #include	<iostream>
 #include	<time.h>
@@ -43,8 +44,7 @@
 #include	<aqsis/riutil/tokendictionary.h>
 #include	"iddmanager.h"
 #include	<aqsis/core/irenderer.h>
-#include	"iraytrace.h"
-#include	"iraytrace.h"
+#include	<aqsis/core/iraytrace.h>
 #include	<aqsis/tex/filtering/itexturecache.h>
 #include	"lights.h"
 
@@ -106,6 +106,7 @@ enum EqRenderMode
  */
 
 class CqRenderer;
+class CqRunProgramRepository;
 AQSIS_CORE_SHARE extern CqRenderer* pCurrRenderer;
 
 class CqRenderer : public IqRenderer
@@ -215,6 +216,9 @@ class CqRenderer : public IqRenderer
 		 */
 		const char* textureSearchPath();
 
+		/// Get the child processes for RunProgram procedurals.
+		CqRunProgramRepository& runPrograms();
+
 		virtual	bool	GetBasisMatrix( CqMatrix& matBasis, const CqString& name );
 
 
@@ -260,6 +264,15 @@ class CqRenderer : public IqRenderer
 		 * \return A reference to a list of CqShaderRegister classes.
 		 */
 		virtual boost::shared_ptr<IqShader> CreateShader( const char* strName, EqShaderType type );
+		/** \brief Find a shader instance shared with addSharedShader().
+		 *
+		 * \param key - identifies the shader, its arguments and anything else
+		 *              which affects the instance.
+		 * \return The instance, or null if none has been added under key.
+		 */
+		boost::shared_ptr<IqShader> findSharedShader( const std::string& key ) const;
+		/// Share a fully set up shader instance for reuse under the given key.
+		void addSharedShader( const std::string& key, const boost::shared_ptr<IqShader>& shader );
 
 		/** Flush any registered shaders.
 		 */
@@ -267,6 +280,7 @@ class CqRenderer : public IqRenderer
 		{
 			m_Shaders.clear();
 			m_InstancedShaders.clear();
+			m_SharedShaders.clear();
 		}
 
 		/** Prepare the shaders for rendering.
@@ -522,6 +536,7 @@ class CqRenderer : public IqRenderer
 
 	private:
 		const SqOutputDataEntry* FindOutputDataEntry(const char* name);
+		void	renderWorldImage(bool clone);
 
 		/// Map type to hold loaded reference shaders.
 		typedef std::map< CqShaderKey, boost::shared_ptr<IqShader> > TqShaderMap;
@@ -538,11 +553,16 @@ class CqRenderer : public IqRenderer
 		EqRenderMode	m_Mode;
 		TqShaderMap m_Shaders;
 		std::vector< boost::shared_ptr<IqShader> >  m_InstancedShaders;
+		/// Shader instances which may be reused, by hash of their key.
+		typedef std::multimap<std::size_t,
+				std::pair<std::string, boost::shared_ptr<IqShader> > > TqSharedShaderMap;
+		TqSharedShaderMap m_SharedShaders;
 
 		typedef std::map<std::string, CqLightsourcePtr> TqLightMap;
 		TqLightMap m_lights;
 
 		boost::shared_ptr<IqTextureCache> m_textureCache; ///< Cache for aqsistex texture access.
+		boost::shared_ptr<CqRunProgramRepository> m_runPrograms; ///< Child processes for RunProgram procedurals.
 		 
 
 		bool	m_fSaveGPrims;
@@ -33,6 +33,8 @@
 #include "renderer.h"
 #include "transform.h"
 #include <aqsis/math/math.h>
+#include <aqsis/tex/buffers/tilecache.h>
+#include <aqsis/util/pool.h>
 
 namespace Aqsis {
 
@@ -106,6 +108,7 @@ void CqStats::InitialiseFrame()
 	m_cTextureMemory = 0;
 	memset( m_cTextureMisses, '\0', sizeof( m_cTextureMisses ) );
 	memset( m_cTextureHits, '\0', sizeof( m_cTextureHits ) );
+	CqTileCache::instance().resetStats();
 }
 //----------------------------------------------------------------------
 /** Output rendering stats if required.
@@ -344,9 +347,14 @@ void CqStats::PrintStats( TqInt level ) const
 		TqFloat _mpg_max = 0.0f;
 		if (STATS_INT_GETF( MPG_max_area ) != FLT_MIN)
 			_mpg_max = STATS_INT_GETF( MPG_max_area );
+		// Object pool chunks (micropolygons and laths)
+		TqInt _pool_allocated = 0;
+		TqInt _pool_recycled = 0;
+		CqObjectPoolBase::chunkCounts(_pool_allocated, _pool_recycled);
 		MSG << "Micropolygons:\n\t"
 		<< STATS_INT_GETI( MPG_allocated ) << " created (" << STATS_INT_GETI( MPG_culled ) << " culled)\n"
 		<< "\t" <<STATS_INT_GETI( MPG_peak ) << " peak, " << STATS_INT_GETI( MPG_trimmed ) << " trimmed, ( " << STATS_INT_GETI( MPG_trimmedout ) << " completely ) " << STATS_INT_GETI( MPG_missed ) << " missed (" << _mpg_m_q << "%)\n\t"
+		<< _pool_allocated << " pool chunks allocated, " << _pool_recycled << " recycled\n\t"
 		<< "\n\tMPG Area:\t" << _mpg_average_ratio << " average \n\t\t\t"
 		<<  _mpg_min << " min\n\t\t\t"
 		<<  _mpg_max << " max\n\t"
@@ -464,6 +472,13 @@ void CqStats::PrintStats( TqInt level ) const
 				MSG << 100.0f * ( ( float ) m_cTextureHits[ 1 ][ i ] / ( float ) ( m_cTextureHits[ 1 ][ i ] + m_cTextureMisses[ i ] ) ) << "%)" << std::endl;
 			}
 		}
+		CqTileCache::SqStats tileStats = CqTileCache::instance().stats();
+		MSG << "Texture tile cache  : " << tileStats.hits << " hits, "
+			<< tileStats.misses << " misses, " << tileStats.evictions << " evictions\n"
+			<< "\t\t\t" << tileStats.bytesUsed << " bytes used, "
+			<< tileStats.peakBytes << " peak\n"
+			<< "\t\t\t" << tileStats.openFiles << " files open, "
+			<< tileStats.fileCloses << " handles closed" << std::endl;
 		MSG << std::endl;
 	}
 }
@@ -0,0 +1,1627 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/// \file Cache of parsed RIB archive files
+
+#include <aqsis/riutil/ricxxutil.h>
+
+#include <algorithm>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/function.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#ifdef ENABLE_THREADING
+#   include <boost/ptr_container/ptr_vector.hpp>
+#   include <boost/thread/condition_variable.hpp>
+#   include <boost/thread/mutex.hpp>
+#   include <boost/thread/thread.hpp>
+#endif
+
+#include <aqsis/riutil/errorhandler.h>
+#include <aqsis/riutil/ribparser.h>
+#include <aqsis/riutil/ribwriter.h>
+#include <aqsis/riutil/tokendictionary.h>
+#include <aqsis/util/file.h>
+#include "ricxx_cache.h"
+
+namespace Aqsis {
+
+namespace {
+
+/// Callback made with the name of each archive read by a recorded stream.
+typedef boost::function<void (const char* name)> ArchiveFoundCallback;
+
+/// Renderer which records all interface calls into a cached stream.
+class RiCacheRecorder : public Ri::Renderer
+{
+    private:
+        CachedRiStream& m_stream;
+        Ri::Renderer* m_declarations;
+        std::vector<std::string>* m_archives;
+        ArchiveFoundCallback m_foundArchive;
+
+    public:
+        /// Record calls into stream.
+        ///
+        /// Declare calls are passed on to the declarations context as well as
+        /// being recorded, since the parser needs them to interpret the
+        /// parameter lists in the remainder of the archive.
+        ///
+        /// If archives is non-null, the names of archives read by the stream
+        /// with ReadArchive are appended to it, and passed to foundArchive
+        /// as soon as they're seen.  DelayedReadArchive procedurals aren't
+        /// included; the renderer prefetches those once it knows they're
+        /// visible.
+        RiCacheRecorder(CachedRiStream& stream, Ri::Renderer* declarations,
+                        std::vector<std::string>* archives = 0,
+                        const ArchiveFoundCallback& foundArchive
+                            = ArchiveFoundCallback())
+            : m_stream(stream),
+            m_declarations(declarations),
+            m_archives(archives),
+            m_foundArchive(foundArchive)
+        { }
+
+        virtual RtVoid Declare(RtConstString name, RtConstString declaration)
+        {
+            if(m_declarations)
+                m_declarations->Declare(name, declaration);
+            m_stream.push_back(new RiCache::Declare(name, declaration));
+        }
+
+        virtual RtVoid ReadArchive(RtConstToken name,
+                            RtArchiveCallback callback,
+                            const ParamList& pList)
+        {
+            if(m_archives)
+            {
+                m_archives->push_back(name);
+                if(m_foundArchive)
+                    m_foundArchive(name);
+            }
+            m_stream.push_back(new RiCache::ReadArchive(name, callback, pList));
+        }
+
+        virtual RtVoid Procedural(RtPointer data, RtConstBound bound,
+                            RtProcSubdivFunc refineproc,
+                            RtProcFreeFunc freeproc)
+        {
+            m_stream.push_back(new RiCache::Procedural(data, bound, refineproc, freeproc));
+        }
+
+        // Comments are only of interest to archive callbacks, and archives
+        // read with a callback aren't cached.
+        virtual RtVoid ArchiveRecord(RtConstToken type, const char* string)
+        { }
+
+        // Code generator for autogenerated method declarations
+        /*[[[cog
+        from codegenutils import *
+        riXml = parseXml(riXmlPath)
+        from Cheetah.Template import Template
+
+        methodTemplate = r'''
+        virtual $wrapDecl($riCxxMethodDecl($proc), 72, wrapIndent=20)
+        {
+            m_stream.push_back(new RiCache::${procName}($callArgs));
+        }
+        '''
+
+        handWritten = ('Declare', 'ReadArchive', 'Procedural')
+        for proc in riXml.findall('Procedures/Procedure'):
+            procName = proc.findtext('Name')
+            if proc.findall('Rib') and procName not in handWritten:
+                callArgs = ', '.join(wrapperCallArgList(proc))
+                cog.out(str(Template(methodTemplate, searchList=locals())));
+
+        ]]]*/
+
+        virtual RtVoid FrameBegin(RtInt number)
+        {
+            m_stream.push_back(new RiCache::FrameBegin(number));
+        }
+
+        virtual RtVoid FrameEnd()
+        {
+            m_stream.push_back(new RiCache::FrameEnd());
+        }
+
+        virtual RtVoid WorldBegin()
+        {
+            m_stream.push_back(new RiCache::WorldBegin());
+        }
+
+        virtual RtVoid WorldEnd()
+        {
+            m_stream.push_back(new RiCache::WorldEnd());
+        }
+
+        virtual RtVoid IfBegin(RtConstString condition)
+        {
+            m_stream.push_back(new RiCache::IfBegin(condition));
+        }
+
+        virtual RtVoid ElseIf(RtConstString condition)
+        {
+            m_stream.push_back(new RiCache::ElseIf(condition));
+        }
+
+        virtual RtVoid Else()
+        {
+            m_stream.push_back(new RiCache::Else());
+        }
+
+        virtual RtVoid IfEnd()
+        {
+            m_stream.push_back(new RiCache::IfEnd());
+        }
+
+        virtual RtVoid Format(RtInt xresolution, RtInt yresolution,
+                            RtFloat pixelaspectratio)
+        {
+            m_stream.push_back(new RiCache::Format(xresolution, yresolution, pixelaspectratio));
+        }
+
+        virtual RtVoid FrameAspectRatio(RtFloat frameratio)
+        {
+            m_stream.push_back(new RiCache::FrameAspectRatio(frameratio));
+        }
+
+        virtual RtVoid ScreenWindow(RtFloat left, RtFloat right, RtFloat bottom,
+                            RtFloat top)
+        {
+            m_stream.push_back(new RiCache::ScreenWindow(left, right, bottom, top));
+        }
+
+        virtual RtVoid CropWindow(RtFloat xmin, RtFloat xmax, RtFloat ymin,
+                            RtFloat ymax)
+        {
+            m_stream.push_back(new RiCache::CropWindow(xmin, xmax, ymin, ymax));
+        }
+
+        virtual RtVoid Projection(RtConstToken name, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Projection(name, pList));
+        }
+
+        virtual RtVoid Clipping(RtFloat cnear, RtFloat cfar)
+        {
+            m_stream.push_back(new RiCache::Clipping(cnear, cfar));
+        }
+
+        virtual RtVoid ClippingPlane(RtFloat x, RtFloat y, RtFloat z,
+                            RtFloat nx, RtFloat ny, RtFloat nz)
+        {
+            m_stream.push_back(new RiCache::ClippingPlane(x, y, z, nx, ny, nz));
+        }
+
+        virtual RtVoid DepthOfField(RtFloat fstop, RtFloat focallength,
+                            RtFloat focaldistance)
+        {
+            m_stream.push_back(new RiCache::DepthOfField(fstop, focallength, focaldistance));
+        }
+
+        virtual RtVoid Shutter(RtFloat opentime, RtFloat closetime)
+        {
+            m_stream.push_back(new RiCache::Shutter(opentime, closetime));
+        }
+
+        virtual RtVoid PixelVariance(RtFloat variance)
+        {
+            m_stream.push_back(new RiCache::PixelVariance(variance));
+        }
+
+        virtual RtVoid PixelSamples(RtFloat xsamples, RtFloat ysamples)
+        {
+            m_stream.push_back(new RiCache::PixelSamples(xsamples, ysamples));
+        }
+
+        virtual RtVoid PixelFilter(RtFilterFunc function, RtFloat xwidth,
+                            RtFloat ywidth)
+        {
+            m_stream.push_back(new RiCache::PixelFilter(function, xwidth, ywidth));
+        }
+
+        virtual RtVoid Exposure(RtFloat gain, RtFloat gamma)
+        {
+            m_stream.push_back(new RiCache::Exposure(gain, gamma));
+        }
+
+        virtual RtVoid Imager(RtConstToken name, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Imager(name, pList));
+        }
+
+        virtual RtVoid Quantize(RtConstToken type, RtInt one, RtInt min,
+                            RtInt max, RtFloat ditheramplitude)
+        {
+            m_stream.push_back(new RiCache::Quantize(type, one, min, max, ditheramplitude));
+        }
+
+        virtual RtVoid Display(RtConstToken name, RtConstToken type,
+                            RtConstToken mode, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Display(name, type, mode, pList));
+        }
+
+        virtual RtVoid Hider(RtConstToken name, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Hider(name, pList));
+        }
+
+        virtual RtVoid ColorSamples(const FloatArray& nRGB,
+                            const FloatArray& RGBn)
+        {
+            m_stream.push_back(new RiCache::ColorSamples(nRGB, RGBn));
+        }
+
+        virtual RtVoid RelativeDetail(RtFloat relativedetail)
+        {
+            m_stream.push_back(new RiCache::RelativeDetail(relativedetail));
+        }
+
+        virtual RtVoid Option(RtConstToken name, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Option(name, pList));
+        }
+
+        virtual RtVoid AttributeBegin()
+        {
+            m_stream.push_back(new RiCache::AttributeBegin());
+        }
+
+        virtual RtVoid AttributeEnd()
+        {
+            m_stream.push_back(new RiCache::AttributeEnd());
+        }
+
+        virtual RtVoid Color(RtConstColor Cq)
+        {
+            m_stream.push_back(new RiCache::Color(Cq));
+        }
+
+        virtual RtVoid Opacity(RtConstColor Os)
+        {
+            m_stream.push_back(new RiCache::Opacity(Os));
+        }
+
+        virtual RtVoid TextureCoordinates(RtFloat s1, RtFloat t1, RtFloat s2,
+                            RtFloat t2, RtFloat s3, RtFloat t3, RtFloat s4,
+                            RtFloat t4)
+        {
+            m_stream.push_back(new RiCache::TextureCoordinates(s1, t1, s2, t2, s3, t3, s4, t4));
+        }
+
+        virtual RtVoid LightSource(RtConstToken shadername, RtConstToken name,
+                            const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::LightSource(shadername, name, pList));
+        }
+
+        virtual RtVoid AreaLightSource(RtConstToken shadername,
+                            RtConstToken name, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::AreaLightSource(shadername, name, pList));
+        }
+
+        virtual RtVoid Illuminate(RtConstToken name, RtBoolean onoff)
+        {
+            m_stream.push_back(new RiCache::Illuminate(name, onoff));
+        }
+
+        virtual RtVoid Surface(RtConstToken name, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Surface(name, pList));
+        }
+
+        virtual RtVoid Displacement(RtConstToken name, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Displacement(name, pList));
+        }
+
+        virtual RtVoid Atmosphere(RtConstToken name, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Atmosphere(name, pList));
+        }
+
+        virtual RtVoid Interior(RtConstToken name, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Interior(name, pList));
+        }
+
+        virtual RtVoid Exterior(RtConstToken name, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Exterior(name, pList));
+        }
+
+        virtual RtVoid ShaderLayer(RtConstToken type, RtConstToken name,
+                            RtConstToken layername, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::ShaderLayer(type, name, layername, pList));
+        }
+
+        virtual RtVoid ConnectShaderLayers(RtConstToken type,
+                            RtConstToken layer1, RtConstToken variable1,
+                            RtConstToken layer2, RtConstToken variable2)
+        {
+            m_stream.push_back(new RiCache::ConnectShaderLayers(type, layer1, variable1, layer2, variable2));
+        }
+
+        virtual RtVoid ShadingRate(RtFloat size)
+        {
+            m_stream.push_back(new RiCache::ShadingRate(size));
+        }
+
+        virtual RtVoid ShadingInterpolation(RtConstToken type)
+        {
+            m_stream.push_back(new RiCache::ShadingInterpolation(type));
+        }
+
+        virtual RtVoid Matte(RtBoolean onoff)
+        {
+            m_stream.push_back(new RiCache::Matte(onoff));
+        }
+
+        virtual RtVoid Bound(RtConstBound bound)
+        {
+            m_stream.push_back(new RiCache::Bound(bound));
+        }
+
+        virtual RtVoid Detail(RtConstBound bound)
+        {
+            m_stream.push_back(new RiCache::Detail(bound));
+        }
+
+        virtual RtVoid DetailRange(RtFloat offlow, RtFloat onlow,
+                            RtFloat onhigh, RtFloat offhigh)
+        {
+            m_stream.push_back(new RiCache::DetailRange(offlow, onlow, onhigh, offhigh));
+        }
+
+        virtual RtVoid GeometricApproximation(RtConstToken type,
+                            RtFloat value)
+        {
+            m_stream.push_back(new RiCache::GeometricApproximation(type, value));
+        }
+
+        virtual RtVoid Orientation(RtConstToken orientation)
+        {
+            m_stream.push_back(new RiCache::Orientation(orientation));
+        }
+
+        virtual RtVoid ReverseOrientation()
+        {
+            m_stream.push_back(new RiCache::ReverseOrientation());
+        }
+
+        virtual RtVoid Sides(RtInt nsides)
+        {
+            m_stream.push_back(new RiCache::Sides(nsides));
+        }
+
+        virtual RtVoid Identity()
+        {
+            m_stream.push_back(new RiCache::Identity());
+        }
+
+        virtual RtVoid Transform(RtConstMatrix transform)
+        {
+            m_stream.push_back(new RiCache::Transform(transform));
+        }
+
+        virtual RtVoid ConcatTransform(RtConstMatrix transform)
+        {
+            m_stream.push_back(new RiCache::ConcatTransform(transform));
+        }
+
+        virtual RtVoid Perspective(RtFloat fov)
+        {
+            m_stream.push_back(new RiCache::Perspective(fov));
+        }
+
+        virtual RtVoid Translate(RtFloat dx, RtFloat dy, RtFloat dz)
+        {
+            m_stream.push_back(new RiCache::Translate(dx, dy, dz));
+        }
+
+        virtual RtVoid Rotate(RtFloat angle, RtFloat dx, RtFloat dy,
+                            RtFloat dz)
+        {
+            m_stream.push_back(new RiCache::Rotate(angle, dx, dy, dz));
+        }
+
+        virtual RtVoid Scale(RtFloat sx, RtFloat sy, RtFloat sz)
+        {
+            m_stream.push_back(new RiCache::Scale(sx, sy, sz));
+        }
+
+        virtual RtVoid Skew(RtFloat angle, RtFloat dx1, RtFloat dy1,
+                            RtFloat dz1, RtFloat dx2, RtFloat dy2,
+                            RtFloat dz2)
+        {
+            m_stream.push_back(new RiCache::Skew(angle, dx1, dy1, dz1, dx2, dy2, dz2));
+        }
+
+        virtual RtVoid CoordinateSystem(RtConstToken space)
+        {
+            m_stream.push_back(new RiCache::CoordinateSystem(space));
+        }
+
+        virtual RtVoid CoordSysTransform(RtConstToken space)
+        {
+            m_stream.push_back(new RiCache::CoordSysTransform(space));
+        }
+
+        virtual RtVoid TransformBegin()
+        {
+            m_stream.push_back(new RiCache::TransformBegin());
+        }
+
+        virtual RtVoid TransformEnd()
+        {
+            m_stream.push_back(new RiCache::TransformEnd());
+        }
+
+        virtual RtVoid Resource(RtConstToken handle, RtConstToken type,
+                            const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Resource(handle, type, pList));
+        }
+
+        virtual RtVoid ResourceBegin()
+        {
+            m_stream.push_back(new RiCache::ResourceBegin());
+        }
+
+        virtual RtVoid ResourceEnd()
+        {
+            m_stream.push_back(new RiCache::ResourceEnd());
+        }
+
+        virtual RtVoid Attribute(RtConstToken name, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Attribute(name, pList));
+        }
+
+        virtual RtVoid Polygon(const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Polygon(pList));
+        }
+
+        virtual RtVoid GeneralPolygon(const IntArray& nverts,
+                            const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::GeneralPolygon(nverts, pList));
+        }
+
+        virtual RtVoid PointsPolygons(const IntArray& nverts,
+                            const IntArray& verts, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::PointsPolygons(nverts, verts, pList));
+        }
+
+        virtual RtVoid PointsGeneralPolygons(const IntArray& nloops,
+                            const IntArray& nverts, const IntArray& verts,
+                            const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::PointsGeneralPolygons(nloops, nverts, verts, pList));
+        }
+
+        virtual RtVoid Basis(RtConstBasis ubasis, RtInt ustep,
+                            RtConstBasis vbasis, RtInt vstep)
+        {
+            m_stream.push_back(new RiCache::Basis(ubasis, ustep, vbasis, vstep));
+        }
+
+        virtual RtVoid Patch(RtConstToken type, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Patch(type, pList));
+        }
+
+        virtual RtVoid PatchMesh(RtConstToken type, RtInt nu,
+                            RtConstToken uwrap, RtInt nv, RtConstToken vwrap,
+                            const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::PatchMesh(type, nu, uwrap, nv, vwrap, pList));
+        }
+
+        virtual RtVoid NuPatch(RtInt nu, RtInt uorder, const FloatArray& uknot,
+                            RtFloat umin, RtFloat umax, RtInt nv, RtInt vorder,
+                            const FloatArray& vknot, RtFloat vmin, RtFloat vmax,
+                            const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::NuPatch(nu, uorder, uknot, umin, umax, nv, vorder, vknot, vmin, vmax, pList));
+        }
+
+        virtual RtVoid TrimCurve(const IntArray& ncurves, const IntArray& order,
+                            const FloatArray& knot, const FloatArray& min,
+                            const FloatArray& max, const IntArray& n,
+                            const FloatArray& u, const FloatArray& v,
+                            const FloatArray& w)
+        {
+            m_stream.push_back(new RiCache::TrimCurve(ncurves, order, knot, min, max, n, u, v, w));
+        }
+
+        virtual RtVoid SubdivisionMesh(RtConstToken scheme,
+                            const IntArray& nvertices, const IntArray& vertices,
+                            const TokenArray& tags, const IntArray& nargs,
+                            const IntArray& intargs,
+                            const FloatArray& floatargs,
+                            const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::SubdivisionMesh(scheme, nvertices, vertices, tags, nargs, intargs, floatargs, pList));
+        }
+
+        virtual RtVoid Sphere(RtFloat radius, RtFloat zmin, RtFloat zmax,
+                            RtFloat thetamax, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Sphere(radius, zmin, zmax, thetamax, pList));
+        }
+
+        virtual RtVoid Cone(RtFloat height, RtFloat radius, RtFloat thetamax,
+                            const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Cone(height, radius, thetamax, pList));
+        }
+
+        virtual RtVoid Cylinder(RtFloat radius, RtFloat zmin, RtFloat zmax,
+                            RtFloat thetamax, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Cylinder(radius, zmin, zmax, thetamax, pList));
+        }
+
+        virtual RtVoid Hyperboloid(RtConstPoint point1, RtConstPoint point2,
+                            RtFloat thetamax, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Hyperboloid(point1, point2, thetamax, pList));
+        }
+
+        virtual RtVoid Paraboloid(RtFloat rmax, RtFloat zmin, RtFloat zmax,
+                            RtFloat thetamax, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Paraboloid(rmax, zmin, zmax, thetamax, pList));
+        }
+
+        virtual RtVoid Disk(RtFloat height, RtFloat radius, RtFloat thetamax,
+                            const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Disk(height, radius, thetamax, pList));
+        }
+
+        virtual RtVoid Torus(RtFloat majorrad, RtFloat minorrad, RtFloat phimin,
+                            RtFloat phimax, RtFloat thetamax,
+                            const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Torus(majorrad, minorrad, phimin, phimax, thetamax, pList));
+        }
+
+        virtual RtVoid Points(const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Points(pList));
+        }
+
+        virtual RtVoid Curves(RtConstToken type, const IntArray& nvertices,
+                            RtConstToken wrap, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Curves(type, nvertices, wrap, pList));
+        }
+
+        virtual RtVoid Blobby(RtInt nleaf, const IntArray& code,
+                            const FloatArray& floats, const TokenArray& strings,
+                            const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Blobby(nleaf, code, floats, strings, pList));
+        }
+
+        virtual RtVoid Geometry(RtConstToken type, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::Geometry(type, pList));
+        }
+
+        virtual RtVoid SolidBegin(RtConstToken type)
+        {
+            m_stream.push_back(new RiCache::SolidBegin(type));
+        }
+
+        virtual RtVoid SolidEnd()
+        {
+            m_stream.push_back(new RiCache::SolidEnd());
+        }
+
+        virtual RtVoid ObjectBegin(RtConstToken name)
+        {
+            m_stream.push_back(new RiCache::ObjectBegin(name));
+        }
+
+        virtual RtVoid ObjectEnd()
+        {
+            m_stream.push_back(new RiCache::ObjectEnd());
+        }
+
+        virtual RtVoid ObjectInstance(RtConstToken name)
+        {
+            m_stream.push_back(new RiCache::ObjectInstance(name));
+        }
+
+        virtual RtVoid MotionBegin(const FloatArray& times)
+        {
+            m_stream.push_back(new RiCache::MotionBegin(times));
+        }
+
+        virtual RtVoid MotionEnd()
+        {
+            m_stream.push_back(new RiCache::MotionEnd());
+        }
+
+        virtual RtVoid MakeTexture(RtConstString imagefile,
+                            RtConstString texturefile, RtConstToken swrap,
+                            RtConstToken twrap, RtFilterFunc filterfunc,
+                            RtFloat swidth, RtFloat twidth,
+                            const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::MakeTexture(imagefile, texturefile, swrap, twrap, filterfunc, swidth, twidth, pList));
+        }
+
+        virtual RtVoid MakeLatLongEnvironment(RtConstString imagefile,
+                            RtConstString reflfile, RtFilterFunc filterfunc,
+                            RtFloat swidth, RtFloat twidth,
+                            const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::MakeLatLongEnvironment(imagefile, reflfile, filterfunc, swidth, twidth, pList));
+        }
+
+        virtual RtVoid MakeCubeFaceEnvironment(RtConstString px,
+                            RtConstString nx, RtConstString py,
+                            RtConstString ny, RtConstString pz,
+                            RtConstString nz, RtConstString reflfile,
+                            RtFloat fov, RtFilterFunc filterfunc,
+                            RtFloat swidth, RtFloat twidth,
+                            const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::MakeCubeFaceEnvironment(px, nx, py, ny, pz, nz, reflfile, fov, filterfunc, swidth, twidth, pList));
+        }
+
+        virtual RtVoid MakeShadow(RtConstString picfile,
+                            RtConstString shadowfile, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::MakeShadow(picfile, shadowfile, pList));
+        }
+
+        virtual RtVoid MakeOcclusion(const StringArray& picfiles,
+                            RtConstString shadowfile, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::MakeOcclusion(picfiles, shadowfile, pList));
+        }
+
+        virtual RtVoid ErrorHandler(RtErrorFunc handler)
+        {
+            m_stream.push_back(new RiCache::ErrorHandler(handler));
+        }
+
+        virtual RtVoid ArchiveBegin(RtConstToken name, const ParamList& pList)
+        {
+            m_stream.push_back(new RiCache::ArchiveBegin(name, pList));
+        }
+
+        virtual RtVoid ArchiveEnd()
+        {
+            m_stream.push_back(new RiCache::ArchiveEnd());
+        }
+        ///[[[end]]]
+};
+
+
+/// Names of the standard procedurals, which can be saved in RIB files.
+const char* const standardProcedurals[] = {
+    "DelayedReadArchive", "RunProgram", "DynamicLoad"
+};
+const int numStandardProcedurals = 3;
+
+/// Recorder for the calls made by a procedural.
+///
+/// Also notes whether the calls can be saved as RIB, which isn't possible
+/// for procedurals with user-defined subdivision functions.
+class ProceduralRecorder : public RiCacheRecorder
+{
+    private:
+        Ri::RendererServices& m_services;
+        bool m_savable;
+
+    public:
+        ProceduralRecorder(CachedRiStream& stream, Ri::Renderer* declarations,
+                           Ri::RendererServices& services)
+            : RiCacheRecorder(stream, declarations),
+            m_services(services),
+            m_savable(true)
+        { }
+
+        bool savable() const { return m_savable; }
+
+        virtual RtVoid Procedural(RtPointer data, RtConstBound bound,
+                            RtProcSubdivFunc refineproc,
+                            RtProcFreeFunc freeproc)
+        {
+            bool standard = false;
+            for(int i = 0; i < numStandardProcedurals; ++i)
+            {
+                if(refineproc == m_services.getProcSubdivFunc(
+                                        standardProcedurals[i]))
+                    standard = true;
+            }
+            if(!standard)
+                m_savable = false;
+            RiCacheRecorder::Procedural(data, bound, refineproc, freeproc);
+        }
+};
+
+/// Escape line breaks in a procedural key so it fits in a RIB comment.
+std::string escapeKey(const std::string& key)
+{
+    std::string escaped;
+    for(int i = 0, iend = key.size(); i < iend; ++i)
+    {
+        switch(key[i])
+        {
+            case '\\': escaped += "\\\\"; break;
+            case '\n':  escaped += "\\n";  break;
+            case '\r':  escaped += "\\r";  break;
+            default:    escaped += key[i];  break;
+        }
+    }
+    return escaped;
+}
+
+/// Undo escapeKey().
+std::string unescapeKey(const std::string& escaped)
+{
+    std::string key;
+    for(int i = 0, iend = escaped.size(); i < iend; ++i)
+    {
+        if(escaped[i] == '\\' && i + 1 < iend)
+        {
+            switch(escaped[++i])
+            {
+                case 'n':  key += '\n'; break;
+                case 'r':  key += '\r'; break;
+                default:   key += escaped[i]; break;
+            }
+        }
+        else
+            key += escaped[i];
+    }
+    return key;
+}
+
+/// Header line of a saved procedural, holding the full key.
+///
+/// File names only hold a hash of the key, so this is checked on loading to
+/// guard against collisions.
+std::string procCacheHeader(const std::string& key)
+{
+    return "##aqsis procedural " + escapeKey(key);
+}
+
+/// Start of the header lines listing the files a saved procedural read.
+const char procCacheFilePrefix[] = "##aqsis file ";
+
+/// Files read while recording a procedural, with their modification times.
+typedef std::vector<std::pair<std::string, std::time_t> > FileTimes;
+
+/// Check whether any of the files have changed since they were read.
+///
+/// Files which can no longer be found count as changed.
+bool filesChanged(const FileTimes& files)
+{
+    for(int i = 0, iend = files.size(); i < iend; ++i)
+    {
+        try
+        {
+            if(boostfs::last_write_time(boostfs::path(files[i].first))
+               != files[i].second)
+                return true;
+        }
+        catch(std::exception&)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Check the header of a saved procedural.
+///
+/// Returns true if the file holds the calls recorded under key, and none of
+/// the files read while recording them have changed since.  Those files are
+/// returned in files, if it's non-null.
+bool procCacheFileCurrent(const std::string& fileName, const std::string& key,
+                          FileTimes* files = 0)
+{
+    std::ifstream in(fileName.c_str(), std::ios::binary);
+    std::string line;
+    if(!std::getline(in, line) || line != procCacheHeader(key))
+        return false;
+    FileTimes readFiles;
+    const std::string prefix = procCacheFilePrefix;
+    while(std::getline(in, line) && line.compare(0, prefix.size(), prefix) == 0)
+    {
+        std::istringstream fileLine(line.substr(prefix.size()));
+        std::time_t modifiedTime = 0;
+        std::string name;
+        if(!(fileLine >> modifiedTime) || fileLine.get() != ' '
+           || !std::getline(fileLine, name))
+            return false;
+        readFiles.push_back(std::make_pair(unescapeKey(name), modifiedTime));
+    }
+    if(filesChanged(readFiles))
+        return false;
+    if(files)
+        files->swap(readFiles);
+    return true;
+}
+
+
+#ifdef ENABLE_THREADING
+
+/// Error handler which saves messages to be reported later.
+class DeferredErrorHandler : public Ri::ErrorHandler
+{
+    public:
+        typedef std::vector<std::pair<int, std::string> > MessageList;
+
+        DeferredErrorHandler() : ErrorHandler(Debug) {}
+
+        /// Send the saved messages on to another handler.
+        void replay(Ri::ErrorHandler& handler) const
+        {
+            for(int i = 0, iend = m_messages.size(); i < iend; ++i)
+                handler.log(m_messages[i].first, "%s", m_messages[i].second);
+        }
+
+    protected:
+        virtual void dispatch(int code, const std::string& message)
+        {
+            m_messages.push_back(std::make_pair(code, message));
+        }
+
+    private:
+        MessageList m_messages;
+};
+
+/// Sink for the declarations made by an archive parsed in the background.
+class DeclarationSink : public StubRenderer
+{
+    private:
+        TokenDict& m_tokens;
+    public:
+        DeclarationSink(TokenDict& tokens) : m_tokens(tokens) {}
+
+        virtual RtVoid Declare(RtConstString name, RtConstString declaration)
+        {
+            if(declaration)
+                m_tokens.declare(name, declaration);
+            else
+                m_tokens.declare(name, Ri::TypeSpec());
+        }
+};
+
+/// An archive to be parsed on a worker thread.
+///
+/// The parser looks up declarations in a private copy of the dictionary as it
+/// stood when the prefetch was requested, and any errors are saved to be
+/// reported on the main thread when the archive is replayed.  Other lookups
+/// go to the main renderer services, which only look in constant tables.
+class PrefetchJob : public Ri::RendererServices
+{
+    public:
+        std::string fileName;
+        std::time_t modifiedTime;
+        /// Version of the declarations the archive is parsed with.
+        unsigned long declarations;
+        boost::shared_ptr<CachedRiStream> stream;
+        std::vector<std::string> archives;
+        DeferredErrorHandler errors;
+        /// Set when a thread has taken the job.
+        bool started;
+        /// Set when the job is complete.
+        bool done;
+
+        PrefetchJob(const std::string& fileName, std::time_t modifiedTime,
+                    unsigned long declarations, const TokenDict& tokens,
+                    Ri::RendererServices& services)
+            : fileName(fileName),
+            modifiedTime(modifiedTime),
+            declarations(declarations),
+            stream(),
+            archives(),
+            errors(),
+            started(false),
+            done(false),
+            m_tokens(tokens),
+            m_services(services)
+        { }
+
+        /// Parse the archive into stream.
+        void run()
+        {
+            boost::shared_ptr<CachedRiStream> parsed(
+                    new CachedRiStream(fileName.c_str()));
+            try
+            {
+                RibInputFile archiveFile(fileName.c_str());
+                boost::scoped_ptr<RibParser> parser(RibParser::create(*this));
+                DeclarationSink declarations(m_tokens);
+                RiCacheRecorder recorder(*parsed, &declarations, &archives);
+                parser->parseStream(archiveFile, fileName, recorder);
+            }
+            catch(std::exception& e)
+            {
+                errors.error(EqE_System, "Could not read archive \"%s\": %s",
+                             fileName, e.what());
+            }
+            stream = parsed;
+        }
+
+        virtual Ri::ErrorHandler& errorHandler() { return errors; }
+
+        virtual RtFilterFunc getFilterFunc(RtConstToken name) const
+        {
+            return m_services.getFilterFunc(name);
+        }
+        virtual RtConstBasis* getBasis(RtConstToken name) const
+        {
+            return m_services.getBasis(name);
+        }
+        virtual RtErrorFunc getErrorFunc(RtConstToken name) const
+        {
+            return m_services.getErrorFunc(name);
+        }
+        virtual RtProcSubdivFunc getProcSubdivFunc(RtConstToken name) const
+        {
+            return m_services.getProcSubdivFunc(name);
+        }
+        virtual Ri::TypeSpec getDeclaration(RtConstToken token,
+                                            const char** nameBegin = 0,
+                                            const char** nameEnd = 0) const
+        {
+            return m_tokens.lookup(token, nameBegin, nameEnd);
+        }
+
+        // The parser never needs the filter chain.
+        virtual Ri::Renderer& firstFilter()
+        {
+            AQSIS_THROW_XQERROR(XqInternal, EqE_Bug,
+                                "no filter chain while prefetching archives");
+        }
+        virtual void addFilter(const char* name,
+                               const Ri::ParamList& filterParams) { }
+        virtual void addFilter(Ri::Filter& filter) { }
+        virtual void parseRib(std::istream& ribStream, const char* name,
+                              Ri::Renderer& context) { }
+        using Ri::RendererServices::parseRib;
+
+    private:
+        TokenDict m_tokens;
+        Ri::RendererServices& m_services;
+};
+
+#endif // ENABLE_THREADING
+
+
+class RibArchiveCacheImpl : public RibArchiveCache
+{
+    private:
+        struct Entry
+        {
+            std::time_t modifiedTime;
+            /// Version of the declarations the stream was parsed with.
+            unsigned long declarations;
+            int numReads;
+            /// When the entry was last used, for discarding old entries.
+            unsigned long lastUse;
+            boost::shared_ptr<CachedRiStream> stream;
+            /// Archives read by the stream.
+            std::vector<std::string> archives;
+#           ifdef ENABLE_THREADING
+            /// Background parse of the archive, if one is outstanding.
+            boost::shared_ptr<PrefetchJob> prefetch;
+#           endif
+
+            Entry() : modifiedTime(0), declarations(0), numReads(0), lastUse(0),
+                stream(), archives() {}
+        };
+        typedef std::map<std::string, Entry> EntryMap;
+        EntryMap m_entries;
+        ArchiveResolver m_resolver;
+        struct ProceduralEntry
+        {
+            std::time_t modifiedTime;
+            /// Version of the declarations the calls were recorded with.
+            unsigned long declarations;
+            unsigned long lastUse;
+            boost::shared_ptr<CachedRiStream> stream;
+            /// Archives read while the calls were recorded.
+            FileTimes files;
+
+            ProceduralEntry() : modifiedTime(0), declarations(0), lastUse(0),
+                stream(), files() {}
+        };
+        typedef std::map<std::string, ProceduralEntry> ProceduralMap;
+        ProceduralMap m_procedurals;
+        /// Replaced procedural streams.  Procedurals created from these may
+        /// still refer to their data, so they're kept until trim().
+        std::vector<boost::shared_ptr<CachedRiStream> > m_retiredProcedurals;
+        /// Directory for saving procedurals, or empty.
+        std::string m_procCacheDir;
+        /// Archives read by each procedural being recorded, innermost last.
+        std::vector<FileTimes*> m_recordings;
+        /// Count of entry uses, giving the order in which they were used.
+        unsigned long m_useCount;
+        /// Declarations made on the main thread.
+        TokenDict m_tokens;
+        /// Version of m_tokens, changed whenever a declaration changes.
+        /// Streams parsed under other versions may parse differently, so
+        /// they're parsed again rather than replayed.
+        unsigned long m_declarations;
+#       ifdef ENABLE_THREADING
+        /// Jobs not yet taken by a worker.
+        std::deque<boost::shared_ptr<PrefetchJob> > m_queue;
+        boost::ptr_vector<boost::thread> m_workers;
+        bool m_stopping;
+        /// Protects the queue, m_stopping and the job flags.
+        boost::mutex m_mutex;
+        boost::condition_variable m_jobQueued;
+        boost::condition_variable m_jobDone;
+
+        void workerLoop()
+        {
+            while(true)
+            {
+                boost::shared_ptr<PrefetchJob> job;
+                {
+                    boost::mutex::scoped_lock lock(m_mutex);
+                    while(m_queue.empty() && !m_stopping)
+                        m_jobQueued.wait(lock);
+                    if(m_stopping)
+                        return;
+                    job = m_queue.front();
+                    m_queue.pop_front();
+                    job->started = true;
+                }
+                job->run();
+                {
+                    boost::mutex::scoped_lock lock(m_mutex);
+                    job->done = true;
+                }
+                m_jobDone.notify_all();
+            }
+        }
+
+        void stopWorkers()
+        {
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                m_stopping = true;
+            }
+            m_jobQueued.notify_all();
+            for(int i = 0, iend = m_workers.size(); i < iend; ++i)
+                m_workers[i].join();
+            m_workers.clear();
+            m_stopping = false;
+        }
+
+        /// Get the result of a prefetch, waiting for it if necessary.
+        void finishPrefetch(Entry& entry, Ri::ErrorHandler& errorHandler)
+        {
+            boost::shared_ptr<PrefetchJob> job = entry.prefetch;
+            entry.prefetch.reset();
+            bool runHere = false;
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                if(!job->started)
+                {
+                    // Nobody has got to it yet, so parse it ourselves rather
+                    // than wait.
+                    m_queue.erase(std::find(m_queue.begin(), m_queue.end(), job));
+                    job->started = true;
+                    runHere = true;
+                }
+                else
+                {
+                    while(!job->done)
+                        m_jobDone.wait(lock);
+                }
+            }
+            if(runHere)
+                job->run();
+            job->errors.replay(errorHandler);
+            if(job->modifiedTime == entry.modifiedTime
+               && job->declarations == m_declarations)
+            {
+                entry.declarations = job->declarations;
+                entry.stream = job->stream;
+                entry.archives.swap(job->archives);
+            }
+        }
+#       endif
+
+        /// Start parsing an archive read by another archive.
+        void prefetchArchive(const char* name, Ri::RendererServices& services)
+        {
+            if(!m_resolver || numPrefetchThreads() == 0)
+                return;
+            std::string path = m_resolver(name);
+            if(!path.empty())
+                prefetch(path.c_str(), services);
+        }
+
+        /// Start parsing the archives read by an archive being replayed.
+        void prefetchArchives(const std::vector<std::string>& archives,
+                              Ri::RendererServices& services)
+        {
+            for(int i = 0, iend = archives.size(); i < iend; ++i)
+                prefetchArchive(archives[i].c_str(), services);
+        }
+
+        int numPrefetchThreads() const
+        {
+#           ifdef ENABLE_THREADING
+            return m_workers.size();
+#           else
+            return 0;
+#           endif
+        }
+
+        /// Look up a declared token, giving an Unknown type if it's undeclared.
+        Ri::TypeSpec lookupDeclaration(const char* name) const
+        {
+            try
+            {
+                return m_tokens.lookup(name);
+            }
+            catch(XqValidation& /*e*/)
+            {
+                return Ri::TypeSpec();
+            }
+        }
+
+        /// Find the entry for the file, discarding it if the file has changed.
+        Entry& findEntry(const std::string& fileName)
+        {
+            std::time_t modifiedTime = boostfs::last_write_time(
+                    boostfs::path(fileName));
+            Entry& entry = m_entries[fileName];
+            if(entry.modifiedTime != modifiedTime)
+            {
+                // New or changed on disk; forget any old version.
+                entry = Entry();
+                entry.modifiedTime = modifiedTime;
+            }
+            entry.lastUse = ++m_useCount;
+            return entry;
+        }
+
+        /// Store a procedural stream, retiring any old version.
+        void storeProcedural(const std::string& key, std::time_t modifiedTime,
+                             unsigned long declarations,
+                             const boost::shared_ptr<CachedRiStream>& stream,
+                             const FileTimes& files)
+        {
+            ProceduralEntry& entry = m_procedurals[key];
+            if(entry.stream)
+                m_retiredProcedurals.push_back(entry.stream);
+            entry.modifiedTime = modifiedTime;
+            entry.declarations = declarations;
+            entry.lastUse = ++m_useCount;
+            entry.stream = stream;
+            entry.files = files;
+        }
+
+        /// Path of the file holding a saved procedural.
+        std::string procCacheFile(const std::string& key,
+                                  std::time_t modifiedTime) const
+        {
+            std::ostringstream name;
+            name << std::hex << boost::hash<std::string>()(key) << std::dec
+                 << '-' << modifiedTime << ".rib";
+            return native(boostfs::path(m_procCacheDir) / name.str());
+        }
+
+        /// Load a procedural saved by an earlier render, if there is one.
+        ///
+        /// Saved calls are ignored if any of the archives read while
+        /// recording them have changed.  Those archives are returned in
+        /// files.
+        boost::shared_ptr<CachedRiStream> loadProcedural(
+                const std::string& key, std::time_t modifiedTime,
+                FileTimes& files, Ri::RendererServices& services,
+                Ri::Renderer& context)
+        {
+            boost::shared_ptr<CachedRiStream> stream;
+            std::string fileName = procCacheFile(key, modifiedTime);
+            if(!procCacheFileCurrent(fileName, key, &files))
+                return stream;
+            stream.reset(new CachedRiStream(key.c_str()));
+            try
+            {
+                RibInputFile cacheFile(fileName.c_str());
+                RiCacheRecorder recorder(*stream, &context);
+                services.parseRib(cacheFile, fileName.c_str(), recorder);
+            }
+            catch(std::exception& e)
+            {
+                services.errorHandler().warning(EqE_System,
+                        "Could not read procedural cache file \"%s\": %s",
+                        fileName, e.what());
+                stream.reset();
+            }
+            return stream;
+        }
+
+        /// Save a procedural for use by later renders.
+        ///
+        /// The file is written under a temporary name and then renamed, so
+        /// that renders sharing the directory never see a partial file.  A
+        /// saved file which is out of date with the archives it read is
+        /// replaced.
+        void saveProcedural(const std::string& key, std::time_t modifiedTime,
+                            const FileTimes& files,
+                            const CachedRiStream& stream,
+                            Ri::RendererServices& services)
+        {
+            std::string fileName = procCacheFile(key, modifiedTime);
+            std::string tmpName = fileName + ".tmp";
+            try
+            {
+                if(procCacheFileCurrent(fileName, key))
+                    return;
+                {
+                    std::ofstream out(tmpName.c_str(), std::ios::binary);
+                    if(!out)
+                        AQSIS_THROW_XQERROR(XqInvalidFile, EqE_NoFile,
+                                            "could not open file for writing");
+                    out << procCacheHeader(key) << "\n";
+                    for(int i = 0, iend = files.size(); i < iend; ++i)
+                    {
+                        out << procCacheFilePrefix << files[i].second << ' '
+                            << escapeKey(files[i].first) << "\n";
+                    }
+                    RibWriterOptions opts;
+                    opts.useBinary = true;
+                    boost::scoped_ptr<RibWriterServices> writer(
+                            createRibWriter(out, opts));
+                    for(int i = 0; i < numStandardProcedurals; ++i)
+                    {
+                        const char* name = standardProcedurals[i];
+                        writer->registerProcSubdivFunc(name,
+                                services.getProcSubdivFunc(name));
+                    }
+                    stream.replay(writer->firstFilter());
+                    writer.reset();
+                    if(!out)
+                        AQSIS_THROW_XQERROR(XqInvalidFile, EqE_System,
+                                            "could not write file");
+                }
+                // Older boost versions won't rename over an existing file.
+                if(boostfs::exists(boostfs::path(fileName)))
+                    boostfs::remove(boostfs::path(fileName));
+                boostfs::rename(boostfs::path(tmpName),
+                                boostfs::path(fileName));
+            }
+            catch(std::exception& e)
+            {
+                services.errorHandler().warning(EqE_System,
+                        "Could not save procedural cache file \"%s\": %s",
+                        fileName, e.what());
+                try
+                {
+                    boostfs::remove(boostfs::path(tmpName));
+                }
+                catch(std::exception&)
+                { }
+            }
+        }
+
+    public:
+        RibArchiveCacheImpl(const ArchiveResolver& resolver)
+            : m_entries(),
+            m_resolver(resolver),
+            m_procedurals(),
+            m_retiredProcedurals(),
+            m_procCacheDir(),
+            m_recordings(),
+            m_useCount(0),
+            m_tokens(),
+            m_declarations(0)
+#           ifdef ENABLE_THREADING
+            , m_queue(),
+            m_workers(),
+            m_stopping(false)
+#           endif
+        { }
+
+        virtual ~RibArchiveCacheImpl()
+        {
+            setPrefetchThreads(0);
+        }
+
+        virtual void readArchive(const char* fileName,
+                                 Ri::RendererServices& services,
+                                 Ri::Renderer& context)
+        {
+            std::string name = fileName;
+            Entry& entry = findEntry(name);
+            ++entry.numReads;
+            // Procedurals being recorded depend on the archive.
+            for(int i = 0, iend = m_recordings.size(); i < iend; ++i)
+                m_recordings[i]->push_back(
+                        std::make_pair(name, entry.modifiedTime));
+#           ifdef ENABLE_THREADING
+            if(entry.prefetch)
+                finishPrefetch(entry, services.errorHandler());
+#           endif
+            if(entry.stream && entry.declarations != m_declarations)
+            {
+                entry.stream.reset();
+                entry.archives.clear();
+            }
+            // Keep a reference, since replaying may call back into the cache.
+            boost::shared_ptr<CachedRiStream> stream = entry.stream;
+            if(!stream)
+            {
+                RibInputFile archiveFile(fileName);
+                if(entry.numReads == 1 && numPrefetchThreads() == 0)
+                {
+                    // Many archives are read only once, so don't spend memory
+                    // on them until they're seen again.
+                    services.parseRib(archiveFile, name.c_str(), context);
+                    return;
+                }
+                // When prefetching, the archive is recorded so that the
+                // archives it reads can be found before they're needed.
+                // They're prefetched as soon as they're seen, so they're
+                // parsed alongside the rest of this one.
+                stream.reset(new CachedRiStream(name.c_str()));
+                entry.declarations = m_declarations;
+                RiCacheRecorder recorder(*stream, &context, &entry.archives,
+                        boost::bind(&RibArchiveCacheImpl::prefetchArchive,
+                                    this, _1, boost::ref(services)));
+                services.parseRib(archiveFile, name.c_str(), recorder);
+                entry.stream = stream;
+            }
+            std::vector<std::string> archives = entry.archives;
+            if(entry.numReads == 1)
+            {
+                // As above, only keep archives which are read more than once.
+                entry.stream.reset();
+                entry.archives.clear();
+            }
+            prefetchArchives(archives, services);
+            stream->replay(context);
+        }
+
+        virtual void prefetch(const char* fileName,
+                              Ri::RendererServices& services)
+        {
+#           ifdef ENABLE_THREADING
+            if(m_workers.empty())
+                return;
+            Entry& entry = findEntry(fileName);
+            if((entry.stream && entry.declarations == m_declarations)
+               || entry.prefetch)
+                return;
+            entry.prefetch.reset(new PrefetchJob(fileName, entry.modifiedTime,
+                                                 m_declarations, m_tokens,
+                                                 services));
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                m_queue.push_back(entry.prefetch);
+            }
+            m_jobQueued.notify_one();
+#           endif
+        }
+
+        virtual bool replayProcedural(const char* key,
+                                      std::time_t modifiedTime,
+                                      Ri::RendererServices& services,
+                                      Ri::Renderer& context)
+        {
+            // Keep a reference, since replaying may call back into the cache.
+            boost::shared_ptr<CachedRiStream> stream;
+            ProceduralMap::iterator i = m_procedurals.find(key);
+            if(i != m_procedurals.end() && i->second.modifiedTime == modifiedTime
+               && i->second.declarations == m_declarations
+               && !filesChanged(i->second.files))
+            {
+                i->second.lastUse = ++m_useCount;
+                stream = i->second.stream;
+            }
+            else if(!m_procCacheDir.empty())
+            {
+                FileTimes files;
+                stream = loadProcedural(key, modifiedTime, files, services,
+                                        context);
+                if(stream)
+                    storeProcedural(key, modifiedTime, m_declarations, stream,
+                                    files);
+            }
+            if(!stream)
+                return false;
+            stream->replay(context);
+            return true;
+        }
+
+        virtual void recordProcedural(const char* key, std::time_t modifiedTime,
+                                      const ProceduralGenerator& generate,
+                                      bool saveToDisk,
+                                      Ri::RendererServices& services,
+                                      Ri::Renderer& context)
+        {
+            boost::shared_ptr<CachedRiStream> stream(new CachedRiStream(key));
+            ProceduralRecorder recorder(*stream, &context, services);
+            unsigned long declarations = m_declarations;
+            FileTimes files;
+            m_recordings.push_back(&files);
+            try
+            {
+                generate(recorder);
+            }
+            catch(...)
+            {
+                m_recordings.pop_back();
+                throw;
+            }
+            m_recordings.pop_back();
+            storeProcedural(key, modifiedTime, declarations, stream, files);
+            if(saveToDisk && !m_procCacheDir.empty() && recorder.savable())
+                saveProcedural(key, modifiedTime, files, *stream, services);
+            stream->replay(context);
+        }
+
+        virtual void setProceduralCacheDir(const char* dirName)
+        {
+            m_procCacheDir = dirName;
+        }
+
+        virtual void declare(const char* name, const char* declaration)
+        {
+            Ri::TypeSpec oldSpec = lookupDeclaration(name);
+            if(declaration)
+                m_tokens.declare(name, declaration);
+            else
+                m_tokens.declare(name, Ri::TypeSpec());
+            if(!(lookupDeclaration(name) == oldSpec))
+                ++m_declarations;
+        }
+
+        virtual void setPrefetchThreads(int numThreads)
+        {
+#           ifdef ENABLE_THREADING
+            if(numThreads == numPrefetchThreads())
+                return;
+            stopWorkers();
+            for(int i = 0; i < numThreads; ++i)
+                m_workers.push_back(new boost::thread(
+                        boost::bind(&RibArchiveCacheImpl::workerLoop, this)));
+#           endif
+        }
+
+        virtual void clear()
+        {
+#           ifdef ENABLE_THREADING
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                m_queue.clear();
+            }
+            // Wait for jobs in progress, since they refer to services which
+            // may not outlive the cache.
+            for(EntryMap::iterator i = m_entries.begin();
+                i != m_entries.end(); ++i)
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                const boost::shared_ptr<PrefetchJob>& job = i->second.prefetch;
+                while(job && job->started && !job->done)
+                    m_jobDone.wait(lock);
+            }
+#           endif
+            m_entries.clear();
+            m_procedurals.clear();
+            m_retiredProcedurals.clear();
+        }
+
+        virtual void trim(int maxEntries)
+        {
+            m_retiredProcedurals.clear();
+            int numEntries = m_entries.size() + m_procedurals.size();
+            if(numEntries <= maxEntries)
+                return;
+            // Find the oldest use of the maxEntries most recently used
+            // entries.  Uses are unique, so exactly that many are kept.
+            unsigned long keepFrom = m_useCount + 1;
+            if(maxEntries > 0)
+            {
+                std::vector<unsigned long> uses;
+                uses.reserve(numEntries);
+                for(EntryMap::const_iterator i = m_entries.begin();
+                    i != m_entries.end(); ++i)
+                    uses.push_back(i->second.lastUse);
+                for(ProceduralMap::const_iterator i = m_procedurals.begin();
+                    i != m_procedurals.end(); ++i)
+                    uses.push_back(i->second.lastUse);
+                std::vector<unsigned long>::iterator oldestKept =
+                    uses.begin() + (numEntries - maxEntries);
+                std::nth_element(uses.begin(), oldestKept, uses.end());
+                keepFrom = *oldestKept;
+            }
+            for(EntryMap::iterator i = m_entries.begin(); i != m_entries.end();)
+            {
+#               ifdef ENABLE_THREADING
+                // Archives still being prefetched are about to be read.
+                if(i->second.prefetch)
+                {
+                    ++i;
+                    continue;
+                }
+#               endif
+                if(i->second.lastUse < keepFrom)
+                    m_entries.erase(i++);
+                else
+                    ++i;
+            }
+            for(ProceduralMap::iterator i = m_procedurals.begin();
+                i != m_procedurals.end();)
+            {
+                if(i->second.lastUse < keepFrom)
+                    m_procedurals.erase(i++);
+                else
+                    ++i;
+            }
+        }
+};
+
+} // anon. namespace
+
+
+RibArchiveCache* createRibArchiveCache(const ArchiveResolver& resolver)
+{
+    return new RibArchiveCacheImpl(resolver);
+}
+
+} // namespace Aqsis
+// vi: set et:
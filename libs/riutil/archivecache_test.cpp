@@ -0,0 +1,473 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/// \file
+///
+/// \brief Parsed RIB archive cache - tests
+///
+
+#include <aqsis/riutil/ricxxutil.h>
+
+#include <ctime>
+#include <fstream>
+#include <string>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+#include <aqsis/riutil/errorhandler.h>
+#include <aqsis/riutil/ribparser.h>
+#include <aqsis/riutil/tokendictionary.h>
+
+using namespace Aqsis;
+
+namespace {
+
+/// Renderer counting the calls made to it.
+class CountingRenderer : public StubRenderer
+{
+    public:
+        int numDeclares;
+        int numSpheres;
+        /// Type of the first parameter of the last sphere which had one.
+        Ri::TypeSpec paramSpec;
+        /// Cache and services for nested ReadArchive calls.
+        RibArchiveCache* cache;
+        Ri::RendererServices* services;
+        CountingRenderer()
+            : numDeclares(0), numSpheres(0), paramSpec(), cache(0),
+            services(0) {}
+
+        virtual RtVoid Declare(RtConstString name, RtConstString declaration)
+        {
+            ++numDeclares;
+        }
+        virtual RtVoid Sphere(RtFloat radius, RtFloat zmin, RtFloat zmax,
+                              RtFloat thetamax, const ParamList& pList)
+        {
+            ++numSpheres;
+            if(pList.size() > 0)
+                paramSpec = pList[0].spec();
+        }
+        virtual RtVoid ReadArchive(RtConstToken name,
+                                   RtArchiveCallback callback,
+                                   const ParamList& pList)
+        {
+            if(cache)
+                cache->readArchive(name, *services, *this);
+        }
+};
+
+/// Error handler which counts the messages sent to it.
+class NullErrorHandler : public Ri::ErrorHandler
+{
+    public:
+        int numMessages;
+        NullErrorHandler() : ErrorHandler(Warning), numMessages(0) {}
+    protected:
+        virtual void dispatch(int code, const std::string& message)
+        {
+            ++numMessages;
+        }
+};
+
+/// Services with a fake parser, which makes a Declare call followed by one
+/// Sphere call per line of input.
+class CountingServices : public StubRendererServices
+{
+    public:
+        int numParses;
+        NullErrorHandler handler;
+        StubRenderer renderer;
+        CountingServices() : numParses(0) {}
+
+        virtual Ri::ErrorHandler& errorHandler() { return handler; }
+        virtual Ri::TypeSpec getDeclaration(RtConstToken token,
+                const char** nameBegin = 0, const char** nameEnd = 0) const
+        {
+            return Ri::TypeSpec();
+        }
+        virtual Ri::Renderer& firstFilter() { return renderer; }
+
+        virtual void parseRib(std::istream& ribStream, const char* name,
+                              Ri::Renderer& context)
+        {
+            ++numParses;
+            context.Declare("foo", "uniform float");
+            std::string line;
+            while(std::getline(ribStream, line))
+                context.Sphere(1, -1, 1, 360, Ri::ParamList());
+        }
+        using StubRendererServices::parseRib;
+};
+
+/// Services parsing RIB with the real parser, as needed to load procedurals
+/// saved on disk.
+class ParsingServices : public StubRendererServices
+{
+    public:
+        NullErrorHandler handler;
+        StubRenderer renderer;
+        TokenDict tokenDict;
+
+        virtual Ri::ErrorHandler& errorHandler() { return handler; }
+        virtual Ri::TypeSpec getDeclaration(RtConstToken token,
+                const char** nameBegin = 0, const char** nameEnd = 0) const
+        {
+            return tokenDict.lookup(token, nameBegin, nameEnd);
+        }
+        virtual Ri::Renderer& firstFilter() { return renderer; }
+
+        virtual void parseRib(std::istream& ribStream, const char* name,
+                              Ri::Renderer& context)
+        {
+            boost::scoped_ptr<RibParser> parser(RibParser::create(*this));
+            parser->parseStream(ribStream, name, context);
+        }
+        using StubRendererServices::parseRib;
+};
+
+void writeArchive(const char* fileName, int numLines, std::time_t modifiedTime)
+{
+    {
+        std::ofstream out(fileName);
+        for(int i = 0; i < numLines; ++i)
+            out << "Sphere 1 -1 1 360\n";
+    }
+    boost::filesystem::last_write_time(fileName, modifiedTime);
+}
+
+std::string resolveArchive(const char* name)
+{
+    return name;
+}
+
+/// Procedural making a Declare call and the given number of Sphere calls.
+void generateSpheres(Ri::Renderer& context, int numSpheres, int* numRuns)
+{
+    ++*numRuns;
+    context.Declare("foo", "uniform float");
+    for(int i = 0; i < numSpheres; ++i)
+        context.Sphere(1, -1, 1, 360, Ri::ParamList());
+}
+
+/// Procedural reading two archives through the cache, as the renderer does
+/// for the archive of a DelayedReadArchive and any archives nested in it.
+void readArchives(Ri::Renderer& context, RibArchiveCache* cache,
+                  Ri::RendererServices* services, const char* outerName,
+                  const char* innerName, int* numRuns)
+{
+    ++*numRuns;
+    cache->readArchive(outerName, *services, context);
+    cache->readArchive(innerName, *services, context);
+}
+
+} // anon. namespace
+
+BOOST_AUTO_TEST_SUITE(archivecache_tests)
+
+BOOST_AUTO_TEST_CASE(RibArchiveCache_replay_test)
+{
+    const char* fileName = "archivecache_test.rib";
+    writeArchive(fileName, 2, 1000000);
+    boost::scoped_ptr<RibArchiveCache> cache(createRibArchiveCache());
+    CountingServices services;
+    CountingRenderer renderer;
+
+    // First read is parsed directly, the second parsed into the cache.
+    cache->readArchive(fileName, services, renderer);
+    cache->readArchive(fileName, services, renderer);
+    BOOST_CHECK_EQUAL(services.numParses, 2);
+    // Later reads are replayed from memory.
+    cache->readArchive(fileName, services, renderer);
+    BOOST_CHECK_EQUAL(services.numParses, 2);
+    BOOST_CHECK_EQUAL(renderer.numSpheres, 6);
+    // Declarations are passed on while recording, and replayed.
+    BOOST_CHECK_EQUAL(renderer.numDeclares, 4);
+
+    // Changing the file invalidates the cache entry.
+    writeArchive(fileName, 3, 2000000);
+    cache->readArchive(fileName, services, renderer);
+    BOOST_CHECK_EQUAL(services.numParses, 3);
+    BOOST_CHECK_EQUAL(renderer.numSpheres, 9);
+
+    boost::filesystem::remove(fileName);
+}
+
+BOOST_AUTO_TEST_CASE(RibArchiveCache_declarations_test)
+{
+    const char* fileName = "archivecache_test_declarations.rib";
+    {
+        std::ofstream out(fileName);
+        out << "Sphere 1 -1 1 360 \"foo\" [1]\n";
+    }
+    boost::scoped_ptr<RibArchiveCache> cache(createRibArchiveCache());
+    ParsingServices services;
+    CountingRenderer renderer;
+
+    services.tokenDict.declare("foo", "uniform float");
+    cache->declare("foo", "uniform float");
+    cache->readArchive(fileName, services, renderer);
+    cache->readArchive(fileName, services, renderer);
+    cache->readArchive(fileName, services, renderer);
+    BOOST_CHECK(renderer.paramSpec == Ri::TypeSpec(Ri::TypeSpec::Uniform,
+                                                   Ri::TypeSpec::Float));
+
+    // Repeating a declaration keeps the cached archive.  The parser sees a
+    // new type which the cache hasn't been told about, to show the archive
+    // isn't parsed again.
+    cache->declare("foo", "uniform float");
+    services.tokenDict.declare("foo", "constant float");
+    cache->readArchive(fileName, services, renderer);
+    BOOST_CHECK(renderer.paramSpec == Ri::TypeSpec(Ri::TypeSpec::Uniform,
+                                                   Ri::TypeSpec::Float));
+
+    // Changing it means the archive is parsed again with the new type.
+    cache->declare("foo", "constant float");
+    cache->readArchive(fileName, services, renderer);
+    BOOST_CHECK(renderer.paramSpec == Ri::TypeSpec(Ri::TypeSpec::Constant,
+                                                   Ri::TypeSpec::Float));
+    BOOST_CHECK_EQUAL(services.handler.numMessages, 0);
+
+    boost::filesystem::remove(fileName);
+}
+
+BOOST_AUTO_TEST_CASE(RibArchiveCache_prefetch_test)
+{
+    const char* outerName = "archivecache_test_outer.rib";
+    const char* innerName = "archivecache_test_inner.rib";
+    {
+        std::ofstream out(outerName);
+        out << "Sphere 1 -1 1 360\n"
+               "ReadArchive \"" << innerName << "\"\n";
+    }
+    writeArchive(innerName, 2, 1000000);
+    boost::scoped_ptr<RibArchiveCache> cache(
+            createRibArchiveCache(resolveArchive));
+    cache->setPrefetchThreads(2);
+    CountingServices services;
+    CountingRenderer renderer;
+    renderer.cache = cache.get();
+    renderer.services = &services;
+
+    cache->prefetch(outerName, services);
+    cache->readArchive(outerName, services, renderer);
+#ifdef ENABLE_THREADING
+    // Both archives were parsed by the real RIB parser in the background -
+    // the inner one as soon as the outer one was about to be replayed.
+    BOOST_CHECK_EQUAL(services.numParses, 0);
+    BOOST_CHECK_EQUAL(renderer.numSpheres, 3);
+#else
+    // Without threads, prefetching does nothing.
+    BOOST_CHECK_EQUAL(services.numParses, 1);
+    BOOST_CHECK_EQUAL(renderer.numSpheres, 2);
+#endif
+
+    boost::filesystem::remove(outerName);
+    boost::filesystem::remove(innerName);
+}
+
+#ifdef ENABLE_THREADING
+BOOST_AUTO_TEST_CASE(RibArchiveCache_prefetch_declare_test)
+{
+    const char* fileName = "archivecache_test_declare.rib";
+    {
+        std::ofstream out(fileName);
+        out << "Sphere 1 -1 1 360 \"foo\" [1]\n";
+    }
+    boost::scoped_ptr<RibArchiveCache> cache(createRibArchiveCache());
+    cache->setPrefetchThreads(1);
+    CountingServices services;
+    CountingRenderer renderer;
+
+    // Archives parsed in the background see the declarations made so far.
+    cache->declare("foo", "uniform float");
+    cache->prefetch(fileName, services);
+    cache->readArchive(fileName, services, renderer);
+    BOOST_CHECK_EQUAL(services.handler.numMessages, 0);
+    BOOST_CHECK_EQUAL(renderer.numSpheres, 1);
+
+    // A null declaration forgets the token again.
+    cache->declare("foo", 0);
+    cache->prefetch(fileName, services);
+    cache->readArchive(fileName, services, renderer);
+    BOOST_CHECK(services.handler.numMessages > 0);
+
+    boost::filesystem::remove(fileName);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(RibArchiveCache_procedural_test)
+{
+    boost::scoped_ptr<RibArchiveCache> cache(createRibArchiveCache());
+    CountingServices services;
+    CountingRenderer renderer;
+    int numRuns = 0;
+
+    BOOST_CHECK(!cache->replayProcedural("proc", 1000, services, renderer));
+    cache->recordProcedural("proc", 1000,
+            boost::bind(generateSpheres, _1, 2, &numRuns), false,
+            services, renderer);
+    BOOST_CHECK_EQUAL(numRuns, 1);
+    BOOST_CHECK_EQUAL(renderer.numSpheres, 2);
+    // Declarations are passed on while recording, and replayed.
+    BOOST_CHECK_EQUAL(renderer.numDeclares, 2);
+
+    BOOST_CHECK(cache->replayProcedural("proc", 1000, services, renderer));
+    BOOST_CHECK_EQUAL(renderer.numSpheres, 4);
+    // Other keys and modification times miss.
+    BOOST_CHECK(!cache->replayProcedural("proc2", 1000, services, renderer));
+    BOOST_CHECK(!cache->replayProcedural("proc", 2000, services, renderer));
+    BOOST_CHECK_EQUAL(renderer.numSpheres, 4);
+
+    cache->clear();
+    BOOST_CHECK(!cache->replayProcedural("proc", 1000, services, renderer));
+}
+
+BOOST_AUTO_TEST_CASE(RibArchiveCache_procedural_disk_test)
+{
+    const char* dirName = "archivecache_test_procs";
+    boost::filesystem::create_directory(dirName);
+    ParsingServices services;
+    CountingRenderer renderer;
+    int numRuns = 0;
+    {
+        boost::scoped_ptr<RibArchiveCache> cache(createRibArchiveCache());
+        cache->setProceduralCacheDir(dirName);
+        cache->recordProcedural("proc", 1000,
+                boost::bind(generateSpheres, _1, 2, &numRuns), true,
+                services, renderer);
+    }
+    BOOST_CHECK_EQUAL(numRuns, 1);
+    BOOST_CHECK_EQUAL(renderer.numSpheres, 2);
+
+    // A new cache loads the calls saved by the first.
+    boost::scoped_ptr<RibArchiveCache> cache(createRibArchiveCache());
+    cache->setProceduralCacheDir(dirName);
+    BOOST_CHECK(cache->replayProcedural("proc", 1000, services, renderer));
+    BOOST_CHECK_EQUAL(renderer.numSpheres, 4);
+    // Saved calls are only used for the same key and modification time.
+    BOOST_CHECK(!cache->replayProcedural("proc2", 1000, services, renderer));
+    BOOST_CHECK(!cache->replayProcedural("proc", 2000, services, renderer));
+    BOOST_CHECK_EQUAL(renderer.numSpheres, 4);
+    BOOST_CHECK_EQUAL(services.handler.numMessages, 0);
+
+    // Procedurals not saved to disk are only held in memory.
+    cache->recordProcedural("unsaved", 1000,
+            boost::bind(generateSpheres, _1, 1, &numRuns), false,
+            services, renderer);
+    cache->clear();
+    BOOST_CHECK(!cache->replayProcedural("unsaved", 1000, services, renderer));
+    BOOST_CHECK(cache->replayProcedural("proc", 1000, services, renderer));
+
+    boost::filesystem::remove_all(dirName);
+}
+
+BOOST_AUTO_TEST_CASE(RibArchiveCache_procedural_files_test)
+{
+    const char* dirName = "archivecache_test_files";
+    const char* outerName = "archivecache_test_files_outer.rib";
+    const char* innerName = "archivecache_test_files_inner.rib";
+    boost::filesystem::create_directory(dirName);
+    writeArchive(outerName, 1, 1000000);
+    writeArchive(innerName, 2, 1000000);
+    ParsingServices services;
+    CountingServices archiveServices;
+    CountingRenderer renderer;
+    int numRuns = 0;
+    boost::scoped_ptr<RibArchiveCache> cache(createRibArchiveCache());
+    cache->setProceduralCacheDir(dirName);
+    ProceduralGenerator generate = boost::bind(readArchives,
+            _1, cache.get(), &archiveServices, outerName, innerName, &numRuns);
+
+    cache->recordProcedural("proc", 1000, generate, true, services, renderer);
+    BOOST_CHECK_EQUAL(numRuns, 1);
+    BOOST_CHECK_EQUAL(renderer.numSpheres, 3);
+    BOOST_CHECK(cache->replayProcedural("proc", 1000, services, renderer));
+    BOOST_CHECK_EQUAL(renderer.numSpheres, 6);
+
+    // Changing any archive read while recording discards the calls, both in
+    // memory and on disk.
+    writeArchive(innerName, 3, 2000000);
+    BOOST_CHECK(!cache->replayProcedural("proc", 1000, services, renderer));
+    {
+        boost::scoped_ptr<RibArchiveCache> cache2(createRibArchiveCache());
+        cache2->setProceduralCacheDir(dirName);
+        BOOST_CHECK(!cache2->replayProcedural("proc", 1000, services, renderer));
+    }
+
+    // Recording again replaces the stale file on disk.
+    cache->recordProcedural("proc", 1000, generate, true, services, renderer);
+    BOOST_CHECK_EQUAL(numRuns, 2);
+    BOOST_CHECK_EQUAL(renderer.numSpheres, 10);
+    {
+        boost::scoped_ptr<RibArchiveCache> cache2(createRibArchiveCache());
+        cache2->setProceduralCacheDir(dirName);
+        BOOST_CHECK(cache2->replayProcedural("proc", 1000, services, renderer));
+        BOOST_CHECK_EQUAL(renderer.numSpheres, 14);
+    }
+
+    // Archives which can no longer be found count as changed.
+    boost::filesystem::remove(outerName);
+    BOOST_CHECK(!cache->replayProcedural("proc", 1000, services, renderer));
+    BOOST_CHECK_EQUAL(services.handler.numMessages, 0);
+
+    boost::filesystem::remove(innerName);
+    boost::filesystem::remove_all(dirName);
+}
+
+BOOST_AUTO_TEST_CASE(RibArchiveCache_trim_test)
+{
+    boost::scoped_ptr<RibArchiveCache> cache(createRibArchiveCache());
+    CountingServices services;
+    CountingRenderer renderer;
+    int numRuns = 0;
+
+    cache->recordProcedural("proc1", 1000,
+            boost::bind(generateSpheres, _1, 1, &numRuns), false,
+            services, renderer);
+    cache->recordProcedural("proc2", 1000,
+            boost::bind(generateSpheres, _1, 1, &numRuns), false,
+            services, renderer);
+    BOOST_CHECK(cache->replayProcedural("proc1", 1000, services, renderer));
+
+    // Only the most recently used procedural is kept.
+    cache->trim(1);
+    BOOST_CHECK(cache->replayProcedural("proc1", 1000, services, renderer));
+    BOOST_CHECK(!cache->replayProcedural("proc2", 1000, services, renderer));
+    cache->trim(0);
+    BOOST_CHECK(!cache->replayProcedural("proc1", 1000, services, renderer));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
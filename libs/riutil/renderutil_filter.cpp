@@ -60,6 +60,7 @@ class RenderUtilFilter : public Ri::Filter
         bool m_inObject;
         // Conditional testing stuff
         IfElseTestCallback m_ifElseTest;
+        ObjectInstanceCallback m_instanceCallback;
         std::stack<bool> m_ifInactiveStack;
         bool m_trueClauseFound;
         bool m_ifInactive;
@@ -99,14 +100,37 @@ class RenderUtilFilter : public Ri::Filter
             }
         }
 
+        // Replay an object instance, telling the instance callback.
+        void replayInstance(CachedRiStream& instance)
+        {
+            if(!m_instanceCallback)
+            {
+                instance.replay(services().firstFilter());
+                return;
+            }
+            m_instanceCallback(true);
+            try
+            {
+                instance.replay(services().firstFilter());
+            }
+            catch(...)
+            {
+                m_instanceCallback(false);
+                throw;
+            }
+            m_instanceCallback(false);
+        }
+
     public:
-        RenderUtilFilter(const IfElseTestCallback& conditionTest)
+        RenderUtilFilter(const IfElseTestCallback& conditionTest,
+                         const ObjectInstanceCallback& instanceCallback)
             : m_archives(),
             m_objectInstances(),
             m_currCache(0),
             m_nested(0),
             m_inObject(false),
             m_ifElseTest(conditionTest),
+            m_instanceCallback(instanceCallback),
             m_ifInactiveStack(),
             m_trueClauseFound(false),
             m_ifInactive(false)
@@ -216,7 +240,7 @@ class RenderUtilFilter : public Ri::Filter
             // Search for the object instance name
             int index = findCachedStream(m_objectInstances, name);
             if(index >= 0)
-                m_objectInstances[index]->replay(services().firstFilter());
+                replayInstance(*m_objectInstances[index]);
             else
             {
                 // If we didn't find it, error
@@ -1302,9 +1326,10 @@ class RenderUtilFilter : public Ri::Filter
 };
 
 
-Ri::Filter* createRenderUtilFilter(const IfElseTestCallback& callback)
+Ri::Filter* createRenderUtilFilter(const IfElseTestCallback& callback,
+                                   const ObjectInstanceCallback& instanceCallback)
 {
-    return new RenderUtilFilter(callback);
+    return new RenderUtilFilter(callback, instanceCallback);
 }
 
 } // namespace Aqsis
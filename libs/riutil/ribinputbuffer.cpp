@@ -40,16 +40,21 @@
 #	include <boost/iostreams/filter/gzip.hpp>
 #endif
 
+#include <aqsis/riutil/ribparser.h>
 #include <aqsis/util/exception.h>
 
 namespace Aqsis {
 
+const RibInputBuffer::CharType RibInputBuffer::eof;
+
 RibInputBuffer::RibInputBuffer(std::istream& inStream, const std::string& streamName)
 	: m_inStream(&inStream),
 	m_streamName(streamName),
 	m_gzipStream(),
-	m_bufPos(1),
-	m_bufEnd(2),
+	m_curr(m_buffer + 1),
+	m_end(m_buffer + 2),
+	m_memPos(0),
+	m_memEnd(0),
 	m_currPos(1,0),
 	m_prevPos(-1,-1)
 {
@@ -71,6 +76,52 @@ RibInputBuffer::RibInputBuffer(std::istream& inStream, const std::string& stream
 			"gzipped RIB detected, but aqsis compiled without gzip support.");
 #		endif // USE_GZIPPED_RIB
 	}
+	else if(RibInputFile* file = dynamic_cast<RibInputFile*>(&inStream))
+	{
+		// Read mapped files directly from memory.
+		const char* begin = 0;
+		const char* end = 0;
+		if(file->takeMappedInput(begin, end))
+			initMemoryInput(begin, end);
+	}
+}
+
+RibInputBuffer::RibInputBuffer(const char* begin, const char* end,
+		const std::string& streamName)
+	: m_inStream(0),
+	m_streamName(streamName),
+	m_gzipStream(),
+	m_curr(m_buffer + 1),
+	m_end(m_buffer + 2),
+	m_memPos(0),
+	m_memEnd(0),
+	m_currPos(1,0),
+	m_prevPos(-1,-1)
+{
+	m_buffer[0] = 0;
+	m_buffer[1] = 0;
+	initMemoryInput(begin, end);
+}
+
+/** \brief Start reading from memory rather than the input stream.
+ *
+ * The first character is copied into the internal buffer, since there's no
+ * character before it in memory for the lookback.  After that, get() reads
+ * straight from the input range.
+ */
+void RibInputBuffer::initMemoryInput(const char* begin, const char* end)
+{
+	m_inStream = 0;
+	m_memPos = reinterpret_cast<const CharType*>(begin);
+	m_memEnd = reinterpret_cast<const CharType*>(end);
+	m_curr = m_buffer + 1;
+	if(m_memPos < m_memEnd)
+	{
+		m_buffer[2] = *m_memPos++;
+		m_end = m_buffer + 3;
+	}
+	else
+		m_end = m_buffer + 2;
 }
 
 /** \brief Fill the internal buffer with as many characters as possible
@@ -81,18 +132,24 @@ RibInputBuffer::RibInputBuffer(std::istream& inStream, const std::string& stream
  * read, a single character is read using the blocking std::istream::get()
  * function.
  *
- * Postconditions: The m_bufPos index is one before the next character in the
- * input stream.  The m_bufEnd index points to one after the last valid
- * character.  m_bufPos < m_bufEnd
+ * Postconditions: m_curr points to the next character in the input stream,
+ * with the previous character at m_curr[-1].  m_end points to one after the
+ * last valid character.  m_curr < m_end
  */
 void RibInputBuffer::bufferNextChars()
 {
-	// Precondition: m_bufPos is pointing to a one off the end of the valid
+	// Precondition: m_curr is pointing to a one off the end of the valid
 	// characters in the buffer.
-	assert(m_bufPos == m_bufEnd);
+	assert(m_curr == m_end);
+	if(!m_inStream)
+	{
+		bufferNextMemoryChars();
+		return;
+	}
+	CharType* dest = m_buffer + (m_curr - m_buffer);
 	// first make sure that we're not at the maximum extent of the buffer; if
 	// so we need to wrap around to the beginning.
-	if(m_bufEnd == m_bufSize)
+	if(dest == m_buffer + m_bufSize)
 	{
 		// Copy over some chars so that we can always unget() at least one and
 		// still look back into the buffer an additional char for line ending
@@ -100,15 +157,15 @@ void RibInputBuffer::bufferNextChars()
 		m_buffer[0] = m_buffer[m_bufSize-2];
 		m_buffer[1] = m_buffer[m_bufSize-1];
 		// Reset buffer position
-		m_bufPos = 1;
+		dest = m_buffer + 2;
 	}
 	// Now fill the buffer with as many characters as possible using a
 	// non-blocking read with readsome().
-	int numRead = m_inStream->readsome((char*)m_buffer + m_bufPos,
-									   m_bufSize - m_bufPos);
+	int numRead = m_inStream->readsome(reinterpret_cast<char*>(dest),
+									   m_buffer + m_bufSize - dest);
 	if(numRead > 0)
 	{
-		m_bufEnd = m_bufPos + numRead;
+		m_end = dest + numRead;
 	}
 	else
 	{
@@ -117,8 +174,31 @@ void RibInputBuffer::bufferNextChars()
 		// charater.  (Reading a single char may block, but that's acceptable.)
 		std::istream::int_type c = m_inStream->get();
 		// translate EOFs
-		m_buffer[m_bufPos] = (c == EOF) ? eof : c;
-		m_bufEnd = m_bufPos + 1;
+		*dest = (c == EOF) ? eof : c;
+		m_end = dest + 1;
+	}
+	m_curr = dest;
+}
+
+/// Move on to the remaining memory input, or to EOF if there's none left.
+void RibInputBuffer::bufferNextMemoryChars()
+{
+	if(m_memPos < m_memEnd)
+	{
+		// The character before m_memPos is the one we've just read, so we
+		// can read the rest in place.
+		m_curr = m_memPos;
+		m_end = m_memEnd;
+		m_memPos = m_memEnd;
+	}
+	else
+	{
+		// Return EOFs from the internal buffer, keeping the previous
+		// character for unget().
+		m_buffer[1] = m_curr[-1];
+		m_buffer[2] = eof;
+		m_curr = m_buffer + 2;
+		m_end = m_buffer + 3;
 	}
 }
 
@@ -68,6 +68,9 @@ struct SourcePos
  * stdin, the "end" of the rib stream may be encountered at any time.  This
  * class therefore makes sure that any input buffering of a requested number of
  * characters is non-blocking.
+ *
+ * When the input is an uncompressed RibInputFile which has been memory
+ * mapped, characters are read directly from the mapped bytes instead.
  */
 class RibInputBuffer : boost::noncopyable
 {
@@ -85,6 +88,14 @@ class RibInputBuffer : boost::noncopyable
 		 */
 		RibInputBuffer(std::istream& inStream,
 				const std::string& streamName = "unknown");
+		/** \brief Construct an input buffer reading from memory.
+		 *
+		 * \param begin,end - range of characters to read.  These must
+		 *                    remain valid for the lifetime of the buffer.
+		 * \param streamName - name of the stream used in error messages.
+		 */
+		RibInputBuffer(const char* begin, const char* end,
+				const std::string& streamName = "unknown");
 
 		/// Get the next character from the input stream
 		CharType get();
@@ -98,9 +109,11 @@ class RibInputBuffer : boost::noncopyable
 
 	private:
 		static bool isGzippedStream(std::istream& in);
+		void initMemoryInput(const char* begin, const char* end);
 		void bufferNextChars();
+		void bufferNextMemoryChars();
 
-		/// Stream we are reading from.
+		/// Stream we are reading from, or null when reading from memory.
 		std::istream* m_inStream;
 		/// Stream name
 		const std::string m_streamName;
@@ -111,10 +124,15 @@ class RibInputBuffer : boost::noncopyable
 		static const int m_bufSize = 256;
 		/// Internal buffer of characters.
 		CharType m_buffer[m_bufSize];
-		/// Position of current character [ie, last char returned with get() ]
-		int m_bufPos;
-		/// Position of last valid character in input buffer.
-		int m_bufEnd;
+		/// Current character [ie, last char returned with get() ]
+		const CharType* m_curr;
+		/// One past the last valid character in the current buffer.  This is
+		/// either m_buffer or the memory input.
+		const CharType* m_end;
+		/// Next unread character of memory input.
+		const CharType* m_memPos;
+		/// End of memory input.
+		const CharType* m_memEnd;
 
 		/// Current source location
 		SourcePos m_currPos;
@@ -130,15 +148,15 @@ class RibInputBuffer : boost::noncopyable
 inline RibInputBuffer::CharType RibInputBuffer::get()
 {
 	// Get next character.
-	++m_bufPos;
-	if(m_bufPos >= m_bufEnd)
+	++m_curr;
+	if(m_curr >= m_end)
 		bufferNextChars();
-	CharType c = m_buffer[m_bufPos];
+	CharType c = *m_curr;
 
 	// Keep line and column numbers up to date.
 	m_prevPos = m_currPos;
 	++m_currPos.col;
-	if(c == '\r' || (c == '\n' && m_buffer[m_bufPos-1] != '\r'))
+	if(c == '\r' || (c == '\n' && m_curr[-1] != '\r'))
 	{
 		++m_currPos.line;
 		m_currPos.col = 0;
@@ -150,10 +168,9 @@ inline RibInputBuffer::CharType RibInputBuffer::get()
 
 inline void RibInputBuffer::unget()
 {
-	// Precondition: current buffer position is at least two chars into the
-	// buffer so that lookback can work.
-	assert(m_bufPos >= 1);
-	--m_bufPos;
+	// Both the internal buffer and memory input always keep the previous
+	// character available, so this is safe.
+	--m_curr;
 	m_currPos = m_prevPos;
 }
 
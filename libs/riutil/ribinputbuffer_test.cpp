@@ -35,9 +35,12 @@
 
 #include "ribinputbuffer.h"
 
+#include <aqsis/riutil/ribparser.h>
+
 #define BOOST_TEST_DYN_LINK
 
 #include <stdio.h>
+#include <fstream>
 #include <sstream>
 
 #include <boost/test/auto_unit_test.hpp>
@@ -119,4 +122,55 @@ BOOST_AUTO_TEST_CASE(RibInputBuffer_bufwrap_test)
 	BOOST_CHECK_EQUAL(extractedStr, inStr);
 }
 
+BOOST_AUTO_TEST_CASE(RibInputBuffer_memory_test)
+{
+	const std::string inStr("a\r\nb\nc");
+	RibInputBuffer inBuf(inStr.data(), inStr.data() + inStr.size());
+
+	BOOST_CHECK_EQUAL(inBuf.get(), 'a');
+	// unget() works across the switch to reading in place.
+	BOOST_CHECK_EQUAL(inBuf.get(), '\r');
+	inBuf.unget();
+	BOOST_CHECK_EQUAL(inBuf.get(), '\r');
+	BOOST_CHECK_EQUAL(inBuf.pos().line, 2);
+	// \r\n counts as a single line ending.
+	BOOST_CHECK_EQUAL(inBuf.get(), '\n');
+	BOOST_CHECK_EQUAL(inBuf.pos().line, 2);
+	BOOST_CHECK_EQUAL(inBuf.get(), 'b');
+	BOOST_CHECK_EQUAL(inBuf.get(), '\n');
+	BOOST_CHECK_EQUAL(inBuf.pos().line, 3);
+	BOOST_CHECK_EQUAL(inBuf.get(), 'c');
+	BOOST_CHECK_EQUAL(inBuf.get(), RibInputBuffer::eof);
+	inBuf.unget();
+	BOOST_CHECK_EQUAL(inBuf.get(), RibInputBuffer::eof);
+	BOOST_CHECK_EQUAL(inBuf.get(), RibInputBuffer::eof);
+
+	RibInputBuffer emptyBuf(inStr.data(), inStr.data());
+	BOOST_CHECK_EQUAL(emptyBuf.get(), RibInputBuffer::eof);
+}
+
+BOOST_AUTO_TEST_CASE(RibInputBuffer_mapped_file_test)
+{
+	const char* fileName = "ribinputbuffer_test.rib";
+	const std::string inStr("WorldBegin\nWorldEnd\n");
+	{
+		std::ofstream out(fileName, std::ios::binary);
+		out << inStr;
+	}
+	{
+		RibInputFile in(fileName);
+		BOOST_REQUIRE(in);
+		RibInputBuffer inBuf(in);
+		std::string extractedStr;
+		RibInputBuffer::CharType c = 0;
+		while((c = inBuf.get()) != RibInputBuffer::eof)
+			extractedStr += c;
+		BOOST_CHECK_EQUAL(extractedStr, inStr);
+	}
+	std::remove(fileName);
+
+	RibInputFile missing("ribinputbuffer_test_missing.rib");
+	BOOST_CHECK(!missing);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
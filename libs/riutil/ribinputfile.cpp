@@ -0,0 +1,116 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/// \file
+///
+/// \brief Memory mapped RIB file input.
+
+#include <aqsis/riutil/ribparser.h>
+
+#include <fstream>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+namespace Aqsis {
+
+namespace {
+
+/// Stream buffer presenting a range of memory as its get area.
+class MemoryStreamBuf : public std::streambuf
+{
+    public:
+        MemoryStreamBuf(const char* begin, const char* end)
+        {
+            char* b = const_cast<char*>(begin);
+            char* e = const_cast<char*>(end);
+            setg(b, b, e);
+        }
+
+        void take(const char*& begin, const char*& end)
+        {
+            begin = gptr();
+            end = egptr();
+            setg(eback(), egptr(), egptr());
+        }
+};
+
+} // anon. namespace
+
+struct RibInputFile::Impl
+{
+    boost::iostreams::mapped_file_source mapping;
+    boost::scoped_ptr<MemoryStreamBuf> memoryBuf;
+    boost::scoped_ptr<std::filebuf> fileBuf;
+};
+
+RibInputFile::RibInputFile(const char* fileName)
+    : std::istream(0),
+    m_impl(new Impl())
+{
+    try
+    {
+        m_impl->mapping.open(fileName);
+    }
+    catch(std::exception& /*e*/)
+    {
+        // Empty files and pipes can't be mapped; fall back to reading them
+        // as normal files below.
+    }
+    if(m_impl->mapping.is_open())
+    {
+        const char* data = m_impl->mapping.data();
+        m_impl->memoryBuf.reset(new MemoryStreamBuf(data,
+                                        data + m_impl->mapping.size()));
+        rdbuf(m_impl->memoryBuf.get());
+    }
+    else
+    {
+        m_impl->fileBuf.reset(new std::filebuf());
+        bool opened = m_impl->fileBuf->open(fileName,
+                                            std::ios::in | std::ios::binary);
+        rdbuf(m_impl->fileBuf.get());
+        if(!opened)
+            setstate(std::ios::failbit);
+    }
+}
+
+RibInputFile::~RibInputFile()
+{ }
+
+bool RibInputFile::takeMappedInput(const char*& begin, const char*& end)
+{
+    if(!m_impl->memoryBuf)
+        return false;
+    m_impl->memoryBuf->take(begin, end);
+    return true;
+}
+
+} // namespace Aqsis
+// vi: set et:
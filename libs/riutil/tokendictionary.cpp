@@ -80,7 +80,8 @@ Ri::TypeSpec TokenDict::lookup(const char* token, const char** nameBegin,
 		return spec;
 	Dict::const_iterator i
 		= m_dict.find(std::string(*nameBegin, *nameEnd));
-	if(i == m_dict.end())
+	// Tokens declared with a null declaration are no longer declared.
+	if(i == m_dict.end() || i->second.type == Ri::TypeSpec::Unknown)
 	{
 		AQSIS_THROW_XQERROR(XqValidation, EqE_BadToken,
 			"undeclared token \"" << token << "\"");
@@ -146,9 +147,18 @@ const CqPrimvarToken standardVarsInit[] = {
 	// Option "limits"
 	CqPrimvarToken(class_uniform,  type_integer, 1, "gridsize"),
 	CqPrimvarToken(class_uniform,  type_integer, 1, "texturememory"),
+	CqPrimvarToken(class_uniform,  type_integer, 1, "texturefiles"),
+	CqPrimvarToken(class_uniform,  type_integer, 1, "archivecache"),
+	CqPrimvarToken(class_uniform,  type_integer, 1, "archivethreads"),
+	CqPrimvarToken(class_uniform,  type_integer, 1, "runprograms"),
+	CqPrimvarToken(class_uniform,  type_integer, 1, "proceduralcache"),
+	CqPrimvarToken(class_uniform,  type_string,  1, "proceduralcachedir"),
+	CqPrimvarToken(class_uniform,  type_integer, 1, "subdivmemory"),
 	CqPrimvarToken(class_uniform,  type_integer, 2, "bucketsize"),
 	CqPrimvarToken(class_uniform,  type_integer, 1, "eyesplits"),
+	CqPrimvarToken(class_uniform,  type_integer, 1, "threads"),
 	CqPrimvarToken(class_uniform,  type_color,   1, "zthreshold"),
+	CqPrimvarToken(class_uniform,  type_integer, 1, "memorylimit"),
 	// Option "searchpath"
 	CqPrimvarToken(class_uniform,  type_string,  1, "shader"),
 	CqPrimvarToken(class_uniform,  type_string,  1, "archive"),
@@ -188,6 +198,8 @@ const CqPrimvarToken standardVarsInit[] = {
 	CqPrimvarToken(class_uniform,  type_string,  1, "depthfilter"),
 	// Attribute "dice"
 	CqPrimvarToken(class_uniform,  type_integer, 1, "binary"),
+	// Attribute "visibility"
+	CqPrimvarToken(class_uniform,  type_integer, 1, "trace"),
 	// Attribute "mpdump"
 	CqPrimvarToken(class_uniform,  type_integer, 1, "enabled"),
 	// Attribute "derivatives"
@@ -198,6 +210,7 @@ const CqPrimvarToken standardVarsInit[] = {
 	// Attribute "autoshadows"
 	CqPrimvarToken(class_uniform,  type_string,  1, "shadowmapname"),
 	CqPrimvarToken(class_uniform,  type_integer, 1, "res"),
+	CqPrimvarToken(class_uniform,  type_integer, 1, "deep"),
 	// Attribute "Render"
 	CqPrimvarToken(class_uniform,  type_integer, 1, "multipass"),
 	// Attribute "aqsis"
@@ -0,0 +1,291 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+		\brief Tests comparing shaders compiled to native code with the VM.
+*/
+
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/auto_unit_test.hpp>
+
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include <aqsis/math/color.h>
+#include <aqsis/shadervm/ishader.h>
+#include <aqsis/shadervm/ishaderdata.h>
+#include <aqsis/shadervm/ishaderexecenv.h>
+#include <aqsis/slcomp/icodegen.h>
+#include <aqsis/slcomp/libslparse.h>
+
+namespace {
+
+using namespace Aqsis;
+
+const char* const cacheDir = "aqsis_nativeshader_test";
+
+/// Compile a shader with the given backend, and load the result into the VM.
+boost::shared_ptr<IqShader> compileShader(const std::string& source,
+		IqCodeGen& codeGen, const std::string& slxName, std::string& slx)
+{
+	ResetParser();
+	std::istringstream in(source);
+	std::ostringstream errors;
+	BOOST_REQUIRE_MESSAGE(Parse(in, "nativeshader_test.sl", errors), errors.str());
+	codeGen.OutputTree(GetParseTree(), slxName);
+
+	std::ifstream slxFile(slxName.c_str());
+	std::ostringstream slxStream;
+	slxStream << slxFile.rdbuf();
+	slx = slxStream.str();
+	std::istringstream programFile(slx);
+	return createShaderVM(0, programFile, cacheDir);
+}
+
+/// Outputs of the shader at each point.
+struct SqShaderResult
+{
+	std::vector<CqColor> Ci;
+	std::vector<CqColor> Oi;
+};
+
+/// Run a surface shader on a grid with s and t spread over [0,1].
+SqShaderResult runShader(IqShader& shader, TqInt gridRes)
+{
+	TqInt numPoints = gridRes*gridRes;
+	boost::shared_ptr<IqShaderExecEnv> env = IqShaderExecEnv::create(0);
+	env->Initialise(gridRes-1, gridRes-1, (gridRes-1)*(gridRes-1), numPoints,
+			true, IqAttributesPtr(), IqTransformPtr(), &shader, shader.Uses());
+	shader.InitialiseParameters();
+	shader.Initialise(gridRes-1, gridRes-1, numPoints, env.get());
+	// s and t are u and v, for derivatives.
+	for(TqInt d = EnvVars_du; d <= EnvVars_dv; ++d)
+	{
+		if(IqShaderData* dVar = env->pVar(d))
+		{
+			dVar->Initialise(numPoints);
+			for(TqInt i = 0; i < numPoints; ++i)
+				dVar->SetFloat(1.0f/(gridRes-1), i);
+		}
+	}
+	IqShaderData* s = env->pVar(EnvVars_s);
+	IqShaderData* t = env->pVar(EnvVars_t);
+	IqShaderData* Ci = env->pVar(EnvVars_Ci);
+	IqShaderData* Oi = env->pVar(EnvVars_Oi);
+	BOOST_REQUIRE(s && t && Ci && Oi);
+	s->Initialise(numPoints);
+	t->Initialise(numPoints);
+	Ci->Initialise(numPoints);
+	Oi->Initialise(numPoints);
+	for(TqInt i = 0; i < numPoints; ++i)
+	{
+		s->SetFloat(TqFloat(i % gridRes)/(gridRes-1), i);
+		t->SetFloat(TqFloat(i / gridRes)/(gridRes-1), i);
+	}
+
+	shader.Evaluate(env.get());
+
+	SqShaderResult result;
+	result.Ci.resize(numPoints);
+	result.Oi.resize(numPoints);
+	for(TqInt i = 0; i < numPoints; ++i)
+	{
+		Ci->GetColor(result.Ci[i], i);
+		Oi->GetColor(result.Oi[i], i);
+	}
+	return result;
+}
+
+void checkColorsClose(const CqColor& a, const CqColor& b, TqInt point)
+{
+	for(TqInt c = 0; c < 3; ++c)
+	{
+		BOOST_CHECK_MESSAGE(std::fabs(a[c] - b[c]) < 1e-5f,
+				"point " << point << " channel " << c << ": native "
+				<< a[c] << " != VM " << b[c]);
+	}
+}
+
+/// Compile the shader both ways, and check the results are the same.
+///
+/// If expectNative is false, the shader should only run on the VM.
+void checkNativeMatchesVM(const std::string& source, bool expectNative = true)
+{
+	boost::filesystem::create_directories(cacheDir);
+	const char* cxx = std::getenv("CXX");
+	CqCodeGenVM vmCodeGen;
+	CqCodeGenNative nativeCodeGen(cacheDir, cxx ? cxx : "c++");
+
+	std::string slx;
+	boost::shared_ptr<IqShader> vmShader = compileShader(source, vmCodeGen,
+			std::string(cacheDir) + "/vm.slx", slx);
+	BOOST_CHECK(slx.find("NATIVE") == std::string::npos);
+	boost::shared_ptr<IqShader> nativeShader = compileShader(source,
+			nativeCodeGen, std::string(cacheDir) + "/native.slx", slx);
+	BOOST_REQUIRE_MESSAGE((slx.find("NATIVE") != std::string::npos) == expectNative,
+			(expectNative ? "shader was not compiled to native code"
+			 : "shader was compiled to native code"));
+
+	const TqInt gridRes = 7;
+	SqShaderResult vmResult = runShader(*vmShader, gridRes);
+	SqShaderResult nativeResult = runShader(*nativeShader, gridRes);
+	for(TqInt i = 0; i < gridRes*gridRes; ++i)
+	{
+		checkColorsClose(nativeResult.Ci[i], vmResult.Ci[i], i);
+		checkColorsClose(nativeResult.Oi[i], vmResult.Oi[i], i);
+	}
+	boost::filesystem::remove_all(cacheDir);
+}
+
+} // unnamed namespace
+
+BOOST_AUTO_TEST_SUITE(nativeshader_tests)
+
+BOOST_AUTO_TEST_CASE(nativeshader_relations_test)
+{
+	// Each relation has operands of different values on different points, so
+	// reversed operands give different results.
+	checkNativeMatchesVM(
+		"surface relations(float k = 0.5)\n"
+		"{\n"
+		"	float r = 0;\n"
+		"	if(s < k)\n"
+		"		r = 1;\n"
+		"	else\n"
+		"		r = 2;\n"
+		"	if(s >= 0.25 && t > s)\n"
+		"		r += 10;\n"
+		"	if(s <= t || s > 0.9)\n"
+		"		r += 100;\n"
+		"	Ci = color(r, s > t ? 1 : 0, t >= k ? 1 : 0);\n"
+		"	Oi = color(s == t ? 1 : 0, s != t ? 1 : 0, !(s < t) ? 1 : 0);\n"
+		"}\n");
+}
+
+BOOST_AUTO_TEST_CASE(nativeshader_loops_test)
+{
+	checkNativeMatchesVM(
+		"surface loops()\n"
+		"{\n"
+		"	float i = 0, j = 0, acc = 0;\n"
+		"	for(i = 0; i < 10; i += 1)\n"
+		"	{\n"
+		"		if(i > 6*s + 2)\n"
+		"			break;\n"
+		"		if(mod(i, 2) == 0)\n"
+		"			continue;\n"
+		"		for(j = 0; j < 4; j += 1)\n"
+		"		{\n"
+		"			if(j > 3*t)\n"
+		"				continue 2;\n"
+		"			acc += j;\n"
+		"		}\n"
+		"		acc += i;\n"
+		"	}\n"
+		"	Ci = color(acc, i, j);\n"
+		"	Oi = 1;\n"
+		"}\n");
+}
+
+BOOST_AUTO_TEST_CASE(nativeshader_shadeops_test)
+{
+	checkNativeMatchesVM(
+		"surface shadeops(float k = 0.5)\n"
+		"{\n"
+		"	color c = color(s, t, k);\n"
+		"	setcomp(c, 1, comp(c, 0) * 2 - 1);\n"
+		"	Ci = mix(c, color(1, 0, 0), smoothstep(0.2, 0.8, s))\n"
+		"		+ color(pow(t, 2.5), sqrt(s), clamp(s - t, 0, 1));\n"
+		"	Oi = color(max(s, t, k), min(s, t), mod(5*s, 0.7))\n"
+		"		* length(vector(s, t, 1)) / 2;\n"
+		"}\n");
+}
+
+BOOST_AUTO_TEST_CASE(nativeshader_noise_test)
+{
+	checkNativeMatchesVM(
+		"surface noises()\n"
+		"{\n"
+		"	point p = point(s, t, 0.5) * 4;\n"
+		"	color c = noise(p);\n"
+		"	vector v = noise(s*3, t*3);\n"
+		"	Ci = color(noise(s*5), noise(s*3, t*3), noise(p)) + c;\n"
+		"	Oi = color(noise(p, 0.3), xcomp(v), noise(t*7)) + color noise(s*2);\n"
+		"}\n");
+}
+
+BOOST_AUTO_TEST_CASE(nativeshader_derivatives_test)
+{
+	// Derivatives of standard variables, locals and expressions, at the
+	// edges as well as the middle of the grid.
+	checkNativeMatchesVM(
+		"surface derivs()\n"
+		"{\n"
+		"	float ss = s*s;\n"
+		"	point p = point(s, t*s, ss);\n"
+		"	Ci = color(Du(ss), Dv(t*ss), Deriv(ss*t, s));\n"
+		"	Oi = color(Du(p)) + color(Dv(p)) + color(Deriv(p, t)) + Du(noise(s*4));\n"
+		"}\n");
+}
+
+BOOST_AUTO_TEST_CASE(nativeshader_uniform_test)
+{
+	// A uniform loop counter runs the same on every point.
+	checkNativeMatchesVM(
+		"surface uniformloop()\n"
+		"{\n"
+		"	uniform float i;\n"
+		"	float acc = 0;\n"
+		"	for(i = 0; i < 4; i += 1)\n"
+		"		acc += s*i;\n"
+		"	Ci = color(acc, i, 0);\n"
+		"	Oi = 1;\n"
+		"}\n");
+	// The VM gives a uniform assigned under a varying condition the same
+	// value everywhere, so this can't run a point at a time.
+	checkNativeMatchesVM(
+		"surface uniformcond()\n"
+		"{\n"
+		"	uniform float u = 0;\n"
+		"	if(s > 0.5)\n"
+		"		u = 1;\n"
+		"	Ci = u;\n"
+		"	Oi = 1;\n"
+		"}\n", false);
+	// Nor can a derivative of a variable changed in a loop.
+	checkNativeMatchesVM(
+		"surface loopderiv()\n"
+		"{\n"
+		"	float x = 0, j;\n"
+		"	for(j = 0; j < 3; j += 1)\n"
+		"		x += s*t;\n"
+		"	Ci = Du(x);\n"
+		"	Oi = 1;\n"
+		"}\n", false);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,516 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+		\brief Tests that batched shadeops give the same results as evaluating
+		them a point at a time.
+*/
+
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/auto_unit_test.hpp>
+
+#include <cmath>
+
+#include <boost/shared_ptr.hpp>
+
+#include <aqsis/math/color.h>
+#include <aqsis/math/math.h>
+#include <aqsis/math/noise.h>
+#include <aqsis/math/vector3d.h>
+#include <aqsis/shadervm/ishaderexecenv.h>
+
+#include "shadervariable.h"
+#include "shaderexecenv/shadeops_batch.h"
+
+namespace {
+
+using namespace Aqsis;
+
+/// Number of shading points in the test grids.
+const TqInt gridSize = 7;
+
+/// Argument index used for the values the result is filled with beforehand.
+const TqInt sentinelArg = 9;
+
+TqFloat testFloat(TqInt i, TqInt arg)
+{
+	return 1.7f * std::sin(1.3f * i + 2.1f * arg + 0.4f);
+}
+
+/// Test values, storage and comparison for each value type of the shadeops.
+template<typename T>
+struct SqTestData;
+
+template<>
+struct SqTestData<TqFloat>
+{
+	static TqFloat value(TqInt i, TqInt arg)
+	{
+		return testFloat(i, arg);
+	}
+	static IqShaderData* create(bool varying)
+	{
+		if(varying)
+			return new CqShaderVariableVaryingFloat("f");
+		return new CqShaderVariableUniformFloat("f");
+	}
+	static bool close(TqFloat a, TqFloat b)
+	{
+		return std::fabs(a - b) <= 1e-5f * (1 + std::fabs(b));
+	}
+};
+
+template<>
+struct SqTestData<CqVector3D>
+{
+	static CqVector3D value(TqInt i, TqInt arg)
+	{
+		return CqVector3D(testFloat(i, arg), testFloat(i, arg + 5),
+				testFloat(i, arg + 11));
+	}
+	static IqShaderData* create(bool varying)
+	{
+		if(varying)
+			return new CqShaderVariableVaryingPoint("p");
+		return new CqShaderVariableUniformPoint("p");
+	}
+	static bool close(const CqVector3D& a, const CqVector3D& b)
+	{
+		return SqTestData<TqFloat>::close(a.x(), b.x())
+			&& SqTestData<TqFloat>::close(a.y(), b.y())
+			&& SqTestData<TqFloat>::close(a.z(), b.z());
+	}
+};
+
+template<>
+struct SqTestData<CqColor>
+{
+	static CqColor value(TqInt i, TqInt arg)
+	{
+		return CqColor(std::fabs(testFloat(i, arg)),
+				std::fabs(testFloat(i, arg + 5)),
+				std::fabs(testFloat(i, arg + 11)));
+	}
+	static IqShaderData* create(bool varying)
+	{
+		if(varying)
+			return new CqShaderVariableVaryingColor("c");
+		return new CqShaderVariableUniformColor("c");
+	}
+	static bool close(const CqColor& a, const CqColor& b)
+	{
+		return SqTestData<TqFloat>::close(a.r(), b.r())
+			&& SqTestData<TqFloat>::close(a.g(), b.g())
+			&& SqTestData<TqFloat>::close(a.b(), b.b());
+	}
+};
+
+/// Make an argument holding the test values for argument number arg.
+template<typename T>
+boost::shared_ptr<IqShaderData> makeArg(bool varying, TqInt arg)
+{
+	boost::shared_ptr<IqShaderData> d(SqTestData<T>::create(varying));
+	d->Initialise(gridSize);
+	for(TqInt i = 0; i < (varying ? gridSize : 1); ++i)
+		SqBatchAccess<T>::set(d.get(), SqTestData<T>::value(i, arg), i);
+	return d;
+}
+
+template<typename T>
+T getValue(IqShaderData* d, TqInt i)
+{
+	T v;
+	SqBatchAccess<T>::get(d, v, i);
+	return v;
+}
+
+/// True if point i is running in the partial running state.
+bool partlyRunning(TqInt i)
+{
+	return i % 3 != 1;
+}
+
+/// Create an execution environment, with some points switched off if partial.
+boost::shared_ptr<IqShaderExecEnv> createEnv(bool partial)
+{
+	boost::shared_ptr<IqShaderExecEnv> env = IqShaderExecEnv::create(0);
+	env->Initialise(gridSize, 1, gridSize, gridSize, false,
+			IqConstAttributesPtr(), IqConstTransformPtr(), 0, 0);
+	if(partial)
+	{
+		CqBitVector& state = env->CurrentState();
+		for(TqInt i = 0; i < gridSize; ++i)
+			state.SetValue(i, partlyRunning(i));
+		env->GetCurrentState();
+	}
+	return env;
+}
+
+/** \brief Check the result of a shadeop against the reference values.
+ *
+ * A uniform result is only set at the first point.  A varying one should
+ * match the reference at running points and be left alone elsewhere.
+ */
+template<typename R>
+void checkResult(const char* name, TqInt classes, bool partial,
+		IqShaderData* result, TqInt i, const R& expected)
+{
+	bool varying = result->Class() == class_varying;
+	if(i > 0 && !varying)
+		return;
+	R want = (!varying || !partial || partlyRunning(i))
+		? expected : SqTestData<R>::value(i, sentinelArg);
+	BOOST_CHECK_MESSAGE(SqTestData<R>::close(getValue<R>(result, i), want),
+			name << ": classes " << classes << ", partial " << partial
+			<< ", point " << i);
+}
+
+/** \brief Run a shadeop with every mix of uniform and varying arguments and
+ * compare the results with a reference evaluated a point at a time.
+ *
+ * Bit n of the classes counter makes argument n varying; the final bit
+ * makes the result varying, which it must be if any argument is.
+ */
+template<typename R, typename A, typename OpT, typename RefT>
+void checkShadeop(const char* name, const OpT& op, const RefT& ref)
+{
+	for(TqInt classes = 0; classes < 4; ++classes)
+	{
+		bool resultVarying = (classes & 2) != 0;
+		if(!resultVarying && (classes & 1))
+			continue;
+		for(TqInt partial = 0; partial < 2; ++partial)
+		{
+			boost::shared_ptr<IqShaderExecEnv> env = createEnv(partial);
+			boost::shared_ptr<IqShaderData> a = makeArg<A>(classes & 1, 0);
+			boost::shared_ptr<IqShaderData> r = makeArg<R>(resultVarying, sentinelArg);
+			op(*env, a.get(), r.get());
+			for(TqInt i = 0; i < gridSize; ++i)
+				checkResult(name, classes, partial, r.get(), i,
+						ref(getValue<A>(a.get(), i)));
+		}
+	}
+}
+
+template<typename R, typename A, typename B, typename OpT, typename RefT>
+void checkShadeop(const char* name, const OpT& op, const RefT& ref)
+{
+	for(TqInt classes = 0; classes < 8; ++classes)
+	{
+		bool resultVarying = (classes & 4) != 0;
+		if(!resultVarying && (classes & 3))
+			continue;
+		for(TqInt partial = 0; partial < 2; ++partial)
+		{
+			boost::shared_ptr<IqShaderExecEnv> env = createEnv(partial);
+			boost::shared_ptr<IqShaderData> a = makeArg<A>(classes & 1, 0);
+			boost::shared_ptr<IqShaderData> b = makeArg<B>(classes & 2, 1);
+			boost::shared_ptr<IqShaderData> r = makeArg<R>(resultVarying, sentinelArg);
+			op(*env, a.get(), b.get(), r.get());
+			for(TqInt i = 0; i < gridSize; ++i)
+				checkResult(name, classes, partial, r.get(), i,
+						ref(getValue<A>(a.get(), i), getValue<B>(b.get(), i)));
+		}
+	}
+}
+
+template<typename R, typename A, typename B, typename C, typename OpT, typename RefT>
+void checkShadeop(const char* name, const OpT& op, const RefT& ref)
+{
+	for(TqInt classes = 0; classes < 16; ++classes)
+	{
+		bool resultVarying = (classes & 8) != 0;
+		if(!resultVarying && (classes & 7))
+			continue;
+		for(TqInt partial = 0; partial < 2; ++partial)
+		{
+			boost::shared_ptr<IqShaderExecEnv> env = createEnv(partial);
+			boost::shared_ptr<IqShaderData> a = makeArg<A>(classes & 1, 0);
+			boost::shared_ptr<IqShaderData> b = makeArg<B>(classes & 2, 1);
+			boost::shared_ptr<IqShaderData> c = makeArg<C>(classes & 4, 2);
+			boost::shared_ptr<IqShaderData> r = makeArg<R>(resultVarying, sentinelArg);
+			op(*env, a.get(), b.get(), c.get(), r.get());
+			for(TqInt i = 0; i < gridSize; ++i)
+				checkResult(name, classes, partial, r.get(), i,
+						ref(getValue<A>(a.get(), i), getValue<B>(b.get(), i),
+							getValue<C>(c.get(), i)));
+		}
+	}
+}
+
+// Adaptors calling shadeop member functions of the environment.
+typedef void (IqShaderExecEnv::*TqShadeop1)(IqShaderData*, IqShaderData*, IqShader*);
+typedef void (IqShaderExecEnv::*TqShadeop2)(IqShaderData*, IqShaderData*,
+		IqShaderData*, IqShader*);
+typedef void (IqShaderExecEnv::*TqShadeop3)(IqShaderData*, IqShaderData*,
+		IqShaderData*, IqShaderData*, IqShader*);
+typedef void (IqShaderExecEnv::*TqShadeopVar2)(IqShaderData*, IqShaderData*,
+		IqShaderData*, IqShader*, int, IqShaderData**);
+
+struct SqShadeop1
+{
+	SqShadeop1(TqShadeop1 op) : op(op) {}
+	void operator()(IqShaderExecEnv& env, IqShaderData* a, IqShaderData* r) const
+	{
+		(env.*op)(a, r, 0);
+	}
+	TqShadeop1 op;
+};
+
+struct SqShadeop2
+{
+	SqShadeop2(TqShadeop2 op) : op(op) {}
+	void operator()(IqShaderExecEnv& env, IqShaderData* a, IqShaderData* b,
+			IqShaderData* r) const
+	{
+		(env.*op)(a, b, r, 0);
+	}
+	TqShadeop2 op;
+};
+
+struct SqShadeop3
+{
+	SqShadeop3(TqShadeop3 op) : op(op) {}
+	void operator()(IqShaderExecEnv& env, IqShaderData* a, IqShaderData* b,
+			IqShaderData* c, IqShaderData* r) const
+	{
+		(env.*op)(a, b, c, r, 0);
+	}
+	TqShadeop3 op;
+};
+
+/// Adaptor for min() and max(), which take further arguments as an array.
+struct SqShadeopVar2
+{
+	SqShadeopVar2(TqShadeopVar2 op) : op(op) {}
+	void operator()(IqShaderExecEnv& env, IqShaderData* a, IqShaderData* b,
+			IqShaderData* r) const
+	{
+		(env.*op)(a, b, r, 0, 0, 0);
+	}
+	TqShadeopVar2 op;
+};
+
+/// ctransform("hsv", "YIQ", c)
+struct SqCtransformOp
+{
+	void operator()(IqShaderExecEnv& env, IqShaderData* c, IqShaderData* r) const
+	{
+		CqShaderVariableUniformString fromSpace("from");
+		fromSpace.SetString("hsv");
+		CqShaderVariableUniformString toSpace("to");
+		toSpace.SetString("YIQ");
+		env.SO_ctransform(&fromSpace, &toSpace, c, r);
+	}
+};
+
+// Reference implementations, evaluated a point at a time.
+struct SqSinRef
+{
+	TqFloat operator()(TqFloat a) const { return std::sin(a); }
+};
+struct SqAtan2Ref
+{
+	TqFloat operator()(TqFloat y, TqFloat x) const { return std::atan2(y, x); }
+};
+struct SqModRef
+{
+	TqFloat operator()(TqFloat a, TqFloat b) const
+	{
+		TqInt n = static_cast<TqInt>( a / b );
+		TqFloat a2 = a - n * b;
+		if ( a2 < 0.0f )
+			a2 += b;
+		return a2;
+	}
+};
+template<typename T>
+struct SqClampRef
+{
+	T operator()(const T& a, const T& lo, const T& hi) const { return clamp(a, lo, hi); }
+};
+template<typename T>
+struct SqMinRef
+{
+	T operator()(const T& a, const T& b) const { return min(a, b); }
+};
+template<typename T>
+struct SqMaxRef
+{
+	T operator()(const T& a, const T& b) const { return max(a, b); }
+};
+template<typename T>
+struct SqMixRef
+{
+	T operator()(const T& x0, const T& x1, TqFloat value) const
+	{
+		return ( 1.0f - value ) * x0 + value * x1;
+	}
+};
+struct SqLengthRef
+{
+	TqFloat operator()(const CqVector3D& v) const { return v.Magnitude(); }
+};
+struct SqDistanceRef
+{
+	TqFloat operator()(const CqVector3D& a, const CqVector3D& b) const
+	{
+		return ( a - b ).Magnitude();
+	}
+};
+struct SqNormalizeRef
+{
+	CqVector3D operator()(const CqVector3D& v) const
+	{
+		return v / v.Magnitude();
+	}
+};
+struct SqFaceforward2Ref
+{
+	CqVector3D operator()(const CqVector3D& N, const CqVector3D& I,
+			const CqVector3D& Nref) const
+	{
+		return ( ( -I ) * Nref < 0.0f ) ? -N : N;
+	}
+};
+struct SqReflectRef
+{
+	CqVector3D operator()(const CqVector3D& I, const CqVector3D& N) const
+	{
+		return I - 2.0f * ( I * N ) * N;
+	}
+};
+struct SqRefractRef
+{
+	CqVector3D operator()(const CqVector3D& I, const CqVector3D& N,
+			TqFloat eta) const
+	{
+		TqFloat IdotN = I * N;
+		TqFloat k = 1 - eta * eta * ( 1 - IdotN * IdotN );
+		if ( k < 0.0f )
+			return CqVector3D( 0, 0, 0 );
+		return eta * I - ( eta * IdotN + std::sqrt( k ) ) * N;
+	}
+};
+struct SqPtLinedRef
+{
+	TqFloat operator()(const CqVector3D& P0, const CqVector3D& P1,
+			const CqVector3D& Q) const
+	{
+		CqVector3D dir = P1 - P0;
+		TqFloat t = clamp(( ( Q - P0 ) * dir ) / dir.Magnitude2(), 0.0f, 1.0f);
+		return ( Q - ( P0 + t * dir ) ).Magnitude();
+	}
+};
+struct SqCtransformRef
+{
+	CqColor operator()(const CqColor& c) const
+	{
+		return rgbtoYIQ(hsvtorgb(c));
+	}
+};
+struct SqFNoise1Ref
+{
+	TqFloat operator()(TqFloat v) const { return CqNoise::FGNoise1(v); }
+};
+struct SqFNoise3Ref
+{
+	TqFloat operator()(const CqVector3D& p) const { return CqNoise::FGNoise3(p); }
+};
+struct SqCNoise3Ref
+{
+	CqColor operator()(const CqVector3D& p) const { return CqNoise::CGNoise3(p); }
+};
+struct SqPNoise3Ref
+{
+	CqVector3D operator()(const CqVector3D& p) const { return CqNoise::PGNoise3(p); }
+};
+
+} // unnamed namespace
+
+
+BOOST_AUTO_TEST_CASE(shadeops_batch_math_test)
+{
+	checkShadeop<TqFloat, TqFloat>("sin",
+			SqShadeop1(&IqShaderExecEnv::SO_sin), SqSinRef());
+	checkShadeop<TqFloat, TqFloat, TqFloat>("atan",
+			SqShadeop2(&IqShaderExecEnv::SO_atan), SqAtan2Ref());
+	checkShadeop<TqFloat, TqFloat, TqFloat>("mod",
+			SqShadeop2(&IqShaderExecEnv::SO_mod), SqModRef());
+	checkShadeop<TqFloat, TqFloat, TqFloat, TqFloat>("clamp",
+			SqShadeop3(&IqShaderExecEnv::SO_clamp), SqClampRef<TqFloat>());
+	checkShadeop<TqFloat, TqFloat, TqFloat>("min",
+			SqShadeopVar2(&IqShaderExecEnv::SO_min), SqMinRef<TqFloat>());
+	checkShadeop<TqFloat, TqFloat, TqFloat>("max",
+			SqShadeopVar2(&IqShaderExecEnv::SO_max), SqMaxRef<TqFloat>());
+	checkShadeop<TqFloat, TqFloat, TqFloat, TqFloat>("mix",
+			SqShadeop3(&IqShaderExecEnv::SO_fmix), SqMixRef<TqFloat>());
+}
+
+BOOST_AUTO_TEST_CASE(shadeops_batch_vector_test)
+{
+	checkShadeop<TqFloat, CqVector3D>("length",
+			SqShadeop1(&IqShaderExecEnv::SO_length), SqLengthRef());
+	checkShadeop<TqFloat, CqVector3D, CqVector3D>("distance",
+			SqShadeop2(&IqShaderExecEnv::SO_distance), SqDistanceRef());
+	checkShadeop<CqVector3D, CqVector3D>("normalize",
+			SqShadeop1(&IqShaderExecEnv::SO_normalize), SqNormalizeRef());
+	checkShadeop<CqVector3D, CqVector3D, CqVector3D, CqVector3D>("faceforward",
+			SqShadeop3(&IqShaderExecEnv::SO_faceforward2), SqFaceforward2Ref());
+	checkShadeop<CqVector3D, CqVector3D, CqVector3D>("reflect",
+			SqShadeop2(&IqShaderExecEnv::SO_reflect), SqReflectRef());
+	checkShadeop<CqVector3D, CqVector3D, CqVector3D, TqFloat>("refract",
+			SqShadeop3(&IqShaderExecEnv::SO_refract), SqRefractRef());
+	checkShadeop<TqFloat, CqVector3D, CqVector3D, CqVector3D>("ptlined",
+			SqShadeop3(&IqShaderExecEnv::SO_ptlined), SqPtLinedRef());
+	checkShadeop<CqVector3D, CqVector3D, CqVector3D, CqVector3D>("pclamp",
+			SqShadeop3(&IqShaderExecEnv::SO_pclamp), SqClampRef<CqVector3D>());
+	checkShadeop<CqVector3D, CqVector3D, CqVector3D>("pmin",
+			SqShadeopVar2(&IqShaderExecEnv::SO_pmin), SqMinRef<CqVector3D>());
+	checkShadeop<CqVector3D, CqVector3D, CqVector3D, TqFloat>("vmix",
+			SqShadeop3(&IqShaderExecEnv::SO_vmix), SqMixRef<CqVector3D>());
+}
+
+BOOST_AUTO_TEST_CASE(shadeops_batch_color_test)
+{
+	checkShadeop<CqColor, CqColor, CqColor, CqColor>("cclamp",
+			SqShadeop3(&IqShaderExecEnv::SO_cclamp), SqClampRef<CqColor>());
+	checkShadeop<CqColor, CqColor, CqColor>("cmin",
+			SqShadeopVar2(&IqShaderExecEnv::SO_cmin), SqMinRef<CqColor>());
+	checkShadeop<CqColor, CqColor, CqColor>("cmax",
+			SqShadeopVar2(&IqShaderExecEnv::SO_cmax), SqMaxRef<CqColor>());
+	checkShadeop<CqColor, CqColor, CqColor, TqFloat>("cmix",
+			SqShadeop3(&IqShaderExecEnv::SO_cmix), SqMixRef<CqColor>());
+	checkShadeop<CqColor, CqColor>("ctransform",
+			SqCtransformOp(), SqCtransformRef());
+}
+
+BOOST_AUTO_TEST_CASE(shadeops_batch_noise_test)
+{
+	checkShadeop<TqFloat, TqFloat>("noise1",
+			SqShadeop1(&IqShaderExecEnv::SO_fnoise1), SqFNoise1Ref());
+	checkShadeop<TqFloat, CqVector3D>("noise3",
+			SqShadeop1(&IqShaderExecEnv::SO_fnoise3), SqFNoise3Ref());
+	checkShadeop<CqColor, CqVector3D>("cnoise3",
+			SqShadeop1(&IqShaderExecEnv::SO_cnoise3), SqCNoise3Ref());
+	checkShadeop<CqVector3D, CqVector3D>("pnoise3",
+			SqShadeop1(&IqShaderExecEnv::SO_pnoise3), SqPNoise3Ref());
+}
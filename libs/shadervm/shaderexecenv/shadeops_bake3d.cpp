@@ -26,6 +26,10 @@
 
 #include <Partio.h>
 
+#ifdef ENABLE_THREADING
+#   include <boost/thread/mutex.hpp>
+#endif
+
 #include "shaderexecenv.h"
 
 #include <aqsis/util/autobuffer.h>
@@ -228,6 +232,13 @@ class Texture3dCache
 // TODO: Make non-global
 static Bake3dCache g_bakeCloudCache;
 static Texture3dCache g_texture3dCloudCache;
+#ifdef ENABLE_THREADING
+// Grids may be shaded concurrently.  Baking appends to the shared point
+// clouds, so holds its lock throughout; texture3d() only reads the clouds once
+// they're loaded.
+static boost::mutex g_bakeCloudMutex;
+static boost::mutex g_texture3dCloudMutex;
+#endif
 
 void flushBake3dCache()
 {
@@ -260,6 +271,9 @@ void CqShaderExecEnv::SO_bake3d( IqShaderData* ptc,
     const CqBitVector& RS = RunningState();
     CqString ptcName;
     ptc->GetString(ptcName);
+#   ifdef ENABLE_THREADING
+    boost::mutex::scoped_lock lock(g_bakeCloudMutex);
+#   endif
     // Find point cloud in cache, or create it if it doesn't exist.
     Partio::ParticlesDataMutable* pointFile = g_bakeCloudCache.find(ptcName);
     bool varying = position->Class() == class_varying ||
@@ -581,7 +595,13 @@ void CqShaderExecEnv::SO_texture3d(IqShaderData* ptc,
     CqString ptcName;
     ptc->GetString(ptcName);
 
-    Partio::ParticlesData* pointFile = g_texture3dCloudCache.find(ptcName);
+    Partio::ParticlesData* pointFile = 0;
+    {
+#       ifdef ENABLE_THREADING
+        boost::mutex::scoped_lock lock(g_texture3dCloudMutex);
+#       endif
+        pointFile = g_texture3dCloudCache.find(ptcName);
+    }
     bool varying = position->Class() == class_varying ||
                    normal->Class() == class_varying ||
                    Result->Class() == class_varying;
@@ -0,0 +1,410 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+		\brief Batched evaluation of elementwise shadeops over a whole grid.
+
+ Most shadeops compute each shading point independently of the others.
+ Rather than fetch and store every point through the virtual IqShaderData
+ interface, the functions here run a kernel functor directly over the
+ contiguous storage of the varying variables, using the running state as a
+ mask.  When every point is running and every argument is varying the inner
+ loop is a plain array loop with no branches, which the compiler is free to
+ vectorise.
+
+ Arguments of unexpected type (arrays, or a type the kernel doesn't take)
+ fall back to evaluating through the virtual interface, so the batched
+ functions can always be used in place of a hand written grid loop.
+
+ Some vector and colour shadeops keep their own grid loops:
+  - setcomp() and its relatives modify their argument in place.
+  - The min() and max() families only batch two arguments; further ones are
+    passed as a separate array of shader data.
+  - Ops which report domain errors, such as sqrt() and log(), must name the
+    offending point's value in the message.
+  - Derivatives, splines, texture and illumination ops read neighbouring
+    points or the scene rather than a single point of each argument.
+  - Ops returning matrices, such as mtransform() and mrotate(), aren't
+    vector or colour ops and are left for now.
+*/
+
+//? Is .h included already?
+#ifndef SHADEOPS_BATCH_H_INCLUDED
+#define SHADEOPS_BATCH_H_INCLUDED 1
+
+#include	<aqsis/aqsis.h>
+
+#include	<aqsis/math/color.h>
+#include	<aqsis/math/matrix.h>
+#include	<aqsis/math/vector3d.h>
+#include	<aqsis/shadervm/ishaderdata.h>
+#include	<aqsis/util/bitvector.h>
+
+namespace Aqsis {
+
+//----------------------------------------------------------------------
+/** \brief Access to the storage of shader data holding values of type T.
+ *
+ * Specialised for each value type which a batched kernel may take or
+ * return.  point, vector and normal data all share CqVector3D storage.
+ */
+template<typename T>
+struct SqBatchAccess;
+
+template<>
+struct SqBatchAccess<TqFloat>
+{
+	static bool compatible(const IqShaderData* d)
+	{
+		return d->Type() == type_float;
+	}
+	static void ptr(IqShaderData* d, TqFloat*& p)
+	{
+		d->GetFloatPtr(p);
+	}
+	static void get(IqShaderData* d, TqFloat& v, TqInt i)
+	{
+		d->GetFloat(v, i);
+	}
+	static void set(IqShaderData* d, const TqFloat& v, TqInt i)
+	{
+		d->SetFloat(v, i);
+	}
+};
+
+template<>
+struct SqBatchAccess<CqVector3D>
+{
+	static bool compatible(const IqShaderData* d)
+	{
+		EqVariableType type = d->Type();
+		return type == type_point || type == type_vector || type == type_normal;
+	}
+	static void ptr(IqShaderData* d, CqVector3D*& p)
+	{
+		d->GetPointPtr(p);
+	}
+	static void get(IqShaderData* d, CqVector3D& v, TqInt i)
+	{
+		switch(d->Type())
+		{
+			case type_vector: d->GetVector(v, i); break;
+			case type_normal: d->GetNormal(v, i); break;
+			default:          d->GetPoint(v, i);  break;
+		}
+	}
+	static void set(IqShaderData* d, const CqVector3D& v, TqInt i)
+	{
+		switch(d->Type())
+		{
+			case type_vector: d->SetVector(v, i); break;
+			case type_normal: d->SetNormal(v, i); break;
+			default:          d->SetPoint(v, i);  break;
+		}
+	}
+};
+
+template<>
+struct SqBatchAccess<CqColor>
+{
+	static bool compatible(const IqShaderData* d)
+	{
+		return d->Type() == type_color;
+	}
+	static void ptr(IqShaderData* d, CqColor*& p)
+	{
+		d->GetColorPtr(p);
+	}
+	static void get(IqShaderData* d, CqColor& v, TqInt i)
+	{
+		d->GetColor(v, i);
+	}
+	static void set(IqShaderData* d, const CqColor& v, TqInt i)
+	{
+		d->SetColor(v, i);
+	}
+};
+
+template<>
+struct SqBatchAccess<CqMatrix>
+{
+	static bool compatible(const IqShaderData* d)
+	{
+		return d->Type() == type_matrix;
+	}
+	static void ptr(IqShaderData* d, CqMatrix*& p)
+	{
+		d->GetMatrixPtr(p);
+	}
+	static void get(IqShaderData* d, CqMatrix& v, TqInt i)
+	{
+		d->GetMatrix(v, i);
+	}
+	static void set(IqShaderData* d, const CqMatrix& v, TqInt i)
+	{
+		d->SetMatrix(v, i);
+	}
+};
+
+
+//----------------------------------------------------------------------
+/** \brief A single shadeop argument viewed as an array over the grid.
+ *
+ * Uniform data is presented with a stride of zero, so that it may be indexed
+ * in the same way as varying data.
+ */
+template<typename T>
+class CqBatchArg
+{
+	public:
+		CqBatchArg(IqShaderData* d)
+			: m_data(0),
+			m_stride(d->Class() == class_varying ? 1 : 0)
+		{
+			T* p = 0;
+			SqBatchAccess<T>::ptr(d, p);
+			m_data = p;
+		}
+		/// Get the value at the given shading point.
+		const T& operator[](TqInt i) const
+		{
+			return m_data[i*m_stride];
+		}
+		/// Get the underlying storage.
+		const T* data() const
+		{
+			return m_data;
+		}
+		bool isVarying() const
+		{
+			return m_stride != 0;
+		}
+	private:
+		const T* m_data;
+		TqInt m_stride;
+};
+
+namespace detail {
+
+/// Return true if the data can be accessed directly as an array of T.
+template<typename T>
+inline bool batchable(IqShaderData* d)
+{
+	return SqBatchAccess<T>::compatible(d) && d->ArrayEntry(0) == d;
+}
+
+/// Return true if all shading points of the grid are running.
+inline bool allRunning(const CqBitVector& RS, TqInt npoints)
+{
+	return RS.Count() >= npoints;
+}
+
+} // namespace detail
+
+
+//----------------------------------------------------------------------
+/** \brief Evaluate a one argument elementwise shadeop over the grid.
+ *
+ * \param RS - running state, used as a mask for varying results.
+ * \param npoints - number of shading points in the grid.
+ * \param a - argument.
+ * \param result - storage for the result.
+ * \param kernel - functor computing R from a single A.
+ */
+template<typename R, typename A, typename KernelT>
+void batchShadeop(const CqBitVector& RS, TqInt npoints, IqShaderData* a,
+		IqShaderData* result, const KernelT& kernel)
+{
+	bool varying = a->Class() == class_varying || result->Class() == class_varying;
+	if(detail::batchable<A>(a) && detail::batchable<R>(result)
+		&& (!varying || result->Class() == class_varying))
+	{
+		CqBatchArg<A> pa(a);
+		R* pr = 0;
+		SqBatchAccess<R>::ptr(result, pr);
+		if(!varying)
+			pr[0] = kernel(pa[0]);
+		else if(detail::allRunning(RS, npoints))
+		{
+			if(pa.isVarying())
+			{
+				const A* da = pa.data();
+				for(TqInt i = 0; i < npoints; ++i)
+					pr[i] = kernel(da[i]);
+			}
+			else
+			{
+				R r = kernel(pa[0]);
+				for(TqInt i = 0; i < npoints; ++i)
+					pr[i] = r;
+			}
+		}
+		else
+		{
+			for(TqInt i = 0; i < npoints; ++i)
+			{
+				if(RS.Value(i))
+					pr[i] = kernel(pa[i]);
+			}
+		}
+		return;
+	}
+	// Fall back on evaluation via the virtual interface.
+	TqInt i = 0;
+	do
+	{
+		if(!varying || RS.Value(i))
+		{
+			A va;
+			SqBatchAccess<A>::get(a, va, i);
+			SqBatchAccess<R>::set(result, kernel(va), i);
+		}
+	}
+	while(++i < npoints && varying);
+}
+
+/** \brief Evaluate a two argument elementwise shadeop over the grid.
+ *
+ * \see batchShadeop(const CqBitVector&, TqInt, IqShaderData*, IqShaderData*, const KernelT&)
+ */
+template<typename R, typename A, typename B, typename KernelT>
+void batchShadeop(const CqBitVector& RS, TqInt npoints, IqShaderData* a,
+		IqShaderData* b, IqShaderData* result, const KernelT& kernel)
+{
+	bool varying = a->Class() == class_varying || b->Class() == class_varying
+		|| result->Class() == class_varying;
+	if(detail::batchable<A>(a) && detail::batchable<B>(b)
+		&& detail::batchable<R>(result)
+		&& (!varying || result->Class() == class_varying))
+	{
+		CqBatchArg<A> pa(a);
+		CqBatchArg<B> pb(b);
+		R* pr = 0;
+		SqBatchAccess<R>::ptr(result, pr);
+		if(!varying)
+			pr[0] = kernel(pa[0], pb[0]);
+		else if(detail::allRunning(RS, npoints))
+		{
+			if(pa.isVarying() && pb.isVarying())
+			{
+				const A* da = pa.data();
+				const B* db = pb.data();
+				for(TqInt i = 0; i < npoints; ++i)
+					pr[i] = kernel(da[i], db[i]);
+			}
+			else
+			{
+				for(TqInt i = 0; i < npoints; ++i)
+					pr[i] = kernel(pa[i], pb[i]);
+			}
+		}
+		else
+		{
+			for(TqInt i = 0; i < npoints; ++i)
+			{
+				if(RS.Value(i))
+					pr[i] = kernel(pa[i], pb[i]);
+			}
+		}
+		return;
+	}
+	TqInt i = 0;
+	do
+	{
+		if(!varying || RS.Value(i))
+		{
+			A va;
+			SqBatchAccess<A>::get(a, va, i);
+			B vb;
+			SqBatchAccess<B>::get(b, vb, i);
+			SqBatchAccess<R>::set(result, kernel(va, vb), i);
+		}
+	}
+	while(++i < npoints && varying);
+}
+
+/** \brief Evaluate a three argument elementwise shadeop over the grid.
+ *
+ * \see batchShadeop(const CqBitVector&, TqInt, IqShaderData*, IqShaderData*, const KernelT&)
+ */
+template<typename R, typename A, typename B, typename C, typename KernelT>
+void batchShadeop(const CqBitVector& RS, TqInt npoints, IqShaderData* a,
+		IqShaderData* b, IqShaderData* c, IqShaderData* result,
+		const KernelT& kernel)
+{
+	bool varying = a->Class() == class_varying || b->Class() == class_varying
+		|| c->Class() == class_varying || result->Class() == class_varying;
+	if(detail::batchable<A>(a) && detail::batchable<B>(b)
+		&& detail::batchable<C>(c) && detail::batchable<R>(result)
+		&& (!varying || result->Class() == class_varying))
+	{
+		CqBatchArg<A> pa(a);
+		CqBatchArg<B> pb(b);
+		CqBatchArg<C> pc(c);
+		R* pr = 0;
+		SqBatchAccess<R>::ptr(result, pr);
+		if(!varying)
+			pr[0] = kernel(pa[0], pb[0], pc[0]);
+		else if(detail::allRunning(RS, npoints))
+		{
+			if(pa.isVarying() && pb.isVarying() && pc.isVarying())
+			{
+				const A* da = pa.data();
+				const B* db = pb.data();
+				const C* dc = pc.data();
+				for(TqInt i = 0; i < npoints; ++i)
+					pr[i] = kernel(da[i], db[i], dc[i]);
+			}
+			else
+			{
+				for(TqInt i = 0; i < npoints; ++i)
+					pr[i] = kernel(pa[i], pb[i], pc[i]);
+			}
+		}
+		else
+		{
+			for(TqInt i = 0; i < npoints; ++i)
+			{
+				if(RS.Value(i))
+					pr[i] = kernel(pa[i], pb[i], pc[i]);
+			}
+		}
+		return;
+	}
+	TqInt i = 0;
+	do
+	{
+		if(!varying || RS.Value(i))
+		{
+			A va;
+			SqBatchAccess<A>::get(a, va, i);
+			B vb;
+			SqBatchAccess<B>::get(b, vb, i);
+			C vc;
+			SqBatchAccess<C>::get(c, vc, i);
+			SqBatchAccess<R>::set(result, kernel(va, vb, vc), i);
+		}
+	}
+	while(++i < npoints && varying);
+}
+
+} // namespace Aqsis
+
+#endif	// SHADEOPS_BATCH_H_INCLUDED
@@ -27,6 +27,7 @@
 #include	<stdio.h>
 
 #include	"shaderexecenv.h"
+#include	"shadeops_batch.h"
 #include	<aqsis/math/spline.h>
 
 namespace Aqsis {
@@ -56,32 +57,67 @@ void	GetFilterParams( int cParams, IqShaderData** apParams, float& _pswidth, flo
 	}
 }
 
-} // unnamed namespace
+struct SqStepKernel
+{
+	TqFloat operator()(TqFloat min, TqFloat value) const
+	{
+		return ( value < min ) ? 0.0f : 1.0f;
+	}
+};
 
+struct SqSmoothstepKernel
+{
+	TqFloat operator()(TqFloat min, TqFloat max, TqFloat value) const
+	{
+		if ( value < min )
+			return 0.0f;
+		else if ( value >= max )
+			return 1.0f;
+		TqFloat v = ( value - min ) / ( max - min );
+		return v * v * ( 3.0f - 2.0f * v );
+	}
+};
 
-void	CqShaderExecEnv::SO_step( IqShaderData* _min, IqShaderData* value, IqShaderData* Result, IqShader* pShader )
+struct SqNormalizeKernel
 {
-	bool __fVarying;
-	TqUint __iGrid;
+	CqVector3D operator()(const CqVector3D& v) const
+	{
+		CqVector3D unit = v;
+		unit.Unit();
+		return unit;
+	}
+};
 
-	__fVarying=(_min)->Class()==class_varying;
-	__fVarying=(value)->Class()==class_varying||__fVarying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
+/// faceforward(N,I), with Ng passed as the reference normal.
+struct SqFaceforwardKernel
+{
+	CqVector3D operator()(const CqVector3D& N, const CqVector3D& I,
+			const CqVector3D& Nref) const
+	{
+		TqFloat s = ( ( ( -I ) * Nref ) < 0.0f ) ? -1.0f : 1.0f;
+		TqFloat s2 = ( ( N * Nref ) < 0.0f ) ? -1.0f : 1.0f;
+		return s * s2 * N;
+	}
+};
 
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
+/// faceforward(N,I,Nref)
+struct SqFaceforward2Kernel
+{
+	CqVector3D operator()(const CqVector3D& N, const CqVector3D& I,
+			const CqVector3D& Nref) const
 	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat _aq__min;
-			(_min)->GetFloat(_aq__min,__iGrid);
-			TqFloat _aq_value;
-			(value)->GetFloat(_aq_value,__iGrid);
-			(Result)->SetFloat(( _aq_value < _aq__min ) ? 0.0f : 1.0f,__iGrid);
-		}
+		TqFloat s = ( ( ( -I ) * Nref ) < 0.0f ) ? -1.0f : 1.0f;
+		return N * s;
 	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+};
+
+} // unnamed namespace
+
+
+void	CqShaderExecEnv::SO_step( IqShaderData* _min, IqShaderData* value, IqShaderData* Result, IqShader* pShader )
+{
+	batchShadeop<TqFloat, TqFloat, TqFloat>(RunningState(),
+			shadingPointCount(), _min, value, Result, SqStepKernel());
 }
 
 
@@ -89,38 +125,8 @@ void	CqShaderExecEnv::SO_step( IqShaderData* _min, IqShaderData* value, IqShader
 // smoothstep(_min,_max,value)
 void	CqShaderExecEnv::SO_smoothstep( IqShaderData* _min, IqShaderData* _max, IqShaderData* value, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(value)->Class()==class_varying;
-	__fVarying=(_min)->Class()==class_varying||__fVarying;
-	__fVarying=(_max)->Class()==class_varying||__fVarying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat _aq__min;
-			(_min)->GetFloat(_aq__min,__iGrid);
-			TqFloat _aq__max;
-			(_max)->GetFloat(_aq__max,__iGrid);
-			TqFloat _aq_value;
-			(value)->GetFloat(_aq_value,__iGrid);
-			if ( _aq_value < _aq__min )
-				(Result)->SetFloat(0.0f,__iGrid);
-			else if ( _aq_value >= _aq__max )
-				(Result)->SetFloat(1.0f,__iGrid);
-			else
-			{
-				TqFloat v = ( _aq_value - _aq__min ) / ( _aq__max - _aq__min );
-				(Result)->SetFloat(v * v * ( 3.0f - 2.0f * v ),__iGrid);
-			}
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, TqFloat, TqFloat, TqFloat>(RunningState(),
+			shadingPointCount(), _min, _max, value, Result, SqSmoothstepKernel());
 }
 
 
@@ -686,35 +692,8 @@ void CqShaderExecEnv::SO_area( IqShaderData* p, IqShaderData* Result, IqShader*
 
 void	CqShaderExecEnv::SO_normalize( IqShaderData* V, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(V)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	CqVector3D _old(1,0,0);
-	CqVector3D _unit(1,0,0);
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqVector3D _aq_V;
-			(V)->GetVector(_aq_V,__iGrid);
-			// Trade a small comparaison instead of
-			// blindly call Unit(). Big improvement
-			// for polygon or relative flat patch/microgrid.
-			if (_old != _aq_V)
-			{
-				_unit = _aq_V;
-				_unit.Unit();
-				_old = _aq_V;
-			}
-			(Result)->SetVector(_unit,__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<CqVector3D, CqVector3D>(RunningState(), shadingPointCount(),
+			V, Result, SqNormalizeKernel());
 }
 
 
@@ -722,31 +701,21 @@ void	CqShaderExecEnv::SO_normalize( IqShaderData* V, IqShaderData* Result, IqSha
 // faceforward(N,I)
 void CqShaderExecEnv::SO_faceforward( IqShaderData* N, IqShaderData* I, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(N)->Class()==class_varying;
-	__fVarying=(I)->Class()==class_varying||__fVarying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
+	if ( Result->Class() == class_varying )
 	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqVector3D _aq_N;
-			(N)->GetNormal(_aq_N,__iGrid);
-			CqVector3D _aq_I;
-			(I)->GetVector(_aq_I,__iGrid);
-			CqVector3D Nref;
-			Ng() ->GetNormal( Nref, __iGrid );
-			TqFloat s = ( ( ( -_aq_I ) * Nref ) < 0.0f ) ? -1.0f : 1.0f;
-			TqFloat s2 = ( ( _aq_N * Nref ) < 0.0f ) ? -1.0f : 1.0f;
-			(Result)->SetNormal(s * s2 * _aq_N,__iGrid);
-		}
+		batchShadeop<CqVector3D, CqVector3D, CqVector3D, CqVector3D>(
+				RunningState(), shadingPointCount(), N, I, Ng(), Result,
+				SqFaceforwardKernel());
+		return;
 	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	// A uniform result only uses Ng at the first shading point.
+	CqVector3D _aq_N;
+	(N)->GetNormal(_aq_N,0);
+	CqVector3D _aq_I;
+	(I)->GetVector(_aq_I,0);
+	CqVector3D Nref;
+	Ng() ->GetNormal( Nref, 0 );
+	(Result)->SetNormal(SqFaceforwardKernel()(_aq_N, _aq_I, Nref),0);
 }
 
 
@@ -754,31 +723,9 @@ void CqShaderExecEnv::SO_faceforward( IqShaderData* N, IqShaderData* I, IqShader
 // faceforward(N,I,Nref)
 void CqShaderExecEnv::SO_faceforward2( IqShaderData* N, IqShaderData* I, IqShaderData* Nref, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(N)->Class()==class_varying;
-	__fVarying=(I)->Class()==class_varying||__fVarying;
-	__fVarying=(Nref)->Class()==class_varying||__fVarying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqVector3D _aq_N;
-			(N)->GetNormal(_aq_N,__iGrid);
-			CqVector3D _aq_I;
-			(I)->GetVector(_aq_I,__iGrid);
-			CqVector3D _aq_Nref;
-			(Nref)->GetNormal(_aq_Nref,__iGrid);
-			TqFloat s = ( ( ( -_aq_I ) * _aq_Nref ) < 0.0f ) ? -1.0f : 1.0f;
-			(Result)->SetNormal(_aq_N * s,__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<CqVector3D, CqVector3D, CqVector3D, CqVector3D>(
+			RunningState(), shadingPointCount(), N, I, Nref, Result,
+			SqFaceforward2Kernel());
 }
 
 
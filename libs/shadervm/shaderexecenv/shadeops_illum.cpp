@@ -24,17 +24,143 @@
 */
 
 
+#include	<cfloat>
+#include	<cstring>
 #include	<string>
 #include	<stdio.h>
 
 #include	<aqsis/math/math.h>
+#include	<aqsis/math/random.h>
 #include	"shaderexecenv.h"
+#include	"shadeops_batch.h"
 #include	<aqsis/core/ilightsource.h>
+#include	<aqsis/core/iraytrace.h>
+
+#ifdef	ENABLE_THREADING
+#	include	<boost/thread/mutex.hpp>
+#endif
 
 #include	"../../pointrender/microbuffer.h"
 
 namespace Aqsis {
 
+namespace {
+
+/// Default distance by which rays are offset from their origin.
+const TqFloat defaultTraceBias = 0.01f;
+
+struct SqReflectKernel
+{
+	CqVector3D operator()(const CqVector3D& I, const CqVector3D& N) const
+	{
+		TqFloat idn = 2.0f * ( I * N );
+		return I - ( idn * N );
+	}
+};
+
+struct SqRefractKernel
+{
+	CqVector3D operator()(const CqVector3D& I, const CqVector3D& N,
+			TqFloat eta) const
+	{
+		TqFloat IdotN = I * N;
+		TqFloat k = 1 - eta * eta * ( 1 - IdotN * IdotN );
+		return ( k < 0.0f ) ? CqVector3D( 0, 0, 0 ) : CqVector3D( eta * I - ( eta * IdotN + sqrt( k ) ) * N );
+	}
+};
+
+/** Get the raytracer for the current render, or null if there's no geometry
+ * to trace against.
+ */
+const IqRaytrace* activeRaytracer(const IqRenderer* renderer)
+{
+	if(!renderer)
+		return 0;
+	const IqRaytrace* raytracer = renderer->pRaytracer();
+	if(!raytracer || raytracer->IsEmpty())
+		return 0;
+	return raytracer;
+}
+
+/// Get the ray origin offset from Attribute "trace" "bias".
+TqFloat traceBias(const IqConstAttributesPtr& attributes)
+{
+	if(attributes)
+	{
+		const TqFloat* bias = attributes->GetFloatAttribute("trace", "bias");
+		if(bias)
+			return bias[0];
+	}
+	return defaultTraceBias;
+}
+
+/** Choose a direction uniformly distributed over a cone.
+ *
+ * \param axis - unit length cone axis
+ * \param cosConeAngle - cosine of the cone half angle
+ * \param r1,r2 - uniform random numbers in [0,1]
+ */
+CqVector3D coneSampleDirection(const CqVector3D& axis, TqFloat cosConeAngle,
+		TqFloat r1, TqFloat r2)
+{
+	TqFloat cosTheta = 1 - r1*(1 - cosConeAngle);
+	TqFloat sinTheta = std::sqrt(std::max(0.0f, 1 - cosTheta*cosTheta));
+	TqFloat phi = 2*M_PI*r2;
+	CqVector3D u = (std::fabs(axis.x()) > 0.5f ? CqVector3D(0,1,0)
+			: CqVector3D(1,0,0)) % axis;
+	u.Unit();
+	CqVector3D v = axis % u;
+	return (sinTheta*std::cos(phi))*u + (sinTheta*std::sin(phi))*v
+		+ cosTheta*axis;
+}
+
+/// Radical inverse of i in the given base, for low-discrepancy sample points.
+TqFloat radicalInverse(TqUint i, TqUint base)
+{
+	TqFloat invBase = 1.0f/base;
+	TqFloat scale = invBase;
+	TqFloat value = 0;
+	for(; i != 0; i /= base)
+	{
+		value += (i % base)*scale;
+		scale *= invBase;
+	}
+	return value;
+}
+
+/** Hash a shading position into a random seed.
+ *
+ * Seeding from the position rather than the grid index decorrelates the
+ * sample patterns of neighbouring points, and across grids, while keeping
+ * the result independent of the order in which grids are shaded.
+ */
+TqUint positionSeed(const CqVector3D& P)
+{
+	TqUint seed = 2166136261u;
+	for(TqInt i = 0; i < 3; ++i)
+	{
+		TqFloat f = P[i];
+		TqUint bits = 0;
+		std::memcpy(&bits, &f, sizeof(f));
+		seed = (seed ^ bits)*16777619u;
+	}
+	seed ^= seed >> 16;
+	seed *= 0x85ebca6bu;
+	seed ^= seed >> 13;
+	seed *= 0xc2b2ae35u;
+	seed ^= seed >> 16;
+	return seed;
+}
+
+/// Shift a sample in [0,1) by an offset in [0,1), wrapping around.
+TqFloat rotateSample(TqFloat x, TqFloat offset)
+{
+	TqFloat res = x + offset;
+	return res - (res >= 1);
+}
+
+} // unnamed namespace
+
 //----------------------------------------------------------------------
 // init_illuminance()
 // NOTE: There is duplication here between SO_init_illuminance and 
@@ -165,29 +291,8 @@ void CqShaderExecEnv::ValidateIlluminanceCache( IqShaderData* pP, IqShaderData*
 // reflect(I,N)
 void CqShaderExecEnv::SO_reflect( IqShaderData* I, IqShaderData* N, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(I)->Class()==class_varying;
-	__fVarying=(N)->Class()==class_varying||__fVarying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqVector3D _aq_I;
-			(I)->GetVector(_aq_I,__iGrid);
-			CqVector3D _aq_N;
-			(N)->GetNormal(_aq_N,__iGrid);
-			TqFloat idn = 2.0f * ( _aq_I * _aq_N );
-			CqVector3D res = _aq_I - ( idn * _aq_N );
-			(Result)->SetVector(res,__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<CqVector3D, CqVector3D, CqVector3D>(RunningState(),
+			shadingPointCount(), I, N, Result, SqReflectKernel());
 }
 
 
@@ -195,33 +300,8 @@ void CqShaderExecEnv::SO_reflect( IqShaderData* I, IqShaderData* N, IqShaderData
 // reftact(I,N,eta)
 void CqShaderExecEnv::SO_refract( IqShaderData* I, IqShaderData* N, IqShaderData* eta, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(I)->Class()==class_varying;
-	__fVarying=(N)->Class()==class_varying||__fVarying;
-	__fVarying=(eta)->Class()==class_varying||__fVarying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqVector3D _aq_I;
-			(I)->GetVector(_aq_I,__iGrid);
-			CqVector3D _aq_N;
-			(N)->GetNormal(_aq_N,__iGrid);
-			TqFloat _aq_eta;
-			(eta)->GetFloat(_aq_eta,__iGrid);
-			TqFloat IdotN = _aq_I * _aq_N;
-			TqFloat feta = _aq_eta;
-			TqFloat k = 1 - feta * feta * ( 1 - IdotN * IdotN );
-			(Result)->SetVector(( k < 0.0f ) ? CqVector3D( 0, 0, 0 ) : CqVector3D( feta * _aq_I - ( feta * IdotN + sqrt( k ) ) * _aq_N ),__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<CqVector3D, CqVector3D, CqVector3D, TqFloat>(RunningState(),
+			shadingPointCount(), I, N, eta, Result, SqRefractKernel());
 }
 
 
@@ -720,13 +800,30 @@ void CqShaderExecEnv::SO_trace( IqShaderData* P, IqShaderData* R, IqShaderData*
 	__fVarying=(R)->Class()==class_varying||__fVarying;
 	__fVarying=(Result)->Class()==class_varying||__fVarying;
 
+	const IqRaytrace* raytracer = activeRaytracer(getRenderContext());
+	TqFloat bias = traceBias(m_pAttributes);
+
 	__iGrid = 0;
 	const CqBitVector& RS = RunningState();
 	do
 	{
 		if(!__fVarying || RS.Value( __iGrid ) )
 		{
-			(Result)->SetColor(CqColor( 0, 0, 0 ),__iGrid);
+			// Hit points aren't shaded, so the colour seen along the ray is
+			// the surface colour of the nearest primitive.
+			CqColor col(0, 0, 0);
+			if(raytracer)
+			{
+				CqVector3D _aq_P;
+				CqVector3D _aq_R;
+				(P)->GetPoint(_aq_P,__iGrid);
+				(R)->GetVector(_aq_R,__iGrid);
+				_aq_R.Unit();
+				SqRayHit hit;
+				if(raytracer->Intersect(_aq_P, _aq_R, bias, FLT_MAX, &hit))
+					col = hit.Cs;
+			}
+			(Result)->SetColor(col,__iGrid);
 		}
 	}
 	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
@@ -968,15 +1065,70 @@ void CqShaderExecEnv::SO_gather( IqShaderData* category, IqShaderData* P, IqShad
 
 	__iGrid = 0;
 	__fVarying = true;
+
+	const IqRaytrace* raytracer = activeRaytracer(getRenderContext());
+	TqFloat bias = traceBias(m_pAttributes);
+
+	// Output variables which receive information about each hit.
+	IqShaderData* rayLength = 0;
+	IqShaderData* rayDirection = 0;
+	IqShaderData* surfaceCs = 0;
+	IqShaderData* surfaceOs = 0;
+	CqString paramName;
+	for(int i = 0; i < cParams; i+=2)
+	{
+		apParams[i]->GetString(paramName, 0);
+		IqShaderData* paramValue = apParams[i+1];
+		if(paramName == "ray:length" && paramValue->Type() == type_float)
+			rayLength = paramValue;
+		else if(paramName == "ray:direction" && paramValue->Type() == type_vector)
+			rayDirection = paramValue;
+		else if(paramName == "surface:Cs" && paramValue->Type() == type_color)
+			surfaceCs = paramValue;
+		else if(paramName == "surface:Os" && paramValue->Type() == type_color)
+			surfaceOs = paramValue;
+	}
+
+	// Each pass through the gather loop takes the next point of a Halton
+	// sequence, shared by the whole grid.  Each shading point rotates the
+	// sequence by its own random offset, seeded from its position, so
+	// neighbouring points don't trace correlated rays.
+	TqFloat sampleX = radicalInverse(m_gatherSample, 2);
+	TqFloat sampleY = radicalInverse(m_gatherSample, 3);
+
 	const CqBitVector& RS = RunningState();
 	do
 	{
-		if(!__fVarying || RS.Value( __iGrid ) )
+		bool didHit = false;
+		if(raytracer && RS.Value( __iGrid ) )
 		{
-			m_CurrentState.SetValue( __iGrid, false );
+			CqVector3D _aq_P;
+			CqVector3D _aq_N;
+			TqFloat _aq_angle;
+			(P)->GetPoint(_aq_P,__iGrid);
+			(N)->GetVector(_aq_N,__iGrid);
+			(angle)->GetFloat(_aq_angle,__iGrid);
+			_aq_N.Unit();
+			CqRandom random(positionSeed(_aq_P));
+			TqFloat r1 = rotateSample(sampleX, random.RandomFloat());
+			TqFloat r2 = rotateSample(sampleY, random.RandomFloat());
+			CqVector3D dir = coneSampleDirection(_aq_N,
+					std::cos(clamp<TqFloat>(_aq_angle, 0, M_PI)), r1, r2);
+			SqRayHit hit;
+			didHit = raytracer->Intersect(_aq_P, dir, bias, FLT_MAX, &hit);
+			if(didHit)
+			{
+				if(rayLength)
+					rayLength->SetFloat(hit.distance, __iGrid);
+				if(rayDirection)
+					rayDirection->SetVector(dir, __iGrid);
+				if(surfaceCs)
+					surfaceCs->SetColor(hit.Cs, __iGrid);
+				if(surfaceOs)
+					surfaceOs->SetColor(hit.Os, __iGrid);
+			}
 		}
-		else
-			m_CurrentState.SetValue( __iGrid, false );
+		m_CurrentState.SetValue( __iGrid, didHit );
 	}
 	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
 }
@@ -1087,6 +1239,11 @@ void CqShaderExecEnv::SO_calculatenormal( IqShaderData* p, IqShaderData* Result,
 // Missing cache features:
 // * Ri search paths
 static PointOctreeCache g_pointOctreeCache;
+#ifdef	ENABLE_THREADING
+/// Protects g_pointOctreeCache, since grids may be shaded concurrently.
+/// The point clouds themselves are only read once loaded.
+static boost::mutex g_pointOctreeMutex;
+#endif
 
 void clearPointCloudCache()
 {
@@ -1144,6 +1301,9 @@ void CqShaderExecEnv::pointCloudIntegrate(IqShaderData* P, IqShaderData* N,
 			{
 				CqString fileName;
 				paramValue->GetString(fileName, 0);
+#				ifdef ENABLE_THREADING
+				boost::mutex::scoped_lock lock(g_pointOctreeMutex);
+#				endif
 				pointTree = g_pointOctreeCache.find(fileName);
 			}
 		}
@@ -1309,8 +1469,86 @@ static void storeIntegratedResult(const OcclusionIntegrator& integrator,
 // occlusion(P,N,samples)
 void CqShaderExecEnv::SO_occlusion_rt( IqShaderData* P, IqShaderData* N, IqShaderData* samples, IqShaderData* Result, IqShader* pShader, int cParams, IqShaderData** apParams )
 {
-	pointCloudIntegrate<OcclusionIntegrator>(P, N, Result, cParams, apParams,
-											 pShader);
+	// Use the point cloud if one was given, otherwise trace rays if there's
+	// any traceable geometry.
+	const IqRaytrace* raytracer = activeRaytracer(getRenderContext());
+	float coneAngle = M_PI_2;
+	float bias = traceBias(m_pAttributes);
+	float maxDist = FLT_MAX;
+	CqString paramName;
+	for(int i = 0; i < cParams; i+=2)
+	{
+		apParams[i]->GetString(paramName, 0);
+		IqShaderData* paramValue = apParams[i+1];
+		if(paramName == "filename")
+			raytracer = 0;
+		else if(paramName == "coneangle" && paramValue->Type() == type_float)
+			paramValue->GetFloat(coneAngle);
+		else if(paramName == "bias" && paramValue->Type() == type_float)
+			paramValue->GetFloat(bias);
+		else if(paramName == "maxdist" && paramValue->Type() == type_float)
+			paramValue->GetFloat(maxDist);
+	}
+	if(!raytracer)
+	{
+		pointCloudIntegrate<OcclusionIntegrator>(P, N, Result, cParams,
+												 apParams, pShader);
+		return;
+	}
+
+	bool __fVarying = (Result)->Class()==class_varying;
+	TqUint __iGrid = 0;
+	TqFloat cosConeAngle = std::cos(clamp<TqFloat>(coneAngle, 0, M_PI));
+	// Hammersley points over the unit square, stratified in both directions.
+	// The table is built once for the grid and only rebuilt if the number of
+	// samples varies between points.  Each point rotates the pattern by its
+	// own random offset, seeded from its position, to decorrelate neighbours.
+	std::vector<TqFloat> sampleX;
+	std::vector<TqFloat> sampleY;
+	const CqBitVector& RS = RunningState();
+	do
+	{
+		if(!__fVarying || RS.Value( __iGrid ) )
+		{
+			CqVector3D _aq_P;
+			CqVector3D _aq_N;
+			TqFloat _aq_samples;
+			(P)->GetPoint(_aq_P,__iGrid);
+			(N)->GetNormal(_aq_N,__iGrid);
+			(samples)->GetFloat(_aq_samples,__iGrid);
+			_aq_N.Unit();
+			TqInt numSamples = std::max(1, static_cast<TqInt>(_aq_samples));
+			if(static_cast<TqInt>(sampleX.size()) != numSamples)
+			{
+				sampleX.resize(numSamples);
+				sampleY.resize(numSamples);
+				for(TqInt i = 0; i < numSamples; ++i)
+				{
+					sampleX[i] = (i + 0.5f)/numSamples;
+					sampleY[i] = radicalInverse(i, 2);
+				}
+			}
+			CqRandom random(positionSeed(_aq_P));
+			TqFloat offsetX = random.RandomFloat();
+			TqFloat offsetY = random.RandomFloat();
+			// Weight the rays by the cosine to the normal, as the point
+			// cloud integrator does.
+			TqFloat totWeight = 0;
+			TqFloat occWeight = 0;
+			for(TqInt i = 0; i < numSamples; ++i)
+			{
+				TqFloat r1 = rotateSample(sampleX[i], offsetX);
+				TqFloat r2 = rotateSample(sampleY[i], offsetY);
+				CqVector3D dir = coneSampleDirection(_aq_N, cosConeAngle, r1, r2);
+				TqFloat weight = std::max(0.0f, dir*_aq_N);
+				totWeight += weight;
+				if(raytracer->Intersect(_aq_P, dir, bias, maxDist, 0))
+					occWeight += weight;
+			}
+			(Result)->SetFloat(totWeight > 0 ? occWeight/totWeight : 0, __iGrid);
+		}
+	}
+	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
 }
 
 
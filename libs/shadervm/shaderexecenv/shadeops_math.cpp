@@ -28,6 +28,7 @@
 
 #include <aqsis/math/math.h>
 #include "shaderexecenv.h"
+#include "shadeops_batch.h"
 #include <aqsis/util/logging.h>
 
 namespace Aqsis {
@@ -92,72 +93,124 @@ inline void domainError(const char* funcName, IqShaderData* var1, IqShaderData*
 	out << ") is undefined, result has been set to zero\n";
 }
 
-} // unnamed namespace
+//----------------------------------------------------------------------
+// Kernels for the elementwise shadeops, evaluated with batchShadeop().
 
-void	CqShaderExecEnv::SO_radians( IqShaderData* degrees, IqShaderData* Result, IqShader* pShader )
+struct SqRadiansKernel
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(degrees)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
+	TqFloat operator()(TqFloat a) const { return degToRad(a); }
+};
+struct SqDegreesKernel
+{
+	TqFloat operator()(TqFloat a) const { return radToDeg(a); }
+};
+struct SqSinKernel
+{
+	TqFloat operator()(TqFloat a) const { return std::sin(a); }
+};
+struct SqCosKernel
+{
+	TqFloat operator()(TqFloat a) const { return std::cos(a); }
+};
+struct SqTanKernel
+{
+	TqFloat operator()(TqFloat a) const { return std::tan(a); }
+};
+struct SqAtanKernel
+{
+	TqFloat operator()(TqFloat a) const { return std::atan(a); }
+};
+struct SqAtan2Kernel
+{
+	TqFloat operator()(TqFloat y, TqFloat x) const { return std::atan2(y, x); }
+};
+struct SqExpKernel
+{
+	TqFloat operator()(TqFloat a) const { return std::exp(a); }
+};
+struct SqModKernel
+{
+	TqFloat operator()(TqFloat a, TqFloat b) const
 	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat _aq_degrees;
-			(degrees)->GetFloat(_aq_degrees,__iGrid);
-			(Result)->SetFloat(degToRad( _aq_degrees ),__iGrid);
-		}
+		TqInt n = static_cast<TqInt>( a / b );
+		TqFloat a2 = a - n * b;
+		if ( a2 < 0.0f )
+			a2 += b;
+		return a2;
 	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+};
+struct SqAbsKernel
+{
+#ifndef FASTSQRT
+	TqFloat operator()(TqFloat a) const { return std::fabs(a); }
+#else
+	TqFloat operator()(TqFloat a) const { return absf(a); }
+#endif
+};
+struct SqSignKernel
+{
+	TqFloat operator()(TqFloat a) const { return ( a < 0.0f ) ? -1.0f : 1.0f; }
+};
+struct SqFloorKernel
+{
+	TqFloat operator()(TqFloat a) const { return std::floor(a); }
+};
+struct SqCeilKernel
+{
+	TqFloat operator()(TqFloat a) const { return std::ceil(a); }
+};
+struct SqRoundKernel
+{
+	TqFloat operator()(TqFloat a) const { return round(a); }
+};
+template<typename T>
+struct SqClampKernel
+{
+	T operator()(const T& a, const T& min, const T& max) const
+	{
+		return clamp(a, min, max);
+	}
+};
+template<typename T>
+struct SqMinKernel
+{
+	T operator()(const T& a, const T& b) const { return min( a, b ); }
+};
+template<typename T>
+struct SqMaxKernel
+{
+	T operator()(const T& a, const T& b) const { return max( a, b ); }
+};
+struct SqLengthKernel
+{
+	TqFloat operator()(const CqVector3D& v) const { return v.Magnitude(); }
+};
+struct SqDistanceKernel
+{
+	TqFloat operator()(const CqVector3D& p1, const CqVector3D& p2) const
+	{
+		return ( p1 - p2 ).Magnitude();
+	}
+};
+
+} // unnamed namespace
+
+void	CqShaderExecEnv::SO_radians( IqShaderData* degrees, IqShaderData* Result, IqShader* pShader )
+{
+	batchShadeop<TqFloat, TqFloat>(RunningState(), shadingPointCount(),
+			degrees, Result, SqRadiansKernel());
 }
 
 void	CqShaderExecEnv::SO_degrees( IqShaderData* radians, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(radians)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat _aq_radians;
-			(radians)->GetFloat(_aq_radians,__iGrid);
-			(Result)->SetFloat(radToDeg( _aq_radians ),__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, TqFloat>(RunningState(), shadingPointCount(),
+			radians, Result, SqDegreesKernel());
 }
 
 void	CqShaderExecEnv::SO_sin( IqShaderData* a, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(a)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat _aq_a;
-			(a)->GetFloat(_aq_a,__iGrid);
-			(Result)->SetFloat(std::sin(_aq_a), __iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, TqFloat>(RunningState(), shadingPointCount(),
+			a, Result, SqSinKernel());
 }
 
 void	CqShaderExecEnv::SO_asin( IqShaderData* a, IqShaderData* Result, IqShader* pShader )
@@ -189,24 +242,8 @@ void	CqShaderExecEnv::SO_asin( IqShaderData* a, IqShaderData* Result, IqShader*
 
 void	CqShaderExecEnv::SO_cos( IqShaderData* a, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(a)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat _aq_a;
-			(a)->GetFloat(_aq_a,__iGrid);
-			(Result)->SetFloat(std::cos(_aq_a), __iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, TqFloat>(RunningState(), shadingPointCount(),
+			a, Result, SqCosKernel());
 }
 
 void	CqShaderExecEnv::SO_acos( IqShaderData* a, IqShaderData* Result, IqShader* pShader )
@@ -238,71 +275,20 @@ void	CqShaderExecEnv::SO_acos( IqShaderData* a, IqShaderData* Result, IqShader*
 
 void	CqShaderExecEnv::SO_tan( IqShaderData* a, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(a)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat aVal;
-			(a)->GetFloat(aVal,__iGrid);
-			(Result)->SetFloat(std::tan(aVal), __iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, TqFloat>(RunningState(), shadingPointCount(),
+			a, Result, SqTanKernel());
 }
 
 void	CqShaderExecEnv::SO_atan( IqShaderData* yoverx, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(yoverx)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat _aq_yoverx;
-			(yoverx)->GetFloat(_aq_yoverx,__iGrid);
-			(Result)->SetFloat(std::atan(_aq_yoverx), __iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, TqFloat>(RunningState(), shadingPointCount(),
+			yoverx, Result, SqAtanKernel());
 }
 
 void	CqShaderExecEnv::SO_atan( IqShaderData* y, IqShaderData* x, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(x)->Class()==class_varying;
-	__fVarying=(y)->Class()==class_varying||__fVarying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat _aq_x;
-			(x)->GetFloat(_aq_x,__iGrid);
-			TqFloat _aq_y;
-			(y)->GetFloat(_aq_y,__iGrid);
-			(Result)->SetFloat(std::atan2(_aq_y, _aq_x), __iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, TqFloat, TqFloat>(RunningState(),
+			shadingPointCount(), y, x, Result, SqAtan2Kernel());
 }
 
 void	CqShaderExecEnv::SO_pow( IqShaderData* x, IqShaderData* y, IqShaderData* Result, IqShader* pShader )
@@ -350,24 +336,8 @@ void	CqShaderExecEnv::SO_pow( IqShaderData* x, IqShaderData* y, IqShaderData* Re
 
 void	CqShaderExecEnv::SO_exp( IqShaderData* x, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(x)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat _aq_x;
-			(x)->GetFloat(_aq_x,__iGrid);
-			(Result)->SetFloat(std::exp(_aq_x), __iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, TqFloat>(RunningState(), shadingPointCount(),
+			x, Result, SqExpKernel());
 }
 
 void	CqShaderExecEnv::SO_sqrt( IqShaderData* x, IqShaderData* Result, IqShader* pShader )
@@ -434,31 +404,8 @@ void	CqShaderExecEnv::SO_log( IqShaderData* x, IqShaderData* Result, IqShader* p
 
 void	CqShaderExecEnv::SO_mod( IqShaderData* a, IqShaderData* b, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(a)->Class()==class_varying;
-	__fVarying=(b)->Class()==class_varying||__fVarying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat _aq_a;
-			(a)->GetFloat(_aq_a,__iGrid);
-			TqFloat _aq_b;
-			(b)->GetFloat(_aq_b,__iGrid);
-			TqInt n = static_cast<TqInt>( _aq_a / _aq_b );
-			TqFloat a2 = _aq_a - n * _aq_b;
-			if ( a2 < 0.0f )
-				a2 += _aq_b;
-			(Result)->SetFloat(a2,__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, TqFloat, TqFloat>(RunningState(),
+			shadingPointCount(), a, b, Result, SqModKernel());
 }
 
 //----------------------------------------------------------------------
@@ -496,54 +443,25 @@ void	CqShaderExecEnv::SO_log( IqShaderData* x, IqShaderData* base, IqShaderData*
 
 void	CqShaderExecEnv::SO_abs( IqShaderData* x, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(x)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat _aq_x;
-			(x)->GetFloat(_aq_x,__iGrid);
-#ifndef FASTSQRT
-			(Result)->SetFloat(std::fabs(_aq_x), __iGrid);
-#else
-			(Result)->SetFloat(absf( _aq_x ),__iGrid);
-#endif
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, TqFloat>(RunningState(), shadingPointCount(),
+			x, Result, SqAbsKernel());
 }
 
 void	CqShaderExecEnv::SO_sign( IqShaderData* x, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(x)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat _aq_x;
-			(x)->GetFloat(_aq_x,__iGrid);
-			(Result)->SetFloat(( _aq_x < 0.0f ) ? -1.0f : 1.0f,__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, TqFloat>(RunningState(), shadingPointCount(),
+			x, Result, SqSignKernel());
 }
 
 void	CqShaderExecEnv::SO_min( IqShaderData* a, IqShaderData* b, IqShaderData* Result, IqShader* pShader, int cParams, IqShaderData** apParams )
 {
+	if ( cParams == 0 )
+	{
+		batchShadeop<TqFloat, TqFloat, TqFloat>(RunningState(), shadingPointCount(),
+				a, b, Result, SqMinKernel<TqFloat>());
+		return;
+	}
+
 	bool __fVarying;
 	TqUint __iGrid;
 
@@ -576,6 +494,13 @@ void	CqShaderExecEnv::SO_min( IqShaderData* a, IqShaderData* b, IqShaderData* Re
 
 void	CqShaderExecEnv::SO_max( IqShaderData* a, IqShaderData* b, IqShaderData* Result, IqShader* pShader, int cParams, IqShaderData** apParams )
 {
+	if ( cParams == 0 )
+	{
+		batchShadeop<TqFloat, TqFloat, TqFloat>(RunningState(), shadingPointCount(),
+				a, b, Result, SqMaxKernel<TqFloat>());
+		return;
+	}
+
 	bool __fVarying;
 	TqUint __iGrid;
 
@@ -608,6 +533,13 @@ void	CqShaderExecEnv::SO_max( IqShaderData* a, IqShaderData* b, IqShaderData* Re
 
 void	CqShaderExecEnv::SO_pmin( IqShaderData* a, IqShaderData* b, IqShaderData* Result, IqShader* pShader, int cParams, IqShaderData** apParams )
 {
+	if ( cParams == 0 )
+	{
+		batchShadeop<CqVector3D, CqVector3D, CqVector3D>(RunningState(), shadingPointCount(),
+				a, b, Result, SqMinKernel<CqVector3D>());
+		return;
+	}
+
 	bool __fVarying;
 	TqUint __iGrid;
 
@@ -640,6 +572,13 @@ void	CqShaderExecEnv::SO_pmin( IqShaderData* a, IqShaderData* b, IqShaderData* R
 
 void	CqShaderExecEnv::SO_pmax( IqShaderData* a, IqShaderData* b, IqShaderData* Result, IqShader* pShader, int cParams, IqShaderData** apParams )
 {
+	if ( cParams == 0 )
+	{
+		batchShadeop<CqVector3D, CqVector3D, CqVector3D>(RunningState(), shadingPointCount(),
+				a, b, Result, SqMaxKernel<CqVector3D>());
+		return;
+	}
+
 	bool __fVarying;
 	TqUint __iGrid;
 
@@ -672,6 +611,13 @@ void	CqShaderExecEnv::SO_pmax( IqShaderData* a, IqShaderData* b, IqShaderData* R
 
 void	CqShaderExecEnv::SO_cmin( IqShaderData* a, IqShaderData* b, IqShaderData* Result, IqShader* pShader, int cParams, IqShaderData** apParams )
 {
+	if ( cParams == 0 )
+	{
+		batchShadeop<CqColor, CqColor, CqColor>(RunningState(), shadingPointCount(),
+				a, b, Result, SqMinKernel<CqColor>());
+		return;
+	}
+
 	bool __fVarying;
 	TqUint __iGrid;
 
@@ -704,6 +650,13 @@ void	CqShaderExecEnv::SO_cmin( IqShaderData* a, IqShaderData* b, IqShaderData* R
 
 void	CqShaderExecEnv::SO_cmax( IqShaderData* a, IqShaderData* b, IqShaderData* Result, IqShader* pShader, int cParams, IqShaderData** apParams )
 {
+	if ( cParams == 0 )
+	{
+		batchShadeop<CqColor, CqColor, CqColor>(RunningState(), shadingPointCount(),
+				a, b, Result, SqMaxKernel<CqColor>());
+		return;
+	}
+
 	bool __fVarying;
 	TqUint __iGrid;
 
@@ -736,201 +689,51 @@ void	CqShaderExecEnv::SO_cmax( IqShaderData* a, IqShaderData* b, IqShaderData* R
 
 void	CqShaderExecEnv::SO_clamp( IqShaderData* a, IqShaderData* _min, IqShaderData* _max, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(a)->Class()==class_varying;
-	__fVarying=(_min)->Class()==class_varying||__fVarying;
-	__fVarying=(_max)->Class()==class_varying||__fVarying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat _aq_a;
-			(a)->GetFloat(_aq_a,__iGrid);
-			TqFloat _aq__min;
-			(_min)->GetFloat(_aq__min,__iGrid);
-			TqFloat _aq__max;
-			(_max)->GetFloat(_aq__max,__iGrid);
-			(Result)->SetFloat(clamp( _aq_a, _aq__min, _aq__max ),__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, TqFloat, TqFloat, TqFloat>(RunningState(),
+			shadingPointCount(), a, _min, _max, Result, SqClampKernel<TqFloat>());
 }
 
 void	CqShaderExecEnv::SO_pclamp( IqShaderData* a, IqShaderData* _min, IqShaderData* _max, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(a)->Class()==class_varying;
-	__fVarying=(_min)->Class()==class_varying||__fVarying;
-	__fVarying=(_max)->Class()==class_varying||__fVarying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqVector3D _aq_a;
-			(a)->GetPoint(_aq_a,__iGrid);
-			CqVector3D _aq__min;
-			(_min)->GetPoint(_aq__min,__iGrid);
-			CqVector3D _aq__max;
-			(_max)->GetPoint(_aq__max,__iGrid);
-			(Result)->SetPoint(clamp( _aq_a, _aq__min, _aq__max ),__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<CqVector3D, CqVector3D, CqVector3D, CqVector3D>(
+			RunningState(), shadingPointCount(), a, _min, _max, Result,
+			SqClampKernel<CqVector3D>());
 }
 
 void	CqShaderExecEnv::SO_cclamp( IqShaderData* a, IqShaderData* _min, IqShaderData* _max, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(a)->Class()==class_varying;
-	__fVarying=(_min)->Class()==class_varying||__fVarying;
-	__fVarying=(_max)->Class()==class_varying||__fVarying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqColor _aq_a;
-			(a)->GetColor(_aq_a,__iGrid);
-			CqColor _aq__min;
-			(_min)->GetColor(_aq__min,__iGrid);
-			CqColor _aq__max;
-			(_max)->GetColor(_aq__max,__iGrid);
-			(Result)->SetColor(clamp( _aq_a, _aq__min, _aq__max ),__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<CqColor, CqColor, CqColor, CqColor>(RunningState(),
+			shadingPointCount(), a, _min, _max, Result, SqClampKernel<CqColor>());
 }
 
 void	CqShaderExecEnv::SO_floor( IqShaderData* x, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(x)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat _aq_x;
-			(x)->GetFloat(_aq_x,__iGrid);
-			(Result)->SetFloat(std::floor(_aq_x), __iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, TqFloat>(RunningState(), shadingPointCount(),
+			x, Result, SqFloorKernel());
 }
 
 void	CqShaderExecEnv::SO_ceil( IqShaderData* x, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(x)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat _aq_x;
-			(x)->GetFloat(_aq_x,__iGrid);
-			(Result)->SetFloat(std::ceil(_aq_x), __iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, TqFloat>(RunningState(), shadingPointCount(),
+			x, Result, SqCeilKernel());
 }
 
 void	CqShaderExecEnv::SO_round( IqShaderData* x, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-	TqFloat res;
-
-	__fVarying=(x)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat _aq_x;
-			(x)->GetFloat(_aq_x,__iGrid);
-			res = round(_aq_x);
-			(Result)->SetFloat(res,__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, TqFloat>(RunningState(), shadingPointCount(),
+			x, Result, SqRoundKernel());
 }
 
 void	CqShaderExecEnv::SO_length( IqShaderData* V, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(V)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqVector3D _aq_V;
-			(V)->GetVector(_aq_V,__iGrid);
-			(Result)->SetFloat(_aq_V.Magnitude(),__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, CqVector3D>(RunningState(), shadingPointCount(),
+			V, Result, SqLengthKernel());
 }
 
 void	CqShaderExecEnv::SO_distance( IqShaderData* P1, IqShaderData* P2, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(P1)->Class()==class_varying;
-	__fVarying=(P2)->Class()==class_varying||__fVarying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqVector3D _aq_P1;
-			(P1)->GetPoint(_aq_P1,__iGrid);
-			CqVector3D _aq_P2;
-			(P2)->GetPoint(_aq_P2,__iGrid);
-			(Result)->SetFloat(( _aq_P1 - _aq_P2 ).Magnitude(),__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, CqVector3D, CqVector3D>(RunningState(),
+			shadingPointCount(), P1, P2, Result, SqDistanceKernel());
 }
 
 
@@ -27,61 +27,126 @@
 #include	<stdio.h>
 
 #include	"shaderexecenv.h"
+#include	"shadeops_batch.h"
 
 namespace Aqsis {
 
+namespace {
+
+/// Linear interpolation between two values, for batched evaluation of mix().
+template<typename T>
+struct SqMixKernel
+{
+	T operator()(const T& x0, const T& x1, TqFloat value) const
+	{
+		return ( 1.0f - value ) * x0 + value * x1;
+	}
+};
+
+/// Distance from Q to the segment from P0 to P1, for ptlined().
+struct SqPtLineDistKernel
+{
+	TqFloat operator()(const CqVector3D& P0, const CqVector3D& P1,
+			const CqVector3D& Q) const
+	{
+		CqVector3D kDiff = Q - P0;
+		CqVector3D vecDir = P1 - P0;
+		TqFloat fT = kDiff * vecDir;
+
+		if ( fT <= 0.0f )
+			fT = 0.0f;
+		else
+		{
+			TqFloat fSqrLen = vecDir.Magnitude2();
+			if ( fT >= fSqrLen )
+			{
+				fT = 1.0f;
+				kDiff -= vecDir;
+			}
+			else
+			{
+				fT /= fSqrLen;
+				kDiff -= fT * vecDir;
+			}
+		}
+		return kDiff.Magnitude();
+	}
+};
+
+/// Copy a value unchanged, for transforms without a renderer to supply spaces.
+template<typename T>
+struct SqCopyKernel
+{
+	T operator()(const T& x) const
+	{
+		return x;
+	}
+};
+
+/// Transform by a matrix fixed for the whole grid, for transform() and friends.
+struct SqTransformKernel
+{
+	SqTransformKernel(const CqMatrix& mat)
+		: mat(mat)
+	{}
+	CqVector3D operator()(const CqVector3D& p) const
+	{
+		return mat * p;
+	}
+	CqMatrix mat;
+};
+
+/// Transform by a matrix argument, for the matrix forms of transform().
+struct SqMatrixMultKernel
+{
+	CqVector3D operator()(const CqMatrix& m, const CqVector3D& p) const
+	{
+		return m * p;
+	}
+};
+
+/** Convert colours between two named spaces via rgb, for ctransform().  A
+ * null conversion leaves the colour as it is.
+ */
+struct SqColorSpaceKernel
+{
+	typedef CqColor (*TqConversion)(const CqColor&);
+	SqColorSpaceKernel()
+		: fromSpace(0),
+		toSpace(0)
+	{}
+	CqColor operator()(const CqColor& c) const
+	{
+		CqColor col = fromSpace ? fromSpace(c) : c;
+		return toSpace ? toSpace(col) : col;
+	}
+	TqConversion fromSpace;
+	TqConversion toSpace;
+};
+
+} // unnamed namespace
+
 
 //----------------------------------------------------------------------
 // transform(s,s,P)
 void CqShaderExecEnv::SO_transform( IqShaderData* fromspace, IqShaderData* tospace, IqShaderData* p, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
 	assert( pShader != 0 );
 
-	__fVarying=(p)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
 	if ( getRenderContext() )
 	{
-		__iGrid = 0;
 		CqString _aq_fromspace;
-		(fromspace)->GetString(_aq_fromspace,__iGrid);
+		(fromspace)->GetString(_aq_fromspace,0);
 		CqString _aq_tospace;
-		(tospace)->GetString(_aq_tospace,__iGrid);
-		CqMatrix mat; 
+		(tospace)->GetString(_aq_tospace,0);
+		CqMatrix mat;
 		getRenderContext() ->matSpaceToSpace( _aq_fromspace.c_str(), _aq_tospace.c_str(), pShader->getTransform(), pTransform().get(), getRenderContext()->Time(), mat );
-
-
-		__iGrid = 0;
-		const CqBitVector& RS = RunningState();
-		do
-		{
-			if(!__fVarying || RS.Value( __iGrid ) )
-			{
-				CqVector3D _aq_p;
-				(p)->GetPoint(_aq_p,__iGrid);
-				(Result)->SetPoint(mat * _aq_p,__iGrid);
-			}
-		}
-		while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+		batchShadeop<CqVector3D, CqVector3D>(RunningState(), shadingPointCount(),
+				p, Result, SqTransformKernel(mat));
 	}
 	else
-	{
-		__iGrid = 0;
-		const CqBitVector& RS = RunningState();
-		do
-		{
-			if(!__fVarying || RS.Value( __iGrid ) )
-			{
-				CqVector3D _aq_p;
-				(p)->GetPoint(_aq_p,__iGrid);
-				(Result)->SetPoint(_aq_p,__iGrid);
-			}
-		}
-		while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
-	}
+		batchShadeop<CqVector3D, CqVector3D>(RunningState(), shadingPointCount(),
+				p, Result, SqCopyKernel<CqVector3D>());
 }
 
 
@@ -89,51 +154,20 @@ void CqShaderExecEnv::SO_transform( IqShaderData* fromspace, IqShaderData* tospa
 // transform(s,P)
 void CqShaderExecEnv::SO_transform( IqShaderData* tospace, IqShaderData* p, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
 	assert( pShader != 0 );
 
-	__fVarying=(p)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
 	if ( getRenderContext() )
 	{
-		__iGrid = 0;
 		CqString _aq_tospace;
-		(tospace)->GetString(_aq_tospace,__iGrid);
+		(tospace)->GetString(_aq_tospace,0);
 		CqMatrix mat;
 		getRenderContext() ->matSpaceToSpace( "current", _aq_tospace.c_str(), pShader->getTransform(), pTransform().get(), getRenderContext()->Time(), mat );
-
-
-		__iGrid = 0;
-		const CqBitVector& RS = RunningState();
-		do
-		{
-			if(!__fVarying || RS.Value( __iGrid ) )
-			{
-				CqVector3D _aq_p;
-				(p)->GetPoint(_aq_p,__iGrid);
-				(Result)->SetPoint(mat * _aq_p,__iGrid);
-			}
-		}
-		while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+		batchShadeop<CqVector3D, CqVector3D>(RunningState(), shadingPointCount(),
+				p, Result, SqTransformKernel(mat));
 	}
 	else
-	{
-		__iGrid = 0;
-		const CqBitVector& RS = RunningState();
-		do
-		{
-			if(!__fVarying || RS.Value( __iGrid ) )
-			{
-				CqVector3D _aq_p;
-				(p)->GetPoint(_aq_p,__iGrid);
-				(Result)->SetPoint(_aq_p,__iGrid);
-			}
-		}
-		while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
-	}
+		batchShadeop<CqVector3D, CqVector3D>(RunningState(), shadingPointCount(),
+				p, Result, SqCopyKernel<CqVector3D>());
 }
 
 
@@ -141,28 +175,10 @@ void CqShaderExecEnv::SO_transform( IqShaderData* tospace, IqShaderData* p, IqSh
 // transform(m,P)
 void CqShaderExecEnv::SO_transformm( IqShaderData* tospace, IqShaderData* p, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
 	assert( pShader != 0 );
 
-	__fVarying=(p)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqMatrix _aq_tospace;
-			(tospace)->GetMatrix(_aq_tospace,__iGrid);
-			CqVector3D _aq_p;
-			(p)->GetPoint(_aq_p,__iGrid);
-			(Result)->SetPoint(_aq_tospace * _aq_p,__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<CqVector3D, CqMatrix, CqVector3D>(RunningState(),
+			shadingPointCount(), tospace, p, Result, SqMatrixMultKernel());
 }
 
 
@@ -170,53 +186,22 @@ void CqShaderExecEnv::SO_transformm( IqShaderData* tospace, IqShaderData* p, IqS
 // vtransform(s,s,P)
 void CqShaderExecEnv::SO_vtransform( IqShaderData* fromspace, IqShaderData* tospace, IqShaderData* p, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
 	assert( pShader != 0 );
 
-	__fVarying=(p)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
 	if ( getRenderContext() )
 	{
-		__iGrid = 0;
 		CqString _aq_fromspace;
-		(fromspace)->GetString(_aq_fromspace,__iGrid);
+		(fromspace)->GetString(_aq_fromspace,0);
 		CqString _aq_tospace;
-		(tospace)->GetString(_aq_tospace,__iGrid);
+		(tospace)->GetString(_aq_tospace,0);
 		CqMatrix mat;
 		getRenderContext() ->matVSpaceToSpace( _aq_fromspace.c_str(), _aq_tospace.c_str(), pShader->getTransform(), pTransform().get(), getRenderContext()->Time(), mat );
-
-
-		__iGrid = 0;
-		const CqBitVector& RS = RunningState();
-		do
-		{
-			if(!__fVarying || RS.Value( __iGrid ) )
-			{
-				CqVector3D _aq_p;
-				(p)->GetVector(_aq_p,__iGrid);
-				(Result)->SetVector(mat * _aq_p,__iGrid);
-			}
-		}
-		while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+		batchShadeop<CqVector3D, CqVector3D>(RunningState(), shadingPointCount(),
+				p, Result, SqTransformKernel(mat));
 	}
 	else
-	{
-		__iGrid = 0;
-		const CqBitVector& RS = RunningState();
-		do
-		{
-			if(!__fVarying || RS.Value( __iGrid ) )
-			{
-				CqVector3D _aq_p;
-				(p)->GetVector(_aq_p,__iGrid);
-				(Result)->SetVector(_aq_p,__iGrid);
-			}
-		}
-		while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
-	}
+		batchShadeop<CqVector3D, CqVector3D>(RunningState(), shadingPointCount(),
+				p, Result, SqCopyKernel<CqVector3D>());
 }
 
 
@@ -224,51 +209,20 @@ void CqShaderExecEnv::SO_vtransform( IqShaderData* fromspace, IqShaderData* tosp
 // vtransform(s,P)
 void CqShaderExecEnv::SO_vtransform( IqShaderData* tospace, IqShaderData* p, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
 	assert( pShader != 0 );
 
-	__fVarying=(p)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
 	if ( getRenderContext() )
 	{
-		__iGrid = 0;
 		CqString _aq_tospace;
-		(tospace)->GetString(_aq_tospace,__iGrid);
+		(tospace)->GetString(_aq_tospace,0);
 		CqMatrix mat;
 		getRenderContext() ->matVSpaceToSpace( "current", _aq_tospace.c_str(), pShader->getTransform(), pTransform().get(), getRenderContext()->Time(), mat );
-
-
-		__iGrid = 0;
-		const CqBitVector& RS = RunningState();
-		do
-		{
-			if(!__fVarying || RS.Value( __iGrid ) )
-			{
-				CqVector3D _aq_p;
-				(p)->GetVector(_aq_p,__iGrid);
-				(Result)->SetVector(mat * _aq_p,__iGrid);
-			}
-		}
-		while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+		batchShadeop<CqVector3D, CqVector3D>(RunningState(), shadingPointCount(),
+				p, Result, SqTransformKernel(mat));
 	}
 	else
-	{
-		__iGrid = 0;
-		const CqBitVector& RS = RunningState();
-		do
-		{
-			if(!__fVarying || RS.Value( __iGrid ) )
-			{
-				CqVector3D _aq_p;
-				(p)->GetVector(_aq_p,__iGrid);
-				(Result)->SetVector(_aq_p,__iGrid);
-			}
-		}
-		while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
-	}
+		batchShadeop<CqVector3D, CqVector3D>(RunningState(), shadingPointCount(),
+				p, Result, SqCopyKernel<CqVector3D>());
 }
 
 
@@ -276,28 +230,10 @@ void CqShaderExecEnv::SO_vtransform( IqShaderData* tospace, IqShaderData* p, IqS
 // vtransform(m,P)
 void CqShaderExecEnv::SO_vtransformm( IqShaderData* tospace, IqShaderData* p, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
 	assert( pShader != 0 );
 
-	__fVarying=(p)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqMatrix _aq_tospace;
-			(tospace)->GetMatrix(_aq_tospace,__iGrid);
-			CqVector3D _aq_p;
-			(p)->GetVector(_aq_p,__iGrid);
-			(Result)->SetVector(_aq_tospace * _aq_p,__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<CqVector3D, CqMatrix, CqVector3D>(RunningState(),
+			shadingPointCount(), tospace, p, Result, SqMatrixMultKernel());
 }
 
 
@@ -305,53 +241,22 @@ void CqShaderExecEnv::SO_vtransformm( IqShaderData* tospace, IqShaderData* p, Iq
 // ntransform(s,s,P)
 void CqShaderExecEnv::SO_ntransform( IqShaderData* fromspace, IqShaderData* tospace, IqShaderData* p, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
 	assert( pShader != 0 );
 
-	__fVarying=(p)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
 	if ( getRenderContext() )
 	{
-		__iGrid = 0;
 		CqString _aq_fromspace;
-		(fromspace)->GetString(_aq_fromspace,__iGrid);
+		(fromspace)->GetString(_aq_fromspace,0);
 		CqString _aq_tospace;
-		(tospace)->GetString(_aq_tospace,__iGrid);
+		(tospace)->GetString(_aq_tospace,0);
 		CqMatrix mat;
 		getRenderContext() ->matNSpaceToSpace( _aq_fromspace.c_str(), _aq_tospace.c_str(), pShader->getTransform(), pTransform().get(), getRenderContext()->Time(), mat );
-		__iGrid = 0;
-
-		__iGrid = 0;
-		const CqBitVector& RS = RunningState();
-		do
-		{
-			if(!__fVarying || RS.Value( __iGrid ) )
-			{
-				CqVector3D _aq_p;
-				(p)->GetNormal(_aq_p,__iGrid);
-				(Result)->SetNormal(mat * _aq_p,__iGrid);
-			}
-		}
-		while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+		batchShadeop<CqVector3D, CqVector3D>(RunningState(), shadingPointCount(),
+				p, Result, SqTransformKernel(mat));
 	}
 	else
-	{
-		__iGrid = 0;
-		const CqBitVector& RS = RunningState();
-		do
-		{
-			if(!__fVarying || RS.Value( __iGrid ) )
-			{
-				CqVector3D _aq_p;
-				(p)->GetNormal(_aq_p,__iGrid);
-				(Result)->SetNormal(_aq_p,__iGrid);
-			}
-		}
-		while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
-	}
+		batchShadeop<CqVector3D, CqVector3D>(RunningState(), shadingPointCount(),
+				p, Result, SqCopyKernel<CqVector3D>());
 }
 
 
@@ -359,51 +264,20 @@ void CqShaderExecEnv::SO_ntransform( IqShaderData* fromspace, IqShaderData* tosp
 // ntransform(s,P)
 void CqShaderExecEnv::SO_ntransform( IqShaderData* tospace, IqShaderData* p, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
 	assert( pShader != 0 );
 
-	__fVarying=(p)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
 	if ( getRenderContext() )
 	{
-		__iGrid = 0;
 		CqString _aq_tospace;
-		(tospace)->GetString(_aq_tospace,__iGrid);
+		(tospace)->GetString(_aq_tospace,0);
 		CqMatrix mat;
 		getRenderContext() ->matNSpaceToSpace( "current", _aq_tospace.c_str(), pShader->getTransform(), pTransform().get(), getRenderContext()->Time(), mat );
-		__iGrid = 0;
-
-		__iGrid = 0;
-		const CqBitVector& RS = RunningState();
-		do
-		{
-			if(!__fVarying || RS.Value( __iGrid ) )
-			{
-				CqVector3D _aq_p;
-				(p)->GetNormal(_aq_p,__iGrid);
-				(Result)->SetNormal(mat * _aq_p,__iGrid);
-			}
-		}
-		while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+		batchShadeop<CqVector3D, CqVector3D>(RunningState(), shadingPointCount(),
+				p, Result, SqTransformKernel(mat));
 	}
 	else
-	{
-		__iGrid = 0;
-		const CqBitVector& RS = RunningState();
-		do
-		{
-			if(!__fVarying || RS.Value( __iGrid ) )
-			{
-				CqVector3D _aq_p;
-				(p)->GetNormal(_aq_p,__iGrid);
-				(Result)->SetNormal(_aq_p,__iGrid);
-			}
-		}
-		while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
-	}
+		batchShadeop<CqVector3D, CqVector3D>(RunningState(), shadingPointCount(),
+				p, Result, SqCopyKernel<CqVector3D>());
 }
 
 
@@ -411,57 +285,16 @@ void CqShaderExecEnv::SO_ntransform( IqShaderData* tospace, IqShaderData* p, IqS
 // ntransform(m,P)
 void CqShaderExecEnv::SO_ntransformm( IqShaderData* tospace, IqShaderData* p, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
 	assert( pShader != 0 );
 
-	__fVarying=(p)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqMatrix _aq_tospace;
-			(tospace)->GetMatrix(_aq_tospace,__iGrid);
-			CqVector3D _aq_p;
-			(p)->GetNormal(_aq_p,__iGrid);
-			(Result)->SetNormal(_aq_tospace * _aq_p,__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<CqVector3D, CqMatrix, CqVector3D>(RunningState(),
+			shadingPointCount(), tospace, p, Result, SqMatrixMultKernel());
 }
 
 void CqShaderExecEnv::SO_cmix( IqShaderData* color0, IqShaderData* color1, IqShaderData* value, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(color0)->Class()==class_varying;
-	__fVarying=(color1)->Class()==class_varying||__fVarying;
-	__fVarying=(value)->Class()==class_varying||__fVarying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqColor _aq_color0;
-			(color0)->GetColor(_aq_color0,__iGrid);
-			CqColor _aq_color1;
-			(color1)->GetColor(_aq_color1,__iGrid);
-			TqFloat _aq_value;
-			(value)->GetFloat(_aq_value,__iGrid);
-			CqColor c( ( 1.0f - _aq_value ) * _aq_color0 + _aq_value * _aq_color1 );
-			(Result)->SetColor(c,__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<CqColor, CqColor, CqColor, TqFloat>(RunningState(),
+			shadingPointCount(), color0, color1, value, Result, SqMixKernel<CqColor>());
 }
 
 void CqShaderExecEnv::SO_cmixc( IqShaderData* color0, IqShaderData* color1, IqShaderData* value, IqShaderData* Result, IqShader* pShader )
@@ -497,58 +330,14 @@ void CqShaderExecEnv::SO_cmixc( IqShaderData* color0, IqShaderData* color1, IqSh
 
 void	CqShaderExecEnv::SO_fmix( IqShaderData* f0, IqShaderData* f1, IqShaderData* value, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(f0)->Class()==class_varying;
-	__fVarying=(f1)->Class()==class_varying||__fVarying;
-	__fVarying=(value)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat _aq_f0;
-			(f0)->GetFloat(_aq_f0,__iGrid);
-			TqFloat _aq_f1;
-			(f1)->GetFloat(_aq_f1,__iGrid);
-			TqFloat _aq_value;
-			(value)->GetFloat(_aq_value,__iGrid);
-			TqFloat f( ( 1.0f - _aq_value ) * _aq_f0 + _aq_value * _aq_f1 );
-			(Result)->SetFloat(f,__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, TqFloat, TqFloat, TqFloat>(RunningState(),
+			shadingPointCount(), f0, f1, value, Result, SqMixKernel<TqFloat>());
 }
 
 void    CqShaderExecEnv::SO_pmix( IqShaderData* p0, IqShaderData* p1, IqShaderData* value, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(p0)->Class()==class_varying;
-	__fVarying=(p1)->Class()==class_varying||__fVarying;
-	__fVarying=(value)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqVector3D _aq_p0;
-			(p0)->GetPoint(_aq_p0,__iGrid);
-			CqVector3D _aq_p1;
-			(p1)->GetPoint(_aq_p1,__iGrid);
-			TqFloat _aq_value;
-			(value)->GetFloat(_aq_value,__iGrid);
-			CqVector3D p( ( 1.0f - _aq_value ) * _aq_p0 + _aq_value * _aq_p1 );
-			(Result)->SetPoint(p,__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<CqVector3D, CqVector3D, CqVector3D, TqFloat>(RunningState(),
+			shadingPointCount(), p0, p1, value, Result, SqMixKernel<CqVector3D>());
 }
 
 void	CqShaderExecEnv::SO_pmixc( IqShaderData* p0, IqShaderData* p1, IqShaderData* value, IqShaderData* Result, IqShader* pShader )
@@ -583,30 +372,8 @@ void	CqShaderExecEnv::SO_pmixc( IqShaderData* p0, IqShaderData* p1, IqShaderData
 
 void    CqShaderExecEnv::SO_vmix( IqShaderData* v0, IqShaderData* v1, IqShaderData* value, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(v0)->Class()==class_varying;
-	__fVarying=(v1)->Class()==class_varying||__fVarying;
-	__fVarying=(value)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqVector3D _aq_v0;
-			(v0)->GetVector(_aq_v0,__iGrid);
-			CqVector3D _aq_v1;
-			(v1)->GetVector(_aq_v1,__iGrid);
-			TqFloat _aq_value;
-			(value)->GetFloat(_aq_value,__iGrid);
-			CqVector3D v( ( 1.0f - _aq_value ) * _aq_v0 + _aq_value * _aq_v1 );
-			(Result)->SetVector(v,__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<CqVector3D, CqVector3D, CqVector3D, TqFloat>(RunningState(),
+			shadingPointCount(), v0, v1, value, Result, SqMixKernel<CqVector3D>());
 }
 
 void	CqShaderExecEnv::SO_vmixc( IqShaderData* v0, IqShaderData* v1, IqShaderData* value, IqShaderData* Result, IqShader* pShader )
@@ -641,30 +408,8 @@ void	CqShaderExecEnv::SO_vmixc( IqShaderData* v0, IqShaderData* v1, IqShaderData
 
 void	CqShaderExecEnv::SO_nmix( IqShaderData* n0, IqShaderData* n1, IqShaderData* value, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(n0)->Class()==class_varying;
-	__fVarying=(n1)->Class()==class_varying||__fVarying;
-	__fVarying=(value)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqVector3D _aq_n0;
-			(n0)->GetNormal(_aq_n0,__iGrid);
-			CqVector3D _aq_n1;
-			(n1)->GetNormal(_aq_n1,__iGrid);
-			TqFloat _aq_value;
-			(value)->GetFloat(_aq_value,__iGrid);
-			CqVector3D n( ( 1.0f - _aq_value ) * _aq_n0 + _aq_value * _aq_n1 );
-			(Result)->SetNormal(n,__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<CqVector3D, CqVector3D, CqVector3D, TqFloat>(RunningState(),
+			shadingPointCount(), n0, n1, value, Result, SqMixKernel<CqVector3D>());
 }
 
 void	CqShaderExecEnv::SO_nmixc( IqShaderData* n0, IqShaderData* n1, IqShaderData* value, IqShaderData* Result, IqShader* pShader )
@@ -702,43 +447,27 @@ void	CqShaderExecEnv::SO_nmixc( IqShaderData* n0, IqShaderData* n1, IqShaderData
 // ctransform(s,s,c)
 void CqShaderExecEnv::SO_ctransform( IqShaderData* fromspace, IqShaderData* tospace, IqShaderData* c, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(c)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
 	CqString fromSpaceName( "rgb" );
 	if ( NULL != fromspace )
 		fromspace->GetString( fromSpaceName );
 	CqString toSpaceName;
-	(tospace)->GetString(toSpaceName,__iGrid);
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqColor col;
-			(c)->GetColor(col,__iGrid);
-			if      (fromSpaceName == "hsv")  col = hsvtorgb(col);
-			else if (fromSpaceName == "hsl")  col = hsltorgb(col);
-			else if (fromSpaceName == "XYZ")  col = XYZtorgb(col);
-			else if (fromSpaceName == "xyY")  col = xyYtorgb(col);
-			else if (fromSpaceName == "YIQ")  col = YIQtorgb(col);
-
-			if      (toSpaceName == "hsv")   col = rgbtohsv(col);
-			else if (toSpaceName == "hsl")   col = rgbtohsl(col);
-			else if (toSpaceName == "XYZ")   col = rgbtoXYZ(col);
-			else if (toSpaceName == "xyY")   col = rgbtoxyY(col);
-			else if (toSpaceName == "YIQ")   col = rgbtoYIQ(col);
-
-			(Result)->SetColor(col,__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	(tospace)->GetString(toSpaceName,0);
+
+	SqColorSpaceKernel kernel;
+	if      (fromSpaceName == "hsv")  kernel.fromSpace = hsvtorgb;
+	else if (fromSpaceName == "hsl")  kernel.fromSpace = hsltorgb;
+	else if (fromSpaceName == "XYZ")  kernel.fromSpace = XYZtorgb;
+	else if (fromSpaceName == "xyY")  kernel.fromSpace = xyYtorgb;
+	else if (fromSpaceName == "YIQ")  kernel.fromSpace = YIQtorgb;
+
+	if      (toSpaceName == "hsv")   kernel.toSpace = rgbtohsv;
+	else if (toSpaceName == "hsl")   kernel.toSpace = rgbtohsl;
+	else if (toSpaceName == "XYZ")   kernel.toSpace = rgbtoXYZ;
+	else if (toSpaceName == "xyY")   kernel.toSpace = rgbtoxyY;
+	else if (toSpaceName == "YIQ")   kernel.toSpace = rgbtoYIQ;
+
+	batchShadeop<CqColor, CqColor>(RunningState(), shadingPointCount(),
+			c, Result, kernel);
 }
 
 
@@ -755,50 +484,8 @@ void CqShaderExecEnv::SO_ctransform( IqShaderData* tospace, IqShaderData* c, IqS
 // ctransform(s,c)
 void CqShaderExecEnv::SO_ptlined( IqShaderData* P0, IqShaderData* P1, IqShaderData* Q, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(P0)->Class()==class_varying;
-	__fVarying=(P1)->Class()==class_varying||__fVarying;
-	__fVarying=(Q)->Class()==class_varying||__fVarying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqVector3D _aq_P0;
-			(P0)->GetPoint(_aq_P0,__iGrid);
-			CqVector3D _aq_P1;
-			(P1)->GetPoint(_aq_P1,__iGrid);
-			CqVector3D _aq_Q;
-			(Q)->GetPoint(_aq_Q,__iGrid);
-			CqVector3D kDiff = _aq_Q - _aq_P0;
-			CqVector3D vecDir = _aq_P1 - _aq_P0;
-			TqFloat fT = kDiff * vecDir;
-
-			if ( fT <= 0.0f )
-				fT = 0.0f;
-			else
-			{
-				TqFloat fSqrLen = vecDir.Magnitude2();
-				if ( fT >= fSqrLen )
-				{
-					fT = 1.0f;
-					kDiff -= vecDir;
-				}
-				else
-				{
-					fT /= fSqrLen;
-					kDiff -= fT * vecDir;
-				}
-			}
-			(Result)->SetFloat(kDiff.Magnitude(),__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, CqVector3D, CqVector3D, CqVector3D>(RunningState(),
+			shadingPointCount(), P0, P1, Q, Result, SqPtLineDistKernel());
 }
 
 //----------------------------------------------------------------------
@@ -28,9 +28,41 @@
 
 #include	"shaderexecenv.h"
 #include	<aqsis/math/vectorcast.h>
+#include	"shadeops_batch.h"
 
 namespace Aqsis {
 
+namespace {
+
+// Kernels for batched evaluation of the noise shadeops.
+
+struct SqFNoise1Kernel
+{
+	TqFloat operator()(TqFloat v) const { return CqNoise::FGNoise1(v); }
+};
+struct SqFNoise2Kernel
+{
+	TqFloat operator()(TqFloat u, TqFloat v) const { return CqNoise::FGNoise2(u, v); }
+};
+struct SqFNoise3Kernel
+{
+	TqFloat operator()(const CqVector3D& p) const { return CqNoise::FGNoise3(p); }
+};
+struct SqCNoise1Kernel
+{
+	CqColor operator()(TqFloat v) const { return CqNoise::CGNoise1(v); }
+};
+struct SqCNoise3Kernel
+{
+	CqColor operator()(const CqVector3D& p) const { return CqNoise::CGNoise3(p); }
+};
+struct SqPNoise3Kernel
+{
+	CqVector3D operator()(const CqVector3D& p) const { return CqNoise::PGNoise3(p); }
+};
+
+} // unnamed namespace
+
 
 void	CqShaderExecEnv::SO_frandom( IqShaderData* Result, IqShader* pShader )
 {
@@ -104,75 +136,24 @@ void	CqShaderExecEnv::SO_prandom( IqShaderData* Result, IqShader* pShader )
 // noise(v)
 void	CqShaderExecEnv::SO_fnoise1( IqShaderData* v, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(v)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat _aq_v;
-			(v)->GetFloat(_aq_v,__iGrid);
-			(Result)->SetFloat( m_noise.FGNoise1( _aq_v ),__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, TqFloat>(RunningState(), shadingPointCount(),
+			v, Result, SqFNoise1Kernel());
 }
 
 //----------------------------------------------------------------------
 // noise(u,v)
 void CqShaderExecEnv::SO_fnoise2( IqShaderData* u, IqShaderData* v, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(u)->Class()==class_varying;
-	__fVarying=(v)->Class()==class_varying||__fVarying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat _aq_u;
-			(u)->GetFloat(_aq_u,__iGrid);
-			TqFloat _aq_v;
-			(v)->GetFloat(_aq_v,__iGrid);
-			(Result)->SetFloat( m_noise.FGNoise2( _aq_u, _aq_v ),__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, TqFloat, TqFloat>(RunningState(),
+			shadingPointCount(), u, v, Result, SqFNoise2Kernel());
 }
 
 //----------------------------------------------------------------------
 // noise(p)
 void CqShaderExecEnv::SO_fnoise3( IqShaderData* p, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(p)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqVector3D _aq_p;
-			(p)->GetPoint(_aq_p,__iGrid);
-			(Result)->SetFloat( m_noise.FGNoise3( _aq_p ),__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<TqFloat, CqVector3D>(RunningState(), shadingPointCount(),
+			p, Result, SqFNoise3Kernel());
 }
 
 //----------------------------------------------------------------------
@@ -207,24 +188,8 @@ void CqShaderExecEnv::SO_fnoise4( IqShaderData* p, IqShaderData* t, IqShaderData
 // noise(v)
 void	CqShaderExecEnv::SO_cnoise1( IqShaderData* v, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(v)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			TqFloat _aq_v;
-			(v)->GetFloat(_aq_v,__iGrid);
-			(Result)->SetColor( m_noise.CGNoise1( _aq_v ),__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<CqColor, TqFloat>(RunningState(), shadingPointCount(),
+			v, Result, SqCNoise1Kernel());
 }
 
 //----------------------------------------------------------------------
@@ -258,24 +223,8 @@ void CqShaderExecEnv::SO_cnoise2( IqShaderData* u, IqShaderData* v, IqShaderData
 // noise(p)
 void CqShaderExecEnv::SO_cnoise3( IqShaderData* p, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(p)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqVector3D _aq_p;
-			(p)->GetPoint(_aq_p,__iGrid);
-			(Result)->SetColor( m_noise.CGNoise3( _aq_p ),__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<CqColor, CqVector3D>(RunningState(), shadingPointCount(),
+			p, Result, SqCNoise3Kernel());
 }
 
 //----------------------------------------------------------------------
@@ -361,24 +310,8 @@ void CqShaderExecEnv::SO_pnoise2( IqShaderData* u, IqShaderData* v, IqShaderData
 // noise(p)
 void CqShaderExecEnv::SO_pnoise3( IqShaderData* p, IqShaderData* Result, IqShader* pShader )
 {
-	bool __fVarying;
-	TqUint __iGrid;
-
-	__fVarying=(p)->Class()==class_varying;
-	__fVarying=(Result)->Class()==class_varying||__fVarying;
-
-	__iGrid = 0;
-	const CqBitVector& RS = RunningState();
-	do
-	{
-		if(!__fVarying || RS.Value( __iGrid ) )
-		{
-			CqVector3D _aq_p;
-			(p)->GetPoint(_aq_p,__iGrid);
-			(Result)->SetPoint( m_noise.PGNoise3( _aq_p ),__iGrid);
-		}
-	}
-	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+	batchShadeop<CqVector3D, CqVector3D>(RunningState(), shadingPointCount(),
+			p, Result, SqPNoise3Kernel());
 }
 
 //----------------------------------------------------------------------
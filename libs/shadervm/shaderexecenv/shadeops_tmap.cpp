@@ -34,6 +34,10 @@
 #include	<cstdio>
 #include	<cstring>
 
+#ifdef	ENABLE_THREADING
+#	include	<boost/thread/mutex.hpp>
+#endif
+
 #include	"shaderexecenv.h"
 #include	<aqsis/tex/filtering/ienvironmentsampler.h>
 #include	<aqsis/tex/filtering/iocclusionsampler.h>
@@ -1037,6 +1041,10 @@ typedef std::map<std::string, BakingChannel> BakingData;
 typedef std::map<std::string, bool> BakingAccess;
 
 static BakingAccess *Existing = new BakingAccess;
+#ifdef	ENABLE_THREADING
+/// Serialises baking to files, since grids may be shaded concurrently.
+static boost::mutex g_bakingMutex;
+#endif
 
 extern "C" BakingData *bake_init()
 {
@@ -1046,6 +1054,9 @@ extern "C" BakingData *bake_init()
 }
 extern "C" void bake_done( BakingData *bd )
 {
+#	ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock( g_bakingMutex );
+#	endif
 	delete bd; // Will destroy bd, and in turn all its BakingChannel's
 }
 // Workhorse routine -- look up the channel name, add a new BakingChannel
@@ -1053,6 +1064,9 @@ extern "C" void bake_done( BakingData *bd )
 extern "C" void bake ( BakingData *bd, const std::string &name,
 	                       float s, float t, int elsize, float *data )
 {
+#	ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock( g_bakingMutex );
+#	endif
 	BakingData::iterator found = bd->find ( name );
 	BakingAccess::iterator exist = Existing->find ( name );
 
@@ -27,305 +27,175 @@
 #include	"shaderstack.h"
 #include	<aqsis/shadervm/ishaderdata.h>
 
+#ifdef ENABLE_THREADING
+#	include	<boost/thread/tss.hpp>
+#endif
+
 #undef SHADERSTACKSTATS /* define if you want to know at run-time the max. depth of stack */
 
 
 namespace Aqsis {
 
 TqUint   CqShaderStack::m_samples = 18;
-TqUint   CqShaderStack::m_maxsamples = 18;
-
-std::deque<CqShaderVariableUniformFloat*>			CqShaderStack::m_UFPool;
-std::deque<CqShaderVariableUniformPoint*>			CqShaderStack::m_UPPool;
-std::deque<CqShaderVariableUniformString*>			CqShaderStack::m_USPool;
-std::deque<CqShaderVariableUniformColor*>			CqShaderStack::m_UCPool;
-std::deque<CqShaderVariableUniformNormal*>			CqShaderStack::m_UNPool;
-std::deque<CqShaderVariableUniformVector*>			CqShaderStack::m_UVPool;
-std::deque<CqShaderVariableUniformMatrix*>			CqShaderStack::m_UMPool;
-
-std::deque<CqShaderVariableVaryingFloat*>			CqShaderStack::m_VFPool;
-std::deque<CqShaderVariableVaryingPoint*>			CqShaderStack::m_VPPool;
-std::deque<CqShaderVariableVaryingString*>			CqShaderStack::m_VSPool;
-std::deque<CqShaderVariableVaryingColor*>			CqShaderStack::m_VCPool;
-std::deque<CqShaderVariableVaryingNormal*>			CqShaderStack::m_VNPool;
-std::deque<CqShaderVariableVaryingVector*>			CqShaderStack::m_VVPool;
-std::deque<CqShaderVariableVaryingMatrix*>			CqShaderStack::m_VMPool;
-
 
 //----------------------------------------------------------------------
-/** Returns the next shaderstack variable and allocates more if
- *  it needs to be
+/** \class CqShaderTempPool
+ * Free lists of shader stack temporaries, one per variable type and class.
+ *
+ * There is one pool per thread, shared by all shaders run on that thread.
  */
-
-IqShaderData* CqShaderStack::GetNextTemp( EqVariableType type, EqVariableClass _class )
+class CqShaderTempPool
 {
-	switch ( type )
-	{
-			case type_float:
-			{
-				if ( _class == class_uniform )
-				{
-					if( m_UFPool.empty() )
-						return( new CqShaderVariableUniformFloat() );
-					else
-					{
-						IqShaderData* ret = m_UFPool.front();
-						m_UFPool.pop_front();
-						return( ret );
-					}
-				}
-				else
-				{
-					if( m_VFPool.empty() )
-						return( new CqShaderVariableVaryingFloat() );
-					else
-					{
-						IqShaderData* ret = m_VFPool.front();
-						m_VFPool.pop_front();
-						return( ret );
-					}
-				}
-			}
-
-			case type_point:
-			{
-				if ( _class == class_uniform )
-				{
-					if( m_UPPool.empty() )
-						return( new CqShaderVariableUniformPoint() );
-					else
-					{
-						IqShaderData* ret = m_UPPool.front();
-						m_UPPool.pop_front();
-						return( ret );
-					}
-				}
-				else
-				{
-					if( m_VPPool.empty() )
-						return( new CqShaderVariableVaryingPoint() );
-					else
-					{
-						IqShaderData* ret = m_VPPool.front();
-						m_VPPool.pop_front();
-						return( ret );
-					}
-				}
-			}
-
-			case type_string:
+	public:
+		~CqShaderTempPool()
+		{
+			clear();
+		}
+		/// Delete all the pooled temporaries.
+		void clear()
+		{
+			for(TqInt type = 0; type < numTypes; ++type)
 			{
-				if ( _class == class_uniform )
+				for(TqInt varying = 0; varying < 2; ++varying)
 				{
-					if( m_USPool.empty() )
-						return( new CqShaderVariableUniformString() );
-					else
-					{
-						IqShaderData* ret = m_USPool.front();
-						m_USPool.pop_front();
-						return( ret );
-					}
-				}
-				else
-				{
-					if( m_VSPool.empty() )
-						return( new CqShaderVariableVaryingString() );
-					else
-					{
-						IqShaderData* ret = m_VSPool.front();
-						m_VSPool.pop_front();
-						return( ret );
-					}
+					std::vector<IqShaderData*>& temps = m_temps[type][varying];
+					for(std::vector<IqShaderData*>::iterator i = temps.begin(); i != temps.end(); ++i)
+						delete *i;
+					temps.clear();
 				}
 			}
+		}
+		/// Get the free list for temporaries of the given type and class.
+		std::vector<IqShaderData*>& temps( EqVariableType type, EqVariableClass _class )
+		{
+			TqInt index = static_cast<TqInt>(type);
+			assert(index >= 0 && index < static_cast<TqInt>(numTypes));
+			return m_temps[index][_class == class_uniform ? 0 : 1];
+		}
 
-			case type_color:
-			{
-				if ( _class == class_uniform )
-				{
-					if( m_UCPool.empty() )
-						return( new CqShaderVariableUniformColor() );
-					else
-					{
-						IqShaderData* ret = m_UCPool.front();
-						m_UCPool.pop_front();
-						return( ret );
-					}
-				}
-				else
-				{
-					if( m_VCPool.empty() )
-						return( new CqShaderVariableVaryingColor() );
-					else
-					{
-						IqShaderData* ret = m_VCPool.front();
-						m_VCPool.pop_front();
-						return( ret );
-					}
-				}
-			}
+	private:
+		enum { numTypes = type_bool + 1 };
+		std::vector<IqShaderData*> m_temps[numTypes][2];
+};
 
-			case type_normal:
-			{
-				if ( _class == class_uniform )
-				{
-					if( m_UNPool.empty() )
-						return( new CqShaderVariableUniformNormal() );
-					else
-					{
-						IqShaderData* ret = m_UNPool.front();
-						m_UNPool.pop_front();
-						return( ret );
-					}
-				}
-				else
-				{
-					if( m_VNPool.empty() )
-						return( new CqShaderVariableVaryingNormal() );
-					else
-					{
-						IqShaderData* ret = m_VNPool.front();
-						m_VNPool.pop_front();
-						return( ret );
-					}
-				}
-			}
+namespace {
 
-			case type_vector:
-			{
-				if ( _class == class_uniform )
-				{
-					if( m_UVPool.empty() )
-						return( new CqShaderVariableUniformVector() );
-					else
-					{
-						IqShaderData* ret = m_UVPool.front();
-						m_UVPool.pop_front();
-						return( ret );
-					}
-				}
-				else
-				{
-					if( m_VVPool.empty() )
-						return( new CqShaderVariableVaryingVector() );
-					else
-					{
-						IqShaderData* ret = m_VVPool.front();
-						m_VVPool.pop_front();
-						return( ret );
-					}
-				}
-			}
+#ifdef ENABLE_THREADING
+boost::thread_specific_ptr<CqShaderTempPool> g_threadTempPool;
+#else
+CqShaderTempPool g_tempPool;
+#endif
 
-			case type_matrix:
-			{
-				if ( _class == class_uniform )
-				{
-					if( m_UMPool.empty() )
-						return( new CqShaderVariableUniformMatrix() );
-					else
-					{
-						IqShaderData* ret = m_UMPool.front();
-						m_UMPool.pop_front();
-						return( ret );
-					}
-				}
-				else
-				{
-					if( m_VMPool.empty() )
-						return( new CqShaderVariableVaryingMatrix() );
-					else
-					{
-						IqShaderData* ret = m_VMPool.front();
-						m_VMPool.pop_front();
-						return( ret );
-					}
-				}
-			}
+/// Get the temporary pool of the calling thread.
+CqShaderTempPool* threadTempPool()
+{
+#ifdef ENABLE_THREADING
+	CqShaderTempPool* pool = g_threadTempPool.get();
+	if(!pool)
+	{
+		pool = new CqShaderTempPool();
+		g_threadTempPool.reset(pool);
+	}
+	return pool;
+#else
+	return &g_tempPool;
+#endif
+}
 
-			default:
-				break;
+/// Allocate a new temporary of the given type and class.
+IqShaderData* newTemp( EqVariableType type, EqVariableClass _class )
+{
+	bool uniform = _class == class_uniform;
+	switch ( type )
+	{
+		case type_float:
+			if(uniform)
+				return new CqShaderVariableUniformFloat();
+			return new CqShaderVariableVaryingFloat();
+		case type_point:
+			if(uniform)
+				return new CqShaderVariableUniformPoint();
+			return new CqShaderVariableVaryingPoint();
+		case type_string:
+			if(uniform)
+				return new CqShaderVariableUniformString();
+			return new CqShaderVariableVaryingString();
+		case type_color:
+			if(uniform)
+				return new CqShaderVariableUniformColor();
+			return new CqShaderVariableVaryingColor();
+		case type_normal:
+			if(uniform)
+				return new CqShaderVariableUniformNormal();
+			return new CqShaderVariableVaryingNormal();
+		case type_vector:
+			if(uniform)
+				return new CqShaderVariableUniformVector();
+			return new CqShaderVariableVaryingVector();
+		case type_matrix:
+			if(uniform)
+				return new CqShaderVariableUniformMatrix();
+			return new CqShaderVariableVaryingMatrix();
+		default:
+			break;
 	}
 	assert( false );
 	return( NULL );
 }
 
+} // unnamed namespace
+
+
 //----------------------------------------------------------------------
-/** Release the stack value passed in, if it is a temporary, return it to the bucket.
- * \param s Stack entry to be released.
+/** Attach to the temporary pool of the calling thread.
  */
-void CqShaderStack::Release( SqStackEntry s )
+
+void CqShaderStack::AttachTempPool()
 {
-	if( s.m_IsTemp )
-	{
-		switch( s.m_Data->Type() )
-		{
-				case type_float:
-				{
-					if ( s.m_Data->Class() == class_uniform )
-						m_UFPool.push_back(reinterpret_cast<CqShaderVariableUniformFloat*>(s.m_Data) );
-					else
-						m_VFPool.push_back(reinterpret_cast<CqShaderVariableVaryingFloat*>(s.m_Data) );
-					break;
-				}
+	m_temps = threadTempPool();
+}
 
-				case type_point:
-				{
-					if ( s.m_Data->Class() == class_uniform )
-						m_UPPool.push_back(reinterpret_cast<CqShaderVariableUniformPoint*>(s.m_Data) );
-					else
-						m_VPPool.push_back(reinterpret_cast<CqShaderVariableVaryingPoint*>(s.m_Data) );
-					break;
-				}
 
-				case type_string:
-				{
-					if ( s.m_Data->Class() == class_uniform )
-						m_USPool.push_back(reinterpret_cast<CqShaderVariableUniformString*>(s.m_Data) );
-					else
-						m_VSPool.push_back(reinterpret_cast<CqShaderVariableVaryingString*>(s.m_Data) );
-					break;
-				}
+//----------------------------------------------------------------------
+/** Free the temporaries pooled by the calling thread.
+ */
 
-				case type_color:
-				{
-					if ( s.m_Data->Class() == class_uniform )
-						m_UCPool.push_back(reinterpret_cast<CqShaderVariableUniformColor*>(s.m_Data) );
-					else
-						m_VCPool.push_back(reinterpret_cast<CqShaderVariableVaryingColor*>(s.m_Data) );
-					break;
-				}
+void CqShaderStack::FreeTempPool()
+{
+#ifdef ENABLE_THREADING
+	g_threadTempPool.reset();
+#else
+	g_tempPool.clear();
+#endif
+}
 
-				case type_normal:
-				{
-					if ( s.m_Data->Class() == class_uniform )
-						m_UNPool.push_back(reinterpret_cast<CqShaderVariableUniformNormal*>(s.m_Data) );
-					else
-						m_VNPool.push_back(reinterpret_cast<CqShaderVariableVaryingNormal*>(s.m_Data) );
-					break;
-				}
 
-				case type_vector:
-				{
-					if ( s.m_Data->Class() == class_uniform )
-						m_UVPool.push_back(reinterpret_cast<CqShaderVariableUniformVector*>(s.m_Data) );
-					else
-						m_VVPool.push_back(reinterpret_cast<CqShaderVariableVaryingVector*>(s.m_Data) );
-					break;
-				}
+//----------------------------------------------------------------------
+/** Returns the next shaderstack variable and allocates more if
+ *  it needs to be
+ */
 
-				case type_matrix:
-				{
-					if ( s.m_Data->Class() == class_uniform )
-						m_UMPool.push_back(reinterpret_cast<CqShaderVariableUniformMatrix*>(s.m_Data) );
-					else
-						m_VMPool.push_back(reinterpret_cast<CqShaderVariableVaryingMatrix*>(s.m_Data) );
-					break;
-				}
-				
-				default:
-					break;
-		}
+IqShaderData* CqShaderStack::GetNextTemp( EqVariableType type, EqVariableClass _class )
+{
+	assert(m_temps);
+	std::vector<IqShaderData*>& temps = m_temps->temps( type, _class );
+	if( temps.empty() )
+		return( newTemp( type, _class ) );
+	IqShaderData* ret = temps.back();
+	temps.pop_back();
+	return( ret );
+}
+
+//----------------------------------------------------------------------
+/** Release the stack value passed in, if it is a temporary, return it to the bucket.
+ * \param s Stack entry to be released.
+ */
+void CqShaderStack::Release( SqStackEntry s )
+{
+	if( s.m_IsTemp )
+	{
+		assert(m_temps);
+		m_temps->temps( s.m_Data->Type(), s.m_Data->Class() ).push_back( s.m_Data );
 	}
 }
 
@@ -342,7 +212,7 @@ void CqShaderStack::Statistics()
 	static TqInt done = 0;
 	if (!done)
 	{
-		std::cout << "The shaderstack's max. depth was " << m_maxsamples << std::endl;
+		std::cout << "The shaderstack's max. depth was " << m_maxDepth << std::endl;
 		done = 1;
 	}
 #endif
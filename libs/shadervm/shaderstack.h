@@ -212,9 +212,16 @@ static CqMatrix temp_matrix;
 			} \
 		}
 
+class CqShaderTempPool;
+
 //----------------------------------------------------------------------
 /** \class CqShaderStack
  * Class handling the shader execution stack.
+ *
+ * The temporaries pushed onto the stack by shadeops are recycled through a
+ * pool belonging to the thread executing the shader, so separate threads may
+ * run separate shaders concurrently, and once a thread has warmed up shading
+ * a grid needs no heap allocation.
  */
 
 struct	SqStackEntry
@@ -226,10 +233,17 @@ struct	SqStackEntry
 class AQSIS_SHADERVM_SHARE CqShaderStack
 {
 	public:
-		CqShaderStack() : m_iTop( 0 )
+		CqShaderStack() : m_iTop( 0 ), m_maxDepth( m_samples ), m_temps( 0 )
+		{
+			m_Stack.resize( m_maxDepth );
+		}
+		/** Copy constructor.  Only the stack depth seen by the other stack is
+		 * copied, so that a cloned shader starts with a stack large enough to
+		 * run without reallocating.
+		 */
+		CqShaderStack( const CqShaderStack& From ) : m_iTop( 0 ), m_maxDepth( From.m_maxDepth ), m_temps( 0 )
 		{
-			m_maxsamples = max(m_maxsamples, m_samples);
-			m_Stack.resize( m_maxsamples);
+			m_Stack.resize( m_maxDepth );
 		}
 		virtual ~CqShaderStack()
 		{
@@ -238,6 +252,9 @@ class AQSIS_SHADERVM_SHARE CqShaderStack
 		}
 
 
+		/** Get a temporary variable from the pool of the executing thread,
+		 * allocating a new one only if the pool is empty.
+		 */
 		IqShaderData* GetNextTemp( EqVariableType type, EqVariableClass _class );
 
 		//----------------------------------------------------------------------
@@ -254,8 +271,7 @@ class AQSIS_SHADERVM_SHARE CqShaderStack
 			m_Stack[ m_iTop ].m_Data = pv;
 			m_Stack[ m_iTop ].m_IsTemp = true;
 			m_iTop ++;
-			m_maxsamples = max(m_iTop, m_maxsamples);
-
+			m_maxDepth = max(m_iTop, m_maxDepth);
 
 		}
 
@@ -274,7 +290,7 @@ class AQSIS_SHADERVM_SHARE CqShaderStack
 			m_Stack[ m_iTop ].m_Data = pv;
 			m_Stack[ m_iTop ].m_IsTemp = false;
 			m_iTop ++;
-			m_maxsamples = max(m_iTop, m_maxsamples);
+			m_maxDepth = max(m_iTop, m_maxDepth);
 
 		}
 
@@ -318,10 +334,15 @@ class AQSIS_SHADERVM_SHARE CqShaderStack
 			Release(Pop(f));
 		}
 
+		/** Free the temporaries pooled by the calling thread.  Pools of
+		 * other threads are freed when those threads exit.
+		 */
+		static void FreeTempPool();
+
 		/**
 		 * Print the max number of depth if compiled for it.
 		 */
-		static void Statistics();
+		void Statistics();
 
 		/** set the more efficient number of samples per type of variable at run-time.
 		 */
@@ -331,37 +352,17 @@ class AQSIS_SHADERVM_SHARE CqShaderStack
 		}
 
 	protected:
+		/** Attach the stack to the temporary pool of the calling thread.
+		 * Must be called before executing any code which uses temporaries.
+		 */
+		void AttachTempPool();
+
 		std::vector<SqStackEntry>	m_Stack;
 		TqUint	m_iTop;										///< Index of the top entry.
-
-		static std::deque<CqShaderVariableUniformFloat*>				m_UFPool;
-		// Integer
-		static std::deque<CqShaderVariableUniformPoint*>				m_UPPool;
-		static std::deque<CqShaderVariableUniformString*>			m_USPool;
-		static std::deque<CqShaderVariableUniformColor*>				m_UCPool;
-		// Triple
-		// hPoint
-		static std::deque<CqShaderVariableUniformNormal*>			m_UNPool;
-		static std::deque<CqShaderVariableUniformVector*>			m_UVPool;
-		// Void
-		static std::deque<CqShaderVariableUniformMatrix*>			m_UMPool;
-		// SixteenTuple
-
-		static std::deque<CqShaderVariableVaryingFloat*>				m_VFPool;
-		// Integer
-		static std::deque<CqShaderVariableVaryingPoint*>				m_VPPool;
-		static std::deque<CqShaderVariableVaryingString*>			m_VSPool;
-		static std::deque<CqShaderVariableVaryingColor*>				m_VCPool;
-		// Triple
-		// hPoint
-		static std::deque<CqShaderVariableVaryingNormal*>			m_VNPool;
-		static std::deque<CqShaderVariableVaryingVector*>			m_VVPool;
-		// Void
-		static std::deque<CqShaderVariableVaryingMatrix*>			m_VMPool;
-		// SixteenTuple
+		TqUint	m_maxDepth;									///< Deepest the stack has been.
+		CqShaderTempPool*	m_temps;						///< Temporaries of the executing thread.
 
 		static TqUint    m_samples; // by default == 18 see shaderstack.cpp
-		static TqUint    m_maxsamples;
 }
 ;
 
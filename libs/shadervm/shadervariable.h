@@ -984,6 +984,10 @@ class CqShaderVariableUniformColor : public CqShaderVariableUniform<type_color,
 		{
 			res = &m_Value;
 		}
+		virtual	void	GetColorPtr( CqColor*& res )
+		{
+			res = &m_Value;
+		}
 		virtual	void	SetColor( const CqColor& c )
 		{
 			m_Value = c;
@@ -1025,6 +1029,10 @@ class CqShaderVariableUniformMatrix : public CqShaderVariableUniform<type_matrix
 		{
 			res = &m_Value;
 		}
+		virtual	void	GetMatrixPtr( CqMatrix*& res )
+		{
+			res = &m_Value;
+		}
 		virtual	void	SetMatrix( const CqMatrix& m )
 		{
 			m_Value = m;
@@ -25,6 +25,7 @@
 
 #include "shadervm.h"
 
+#include <algorithm>
 #include <cstring>
 #include <ctype.h>
 #include <iostream>
@@ -33,6 +34,7 @@
 
 #include <aqsis/core/isurface.h>
 #include <aqsis/slcomp/icodegen.h>
+#include <aqsis/util/file.h>
 #include <aqsis/util/logging.h>
 #include "shadervariable.h"
 #include <aqsis/util/sstring.h>
@@ -50,12 +52,13 @@ boost::shared_ptr<IqShader> createShaderVM(IqRenderer* renderContext)
 
 boost::shared_ptr<IqShader> createShaderVM(IqRenderer* renderContext,
                                            std::istream& programFile,
-                                           const std::string& dsoPath)
+                                           const std::string& dsoPath,
+                                           bool fuseInstructions)
 {
 	boost::shared_ptr<CqShaderVM> shader(new CqShaderVM(renderContext));
 	if(!dsoPath.empty())
 		shader->SetDSOPath(dsoPath.c_str());
-	shader->LoadProgram(&programFile);
+	shader->LoadProgram(&programFile, fuseInstructions);
 	return shader;
 }
 
@@ -468,6 +471,12 @@ SqOpCodeTrans CqShaderVM::m_TransTable[] =
 
         {"bake3d", 0, &CqShaderVM::SO_bake3d, 0, {0}},
         {"texture3d", 0, &CqShaderVM::SO_texture3d, 0, {0}},
+
+        // Superinstructions, only generated by FuseInstructions().
+        // The integer is a bit mask of the operands which are float constants
+        // rather than variables.
+        {"fusedff", 0, &CqShaderVM::SO_fusedff, 5, {type_integer, type_invalid, type_invalid, type_void, type_invalid}},
+        {"fusedfff", 0, &CqShaderVM::SO_fusedfff, 7, {type_integer, type_invalid, type_invalid, type_invalid, type_void, type_void, type_invalid}},
     };
 
 /*
@@ -488,10 +497,26 @@ static const TqUlong phash = CqString::hash("param");
 static const TqUlong vhash = CqString::hash("varying");
 static const TqUlong uhash = CqString::hash("uniform");
 static const TqUlong ushash = CqString::hash("USES");
+static const TqUlong nhash = CqString::hash("NATIVE");
 static const TqUlong ehash = CqString::hash("external");
 static const TqUlong ohash = CqString::hash("output");
 
 
+SqShaderProgram::SqShaderProgram()
+	: m_pNativeShade( 0 )
+{ }
+
+SqShaderProgram::~SqShaderProgram()
+{
+	// Delete strings used by the program
+	for ( std::list<CqString*>::iterator i = m_ProgramStrings.begin();
+			i != m_ProgramStrings.end(); i++ )
+	{
+		delete *i;
+	}
+}
+
+
 CqShaderVM::CqShaderVM(IqRenderer* pRenderContext)
 	: CqShaderStack(),
 	m_Uses(0xFFFFFFFF),
@@ -501,11 +526,12 @@ CqShaderVM::CqShaderVM(IqRenderer* pRenderContext)
 	m_pEnv(0),
 	m_pTransform(),
 	m_LocalVars(),
+	m_SharedLocalVars(),
 	m_InstancedParams(),
 	m_StoredArguments(),
-	m_ProgramInit(),
-	m_Program(),
-	m_ProgramStrings(),
+	m_pProgram(new SqShaderProgram()),
+	m_pSpecialisedProgram(),
+	m_fSpecialisationOverridden(false),
 	m_uGridRes(0),
 	m_vGridRes(0),
 	m_shadingPointCount(0),
@@ -527,7 +553,7 @@ CqShaderVM::CqShaderVM(IqRenderer* pRenderContext)
 }
 
 CqShaderVM::CqShaderVM(const CqShaderVM& From)
-	: CqShaderStack(),
+	: CqShaderStack(From),
 	m_Uses(0),
 	m_strName(),
 	m_Type(Type_Surface),
@@ -535,10 +561,11 @@ CqShaderVM::CqShaderVM(const CqShaderVM& From)
 	m_pEnv(0),
 	m_pTransform(),
 	m_LocalVars(),
+	m_SharedLocalVars(),
 	m_StoredArguments(),
-	m_ProgramInit(),
-	m_Program(),
-	m_ProgramStrings(),
+	m_pProgram(),
+	m_pSpecialisedProgram(),
+	m_fSpecialisationOverridden(false),
 	m_uGridRes(0),
 	m_vGridRes(0),
 	m_shadingPointCount(0),
@@ -562,10 +589,11 @@ CqShaderVM::CqShaderVM(const CqShaderVM& From)
 
 CqShaderVM::~CqShaderVM()
 {
-	// Delete the local variables.
+	// Delete the parameters; the other local variables are shared.
 	for ( std::vector<IqShaderData*>::iterator i = m_LocalVars.begin(); i != m_LocalVars.end(); i++ )
 	{
-		delete *i;
+		if ( IsParameter( *i ) )
+			delete *i;
 	}
 	// Delete the cached instance params (note that every second one is the
 	// corresponding local var)
@@ -574,12 +602,6 @@ CqShaderVM::~CqShaderVM()
 	{
 		delete *i;
 	}
-	// Delete strings used by the program
-	for ( std::list<CqString*>::iterator i = m_ProgramStrings.begin();
-			i != m_ProgramStrings.end(); i++ )
-	{
-		delete *i;
-	}
 	// Delete stored shader arguments
 	for(std::vector<SqArgumentRecord>::iterator i = m_StoredArguments.begin();
 			i != m_StoredArguments.end(); ++i)
@@ -916,7 +938,7 @@ void CqShaderVM::GetToken( char* token, TqInt l, std::istream* pFile )
 /** Load a program from a compiled slx file.
 */
 
-void CqShaderVM::LoadProgram( std::istream* pFile )
+void CqShaderVM::LoadProgram( std::istream* pFile, bool fFuse )
 {
 	enum EqSegment
 	{
@@ -931,6 +953,7 @@ void CqShaderVM::LoadProgram( std::istream* pFile )
 	boost::shared_ptr<CqShaderExecEnv> StdEnv(new CqShaderExecEnv(m_pRenderContext));
 	TqInt	array_count = 0;
 	TqUlong  htoken, i;
+	std::string	nativeLib;
 
 	bool fShaderSpec = false;
 	while ( !pFile->eof() )
@@ -1001,6 +1024,12 @@ void CqShaderVM::LoadProgram( std::istream* pFile )
 			continue;
 		}
 
+		if ( nhash == htoken ) // == "NATIVE"
+		{
+			( *pFile ) >> nativeLib;
+			continue;
+		}
+
 		if ( shash == htoken ) // == "segment"
 		{
 			GetToken( token, 255, pFile );
@@ -1011,13 +1040,13 @@ void CqShaderVM::LoadProgram( std::istream* pFile )
 			else if ( ihash == htoken) // == "Init"
 			{
 				Segment = Seg_Init;
-				pProgramArea = &m_ProgramInit;
+				pProgramArea = &m_pProgram->m_ProgramInit;
 				aLabels.clear();
 			}
 			else if (chash == htoken ) // == "Code"
 			{
 				Segment = Seg_Code;
-				pProgramArea = &m_Program;
+				pProgramArea = &m_pProgram->m_Program;
 				aLabels.clear();
 			}
 		}
@@ -1316,10 +1345,11 @@ void CqShaderVM::LoadProgram( std::istream* pFile )
 		( *pFile ) >> std::ws;
 	}
 	// Now we need to complete any label jump statements.
+	std::vector<UsProgramElement>& program = m_pProgram->m_Program;
 	i = 0;
-	while ( i < m_Program.size() )
+	while ( i < program.size() )
 	{
-		UsProgramElement E = m_Program[ i++ ]
+		UsProgramElement E = program[ i++ ]
 		                     ;
 		if ( E.m_Command == &CqShaderVM::SO_jnz ||
 		        E.m_Command == &CqShaderVM::SO_jmp ||
@@ -1328,9 +1358,9 @@ void CqShaderVM::LoadProgram( std::istream* pFile )
 		        E.m_Command == &CqShaderVM::SO_S_JZ)
 		{
 			SqLabel lab;
-			lab.m_Offset = aLabels[ static_cast<unsigned int>( m_Program[ i ].m_FloatVal ) ];
-			lab.m_pAddress = &m_Program[ lab.m_Offset ];
-			m_Program[ i ].m_Label = lab;
+			lab.m_Offset = aLabels[ static_cast<unsigned int>( program[ i ].m_FloatVal ) ];
+			lab.m_pAddress = &program[ lab.m_Offset ];
+			program[ i ].m_Label = lab;
 			i++;
 		}
 		else
@@ -1347,6 +1377,130 @@ void CqShaderVM::LoadProgram( std::istream* pFile )
 			}
 		}
 	}
+	FindSpecialisableParams();
+	if ( fFuse )
+		FuseInstructions();
+	if ( !nativeLib.empty() )
+		LoadNative( nativeLib, StdEnv.get() );
+}
+
+
+//---------------------------------------------------------------------
+/** Check that the name of a native shader library is a plain file name as
+ * written by the native backend, so that an slx file can't name an arbitrary
+ * library to load.
+ */
+
+static bool isValidNativeLibName( const std::string& libName )
+{
+	const std::string suffix( ".so" );
+	if ( libName.size() <= suffix.size() || libName[ 0 ] == '.'
+		|| libName.compare( libName.size() - suffix.size(), suffix.size(), suffix ) != 0 )
+		return ( false );
+	for ( std::string::const_iterator i = libName.begin(); i != libName.end(); i++ )
+	{
+		if ( !isalnum( static_cast<unsigned char>( *i ) ) && *i != '_' && *i != '.' )
+			return ( false );
+	}
+	return ( true );
+}
+
+//---------------------------------------------------------------------
+/** Load the native code for the main program from a shared library.
+ *
+ * The slx file names the library without a directory, and it is looked up
+ * amongst the libraries on the shader search path, in the same way as DSO
+ * shadeops.
+ */
+
+void CqShaderVM::LoadNative( const std::string& libName, IqShaderExecEnv* pStdEnv )
+{
+	typedef int (*TqVersionFunc)();
+	typedef const char* const* (*TqVariablesFunc)();
+	typedef const char* (*TqTypesFunc)();
+
+	if ( !isValidNativeLibName( libName ) )
+	{
+		Aqsis::log() << warning << "Invalid native shader name \"" << libName
+			<< "\", using bytecode" << std::endl;
+		return;
+	}
+	CqString strLibName;
+	for ( std::list<CqString>::const_iterator i = m_DSOPathList.begin();
+		i != m_DSOPathList.end(); i++ )
+	{
+		if ( filename( boostfs::path( *i ) ) == libName )
+		{
+			strLibName = *i;
+			break;
+		}
+	}
+	if ( strLibName.empty() )
+	{
+		Aqsis::log() << warning << "Cannot find native shader \"" << libName
+			<< "\" on the shader search path, using bytecode" << std::endl;
+		return;
+	}
+
+	SqShaderProgram& program = *m_pProgram;
+	void* handle = 0;
+	try
+	{
+		handle = program.m_NativePlugin.SimpleDLOpen( &strLibName );
+	}
+	catch ( XqPluginError& e )
+	{
+		Aqsis::log() << warning << "Cannot load native shader \"" << libName
+			<< "\", using bytecode: " << e.what() << std::endl;
+		return;
+	}
+	CqString versionName( "aqsis_native_version" );
+	CqString variablesName( "aqsis_native_variables" );
+	CqString typesName( "aqsis_native_types" );
+	CqString shadeName( "aqsis_native_shade" );
+	TqVersionFunc pVersion = reinterpret_cast<TqVersionFunc>(
+			program.m_NativePlugin.SimpleDLSym( handle, &versionName ) );
+	TqVariablesFunc pVariables = reinterpret_cast<TqVariablesFunc>(
+			program.m_NativePlugin.SimpleDLSym( handle, &variablesName ) );
+	TqTypesFunc pTypes = reinterpret_cast<TqTypesFunc>(
+			program.m_NativePlugin.SimpleDLSym( handle, &typesName ) );
+	SqShaderProgram::TqNativeShade pShade = reinterpret_cast<SqShaderProgram::TqNativeShade>(
+			program.m_NativePlugin.SimpleDLSym( handle, &shadeName ) );
+	if ( !pVersion || !pVariables || !pTypes || !pShade
+		|| pVersion() != AQSIS_NATIVE_SHADER_VERSION )
+	{
+		Aqsis::log() << warning << "Incompatible native shader \"" << libName
+			<< "\", using bytecode" << std::endl;
+		return;
+	}
+
+	// Resolve the variables in the same way as program operands.
+	std::vector<TqInt> variables;
+	const char* const* names = pVariables();
+	for ( ; *names; ++names )
+	{
+		TqInt iVar;
+		if ( ( iVar = FindLocalVarIndex( *names ) ) >= 0 )
+			variables.push_back( iVar );
+		else if ( ( iVar = pStdEnv->FindStandardVarIndex( *names ) ) >= 0 )
+			variables.push_back( iVar | 0x8000 );
+		else
+		{
+			Aqsis::log() << warning << "Unknown variable \"" << *names << "\" in native shader \""
+				<< libName << "\", using bytecode" << std::endl;
+			return;
+		}
+	}
+	std::string types( pTypes() );
+	if ( types.size() != variables.size() )
+	{
+		Aqsis::log() << warning << "Invalid native shader \"" << libName
+			<< "\", using bytecode" << std::endl;
+		return;
+	}
+	program.m_NativeVariables.swap( variables );
+	program.m_NativeTypes = types;
+	program.m_pNativeShade = pShade;
 }
 
 CqString CqShaderVM::GetString(std::istream* pFile)
@@ -1495,6 +1649,7 @@ void CqShaderVM::Initialise( const TqInt uGridRes, const TqInt vGridRes, TqInt s
 	m_uGridRes = uGridRes;
 	m_vGridRes = vGridRes;
 	m_shadingPointCount = shadingPointCount;
+	m_fSpecialisationOverridden = false;
 
 	// Reset the program counter.
 	m_PC = 0;
@@ -1514,16 +1669,16 @@ CqShaderVM&	CqShaderVM::operator=( const CqShaderVM& From )
 	m_outsideWorld = From.m_outsideWorld;
 	m_pRenderContext = From.m_pRenderContext;
 
-	// Copy the local variables...
+	// Copy the parameters, which hold the values for this instance, and
+	// share the other local variables...
 	std::vector<IqShaderData*>::const_iterator i;
 	for ( i = From.m_LocalVars.begin(); i != From.m_LocalVars.end(); i++ )
-		m_LocalVars.push_back( ( *i ) ->Clone() );
+		m_LocalVars.push_back( IsParameter( *i ) ? ( *i ) ->Clone() : *i );
+	m_SharedLocalVars = From.m_SharedLocalVars;
 
-	// Copy the intialisation program.
-	m_ProgramInit.assign(From.m_ProgramInit.begin(), From.m_ProgramInit.end());
-
-	// Copy the main program.
-	m_Program.assign(From.m_Program.begin(), From.m_Program.end());
+	// ...but share the program.  Only its cache of specialisations changes
+	// after loading, and that is locked.
+	m_pProgram = From.m_pProgram;
 
 	return ( *this );
 }
@@ -1536,27 +1691,184 @@ CqShaderVM&	CqShaderVM::operator=( const CqShaderVM& From )
 void CqShaderVM::Execute(IqShaderExecEnv* pEnv)
 {
 	// Check if there is anything to execute.
-	if ( m_Program.size() <= 0 )
+	const std::vector<UsProgramElement>& program = MainProgram();
+	if ( program.size() <= 0 )
+		return ;
+
+	if ( m_pProgram->m_pNativeShade && ExecuteNative( pEnv ) )
 		return ;
 
 	m_pEnv = pEnv;
+	AttachTempPool();
 
 	pEnv->InvalidateIlluminanceCache();
 
 	// Execute the main program.
-	m_PC = &m_Program[ 0 ];
+	m_PC = &program[ 0 ];
 	m_PO = 0;
-	m_PE = m_Program.size();
-	UsProgramElement* pE;
+	m_PE = program.size();
+	const UsProgramElement* pE;
 
 	while ( !fDone() )
 	{
 		pE = &ReadNext();
 		( this->*pE->m_Command ) ();
 	}
-	// Check that the stack is empty.
+	// Check that the stack is empty.  The storage is kept for the next run.
 	assert( m_iTop == 0 );
-	m_Stack.clear();
+}
+
+
+//---------------------------------------------------------------------
+// Shadeops called back from native shaders.
+
+namespace {
+
+CqVector3D nativePoint( const float* args )
+{
+	return ( CqVector3D( args[ 0 ], args[ 1 ], args[ 2 ] ) );
+}
+
+float nativeFNoise( const float* args, int numArgs )
+{
+	switch ( numArgs )
+	{
+		case 1:
+			return ( CqNoise::FGNoise1( args[ 0 ] ) );
+		case 2:
+			return ( CqNoise::FGNoise2( args[ 0 ], args[ 1 ] ) );
+		case 3:
+			return ( CqNoise::FGNoise3( nativePoint( args ) ) );
+		default:
+			return ( CqNoise::FGNoise4( nativePoint( args ), args[ 3 ] ) );
+	}
+}
+
+void nativePNoise( const float* args, int numArgs, float* result )
+{
+	CqVector3D n;
+	switch ( numArgs )
+	{
+		case 1:
+			n = CqNoise::PGNoise1( args[ 0 ] );
+			break;
+		case 2:
+			n = CqNoise::PGNoise2( args[ 0 ], args[ 1 ] );
+			break;
+		case 3:
+			n = CqNoise::PGNoise3( nativePoint( args ) );
+			break;
+		default:
+			n = CqNoise::PGNoise4( nativePoint( args ), args[ 3 ] );
+			break;
+	}
+	result[ 0 ] = n.x();
+	result[ 1 ] = n.y();
+	result[ 2 ] = n.z();
+}
+
+void nativeCNoise( const float* args, int numArgs, float* result )
+{
+	CqColor n;
+	switch ( numArgs )
+	{
+		case 1:
+			n = CqNoise::CGNoise1( args[ 0 ] );
+			break;
+		case 2:
+			n = CqNoise::CGNoise2( args[ 0 ], args[ 1 ] );
+			break;
+		case 3:
+			n = CqNoise::CGNoise3( nativePoint( args ) );
+			break;
+		default:
+			n = CqNoise::CGNoise4( nativePoint( args ), args[ 3 ] );
+			break;
+	}
+	result[ 0 ] = n.r();
+	result[ 1 ] = n.g();
+	result[ 2 ] = n.b();
+}
+
+} // unnamed namespace
+
+//---------------------------------------------------------------------
+/**	Run the native code for the main program over the shading points.
+*/
+
+bool CqShaderVM::ExecuteNative( IqShaderExecEnv* pEnv )
+{
+	const SqShaderProgram& program = *m_pProgram;
+	TqUint count = pEnv->shadingPointCount();
+	TqUint numVars = program.m_NativeVariables.size();
+	std::vector<float*> vars( numVars + 1, static_cast<float*>( 0 ) );
+	std::vector<int> varying( numVars + 1, 0 );
+	for ( TqUint i = 0; i < numVars; i++ )
+	{
+		TqInt iVar = program.m_NativeVariables[ i ];
+		IqShaderData* pVar = ( iVar & 0x8000 ) ? pEnv->pVar( iVar & 0x7FFF ) : m_LocalVars[ iVar ];
+		if ( !pVar || pVar->isArray() )
+			return ( false );
+		// The native code reads a single value for all points, or one per
+		// point, and can only write to the latter.
+		TqUint size = pVar->Size();
+		bool fWrite = isupper( program.m_NativeTypes[ i ] ) != 0;
+		if ( ( size != 1 && size < count ) || ( fWrite && size == 1 && count > 1 ) )
+			return ( false );
+		varying[ i ] = size > 1;
+
+		bool fTriple = tolower( program.m_NativeTypes[ i ] ) == 't';
+		CqVector3D* pVec = 0;
+		CqColor* pCol = 0;
+		switch ( pVar->Type() )
+		{
+			case type_float:
+				if ( fTriple )
+					return ( false );
+				pVar->GetFloatPtr( vars[ i ] );
+				break;
+			case type_point:
+				pVar->GetPointPtr( pVec );
+				break;
+			case type_vector:
+				pVar->GetVectorPtr( pVec );
+				break;
+			case type_normal:
+				pVar->GetNormalPtr( pVec );
+				break;
+			case type_color:
+				pVar->GetColorPtr( pCol );
+				break;
+			default:
+				return ( false );
+		}
+		if ( pVar->Type() != type_float )
+		{
+			if ( !fTriple )
+				return ( false );
+			vars[ i ] = pVec ? &( *pVec )[ 0 ] : &( *pCol )[ 0 ];
+		}
+	}
+
+	const CqBitVector& runningState = pEnv->RunningState();
+	std::vector<unsigned char> running( count + 1, 0 );
+	for ( TqUint i = 0; i < count; i++ )
+		running[ i ] = runningState.Value( i );
+
+	CqGridDiff diff = pEnv->GridDiff();
+	SqShaderProgram::SqNativeShadingEnv env;
+	env.uSize = diff.uRes();
+	env.vSize = diff.vRes();
+	// The native code only finds neighbours on a complete grid.
+	bool fGrid = env.uSize * env.vSize == static_cast<TqInt>( count );
+	env.uDiffZero = diff.uDiffZero() || !fGrid;
+	env.vDiffZero = diff.vDiffZero() || !fGrid;
+	env.centred = diff.useCentred();
+	env.fnoise = nativeFNoise;
+	env.pnoise = nativePNoise;
+	env.cnoise = nativeCNoise;
+	program.m_pNativeShade( &vars[ 0 ], &varying[ 0 ], count, &running[ 0 ], &env );
+	return ( true );
 }
 
 
@@ -1567,7 +1879,8 @@ void CqShaderVM::Execute(IqShaderExecEnv* pEnv)
 void CqShaderVM::ExecuteInit()
 {
 	// Check if there is anything to execute.
-	if ( m_ProgramInit.size() <= 0 )
+	const std::vector<UsProgramElement>& programInit = m_pProgram->m_ProgramInit;
+	if ( programInit.size() <= 0 )
 		return ;
 
 	// Fake an environment
@@ -1576,21 +1889,21 @@ void CqShaderVM::ExecuteInit()
 	CqShaderExecEnv Env(m_pRenderContext);
 	Env.Initialise( 1, 1, 1, 1, false, IqAttributesPtr(), IqTransformPtr(), this, m_Uses );
 	Initialise( 1, 1, 1, &Env );
+	AttachTempPool();
 
 	// Execute the init program.
-	m_PC = &m_ProgramInit[ 0 ];
+	m_PC = &programInit[ 0 ];
 	m_PO = 0;
-	m_PE = m_ProgramInit.size();
-	UsProgramElement* pE;
+	m_PE = programInit.size();
+	const UsProgramElement* pE;
 
 	while ( !fDone() )
 	{
 		pE = &ReadNext();
 		( this->*pE->m_Command ) ();
 	}
-	// Check that the stack is empty.
+	// Check that the stack is empty.  The storage is kept for the next run.
 	assert( m_iTop == 0 );
-	m_Stack.clear();
 
 	m_pEnv = pOldEnv;
 }
@@ -1852,15 +2165,14 @@ void CqShaderVM::InitialiseParameters( )
 	for( std::vector<IqShaderData*>::iterator i = m_LocalVars.begin();
 		 i != m_LocalVars.end(); ++i )
 	{
-		IqShaderData::EqStorage storeType = (*i)->Storage();
-		if( storeType == IqShaderData::Parameter ||
-			storeType == IqShaderData::OutputParameter )
+		if( IsParameter(*i) )
 		{
 			// Record shader parameters only, not temporary vars
 			m_InstancedParams.push_back((*i)->Clone());
 			m_InstancedParams.push_back((*i));
 		}
 	}
+	Specialise();
 }
 
 
@@ -1876,7 +2188,10 @@ void CqShaderVM::SetArgument( IqParameter* pParam, IqSurface* pSurface )
 	{
 		IqShaderData* pVar = m_LocalVars[ i ];
 		if(pVar->Type() == pParam->Type())
+		{
 			pParam->Dice(m_uGridRes,m_vGridRes,pVar,pSurface);
+			ParamOverridden( i );
+		}
 	}
 }
 
@@ -1890,7 +2205,11 @@ IqShaderData* CqShaderVM::FindArgument( const CqString& name )
 	// Find the relevant variable.
 	TqInt i = FindLocalVarIndex( name.c_str() );
 	if ( i >= 0 )
+	{
+		// The caller may set the value.
+		ParamOverridden( i );
 		return( m_LocalVars[ i ] );
+	}
 	else
 		return( NULL );
 }
@@ -1929,91 +2248,533 @@ const std::vector<IqShaderData*>& CqShaderVM::GetArguments() const
 
 
 //---------------------------------------------------------------------
-/**
- *  Shutdown the engine, releasing any static data it may hold on to during it's lifetime..
+/** Note that a parameter may have been given a value for the current grid
+ * other than the instance value.
  */
 
-void CqShaderVM::ShutdownShaderEngine()
+void CqShaderVM::ParamOverridden( TqInt iVar )
 {
-	// Free any temporary variables in the buckets.
-	while( !m_UFPool.empty() )
-	{
-		delete(m_UFPool.front());
-		m_UFPool.pop_front();
-	}
-	while( !m_VFPool.empty() )
+	const std::vector<TqInt>& params = m_pProgram->m_SpecialisableParams;
+	if ( std::find( params.begin(), params.end(), iVar ) != params.end() )
+		m_fSpecialisationOverridden = true;
+}
+
+
+//---------------------------------------------------------------------
+/** Determine whether a command is a jump, taking a label parameter.
+ */
+
+bool CqShaderVM::IsJump( void( CqShaderVM::*pCommand ) () )
+{
+	return ( pCommand == &CqShaderVM::SO_jnz ||
+	         pCommand == &CqShaderVM::SO_jmp ||
+	         pCommand == &CqShaderVM::SO_jz ||
+	         pCommand == &CqShaderVM::SO_RS_JZ ||
+	         pCommand == &CqShaderVM::SO_S_JZ );
+}
+
+
+//---------------------------------------------------------------------
+/** Mark the program elements which are the target of a jump.
+ */
+
+void CqShaderVM::FindJumpTargets( const std::vector<UsProgramElement>& program, std::vector<bool>& target )
+{
+	target.assign( program.size(), false );
+	TqUint i = 0;
+	while ( i < program.size() )
 	{
-		delete(m_VFPool.front());
-		m_VFPool.pop_front();
+		const SqOpCodeTrans* pOp = FindOpCode( program[ i ].m_Command );
+		if ( IsJump( pOp->m_pCommand ) )
+			target[ program[ i + 1 ].m_Label.m_Offset ] = true;
+		i += 1 + pOp->m_cParams;
 	}
+}
+
 
-	while( !m_UPPool.empty() )
+//---------------------------------------------------------------------
+/** Copy a program, dropping the removed elements and relocating the jump
+ * labels into the copy.
+ */
+
+void CqShaderVM::CompactProgram( const std::vector<UsProgramElement>& program, const std::vector<bool>& removed, std::vector<UsProgramElement>& compact )
+{
+	compact.clear();
+	// Drop the removed elements, noting where the rest end up.
+	std::vector<TqInt> newOffset( program.size() );
+	for ( TqUint i = 0; i < program.size(); i++ )
 	{
-		delete(m_UPPool.front());
-		m_UPPool.pop_front();
+		newOffset[ i ] = compact.size();
+		if ( !removed[ i ] )
+			compact.push_back( program[ i ] );
 	}
-	while( !m_VPPool.empty() )
+	// Relocate the jump labels into the new program.
+	TqUint i = 0;
+	while ( i < compact.size() )
 	{
-		delete(m_VPPool.front());
-		m_VPPool.pop_front();
+		const SqOpCodeTrans* pOp = FindOpCode( compact[ i ].m_Command );
+		if ( IsJump( pOp->m_pCommand ) )
+		{
+			SqLabel& lab = compact[ i + 1 ].m_Label;
+			lab.m_Offset = newOffset[ lab.m_Offset ];
+			lab.m_pAddress = &compact[ lab.m_Offset ];
+		}
+		i += 1 + pOp->m_cParams;
 	}
+}
 
-	while( !m_USPool.empty() )
-	{
-		delete(m_USPool.front());
-		m_USPool.pop_front();
-	}
-	while( !m_VSPool.empty() )
+
+//---------------------------------------------------------------------
+/** Find the translation table entry for a command.
+ */
+
+const SqOpCodeTrans* CqShaderVM::FindOpCode( void( CqShaderVM::*pCommand ) () )
+{
+	for ( TqInt i = 0; i < m_cTransSize; i++ )
 	{
-		delete(m_VSPool.front());
-		m_VSPool.pop_front();
+		if ( m_TransTable[ i ].m_pCommand == pCommand )
+			return ( &m_TransTable[ i ] );
 	}
+	return ( 0 );
+}
+
 
-	while( !m_UCPool.empty() )
+//---------------------------------------------------------------------
+/** Evaluate a binary float operation on uniform operands at load time.
+ * \param a The operand on top of the stack.
+ * \param b The operand below it.
+ * \param result Set to the value of the operation.
+ * \return false if the command can't be folded.
+ */
+
+bool CqShaderVM::FoldFloatOp( void( CqShaderVM::*pCommand ) (), TqFloat a, TqFloat b, TqFloat& result )
+{
+	if ( pCommand == &CqShaderVM::SO_addff )
+		result = a + b;
+	else if ( pCommand == &CqShaderVM::SO_subff )
+		result = a - b;
+	else if ( pCommand == &CqShaderVM::SO_mulff )
+		result = a * b;
+	else if ( pCommand == &CqShaderVM::SO_divff && b != 0 )
+		result = a / b;
+	else if ( pCommand == &CqShaderVM::SO_lsff )
+		result = a < b;
+	else if ( pCommand == &CqShaderVM::SO_gtff )
+		result = a > b;
+	else if ( pCommand == &CqShaderVM::SO_leff )
+		result = a <= b;
+	else if ( pCommand == &CqShaderVM::SO_geff )
+		result = a >= b;
+	else if ( pCommand == &CqShaderVM::SO_eqff )
+		result = a == b;
+	else if ( pCommand == &CqShaderVM::SO_neff )
+		result = a != b;
+	else
+		return ( false );
+	return ( true );
+}
+
+
+//---------------------------------------------------------------------
+/** Find the uniform float parameters which are only pushed as operands of
+ * foldable operations.  Any other use, such as assignment or passing as an
+ * output argument to a shadeop, might modify the parameter.
+ */
+
+void CqShaderVM::FindSpecialisableParams()
+{
+	const std::vector<UsProgramElement>& program = m_pProgram->m_Program;
+	std::vector<bool> specialisable( m_LocalVars.size() );
+	for ( TqUint iVar = 0; iVar < m_LocalVars.size(); iVar++ )
 	{
-		delete(m_UCPool.front());
-		m_UCPool.pop_front();
+		const IqShaderData* pVar = m_LocalVars[ iVar ];
+		specialisable[ iVar ] = pVar->Storage() == IqShaderData::Parameter &&
+		                        pVar->Class() == class_uniform &&
+		                        pVar->Type() == type_float &&
+		                        pVar->ArrayLength() == 0;
 	}
-	while( !m_VCPool.empty() )
+
+	TqUint i = 0;
+	while ( i < program.size() )
 	{
-		delete(m_VCPool.front());
-		m_VCPool.pop_front();
+		const SqOpCodeTrans* pOp = FindOpCode( program[ i ].m_Command );
+		assert( pOp );
+		// The parameter of an external call is the call descriptor.
+		if ( pOp->m_pCommand != &CqShaderVM::SO_external )
+		{
+			for ( TqInt p = 0; p < pOp->m_cParams; p++ )
+			{
+				if ( pOp->m_aParamTypes[ p ] != type_invalid )
+					continue;
+				TqInt iVar = program[ i + 1 + p ].m_iVariable;
+				if ( iVar & 0x8000 )
+					continue;
+				// The value must be consumed by a foldable operation, either
+				// directly or after one more operand is pushed.
+				TqFloat dummy;
+				TqUint next = i + 2;
+				bool fRead = false;
+				if ( pOp->m_pCommand == &CqShaderVM::SO_pushv && next < program.size() )
+				{
+					if ( program[ next ].m_Command == &CqShaderVM::SO_pushif ||
+					        program[ next ].m_Command == &CqShaderVM::SO_pushv )
+						next += 2;
+					fRead = next < program.size() &&
+					        FoldFloatOp( program[ next ].m_Command, 0, 1, dummy );
+				}
+				if ( !fRead )
+					specialisable[ iVar ] = false;
+			}
+		}
+		i += 1 + pOp->m_cParams;
 	}
 
-	while( !m_UNPool.empty() )
+	m_pProgram->m_SpecialisableParams.clear();
+	for ( TqUint iVar = 0; iVar < specialisable.size(); iVar++ )
 	{
-		delete(m_UNPool.front());
-		m_UNPool.pop_front();
+		if ( specialisable[ iVar ] )
+			m_pProgram->m_SpecialisableParams.push_back( iVar );
 	}
-	while( !m_VNPool.empty() )
+}
+
+
+//---------------------------------------------------------------------
+/** Find the index of a float operation which can be fused, in the order
+ * add, subtract, multiply, divide.
+ * \return -1 if the command can't be fused.
+ */
+
+TqInt CqShaderVM::FusedOpIndex( void( CqShaderVM::*pCommand ) () )
+{
+	if ( pCommand == &CqShaderVM::SO_addff )
+		return ( 0 );
+	else if ( pCommand == &CqShaderVM::SO_subff )
+		return ( 1 );
+	else if ( pCommand == &CqShaderVM::SO_mulff )
+		return ( 2 );
+	else if ( pCommand == &CqShaderVM::SO_divff )
+		return ( 3 );
+	return ( -1 );
+}
+
+
+//---------------------------------------------------------------------
+/** Check whether a push can be an operand of a fused instruction.  Pushes
+ * of specialisable parameters are left alone, so that Specialise() can still
+ * fold them.
+ */
+
+bool CqShaderVM::IsFusableOperand( const UsProgramElement* pPush, const std::vector<TqInt>& params )
+{
+	if ( pPush->m_Command == &CqShaderVM::SO_pushif )
+		return ( true );
+	return ( pPush->m_Command == &CqShaderVM::SO_pushv &&
+	         std::find( params.begin(), params.end(), pPush[ 1 ].m_iVariable ) == params.end() );
+}
+
+
+//---------------------------------------------------------------------
+/** Fuse each sequence of pushes and float arithmetic whose result is popped
+ * straight into a variable.  The sequences are
+ *
+ * \verbatim
+ *   push x; push y; op; pop d              ->  fusedff y x op d
+ *   push x; push y; push z; op1; op2; pop d  ->  fusedfff z y x op1 op2 d
+ *   push x; push y; op1; push z; op2; pop d  ->  fusedfff y x z op1 op2 d
+ * \endverbatim
+ *
+ * where each push is a pushv or pushif, and op2 of the last form is an
+ * addition or multiplication, so that its operands can be swapped.  The
+ * fused instructions compute op( a, b ) and op2( op1( a, b ), c ) of their
+ * operands a, b and c, as the stack operations do for the operand on top.
+ *
+ * Sequences containing a jump target are left alone.
+ */
+
+void CqShaderVM::FuseInstructions()
+{
+	std::vector<UsProgramElement>& program = m_pProgram->m_Program;
+	const std::vector<TqInt>& params = m_pProgram->m_SpecialisableParams;
+	std::vector<bool> target;
+	FindJumpTargets( program, target );
+	std::vector<bool> removed( program.size(), false );
+	TqInt cFused = 0;
+	TqUint i = 0;
+	while ( i < program.size() )
 	{
-		delete(m_VNPool.front());
-		m_VNPool.pop_front();
+		const SqOpCodeTrans* pOp = FindOpCode( program[ i ].m_Command );
+		TqUint next = i + 1 + pOp->m_cParams;
+
+		// Follow the stack through a run of pushes and operations, which
+		// must leave a single value to be popped.
+		TqUint pushes[ 3 ];
+		TqInt cPushes = 0;
+		TqUint ops[ 2 ];
+		TqInt cOps = 0;
+		TqUint pop = 0;
+		TqUint j = i;
+		while ( j < program.size() && ( j == i || !target[ j ] ) )
+		{
+			if ( IsFusableOperand( &program[ j ], params ) && cPushes < 3 )
+			{
+				pushes[ cPushes++ ] = j;
+				j += 2;
+			}
+			else if ( FusedOpIndex( program[ j ].m_Command ) >= 0 && cOps < 2 &&
+			          cPushes - cOps >= 2 )
+			{
+				ops[ cOps++ ] = j;
+				j++;
+			}
+			else
+			{
+				if ( program[ j ].m_Command == &CqShaderVM::SO_pop &&
+				        cOps > 0 && cPushes - cOps == 1 )
+					pop = j;
+				break;
+			}
+		}
+
+		// The operands in the order the fused instruction takes them.
+		TqUint operands[ 3 ];
+		bool fFuse = pop != 0;
+		if ( fFuse && cOps == 2 && ops[ 0 ] < pushes[ 2 ] )
+		{
+			// The last operand was pushed after the first operation, so is
+			// on top for the second.
+			operands[ 0 ] = pushes[ 1 ];
+			operands[ 1 ] = pushes[ 0 ];
+			operands[ 2 ] = pushes[ 2 ];
+			fFuse = program[ ops[ 1 ] ].m_Command == &CqShaderVM::SO_addff ||
+			        program[ ops[ 1 ] ].m_Command == &CqShaderVM::SO_mulff;
+		}
+		else if ( fFuse )
+		{
+			for ( TqInt k = 0; k < cPushes; k++ )
+				operands[ k ] = pushes[ cPushes - 1 - k ];
+		}
+
+		if ( fFuse )
+		{
+			UsProgramElement E[ 8 ];
+			TqInt cE = 0;
+			E[ cE++ ].m_Command = cPushes == 2 ? &CqShaderVM::SO_fusedff : &CqShaderVM::SO_fusedfff;
+			TqInt immediates = 0;
+			for ( TqInt k = 0; k < cPushes; k++ )
+			{
+				if ( program[ operands[ k ] ].m_Command == &CqShaderVM::SO_pushif )
+					immediates |= 1 << k;
+			}
+			E[ cE++ ].m_intVal = immediates;
+			for ( TqInt k = 0; k < cPushes; k++ )
+				E[ cE++ ] = program[ operands[ k ] + 1 ];
+			for ( TqInt k = 0; k < cOps; k++ )
+				E[ cE++ ].m_Command = program[ ops[ k ] ].m_Command;
+			E[ cE++ ].m_iVariable = program[ pop + 1 ].m_iVariable;
+			// The fused instruction is always shorter than the sequence.
+			std::copy( E, E + cE, program.begin() + i );
+			next = pop + 2;
+			std::fill( removed.begin() + i + cE, removed.begin() + next, true );
+			cFused++;
+		}
+		i = next;
 	}
+	if ( cFused == 0 )
+		return;
+
+	std::vector<UsProgramElement> compact;
+	CompactProgram( program, removed, compact );
+	program.swap( compact );
+	Aqsis::log() << debug << "Fused " << cFused << " instruction sequences in shader \""
+		<< strName().c_str() << "\"" << std::endl;
+}
+
 
-	while( !m_UVPool.empty() )
+//---------------------------------------------------------------------
+/** Fold the current values of the specialisable parameters into a copy of
+ * the main program.
+ */
+
+void CqShaderVM::Specialise()
+{
+	m_pSpecialisedProgram.reset();
+	const std::vector<TqInt>& params = m_pProgram->m_SpecialisableParams;
+	if ( params.empty() )
+		return;
+
+	std::vector<TqFloat> values( params.size() );
+	for ( TqUint iParam = 0; iParam < params.size(); iParam++ )
+		m_LocalVars[ params[ iParam ] ] ->GetFloat( values[ iParam ] );
+
+#	ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock( m_pProgram->m_SpecialisationsMutex );
+#	endif
+	SqShaderProgram::TqSpecialisations& cache = m_pProgram->m_Specialisations;
+	SqShaderProgram::TqSpecialisations::iterator cached = cache.find( values );
+	if ( cached != cache.end() )
 	{
-		delete(m_UVPool.front());
-		m_UVPool.pop_front();
+		m_pSpecialisedProgram = cached->second;
+		return;
 	}
-	while( !m_VVPool.empty() )
+	// Each specialisation is a full copy of the program, so don't make an
+	// unbounded number of them.
+	const TqUint maxSpecialisations = 64;
+	if ( cache.size() >= maxSpecialisations )
+		return;
+
+	const std::vector<UsProgramElement>& program = m_pProgram->m_Program;
+	std::vector<UsProgramElement> folded( program );
+	// Elements replaced by folding, and the targets of jumps, which end a
+	// straight run of code.
+	std::vector<bool> removed( program.size(), false );
+	std::vector<bool> target;
+	FindJumpTargets( program, target );
+
+	// Track the constant pushes at the top of the stack within each straight
+	// run of code, and fold each operation on two of them.
+	std::vector<TqUint> constPushes;
+	bool fFolded = false;
+	TqUint i = 0;
+	while ( i < folded.size() )
 	{
-		delete(m_VVPool.front());
-		m_VVPool.pop_front();
+		if ( removed[ i ] )
+		{
+			i++;
+			continue;
+		}
+		if ( target[ i ] )
+			constPushes.clear();
+		const SqOpCodeTrans* pOp = FindOpCode( folded[ i ].m_Command );
+		TqUint next = i + 1 + pOp->m_cParams;
+		TqFloat value;
+		if ( pOp->m_pCommand == &CqShaderVM::SO_pushif )
+			constPushes.push_back( i );
+		else if ( pOp->m_pCommand == &CqShaderVM::SO_pushv &&
+		          std::find( params.begin(), params.end(), folded[ i + 1 ].m_iVariable ) != params.end() )
+			constPushes.push_back( i );
+		else if ( constPushes.size() >= 2 )
+		{
+			// Any other instruction clears the list, so both operands were
+			// pushed immediately before this operation.
+			TqFloat operand[ 2 ];
+			for ( TqInt j = 0; j < 2; j++ )
+			{
+				const UsProgramElement* pPush = &folded[ *( constPushes.end() - 2 + j ) ];
+				if ( pPush->m_Command == &CqShaderVM::SO_pushif )
+					operand[ j ] = pPush[ 1 ].m_FloatVal;
+				else
+					operand[ j ] = values[ std::find( params.begin(), params.end(),
+					                               pPush[ 1 ].m_iVariable ) - params.begin() ];
+			}
+			if ( FoldFloatOp( pOp->m_pCommand, operand[ 1 ], operand[ 0 ], value ) )
+			{
+				TqUint start = *( constPushes.end() - 2 );
+				folded[ start ].m_Command = &CqShaderVM::SO_pushif;
+				folded[ start + 1 ].m_FloatVal = value;
+				std::fill( removed.begin() + start + 2, removed.begin() + next, true );
+				constPushes.pop_back();
+				fFolded = true;
+			}
+			else
+				constPushes.clear();
+		}
+		else
+			constPushes.clear();
+		i = next;
 	}
-
-	while( !m_UMPool.empty() )
+	if ( !fFolded )
 	{
-		delete(m_UMPool.front());
-		m_UMPool.pop_front();
+		cache[ values ] = boost::shared_ptr<const std::vector<UsProgramElement> >();
+		return;
 	}
-	while( !m_VMPool.empty() )
+
+	boost::shared_ptr<std::vector<UsProgramElement> > pSpecialised( new std::vector<UsProgramElement>() );
+	std::vector<UsProgramElement>& compact = *pSpecialised;
+	CompactProgram( folded, removed, compact );
+	Aqsis::log() << debug << "Specialised shader \"" << strName().c_str() << "\" from "
+		<< program.size() << " to " << compact.size() << " program elements" << std::endl;
+	m_pSpecialisedProgram = pSpecialised;
+	cache[ values ] = m_pSpecialisedProgram;
+}
+
+
+//---------------------------------------------------------------------
+/** The main program to run on the current grid, which is the specialised
+ * copy unless a specialised parameter has been overridden.
+ */
+
+const std::vector<UsProgramElement>& CqShaderVM::MainProgram() const
+{
+	if ( m_pSpecialisedProgram && !m_fSpecialisationOverridden )
+		return ( *m_pSpecialisedProgram );
+	return ( m_pProgram->m_Program );
+}
+
+
+//---------------------------------------------------------------------
+/** Write the main program as it will be run, one instruction per line.
+ */
+
+void CqShaderVM::DisassembleProgram( std::ostream& out ) const
+{
+	const std::vector<UsProgramElement>& program = MainProgram();
+	TqUint i = 0;
+	while ( i < program.size() )
 	{
-		delete(m_VMPool.front());
-		m_VMPool.pop_front();
+		const SqOpCodeTrans* pOp = FindOpCode( program[ i ].m_Command );
+		assert( pOp );
+		out << i << ": " << pOp->m_strName;
+		// Operands of fused instructions may be constants.
+		TqInt immediates = 0;
+		if ( pOp->m_pCommand == &CqShaderVM::SO_fusedff || pOp->m_pCommand == &CqShaderVM::SO_fusedfff )
+			immediates = program[ i + 1 ].m_intVal << 1;
+		for ( TqInt p = 0; p < pOp->m_cParams; p++ )
+		{
+			const UsProgramElement& param = program[ i + 1 + p ];
+			out << " ";
+			if ( IsJump( pOp->m_pCommand ) )
+			{
+				// Print where the jump actually goes, rather than the offset
+				// it was loaded with.
+				out << "@" << ( param.m_Label.m_pAddress - &program[ 0 ] );
+			}
+			else if ( pOp->m_pCommand == &CqShaderVM::SO_external )
+				out << "<call>";
+			else if ( immediates & ( 1 << p ) )
+				out << param.m_FloatVal;
+			else if ( pOp->m_aParamTypes[ p ] == type_invalid )
+			{
+				if ( param.m_iVariable & 0x8000 )
+					out << "$" << ( param.m_iVariable & 0x7fff );
+				else
+					out << m_LocalVars[ param.m_iVariable ] ->strName().c_str();
+			}
+			else if ( pOp->m_aParamTypes[ p ] == type_void )
+				out << FindOpCode( param.m_Command ) ->m_strName;
+			else if ( pOp->m_aParamTypes[ p ] == type_float )
+				out << param.m_FloatVal;
+			else if ( pOp->m_aParamTypes[ p ] == type_integer )
+				out << param.m_intVal;
+			else if ( pOp->m_aParamTypes[ p ] == type_string )
+				out << "\"" << param.m_pString->c_str() << "\"";
+		}
+		out << "\n";
+		i += 1 + pOp->m_cParams;
 	}
 }
 
 
+//---------------------------------------------------------------------
+/**
+ *  Shutdown the engine, releasing any static data it may hold on to during it's lifetime..
+ */
+
+void CqShaderVM::ShutdownShaderEngine()
+{
+	// Free any temporary variables in the buckets.
+	FreeTempPool();
+}
+
+
 } // namespace Aqsis
 //---------------------------------------------------------------------
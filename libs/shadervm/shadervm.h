@@ -29,7 +29,14 @@
 
 #include	<vector>
 #include	<list>
+#include	<map>
+#include	<iosfwd>
+#include	<string>
+#include	<boost/noncopyable.hpp>
 #include	<boost/shared_ptr.hpp>
+#ifdef ENABLE_THREADING
+#	include	<boost/thread/mutex.hpp>
+#endif
 
 #include	<aqsis/aqsis.h>
 
@@ -37,6 +44,7 @@
 #include	<aqsis/math/vector3d.h>
 #include	<aqsis/math/color.h>
 #include	<aqsis/util/sstring.h>
+#include	<aqsis/util/plugins.h>
 #include	<aqsis/math/matrix.h>
 #include	<aqsis/math/noise.h>
 #include	<aqsis/shadervm/ishaderdata.h>
@@ -105,9 +113,76 @@ union UsProgramElement
 	SqDSOExternalCall *m_pExtCall	;		///< Call a DSO function
 };
 
+//----------------------------------------------------------------------
+/** \struct SqShaderProgram
+ * The bytecodes of a compiled shader, shared by all instances of the shader.
+ *
+ * CqShaderVM::LoadProgram() fills in everything but m_Specialisations before
+ * the program is shared: it reads the bytecodes and resolves their jump
+ * labels, finds the specialisable parameters, rewrites m_Program in place
+ * with fused instructions (see CqShaderVM::FuseInstructions()) and loads any
+ * native code.  None of that changes once loading has finished.  Jump labels
+ * hold absolute addresses within the program, so it can't be copied.
+ *
+ * m_Specialisations is the exception.  CqShaderVM::Specialise() adds to it
+ * under m_SpecialisationsMutex whenever an instance is initialised with new
+ * parameter values, so it grows while rendering.  Entries are never removed
+ * or replaced, and each specialised program is itself immutable.
+ */
+
+struct SqShaderProgram : boost::noncopyable
+{
+	std::vector<UsProgramElement>	m_ProgramInit;		///< Bytecodes of the intialisation program.
+	std::vector<UsProgramElement>	m_Program;			///< Bytecodes of the main program.
+	std::list<CqString*>			m_ProgramStrings;	///< Strings used by the program, which are stored additionally as UsProgramElements.
+
+	/// Indices of the uniform float parameters which the main program only
+	/// reads as operands of simple arithmetic.
+	std::vector<TqInt>	m_SpecialisableParams;
+	typedef std::map<std::vector<TqFloat>, boost::shared_ptr<const std::vector<UsProgramElement> > > TqSpecialisations;
+	/// Specialised main programs, by the values of m_SpecialisableParams.
+	/// A null program means specialising had no effect.
+	TqSpecialisations	m_Specialisations;
+#	ifdef ENABLE_THREADING
+	boost::mutex	m_SpecialisationsMutex;	///< Protects m_Specialisations.
+#	endif
+
+	/// Grid and callbacks passed to a native shader, see AQSIS_NATIVE_SHADER_VERSION.
+	struct SqNativeShadingEnv
+	{
+		int	uSize;
+		int	vSize;
+		int	uDiffZero;
+		int	vDiffZero;
+		int	centred;
+		float	(*fnoise)( const float* args, int numArgs );
+		void	(*pnoise)( const float* args, int numArgs, float* result );
+		void	(*cnoise)( const float* args, int numArgs, float* result );
+	};
+	/// Entry point of a native shader, see AQSIS_NATIVE_SHADER_VERSION.
+	typedef void (*TqNativeShade)( float* const* vars, const int* varying,
+			int count, const unsigned char* running, const SqNativeShadingEnv* env );
+	/// Main program compiled to native code, or null if there is none.
+	TqNativeShade	m_pNativeShade;
+	/// Variables used by the native code, indexed as for program operands.
+	std::vector<TqInt>	m_NativeVariables;
+	/// Type code of each variable, as given by aqsis_native_types().
+	std::string	m_NativeTypes;
+	CqSimplePlugin	m_NativePlugin;	///< Keeps the native library loaded.
+
+	SqShaderProgram();
+	~SqShaderProgram();
+};
+
+
 //----------------------------------------------------------------------
 /** \class CqShaderVM
  * Main class handling the execution of a program in shader language bytecodes.
+ *
+ * Copies share the program, and only duplicate the per-instance state: the
+ * parameters and the arguments.  Other local variables only carry values
+ * within a single run of the program, and shading is serialised, so copies
+ * share those too.
  */
 
 class AQSIS_SHADERVM_SHARE CqShaderVM : public CqShaderStack, public IqShader, public CqDSORepository
@@ -205,20 +280,82 @@ class AQSIS_SHADERVM_SHARE CqShaderVM : public CqShaderStack, public IqShader, p
 		 */
 		CqShaderVM&	operator=( const CqShaderVM& From );
 
+		/** \brief Determine whether this shader runs the same main program as another.
+		 *
+		 * Copies share the program they were loaded with, and instances
+		 * whose parameters have the same values share its specialisation.
+		 */
+		bool	SharesMainProgram( const CqShaderVM& other ) const
+		{
+			return ( &MainProgram() == &other.MainProgram() );
+		}
+
+		/** \brief Write out the main program which will be run.
+		 *
+		 * This is the program after instruction fusion, and specialisation
+		 * for the current parameter values.  Each instruction is written on
+		 * a line as "offset: opcode params", with jump targets as "@offset".
+		 */
+		void	DisassembleProgram( std::ostream& out ) const;
+
 	private:
 		/** \brief Load a compiled shader program from the given stream
 		 *
+		 * \param fFuse - whether to fuse instruction sequences in the main
+		 *   program, see FuseInstructions().
 		 * \throw XqBadShader If the program was compiled with a different
 		 *   version of aqsis, or is invalid in any other way.
 		 */
-		void	LoadProgram( std::istream* pFile );
+		void	LoadProgram( std::istream* pFile, bool fFuse = true );
+		/** \brief Load the native code for the main program.
+		 *
+		 * If the library can't be used the shader still runs the bytecode,
+		 * so failures are only warnings.
+		 */
+		void	LoadNative( const std::string& libName, IqShaderExecEnv* pStdEnv );
+		const std::vector<UsProgramElement>&	MainProgram() const;
 		void	Execute( IqShaderExecEnv* pEnv );
+		/** \brief Run the native code for the main program.
+		 *
+		 * \return false if the variables don't have the layout the native
+		 *   code needs, in which case the bytecode must be run instead.
+		 */
+		bool	ExecuteNative( IqShaderExecEnv* pEnv );
 		void	ExecuteInit();
+		/// Find the parameters which Specialise() may fold into the program.
+		void	FindSpecialisableParams();
+		/** \brief Select a main program specialised for the current parameter values.
+		 *
+		 * Wherever the program does arithmetic or comparisons purely on
+		 * constants and specialisable parameters, the result is folded into a
+		 * single constant.  The specialised program is cached with the shared
+		 * program, so instances with the same values share it.
+		 */
+		void	Specialise();
+		void	ParamOverridden( TqInt iVar );
+		/** \brief Replace common instruction sequences in the main program with superinstructions.
+		 *
+		 * One or two float operations on pushed variables or constants, whose
+		 * result is popped straight into a variable, become a single
+		 * SO_fusedff or SO_fusedfff.  These work on the variables directly
+		 * instead of through the stack.
+		 */
+		void	FuseInstructions();
+		/// Run a superinstruction made by FuseInstructions() with cOperands operands.
+		void	ExecuteFused( TqInt cOperands );
+		static	bool	IsFusableOperand( const UsProgramElement* pPush, const std::vector<TqInt>& params );
+		static	TqInt	FusedOpIndex( void( CqShaderVM::*pCommand ) () );
+		void	AssignRunning( IqShaderData* pV, IqShaderData* pVal );
+		static	bool	IsJump( void( CqShaderVM::*pCommand ) () );
+		static	void	FindJumpTargets( const std::vector<UsProgramElement>& program, std::vector<bool>& target );
+		static	void	CompactProgram( const std::vector<UsProgramElement>& program, const std::vector<bool>& removed, std::vector<UsProgramElement>& compact );
+		static	const SqOpCodeTrans*	FindOpCode( void( CqShaderVM::*pCommand ) () );
+		static	bool	FoldFloatOp( void( CqShaderVM::*pCommand ) (), TqFloat a, TqFloat b, TqFloat& result );
 
 		// Allow createShaderVM to call LoadProgram:
 		friend boost::shared_ptr<IqShader> createShaderVM(
 				IqRenderer* renderContext, std::istream& programFile,
-				const std::string& dsoPath);
+				const std::string& dsoPath, bool fuseInstructions);
 
 		struct SqArgumentRecord
 		{
@@ -235,16 +372,17 @@ class AQSIS_SHADERVM_SHARE CqShaderVM : public CqShaderStack, public IqShader, p
 		IqShaderExecEnv* m_pEnv;							///< Pointer to the current excution environment.
 		IqTransformPtr m_pTransform;    ///< Pointer to the transformation at the time the shader was instantiated.
 
-		std::vector<IqShaderData*>	m_LocalVars;		///< Array of local variables.
+		std::vector<IqShaderData*>	m_LocalVars;		///< Array of local variables.  Parameters belong to this instance, the rest to m_SharedLocalVars.
+		std::vector<boost::shared_ptr<IqShaderData> >	m_SharedLocalVars;	///< Local variables other than parameters, shared with copies of this shader.
 		std::vector<IqShaderData*>	m_InstancedParams;	///< Array of (instance parameter,local var) pairs.  Includes default params.
 		std::vector<SqArgumentRecord>	m_StoredArguments;		///< Array of arguments specified during construction.
-		std::vector<UsProgramElement>	m_ProgramInit;		///< Bytecodes of the intialisation program.
-		std::vector<UsProgramElement>	m_Program;			///< Bytecodes of the main program.
-		std::list<CqString*>			m_ProgramStrings;	///< Strings used by the program, which are stored additionally as UsProgramElements.
+		boost::shared_ptr<SqShaderProgram>	m_pProgram;	///< The program, shared with copies of this shader.
+		boost::shared_ptr<const std::vector<UsProgramElement> >	m_pSpecialisedProgram;	///< Main program specialised for the instance parameters, or null.
+		bool	m_fSpecialisationOverridden;	///< A primitive variable has overridden a specialised parameter for the current grid.
 		TqInt	m_uGridRes;
 		TqInt	m_vGridRes;
 		TqInt	m_shadingPointCount;
-		UsProgramElement*	m_PC;							///< Current program pointer.
+		const UsProgramElement*	m_PC;						///< Current program pointer.
 		TqInt	m_PO;							///< Current program offset.
 		TqInt	m_PE;							///< Offset of the end of the program.
 		bool	m_fAmbient;						///< Flag indicating if this is an ambient light source ( if it is indeed a light source ).
@@ -277,7 +415,7 @@ class AQSIS_SHADERVM_SHARE CqShaderVM : public CqShaderStack, public IqShader, p
 		/** Get the next program element from storage.
 		 * \return Reference to the next program element.
 		 */
-		UsProgramElement&	ReadNext()
+		const UsProgramElement&	ReadNext()
 		{
 			m_PO++;
 			return ( *m_PC++ );
@@ -299,6 +437,14 @@ class AQSIS_SHADERVM_SHARE CqShaderVM : public CqShaderStack, public IqShader, p
 		void	AddLocalVariable( IqShaderData* pVar )
 		{
 			m_LocalVars.push_back( pVar );
+			if ( !IsParameter( pVar ) )
+				m_SharedLocalVars.push_back( boost::shared_ptr<IqShaderData>( pVar ) );
+		}
+		/// Return true if a local variable is a parameter, which each instance has its own copy of.
+		static bool	IsParameter( const IqShaderData* pVar )
+		{
+			IqShaderData::EqStorage storage = pVar->Storage();
+			return ( storage == IqShaderData::Parameter || storage == IqShaderData::OutputParameter );
 		}
 		/** Find the index of a named shader variable.
 		 * \param strName Character pointer to the name.
@@ -373,7 +519,7 @@ class AQSIS_SHADERVM_SHARE CqShaderVM : public CqShaderStack, public IqShader, p
 			UsProgramElement E;
 			E.m_pString = ps;
 			pProgramArea->push_back( E );
-			m_ProgramStrings.push_back( ps ); // Store here as well to avoid mem leak.
+			m_pProgram->m_ProgramStrings.push_back( ps ); // Store here as well to avoid mem leak.
 		}
 		/** Add an variable index value to the program area.
 		 * \param iVar Integer variable index to add, top bit indicates system variable.
@@ -406,6 +552,8 @@ class AQSIS_SHADERVM_SHARE CqShaderVM : public CqShaderStack, public IqShader, p
 		void	SO_pushv();
 		void	SO_ipushv();
 		void	SO_pop();
+		void	SO_fusedff();
+		void	SO_fusedfff();
 		void	SO_ipop();
 		void	SO_mergef();
 		void	SO_merges();
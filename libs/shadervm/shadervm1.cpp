@@ -25,6 +25,7 @@
 
 #include "shadervm.h"
 
+#include <functional>
 #include <iostream>
 
 #include <aqsis/util/logging.h>
@@ -129,12 +130,8 @@ void CqShaderVM::SO_ipushv()
 	RELEASE( A );
 }
 
-void CqShaderVM::SO_pop()
+void CqShaderVM::AssignRunning( IqShaderData* pV, IqShaderData* pVal )
 {
-	AUTOFUNC;
-	TqInt iVar = ReadNext().m_iVariable;
-	IqShaderData* pV = GetVar( iVar );
-	POPV( Val );
 	if(m_pEnv->IsRunning())
 	{
 		TqUint ext = max( m_pEnv->shadingPointCount(), pV->Size() );
@@ -144,12 +141,227 @@ void CqShaderVM::SO_pop()
 		for ( i = 0; i < ext; i++ )
 		{
 			if(!fVarying || RS.Value( i ))
-				pV->SetValueFromVariable( Val, i );
+				pV->SetValueFromVariable( pVal, i );
 		}
 	}
+}
+
+void CqShaderVM::SO_pop()
+{
+	AUTOFUNC;
+	TqInt iVar = ReadNext().m_iVariable;
+	IqShaderData* pV = GetVar( iVar );
+	POPV( Val );
+	AssignRunning( pV, Val );
 	RELEASE( Val );
 }
 
+namespace {
+
+/// Values of an operand of a fused instruction.  Uniform variables and
+/// constants have a step of zero, so repeat their single value.
+struct SqFusedSource
+{
+	const TqFloat* values;
+	TqInt step;
+
+	TqFloat operator[]( TqUint i ) const
+	{
+		return ( values[ i * step ] );
+	}
+};
+
+/// Apply a float operation to the running elements of the result, or to all
+/// of them if RS is null.
+template<typename OpT>
+void fusedFloatOp( TqFloat* pRes, const SqFusedSource* src, TqUint count,
+                   const CqBitVector* RS, OpT op )
+{
+	for ( TqUint i = 0; i < count; i++ )
+	{
+		if ( !RS || RS->Value( i ) )
+			pRes[ i ] = op( src[ 0 ][ i ], src[ 1 ][ i ] );
+	}
+}
+
+/// Apply two float operations, as op2( op1( a, b ), c ).
+template<typename Op1T, typename Op2T>
+void fusedFloatOp( TqFloat* pRes, const SqFusedSource* src, TqUint count,
+                   const CqBitVector* RS, Op1T op1, Op2T op2 )
+{
+	for ( TqUint i = 0; i < count; i++ )
+	{
+		if ( !RS || RS->Value( i ) )
+			pRes[ i ] = op2( op1( src[ 0 ][ i ], src[ 1 ][ i ] ), src[ 2 ][ i ] );
+	}
+}
+
+/// Select the functor for the second operation, given by CqShaderVM::FusedOpIndex().
+template<typename Op1T>
+void fusedFloatOp2( TqInt op2, TqFloat* pRes, const SqFusedSource* src, TqUint count,
+                    const CqBitVector* RS, Op1T op1 )
+{
+	switch ( op2 )
+	{
+		case 0:
+			fusedFloatOp( pRes, src, count, RS, op1, std::plus<TqFloat>() );
+			break;
+		case 1:
+			fusedFloatOp( pRes, src, count, RS, op1, std::minus<TqFloat>() );
+			break;
+		case 2:
+			fusedFloatOp( pRes, src, count, RS, op1, std::multiplies<TqFloat>() );
+			break;
+		default:
+			fusedFloatOp( pRes, src, count, RS, op1, std::divides<TqFloat>() );
+			break;
+	}
+}
+
+/// Run the one or two operations of a fused instruction.
+void fusedFloatOps( const TqInt* ops, TqInt cOps, TqFloat* pRes, const SqFusedSource* src,
+                    TqUint count, const CqBitVector* RS )
+{
+	if ( cOps == 1 )
+	{
+		switch ( ops[ 0 ] )
+		{
+			case 0:
+				fusedFloatOp( pRes, src, count, RS, std::plus<TqFloat>() );
+				break;
+			case 1:
+				fusedFloatOp( pRes, src, count, RS, std::minus<TqFloat>() );
+				break;
+			case 2:
+				fusedFloatOp( pRes, src, count, RS, std::multiplies<TqFloat>() );
+				break;
+			default:
+				fusedFloatOp( pRes, src, count, RS, std::divides<TqFloat>() );
+				break;
+		}
+	}
+	else
+	{
+		switch ( ops[ 0 ] )
+		{
+			case 0:
+				fusedFloatOp2( ops[ 1 ], pRes, src, count, RS, std::plus<TqFloat>() );
+				break;
+			case 1:
+				fusedFloatOp2( ops[ 1 ], pRes, src, count, RS, std::minus<TqFloat>() );
+				break;
+			case 2:
+				fusedFloatOp2( ops[ 1 ], pRes, src, count, RS, std::multiplies<TqFloat>() );
+				break;
+			default:
+				fusedFloatOp2( ops[ 1 ], pRes, src, count, RS, std::divides<TqFloat>() );
+				break;
+		}
+	}
+}
+
+} // unnamed namespace
+
+void CqShaderVM::SO_fusedff()
+{
+	ExecuteFused( 2 );
+}
+
+void CqShaderVM::SO_fusedfff()
+{
+	ExecuteFused( 3 );
+}
+
+void CqShaderVM::ExecuteFused( TqInt cOperands )
+{
+	AUTOFUNC;
+	TqInt immediates = ReadNext().m_intVal;
+	IqShaderData* pVars[ 3 ] = { 0, 0, 0 };
+	TqFloat values[ 3 ];
+	for ( TqInt j = 0; j < cOperands; j++ )
+	{
+		const UsProgramElement& operand = ReadNext();
+		if ( immediates & ( 1 << j ) )
+			values[ j ] = operand.m_FloatVal;
+		else
+			pVars[ j ] = GetVar( operand.m_iVariable );
+	}
+	void ( CqShaderVM::*pCommands[ 2 ] ) ();
+	TqInt ops[ 2 ];
+	for ( TqInt j = 0; j < cOperands - 1; j++ )
+	{
+		pCommands[ j ] = ReadNext().m_Command;
+		ops[ j ] = FusedOpIndex( pCommands[ j ] );
+	}
+	IqShaderData* pV = GetVar( ReadNext().m_iVariable );
+	if ( !m_pEnv->IsRunning() )
+		return;
+
+	// Find the values of the operands, if they're all plain floats of the
+	// same size as the result, or uniform.
+	TqUint ext = m_pEnv->shadingPointCount();
+	TqUint sizeV = pV->Size();
+	bool fPlainFloats = pV->Type() == type_float && pV->ArrayLength() == 0;
+	bool fUniform = sizeV == 1;
+	SqFusedSource src[ 3 ];
+	for ( TqInt j = 0; j < cOperands && fPlainFloats; j++ )
+	{
+		if ( !pVars[ j ] )
+		{
+			src[ j ].values = &values[ j ];
+			src[ j ].step = 0;
+			continue;
+		}
+		TqUint size = pVars[ j ]->Size();
+		fPlainFloats = pVars[ j ]->Type() == type_float && pVars[ j ]->ArrayLength() == 0 &&
+		               ( size == 1 || size == ext );
+		fUniform = fUniform && size == 1;
+		if ( fPlainFloats )
+		{
+			pVars[ j ]->GetFloatPtr( src[ j ].values );
+			src[ j ].step = size > 1 ? 1 : 0;
+		}
+	}
+
+	if ( fPlainFloats && fUniform )
+	{
+		// Everything uniform, so there's a single value to compute.
+		TqFloat res;
+		fusedFloatOps( ops, cOperands - 1, &res, src, 1, 0 );
+		pV->SetFloat( res );
+	}
+	else if ( fPlainFloats && ext > 1 && sizeV == ext )
+	{
+		// Compute straight into the varying result.
+		TqFloat* res;
+		pV->GetFloatPtr( res );
+		fusedFloatOps( ops, cOperands - 1, res, src, ext, &m_pEnv->RunningState() );
+	}
+	else
+	{
+		// Anything else runs the original instruction sequence, with the
+		// first operand on top of the stack.  Where the last operand of
+		// fusedfff was pushed after the first operation, the second
+		// operation is commutative, so pushing it first gives the same result.
+		for ( TqInt j = cOperands - 1; j >= 0; j-- )
+		{
+			if ( pVars[ j ] )
+				PushV( pVars[ j ] );
+			else
+			{
+				RESULT( type_float, class_uniform );
+				pResult->SetFloat( values[ j ] );
+				Push( pResult );
+			}
+		}
+		for ( TqInt j = 0; j < cOperands - 1; j++ )
+			( this->*pCommands[ j ] ) ();
+		POPV( Val );
+		AssignRunning( pV, Val );
+		RELEASE( Val );
+	}
+}
+
 void CqShaderVM::SO_ipop()
 {
 	AUTOFUNC;
@@ -0,0 +1,351 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+		\brief Tests for the transformations the VM makes to shader programs.
+*/
+
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/auto_unit_test.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <aqsis/math/color.h>
+#include <aqsis/shadervm/ishaderexecenv.h>
+#include <aqsis/slcomp/icodegen.h>
+#include <aqsis/slcomp/libslparse.h>
+
+#include "shadervm.h"
+
+namespace {
+
+using namespace Aqsis;
+
+/// Compile a shader to VM code and load it, with or without instruction fusion.
+boost::shared_ptr<CqShaderVM> compileShader(const std::string& source,
+		bool fuse = true)
+{
+	ResetParser();
+	std::istringstream in(source);
+	std::ostringstream errors;
+	BOOST_REQUIRE_MESSAGE(Parse(in, "shadervm_test.sl", errors), errors.str());
+	const char* slxName = "shadervm_test.slx";
+	CqCodeGenVM codeGen;
+	codeGen.OutputTree(GetParseTree(), slxName);
+
+	std::ifstream programFile(slxName);
+	boost::shared_ptr<CqShaderVM> shader = boost::dynamic_pointer_cast<CqShaderVM>(
+			createShaderVM(0, programFile, "", fuse));
+	programFile.close();
+	std::remove(slxName);
+	BOOST_REQUIRE(shader);
+	return shader;
+}
+
+/// Outputs of the shader at each point.
+struct SqShaderResult
+{
+	std::vector<CqColor> Ci;
+	std::vector<CqColor> Oi;
+};
+
+/// Run a surface shader on a grid with s and t spread over [0,1].
+SqShaderResult runShader(CqShaderVM& shader, TqInt gridRes)
+{
+	TqInt numPoints = gridRes*gridRes;
+	boost::shared_ptr<IqShaderExecEnv> env = IqShaderExecEnv::create(0);
+	env->Initialise(gridRes, gridRes, numPoints, numPoints, false,
+			IqAttributesPtr(), IqTransformPtr(), &shader, shader.Uses());
+	shader.Initialise(gridRes, gridRes, numPoints, env.get());
+	IqShaderData* s = env->pVar(EnvVars_s);
+	IqShaderData* t = env->pVar(EnvVars_t);
+	IqShaderData* Ci = env->pVar(EnvVars_Ci);
+	IqShaderData* Oi = env->pVar(EnvVars_Oi);
+	BOOST_REQUIRE(s && t && Ci && Oi);
+	s->Initialise(numPoints);
+	t->Initialise(numPoints);
+	Ci->Initialise(numPoints);
+	Oi->Initialise(numPoints);
+	for(TqInt i = 0; i < numPoints; ++i)
+	{
+		s->SetFloat(TqFloat(i % gridRes)/(gridRes-1), i);
+		t->SetFloat(TqFloat(i / gridRes)/(gridRes-1), i);
+	}
+
+	shader.Evaluate(env.get());
+
+	SqShaderResult result;
+	result.Ci.resize(numPoints);
+	result.Oi.resize(numPoints);
+	for(TqInt i = 0; i < numPoints; ++i)
+	{
+		Ci->GetColor(result.Ci[i], i);
+		Oi->GetColor(result.Oi[i], i);
+	}
+	return result;
+}
+
+/// An instruction of a disassembled program.
+struct SqInstruction
+{
+	std::string opcode;
+	std::vector<std::string> params;
+};
+
+/// Parse the output of CqShaderVM::DisassembleProgram(), by offset.
+std::map<TqInt, SqInstruction> disassemble(const CqShaderVM& shader)
+{
+	std::ostringstream out;
+	shader.DisassembleProgram(out);
+	std::istringstream in(out.str());
+	std::map<TqInt, SqInstruction> program;
+	std::string line;
+	while(std::getline(in, line))
+	{
+		std::istringstream lineStream(line);
+		TqInt offset = 0;
+		char colon = 0;
+		lineStream >> offset >> colon;
+		SqInstruction& instr = program[offset];
+		lineStream >> instr.opcode;
+		std::string param;
+		while(lineStream >> param)
+			instr.params.push_back(param);
+	}
+	return program;
+}
+
+TqInt countOpcode(const std::map<TqInt, SqInstruction>& program,
+		const std::string& opcode)
+{
+	TqInt count = 0;
+	for(std::map<TqInt, SqInstruction>::const_iterator i = program.begin();
+			i != program.end(); ++i)
+	{
+		if(i->second.opcode == opcode)
+			++count;
+	}
+	return count;
+}
+
+bool hasPush(const std::map<TqInt, SqInstruction>& program, TqFloat value)
+{
+	for(std::map<TqInt, SqInstruction>::const_iterator i = program.begin();
+			i != program.end(); ++i)
+	{
+		if(i->second.opcode == "pushif" && !i->second.params.empty()
+				&& std::atof(i->second.params[0].c_str()) == value)
+			return true;
+	}
+	return false;
+}
+
+/** Find each jump in order, as the pair of its opcode and the opcode it
+ * jumps to, checking that it lands on an instruction.
+ */
+std::vector<std::pair<std::string, std::string> > jumps(
+		const std::map<TqInt, SqInstruction>& program)
+{
+	std::vector<std::pair<std::string, std::string> > result;
+	for(std::map<TqInt, SqInstruction>::const_iterator i = program.begin();
+			i != program.end(); ++i)
+	{
+		const SqInstruction& instr = i->second;
+		if(instr.params.size() != 1 || instr.params[0][0] != '@')
+			continue;
+		TqInt target = std::atoi(instr.params[0].c_str() + 1);
+		std::map<TqInt, SqInstruction>::const_iterator targetInstr = program.find(target);
+		BOOST_CHECK_MESSAGE(targetInstr != program.end(), instr.opcode
+				<< " at " << i->first << " jumps to " << target
+				<< ", which isn't the start of an instruction");
+		if(targetInstr != program.end())
+			result.push_back(std::make_pair(instr.opcode, targetInstr->second.opcode));
+	}
+	return result;
+}
+
+} // unnamed namespace
+
+BOOST_AUTO_TEST_SUITE(shadervm_tests)
+
+BOOST_AUTO_TEST_CASE(shadervm_specialise_test)
+{
+	boost::shared_ptr<CqShaderVM> shader = compileShader(
+		"surface specialise(float k = 0; float n = 2)\n"
+		"{\n"
+		"	float r = 0, i = 0;\n"
+		"	if(s < k*2 + 1)\n"
+		"		r = 1;\n"
+		"	for(i = 0; i < n + 1; i += 1)\n"
+		"		r += t;\n"
+		"	Ci = color(r, 0, 0);\n"
+		"	Oi = 1;\n"
+		"}\n");
+	std::map<TqInt, SqInstruction> generic = disassemble(*shader);
+	BOOST_REQUIRE_EQUAL(countOpcode(generic, "mulff"), 1);
+
+	TqFloat k = 1.5;
+	shader->SetArgument("k", type_float, "", &k);
+	shader->InitialiseParameters();
+	std::map<TqInt, SqInstruction> specialised = disassemble(*shader);
+
+	// k*2 + 1 and n + 1 are both folded into constants.
+	BOOST_CHECK_EQUAL(countOpcode(specialised, "mulff"), 0);
+	BOOST_CHECK_EQUAL(countOpcode(specialised, "addff"),
+			countOpcode(generic, "addff") - 2);
+	BOOST_CHECK(hasPush(specialised, 4));
+	BOOST_CHECK(hasPush(specialised, 3));
+	BOOST_CHECK(specialised.size() < generic.size());
+
+	// The jumps still go to the same instructions, after the code has moved.
+	std::vector<std::pair<std::string, std::string> > genericJumps = jumps(generic);
+	std::vector<std::pair<std::string, std::string> > specialisedJumps = jumps(specialised);
+	BOOST_CHECK(!genericJumps.empty());
+	BOOST_CHECK(genericJumps == specialisedJumps);
+
+	// And the specialised program gives the right results.
+	const TqInt gridRes = 3;
+	SqShaderResult result = runShader(*shader, gridRes);
+	for(TqInt i = 0; i < gridRes*gridRes; ++i)
+	{
+		TqFloat tVal = TqFloat(i / gridRes)/(gridRes-1);
+		BOOST_CHECK_CLOSE(result.Ci[i].r(), 1 + 3*tVal, 1e-4f);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(shadervm_fusion_test)
+{
+	// Each fused sequence, on uniform and varying variables and constants,
+	// and with some points not running.
+	const char* source =
+		"surface fusion()\n"
+		"{\n"
+		"	uniform float u = 2;\n"
+		"	float x = 0, y = 0, z = 0;\n"
+		"	x = s + t;\n"
+		"	y = 1 - s;\n"
+		"	z = t / 4;\n"
+		"	u = u * 3 - 1;\n"
+		"	x = x * y + z;\n"
+		"	y = z + s * t;\n"
+		"	z = (x - y) / u;\n"
+		"	if(s > 0.5)\n"
+		"		x = s * t + 2;\n"
+		"	Ci = color(x, y, z);\n"
+		"	Oi = color(u, 0, 1);\n"
+		"}\n";
+	boost::shared_ptr<CqShaderVM> fused = compileShader(source, true);
+	boost::shared_ptr<CqShaderVM> unfused = compileShader(source, false);
+	fused->InitialiseParameters();
+	unfused->InitialiseParameters();
+
+	std::map<TqInt, SqInstruction> fusedProgram = disassemble(*fused);
+	std::map<TqInt, SqInstruction> unfusedProgram = disassemble(*unfused);
+	BOOST_CHECK_EQUAL(countOpcode(fusedProgram, "fusedff"), 3);
+	BOOST_CHECK_EQUAL(countOpcode(fusedProgram, "fusedfff"), 5);
+	BOOST_CHECK_EQUAL(countOpcode(unfusedProgram, "fusedff")
+			+ countOpcode(unfusedProgram, "fusedfff"), 0);
+	BOOST_CHECK_EQUAL(countOpcode(fusedProgram, "pop")
+			+ 8, countOpcode(unfusedProgram, "pop"));
+
+	const TqInt gridRes = 5;
+	SqShaderResult fusedResult = runShader(*fused, gridRes);
+	SqShaderResult unfusedResult = runShader(*unfused, gridRes);
+	for(TqInt i = 0; i < gridRes*gridRes; ++i)
+	{
+		for(TqInt c = 0; c < 3; ++c)
+		{
+			BOOST_CHECK_CLOSE(fusedResult.Ci[i][c], unfusedResult.Ci[i][c], 1e-4f);
+			BOOST_CHECK_CLOSE(fusedResult.Oi[i][c], unfusedResult.Oi[i][c], 1e-4f);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(shadervm_clone_test)
+{
+	boost::shared_ptr<CqShaderVM> shader = compileShader(
+		"surface cloned(float k = 0)\n"
+		"{\n"
+		"	float r = s * (k*2 + 1);\n"
+		"	Ci = color(r, 0, 0);\n"
+		"	Oi = 1;\n"
+		"}\n");
+	boost::shared_ptr<CqShaderVM> a = boost::dynamic_pointer_cast<CqShaderVM>(shader->Clone());
+	boost::shared_ptr<CqShaderVM> b = boost::dynamic_pointer_cast<CqShaderVM>(shader->Clone());
+	boost::shared_ptr<CqShaderVM> c = boost::dynamic_pointer_cast<CqShaderVM>(shader->Clone());
+	BOOST_REQUIRE(a && b && c);
+
+	// Copies have their own parameters, but share the other locals.
+	const std::vector<IqShaderData*>& aVars = a->GetArguments();
+	const std::vector<IqShaderData*>& bVars = b->GetArguments();
+	BOOST_REQUIRE_EQUAL(aVars.size(), bVars.size());
+	TqInt numParams = 0;
+	TqInt numShared = 0;
+	for(TqUint i = 0; i < aVars.size(); ++i)
+	{
+		if(aVars[i]->Storage() == IqShaderData::Parameter)
+		{
+			BOOST_CHECK(aVars[i] != bVars[i]);
+			++numParams;
+		}
+		else
+		{
+			BOOST_CHECK(aVars[i] == bVars[i]);
+			++numShared;
+		}
+	}
+	BOOST_CHECK_EQUAL(numParams, 1);
+	BOOST_CHECK(numShared > 0);
+
+	// Instances with the same parameters share a specialised program, and
+	// instances with different ones don't.
+	TqFloat k = 1;
+	a->SetArgument("k", type_float, "", &k);
+	b->SetArgument("k", type_float, "", &k);
+	k = 2;
+	c->SetArgument("k", type_float, "", &k);
+	a->InitialiseParameters();
+	b->InitialiseParameters();
+	c->InitialiseParameters();
+	BOOST_CHECK(a->SharesMainProgram(*b));
+	BOOST_CHECK(!a->SharesMainProgram(*c));
+
+	// Running one instance doesn't disturb the others.
+	const TqInt gridRes = 3;
+	SqShaderResult aResult = runShader(*a, gridRes);
+	SqShaderResult cResult = runShader(*c, gridRes);
+	SqShaderResult aResult2 = runShader(*a, gridRes);
+	for(TqInt i = 0; i < gridRes*gridRes; ++i)
+	{
+		TqFloat sVal = TqFloat(i % gridRes)/(gridRes-1);
+		BOOST_CHECK_CLOSE(aResult.Ci[i].r() + 1, 3*sVal + 1, 1e-4f);
+		BOOST_CHECK_CLOSE(cResult.Ci[i].r() + 1, 5*sVal + 1, 1e-4f);
+		BOOST_CHECK_CLOSE(aResult2.Ci[i].r() + 1, 3*sVal + 1, 1e-4f);
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
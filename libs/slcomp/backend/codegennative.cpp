@@ -0,0 +1,155 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+		\brief Compiler backend to output native code alongside VM code.
+*/
+
+#include <aqsis/slcomp/icodegen.h>
+
+#include	<cstdio>
+#include	<cstdlib>
+#include	<fstream>
+#include	<sstream>
+
+#ifndef	AQSIS_SYSTEM_WIN32
+#include	<unistd.h>
+#endif
+
+#include	<aqsis/util/logging.h>
+#include	"nativeoutput.h"
+#include	"vmdatagather.h"
+#include	"vmoutput.h"
+#include	<aqsis/slcomp/iparsenode.h>
+
+
+namespace Aqsis {
+
+namespace {
+
+/// Options for compiling native shaders.
+const char* const nativeFlags = "-O2 -shared -fPIC";
+
+/// 64 bit FNV-1a hash of a string, used to name the cached library.
+std::string fnvHash( const std::string& source )
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	for ( std::string::const_iterator i = source.begin(); i != source.end(); i++ )
+	{
+		hash ^= static_cast<unsigned char>( *i );
+		hash *= 1099511628211ULL;
+	}
+	std::ostringstream strm;
+	strm << std::hex << hash;
+	return ( strm.str() );
+}
+
+bool fileExists( const std::string& fileName )
+{
+	std::ifstream file( fileName.c_str() );
+	return ( file.is_open() );
+}
+
+/** \brief Compile the native code for a shader, or find it in the cache.
+ *
+ * Returns the file name of the library without its directory, or an empty
+ * string on failure.  The renderer finds the library on the shader search
+ * path, so the slx file doesn't depend on where the cache was.
+ */
+std::string compileNative( const CqNativeOutput& native, const std::string& cacheDir,
+		const std::string& compiler )
+{
+#ifdef	AQSIS_SYSTEM_WIN32
+	Aqsis::log() << warning << "Native shaders are not supported on this platform" << std::endl;
+	return ( "" );
+#else
+	std::string source = native.strSource();
+	// A different compiler or options give a different library from the
+	// same source.
+	std::string hash = fnvHash( compiler + " " + nativeFlags + "\n" + source );
+	std::string fileName = native.strShaderName() + "_" + hash + ".so";
+	std::string baseName = cacheDir;
+	if ( baseName.empty() )
+		baseName = ".";
+	baseName += "/" + native.strShaderName() + "_" + hash;
+	std::string libName = baseName + ".so";
+	if ( fileExists( libName ) )
+		return ( fileName );
+
+	std::string srcName = baseName + ".cpp";
+	{
+		std::ofstream srcFile( srcName.c_str() );
+		srcFile << source;
+		if ( !srcFile )
+		{
+			Aqsis::log() << error << "Cannot write native shader source \"" << srcName << "\"" << std::endl;
+			return ( "" );
+		}
+	}
+	// Compile to a temporary name so that a concurrent aqsl or renderer never
+	// sees a partly written library.
+	std::ostringstream tmpName;
+	tmpName << baseName << ".tmp" << getpid();
+	std::string command = compiler + " " + nativeFlags + " -o \"" + tmpName.str()
+		+ "\" \"" + srcName + "\"";
+	if ( std::system( command.c_str() ) != 0 )
+	{
+		Aqsis::log() << error << "Native shader compilation failed: " << command << std::endl;
+		std::remove( tmpName.str().c_str() );
+		return ( "" );
+	}
+	if ( std::rename( tmpName.str().c_str(), libName.c_str() ) != 0 )
+	{
+		std::remove( tmpName.str().c_str() );
+		return ( "" );
+	}
+	return ( fileName );
+#endif
+}
+
+} // unnamed namespace
+
+
+CqCodeGenNative::CqCodeGenNative( const std::string& cacheDir, const std::string& compiler )
+	: m_cacheDir( cacheDir ),
+	m_compiler( compiler )
+{ }
+
+void CqCodeGenNative::OutputTree( IqParseNode* pNode, std::string strOutName )
+{
+	std::string libName;
+	CqNativeOutput native;
+	if ( native.Translate( pNode ) )
+		libName = compileNative( native, m_cacheDir, m_compiler );
+	else
+	{
+		Aqsis::log() << info << "Shader \"" << native.strShaderName()
+			<< "\" will only run on the VM: unsupported " << native.strUnsupported() << std::endl;
+	}
+
+	CqCodeGenDataGather DG;
+	CqCodeGenOutput V( &DG, strOutName, libName );
+	pNode->Accept( DG );
+	pNode->Accept( V );
+}
+
+//-----------------------------------------------------------------------
+
+} // namespace Aqsis
@@ -0,0 +1,1264 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+		\brief Compiler backend to translate shaders into C++.
+*/
+
+#include	"nativeoutput.h"
+
+#include	<algorithm>
+#include	<cassert>
+#include	<cctype>
+#include	<cfloat>
+#include	<cmath>
+#include	<cstring>
+
+#include	<aqsis/math/math.h>
+
+namespace Aqsis {
+
+namespace {
+
+/** Code at the start of every generated shader.
+ *
+ * The helpers reproduce the results of the VM shadeops of the same names,
+ * including the values returned outside the domain of a function.
+ */
+const char* const nativePrelude =
+	"#include <cmath>\n"
+	"\n"
+	"namespace {\n"
+	"\n"
+	"struct V3\n"
+	"{\n"
+	"\tfloat x, y, z;\n"
+	"\tV3() : x(0), y(0), z(0) {}\n"
+	"\tV3(float f) : x(f), y(f), z(f) {}\n"
+	"\tV3(float x_, float y_, float z_) : x(x_), y(y_), z(z_) {}\n"
+	"};\n"
+	"\n"
+	"inline V3 operator+(const V3& a, const V3& b) { return V3(a.x + b.x, a.y + b.y, a.z + b.z); }\n"
+	"inline V3 operator-(const V3& a, const V3& b) { return V3(a.x - b.x, a.y - b.y, a.z - b.z); }\n"
+	"inline V3 operator*(const V3& a, const V3& b) { return V3(a.x * b.x, a.y * b.y, a.z * b.z); }\n"
+	"inline V3 operator/(const V3& a, const V3& b) { return V3(a.x / b.x, a.y / b.y, a.z / b.z); }\n"
+	"inline V3 operator-(const V3& a) { return V3(-a.x, -a.y, -a.z); }\n"
+	"inline bool sl_eq(const V3& a, const V3& b) { return a.x == b.x && a.y == b.y && a.z == b.z; }\n"
+	"inline float sl_dot(const V3& a, const V3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }\n"
+	"inline V3 sl_cross(const V3& a, const V3& b)\n"
+	"{\n"
+	"\treturn V3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);\n"
+	"}\n"
+	"inline float sl_and(float a, float b) { return a != 0 && b != 0; }\n"
+	"inline float sl_or(float a, float b) { return a != 0 || b != 0; }\n"
+	"\n"
+	"inline float sl_radians(float a) { return a / 180.0 * 3.14159265358979323846; }\n"
+	"inline float sl_degrees(float a) { return a / 3.14159265358979323846 * 180.0; }\n"
+	"inline float sl_sin(float a) { return std::sin(a); }\n"
+	"inline float sl_asin(float a) { return a < -1 || a > 1 ? 0 : std::asin(a); }\n"
+	"inline float sl_cos(float a) { return std::cos(a); }\n"
+	"inline float sl_acos(float a) { return a < -1 || a > 1 ? 0 : std::acos(a); }\n"
+	"inline float sl_tan(float a) { return std::tan(a); }\n"
+	"inline float sl_atan(float a) { return std::atan(a); }\n"
+	"inline float sl_atan2(float y, float x) { return std::atan2(y, x); }\n"
+	"inline float sl_pow(float x, float y)\n"
+	"{\n"
+	"\tif(x < 0)\n"
+	"\t{\n"
+	"\t\tint yInt = static_cast<int>(std::floor(y));\n"
+	"\t\treturn yInt != y ? 0 : std::pow(x, yInt);\n"
+	"\t}\n"
+	"\treturn std::pow(x, y);\n"
+	"}\n"
+	"inline float sl_exp(float a) { return std::exp(a); }\n"
+	"inline float sl_sqrt(float a) { return a < 0 ? 0 : std::sqrt(a); }\n"
+	"inline float sl_inversesqrt(float a) { return a <= 0 ? 0 : 1 / std::sqrt(a); }\n"
+	"inline float sl_log(float a) { return a <= 0 ? 0 : std::log(a); }\n"
+	"inline float sl_log2(float a, float base)\n"
+	"{\n"
+	"\treturn a <= 0 || base <= 0 ? 0 : std::log(a) / std::log(base);\n"
+	"}\n"
+	"inline float sl_mod(float a, float b)\n"
+	"{\n"
+	"\tint n = static_cast<int>(a / b);\n"
+	"\tfloat a2 = a - n * b;\n"
+	"\treturn a2 < 0 ? a2 + b : a2;\n"
+	"}\n"
+	"inline float sl_abs(float a) { return std::fabs(a); }\n"
+	"inline float sl_sign(float a) { return a < 0 ? -1 : 1; }\n"
+	"inline float sl_floor(float a) { return std::floor(a); }\n"
+	"inline float sl_ceil(float a) { return std::ceil(a); }\n"
+	"inline float sl_round(float a) { return std::floor(a - 0.5) + 1; }\n"
+	"inline float sl_step(float min, float value) { return value < min ? 0 : 1; }\n"
+	"inline float sl_smoothstep(float min, float max, float value)\n"
+	"{\n"
+	"\tif(value < min)\n"
+	"\t\treturn 0;\n"
+	"\telse if(value >= max)\n"
+	"\t\treturn 1;\n"
+	"\tfloat v = (value - min) / (max - min);\n"
+	"\treturn v * v * (3 - 2 * v);\n"
+	"}\n"
+	"inline float sl_min(float a, float b) { return a < b ? a : b; }\n"
+	"inline float sl_max(float a, float b) { return a < b ? b : a; }\n"
+	"inline float sl_clamp(float x, float min, float max) { return x < min ? min : (x > max ? max : x); }\n"
+	"inline V3 sl_min(const V3& a, const V3& b) { return V3(sl_min(a.x, b.x), sl_min(a.y, b.y), sl_min(a.z, b.z)); }\n"
+	"inline V3 sl_max(const V3& a, const V3& b) { return V3(sl_max(a.x, b.x), sl_max(a.y, b.y), sl_max(a.z, b.z)); }\n"
+	"inline V3 sl_clamp(const V3& v, const V3& min, const V3& max)\n"
+	"{\n"
+	"\treturn V3(sl_clamp(v.x, min.x, max.x), sl_clamp(v.y, min.y, max.y), sl_clamp(v.z, min.z, max.z));\n"
+	"}\n"
+	"inline float sl_mix(float x0, float x1, float v) { return (1 - v) * x0 + v * x1; }\n"
+	"inline V3 sl_mix(const V3& x0, const V3& x1, const V3& v) { return (1 - v) * x0 + v * x1; }\n"
+	"inline float sl_length(const V3& v) { return std::sqrt(sl_dot(v, v)); }\n"
+	"inline float sl_distance(const V3& a, const V3& b) { return sl_length(a - b); }\n"
+	"inline V3 sl_normalize(const V3& v)\n"
+	"{\n"
+	"\tfloat l = sl_length(v);\n"
+	"\treturn l != 0 ? V3(v.x / l, v.y / l, v.z / l) : v;\n"
+	"}\n"
+	"inline V3 sl_faceforward2(const V3& n, const V3& i, const V3& nref)\n"
+	"{\n"
+	"\treturn sl_dot(-i, nref) < 0 ? -n : n;\n"
+	"}\n"
+	"inline float sl_xcomp(const V3& v) { return v.x; }\n"
+	"inline float sl_ycomp(const V3& v) { return v.y; }\n"
+	"inline float sl_zcomp(const V3& v) { return v.z; }\n"
+	"inline float& sl_compref(V3& v, float i)\n"
+	"{\n"
+	"\tint n = static_cast<int>(i);\n"
+	"\treturn n <= 0 ? v.x : (n == 1 ? v.y : v.z);\n"
+	"}\n"
+	"inline float sl_comp(V3 v, float i) { return sl_compref(v, i); }\n"
+	"inline void sl_setcomp(V3& v, float i, float f) { sl_compref(v, i) = f; }\n"
+	"inline void sl_setxcomp(V3& v, float f) { v.x = f; }\n"
+	"inline void sl_setycomp(V3& v, float f) { v.y = f; }\n"
+	"inline void sl_setzcomp(V3& v, float f) { v.z = f; }\n"
+	"\n"
+	"struct sl_env\n"
+	"{\n"
+	"\tint uSize, vSize;\n"
+	"\tint uDiffZero, vDiffZero;\n"
+	"\tint centred;\n"
+	"\tfloat (*fnoise)(const float* args, int numArgs);\n"
+	"\tvoid (*pnoise)(const float* args, int numArgs, float* result);\n"
+	"\tvoid (*cnoise)(const float* args, int numArgs, float* result);\n"
+	"};\n"
+	"\n"
+	"struct sl_args\n"
+	"{\n"
+	"\tfloat a[4];\n"
+	"\tint n;\n"
+	"\tsl_args(float x) : n(1) { a[0] = x; }\n"
+	"\tsl_args(float x, float y) : n(2) { a[0] = x; a[1] = y; }\n"
+	"\tsl_args(const V3& p) : n(3) { a[0] = p.x; a[1] = p.y; a[2] = p.z; }\n"
+	"\tsl_args(const V3& p, float t) : n(4) { a[0] = p.x; a[1] = p.y; a[2] = p.z; a[3] = t; }\n"
+	"};\n"
+	"inline float sl_fnoise(const sl_env* env, const sl_args& a) { return env->fnoise(a.a, a.n); }\n"
+	"inline V3 sl_pnoise(const sl_env* env, const sl_args& a)\n"
+	"{\n"
+	"\tfloat r[3];\n"
+	"\tenv->pnoise(a.a, a.n, r);\n"
+	"\treturn V3(r[0], r[1], r[2]);\n"
+	"}\n"
+	"inline V3 sl_cnoise(const sl_env* env, const sl_args& a)\n"
+	"{\n"
+	"\tfloat r[3];\n"
+	"\tenv->cnoise(a.a, a.n, r);\n"
+	"\treturn V3(r[0], r[1], r[2]);\n"
+	"}\n"
+	"\n"
+	"// Differences on the grid, as CqGridDiff computes them.  f gives the value\n"
+	"// at any point.\n"
+	"template<typename T>\n"
+	"T sl_diff(T (*f)(float* const*, const int*, const sl_env*, int), float* const* vars,\n"
+	"\t\tconst int* varying, const sl_env* env, int i, int n, int nSize, int stride)\n"
+	"{\n"
+	"\tif(nSize < 2)\n"
+	"\t\treturn T(0);\n"
+	"\tif(env->centred && nSize > 2)\n"
+	"\t{\n"
+	"\t\tif(n == 0)\n"
+	"\t\t\treturn T(-1.5f) * f(vars, varying, env, i) + T(2) * f(vars, varying, env, i + stride)\n"
+	"\t\t\t\t- T(0.5f) * f(vars, varying, env, i + 2 * stride);\n"
+	"\t\telse if(n == nSize - 1)\n"
+	"\t\t\treturn T(1.5f) * f(vars, varying, env, i) - T(2) * f(vars, varying, env, i - stride)\n"
+	"\t\t\t\t+ T(0.5f) * f(vars, varying, env, i - 2 * stride);\n"
+	"\t\treturn T(0.5f) * (f(vars, varying, env, i + stride) - f(vars, varying, env, i - stride));\n"
+	"\t}\n"
+	"\tif(n == nSize - 1)\n"
+	"\t\treturn T(0.5f) * (f(vars, varying, env, i) - f(vars, varying, env, i - stride));\n"
+	"\treturn T(0.5f) * (f(vars, varying, env, i + stride) - f(vars, varying, env, i));\n"
+	"}\n"
+	"template<typename T>\n"
+	"T sl_diffu(T (*f)(float* const*, const int*, const sl_env*, int), float* const* vars,\n"
+	"\t\tconst int* varying, const sl_env* env, int i)\n"
+	"{\n"
+	"\tif(env->uDiffZero)\n"
+	"\t\treturn T(0);\n"
+	"\treturn sl_diff(f, vars, varying, env, i, i % env->uSize, env->uSize, 1);\n"
+	"}\n"
+	"template<typename T>\n"
+	"T sl_diffv(T (*f)(float* const*, const int*, const sl_env*, int), float* const* vars,\n"
+	"\t\tconst int* varying, const sl_env* env, int i)\n"
+	"{\n"
+	"\tif(env->vDiffZero)\n"
+	"\t\treturn T(0);\n"
+	"\treturn sl_diff(f, vars, varying, env, i, i / env->uSize, env->vSize, env->uSize);\n"
+	"}\n"
+	"template<typename T>\n"
+	"T sl_Du(T (*f)(float* const*, const int*, const sl_env*, int), float* const* vars,\n"
+	"\t\tconst int* varying, const sl_env* env, int i, float du)\n"
+	"{\n"
+	"\treturn du == 0 ? T(0) : sl_diffu(f, vars, varying, env, i) * T(1 / du);\n"
+	"}\n"
+	"template<typename T>\n"
+	"T sl_Dv(T (*f)(float* const*, const int*, const sl_env*, int), float* const* vars,\n"
+	"\t\tconst int* varying, const sl_env* env, int i, float dv)\n"
+	"{\n"
+	"\treturn dv == 0 ? T(0) : sl_diffv(f, vars, varying, env, i) * T(1 / dv);\n"
+	"}\n"
+	"template<typename T>\n"
+	"T sl_Deriv(T (*fy)(float* const*, const int*, const sl_env*, int),\n"
+	"\t\tfloat (*fx)(float* const*, const int*, const sl_env*, int), float* const* vars,\n"
+	"\t\tconst int* varying, const sl_env* env, int i)\n"
+	"{\n"
+	"\tfloat dxu = sl_diffu(fx, vars, varying, env, i);\n"
+	"\tfloat dxv = sl_diffv(fx, vars, varying, env, i);\n"
+	"\tif(std::fabs(dxu) >= std::fabs(dxv))\n"
+	"\t\treturn dxu != 0 ? sl_diffu(fy, vars, varying, env, i) / T(dxu) : T(0);\n"
+	"\treturn sl_diffv(fy, vars, varying, env, i) / T(dxv);\n"
+	"}\n"
+	"\n"
+	"inline float sl_loadf(const float* p, int varying, int i) { return p[varying ? i : 0]; }\n"
+	"inline V3 sl_loadt(const float* p, int varying, int i)\n"
+	"{\n"
+	"\tp += varying ? 3 * i : 0;\n"
+	"\treturn V3(p[0], p[1], p[2]);\n"
+	"}\n"
+	"inline void sl_storef(float* p, int i, float f) { p[i] = f; }\n"
+	"inline void sl_storet(float* p, int i, const V3& v)\n"
+	"{\n"
+	"\tp += 3 * i;\n"
+	"\tp[0] = v.x;\n"
+	"\tp[1] = v.y;\n"
+	"\tp[2] = v.z;\n"
+	"}\n"
+	"\n"
+	"} // unnamed namespace\n"
+	"\n";
+
+/// How a shadeop is translated.
+enum EqNativeCall
+{
+	Call_Function,		///< Call the helper function named after the shadeop.
+	Call_Fold,			///< Fold any number of arguments with the helper.
+	Call_Assign,		///< The helper assigns to the variable given as the first argument.
+	Call_Noise,			///< Call the renderer through the helper with the arguments packed up.
+};
+
+struct SqNativeShadeop
+{
+	const char*	m_vmName;
+	const char*	m_function;
+	EqNativeCall	m_call;
+};
+
+/// The shadeops which can be translated, by VM name.
+const SqNativeShadeop nativeShadeops[] =
+{
+	{ "radians", "sl_radians", Call_Function },
+	{ "degrees", "sl_degrees", Call_Function },
+	{ "sin", "sl_sin", Call_Function },
+	{ "asin", "sl_asin", Call_Function },
+	{ "cos", "sl_cos", Call_Function },
+	{ "acos", "sl_acos", Call_Function },
+	{ "tan", "sl_tan", Call_Function },
+	{ "atan", "sl_atan", Call_Function },
+	{ "atan2", "sl_atan2", Call_Function },
+	{ "pow", "sl_pow", Call_Function },
+	{ "exp", "sl_exp", Call_Function },
+	{ "sqrt", "sl_sqrt", Call_Function },
+	{ "inversesqrt", "sl_inversesqrt", Call_Function },
+	{ "log", "sl_log", Call_Function },
+	{ "log2", "sl_log2", Call_Function },
+	{ "mod", "sl_mod", Call_Function },
+	{ "abs", "sl_abs", Call_Function },
+	{ "sign", "sl_sign", Call_Function },
+	{ "floor", "sl_floor", Call_Function },
+	{ "ceil", "sl_ceil", Call_Function },
+	{ "round", "sl_round", Call_Function },
+	{ "step", "sl_step", Call_Function },
+	{ "smoothstep", "sl_smoothstep", Call_Function },
+	{ "min", "sl_min", Call_Fold },
+	{ "max", "sl_max", Call_Fold },
+	{ "pmin", "sl_min", Call_Fold },
+	{ "pmax", "sl_max", Call_Fold },
+	{ "vmin", "sl_min", Call_Fold },
+	{ "vmax", "sl_max", Call_Fold },
+	{ "nmin", "sl_min", Call_Fold },
+	{ "nmax", "sl_max", Call_Fold },
+	{ "cmin", "sl_min", Call_Fold },
+	{ "cmax", "sl_max", Call_Fold },
+	{ "clamp", "sl_clamp", Call_Function },
+	{ "pclamp", "sl_clamp", Call_Function },
+	{ "vclamp", "sl_clamp", Call_Function },
+	{ "nclamp", "sl_clamp", Call_Function },
+	{ "cclamp", "sl_clamp", Call_Function },
+	{ "fmix", "sl_mix", Call_Function },
+	{ "pmix", "sl_mix", Call_Function },
+	{ "vmix", "sl_mix", Call_Function },
+	{ "nmix", "sl_mix", Call_Function },
+	{ "cmix", "sl_mix", Call_Function },
+	{ "pmixc", "sl_mix", Call_Function },
+	{ "vmixc", "sl_mix", Call_Function },
+	{ "nmixc", "sl_mix", Call_Function },
+	{ "cmixc", "sl_mix", Call_Function },
+	{ "length", "sl_length", Call_Function },
+	{ "distance", "sl_distance", Call_Function },
+	{ "normalize", "sl_normalize", Call_Function },
+	{ "faceforward2", "sl_faceforward2", Call_Function },
+	{ "xcomp", "sl_xcomp", Call_Function },
+	{ "ycomp", "sl_ycomp", Call_Function },
+	{ "zcomp", "sl_zcomp", Call_Function },
+	{ "comp", "sl_comp", Call_Function },
+	{ "setcomp", "sl_setcomp", Call_Assign },
+	{ "setxcomp", "sl_setxcomp", Call_Assign },
+	{ "setycomp", "sl_setycomp", Call_Assign },
+	{ "setzcomp", "sl_setzcomp", Call_Assign },
+	{ "noise1", "sl_fnoise", Call_Noise },
+	{ "noise2", "sl_fnoise", Call_Noise },
+	{ "noise3", "sl_fnoise", Call_Noise },
+	{ "noise4", "sl_fnoise", Call_Noise },
+	{ "pnoise1", "sl_pnoise", Call_Noise },
+	{ "pnoise2", "sl_pnoise", Call_Noise },
+	{ "pnoise3", "sl_pnoise", Call_Noise },
+	{ "pnoise4", "sl_pnoise", Call_Noise },
+	{ "cnoise1", "sl_cnoise", Call_Noise },
+	{ "cnoise2", "sl_cnoise", Call_Noise },
+	{ "cnoise3", "sl_cnoise", Call_Noise },
+	{ "cnoise4", "sl_cnoise", Call_Noise },
+};
+
+const SqNativeShadeop* findNativeShadeop( const char* vmName )
+{
+	for ( TqUint i = 0; i < sizeof( nativeShadeops ) / sizeof( nativeShadeops[ 0 ] ); i++ )
+	{
+		if ( std::strcmp( nativeShadeops[ i ].m_vmName, vmName ) == 0 )
+			return ( &nativeShadeops[ i ] );
+	}
+	return ( 0 );
+}
+
+} // unnamed namespace
+
+
+CqNativeOutput::CqNativeOutput()
+	: m_shaderName(),
+	m_source(),
+	m_unsupported(),
+	m_fSupported( true ),
+	m_expr(),
+	m_body(),
+	m_indent( 2 ),
+	m_externals(),
+	m_externalIndex(),
+	m_locals(),
+	m_loops(),
+	m_labels( 0 ),
+	m_deps(),
+	m_localAssignments(),
+	m_localDefs(),
+	m_derivFunctions(),
+	m_flowDepth( 0 ),
+	m_varyingDepth( 0 )
+{ }
+
+void CqNativeOutput::SqDeps::Merge( const SqDeps& deps )
+{
+	m_externals.insert( deps.m_externals.begin(), deps.m_externals.end() );
+	m_locals.insert( deps.m_locals.begin(), deps.m_locals.end() );
+	m_fWrites = m_fWrites || deps.m_fWrites;
+}
+
+bool CqNativeOutput::Translate( IqParseNode* pNode )
+{
+	pNode->Accept( *this );
+
+	// Derivatives evaluate their arguments at other points, which is only
+	// right if the variables have the same value throughout the shader.
+	for ( TqUint i = 0; i < m_derivFunctions.size(); i++ )
+	{
+		const SqDeps& deps = m_derivFunctions[ i ].m_deps;
+		for ( std::set<TqInt>::const_iterator e = deps.m_externals.begin(); e != deps.m_externals.end(); e++ )
+		{
+			if ( m_externals[ *e ].m_written )
+				Unsupported( "derivative of " + m_externals[ *e ].m_name + ", which the shader changes" );
+		}
+		for ( std::set<TqUint>::const_iterator l = deps.m_locals.begin(); l != deps.m_locals.end(); l++ )
+		{
+			if ( m_localAssignments[ *l ] != 1 )
+				Unsupported( "derivative of a local variable assigned more than once" );
+		}
+	}
+	if ( !m_fSupported )
+		return ( false );
+
+	std::ostringstream source;
+	source << nativePrelude;
+
+	// Tables describing the variables used, in the order they are passed in.
+	source << "namespace {\n\n"
+		<< "const char* const variables[] =\n{\n";
+	for ( TqUint i = 0; i < m_externals.size(); i++ )
+		source << "\t\"" << m_externals[ i ].m_name << "\",\n";
+	source << "\t0\n};\n\n"
+		<< "const char types[] = \"";
+	for ( TqUint i = 0; i < m_externals.size(); i++ )
+	{
+		char c = IsTriple( m_externals[ i ].m_type ) ? 't' : 'f';
+		source << static_cast<char>( m_externals[ i ].m_written ? std::toupper( c ) : c );
+	}
+	source << "\";\n\n";
+	for ( TqUint i = 0; i < m_derivFunctions.size(); i++ )
+		source << DerivFunctionSource( i );
+	source << "} // unnamed namespace\n\n";
+
+	source << "extern \"C\" int aqsis_native_version()\n{\n"
+		<< "\treturn " << AQSIS_NATIVE_SHADER_VERSION << ";\n}\n\n"
+		<< "extern \"C\" const char* const* aqsis_native_variables()\n{\n"
+		<< "\treturn variables;\n}\n\n"
+		<< "extern \"C\" const char* aqsis_native_types()\n{\n"
+		<< "\treturn types;\n}\n\n";
+
+	source << "extern \"C\" void aqsis_native_shade(float* const* vars, const int* varying,\n"
+		<< "\t\tint count, const unsigned char* running, const sl_env* env)\n{\n"
+		<< "\tfor(int i = 0; i < count; ++i)\n\t{\n"
+		<< "\t\tif(!running[i])\n\t\t\tcontinue;\n";
+	for ( TqUint i = 0; i < m_externals.size(); i++ )
+	{
+		source << "\t\t" << CppType( m_externals[ i ].m_type ) << " x" << i
+			<< " = sl_load" << ( IsTriple( m_externals[ i ].m_type ) ? 't' : 'f' )
+			<< "(vars[" << i << "], varying[" << i << "], i);\n";
+	}
+	for ( std::map<TqUint, TqInt>::const_iterator i = m_locals.begin(); i != m_locals.end(); i++ )
+		source << "\t\t" << CppType( i->second ) << " l" << i->first << " = 0;\n";
+	source << m_body.str();
+	for ( TqUint i = 0; i < m_externals.size(); i++ )
+	{
+		if ( m_externals[ i ].m_written )
+		{
+			source << "\t\tsl_store" << ( IsTriple( m_externals[ i ].m_type ) ? 't' : 'f' )
+				<< "(vars[" << i << "], i, x" << i << ");\n";
+		}
+	}
+	source << "\t}\n}\n";
+
+	m_source = source.str();
+	return ( true );
+}
+
+void CqNativeOutput::Unsupported( const std::string& what, IqParseNode* pNode )
+{
+	if ( m_fSupported )
+	{
+		std::ostringstream strm;
+		strm << what;
+		if ( pNode && pNode->strFileName() )
+			strm << " at " << pNode->strFileName() << ":" << pNode->LineNo();
+		m_unsupported = strm.str();
+	}
+	m_fSupported = false;
+}
+
+std::string CqNativeOutput::Expression( IqParseNode* pNode )
+{
+	std::string saved;
+	saved.swap( m_expr );
+	if ( IsStatement( pNode ) )
+		Unsupported( "statement used as an expression", pNode );
+	else
+	{
+		TqInt type = pNode->ResType() & Type_Mask;
+		if ( type != Type_Void && !CppType( type ) )
+			Unsupported( std::string( "expression of type " ) + gVariableTypeNames[ type ], pNode );
+		else
+			pNode->Accept( *this );
+	}
+	saved.swap( m_expr );
+	return ( saved );
+}
+
+void CqNativeOutput::Statement( IqParseNode* pNode )
+{
+	if ( pNode->NodeType() == ParseNode_Base )
+	{
+		// A block of statements.
+		for ( IqParseNode* pNext = pNode->pChild(); pNext; pNext = pNext->pNextSibling() )
+			Statement( pNext );
+	}
+	else if ( IsStatement( pNode ) )
+		pNode->Accept( *this );
+	else
+		Indent() << Expression( pNode ) << ";\n";
+}
+
+void CqNativeOutput::Arguments( IqParseNode* pArgs, std::vector<std::string>& args )
+{
+	for ( IqParseNode* pArg = pArgs; pArg; pArg = pArg->pNextSibling() )
+		args.push_back( Expression( pArg ) );
+}
+
+std::string CqNativeOutput::VariableName( const SqVarRef& ref, bool write )
+{
+	IqVarDef* pVD = IqVarDef::GetVariablePtr( ref );
+	if ( !pVD )
+	{
+		Unsupported( "unknown variable" );
+		return ( "" );
+	}
+	TqInt type = pVD->Type();
+	if ( ( type & Type_Array ) || !CppType( type & Type_Mask ) || pVD->fExtern() )
+	{
+		Unsupported( std::string( "variable " ) + pVD->strName() );
+		return ( "" );
+	}
+	if ( write && !( type & Type_Varying ) && m_varyingDepth > 0 )
+	{
+		Unsupported( std::string( "uniform variable " ) + pVD->strName()
+			+ " assigned under a varying condition" );
+		return ( "" );
+	}
+
+	// Parameters and standard variables are passed in by the VM.
+	if ( ref.m_Type == VarTypeStandard || ( type & Type_Param ) )
+		return ( ExternalName( pVD->strName(), type & Type_Mask, write ) );
+
+	m_locals[ ref.m_Index ] = type & Type_Mask;
+	if ( write )
+	{
+		m_localAssignments[ ref.m_Index ]++;
+		m_deps.m_fWrites = true;
+	}
+	else
+		m_deps.m_locals.insert( ref.m_Index );
+	std::ostringstream name;
+	name << "l" << ref.m_Index;
+	return ( name.str() );
+}
+
+std::string CqNativeOutput::ExternalName( const std::string& name, TqInt type, bool write )
+{
+	std::map<std::string, TqInt>::iterator i = m_externalIndex.find( name );
+	TqInt index = 0;
+	if ( i == m_externalIndex.end() )
+	{
+		SqExternal external;
+		external.m_name = name;
+		external.m_type = type;
+		external.m_written = false;
+		index = m_externals.size();
+		m_externals.push_back( external );
+		m_externalIndex[ external.m_name ] = index;
+	}
+	else
+		index = i->second;
+	if ( write )
+	{
+		m_externals[ index ].m_written = true;
+		m_deps.m_fWrites = true;
+	}
+	else
+		m_deps.m_externals.insert( index );
+	std::ostringstream strm;
+	strm << "x" << index;
+	return ( strm.str() );
+}
+
+void CqNativeOutput::Derivative( const std::string& kind, IqParseNode* pArguments, IqParseNode* pNode )
+{
+	IqParseNode* pDen = pArguments ? pArguments->pNextSibling() : 0;
+	if ( !pArguments || ( kind == "Deriv" ) != ( pDen != 0 ) )
+	{
+		Unsupported( kind, pNode );
+		return;
+	}
+	std::string y = DerivFunction( pArguments );
+	if ( kind == "Deriv" )
+	{
+		if ( ( pDen->ResType() & Type_Mask ) != Type_Float )
+		{
+			Unsupported( kind, pNode );
+			return;
+		}
+		std::string x = DerivFunction( pDen );
+		m_expr += "sl_Deriv(" + y + ", " + x + ", vars, varying, env, i)";
+	}
+	else
+	{
+		m_expr += "sl_" + kind + "(" + y + ", vars, varying, env, i, "
+			+ ExternalName( kind == "Du" ? "du" : "dv", Type_Float, false ) + ")";
+	}
+}
+
+std::string CqNativeOutput::DerivFunction( IqParseNode* pNode )
+{
+	SqDeps saved;
+	std::swap( saved, m_deps );
+	SqDerivFunction function;
+	function.m_type = pNode->ResType() & Type_Mask;
+	function.m_value = Expression( pNode );
+	function.m_deps = m_deps;
+	saved.Merge( m_deps );
+	std::swap( saved, m_deps );
+	if ( function.m_deps.m_fWrites )
+		Unsupported( "assignment in a derivative", pNode );
+
+	// The function recomputes the locals it reads, so depends on what they
+	// read in turn.
+	std::set<TqUint> done;
+	for ( bool fChanged = true; fChanged; )
+	{
+		fChanged = false;
+		std::set<TqUint> locals = function.m_deps.m_locals;
+		for ( std::set<TqUint>::const_iterator l = locals.begin(); l != locals.end(); l++ )
+		{
+			if ( !done.insert( *l ).second )
+				continue;
+			std::map<TqUint, SqLocalDef>::const_iterator def = m_localDefs.find( *l );
+			if ( def == m_localDefs.end() )
+			{
+				Unsupported( "derivative of a local variable assigned under a condition or loop", pNode );
+				break;
+			}
+			function.m_deps.Merge( def->second.m_deps );
+			fChanged = true;
+		}
+	}
+
+	std::ostringstream name;
+	name << "d" << m_derivFunctions.size();
+	m_derivFunctions.push_back( function );
+	return ( name.str() );
+}
+
+std::string CqNativeOutput::DerivFunctionSource( TqUint index ) const
+{
+	const SqDerivFunction& function = m_derivFunctions[ index ];
+	std::ostringstream source;
+	source << "inline " << CppType( function.m_type ) << " d" << index
+		<< "(float* const* vars, const int* varying, const sl_env* env, int i)\n{\n";
+	const SqDeps& deps = function.m_deps;
+	for ( std::set<TqInt>::const_iterator e = deps.m_externals.begin(); e != deps.m_externals.end(); e++ )
+	{
+		TqInt type = m_externals[ *e ].m_type;
+		source << "\t" << CppType( type ) << " x" << *e << " = sl_load"
+			<< ( IsTriple( type ) ? 't' : 'f' ) << "(vars[" << *e << "], varying[" << *e << "], i);\n";
+	}
+	// Recompute the locals in the order the shader assigns them.
+	std::map<TqInt, TqUint> locals;
+	for ( std::set<TqUint>::const_iterator l = deps.m_locals.begin(); l != deps.m_locals.end(); l++ )
+		locals[ m_localDefs.find( *l )->second.m_order ] = *l;
+	for ( std::map<TqInt, TqUint>::const_iterator l = locals.begin(); l != locals.end(); l++ )
+	{
+		source << "\t" << CppType( m_locals.find( l->second )->second ) << " l" << l->second
+			<< " = " << m_localDefs.find( l->second )->second.m_value << ";\n";
+	}
+	source << "\treturn " << function.m_value << ";\n}\n\n";
+	return ( source.str() );
+}
+
+bool CqNativeOutput::HasVaryingExit( IqParseNode* pNode, bool fVarying )
+{
+	if ( pNode->NodeType() == ParseNode_LoopMod )
+		return ( fVarying );
+	if ( ( pNode->NodeType() == ParseNode_Conditional || pNode->NodeType() == ParseNode_WhileConstruct )
+		&& pNode->pChild() && pNode->pChild()->fVarying() )
+		fVarying = true;
+	for ( IqParseNode* pChild = pNode->pChild(); pChild; pChild = pChild->pNextSibling() )
+	{
+		if ( HasVaryingExit( pChild, fVarying ) )
+			return ( true );
+	}
+	return ( false );
+}
+
+bool CqNativeOutput::IsStatement( IqParseNode* pNode ) const
+{
+	switch ( pNode->NodeType() )
+	{
+		case ParseNode_DiscardResult:
+		case ParseNode_WhileConstruct:
+		case ParseNode_LoopMod:
+		case ParseNode_IlluminateConstruct:
+		case ParseNode_IlluminanceConstruct:
+		case ParseNode_SolarConstruct:
+		case ParseNode_GatherConstruct:
+		case ParseNode_Conditional:
+			return ( true );
+		default:
+			return ( false );
+	}
+}
+
+const char* CqNativeOutput::CppType( TqInt type )
+{
+	switch ( type )
+	{
+		case Type_Float:
+			return ( "float" );
+		case Type_Point:
+		case Type_Color:
+		case Type_Triple:
+		case Type_Normal:
+		case Type_Vector:
+			return ( "V3" );
+		default:
+			return ( 0 );
+	}
+}
+
+bool CqNativeOutput::IsTriple( TqInt type )
+{
+	return ( type == Type_Point || type == Type_Color || type == Type_Triple
+		|| type == Type_Normal || type == Type_Vector );
+}
+
+std::ostream& CqNativeOutput::Indent()
+{
+	for ( TqInt i = 0; i < m_indent; i++ )
+		m_body << "\t";
+	return ( m_body );
+}
+
+void CqNativeOutput::Visit( IqParseNode& N )
+{
+	// A block used as an expression, which is fine as long as it holds a
+	// single expression.
+	IqParseNode* pChild = N.pChild();
+	if ( pChild && !pChild->pNextSibling() )
+		m_expr += Expression( pChild );
+	else
+		Unsupported( "block used as an expression", &N );
+}
+
+void CqNativeOutput::Visit( IqParseNodeShader& S )
+{
+	IqParseNode* pNode = static_cast<IqParseNode*>( S.GetInterface( ParseNode_Base ) );
+	m_shaderName = S.strName();
+	IqParseNode* pCode = pNode->pChild();
+	if ( pCode )
+		Statement( pCode );
+}
+
+void CqNativeOutput::Visit( IqParseNodeFunctionCall& FC )
+{
+	IqFuncDef* pFunc = FC.pFuncDef();
+	IqParseNode* pNode = static_cast<IqParseNode*>( FC.GetInterface( ParseNode_Base ) );
+	IqParseNode* pArguments = pNode->pChild();
+	if ( pFunc->fLocal() )
+	{
+		Unsupported( std::string( "call to local function " ) + pFunc->strName(), pNode );
+		return;
+	}
+
+	// Operators map directly onto C++.
+	std::string name = pFunc->strName();
+	if ( name.compare( 0, 8, "operator" ) == 0 )
+	{
+		std::vector<std::string> args;
+		Arguments( pArguments, args );
+		std::string op = name.substr( 8 );
+		if ( op == "neg" && args.size() == 1 )
+			m_expr += "(-" + args[ 0 ] + ")";
+		else if ( args.size() != 2 )
+			Unsupported( "operator " + op, pNode );
+		else if ( op == "." )
+			m_expr += "sl_dot(" + args[ 0 ] + ", " + args[ 1 ] + ")";
+		else if ( op == "^" )
+			m_expr += "sl_cross(" + args[ 0 ] + ", " + args[ 1 ] + ")";
+		else if ( op == "+" || op == "-" || op == "*" || op == "/" )
+			m_expr += "(" + args[ 0 ] + " " + op + " " + args[ 1 ] + ")";
+		else
+			Unsupported( "operator " + op, pNode );
+		return;
+	}
+
+	// The VM names of the derivatives are Du, Dv and Deriv prefixed by the type.
+	std::string vmName = pFunc->strVMName();
+	std::string kind = vmName.empty() ? vmName : vmName.substr( 1 );
+	if ( kind == "Du" || kind == "Dv" || kind == "Deriv" )
+	{
+		Derivative( kind, pArguments, pNode );
+		return;
+	}
+
+	const SqNativeShadeop* pShadeop = findNativeShadeop( pFunc->strVMName() );
+	if ( !pShadeop )
+	{
+		Unsupported( std::string( "shadeop " ) + pFunc->strName(), pNode );
+		return;
+	}
+	std::vector<std::string> args;
+	if ( pShadeop->m_call == Call_Assign )
+	{
+		// The first argument is a variable which the shadeop sets.
+		IqParseNodeVariable* pVar = 0;
+		if ( pArguments && pArguments->NodeType() == ParseNode_Variable )
+			pVar = static_cast<IqParseNodeVariable*>( pArguments->GetInterface( ParseNode_Variable ) );
+		if ( !pVar )
+		{
+			Unsupported( std::string( "shadeop " ) + pFunc->strName(), pNode );
+			return;
+		}
+		args.push_back( VariableName( pVar->VarRef(), true ) );
+		Arguments( pArguments->pNextSibling(), args );
+	}
+	else
+		Arguments( pArguments, args );
+
+	if ( pShadeop->m_call == Call_Fold )
+	{
+		if ( args.empty() )
+		{
+			Unsupported( std::string( "shadeop " ) + pFunc->strName(), pNode );
+			return;
+		}
+		std::string result = args[ 0 ];
+		for ( TqUint i = 1; i < args.size(); i++ )
+			result = std::string( pShadeop->m_function ) + "(" + result + ", " + args[ i ] + ")";
+		m_expr += result;
+		return;
+	}
+	m_expr += pShadeop->m_function;
+	m_expr += pShadeop->m_call == Call_Noise ? "(env, sl_args(" : "(";
+	for ( TqUint i = 0; i < args.size(); i++ )
+	{
+		if ( i > 0 )
+			m_expr += ", ";
+		m_expr += args[ i ];
+	}
+	m_expr += pShadeop->m_call == Call_Noise ? "))" : ")";
+}
+
+void CqNativeOutput::Visit( IqParseNodeUnresolvedCall& UFC )
+{
+	Unsupported( std::string( "external function " ) + UFC.strName(),
+			static_cast<IqParseNode*>( UFC.GetInterface( ParseNode_Base ) ) );
+}
+
+void CqNativeOutput::Visit( IqParseNodeVariable& V )
+{
+	IqParseNodeVariable* pVN = static_cast<IqParseNodeVariable*>( V.GetInterface( ParseNode_Variable ) );
+	m_expr += VariableName( pVN->VarRef(), false );
+}
+
+void CqNativeOutput::Visit( IqParseNodeArrayVariable& AV )
+{
+	Unsupported( "array variable", static_cast<IqParseNode*>( AV.GetInterface( ParseNode_Base ) ) );
+}
+
+void CqNativeOutput::Visit( IqParseNodeVariableAssign& VA )
+{
+	IqParseNode* pNode = static_cast<IqParseNode*>( VA.GetInterface( ParseNode_Base ) );
+	IqParseNodeVariable* pVN = static_cast<IqParseNodeVariable*>( VA.GetInterface( ParseNode_Variable ) );
+	IqParseNode* pExpr = pNode->pChild();
+	if ( !pExpr )
+	{
+		Unsupported( "empty assignment", pNode );
+		return;
+	}
+	SqDeps saved;
+	std::swap( saved, m_deps );
+	std::string value = Expression( pExpr );
+	SqDeps deps = m_deps;
+	saved.Merge( m_deps );
+	std::swap( saved, m_deps );
+	std::string name = VariableName( pVN->VarRef(), true );
+	m_expr += "(" + name + " = " + value + ")";
+
+	// Note the value of a local assigned outside control flow, so that
+	// derivatives can recompute it.
+	const SqVarRef& ref = pVN->VarRef();
+	IqVarDef* pVD = IqVarDef::GetVariablePtr( ref );
+	if ( pVD && ref.m_Type != VarTypeStandard && !( pVD->Type() & Type_Param )
+		&& m_flowDepth == 0 && !deps.m_fWrites && m_localDefs.find( ref.m_Index ) == m_localDefs.end() )
+	{
+		SqLocalDef def;
+		def.m_value = value;
+		def.m_deps = deps;
+		def.m_order = m_localDefs.size();
+		m_localDefs[ ref.m_Index ] = def;
+	}
+}
+
+void CqNativeOutput::Visit( IqParseNodeArrayVariableAssign& AVA )
+{
+	Unsupported( "array assignment", static_cast<IqParseNode*>( AVA.GetInterface( ParseNode_Base ) ) );
+}
+
+void CqNativeOutput::Visit( IqParseNodeOperator& OP )
+{
+	IqParseNode* pNode = static_cast<IqParseNode*>( OP.GetInterface( ParseNode_Base ) );
+	IqParseNode* pOperandA = pNode->pChild();
+	IqParseNode* pOperandB = pOperandA ? pOperandA->pNextSibling() : 0;
+	if ( !pOperandA )
+	{
+		Unsupported( "operator without operands", pNode );
+		return;
+	}
+	// The parser adds the operands of a relation in reverse order, so the
+	// left hand side is the second child.
+	if ( pOperandB && pNode->GetInterface( ParseNode_RelationalOp ) )
+		std::swap( pOperandA, pOperandB );
+	bool fTriple = IsTriple( pOperandA->ResType() & Type_Mask )
+		|| ( pOperandB && IsTriple( pOperandB->ResType() & Type_Mask ) );
+	std::string a = Expression( pOperandA );
+	std::string b = pOperandB ? Expression( pOperandB ) : "";
+
+	const char* op = 0;
+	switch ( OP.Operator() )
+	{
+		case Op_Add: op = "+"; break;
+		case Op_Sub: op = "-"; break;
+		case Op_Mul: op = "*"; break;
+		case Op_Div: op = "/"; break;
+		case Op_L: op = "<"; break;
+		case Op_G: op = ">"; break;
+		case Op_GE: op = ">="; break;
+		case Op_LE: op = "<="; break;
+		case Op_EQ: op = "=="; break;
+		case Op_NE: op = "!="; break;
+		default: break;
+	}
+
+	switch ( OP.Operator() )
+	{
+		case Op_Add:
+		case Op_Sub:
+		case Op_Mul:
+		case Op_Div:
+			m_expr += "(" + a + " " + op + " " + b + ")";
+			return;
+		case Op_Dot:
+			m_expr += "sl_dot(" + a + ", " + b + ")";
+			return;
+		case Op_Crs:
+			m_expr += "sl_cross(" + a + ", " + b + ")";
+			return;
+		case Op_Mod:
+			if ( fTriple )
+				break;
+			m_expr += "sl_mod(" + a + ", " + b + ")";
+			return;
+		case Op_EQ:
+		case Op_NE:
+			if ( fTriple )
+			{
+				m_expr += std::string( "float(" ) + ( OP.Operator() == Op_NE ? "!" : "" )
+					+ "sl_eq(" + a + ", " + b + "))";
+				return;
+			}
+			// Fall through
+		case Op_L:
+		case Op_G:
+		case Op_GE:
+		case Op_LE:
+			if ( fTriple )
+				break;
+			m_expr += "float(" + a + " " + op + " " + b + ")";
+			return;
+		case Op_Plus:
+			m_expr += a;
+			return;
+		case Op_Neg:
+			m_expr += "(-" + a + ")";
+			return;
+		case Op_LogicalNot:
+			if ( fTriple )
+				break;
+			m_expr += "float(" + a + " == 0)";
+			return;
+		case Op_LogAnd:
+			m_expr += "sl_and(" + a + ", " + b + ")";
+			return;
+		case Op_LogOr:
+			m_expr += "sl_or(" + a + ", " + b + ")";
+			return;
+		default:
+			break;
+	}
+	Unsupported( "operator", pNode );
+}
+
+void CqNativeOutput::Visit( IqParseNodeMathOp& OP )
+{
+	Visit( *static_cast<IqParseNodeOperator*>( OP.GetInterface( ParseNode_Operator ) ) );
+}
+
+void CqNativeOutput::Visit( IqParseNodeRelationalOp& OP )
+{
+	Visit( *static_cast<IqParseNodeOperator*>( OP.GetInterface( ParseNode_Operator ) ) );
+}
+
+void CqNativeOutput::Visit( IqParseNodeUnaryOp& OP )
+{
+	Visit( *static_cast<IqParseNodeOperator*>( OP.GetInterface( ParseNode_Operator ) ) );
+}
+
+void CqNativeOutput::Visit( IqParseNodeLogicalOp& OP )
+{
+	Visit( *static_cast<IqParseNodeOperator*>( OP.GetInterface( ParseNode_Operator ) ) );
+}
+
+void CqNativeOutput::Visit( IqParseNodeDiscardResult& DR )
+{
+	IqParseNode* pNode = static_cast<IqParseNode*>( DR.GetInterface( ParseNode_Base ) );
+	for ( IqParseNode* pNext = pNode->pChild(); pNext; pNext = pNext->pNextSibling() )
+		Statement( pNext );
+}
+
+void CqNativeOutput::Visit( IqParseNodeConstantFloat& F )
+{
+	TqFloat value = F.Value();
+	if ( !( value == value ) || std::fabs( value ) > FLT_MAX )
+	{
+		Unsupported( "non-finite constant" );
+		return;
+	}
+	// 9 significant digits are enough to reproduce any float exactly.
+	std::ostringstream strm;
+	strm.precision( 9 );
+	strm << "float(" << value << ")";
+	m_expr += strm.str();
+}
+
+void CqNativeOutput::Visit( IqParseNodeConstantString& S )
+{
+	Unsupported( "string constant", static_cast<IqParseNode*>( S.GetInterface( ParseNode_Base ) ) );
+}
+
+void CqNativeOutput::Visit( IqParseNodeWhileConstruct& WC )
+{
+	IqParseNode* pNode = static_cast<IqParseNode*>( WC.GetInterface( ParseNode_Base ) );
+	IqParseNode* pArg = pNode->pChild();
+	assert( pArg != 0 );
+	IqParseNode* pStmt = pArg->pNextSibling();
+	assert( pStmt != 0 );
+	IqParseNode* pStmtInc = pStmt->pNextSibling();
+
+	// break and continue can leave several loops at once, so are translated
+	// as jumps to labels after the loop body and after the loop.
+	SqLoop loop;
+	loop.m_label = m_labels++;
+	loop.m_fBreak = false;
+	loop.m_fContinue = false;
+
+	// The points leave the loop at different times if the condition is
+	// varying, or if a break or continue is under a varying condition.
+	bool fVarying = pArg->fVarying() || HasVaryingExit( pStmt, false );
+	m_flowDepth++;
+	if ( fVarying )
+		m_varyingDepth++;
+
+	Indent() << "for(;;)\n";
+	Indent() << "{\n";
+	m_indent++;
+	Indent() << "if(" << Expression( pArg ) << " == 0)\n";
+	Indent() << "\tbreak;\n";
+	m_loops.push_back( loop );
+	Statement( pStmt );
+	loop = m_loops.back();
+	m_loops.pop_back();
+	if ( loop.m_fContinue )
+		Indent() << "continue" << loop.m_label << ":;\n";
+	if ( pStmtInc )
+		Statement( pStmtInc );
+	m_indent--;
+	Indent() << "}\n";
+
+	m_flowDepth--;
+	if ( fVarying )
+		m_varyingDepth--;
+	if ( loop.m_fBreak )
+		Indent() << "break" << loop.m_label << ":;\n";
+}
+
+void CqNativeOutput::Visit( IqParseNodeLoopMod& LM )
+{
+	IqParseNode* pNode = static_cast<IqParseNode*>( LM.GetInterface( ParseNode_Base ) );
+	IqParseNode* pChild = pNode->pChild();
+	TqInt depth = 1;
+	if ( pChild )
+	{
+		IqParseNodeConstantFloat* pDepth = static_cast<IqParseNodeConstantFloat*>(
+				pChild->GetInterface( ParseNode_ConstantFloat ) );
+		if ( !pDepth )
+		{
+			Unsupported( "loop depth", pNode );
+			return;
+		}
+		depth = lround( pDepth->Value() );
+	}
+	if ( depth < 1 || depth > static_cast<TqInt>( m_loops.size() ) )
+	{
+		Unsupported( "loop depth", pNode );
+		return;
+	}
+	SqLoop& loop = m_loops[ m_loops.size() - depth ];
+	switch ( LM.modType() )
+	{
+		case LoopMod_Break:
+			loop.m_fBreak = true;
+			Indent() << "goto break" << loop.m_label << ";\n";
+			break;
+		case LoopMod_Continue:
+			loop.m_fContinue = true;
+			Indent() << "goto continue" << loop.m_label << ";\n";
+			break;
+	}
+}
+
+void CqNativeOutput::Visit( IqParseNodeIlluminateConstruct& IC )
+{
+	Unsupported( "illuminate", static_cast<IqParseNode*>( IC.GetInterface( ParseNode_Base ) ) );
+}
+
+void CqNativeOutput::Visit( IqParseNodeIlluminanceConstruct& IC )
+{
+	Unsupported( "illuminance", static_cast<IqParseNode*>( IC.GetInterface( ParseNode_Base ) ) );
+}
+
+void CqNativeOutput::Visit( IqParseNodeSolarConstruct& SC )
+{
+	Unsupported( "solar", static_cast<IqParseNode*>( SC.GetInterface( ParseNode_Base ) ) );
+}
+
+void CqNativeOutput::Visit( IqParseNodeGatherConstruct& GC )
+{
+	Unsupported( "gather", static_cast<IqParseNode*>( GC.GetInterface( ParseNode_Base ) ) );
+}
+
+void CqNativeOutput::Visit( IqParseNodeConditional& C )
+{
+	IqParseNode* pNode = static_cast<IqParseNode*>( C.GetInterface( ParseNode_Base ) );
+	IqParseNode* pArg = pNode->pChild();
+	assert( pArg != 0 );
+	IqParseNode* pTrueStmt = pArg->pNextSibling();
+	assert( pTrueStmt != 0 );
+	IqParseNode* pFalseStmt = pTrueStmt->pNextSibling();
+
+	Indent() << "if(" << Expression( pArg ) << " != 0)\n";
+	m_flowDepth++;
+	if ( pArg->fVarying() )
+		m_varyingDepth++;
+	Indent() << "{\n";
+	m_indent++;
+	Statement( pTrueStmt );
+	m_indent--;
+	Indent() << "}\n";
+	if ( pFalseStmt )
+	{
+		Indent() << "else\n";
+		Indent() << "{\n";
+		m_indent++;
+		Statement( pFalseStmt );
+		m_indent--;
+		Indent() << "}\n";
+	}
+	m_flowDepth--;
+	if ( pArg->fVarying() )
+		m_varyingDepth--;
+}
+
+void CqNativeOutput::Visit( IqParseNodeConditionalExpression& CE )
+{
+	IqParseNode* pNode = static_cast<IqParseNode*>( CE.GetInterface( ParseNode_Base ) );
+	IqParseNode* pCondition = pNode->pChild();
+	assert( pCondition != 0 );
+	IqParseNode* pTrueStmt = pCondition->pNextSibling();
+	assert( pTrueStmt != 0 );
+	IqParseNode* pFalseStmt = pTrueStmt->pNextSibling();
+	assert( pFalseStmt != 0 );
+
+	const char* type = CppType( pTrueStmt->ResType() & Type_Mask );
+	if ( !type )
+	{
+		Unsupported( "conditional expression", pNode );
+		return;
+	}
+	std::string condition = Expression( pCondition );
+	m_flowDepth++;
+	if ( pCondition->fVarying() )
+		m_varyingDepth++;
+	m_expr += "(" + condition + " != 0 ? " + type + "(" + Expression( pTrueStmt )
+		+ ") : " + type + "(" + Expression( pFalseStmt ) + "))";
+	m_flowDepth--;
+	if ( pCondition->fVarying() )
+		m_varyingDepth--;
+}
+
+void CqNativeOutput::Visit( IqParseNodeTypeCast& TC )
+{
+	IqParseNode* pNode = static_cast<IqParseNode*>( TC.GetInterface( ParseNode_Base ) );
+	IqParseNode* pOperand = pNode->pChild();
+	assert( pOperand != 0 );
+
+	TqInt typeFrom = pOperand->ResType() & Type_Mask;
+	TqInt typeTo = TC.CastTo() & Type_Mask;
+	std::string operand = Expression( pOperand );
+	if ( typeFrom == typeTo || ( IsTriple( typeFrom ) && IsTriple( typeTo ) ) )
+		m_expr += operand;
+	else if ( typeFrom == Type_Float && IsTriple( typeTo ) )
+		m_expr += "V3(" + operand + ")";
+	else
+		Unsupported( "type cast", pNode );
+}
+
+void CqNativeOutput::Visit( IqParseNodeTriple& T )
+{
+	IqParseNode* pNode = static_cast<IqParseNode*>( T.GetInterface( ParseNode_Base ) );
+	IqParseNode* pA = pNode->pChild();
+	assert( pA != 0 );
+	IqParseNode* pB = pA->pNextSibling();
+	assert( pB != 0 );
+	IqParseNode* pC = pB->pNextSibling();
+	assert( pC != 0 );
+	m_expr += "V3(" + Expression( pA ) + ", " + Expression( pB ) + ", " + Expression( pC ) + ")";
+}
+
+void CqNativeOutput::Visit( IqParseNodeSixteenTuple& ST )
+{
+	Unsupported( "matrix", static_cast<IqParseNode*>( ST.GetInterface( ParseNode_Base ) ) );
+}
+
+void CqNativeOutput::Visit( IqParseNodeMessagePassingFunction& MPF )
+{
+	Unsupported( "message passing", static_cast<IqParseNode*>( MPF.GetInterface( ParseNode_Base ) ) );
+}
+
+void CqNativeOutput::Visit( IqParseNodeTextureNameWithChannel& TNWC )
+{
+	Unsupported( "texture" );
+}
+
+//-----------------------------------------------------------------------
+
+} // namespace Aqsis
@@ -0,0 +1,221 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+		\brief Compiler backend to translate shaders into C++.
+*/
+
+#ifndef NATIVEOUTPUT_H_INCLUDED
+#define NATIVEOUTPUT_H_INCLUDED 1
+
+#include	<vector>
+#include	<map>
+#include	<set>
+#include	<sstream>
+#include	<string>
+
+#include	<aqsis/aqsis.h>
+
+#include	<aqsis/slcomp/iparsenode.h>
+#include	<aqsis/slcomp/ivardef.h>
+#include	<aqsis/slcomp/ifuncdef.h>
+#include	<aqsis/slcomp/icodegen.h>
+
+namespace Aqsis {
+
+
+//----------------------------------------------------------------------
+/** \brief Translate the main code of a shader into C++.
+ *
+ * The generated source has no dependencies beyond the C++ standard library,
+ * and exports the plain C interface described with
+ * AQSIS_NATIVE_SHADER_VERSION.  The code runs the shader body once for each
+ * running shading point, reading the shader parameters and standard
+ * variables it uses from the arrays passed in by the VM.
+ *
+ * Only a subset of the shading language is translated: float and
+ * point-like variables, arithmetic, the elementwise math shadeops, noise,
+ * derivatives and the control flow constructs.  Noise calls back into the
+ * renderer.  A derivative evaluates its argument at the neighbouring points,
+ * so the argument may only depend on variables which the shader never
+ * changes, and on locals assigned once outside any control flow.
+ *
+ * Anything else, such as strings, arrays, illuminance loops, texturing or
+ * local functions, makes Translate() fail, in which case the shader runs on
+ * the VM alone.  So does assigning to a uniform variable under a varying
+ * condition, since the VM then gives all points the value assigned by the
+ * running ones, which code running a point at a time can't reproduce.
+ */
+class CqNativeOutput : public IqParseNodeVisitor
+{
+	public:
+		CqNativeOutput();
+
+		/// Translate the shader, returns false if it can't be translated.
+		bool Translate( IqParseNode* pNode );
+		/// The generated C++ source.
+		std::string strSource() const
+		{
+			return ( m_source );
+		}
+		/// The name of the shader.
+		const std::string& strShaderName() const
+		{
+			return ( m_shaderName );
+		}
+		/// Description of the first construct which couldn't be translated.
+		const std::string& strUnsupported() const
+		{
+			return ( m_unsupported );
+		}
+
+		virtual	void Visit( IqParseNode& );
+		virtual	void Visit( IqParseNodeShader& );
+		virtual	void Visit( IqParseNodeFunctionCall& );
+		virtual	void Visit( IqParseNodeUnresolvedCall& );
+		virtual	void Visit( IqParseNodeVariable& );
+		virtual	void Visit( IqParseNodeArrayVariable& );
+		virtual	void Visit( IqParseNodeVariableAssign& );
+		virtual	void Visit( IqParseNodeArrayVariableAssign& );
+		virtual	void Visit( IqParseNodeOperator& );
+		virtual	void Visit( IqParseNodeMathOp& );
+		virtual	void Visit( IqParseNodeRelationalOp& );
+		virtual	void Visit( IqParseNodeUnaryOp& );
+		virtual	void Visit( IqParseNodeLogicalOp& );
+		virtual	void Visit( IqParseNodeDiscardResult& );
+		virtual	void Visit( IqParseNodeConstantFloat& );
+		virtual	void Visit( IqParseNodeConstantString& );
+		virtual	void Visit( IqParseNodeWhileConstruct& );
+		virtual	void Visit( IqParseNodeLoopMod& );
+		virtual	void Visit( IqParseNodeIlluminateConstruct& );
+		virtual	void Visit( IqParseNodeIlluminanceConstruct& );
+		virtual	void Visit( IqParseNodeSolarConstruct& );
+		virtual	void Visit( IqParseNodeGatherConstruct& );
+		virtual	void Visit( IqParseNodeConditional& );
+		virtual	void Visit( IqParseNodeConditionalExpression& );
+		virtual	void Visit( IqParseNodeTypeCast& );
+		virtual	void Visit( IqParseNodeTriple& );
+		virtual	void Visit( IqParseNodeSixteenTuple& );
+		virtual	void Visit( IqParseNodeMessagePassingFunction& );
+		virtual	void Visit( IqParseNodeTextureNameWithChannel& );
+
+	private:
+		/// A shader parameter or standard variable used by the code.
+		struct SqExternal
+		{
+			std::string	m_name;
+			TqInt	m_type;
+			bool	m_written;
+		};
+		/// The variables an expression reads, and whether it writes any.
+		struct SqDeps
+		{
+			std::set<TqInt>	m_externals;
+			std::set<TqUint>	m_locals;
+			bool	m_fWrites;
+
+			SqDeps() : m_externals(), m_locals(), m_fWrites( false )
+			{}
+			void	Merge( const SqDeps& deps );
+		};
+		/// A local variable assigned outside any control flow.
+		struct SqLocalDef
+		{
+			std::string	m_value;
+			SqDeps	m_deps;
+			TqInt	m_order;
+		};
+		/// A function to evaluate the argument of a derivative at any point.
+		struct SqDerivFunction
+		{
+			TqInt	m_type;
+			std::string	m_value;
+			SqDeps	m_deps;
+		};
+
+		void	Unsupported( const std::string& what, IqParseNode* pNode = 0 );
+		/// Translate an expression, returning the C++ code for it.
+		std::string	Expression( IqParseNode* pNode );
+		/// Translate a statement into m_body.
+		void	Statement( IqParseNode* pNode );
+		/// Translate the argument list of a shadeop call.
+		void	Arguments( IqParseNode* pArgs, std::vector<std::string>& args );
+		/// Find the C++ name of a variable, noting its use.
+		std::string	VariableName( const SqVarRef& ref, bool write );
+		/// Find the C++ name of a variable passed in by the VM.
+		std::string	ExternalName( const std::string& name, TqInt type, bool write );
+		/// Translate a call to Du, Dv or Deriv.
+		void	Derivative( const std::string& kind, IqParseNode* pArguments, IqParseNode* pNode );
+		/// Add a function evaluating an expression at any point, returning its name.
+		std::string	DerivFunction( IqParseNode* pNode );
+		/// The source of a function added by DerivFunction().
+		std::string	DerivFunctionSource( TqUint index ) const;
+		/// Check whether a loop body can leave the loop under a varying condition.
+		static	bool	HasVaryingExit( IqParseNode* pNode, bool fVarying );
+		bool	IsStatement( IqParseNode* pNode ) const;
+		static	const char*	CppType( TqInt type );
+		static	bool	IsTriple( TqInt type );
+		std::ostream&	Indent();
+
+		std::string	m_shaderName;
+		std::string	m_source;
+		std::string	m_unsupported;
+		bool	m_fSupported;
+
+		/// Code of the expression being translated.
+		std::string	m_expr;
+		/// Code of the shader body.
+		std::ostringstream	m_body;
+		TqInt	m_indent;
+
+		std::vector<SqExternal>	m_externals;
+		std::map<std::string, TqInt>	m_externalIndex;
+		/// Types of the local variables by index in gLocalVars.
+		std::map<TqUint, TqInt>	m_locals;
+		/// A loop being translated.
+		struct SqLoop
+		{
+			TqInt	m_label;
+			bool	m_fBreak;		///< A break jumps out of the loop.
+			bool	m_fContinue;	///< A continue jumps to the end of the loop body.
+		};
+		/// The enclosing loops, innermost last.
+		std::vector<SqLoop>	m_loops;
+		TqInt	m_labels;
+
+		/// Variables used by the expression being translated.
+		SqDeps	m_deps;
+		/// Number of assignments to each local variable.
+		std::map<TqUint, TqInt>	m_localAssignments;
+		/// Values of locals assigned outside any control flow.
+		std::map<TqUint, SqLocalDef>	m_localDefs;
+		std::vector<SqDerivFunction>	m_derivFunctions;
+		/// Number of enclosing conditionals and loops.
+		TqInt	m_flowDepth;
+		/// Number of enclosing conditionals and loops with a varying condition.
+		TqInt	m_varyingDepth;
+};
+
+
+//-----------------------------------------------------------------------
+
+} // namespace Aqsis
+
+#endif	// !NATIVEOUTPUT_H_INCLUDED
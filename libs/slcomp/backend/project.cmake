@@ -1,6 +1,8 @@
 set(backend_srcs
 	codegengraphviz.cpp
+	codegennative.cpp
 	codegenvm.cpp
+	nativeoutput.cpp
 	parsetreeviz.cpp
 	vmdatagather.cpp
 	vmoutput.cpp
@@ -8,6 +10,7 @@ set(backend_srcs
 make_absolute(backend_srcs ${backend_SOURCE_DIR})
 
 set(backend_hdrs
+	nativeoutput.h
 	parsetreeviz.h
 	vmdatagather.h
 	vmoutput.h
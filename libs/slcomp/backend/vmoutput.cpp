@@ -105,6 +105,8 @@ void CqCodeGenOutput::Visit( IqParseNodeShader& S )
 			Use |= ( 0x00000001 << i );
 	}
 	m_slxFile << std::endl << "USES " << Use << std::endl << std::endl;
+	if ( !m_strNativeLib.empty() )
+		m_slxFile << "NATIVE " << m_strNativeLib << std::endl << std::endl;
 
 	// Output any declared variables.
 	for ( i = 0; i < gLocalVars.size(); i++ )
@@ -49,8 +49,13 @@ namespace Aqsis {
 class CqCodeGenOutput : public IqParseNodeVisitor
 {
 	public:
-		CqCodeGenOutput( CqCodeGenDataGather* pDataGather, std::string strOutName ) :
+		/** \param strNativeLib - if not empty, the native library to run in
+		 * place of the main code of the shader.
+		 */
+		CqCodeGenOutput( CqCodeGenDataGather* pDataGather, std::string strOutName,
+				std::string strNativeLib = "" ) :
 		       	m_strOutName( strOutName ),
+		       	m_strNativeLib( strNativeLib ),
 		       	m_gcLabels( 0 ),
 		       	m_pDataGather( pDataGather )
 		{}
@@ -108,6 +113,7 @@ class CqCodeGenOutput : public IqParseNodeVisitor
 		void rsPop();
 
 		CqString	m_strOutName;
+		std::string	m_strNativeLib;
 		TqInt	m_gcLabels;
 		CqCodeGenDataGather*	m_pDataGather;
 		std::ofstream	m_slxFile;
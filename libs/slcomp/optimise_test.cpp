@@ -0,0 +1,257 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+		\brief Tests for the optimisations made to the shader parse tree.
+*/
+
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/auto_unit_test.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <aqsis/slcomp/icodegen.h>
+#include <aqsis/slcomp/libslparse.h>
+
+namespace {
+
+using namespace Aqsis;
+
+/// Compile a shader and return the text of the VM code generated for it.
+std::string compileShader(const std::string& source)
+{
+	ResetParser();
+	std::istringstream in(source);
+	std::ostringstream errors;
+	BOOST_REQUIRE_MESSAGE(Parse(in, "optimise_test.sl", errors), errors.str());
+	const char* slxName = "optimise_test.slx";
+	CqCodeGenVM codeGen;
+	codeGen.OutputTree(GetParseTree(), slxName);
+
+	std::ifstream programFile(slxName);
+	std::ostringstream program;
+	program << programFile.rdbuf();
+	programFile.close();
+	std::remove(slxName);
+	return program.str();
+}
+
+/// Extract the text between the given segment header and the next one.
+std::string segment(const std::string& program, const std::string& name)
+{
+	std::string::size_type begin = program.find("segment " + name);
+	if(begin == std::string::npos)
+		return "";
+	std::string::size_type end = program.find("segment ", begin + 1);
+	return program.substr(begin, end == std::string::npos ? end : end - begin);
+}
+
+/// Find the declaration of a variable in the data segment, or "" if there
+/// isn't one.
+std::string declaration(const std::string& program, const std::string& name)
+{
+	std::istringstream data(segment(program, "Data"));
+	std::string line;
+	while(std::getline(data, line))
+	{
+		if(line.size() > name.size()
+			&& line.compare(line.size() - name.size(), name.size(), name) == 0
+			&& line[line.size() - name.size() - 1] == ' ')
+			return line;
+	}
+	return "";
+}
+
+/// Check whether any variable whose name contains the given text is declared.
+bool declares(const std::string& program, const std::string& text)
+{
+	return segment(program, "Data").find(text) != std::string::npos;
+}
+
+bool isUniform(const std::string& program, const std::string& name)
+{
+	return declaration(program, name).find("uniform") != std::string::npos;
+}
+
+/// Count the lines of the code segment consisting of the given instruction.
+int countInstructions(const std::string& program, const std::string& instruction)
+{
+	std::istringstream code(segment(program, "Code"));
+	std::string line;
+	int count = 0;
+	while(std::getline(code, line))
+	{
+		std::string::size_type begin = line.find_first_not_of(" \t");
+		if(begin != std::string::npos && line.substr(begin) == instruction)
+			++count;
+	}
+	return count;
+}
+
+/// Position of an instruction in the code segment, relative to the others.
+std::string::size_type position(const std::string& program, const std::string& text)
+{
+	return segment(program, "Code").find(text);
+}
+
+} // unnamed namespace
+
+
+BOOST_AUTO_TEST_SUITE(optimise_tests)
+
+BOOST_AUTO_TEST_CASE(optimise_fold_constants_test)
+{
+	std::string program = compileShader(
+		"surface test()\n"
+		"{\n"
+		"	Ci = 2 * 3 * s;\n"
+		"}\n");
+	BOOST_CHECK_EQUAL(countInstructions(program, "pushif 6"), 1);
+	BOOST_CHECK_EQUAL(countInstructions(program, "mulff"), 1);
+}
+
+BOOST_AUTO_TEST_CASE(optimise_identities_test)
+{
+	std::string program = compileShader(
+		"surface test()\n"
+		"{\n"
+		"	float x = s * 1 + 0;\n"
+		"	Ci = x;\n"
+		"}\n");
+	BOOST_CHECK_EQUAL(countInstructions(program, "mulff"), 0);
+	BOOST_CHECK_EQUAL(countInstructions(program, "addff"), 0);
+}
+
+BOOST_AUTO_TEST_CASE(optimise_constant_branch_test)
+{
+	std::string program = compileShader(
+		"surface test()\n"
+		"{\n"
+		"	if(1 > 2)\n"
+		"		Ci = sin(s);\n"
+		"	else\n"
+		"		Ci = cos(s);\n"
+		"}\n");
+	BOOST_CHECK_EQUAL(countInstructions(program, "sin"), 0);
+	BOOST_CHECK_EQUAL(countInstructions(program, "cos"), 1);
+}
+
+BOOST_AUTO_TEST_CASE(optimise_dead_stores_test)
+{
+	std::string program = compileShader(
+		"surface test()\n"
+		"{\n"
+		"	float unused = sqrt(s);\n"
+		"	float readByFunction = t;\n"
+		"	float f() { extern float readByFunction; return readByFunction; }\n"
+		"	float used = cos(s);\n"
+		"	Ci = used + f();\n"
+		"}\n");
+	BOOST_CHECK_EQUAL(declaration(program, "unused"), "");
+	BOOST_CHECK_EQUAL(countInstructions(program, "sqrt"), 0);
+	// Reads through an extern in a local function keep the store alive.
+	BOOST_CHECK_EQUAL(countInstructions(program, "pop readByFunction"), 1);
+}
+
+BOOST_AUTO_TEST_CASE(optimise_demote_uniform_test)
+{
+	std::string program = compileShader(
+		"surface test(float n = 4)\n"
+		"{\n"
+		"	float i = 0, sum = 0, cond = 0, rand = 0, early = 0;\n"
+		"	for(i = 0; i < n; i += 1)\n"
+		"		sum += i;\n"
+		"	if(s > 0.5)\n"
+		"		cond = 1;\n"
+		"	rand = random();\n"
+		"	while(early < n)\n"
+		"	{\n"
+		"		if(t > 0.5)\n"
+		"			break;\n"
+		"		early += 1;\n"
+		"	}\n"
+		"	Ci = sum + cond + rand + early;\n"
+		"}\n");
+	BOOST_CHECK(isUniform(program, "i"));
+	BOOST_CHECK(isUniform(program, "sum"));
+	// Assigned under a varying condition.
+	BOOST_CHECK(!isUniform(program, "cond"));
+	// Assigned from a varying shadeop.
+	BOOST_CHECK(!isUniform(program, "rand"));
+	// Incremented in a loop with a varying exit.
+	BOOST_CHECK(!isUniform(program, "early"));
+}
+
+BOOST_AUTO_TEST_CASE(optimise_hoist_invariants_test)
+{
+	std::string program = compileShader(
+		"surface test(float n = 4)\n"
+		"{\n"
+		"	float i = 0, sum = 0, x = s;\n"
+		"	for(i = 0; i < n; i += 1)\n"
+		"		sum += sin(x * 2) * i;\n"
+		"	Ci = sum;\n"
+		"}\n");
+	BOOST_CHECK_EQUAL(countInstructions(program, "sin"), 1);
+	BOOST_CHECK(position(program, "sin") < position(program, "RS_PUSH"));
+	BOOST_CHECK(declares(program, "licm::t"));
+
+	// An expression reading a variable written in the loop must stay put.
+	program = compileShader(
+		"surface test(float n = 4)\n"
+		"{\n"
+		"	float i = 0, sum = 0, x = s;\n"
+		"	for(i = 0; i < n; i += 1)\n"
+		"	{\n"
+		"		sum += sin(x * 2);\n"
+		"		x += 1;\n"
+		"	}\n"
+		"	Ci = sum;\n"
+		"}\n");
+	BOOST_CHECK(position(program, "sin") > position(program, "RS_PUSH"));
+	BOOST_CHECK(!declares(program, "licm::t"));
+}
+
+BOOST_AUTO_TEST_CASE(optimise_common_subexpressions_test)
+{
+	std::string program = compileShader(
+		"surface test()\n"
+		"{\n"
+		"	float x = sin(s * 10) + sin(s * 10);\n"
+		"	Ci = x;\n"
+		"}\n");
+	BOOST_CHECK_EQUAL(countInstructions(program, "sin"), 1);
+	BOOST_CHECK(declares(program, "cse::t"));
+
+	// Calls with side effects are never shared.
+	program = compileShader(
+		"surface test()\n"
+		"{\n"
+		"	float x = random() + random();\n"
+		"	Ci = x;\n"
+		"}\n");
+	BOOST_CHECK_EQUAL(countInstructions(program, "frandom"), 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
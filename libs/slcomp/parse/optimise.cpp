@@ -7,10 +7,715 @@
 ////---------------------------------------------------------------------
 
 #include	<aqsis/aqsis.h>
+
+#include	<algorithm>
+#include	<cstring>
+#include	<string>
+#include	<vector>
+
 #include	"parsenode.h"
 
 namespace Aqsis {
 
+namespace {
+
+/// Delete a node along with all of its children.
+void DeleteTree( CqParseNode* pNode )
+{
+	while ( pNode->pFirstChild() )
+		DeleteTree( pNode->pFirstChild() );
+	delete( pNode );
+}
+
+/// Put pNew in the place of pOld in the tree, then delete pOld and whatever
+/// remains below it.  pNew may be a child of pOld.
+void ReplaceNode( CqParseNode* pOld, CqParseNode* pNew )
+{
+	pNew->UnLink();
+	pNew->LinkAfter( pOld );
+	DeleteTree( pOld );
+}
+
+/// Replace a node with a float constant holding the given value.
+void ReplaceWithConst( CqParseNode* pOld, TqFloat Value )
+{
+	CqParseNodeFloatConst* pConst = new CqParseNodeFloatConst( Value );
+	pConst->SetPos( pOld->LineNo(), pOld->strFileName() );
+	ReplaceNode( pOld, pConst );
+}
+
+/// Get the value of a node if it is a float constant.
+bool IsFloatConst( const CqParseNode* pNode, TqFloat& Value )
+{
+	if ( pNode == 0 || pNode->NodeType() != IqParseNodeConstantFloat::m_ID )
+		return ( false );
+	Value = static_cast<const CqParseNodeFloatConst*>( pNode )->Value();
+	return ( true );
+}
+
+/// Follow a reference through the externs of local functions to the variable
+/// it names.
+SqVarRef ResolveExtern( SqVarRef ref )
+{
+	while ( ref.m_Type == VarTypeLocal && ref.m_Index < gLocalVars.size() &&
+	        gLocalVars[ ref.m_Index ].fExtern() )
+		ref = gLocalVars[ ref.m_Index ].vrExtern();
+	return ( ref );
+}
+
+/// Check if a list of variables holds a reference.
+bool Contains( const std::vector<SqVarRef>& aRefs, const SqVarRef& ref )
+{
+	return ( std::find( aRefs.begin(), aRefs.end(), ref ) != aRefs.end() );
+}
+
+/// Check if a node is a plain reference to a variable.
+bool IsPlainVariable( const CqParseNode* pNode )
+{
+	return ( pNode->NodeType() == IqParseNodeVariable::m_ID ||
+	         pNode->NodeType() == IqParseNodeArrayVariable::m_ID );
+}
+
+/// Add the variables read anywhere below a node to a list.
+void GatherReads( const CqParseNode* pNode, std::vector<SqVarRef>& aReads )
+{
+	if ( pNode->NodeType() == IqParseNodeVariable::m_ID ||
+	        pNode->NodeType() == IqParseNodeArrayVariable::m_ID )
+	{
+		SqVarRef ref = static_cast<const CqParseNodeVariable*>( pNode )->VarRef();
+		aReads.push_back( ref );
+		// A local function refers to variables of the shader through externs.
+		SqVarRef refShader = ResolveExtern( ref );
+		if ( !( refShader == ref ) )
+			aReads.push_back( refShader );
+	}
+	for ( const CqParseNode* pChild = pNode->pFirstChild(); pChild; pChild = pChild->pNext() )
+		GatherReads( pChild, aReads );
+}
+
+/// Add the variables assigned to anywhere below a node to a list.
+void GatherAssigned( const CqParseNode* pNode, std::vector<SqVarRef>& aWrites )
+{
+	if ( pNode->NodeType() == IqParseNodeVariableAssign::m_ID ||
+	        pNode->NodeType() == IqParseNodeArrayVariableAssign::m_ID )
+		aWrites.push_back( ResolveExtern( static_cast<const CqParseNodeAssign*>( pNode )->VarRef() ) );
+	for ( const CqParseNode* pChild = pNode->pFirstChild(); pChild; pChild = pChild->pNext() )
+		GatherAssigned( pChild, aWrites );
+}
+
+/// Get the function a call resolved to, or null for other nodes.
+const CqFuncDef* CalledFunction( const CqParseNode* pNode )
+{
+	if ( pNode->NodeType() != IqParseNodeFunctionCall::m_ID )
+		return ( 0 );
+	return ( static_cast<const CqFuncDef*>(
+	             static_cast<const CqParseNodeFunctionCall*>( pNode )->pFuncDef() ) );
+}
+
+/// Check if a node is a call which may change the variables passed to it, or
+/// do something else besides returning a value.
+bool IsCallWithEffects( const CqParseNode* pNode )
+{
+	if ( pNode->NodeType() == IqParseNodeUnresolvedCall::m_ID )
+		return ( true );
+	if ( pNode->NodeType() != IqParseNodeFunctionCall::m_ID )
+		return ( false );
+	// Upper case parameter types are outputs, and variable argument lists
+	// can hold outputs too.  Local functions may write to externs.
+	const CqFuncDef* pFunc = CalledFunction( pNode );
+	if ( pFunc == 0 || pFunc->fLocal() || pFunc->Type() == Type_Void )
+		return ( true );
+	std::string strParams = pFunc->strParams();
+	for ( std::string::const_iterator i = strParams.begin(); i != strParams.end(); i++ )
+	{
+		if ( *i == '*' || ( *i >= 'A' && *i <= 'Z' ) )
+			return ( true );
+	}
+	return ( false );
+}
+
+/// Check if a node is one of the light or gather constructs, which set
+/// variables such as L and Cl, and run their bodies for a subset of points.
+bool IsConstruct( TqInt type )
+{
+	return ( type == IqParseNodeIlluminateConstruct::m_ID ||
+	         type == IqParseNodeIlluminanceConstruct::m_ID ||
+	         type == IqParseNodeSolarConstruct::m_ID ||
+	         type == IqParseNodeGatherConstruct::m_ID );
+}
+
+/// Add the variables below a node which may be written other than by an
+/// assignment to a list.  Returns true if variables which aren't known here
+/// may be written as well, by a local or DSO function or a construct.
+bool GatherCallWrites( const CqParseNode* pNode, std::vector<SqVarRef>& aWrites )
+{
+	bool fUnknown = IsConstruct( pNode->NodeType() );
+	if ( pNode->NodeType() == IqParseNodeMessagePassingFunction::m_ID )
+		aWrites.push_back( static_cast<const CqParseNodeCommFunction*>( pNode )->VarRef() );
+	else if ( IsCallWithEffects( pNode ) )
+	{
+		// Arguments are passed by reference, so any of them may be an output.
+		GatherReads( pNode, aWrites );
+		const CqFuncDef* pFunc = CalledFunction( pNode );
+		if ( pFunc == 0 || pFunc->fLocal() )
+			fUnknown = true;
+	}
+	for ( const CqParseNode* pChild = pNode->pFirstChild(); pChild; pChild = pChild->pNext() )
+	{
+		if ( GatherCallWrites( pChild, aWrites ) )
+			fUnknown = true;
+	}
+	return ( fUnknown );
+}
+
+/// Check if evaluating an expression can have an effect other than its value.
+bool HasSideEffects( const CqParseNode* pNode )
+{
+	TqInt type = pNode->NodeType();
+	if ( type == IqParseNodeVariableAssign::m_ID ||
+	        type == IqParseNodeArrayVariableAssign::m_ID ||
+	        IsCallWithEffects( pNode ) )
+		return ( true );
+	for ( const CqParseNode* pChild = pNode->pFirstChild(); pChild; pChild = pChild->pNext() )
+	{
+		if ( HasSideEffects( pChild ) )
+			return ( true );
+	}
+	return ( false );
+}
+
+/// Remove the statements below a node which assign to a dead variable.
+void RemoveStores( CqParseNode* pNode, const std::vector<SqVarRef>& aReads )
+{
+	CqParseNode* pChild = pNode->pFirstChild();
+	while ( pChild )
+	{
+		CqParseNode* pNext = pChild->pNext();
+		TqInt type = pChild->NodeType();
+		if ( type == IqParseNodeVariableAssign::m_ID ||
+		        type == IqParseNodeArrayVariableAssign::m_ID )
+		{
+			CqParseNodeAssign* pAssign = static_cast<CqParseNodeAssign*>( pChild );
+			SqVarRef ref = pAssign->VarRef();
+			CqVarDef* pVarDef = CqVarDef::GetVariablePtr( ref );
+			bool fDead = pAssign->fDiscardResult() && ref.m_Type == VarTypeLocal &&
+			             pVarDef && !pVarDef->fExtern() &&
+			             ( pVarDef->Type() & ( Type_Param | Type_Output ) ) == 0 &&
+			             std::find( aReads.begin(), aReads.end(), ref ) == aReads.end();
+			for ( const CqParseNode* pArg = pAssign->pFirstChild(); fDead && pArg; pArg = pArg->pNext() )
+				fDead = !HasSideEffects( pArg );
+			if ( fDead )
+			{
+				// Leave an empty statement, so loop headers etc. remain valid.
+				CqParseNode* pEmpty = new CqParseNode();
+				pEmpty->SetPos( pChild->LineNo(), pChild->strFileName() );
+				ReplaceNode( pChild, pEmpty );
+				pChild = pNext;
+				continue;
+			}
+		}
+		RemoveStores( pChild, aReads );
+		pChild = pNext;
+	}
+}
+
+/// Standard functions whose result depends on nothing but their arguments.
+/// The VM gives a uniform result for uniform arguments to each of these, and
+/// a call may be made earlier, or once for several uses, while its arguments
+/// are unchanged.  Those which look at derivatives, the lights or the
+/// surface, such as filterstep and faceforward, are left out.
+const char* const gPureFunctions[] =
+{
+	"operator*", "operator/", "operator+", "operator-", "operatorneg",
+	"operator.", "operator^",
+	"abs", "acos", "asin", "atan", "ceil", "clamp", "comp", "concat", "cos",
+	"degrees", "determinant", "distance", "exp", "floor", "inversesqrt",
+	"length", "log", "max", "min", "mix", "mod", "normalize", "pow",
+	"ptlined", "radians", "reflect", "refract", "round", "sign", "sin",
+	"smoothstep", "spline", "sqrt", "step", "tan", "xcomp", "ycomp", "zcomp",
+	"noise", "pnoise", "cellnoise",
+	"transform", "vtransform", "ntransform", "ctransform", "mtransform",
+	"rotate", "scale", "translate",
+	0
+};
+
+/// Check if a call is to one of gPureFunctions.
+bool IsPureCall( const CqParseNode* pNode )
+{
+	const CqFuncDef* pFunc = CalledFunction( pNode );
+	if ( pFunc == 0 || pFunc->fLocal() || IsCallWithEffects( pNode ) )
+		return ( false );
+	for ( const char* const* pName = gPureFunctions; *pName; pName++ )
+	{
+		if ( std::strcmp( pFunc->strName(), *pName ) == 0 )
+			return ( true );
+	}
+	return ( false );
+}
+
+/// Check if an expression is made only of constants, variables and calls to
+/// gPureFunctions.
+bool IsPure( const CqParseNode* pNode )
+{
+	TqInt type = pNode->NodeType();
+	if ( type == IqParseNodeFunctionCall::m_ID )
+	{
+		if ( !IsPureCall( pNode ) )
+			return ( false );
+	}
+	else if ( type != IqParseNodeConstantFloat::m_ID &&
+	          type != IqParseNodeConstantString::m_ID &&
+	          type != IqParseNodeVariable::m_ID &&
+	          type != IqParseNodeArrayVariable::m_ID &&
+	          type != IqParseNodeTypeCast::m_ID &&
+	          type != IqParseNodeTriple::m_ID &&
+	          type != IqParseNodeSixteenTuple::m_ID )
+		return ( false );
+	for ( const CqParseNode* pChild = pNode->pFirstChild(); pChild; pChild = pChild->pNext() )
+	{
+		if ( !IsPure( pChild ) )
+			return ( false );
+	}
+	return ( true );
+}
+
+/// Check if a pure expression is worth keeping in a temporary, rather than
+/// evaluating where it is used.  Only calls are; reading a constant or a
+/// variable costs as much as reading the temporary would.
+bool IsWorthKeeping( const CqParseNode* pNode )
+{
+	if ( pNode->NodeType() != IqParseNodeFunctionCall::m_ID )
+		return ( false );
+	switch ( pNode->ResType() & Type_Mask )
+	{
+			case Type_Float:
+			case Type_Point:
+			case Type_Vector:
+			case Type_Normal:
+			case Type_Color:
+			case Type_Matrix:
+			return ( true );
+			default:
+			return ( false );
+	}
+}
+
+/// Check if two pure expressions compute the same value.
+bool IsSameExpression( const CqParseNode* pA, const CqParseNode* pB )
+{
+	TqInt type = pA->NodeType();
+	if ( type != pB->NodeType() )
+		return ( false );
+	if ( type == IqParseNodeConstantFloat::m_ID )
+	{
+		if ( static_cast<const CqParseNodeFloatConst*>( pA )->Value() !=
+		        static_cast<const CqParseNodeFloatConst*>( pB )->Value() )
+			return ( false );
+	}
+	else if ( type == IqParseNodeConstantString::m_ID )
+	{
+		if ( std::strcmp( static_cast<const CqParseNodeStringConst*>( pA )->strValue(),
+		                  static_cast<const CqParseNodeStringConst*>( pB )->strValue() ) != 0 )
+			return ( false );
+	}
+	else if ( type == IqParseNodeVariable::m_ID || type == IqParseNodeArrayVariable::m_ID )
+	{
+		if ( !( static_cast<const CqParseNodeVariable*>( pA )->VarRef() ==
+		        static_cast<const CqParseNodeVariable*>( pB )->VarRef() ) )
+			return ( false );
+	}
+	else if ( type == IqParseNodeFunctionCall::m_ID )
+	{
+		if ( CalledFunction( pA ) != CalledFunction( pB ) )
+			return ( false );
+	}
+	else if ( type == IqParseNodeTypeCast::m_ID )
+	{
+		if ( static_cast<const CqParseNodeCast*>( pA )->CastTo() !=
+		        static_cast<const CqParseNodeCast*>( pB )->CastTo() )
+			return ( false );
+	}
+	const CqParseNode* pChildA = pA->pFirstChild();
+	const CqParseNode* pChildB = pB->pFirstChild();
+	for ( ; pChildA && pChildB; pChildA = pChildA->pNext(), pChildB = pChildB->pNext() )
+	{
+		if ( !IsSameExpression( pChildA, pChildB ) )
+			return ( false );
+	}
+	return ( pChildA == 0 && pChildB == 0 );
+}
+
+/// Check if a variable has the same value at every point.  The locals set
+/// in aUniform are taken to be uniform, whatever they were declared as.
+bool IsUniformVariable( const SqVarRef& ref, const std::vector<bool>& aUniform )
+{
+	if ( ref.m_Type == VarTypeLocal && ref.m_Index < aUniform.size() && aUniform[ ref.m_Index ] )
+		return ( true );
+	const CqVarDef* pVarDef = CqVarDef::GetVariablePtr( ref );
+	return ( pVarDef != 0 && ( pVarDef->Type() & Type_Uniform ) != 0 );
+}
+
+/// Check if an expression has the same value at every point.  The varying
+/// flags of the parse nodes can't be used for this, as they don't know that
+/// calls such as random() and ambient() are varying.
+bool IsUniform( const CqParseNode* pNode, const std::vector<bool>& aUniform )
+{
+	TqInt type = pNode->NodeType();
+	if ( type == IqParseNodeVariable::m_ID || type == IqParseNodeArrayVariable::m_ID )
+	{
+		if ( !IsUniformVariable( static_cast<const CqParseNodeVariable*>( pNode )->VarRef(), aUniform ) )
+			return ( false );
+	}
+	else if ( type == IqParseNodeFunctionCall::m_ID )
+	{
+		if ( !IsPureCall( pNode ) )
+			return ( false );
+	}
+	else if ( type != IqParseNodeConstantFloat::m_ID &&
+	          type != IqParseNodeConstantString::m_ID &&
+	          type != IqParseNodeTypeCast::m_ID &&
+	          type != IqParseNodeTriple::m_ID &&
+	          type != IqParseNodeSixteenTuple::m_ID &&
+	          type != IqParseNodeRelationalOp::m_ID &&
+	          type != IqParseNodeLogicalOp::m_ID &&
+	          type != IqParseNodeUnaryOp::m_ID &&
+	          type != IqParseNodeConditionalExpression::m_ID )
+		return ( false );
+	for ( const CqParseNode* pChild = pNode->pFirstChild(); pChild; pChild = pChild->pNext() )
+	{
+		if ( !IsUniform( pChild, aUniform ) )
+			return ( false );
+	}
+	return ( true );
+}
+
+/// Check if a break or continue below a node may be taken by some points and
+/// not others.
+bool HasVaryingExit( const CqParseNode* pNode, const std::vector<bool>& aUniform, bool fVarying )
+{
+	TqInt type = pNode->NodeType();
+	if ( type == IqParseNodeLoopMod::m_ID )
+		return ( fVarying );
+	if ( ( type == IqParseNodeConditional::m_ID || type == IqParseNodeWhileConstruct::m_ID ) &&
+	        !IsUniform( pNode->pFirstChild(), aUniform ) )
+		fVarying = true;
+	if ( IsConstruct( type ) )
+		fVarying = true;
+	for ( const CqParseNode* pChild = pNode->pFirstChild(); pChild; pChild = pChild->pNext() )
+	{
+		if ( HasVaryingExit( pChild, aUniform, fVarying ) )
+			return ( true );
+	}
+	return ( false );
+}
+
+/// Check if the points running the children of a node may differ, where
+/// they are the same for the node itself.
+bool IsVaryingFlow( const CqParseNode* pNode, const std::vector<bool>& aUniform )
+{
+	TqInt type = pNode->NodeType();
+	if ( type == IqParseNodeConditional::m_ID || type == IqParseNodeConditionalExpression::m_ID )
+		return ( !IsUniform( pNode->pFirstChild(), aUniform ) );
+	if ( type == IqParseNodeWhileConstruct::m_ID )
+	{
+		if ( !IsUniform( pNode->pFirstChild(), aUniform ) )
+			return ( true );
+		for ( const CqParseNode* pChild = pNode->pFirstChild()->pNext(); pChild; pChild = pChild->pNext() )
+		{
+			if ( HasVaryingExit( pChild, aUniform, false ) )
+				return ( true );
+		}
+		return ( false );
+	}
+	return ( IsConstruct( type ) );
+}
+
+/// Clear the locals in aUniform which are assigned a value which may differ
+/// between points, or are assigned where only some points may be running.
+/// Returns true if any were cleared.
+bool CheckUniformAssignments( const CqParseNode* pNode, std::vector<bool>& aUniform, bool fVaryingFlow )
+{
+	bool fChanged = false;
+	TqInt type = pNode->NodeType();
+	if ( type == IqParseNodeVariableAssign::m_ID || type == IqParseNodeArrayVariableAssign::m_ID )
+	{
+		SqVarRef ref = static_cast<const CqParseNodeAssign*>( pNode )->VarRef();
+		if ( ref.m_Type == VarTypeLocal && ref.m_Index < aUniform.size() && aUniform[ ref.m_Index ] )
+		{
+			bool fUniform = !fVaryingFlow;
+			for ( const CqParseNode* pChild = pNode->pFirstChild(); fUniform && pChild; pChild = pChild->pNext() )
+				fUniform = IsUniform( pChild, aUniform );
+			if ( !fUniform )
+			{
+				aUniform[ ref.m_Index ] = false;
+				fChanged = true;
+			}
+		}
+	}
+	fVaryingFlow = fVaryingFlow || IsVaryingFlow( pNode, aUniform );
+	for ( const CqParseNode* pChild = pNode->pFirstChild(); pChild; pChild = pChild->pNext() )
+	{
+		if ( CheckUniformAssignments( pChild, aUniform, fVaryingFlow ) )
+			fChanged = true;
+	}
+	return ( fChanged );
+}
+
+/// Check if a node is a statement in a block, rather than an expression or
+/// one of the arguments of a construct.
+bool IsStatement( const CqParseNode* pNode )
+{
+	const IqParseNode* pParent = pNode->pParent();
+	if ( pParent == 0 || pParent->NodeType() != IqParseNode::m_ID )
+		return ( false );
+	const IqParseNode* pOuter = pParent->pParent();
+	return ( pOuter == 0 || !IsConstruct( pOuter->NodeType() ) );
+}
+
+/// Insert a statement before another.  The first time, the two are put in a
+/// new block in the place of pStmt, since it needn't be in a block already.
+void InsertBefore( CqParseNode* pStmt, CqParseNode* pNew, CqParseNode*& pBlock )
+{
+	if ( pBlock == 0 )
+	{
+		pBlock = new CqParseNode();
+		pBlock->SetPos( pStmt->LineNo(), pStmt->strFileName() );
+		pStmt->LinkParent( pBlock );
+		pBlock->AddFirstChild( pNew );
+	}
+	else
+		pNew->LinkAfter( pStmt->pPrevious() );
+}
+
+/// Evaluate an expression into a new local just before a statement, and read
+/// the local in its place.  The local is uniform where it can be, which needs
+/// all the points to run the statement.
+SqVarRef MoveToTemporary( CqParseNode* pExpr, CqParseNode* pStmt, CqParseNode*& pBlock,
+                          bool fVaryingFlow, const char* strPass )
+{
+	std::vector<bool> aNone;
+	bool fUniform = !fVaryingFlow && IsUniform( pExpr, aNone );
+	CqString strName( strPass );
+	strName += "::t";
+	strName += static_cast<TqInt>( gLocalVars.size() );
+	CqVarDef Def( ( pExpr->ResType() & Type_Mask ) | ( fUniform ? Type_Uniform : Type_Varying ),
+	              strName.c_str() );
+	SqVarRef ref;
+	ref.m_Type = VarTypeLocal;
+	ref.m_Index = CqVarDef::AddVariable( Def );
+
+	CqParseNodeVariable* pRead = new CqParseNodeVariable( ref );
+	pRead->SetPos( pExpr->LineNo(), pExpr->strFileName() );
+	pRead->LinkAfter( pExpr );
+	pExpr->UnLink();
+
+	CqParseNodeAssign* pAssign = new CqParseNodeAssign( ref );
+	pAssign->SetPos( pStmt->LineNo(), pStmt->strFileName() );
+	pAssign->NoDup();
+	pAssign->AddLastChild( pExpr );
+	InsertBefore( pStmt, pAssign, pBlock );
+	return ( ref );
+}
+
+/// Find the largest expressions below a node which are worth keeping and
+/// read none of the given variables.
+void FindInvariants( CqParseNode* pNode, const std::vector<SqVarRef>& aWrites,
+                     std::vector<CqParseNode*>& aInvariants )
+{
+	for ( CqParseNode* pChild = pNode->pFirstChild(); pChild; pChild = pChild->pNext() )
+	{
+		bool fInvariant = IsWorthKeeping( pChild ) && IsPure( pChild );
+		if ( fInvariant )
+		{
+			std::vector<SqVarRef> aReads;
+			GatherReads( pChild, aReads );
+			for ( std::vector<SqVarRef>::iterator i = aReads.begin(); fInvariant && i != aReads.end(); i++ )
+				fInvariant = !Contains( aWrites, *i );
+		}
+		if ( fInvariant )
+			aInvariants.push_back( pChild );
+		else
+			FindInvariants( pChild, aWrites, aInvariants );
+	}
+}
+
+/// List the expressions worth keeping below a node, outer ones first.
+void FindKeepable( CqParseNode* pNode, std::vector<CqParseNode*>& aExprs )
+{
+	if ( IsWorthKeeping( pNode ) && IsPure( pNode ) )
+		aExprs.push_back( pNode );
+	for ( CqParseNode* pChild = pNode->pFirstChild(); pChild; pChild = pChild->pNext() )
+		FindKeepable( pChild, aExprs );
+}
+
+/// Move the expressions in a loop which don't change between iterations to
+/// temporaries set before it.  Loops which call local or DSO functions, or
+/// hold a construct, are left alone, as they may change anything.
+void HoistFromLoop( CqParseNode* pLoop, bool fVaryingFlow )
+{
+	std::vector<SqVarRef> aWrites;
+	GatherAssigned( pLoop, aWrites );
+	if ( GatherCallWrites( pLoop, aWrites ) )
+		return;
+	std::vector<CqParseNode*> aInvariants;
+	FindInvariants( pLoop, aWrites, aInvariants );
+	CqParseNode* pBlock = 0;
+	for ( std::vector<CqParseNode*>::iterator i = aInvariants.begin(); i != aInvariants.end(); i++ )
+		MoveToTemporary( *i, pLoop, pBlock, fVaryingFlow, "licm" );
+}
+
+/// Evaluate the expressions which appear more than once in the value of an
+/// assignment statement into temporaries, once each.
+void ShareInAssignment( CqParseNode* pAssign, bool fVaryingFlow )
+{
+	CqParseNode* pBlock = 0;
+	for ( ;; )
+	{
+		std::vector<CqParseNode*> aExprs;
+		FindKeepable( pAssign->pFirstChild(), aExprs );
+		std::vector<CqParseNode*> aSame;
+		TqUint i;
+		for ( i = 0; i < aExprs.size() && aSame.empty(); i++ )
+		{
+			for ( TqUint j = i + 1; j < aExprs.size(); j++ )
+			{
+				if ( IsSameExpression( aExprs[ i ], aExprs[ j ] ) )
+					aSame.push_back( aExprs[ j ] );
+			}
+		}
+		if ( aSame.empty() )
+			return;
+		SqVarRef ref = MoveToTemporary( aExprs[ i - 1 ], pAssign, pBlock, fVaryingFlow, "cse" );
+		for ( std::vector<CqParseNode*>::iterator iSame = aSame.begin(); iSame != aSame.end(); iSame++ )
+		{
+			CqParseNodeVariable* pRead = new CqParseNodeVariable( ref );
+			pRead->SetPos( ( *iSame )->LineNo(), ( *iSame )->strFileName() );
+			ReplaceNode( *iSame, pRead );
+		}
+	}
+}
+
+} // unnamed namespace
+
+
+///---------------------------------------------------------------------
+/// RemoveDeadStores
+/// Remove assignments to local variables of a shader which are never read.
+/// Function arguments are passed by reference, so a variable passed to a
+/// function counts as read.
+
+void RemoveDeadStores( CqParseNode* pShader )
+{
+	std::vector<SqVarRef> aReads;
+	GatherReads( pShader, aReads );
+	for ( TqUint i = 0; i < gLocalFuncs.size(); i++ )
+	{
+		if ( gLocalFuncs[ i ].pDefNode() )
+			GatherReads( gLocalFuncs[ i ].pDefNode(), aReads );
+	}
+	RemoveStores( pShader, aReads );
+}
+
+///---------------------------------------------------------------------
+/// DemoteUniformLocals
+/// Make the varying locals of a shader uniform where they hold the same value
+/// at every point, so the VM works on them once rather than per point.
+/// Every local starts out uniform, and those assigned a value which may
+/// differ between points, or assigned where only some points may be running,
+/// are dropped until none change, so loop counters which only depend on
+/// themselves and uniform values are found too.  Locals passed to functions
+/// which may write them, or used by local functions, are left alone.
+
+void DemoteUniformLocals( CqParseNode* pShader )
+{
+	std::vector<SqVarRef> aUsed;
+	GatherReads( pShader, aUsed );
+	GatherAssigned( pShader, aUsed );
+	std::vector<SqVarRef> aExcluded;
+	GatherCallWrites( pShader, aExcluded );
+	for ( TqUint i = 0; i < gLocalFuncs.size(); i++ )
+	{
+		if ( gLocalFuncs[ i ].pDefNode() )
+		{
+			GatherReads( gLocalFuncs[ i ].pDefNode(), aExcluded );
+			GatherAssigned( gLocalFuncs[ i ].pDefNode(), aExcluded );
+		}
+		if ( gLocalFuncs[ i ].pArgs() )
+			GatherReads( gLocalFuncs[ i ].pArgs(), aExcluded );
+	}
+
+	std::vector<bool> aUniform( gLocalVars.size(), false );
+	for ( TqUint i = 0; i < gLocalVars.size(); i++ )
+	{
+		SqVarRef ref;
+		ref.m_Type = VarTypeLocal;
+		ref.m_Index = i;
+		TqInt type = gLocalVars[ i ].Type();
+		aUniform[ i ] = !gLocalVars[ i ].fExtern() && ( type & Type_Varying ) &&
+		                ( type & ( Type_Param | Type_Output | Type_Array ) ) == 0 &&
+		                Contains( aUsed, ref ) && !Contains( aExcluded, ref );
+	}
+	while ( CheckUniformAssignments( pShader, aUniform, false ) )
+		;
+
+	for ( TqUint i = 0; i < gLocalVars.size(); i++ )
+	{
+		if ( aUniform[ i ] )
+			gLocalVars[ i ].SetType( ( gLocalVars[ i ].Type() & ~Type_Varying ) | Type_Uniform );
+	}
+}
+
+
+///---------------------------------------------------------------------
+/// HoistLoopInvariants
+/// Move calls to pure functions whose arguments don't change in a loop out
+/// of it, into temporaries set just before the loop.  This is safe with the
+/// SIMD running state, since the points running in a loop are a subset of
+/// those running where it starts.
+
+void HoistLoopInvariants( CqParseNode* pNode, bool fVaryingFlow )
+{
+	std::vector<bool> aNone;
+	bool fChildFlow = fVaryingFlow || IsVaryingFlow( pNode, aNone );
+	CqParseNode* pChild = pNode->pFirstChild();
+	while ( pChild )
+	{
+		// Get the next now, as the child may be moved into a block.
+		CqParseNode* pNext = pChild->pNext();
+		HoistLoopInvariants( pChild, fChildFlow );
+		pChild = pNext;
+	}
+	if ( pNode->NodeType() == IqParseNodeWhileConstruct::m_ID )
+		HoistFromLoop( pNode, fVaryingFlow );
+}
+
+
+///---------------------------------------------------------------------
+/// ShareCommonSubexpressions
+/// Evaluate calls to pure functions which appear more than once in the value
+/// of an assignment statement once, into a temporary.  Within one statement
+/// nothing can change between the two uses, so no more is needed to know
+/// they are the same.
+
+void ShareCommonSubexpressions( CqParseNode* pNode, bool fVaryingFlow )
+{
+	std::vector<bool> aNone;
+	bool fChildFlow = fVaryingFlow || IsVaryingFlow( pNode, aNone );
+	CqParseNode* pChild = pNode->pFirstChild();
+	while ( pChild )
+	{
+		CqParseNode* pNext = pChild->pNext();
+		ShareCommonSubexpressions( pChild, fChildFlow );
+		pChild = pNext;
+	}
+	if ( pNode->NodeType() == IqParseNodeVariableAssign::m_ID &&
+	        static_cast<CqParseNodeAssign*>( pNode )->fDiscardResult() &&
+	        IsStatement( pNode ) && pNode->pFirstChild() &&
+	        !HasSideEffects( pNode->pFirstChild() ) )
+		ShareInAssignment( pNode, fVaryingFlow );
+}
+
+
 ///---------------------------------------------------------------------
 /// CqParseNode::Optimise
 
@@ -33,11 +738,75 @@ bool CqParseNode::Optimise()
 ///---------------------------------------------------------------------
 /// CqParseNodeFunction:Call:Optimise
 /// Optimise a function definition, basically optimise the parameters.
+/// The arithmetic operators are calls to the "operator" functions, so
+/// those on float constants are folded here, as are operations which leave
+/// a variable unchanged, such as multiplying by one.
 
 bool CqParseNodeFunctionCall::Optimise()
 {
 	CqParseNode::Optimise();
 
+	// Before type checking the first candidate stands in for the function,
+	// which is only right for the float operators when both operands are
+	// float constants, or for the identities on a variable of that type.
+	const IqFuncDef* pFunc = m_aFuncRef.empty() ? 0 : pFuncDef();
+	if ( pFunc == 0 || m_pChild == 0 )
+		return ( false );
+	std::string strVMName = pFunc->strVMName();
+
+	CqParseNode* pOperandA = m_pChild;
+	CqParseNode* pOperandB = pOperandA->pNext();
+	TqFloat A, B;
+	bool fConstA = IsFloatConst( pOperandA, A );
+	if ( pOperandB == 0 )
+	{
+		if ( fConstA && strVMName == "negf" )
+		{
+			ReplaceWithConst( this, -A );
+			return ( true );
+		}
+		return ( false );
+	}
+	if ( pOperandB->pNext() != 0 )
+		return ( false );
+	bool fConstB = IsFloatConst( pOperandB, B );
+
+	if ( fConstA && fConstB )
+	{
+		if ( strVMName == "addff" )
+			ReplaceWithConst( this, A + B );
+		else if ( strVMName == "subff" )
+			ReplaceWithConst( this, A - B );
+		else if ( strVMName == "mulff" )
+			ReplaceWithConst( this, A * B );
+		// Leave division by zero to the shader at run time.
+		else if ( strVMName == "divff" && B != 0 )
+			ReplaceWithConst( this, A / B );
+		else
+			return ( false );
+		return ( true );
+	}
+
+	// Operations which are an identity for the other operand.  Only plain
+	// variables of the result type are considered, so removing the operation
+	// can't change the type or storage of the result.
+	std::string strName = pFunc->strName();
+	bool fMul = strName == "operator*";
+	bool fDiv = strName == "operator/";
+	bool fAdd = strName == "operator+";
+	bool fSub = strName == "operator-";
+	CqParseNode* pKeep = 0;
+	if ( fConstB && ( ( B == 1 && ( fMul || fDiv ) ) || ( B == 0 && ( fAdd || fSub ) ) ) )
+		pKeep = pOperandA;
+	else if ( fConstA && ( ( A == 1 && fMul ) || ( A == 0 && fAdd ) ) )
+		pKeep = pOperandB;
+	if ( pKeep && IsPlainVariable( pKeep ) &&
+	        ( pKeep->ResType() & Type_Mask ) == ( ResType() & Type_Mask ) )
+	{
+		ReplaceNode( this, pKeep );
+		return ( true );
+	}
+
 	return ( false );
 }
 
@@ -117,5 +886,141 @@ bool CqParseNodeCast::Optimise()
 	return ( false );
 }
 
+
+
+///---------------------------------------------------------------------
+/// CqParseNodeRelOp::Optimise
+/// Fold comparisons between float constants.
+
+bool CqParseNodeRelOp::Optimise()
+{
+	CqParseNode::Optimise();
+
+	// The parser adds the operands in reverse order, so the first child is
+	// the right hand side.
+	TqFloat A, B;
+	if ( !IsFloatConst( m_pChild, B ) || !IsFloatConst( m_pChild->pNext(), A ) )
+		return ( false );
+
+	bool fResult;
+	switch ( m_Operator )
+	{
+			case Op_EQ:
+			fResult = A == B;
+			break;
+			case Op_NE:
+			fResult = A != B;
+			break;
+			case Op_L:
+			fResult = A < B;
+			break;
+			case Op_G:
+			fResult = A > B;
+			break;
+			case Op_GE:
+			fResult = A >= B;
+			break;
+			case Op_LE:
+			fResult = A <= B;
+			break;
+			default:
+			return ( false );
+	}
+	ReplaceWithConst( this, fResult ? 1.0f : 0.0f );
+	return ( true );
+}
+
+
+///---------------------------------------------------------------------
+/// CqParseNodeUnaryOp::Optimise
+/// Fold logical negation of a float constant.  Arithmetic negation is a call
+/// to operatorneg, which is folded with the other operators.
+
+bool CqParseNodeUnaryOp::Optimise()
+{
+	CqParseNode::Optimise();
+
+	assert( m_pChild != 0 );
+	TqFloat A;
+	if ( m_Operator != Op_LogicalNot || !IsFloatConst( m_pChild, A ) )
+		return ( false );
+	ReplaceWithConst( this, A == 0 ? 1.0f : 0.0f );
+	return ( true );
+}
+
+
+///---------------------------------------------------------------------
+/// CqParseNodeLogicalOp::Optimise
+/// Fold logical operations on float constants.
+
+bool CqParseNodeLogicalOp::Optimise()
+{
+	CqParseNode::Optimise();
+
+	TqFloat A, B;
+	if ( !IsFloatConst( m_pChild, A ) || !IsFloatConst( m_pChild->pNext(), B ) )
+		return ( false );
+
+	switch ( m_Operator )
+	{
+			case Op_LogAnd:
+			ReplaceWithConst( this, ( A != 0 && B != 0 ) ? 1.0f : 0.0f );
+			return ( true );
+			case Op_LogOr:
+			ReplaceWithConst( this, ( A != 0 || B != 0 ) ? 1.0f : 0.0f );
+			return ( true );
+			default:
+			return ( false );
+	}
+}
+
+
+///---------------------------------------------------------------------
+/// CqParseNodeConditional::Optimise
+/// Remove the branch which can never run when the condition is constant.
+
+bool CqParseNodeConditional::Optimise()
+{
+	CqParseNode::Optimise();
+
+	TqFloat Cond;
+	if ( !IsFloatConst( m_pChild, Cond ) )
+		return ( false );
+	CqParseNode* pTrueStmt = m_pChild->pNext();
+	assert( pTrueStmt != 0 );
+	CqParseNode* pFalseStmt = pTrueStmt->pNext();
+
+	CqParseNode* pKeep = Cond != 0 ? pTrueStmt : pFalseStmt;
+	if ( pKeep == 0 )
+	{
+		// Leave an empty statement, so loop bodies etc. remain valid.
+		pKeep = new CqParseNode();
+		pKeep->SetPos( LineNo(), strFileName() );
+	}
+	ReplaceNode( this, pKeep );
+	return ( true );
+}
+
+
+///---------------------------------------------------------------------
+/// CqParseNodeQCond::Optimise
+/// Select the result directly when the condition is constant.
+
+bool CqParseNodeQCond::Optimise()
+{
+	CqParseNode::Optimise();
+
+	TqFloat Cond;
+	if ( !IsFloatConst( m_pChild, Cond ) )
+		return ( false );
+	CqParseNode* pTrue = m_pChild->pNext();
+	assert( pTrue != 0 );
+	CqParseNode* pFalse = pTrue->pNext();
+	assert( pFalse != 0 );
+
+	ReplaceNode( this, Cond != 0 ? pTrue : pFalse );
+	return ( true );
+}
+
 } // namespace Aqsis
 //---------------------------------------------------------------------
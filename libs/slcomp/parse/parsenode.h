@@ -550,7 +550,14 @@ class CqParseNodeVariable : public CqParseNode, public IqParseNodeVariable
 		}
 		virtual	bool	UpdateStorageStatus()
 		{
-			return fVarying();
+			// The optimiser may have made the variable uniform since this
+			// node was made, so look at its current storage.
+			bool fVarying = CqParseNode::UpdateStorageStatus();
+			IqVarDef* pVarDef = CqVarDef::GetVariablePtr( m_VarRef );
+			if ( pVarDef != 0 && ( pVarDef->Type() & Type_Varying ) != 0 )
+				fVarying = true;
+			m_fVarying = fVarying;
+			return ( m_fVarying );
 		}
 
 	protected:
@@ -912,6 +919,8 @@ class CqParseNodeRelOp : public CqParseNodeOp, public IqParseNodeRelationalOp
 			V.Visit(static_cast<IqParseNodeRelationalOp&>(*this));
 		}
 
+		virtual	bool	Optimise();
+
 
 
 		virtual	CqParseNode*	Clone( CqParseNode* pParent = 0 )
@@ -972,6 +981,7 @@ class CqParseNodeUnaryOp : public CqParseNodeOp, public IqParseNodeUnaryOp
 			V.Visit(static_cast<IqParseNodeUnaryOp&>(*this));
 		}
 
+		virtual	bool	Optimise();
 
 		virtual	TqInt	TypeCheck( TqInt* pTypes, TqInt Count, bool& needsCast, bool CheckOnly );
 		virtual	CqParseNode*	Clone( CqParseNode* pParent = 0 )
@@ -1035,6 +1045,8 @@ class CqParseNodeLogicalOp : public CqParseNodeOp, public IqParseNodeLogicalOp
 			V.Visit(static_cast<IqParseNodeLogicalOp&>(*this));
 		}
 
+		virtual	bool	Optimise();
+
 
 
 		virtual	CqParseNode*	Clone( CqParseNode* pParent = 0 )
@@ -1609,6 +1621,8 @@ class CqParseNodeConditional : public CqParseNode, public IqParseNodeConditional
 			V.Visit(static_cast<IqParseNodeConditional&>(*this));
 		}
 
+		virtual	bool	Optimise();
+
 
 		virtual	CqParseNode*	Clone( CqParseNode* pParent = 0 )
 		{
@@ -1678,6 +1692,8 @@ class CqParseNodeQCond : public CqParseNode, public IqParseNodeConditionalExpres
 			V.Visit(static_cast<IqParseNodeConditionalExpression&>(*this));
 		}
 
+		virtual	bool	Optimise();
+
 
 		virtual	TqInt	TypeCheck( TqInt* pTypes, TqInt Count, bool& needsCast, bool CheckOnly );
 		virtual	CqParseNode*	Clone( CqParseNode* pParent = 0 )
@@ -2062,6 +2078,16 @@ class CqParseNodeTextureNameWithChannel : public CqParseNode
 };
 
 
+/// Remove assignments to local variables of the shader which are never read.
+void RemoveDeadStores( CqParseNode* pShader );
+/// Make varying locals of the shader which always hold a uniform value uniform.
+void DemoteUniformLocals( CqParseNode* pShader );
+/// Move pure calls which don't change in a loop to temporaries before it.
+void HoistLoopInvariants( CqParseNode* pNode, bool fVaryingFlow = false );
+/// Evaluate pure calls repeated in one assignment once, into a temporary.
+void ShareCommonSubexpressions( CqParseNode* pNode, bool fVaryingFlow = false );
+
+
 //-----------------------------------------------------------------------
 
 } // namespace Aqsis
@@ -2135,7 +2135,15 @@ void Optimise()
 	}
 
 	if(ParseTreePointer)
+	{
 		ParseTreePointer->Optimise();
+		RemoveDeadStores(ParseTreePointer);
+		DemoteUniformLocals(ParseTreePointer);
+		HoistLoopInvariants(ParseTreePointer);
+		ShareCommonSubexpressions(ParseTreePointer);
+		// Bring the varying flags up to date with any locals made uniform.
+		ParseTreePointer->UpdateStorageStatus();
+	}
 }
 
 
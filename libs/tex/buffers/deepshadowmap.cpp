@@ -0,0 +1,259 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/**
+ * \file
+ *
+ * \brief Deep shadow map buffer implementation.
+ */
+
+#include <aqsis/tex/buffers/deepshadowmap.h>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <fstream>
+
+#include <aqsis/tex/texexception.h>
+
+namespace Aqsis {
+
+namespace {
+
+const char deepShadowMagicNum[] = "Aqsis DeepShadow";
+const TqInt magicNumSize = sizeof(deepShadowMagicNum)-1;
+
+/// Ordering of visibility nodes by depth, for searching pixel functions.
+bool nodeDepthLess(const SqVisibilityNode& node, TqFloat depth)
+{
+	return node.depth < depth;
+}
+
+template<typename T>
+void readData(std::istream& inStream, T* data, std::size_t count,
+		const boostfs::path& fileName)
+{
+	std::streamsize size = count*sizeof(T);
+	if(size == 0)
+		return;
+	inStream.read(reinterpret_cast<char*>(data), size);
+	if(inStream.gcount() != size)
+		AQSIS_THROW_XQERROR(XqBadTexture, EqE_BadFile,
+			"Unexpected end of deep shadow map \"" << fileName << "\"");
+}
+
+template<typename T>
+void writeData(std::ostream& outStream, const T* data, std::size_t count)
+{
+	if(count > 0)
+		outStream.write(reinterpret_cast<const char*>(data), count*sizeof(T));
+}
+
+} // unnamed namespace
+
+//------------------------------------------------------------------------------
+// CqDeepShadowMap implementation
+
+CqDeepShadowMap::CqDeepShadowMap(TqInt width, TqInt height,
+		const CqMatrix& worldToCamera, const CqMatrix& worldToScreen)
+	: m_width(width),
+	m_height(height),
+	m_worldToCamera(worldToCamera),
+	m_worldToScreen(worldToScreen),
+	m_pixelStart(width*height, 0),
+	m_pixelSize(width*height, 0),
+	m_nodes()
+{ }
+
+CqDeepShadowMap::CqDeepShadowMap(const boostfs::path& fileName)
+	: m_width(0),
+	m_height(0),
+	m_worldToCamera(),
+	m_worldToScreen(),
+	m_pixelStart(),
+	m_pixelSize(),
+	m_nodes()
+{
+	std::ifstream inStream(native(fileName).c_str(),
+			std::ios::in | std::ios::binary);
+	if(!inStream.is_open())
+	{
+		AQSIS_THROW_XQERROR(XqInvalidFile, EqE_NoFile,
+				"Could not open deep shadow map \"" << fileName << "\" for reading");
+	}
+	char magicNum[magicNumSize];
+	inStream.read(magicNum, magicNumSize);
+	if(inStream.gcount() != magicNumSize
+		|| !std::equal(magicNum, magicNum + magicNumSize, deepShadowMagicNum))
+	{
+		AQSIS_THROW_XQERROR(XqBadTexture, EqE_BadFile,
+				"Magic number missmatch in deep shadow map \"" << fileName << "\"");
+	}
+	TqUint size[2] = {0, 0};
+	readData(inStream, size, 2, fileName);
+	m_width = size[0];
+	m_height = size[1];
+	m_worldToCamera.SetfIdentity(false);
+	readData(inStream, m_worldToCamera.pElements(), 16, fileName);
+	m_worldToScreen.SetfIdentity(false);
+	readData(inStream, m_worldToScreen.pElements(), 16, fileName);
+
+	TqInt numPixels = m_width*m_height;
+	std::vector<TqUint> offsets(numPixels+1);
+	readData(inStream, &offsets[0], offsets.size(), fileName);
+	m_pixelStart.assign(offsets.begin(), offsets.end()-1);
+	m_pixelSize.resize(numPixels);
+	for(TqInt i = 0; i < numPixels; ++i)
+	{
+		if(offsets[i+1] < offsets[i])
+			AQSIS_THROW_XQERROR(XqBadTexture, EqE_BadFile,
+				"Corrupt pixel offsets in deep shadow map \"" << fileName << "\"");
+		m_pixelSize[i] = offsets[i+1] - offsets[i];
+	}
+	m_nodes.resize(offsets[numPixels]);
+	if(!m_nodes.empty())
+		readData(inStream, &m_nodes[0].depth, 2*m_nodes.size(), fileName);
+}
+
+void CqDeepShadowMap::write(const boostfs::path& fileName) const
+{
+	std::ofstream outStream(native(fileName).c_str(),
+			std::ios::out | std::ios::binary);
+	if(!outStream.is_open())
+	{
+		AQSIS_THROW_XQERROR(XqInvalidFile, EqE_NoFile,
+				"Could not open deep shadow map \"" << fileName << "\" for writing");
+	}
+	outStream.write(deepShadowMagicNum, magicNumSize);
+	TqUint size[2] = {static_cast<TqUint>(m_width), static_cast<TqUint>(m_height)};
+	writeData(outStream, size, 2);
+	writeData(outStream, m_worldToCamera.pElements(), 16);
+	writeData(outStream, m_worldToScreen.pElements(), 16);
+
+	// Pixels may have been set in any order, so write the nodes out in
+	// pixel order along with the new offsets.
+	TqInt numPixels = m_width*m_height;
+	std::vector<TqUint> offsets(numPixels+1, 0);
+	for(TqInt i = 0; i < numPixels; ++i)
+		offsets[i+1] = offsets[i] + m_pixelSize[i];
+	writeData(outStream, &offsets[0], offsets.size());
+	for(TqInt i = 0; i < numPixels; ++i)
+	{
+		if(m_pixelSize[i] > 0)
+			writeData(outStream, &m_nodes[m_pixelStart[i]].depth, 2*m_pixelSize[i]);
+	}
+	if(!outStream)
+	{
+		AQSIS_THROW_XQERROR(XqInvalidFile, EqE_System,
+				"Could not write deep shadow map \"" << fileName << "\"");
+	}
+}
+
+void CqDeepShadowMap::setPixel(TqInt x, TqInt y,
+		const std::vector<SqVisibilityNode>& nodes)
+{
+	assert(x >= 0 && x < m_width && y >= 0 && y < m_height);
+	TqInt i = y*m_width + x;
+	m_pixelStart[i] = m_nodes.size();
+	m_pixelSize[i] = nodes.size();
+	m_nodes.insert(m_nodes.end(), nodes.begin(), nodes.end());
+}
+
+TqFloat CqDeepShadowMap::visibility(TqInt x, TqInt y, TqFloat depth) const
+{
+	assert(x >= 0 && x < m_width && y >= 0 && y < m_height);
+	TqInt i = y*m_width + x;
+	if(m_pixelSize[i] == 0)
+		return 1;
+	const SqVisibilityNode* begin = &m_nodes[m_pixelStart[i]];
+	const SqVisibilityNode* end = begin + m_pixelSize[i];
+	// Find the first node at or beyond the given depth.  A step exactly at
+	// the depth hasn't been passed yet, and the two nodes of a step share a
+	// depth, so are never interpolated between.
+	const SqVisibilityNode* next = std::lower_bound(begin, end, depth,
+			nodeDepthLess);
+	if(next == begin)
+		return begin->visibility;
+	if(next == end)
+		return (end-1)->visibility;
+	const SqVisibilityNode* prev = next - 1;
+	return prev->visibility + (next->visibility - prev->visibility)
+		* (depth - prev->depth) / (next->depth - prev->depth);
+}
+
+void CqDeepShadowMap::compress(const std::vector<SqVisibilityNode>& nodes,
+		TqFloat tolerance, std::vector<SqVisibilityNode>& result)
+{
+	result.clear();
+	TqInt numNodes = nodes.size();
+	if(numNodes == 0)
+		return;
+	result.push_back(nodes[0]);
+	TqInt start = 0;
+	while(start < numNodes-1)
+	{
+		// Extend a segment from the start node to the furthest node for
+		// which the segment passes within the tolerance of all the nodes in
+		// between.  The admissible slopes form an interval which shrinks as
+		// each node is passed.
+		const SqVisibilityNode& s = nodes[start];
+		TqFloat minSlope = -FLT_MAX;
+		TqFloat maxSlope = FLT_MAX;
+		// False once no sloped segment can pass through the nodes so far.
+		bool slopeOk = true;
+		TqInt end = start+1;
+		for(TqInt i = start+1; i < numNodes; ++i)
+		{
+			TqFloat dz = nodes[i].depth - s.depth;
+			TqFloat dv = nodes[i].visibility - s.visibility;
+			if(dz > 0)
+			{
+				TqFloat slope = dv/dz;
+				if(!slopeOk || slope < minSlope || slope > maxSlope)
+					break;
+				minSlope = std::max(minSlope, (dv - tolerance)/dz);
+				maxSlope = std::min(maxSlope, (dv + tolerance)/dz);
+			}
+			else
+			{
+				// Nodes at the start depth may always end a vertical
+				// segment, but only lie on a sloped one if they're close to
+				// the start node.
+				if(std::fabs(dv) > tolerance)
+					slopeOk = false;
+			}
+			end = i;
+		}
+		result.push_back(nodes[end]);
+		start = end;
+	}
+}
+
+} // namespace Aqsis
@@ -0,0 +1,130 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/** \file
+ *
+ * \brief Unit tests for deep shadow map buffers
+ */
+
+#include <aqsis/tex/buffers/deepshadowmap.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+#include <boost/test/floating_point_comparison.hpp>
+
+#include <boost/filesystem/operations.hpp>
+
+#include "magicnumber.h"
+
+using namespace Aqsis;
+
+namespace {
+
+// Visibility through two half-covering occluders at depth 1 and 2, where
+// the second is approximated by a gentle ramp.
+std::vector<SqVisibilityNode> testFunction()
+{
+	std::vector<SqVisibilityNode> nodes;
+	nodes.push_back(SqVisibilityNode(1, 1));
+	nodes.push_back(SqVisibilityNode(1, 0.5));
+	nodes.push_back(SqVisibilityNode(2, 0.5));
+	nodes.push_back(SqVisibilityNode(2.5, 0.375));
+	nodes.push_back(SqVisibilityNode(3, 0.25));
+	return nodes;
+}
+
+} // unnamed namespace
+
+BOOST_AUTO_TEST_SUITE(deepshadowmap_tests)
+
+BOOST_AUTO_TEST_CASE(CqDeepShadowMap_compress_test)
+{
+	std::vector<SqVisibilityNode> compressed;
+	CqDeepShadowMap::compress(testFunction(), 0.01, compressed);
+	// The collinear node on the ramp is dropped, but the step is kept.
+	BOOST_REQUIRE_EQUAL(compressed.size(), 4U);
+	BOOST_CHECK_EQUAL(compressed[0].depth, 1);
+	BOOST_CHECK_EQUAL(compressed[1].visibility, 0.5);
+	BOOST_CHECK_EQUAL(compressed[2].depth, 2);
+	BOOST_CHECK_EQUAL(compressed[3].depth, 3);
+
+	// A large tolerance flattens small steps.
+	std::vector<SqVisibilityNode> nodes;
+	nodes.push_back(SqVisibilityNode(1, 1));
+	nodes.push_back(SqVisibilityNode(1, 0.99));
+	nodes.push_back(SqVisibilityNode(2, 0.99));
+	nodes.push_back(SqVisibilityNode(2, 0.98));
+	CqDeepShadowMap::compress(nodes, 0.05, compressed);
+	BOOST_REQUIRE_EQUAL(compressed.size(), 2U);
+	BOOST_CHECK_EQUAL(compressed[1].visibility, 0.98f);
+}
+
+BOOST_AUTO_TEST_CASE(CqDeepShadowMap_visibility_test)
+{
+	CqDeepShadowMap map(2, 1, CqMatrix(), CqMatrix());
+	map.setPixel(1, 0, testFunction());
+	// Unset pixels are fully visible.
+	BOOST_CHECK_EQUAL(map.visibility(0, 0, 10), 1);
+	BOOST_CHECK_EQUAL(map.visibility(1, 0, 0.5), 1);
+	// Occluders exactly at the lookup depth don't count.
+	BOOST_CHECK_EQUAL(map.visibility(1, 0, 1), 1);
+	BOOST_CHECK_EQUAL(map.visibility(1, 0, 1.5), 0.5);
+	BOOST_CHECK_CLOSE(map.visibility(1, 0, 2.75), 0.3125f, 1e-4);
+	BOOST_CHECK_EQUAL(map.visibility(1, 0, 10), 0.25);
+}
+
+BOOST_AUTO_TEST_CASE(CqDeepShadowMap_file_test)
+{
+	CqMatrix worldToCamera;
+	worldToCamera.Translate(CqVector3D(1,2,3));
+	CqDeepShadowMap map(2, 2, worldToCamera, CqMatrix());
+	// Pixels set out of order are written in pixel order.
+	map.setPixel(1, 1, testFunction());
+	std::vector<SqVisibilityNode> nodes;
+	nodes.push_back(SqVisibilityNode(4, 1));
+	nodes.push_back(SqVisibilityNode(4, 0));
+	map.setPixel(0, 1, nodes);
+
+	const char* fileName = "deepshadowmap_test.dsm";
+	map.write(fileName);
+	BOOST_CHECK_EQUAL(guessFileType(fileName), ImageFile_AqsisDeepShadow);
+	CqDeepShadowMap readMap(fileName);
+	boost::filesystem::remove(fileName);
+
+	BOOST_CHECK_EQUAL(readMap.width(), 2);
+	BOOST_CHECK_EQUAL(readMap.height(), 2);
+	BOOST_CHECK_EQUAL(readMap.numNodes(), 7U);
+	BOOST_CHECK_EQUAL(readMap.worldToCamera()[3][2], 3);
+	BOOST_CHECK_EQUAL(readMap.visibility(0, 0, 10), 1);
+	BOOST_CHECK_EQUAL(readMap.visibility(0, 1, 5), 0);
+	BOOST_CHECK_EQUAL(readMap.visibility(1, 1, 1.5), 0.5);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,12 +1,16 @@
 set(buffers_srcs
+	deepshadowmap.cpp
 	imagechannel.cpp
 	mixedimagebuffer.cpp
+	tilecache.cpp
 )
 make_absolute(buffers_srcs ${buffers_SOURCE_DIR})
 
 set(buffers_test_srcs
 	channellist_test.cpp
+	deepshadowmap_test.cpp
 	imagechannel_test.cpp
 	mixedimagebuffer_test.cpp
+	tilecache_test.cpp
 )
 make_absolute(buffers_test_srcs ${buffers_SOURCE_DIR})
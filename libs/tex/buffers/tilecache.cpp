@@ -0,0 +1,348 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/**
+ * \file
+ *
+ * \brief Memory bounded texture tile cache implementation.
+ */
+
+#include <aqsis/tex/buffers/tilecache.h>
+
+#include <algorithm>
+
+#include <aqsis/tex/io/itiledtexinputfile.h>
+
+namespace Aqsis {
+
+const std::size_t CqTileCache::defaultMemoryLimit = 256*1024*1024;
+const TqInt CqTileCache::defaultMaxOpenFiles = 128;
+
+namespace {
+
+#ifdef ENABLE_THREADING
+/** Locks for reading texture files.
+ *
+ * Files are assigned to locks by address.  Unrelated files occasionally
+ * share a lock, which is harmless.
+ */
+const TqInt numFileLocks = 64;
+boost::mutex g_fileLocks[numFileLocks];
+
+boost::mutex& fileLock(const IqTiledTexInputFile* file)
+{
+	std::size_t i = reinterpret_cast<std::size_t>(file) / sizeof(void*);
+	return g_fileLocks[i % numFileLocks];
+}
+#endif
+
+/// The cache shared by all tiled arrays.
+CqTileCache g_tileCache(CqTileCache::defaultMemoryLimit,
+		CqTileCache::defaultMaxOpenFiles);
+
+} // unnamed namespace
+
+//------------------------------------------------------------------------------
+// CqTileSlots implementation
+CqTileSlots::CqTileSlots(CqTileCache& cache, TqInt numSlots)
+	: m_cache(cache),
+	m_slots(numSlots)
+{ }
+
+CqTileSlots::~CqTileSlots()
+{
+#	ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_cache.m_mutex);
+#	endif
+	for(TqInt i = 0, end = m_slots.size(); i < end; ++i)
+	{
+		if(m_slots[i])
+			m_cache.unlink(m_slots[i].get());
+	}
+}
+
+boost::intrusive_ptr<CqCachedTile> CqTileSlots::find(TqInt index)
+{
+#	ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_cache.m_mutex);
+#	endif
+	CqCachedTile* tile = m_slots[index].get();
+	if(tile)
+	{
+		++m_cache.m_stats.hits;
+		// Move to the front of the usage list.
+		if(tile != m_cache.m_head)
+		{
+			m_cache.unlink(tile);
+			m_cache.link(tile);
+		}
+	}
+	return tile;
+}
+
+boost::intrusive_ptr<CqCachedTile> CqTileSlots::insert(TqInt index,
+		const boost::intrusive_ptr<CqCachedTile>& tile, std::size_t bytes)
+{
+	std::vector<boost::intrusive_ptr<CqCachedTile> > evicted;
+	boost::intrusive_ptr<CqCachedTile> result;
+	{
+#		ifdef ENABLE_THREADING
+		boost::mutex::scoped_lock lock(m_cache.m_mutex);
+#		endif
+		++m_cache.m_stats.misses;
+		if(m_slots[index])
+			return m_slots[index];
+		m_slots[index] = tile;
+		tile->m_bytes = bytes;
+		tile->m_index = index;
+		tile->m_owner = this;
+		m_cache.link(tile.get());
+		// The caller holds a reference, so the new tile can't be evicted.
+		m_cache.evict(evicted);
+		result = tile;
+	}
+	// Evicted tiles are freed here, outside the lock.
+	return result;
+}
+
+//------------------------------------------------------------------------------
+// CqTileCache::CqFileLock implementation
+CqTileCache::CqFileLock::CqFileLock(const IqTiledTexInputFile* file)
+#	ifdef ENABLE_THREADING
+	: m_mutex(fileLock(file))
+#	endif
+{
+#	ifdef ENABLE_THREADING
+	m_mutex.lock();
+#	endif
+}
+
+CqTileCache::CqFileLock::~CqFileLock()
+{
+#	ifdef ENABLE_THREADING
+	m_mutex.unlock();
+#	endif
+}
+
+//------------------------------------------------------------------------------
+// CqTileCache implementation
+CqTileCache::CqTileCache(std::size_t memoryLimit, TqInt maxOpenFiles)
+	: m_head(0),
+	m_tail(0),
+	m_memoryLimit(memoryLimit),
+	m_stats(),
+	m_openFiles(),
+	m_maxOpenFiles(maxOpenFiles),
+	m_fileCloses(0)
+{ }
+
+CqTileCache& CqTileCache::instance()
+{
+	return g_tileCache;
+}
+
+void CqTileCache::setMemoryLimit(std::size_t bytes)
+{
+	std::vector<boost::intrusive_ptr<CqCachedTile> > evicted;
+#	ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_mutex);
+#	endif
+	m_memoryLimit = bytes;
+	evict(evicted);
+}
+
+std::size_t CqTileCache::memoryLimit() const
+{
+#	ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_mutex);
+#	endif
+	return m_memoryLimit;
+}
+
+void CqTileCache::setMaxOpenFiles(TqInt maxFiles)
+{
+	{
+#		ifdef ENABLE_THREADING
+		boost::mutex::scoped_lock lock(m_fileMutex);
+#		endif
+		m_maxOpenFiles = maxFiles;
+	}
+	closeExcessFiles();
+}
+
+CqTileCache::SqStats CqTileCache::stats() const
+{
+	SqStats stats;
+	{
+#		ifdef ENABLE_THREADING
+		boost::mutex::scoped_lock lock(m_mutex);
+#		endif
+		stats = m_stats;
+	}
+	{
+#		ifdef ENABLE_THREADING
+		boost::mutex::scoped_lock lock(m_fileMutex);
+#		endif
+		stats.openFiles = m_openFiles.size();
+		stats.fileCloses = m_fileCloses;
+	}
+	return stats;
+}
+
+void CqTileCache::resetStats()
+{
+	{
+#		ifdef ENABLE_THREADING
+		boost::mutex::scoped_lock lock(m_mutex);
+#		endif
+		m_stats.hits = 0;
+		m_stats.misses = 0;
+		m_stats.evictions = 0;
+		m_stats.peakBytes = m_stats.bytesUsed;
+	}
+#	ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_fileMutex);
+#	endif
+	m_fileCloses = 0;
+}
+
+void CqTileCache::fileOpened(const IqTiledTexInputFile* file)
+{
+	{
+#		ifdef ENABLE_THREADING
+		boost::mutex::scoped_lock lock(m_fileMutex);
+#		endif
+		m_openFiles.insert(m_openFiles.begin(), file);
+	}
+	closeExcessFiles();
+}
+
+void CqTileCache::fileUsed(const IqTiledTexInputFile* file)
+{
+#	ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_fileMutex);
+#	endif
+	// The list is short, and the most recently used files are near the front.
+	std::vector<const IqTiledTexInputFile*>::iterator i
+		= std::find(m_openFiles.begin(), m_openFiles.end(), file);
+	if(i != m_openFiles.end())
+		std::rotate(m_openFiles.begin(), i, i + 1);
+}
+
+void CqTileCache::fileClosed(const IqTiledTexInputFile* file)
+{
+#	ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_fileMutex);
+#	endif
+	m_openFiles.erase(std::remove(m_openFiles.begin(), m_openFiles.end(), file),
+			m_openFiles.end());
+}
+
+void CqTileCache::link(CqCachedTile* tile)
+{
+	tile->m_prev = 0;
+	tile->m_next = m_head;
+	if(m_head)
+		m_head->m_prev = tile;
+	else
+		m_tail = tile;
+	m_head = tile;
+	m_stats.bytesUsed += tile->m_bytes;
+	m_stats.peakBytes = std::max(m_stats.peakBytes, m_stats.bytesUsed);
+}
+
+void CqTileCache::unlink(CqCachedTile* tile)
+{
+	if(tile->m_prev)
+		tile->m_prev->m_next = tile->m_next;
+	else
+		m_head = tile->m_next;
+	if(tile->m_next)
+		tile->m_next->m_prev = tile->m_prev;
+	else
+		m_tail = tile->m_prev;
+	tile->m_prev = tile->m_next = 0;
+	m_stats.bytesUsed -= tile->m_bytes;
+}
+
+void CqTileCache::evict(std::vector<boost::intrusive_ptr<CqCachedTile> >& evicted)
+{
+	if(m_memoryLimit == 0)
+		return;
+	CqCachedTile* tile = m_tail;
+	while(tile && m_stats.bytesUsed > m_memoryLimit)
+	{
+		CqCachedTile* prev = tile->m_prev;
+		// Only the slot refers to an unpinned tile.  Other references can
+		// only be taken from the slot under m_mutex, so this can't change
+		// under our feet.
+		if(tile->m_refCount == 1)
+		{
+			unlink(tile);
+			boost::intrusive_ptr<CqCachedTile>& slot
+				= tile->m_owner->m_slots[tile->m_index];
+			evicted.push_back(boost::intrusive_ptr<CqCachedTile>());
+			evicted.back().swap(slot);
+			++m_stats.evictions;
+		}
+		tile = prev;
+	}
+}
+
+void CqTileCache::closeExcessFiles()
+{
+#	ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_fileMutex);
+#	endif
+	if(m_maxOpenFiles <= 0)
+		return;
+	for(TqInt i = m_openFiles.size() - 1;
+			i >= 0 && static_cast<TqInt>(m_openFiles.size()) > m_maxOpenFiles; --i)
+	{
+		const IqTiledTexInputFile* file = m_openFiles[i];
+#		ifdef ENABLE_THREADING
+		// Skip files which are being read.  Blocking here could deadlock
+		// with a reader waiting on m_fileMutex in fileUsed().
+		boost::mutex& readLock = fileLock(file);
+		if(!readLock.try_lock())
+			continue;
+#		endif
+		if(file->closeHandle())
+		{
+			m_openFiles.erase(m_openFiles.begin() + i);
+			++m_fileCloses;
+		}
+#		ifdef ENABLE_THREADING
+		readLock.unlock();
+#		endif
+	}
+}
+
+} // namespace Aqsis
@@ -0,0 +1,169 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/** \file
+ *
+ * \brief Unit tests for the texture tile cache
+ */
+
+#include <aqsis/tex/buffers/tilecache.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+#include <aqsis/tex/io/itiledtexinputfile.h>
+
+using namespace Aqsis;
+
+namespace {
+
+struct CqTestTile : public CqCachedTile
+{
+	CqTestTile(TqInt& liveCount) : m_liveCount(liveCount) { ++m_liveCount; }
+	~CqTestTile() { --m_liveCount; }
+	TqInt& m_liveCount;
+};
+
+/// Fake texture file which just records whether its handle is open.
+class CqTestFile : public IqTiledTexInputFile
+{
+	public:
+		CqTestFile() : m_header(), m_open(true) {}
+		virtual boostfs::path fileName() const { return "test"; }
+		virtual EqImageFileType fileType() const { return ImageFile_Tiff; }
+		virtual const CqTexFileHeader& header(TqInt) const { return m_header; }
+		virtual SqTileInfo tileInfo() const { return SqTileInfo(1,1); }
+		virtual bool closeHandle() const { m_open = false; return true; }
+		virtual TqInt numSubImages() const { return 1; }
+		virtual TqInt width(TqInt) const { return 1; }
+		virtual TqInt height(TqInt) const { return 1; }
+		bool isOpen() const { return m_open; }
+	private:
+		virtual void readTileImpl(TqUint8*, TqInt, TqInt, TqInt,
+				const SqTileInfo) const {}
+		CqTexFileHeader m_header;
+		mutable bool m_open;
+};
+
+} // unnamed namespace
+
+BOOST_AUTO_TEST_SUITE(tilecache_tests)
+
+BOOST_AUTO_TEST_CASE(CqTileCache_lru_eviction_test)
+{
+	TqInt liveTiles = 0;
+	CqTileCache cache(300, 0);
+	{
+		CqTileSlots slots(cache, 4);
+		for(TqInt i = 0; i < 3; ++i)
+			slots.insert(i, new CqTestTile(liveTiles), 100);
+		BOOST_CHECK_EQUAL(liveTiles, 3);
+		BOOST_CHECK_EQUAL(cache.stats().bytesUsed, 300U);
+
+		// Touch tile 0 so that tile 1 becomes the least recently used.
+		BOOST_CHECK(slots.find(0));
+		slots.insert(3, new CqTestTile(liveTiles), 100);
+		BOOST_CHECK_EQUAL(liveTiles, 3);
+		BOOST_CHECK(slots.find(0));
+		BOOST_CHECK(!slots.find(1));
+		BOOST_CHECK(slots.find(2));
+		BOOST_CHECK(slots.find(3));
+
+		CqTileCache::SqStats stats = cache.stats();
+		BOOST_CHECK_EQUAL(stats.misses, 4U);
+		BOOST_CHECK_EQUAL(stats.hits, 4U);
+		BOOST_CHECK_EQUAL(stats.evictions, 1U);
+		BOOST_CHECK_EQUAL(stats.peakBytes, 400U);
+		BOOST_CHECK_EQUAL(stats.bytesUsed, 300U);
+	}
+	// Destroying the table releases all its tiles.
+	BOOST_CHECK_EQUAL(liveTiles, 0);
+	BOOST_CHECK_EQUAL(cache.stats().bytesUsed, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(CqTileCache_pinned_tiles_test)
+{
+	TqInt liveTiles = 0;
+	CqTileCache cache(100, 0);
+	CqTileSlots slots(cache, 2);
+	boost::intrusive_ptr<CqCachedTile> pinned = slots.insert(0,
+			new CqTestTile(liveTiles), 100);
+	// The first tile is referenced, so can't be evicted; the cache goes over
+	// its limit instead.
+	slots.insert(1, new CqTestTile(liveTiles), 100);
+	BOOST_CHECK_EQUAL(liveTiles, 2);
+	BOOST_CHECK_EQUAL(cache.stats().bytesUsed, 200U);
+	// Unpinning lets the next shrink evict it.
+	pinned = 0;
+	cache.setMemoryLimit(100);
+	BOOST_CHECK(!slots.find(0));
+	BOOST_CHECK_EQUAL(liveTiles, 1);
+	// Zero means no limit.
+	cache.setMemoryLimit(0);
+	slots.insert(0, new CqTestTile(liveTiles), 100);
+	BOOST_CHECK_EQUAL(liveTiles, 2);
+}
+
+BOOST_AUTO_TEST_CASE(CqTileCache_insert_race_test)
+{
+	TqInt liveTiles = 0;
+	CqTileCache cache(0, 0);
+	CqTileSlots slots(cache, 1);
+	boost::intrusive_ptr<CqCachedTile> first = slots.insert(0,
+			new CqTestTile(liveTiles), 10);
+	// A second load of the same tile keeps the first.
+	boost::intrusive_ptr<CqCachedTile> second = slots.insert(0,
+			new CqTestTile(liveTiles), 10);
+	BOOST_CHECK_EQUAL(first, second);
+	BOOST_CHECK_EQUAL(liveTiles, 1);
+	BOOST_CHECK_EQUAL(cache.stats().bytesUsed, 10U);
+}
+
+BOOST_AUTO_TEST_CASE(CqTileCache_file_limit_test)
+{
+	CqTileCache cache(0, 2);
+	CqTestFile f1, f2, f3;
+	cache.fileOpened(&f1);
+	cache.fileOpened(&f2);
+	cache.fileUsed(&f1);
+	cache.fileOpened(&f3);
+	// f2 was least recently used.
+	BOOST_CHECK(f1.isOpen());
+	BOOST_CHECK(!f2.isOpen());
+	BOOST_CHECK(f3.isOpen());
+	CqTileCache::SqStats stats = cache.stats();
+	BOOST_CHECK_EQUAL(stats.openFiles, 2);
+	BOOST_CHECK_EQUAL(stats.fileCloses, 1U);
+	cache.fileClosed(&f1);
+	cache.fileClosed(&f3);
+	BOOST_CHECK_EQUAL(cache.stats().openFiles, 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
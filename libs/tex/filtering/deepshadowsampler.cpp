@@ -0,0 +1,156 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/** \file
+ *
+ * \brief Deep shadow map sampler implementation
+ */
+
+#include "deepshadowsampler.h"
+
+#include <aqsis/math/math.h>
+#include <aqsis/tex/buffers/deepshadowmap.h>
+#include <aqsis/tex/texexception.h>
+
+#include "depthapprox.h"
+#include "ewafilter.h"
+#include "randomtable.h"
+
+namespace Aqsis {
+
+//------------------------------------------------------------------------------
+// CqDeepShadowSampler implementation
+
+CqDeepShadowSampler::CqDeepShadowSampler(
+		const boost::shared_ptr<CqDeepShadowMap>& map, const CqMatrix& currToWorld)
+	: m_map(map),
+	m_currToLight(),
+	m_currToRaster()
+{
+	if(!m_map)
+		AQSIS_THROW_XQERROR(XqInternal, EqE_NoFile,
+				"Cannot construct deep shadow sampler from NULL map");
+	m_currToLight = m_map->worldToCamera() * currToWorld;
+	// Map the light screen coordinates [-1,1]x[-1,1] onto texture
+	// coordinates [0,1]x[0,1] with the y-axis flipped, as in CqShadowSampler.
+	m_currToRaster = m_map->worldToScreen() * currToWorld;
+	m_currToRaster.Translate(CqVector3D(1,-1,0));
+	m_currToRaster.Scale(0.5f, -0.5f, 1);
+}
+
+void CqDeepShadowSampler::sample(const Sq3DSampleQuad& sampleQuad,
+		const CqShadowSampleOptions& sampleOpts, TqFloat* outSamps) const
+{
+	// Get depths of sample positions.
+	Sq3DSampleQuad quadLightCoord = sampleQuad;
+	quadLightCoord.transform(m_currToLight);
+
+	// Get texture coordinates of sample positions.
+	Sq3DSampleQuad texQuad3D = sampleQuad;
+	texQuad3D.transform(m_currToRaster);
+	SqSampleQuad texQuad = texQuad3D;
+	texQuad.scaleWidth(sampleOpts.sWidth(), sampleOpts.tWidth());
+
+	// Filter with the same EWA weights as depth shadow maps.  Deep maps need
+	// much less blur to avoid aliasing, so the filter is usually small.
+	CqEwaFilterFactory ewaFactory(texQuad, m_map->width(),
+			m_map->height(), sampleOpts.sBlur(), sampleOpts.tBlur(), 2);
+	CqEwaFilter ewaWeights = ewaFactory.createFilter();
+
+	*outSamps = 0;
+	if(!ewaWeights.support().intersectsRange(0, m_map->width(), 0, m_map->height()))
+	{
+		// Fully visible outside the map.
+		return;
+	}
+	if(sampleOpts.depthApprox() == DApprox_Constant)
+	{
+		CqConstDepthApprox depthFunc(quadLightCoord.center().z());
+		filterVisibility(ewaWeights, depthFunc, sampleOpts, outSamps);
+	}
+	else
+	{
+		quadLightCoord.copy2DCoords(texQuad);
+		CqSampleQuadDepthApprox depthFunc(quadLightCoord, m_map->width(),
+				m_map->height());
+		filterVisibility(ewaWeights, depthFunc, sampleOpts, outSamps);
+	}
+}
+
+template<typename DepthFuncT>
+void CqDeepShadowSampler::filterVisibility(const CqEwaFilter& ewaWeights,
+		const DepthFuncT& depthFunc, const CqShadowSampleOptions& sampleOpts,
+		TqFloat* outSamps) const
+{
+	SqFilterSupport support = intersect(ewaWeights.support(),
+			SqFilterSupport(0, m_map->width(), 0, m_map->height()));
+	TqFloat biasLow = sampleOpts.biasLow();
+	TqFloat biasHigh = sampleOpts.biasHigh();
+	TqFloat occlusion = 0;
+	TqFloat totWeight = 0;
+	// As for PCF, filter over the whole support if it's small enough, and
+	// otherwise choose a random subset of the pixels.
+	bool stochastic = support.area() > sampleOpts.numSamples()
+		&& sampleOpts.numSamples() >= 0;
+	TqInt numSamples = stochastic ? sampleOpts.numSamples() : support.area();
+	if(stochastic)
+		detail::g_randTab.randomize();
+	for(TqInt i = 0; i < numSamples; ++i)
+	{
+		TqInt x = 0;
+		TqInt y = 0;
+		if(stochastic)
+		{
+			x = support.sx.start + lfloor(support.sx.range()*detail::g_randTab.x(i));
+			y = support.sy.start + lfloor(support.sy.range()*detail::g_randTab.y(i));
+		}
+		else
+		{
+			x = support.sx.start + i % support.sx.range();
+			y = support.sy.start + i / support.sx.range();
+		}
+		TqFloat weight = ewaWeights(x, y);
+		if(weight == 0)
+			continue;
+		TqFloat depth = depthFunc(x, y);
+		// The bias moves the lookup toward the light.  A range of biases is
+		// approximated by averaging the visibility at each end.
+		TqFloat visibility = m_map->visibility(x, y, depth - biasLow);
+		if(biasHigh != biasLow)
+			visibility = 0.5f*(visibility + m_map->visibility(x, y, depth - biasHigh));
+		occlusion += weight*(1 - visibility);
+		totWeight += weight;
+	}
+	if(!ewaWeights.isNormalized() && totWeight != 0)
+		occlusion /= totWeight;
+	*outSamps = occlusion;
+}
+
+} // namespace Aqsis
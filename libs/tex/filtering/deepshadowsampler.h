@@ -0,0 +1,91 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/** \file
+ *
+ * \brief Deep shadow map sampler.
+ */
+
+#ifndef DEEPSHADOWSAMPLER_H_INCLUDED
+#define DEEPSHADOWSAMPLER_H_INCLUDED
+
+#include <aqsis/aqsis.h>
+
+#include <boost/shared_ptr.hpp>
+
+#include <aqsis/tex/filtering/ishadowsampler.h>
+#include <aqsis/math/matrix.h>
+#include <aqsis/tex/filtering/texturesampleoptions.h>
+
+namespace Aqsis
+{
+
+class CqDeepShadowMap;
+class CqEwaFilter;
+
+//------------------------------------------------------------------------------
+/** \brief A sampler for deep shadow maps.
+ *
+ * The occlusion is the filtered opacity of the map pixels at the depth of the
+ * surface.  The filtering is the same as for CqShadowSampler, but each pixel
+ * contributes a fractional visibility rather than the all-or-nothing result
+ * of a depth comparison.
+ */
+class AQSIS_TEX_SHARE CqDeepShadowSampler : public IqShadowSampler
+{
+	public:
+		/** \brief Construct a sampler for the given map.
+		 *
+		 * \param map - deep shadow map to sample.
+		 * \param currToWorld - a matrix transforming the "current" coordinate
+		 *                      system to the world coordinate system.
+		 */
+		CqDeepShadowSampler(const boost::shared_ptr<CqDeepShadowMap>& map,
+				const CqMatrix& currToWorld);
+
+		// inherited
+		virtual void sample(const Sq3DSampleQuad& sampleQuad,
+				const CqShadowSampleOptions& sampleOpts, TqFloat* outSamps) const;
+	private:
+		template<typename DepthFuncT>
+		void filterVisibility(const CqEwaFilter& ewaWeights,
+				const DepthFuncT& depthFunc, const CqShadowSampleOptions& sampleOpts,
+				TqFloat* outSamps) const;
+
+		boost::shared_ptr<CqDeepShadowMap> m_map;
+		/// transformation: current -> light coordinates
+		CqMatrix m_currToLight;
+		/// transformation: current -> raster coordinates ( [0,width]x[0,height] )
+		CqMatrix m_currToRaster;
+};
+
+} // namespace Aqsis
+
+#endif // DEEPSHADOWSAMPLER_H_INCLUDED
@@ -37,6 +37,7 @@
 
 #include <aqsis/tex/filtering/ishadowsampler.h>
 
+#include "deepshadowsampler.h"
 #include "dummyshadowsampler.h"
 #include <aqsis/tex/io/itiledtexinputfile.h>
 #include "shadowsampler.h"
@@ -70,6 +71,13 @@ boost::shared_ptr<IqShadowSampler> IqShadowSampler::create(
 	return createDummy();
 }
 
+boost::shared_ptr<IqShadowSampler> IqShadowSampler::create(
+		const boost::shared_ptr<CqDeepShadowMap>& map, const CqMatrix& camToWorld)
+{
+	return boost::shared_ptr<IqShadowSampler>(
+			new CqDeepShadowSampler(map, camToWorld));
+}
+
 boost::shared_ptr<IqShadowSampler> IqShadowSampler::createDummy()
 {
 	return boost::shared_ptr<IqShadowSampler>(new CqDummyShadowSampler());
@@ -1,5 +1,6 @@
 set(filtering_srcs
 	cachedfilter.cpp
+	deepshadowsampler.cpp
 	dummyenvironmentsampler.cpp
 	dummytexturesampler.cpp
 	ewafilter.cpp
@@ -16,6 +17,7 @@ make_absolute(filtering_srcs ${filtering_SOURCE_DIR})
 
 set(filtering_hdrs
 	cubeenvironmentsampler.h
+	deepshadowsampler.h
 	dummyenvironmentsampler.h
 	dummyocclusionsampler.h
 	dummyshadowsampler.h
@@ -25,6 +27,7 @@ set(filtering_hdrs
 	mipmap.h
 	occlusionsampler.h
 	randomtable.h
+	samplertable.h
 	shadowsampler.h
 	texturecache.h
 	texturesampler.h
@@ -35,5 +38,6 @@ include_directories(${filtering_SOURCE_DIR})
 
 set(filtering_test_srcs
 	samplequad_test.cpp
+	samplertable_test.cpp
 )
 make_absolute(filtering_test_srcs ${filtering_SOURCE_DIR})
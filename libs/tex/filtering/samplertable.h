@@ -0,0 +1,233 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/** \file
+ *
+ * \brief Hash tables used by the texture cache to look up samplers.
+ */
+
+#ifndef SAMPLERTABLE_H_INCLUDED
+#define SAMPLERTABLE_H_INCLUDED
+
+#include <aqsis/aqsis.h>
+
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+namespace Aqsis {
+
+//------------------------------------------------------------------------------
+/** \brief Open addressing hash table owning samplers keyed by name hash.
+ *
+ * The texture cache only ever adds samplers until it is flushed, so the table
+ * uses linear probing with no support for removing single entries.  The
+ * capacity is kept a power of two and at least twice the number of entries
+ * to keep probe sequences short.
+ *
+ * The table is not synchronised; the texture cache protects it with a mutex.
+ */
+template<typename SamplerT>
+class CqSamplerTable
+{
+	public:
+		CqSamplerTable();
+
+		/// Find the sampler for the given hash, or return a null pointer.
+		const boost::shared_ptr<SamplerT>& find(TqUlong hash) const;
+		/// Add a sampler which isn't yet in the table.
+		void insert(TqUlong hash, const boost::shared_ptr<SamplerT>& sampler);
+		/// Remove all samplers.
+		void clear();
+		/// Number of samplers in the table.
+		TqInt size() const;
+
+	private:
+		struct SqEntry
+		{
+			TqUlong hash;
+			boost::shared_ptr<SamplerT> sampler;	///< null marks an empty slot
+		};
+		/// Get the slot holding the hash, or the empty slot which ends its probe.
+		TqInt probe(TqUlong hash) const;
+
+		std::vector<SqEntry> m_entries;
+		TqInt m_size;
+};
+
+
+//------------------------------------------------------------------------------
+/** \brief A small direct mapped cache of sampler lookups.
+ *
+ * Each render thread keeps one of these in front of the shared tables so that
+ * repeated lookups of the same texture name don't touch any shared state.
+ * Entries hold plain pointers; the cache is invalidated by changing the
+ * generation number whenever the shared tables are flushed.
+ */
+class CqSamplerLookupCache
+{
+	public:
+		/// Create an empty cache for the given generation.
+		CqSamplerLookupCache(TqInt generation = 0);
+
+		/** \brief Find a sampler.
+		 *
+		 * \param kind - sampler type index, distinguishing the separate
+		 *               sampler tables.
+		 * \param hash - hash of the texture name.
+		 * \return The cached sampler, or null.
+		 */
+		void* find(TqInt kind, TqUlong hash) const;
+		/// Remember the sampler found for the given kind and hash.
+		void insert(TqInt kind, TqUlong hash, void* sampler);
+		/// Empty the cache if it belongs to an older generation.
+		void validate(TqInt generation);
+
+	private:
+		struct SqEntry
+		{
+			TqUlong hash;
+			TqInt kind;
+			void* sampler;
+		};
+		static const TqInt m_numEntries = 64;
+		static TqInt slot(TqInt kind, TqUlong hash);
+
+		SqEntry m_entries[m_numEntries];
+		TqInt m_generation;
+};
+
+
+//==============================================================================
+// Implementation details
+//==============================================================================
+// CqSamplerTable implementation
+template<typename SamplerT>
+inline CqSamplerTable<SamplerT>::CqSamplerTable()
+	: m_entries(16),
+	m_size(0)
+{ }
+
+template<typename SamplerT>
+inline const boost::shared_ptr<SamplerT>& CqSamplerTable<SamplerT>::find(
+		TqUlong hash) const
+{
+	return m_entries[probe(hash)].sampler;
+}
+
+template<typename SamplerT>
+void CqSamplerTable<SamplerT>::insert(TqUlong hash,
+		const boost::shared_ptr<SamplerT>& sampler)
+{
+	assert(sampler);
+	if(2*(m_size + 1) > static_cast<TqInt>(m_entries.size()))
+	{
+		// Rehash into a table of twice the size.
+		std::vector<SqEntry> oldEntries(2*m_entries.size());
+		oldEntries.swap(m_entries);
+		for(TqInt i = 0, end = oldEntries.size(); i < end; ++i)
+		{
+			if(oldEntries[i].sampler)
+				m_entries[probe(oldEntries[i].hash)] = oldEntries[i];
+		}
+	}
+	SqEntry& entry = m_entries[probe(hash)];
+	assert(!entry.sampler);
+	entry.hash = hash;
+	entry.sampler = sampler;
+	++m_size;
+}
+
+template<typename SamplerT>
+inline void CqSamplerTable<SamplerT>::clear()
+{
+	std::vector<SqEntry>(16).swap(m_entries);
+	m_size = 0;
+}
+
+template<typename SamplerT>
+inline TqInt CqSamplerTable<SamplerT>::size() const
+{
+	return m_size;
+}
+
+template<typename SamplerT>
+inline TqInt CqSamplerTable<SamplerT>::probe(TqUlong hash) const
+{
+	const TqInt mask = m_entries.size() - 1;
+	TqInt i = hash & mask;
+	while(m_entries[i].sampler && m_entries[i].hash != hash)
+		i = (i + 1) & mask;
+	return i;
+}
+
+//------------------------------------------------------------------------------
+// CqSamplerLookupCache implementation
+inline CqSamplerLookupCache::CqSamplerLookupCache(TqInt generation)
+	: m_generation(generation)
+{
+	std::memset(m_entries, 0, sizeof(m_entries));
+}
+
+inline void* CqSamplerLookupCache::find(TqInt kind, TqUlong hash) const
+{
+	const SqEntry& entry = m_entries[slot(kind, hash)];
+	if(entry.hash == hash && entry.kind == kind)
+		return entry.sampler;
+	return 0;
+}
+
+inline void CqSamplerLookupCache::insert(TqInt kind, TqUlong hash, void* sampler)
+{
+	SqEntry& entry = m_entries[slot(kind, hash)];
+	entry.hash = hash;
+	entry.kind = kind;
+	entry.sampler = sampler;
+}
+
+inline void CqSamplerLookupCache::validate(TqInt generation)
+{
+	if(generation != m_generation)
+	{
+		std::memset(m_entries, 0, sizeof(m_entries));
+		m_generation = generation;
+	}
+}
+
+inline TqInt CqSamplerLookupCache::slot(TqInt kind, TqUlong hash)
+{
+	return (hash + kind) & (m_numEntries - 1);
+}
+
+} // namespace Aqsis
+
+#endif // SAMPLERTABLE_H_INCLUDED
@@ -0,0 +1,84 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/** \file
+ *
+ * \brief Unit tests for the texture cache sampler tables.
+ */
+#include "samplertable.h"
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace Aqsis;
+
+BOOST_AUTO_TEST_SUITE(samplertable_tests)
+
+BOOST_AUTO_TEST_CASE(CqSamplerTable_insert_find_test)
+{
+	CqSamplerTable<TqInt> table;
+	// Enough entries to force several rehashes, with hashes which collide
+	// in the low bits.
+	const TqInt numEntries = 100;
+	for(TqInt i = 0; i < numEntries; ++i)
+		table.insert(i*1024, boost::shared_ptr<TqInt>(new TqInt(i)));
+	BOOST_CHECK_EQUAL(table.size(), numEntries);
+	for(TqInt i = 0; i < numEntries; ++i)
+	{
+		BOOST_REQUIRE(table.find(i*1024));
+		BOOST_CHECK_EQUAL(*table.find(i*1024), i);
+	}
+	BOOST_CHECK(!table.find(1));
+	table.clear();
+	BOOST_CHECK_EQUAL(table.size(), 0);
+	BOOST_CHECK(!table.find(0));
+}
+
+BOOST_AUTO_TEST_CASE(CqSamplerLookupCache_test)
+{
+	TqInt a = 0, b = 0;
+	CqSamplerLookupCache lookup(0);
+	BOOST_CHECK(!lookup.find(0, 42));
+	lookup.insert(0, 42, &a);
+	lookup.insert(1, 42, &b);
+	BOOST_CHECK_EQUAL(lookup.find(0, 42), &a);
+	BOOST_CHECK_EQUAL(lookup.find(1, 42), &b);
+	// Hashes mapping to the same slot replace each other.
+	lookup.insert(0, 42 + 64, &b);
+	BOOST_CHECK(!lookup.find(0, 42));
+	BOOST_CHECK_EQUAL(lookup.find(0, 42 + 64), &b);
+	// A new generation empties the cache.
+	lookup.validate(0);
+	BOOST_CHECK_EQUAL(lookup.find(1, 42), &b);
+	lookup.validate(1);
+	BOOST_CHECK(!lookup.find(1, 42));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
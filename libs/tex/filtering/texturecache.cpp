@@ -38,6 +38,7 @@
 #include "texturecache.h"
 
 #include <aqsis/util/exception.h>
+#include <aqsis/tex/buffers/deepshadowmap.h>
 #include <aqsis/util/file.h>
 #include <aqsis/tex/filtering/ienvironmentsampler.h>
 #include <aqsis/tex/filtering/iocclusionsampler.h>
@@ -48,6 +49,8 @@
 #include <aqsis/util/sstring.h>
 #include <aqsis/tex/texexception.h>
 
+#include "magicnumber.h"
+
 namespace Aqsis {
 
 //------------------------------------------------------------------------------
@@ -70,40 +73,54 @@ CqTextureCache::CqTextureCache(TqSearchPathCallback searchPathCallback)
 	m_occlusionCache(),
 	m_texFileCache(),
 	m_currToWorld(),
-	m_searchPathCallback(searchPathCallback)
+	m_searchPathCallback(searchPathCallback),
+	m_generation(0)
+#	ifdef ENABLE_THREADING
+	, m_mutex(),
+	m_localLookup()
+#	else
+	, m_lookup()
+#	endif
 { }
 
 IqTextureSampler& CqTextureCache::findTextureSampler(const char* name)
 {
-	return findSampler(m_textureCache, name);
+	return findSampler(m_textureCache, Sampler_Texture, name);
 }
 
 IqEnvironmentSampler& CqTextureCache::findEnvironmentSampler(const char* name)
 {
-	return findSampler(m_environmentCache, name);
+	return findSampler(m_environmentCache, Sampler_Environment, name);
 }
 
 IqShadowSampler& CqTextureCache::findShadowSampler(const char* name)
 {
-	return findSampler(m_shadowCache, name);
+	return findSampler(m_shadowCache, Sampler_Shadow, name);
 }
 
 IqOcclusionSampler& CqTextureCache::findOcclusionSampler(const char* name)
 {
-	return findSampler(m_occlusionCache, name);
+	return findSampler(m_occlusionCache, Sampler_Occlusion, name);
 }
 
 void CqTextureCache::flush()
 {
+#	ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_mutex);
+#	endif
 	m_textureCache.clear();
 	m_environmentCache.clear();
 	m_shadowCache.clear();
 	m_occlusionCache.clear();
 	m_texFileCache.clear();
+	++m_generation;
 }
 
 const CqTexFileHeader* CqTextureCache::textureInfo(const char* name)
 {
+#	ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_mutex);
+#	endif
 	boost::shared_ptr<IqTiledTexInputFile> file;
 	try
 	{
@@ -124,57 +141,79 @@ void CqTextureCache::setCurrToWorldMatrix(const CqMatrix& currToWorld)
 //--------------------------------------------------
 // Private methods
 template<typename SamplerT>
-SamplerT& CqTextureCache::findSampler(
-		std::map<TqUlong, boost::shared_ptr<SamplerT> >& samplerMap,
-		const char* name)
+SamplerT& CqTextureCache::findSampler(CqSamplerTable<SamplerT>& samplerTable,
+		EqSamplerKind kind, const char* name)
 {
 	TqUlong hash = CqString::hash(name);
-	typename std::map<TqUlong, boost::shared_ptr<SamplerT> >::const_iterator
-		texIter = samplerMap.find(hash);
-	if(texIter != samplerMap.end())
-	{
-		// The desired texture sampler is already created - return it.
-		return *(texIter->second);
-	}
-	else
+	// Fast path: this thread has looked up the sampler before.
+	CqSamplerLookupCache& lookup = localLookupCache();
+	if(void* sampler = lookup.find(kind, hash))
+		return *static_cast<SamplerT*>(sampler);
+
+	SamplerT* sampler = 0;
 	{
-		// Couldn't find in the currently open texture samplers - create a new
-		// instance.
-		boost::shared_ptr<SamplerT> newTex;
-		try
-		{
-			// Find the file in the current file cache.
-			newTex = newSamplerFromFile<SamplerT>(getTextureFile(name));
-		}
-		catch(XqInvalidFile& e)
+#		ifdef ENABLE_THREADING
+		boost::mutex::scoped_lock lock(m_mutex);
+#		endif
+		sampler = samplerTable.find(hash).get();
+		if(!sampler)
 		{
-			Aqsis::log() << error
-				<< "Invalid texture file - " << e.what() << "\n";
-			newTex = SamplerT::createDummy();
+			// Couldn't find in the currently open texture samplers - create a
+			// new instance.
+			boost::shared_ptr<SamplerT> newTex;
+			try
+			{
+				// Find the file in the current file cache.
+				newTex = newSampler<SamplerT>(name);
+			}
+			catch(XqInvalidFile& e)
+			{
+				Aqsis::log() << error
+					<< "Invalid texture file - " << e.what() << "\n";
+				newTex = SamplerT::createDummy();
+			}
+			catch(XqBadTexture& e)
+			{
+				Aqsis::log() << error
+					<< "Bad texture file - " << e.what() << "\n";
+				newTex = SamplerT::createDummy();
+			}
+			samplerTable.insert(hash, newTex);
+			sampler = newTex.get();
 		}
-		catch(XqBadTexture& e)
-		{
-			Aqsis::log() << error
-				<< "Bad texture file - " << e.what() << "\n";
-			newTex = SamplerT::createDummy();
-		}
-		samplerMap[CqString::hash(name)] = newTex;
-		return *newTex;
 	}
+	// Samplers live until the next flush(), which also invalidates the
+	// lookup caches, so holding a plain pointer here is safe.
+	lookup.insert(kind, hash, sampler);
+	return *sampler;
+}
+
+CqSamplerLookupCache& CqTextureCache::localLookupCache()
+{
+#	ifdef ENABLE_THREADING
+	CqSamplerLookupCache* lookup = m_localLookup.get();
+	if(!lookup)
+	{
+		lookup = new CqSamplerLookupCache(m_generation);
+		m_localLookup.reset(lookup);
+	}
+#	else
+	CqSamplerLookupCache* lookup = &m_lookup;
+#	endif
+	lookup->validate(m_generation);
+	return *lookup;
 }
 
 boost::shared_ptr<IqTiledTexInputFile> CqTextureCache::getTextureFile(
 		const char* name)
 {
 	TqUlong hash = CqString::hash(name);
-	std::map<TqUlong, boost::shared_ptr<IqTiledTexInputFile> >::const_iterator
-		fileIter = m_texFileCache.find(hash);
-	if(fileIter != m_texFileCache.end())
+	boost::shared_ptr<IqTiledTexInputFile> file = m_texFileCache.find(hash);
+	if(file)
 		// File exists in the cache; return it.
-		return fileIter->second;
+		return file;
 	// Else try to open the file and store it in the cache before returning it.
 	boostfs::path fullName = findFile(name, m_searchPathCallback());
-	boost::shared_ptr<IqTiledTexInputFile> file;
 	try
 	{
 		file = IqTiledTexInputFile::open(fullName);
@@ -187,7 +226,7 @@ boost::shared_ptr<IqTiledTexInputFile> CqTextureCache::getTextureFile(
 		Aqsis::log() << warning << "Could not open file as a tiled texture: "
 			<< e.what() << ".  Rendering will continue, but may be slower.\n";
 	}
-	m_texFileCache[hash] = file;
+	m_texFileCache.insert(hash, file);
 	return file;
 }
 
@@ -213,4 +252,23 @@ CqTextureCache::newSamplerFromFile(const boost::shared_ptr<IqTiledTexInputFile>&
 	return IqOcclusionSampler::create(file, m_currToWorld);
 }
 
+template<typename SamplerT>
+boost::shared_ptr<SamplerT> CqTextureCache::newSampler(const char* name)
+{
+	return newSamplerFromFile<SamplerT>(getTextureFile(name));
+}
+
+// Shadow maps may be deep shadow maps, which aren't texture files.
+template<>
+boost::shared_ptr<IqShadowSampler> CqTextureCache::newSampler(const char* name)
+{
+	boostfs::path fullName = findFile(name, m_searchPathCallback());
+	if(guessFileType(fullName) == ImageFile_AqsisDeepShadow)
+	{
+		boost::shared_ptr<CqDeepShadowMap> map(new CqDeepShadowMap(fullName));
+		return IqShadowSampler::create(map, m_currToWorld);
+	}
+	return newSamplerFromFile<IqShadowSampler>(getTextureFile(name));
+}
+
 } // namespace Aqsis
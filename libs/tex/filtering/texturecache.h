@@ -40,12 +40,15 @@
 
 #include <aqsis/aqsis.h>
 
-#include <map>
-
 #include <boost/utility.hpp>
+#ifdef ENABLE_THREADING
+#	include <boost/thread/mutex.hpp>
+#	include <boost/thread/tss.hpp>
+#endif
 
 #include <aqsis/tex/filtering/itexturecache.h>
 #include <aqsis/math/matrix.h>
+#include "samplertable.h"
 
 namespace Aqsis {
 
@@ -57,6 +60,14 @@ class IqTiledTexInputFile;
 class CqTexFileHeader;
 
 /** \brief A cache managing the various types of texture samplers.
+ *
+ * The sampler lookup functions may be called concurrently from several
+ * threads.  Each thread resolves names through its own small lookup cache
+ * first, so repeated lookups of the same texture take no locks.  The shared
+ * sampler tables behind it are protected by a mutex.
+ *
+ * flush() and setCurrToWorldMatrix() must not be called while other threads
+ * are looking up samplers.
  */
 #ifdef AQSIS_SYSTEM_WIN32
 class AQSIS_TEX_SHARE boost::noncopyable_::noncopyable;
@@ -81,26 +92,46 @@ class AQSIS_TEX_SHARE CqTextureCache : public IqTextureCache, private boost::non
 		virtual void setCurrToWorldMatrix(const CqMatrix& currToWorld);
 
 	private:
-		/** \brief Find a sampler in the given map, or create one from file if needed.
+		/// Indices distinguishing the sampler tables in the lookup caches.
+		enum EqSamplerKind
+		{
+			Sampler_Texture,
+			Sampler_Environment,
+			Sampler_Shadow,
+			Sampler_Occlusion
+		};
+
+		/** \brief Find a sampler in the given table, or create one from file if needed.
 		 *
 		 * If the file isn't found, we issue a warning, and a dummy sampler
 		 * should be created instead so that the render can continue.
 		 *
-		 * \param samplerMap - std::map to find the sampler in.
+		 * \param samplerTable - table to find the sampler in.
+		 * \param kind - kind of sampler held in the table.
 		 * \param name - name of the texture.
 		 */
 		template<typename SamplerT>
-		SamplerT& findSampler(std::map<TqUlong, boost::shared_ptr<SamplerT> >&
-				samplerMap, const char* name);
+		SamplerT& findSampler(CqSamplerTable<SamplerT>& samplerTable,
+				EqSamplerKind kind, const char* name);
+		/// Get the lookup cache for the current thread.
+		CqSamplerLookupCache& localLookupCache();
 		/** \brief Retrive a texture file from the cache, or open it from file.
 		 *
 		 * First search for the given file name in the cache.  If it's not
 		 * there, grab the file from disk (note that this may throw an
-		 * XqInvalidFile if it's not found).
+		 * XqInvalidFile if it's not found).  The caller must hold m_mutex.
 		 *
 		 * \param name - file name to open.
 		 */
 		boost::shared_ptr<IqTiledTexInputFile> getTextureFile(const char* name);
+		/** \brief Create a sampler of the given type for a texture name.
+		 *
+		 * The caller must hold m_mutex.
+		 *
+		 * \param name - texture name, to be found on the search path.
+		 */
+		template<typename SamplerT>
+		boost::shared_ptr<SamplerT> newSampler(const char* name);
 		/** \brief Create a sampler of the given type from a file.
 		 *
 		 * SamplerT - is a sampler type to instantiate.
@@ -112,16 +143,25 @@ class AQSIS_TEX_SHARE CqTextureCache : public IqTextureCache, private boost::non
 				const boost::shared_ptr<IqTiledTexInputFile>& file);
 
 		/// Cached textures live in here
-		std::map<TqUlong, boost::shared_ptr<IqTextureSampler> > m_textureCache;
-		std::map<TqUlong, boost::shared_ptr<IqEnvironmentSampler> > m_environmentCache;
-		std::map<TqUlong, boost::shared_ptr<IqShadowSampler> > m_shadowCache;
-		std::map<TqUlong, boost::shared_ptr<IqOcclusionSampler> > m_occlusionCache;
+		CqSamplerTable<IqTextureSampler> m_textureCache;
+		CqSamplerTable<IqEnvironmentSampler> m_environmentCache;
+		CqSamplerTable<IqShadowSampler> m_shadowCache;
+		CqSamplerTable<IqOcclusionSampler> m_occlusionCache;
 		/// Cached texture files live in here:
-		std::map<TqUlong, boost::shared_ptr<IqTiledTexInputFile> > m_texFileCache;
+		CqSamplerTable<IqTiledTexInputFile> m_texFileCache;
 		/// Camera -> world transformation - used for creating shadow maps.
 		CqMatrix m_currToWorld;
 		/// Callback function to obtain the current texture search path.
 		TqSearchPathCallback m_searchPathCallback;
+		/// Incremented by flush() to invalidate the per-thread lookup caches.
+		TqInt m_generation;
+#		ifdef ENABLE_THREADING
+		/// Protects the sampler and file tables.
+		boost::mutex m_mutex;
+		boost::thread_specific_ptr<CqSamplerLookupCache> m_localLookup;
+#		else
+		CqSamplerLookupCache m_lookup;
+#		endif
 };
 
 
@@ -113,6 +113,11 @@ EqImageFileType guessFileType(std::istream& inStream)
 	{
 		return ImageFile_AqsisZfile;
 	}
+	else if( magicNum.size() >= 16
+		&& std::equal(magicNum.begin(), magicNum.begin()+16, "Aqsis DeepShadow") )
+	{
+		return ImageFile_AqsisDeepShadow;
+	}
 	// Add further magic number matches here
 	else
 	{
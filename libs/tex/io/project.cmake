@@ -40,6 +40,7 @@ set(io_test_srcs
 	texfileheader_test.cpp
 	tiffdirhandle_test.cpp
 	tiffinputfile_test.cpp
+	tiffoutputfile_test.cpp
 )
 if(AQSIS_USE_PNG)
 	list(APPEND io_test_srcs pnginputfile_test.cpp)
@@ -186,7 +186,9 @@ void CqTiffOutputFile::writeTiledPixels(const CqMixedImageBuffer& buffer)
 		{
 			const TqInt tileDataLen = min(tileRowStride,
 					rowStride - tileCol*tileRowStride);
-			const TqInt tileDataHeight = min(tileInfo.height, buffer.height() - line);
+			// The buffer may be a band starting partway down the image, so
+			// the rows left are counted from the end of the buffer.
+			const TqInt tileDataHeight = min(tileInfo.height, endLine - line);
 			// Copy parts of the scanlines into the tile buffer.
 			stridedCopy(tileBuf.get(), tileRowStride, srcBuf, rowStride,
 					tileDataHeight, tileDataLen);
@@ -0,0 +1,137 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/** \file
+ *
+ * \brief Unit tests for TIFF output, read back through TIFF input.
+ */
+
+#include "tiffoutputfile.h"
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <algorithm>
+
+#include <aqsis/tex/buffers/texturebuffer.h>
+#include <aqsis/util/tinyformat.h>
+#include "tiffinputfile.h"
+
+namespace {
+
+/// Name of a file in the working directory which is removed in the dtor.
+class CqTempFileName
+{
+	public:
+		CqTempFileName()
+		{
+			for(int i = 0;; ++i)
+			{
+				m_fileName = tfm::format("aqsis_tmpfile_%05d.tif", i);
+				if(!boost::filesystem::exists(m_fileName))
+					break;
+			}
+		}
+		~CqTempFileName()
+		{
+			boost::filesystem::remove(m_fileName);
+		}
+		const std::string& fileName() const
+		{
+			return m_fileName;
+		}
+	private:
+		std::string m_fileName;
+};
+
+/// Fill a buffer with a pattern which differs between all nearby pixels.
+void fillPattern(Aqsis::CqTextureBuffer<TqUint8>& buf, TqInt startLine)
+{
+	TqUint8* data = buf.rawData();
+	for(TqInt y = 0; y < buf.height(); ++y)
+		for(TqInt x = 0; x < buf.width(); ++x)
+			for(TqInt c = 0; c < buf.numChannels(); ++c)
+				*data++ = static_cast<TqUint8>(3*x + 7*(y + startLine) + c);
+}
+
+/** Write an image in bands of the given height to a tiled TIFF file, and
+ * check that it reads back unchanged.
+ */
+void checkBandedTiledWrite(TqInt width, TqInt height, TqInt bandHeight)
+{
+	const TqInt numChannels = 3;
+	CqTempFileName tmpFile;
+	{
+		Aqsis::CqTexFileHeader header;
+		header.setWidth(width);
+		header.setHeight(height);
+		header.channelList() = Aqsis::CqChannelList(Aqsis::Channel_Unsigned8, numChannels);
+		header.set<Aqsis::Attr::TileInfo>(Aqsis::SqTileInfo(32,32));
+		Aqsis::CqTiffOutputFile outFile(tmpFile.fileName(), header);
+		for(TqInt line = 0; line < height; line += bandHeight)
+		{
+			Aqsis::CqTextureBuffer<TqUint8> band(width,
+					std::min(bandHeight, height - line), numChannels);
+			fillPattern(band, line);
+			outFile.writePixels(band);
+		}
+	}
+
+	Aqsis::CqTiffInputFile inFile(tmpFile.fileName());
+	Aqsis::CqTextureBuffer<TqUint8> result;
+	inFile.readPixels(result);
+	BOOST_REQUIRE_EQUAL(result.width(), width);
+	BOOST_REQUIRE_EQUAL(result.height(), height);
+	Aqsis::CqTextureBuffer<TqUint8> expected(width, height, numChannels);
+	fillPattern(expected, 0);
+	const TqInt size = width*height*numChannels;
+	BOOST_CHECK(std::equal(result.rawData(), result.rawData() + size,
+				expected.rawData()));
+}
+
+} // unnamed namespace
+
+BOOST_AUTO_TEST_SUITE(tiffoutputfile_tests)
+
+BOOST_AUTO_TEST_CASE(CqTiffOutputFile_writeTiled_whole_test)
+{
+	checkBandedTiledWrite(40, 100, 100);
+}
+
+BOOST_AUTO_TEST_CASE(CqTiffOutputFile_writeTiled_banded_test)
+{
+	// Bands of one and two tile rows, with partial tiles at the right and
+	// bottom edges.
+	checkBandedTiledWrite(40, 100, 32);
+	checkBandedTiledWrite(40, 100, 64);
+	checkBandedTiledWrite(70, 200, 64);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
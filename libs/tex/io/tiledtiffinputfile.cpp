@@ -39,12 +39,14 @@
 
 #include <boost/scoped_array.hpp>
 
+#include <aqsis/tex/buffers/tilecache.h>
 #include <aqsis/tex/texexception.h>
 
 namespace Aqsis {
 
 CqTiledTiffInputFile::CqTiledTiffInputFile(const boostfs::path& fileName)
 	: m_headers(),
+	m_fileName(fileName),
 	m_fileHandle(new CqTiffFileHandle(fileName, "r")),
 	m_numDirs(m_fileHandle->numDirectories()),
 	m_tileInfo(0,0),
@@ -99,11 +101,17 @@ CqTiledTiffInputFile::CqTiledTiffInputFile(const boostfs::path& fileName)
 		// interface a bit.
 		m_headers.push_back(tmpHeader);
 	}
+	CqTileCache::instance().fileOpened(this);
+}
+
+CqTiledTiffInputFile::~CqTiledTiffInputFile()
+{
+	CqTileCache::instance().fileClosed(this);
 }
 
 boostfs::path CqTiledTiffInputFile::fileName() const
 {
-	return m_fileHandle->fileName();
+	return m_fileName;
 }
 
 EqImageFileType CqTiledTiffInputFile::fileType() const
@@ -124,6 +132,12 @@ SqTileInfo CqTiledTiffInputFile::tileInfo() const
 	return m_tileInfo;
 }
 
+bool CqTiledTiffInputFile::closeHandle() const
+{
+	m_fileHandle.reset();
+	return true;
+}
+
 TqInt CqTiledTiffInputFile::numSubImages() const
 {
 	return m_numDirs;
@@ -144,6 +158,13 @@ TqInt CqTiledTiffInputFile::height(TqInt index) const
 void CqTiledTiffInputFile::readTileImpl(TqUint8* buffer, TqInt x, TqInt y,
 		TqInt subImageIdx, const SqTileInfo tileSize) const
 {
+	if(!m_fileHandle)
+	{
+		m_fileHandle.reset(new CqTiffFileHandle(m_fileName, "r"));
+		CqTileCache::instance().fileOpened(this);
+	}
+	else
+		CqTileCache::instance().fileUsed(this);
 	CqTiffDirHandle dirHandle(m_fileHandle, subImageIdx);
 	if((x+1)*m_tileInfo.width > m_widths[subImageIdx]
 			|| (y+1)*m_tileInfo.height > m_heights[subImageIdx])
@@ -69,11 +69,13 @@ class AQSIS_TEX_SHARE CqTiledTiffInputFile : public IqTiledTexInputFile
 		 * assumptions.
 		 */
 		CqTiledTiffInputFile(const boostfs::path& fileName);
+		virtual ~CqTiledTiffInputFile();
 
 		virtual boostfs::path fileName() const;
 		virtual EqImageFileType fileType() const;
 		virtual const CqTexFileHeader& header(TqInt index = 0) const;
 		virtual SqTileInfo tileInfo() const;
+		virtual bool closeHandle() const;
 
 		virtual TqInt numSubImages() const;
 		virtual TqInt width(TqInt index) const;
@@ -84,8 +86,13 @@ class AQSIS_TEX_SHARE CqTiledTiffInputFile : public IqTiledTexInputFile
 
 		/// Header information
 		std::vector<boost::shared_ptr<CqTexFileHeader> > m_headers;
-		/// Handle to the underlying TIFF structure.
-		boost::shared_ptr<CqTiffFileHandle> m_fileHandle;
+		/// Name of the underlying file.
+		boostfs::path m_fileName;
+		/** Handle to the underlying TIFF structure.  This may be closed by
+		 * the tile cache to limit the number of open files, and is reopened
+		 * on demand.
+		 */
+		mutable boost::shared_ptr<CqTiffFileHandle> m_fileHandle;
 		/// Number of directories in the TIFF file.
 		tdir_t m_numDirs;
 		/// Tile information
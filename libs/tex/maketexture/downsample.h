@@ -40,7 +40,16 @@
 
 #include <aqsis/aqsis.h>
 
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <vector>
+
 #include <boost/shared_ptr.hpp>
+#ifdef ENABLE_THREADING
+#	include <boost/bind.hpp>
+#	include <boost/thread/thread.hpp>
+#endif
 
 #include <aqsis/math/math.h>
 #include "cachedfilter.h"
@@ -115,6 +124,70 @@ template<typename ArrayT>
 boost::shared_ptr<ArrayT> downsample(const ArrayT& srcBuf,
 		const SqFilterInfo& filterInfo, const SqWrapModes& wrapModes);
 
+//------------------------------------------------------------------------------
+/** \brief Downsample an image to the next mipmap size, a band at a time.
+ *
+ * This produces the same result as downsample(), but never holds the whole
+ * source or destination image in memory.  The source is read in bands of
+ * scanlines on demand, and horizontally filtered source rows are kept only
+ * until the last output row which needs them has been computed.  The output
+ * is handed on in bands as it is finished, so peak memory is a few filter
+ * supports worth of rows, rather than the whole image.
+ *
+ * Only seperable filters and wrap modes are supported; check seperable()
+ * before calling downsample(), and fall back to the in-memory version if it
+ * returns false.
+ */
+template<typename ArrayT>
+class CqBandedDownsampler
+{
+	public:
+		/** \brief Set up the filter for a source image of the given size.
+		 *
+		 * \param srcWidth - width of the source image
+		 * \param srcHeight - height of the source image
+		 * \param filterInfo - information about which filter type and size to use
+		 * \param wrapModes - specifies how the texture will be wrapped at the edges.
+		 */
+		CqBandedDownsampler(TqInt srcWidth, TqInt srcHeight,
+				const SqFilterInfo& filterInfo, const SqWrapModes& wrapModes);
+
+		/// Return true if the filter and wrap modes can be used in bands.
+		bool seperable() const;
+		/// Width of the downsampled image.
+		TqInt width() const;
+		/// Height of the downsampled image.
+		TqInt height() const;
+
+		/** \brief Downsample the source image, passing the result to a sink.
+		 *
+		 * SrcT must provide readPixels(ArrayT& buf, TqInt startLine,
+		 * TqInt numScanlines) as IqTexInputFile does.  Source scanlines are
+		 * read in ascending order, apart from a few rows at the opposite edge
+		 * needed for periodic wrapping.
+		 *
+		 * SinkT is a functor taking a const ArrayT& band of output scanlines.
+		 * It's called for consecutive bands from the top of the image; all but
+		 * the last band are bandHeight scanlines high.
+		 *
+		 * \param src - source of the image scanlines
+		 * \param numChannels - number of channels in the image
+		 * \param sink - functor receiving output bands
+		 * \param bandHeight - height of the output bands.  Source bands are
+		 *                     read at twice this height.
+		 */
+		template<typename SrcT, typename SinkT>
+		void downsample(const SrcT& src, TqInt numChannels, SinkT& sink,
+				TqInt bandHeight) const;
+	private:
+		TqInt m_srcWidth;
+		TqInt m_srcHeight;
+		SqWrapModes m_wrapModes;
+		std::vector<TqFloat> m_xWeights;
+		std::vector<TqFloat> m_yWeights;
+		bool m_seperable;
+};
+
 
 
 //==============================================================================
@@ -206,6 +279,284 @@ boost::shared_ptr<ArrayT> downsampleNonseperable(
 	return destBuf;
 }
 
+/** \brief Split a cached filter kernel into horizontal and vertical factors.
+ *
+ * Many filters (box, gaussian, catmull-rom, sinc...) are products of a
+ * function of x and a function of y.  Rather than relying on the filter
+ * name, the cached weights are checked directly: the kernel is separable if
+ * every weight is the product of the weights in its row and column through
+ * the largest weight, up to a small tolerance.
+ *
+ * \param filterWeights - cached filter kernel
+ * \param xWeights - on success, horizontal filter weights
+ * \param yWeights - on success, vertical filter weights
+ * \return true if the kernel is separable.
+ */
+inline bool separateFilter(const CqCachedFilter& filterWeights,
+		std::vector<TqFloat>& xWeights, std::vector<TqFloat>& yWeights)
+{
+	SqFilterSupport support = filterWeights.support();
+	TqInt width = filterWeights.width();
+	TqInt height = filterWeights.height();
+	// Find the largest weight to use as the pivot.
+	TqInt pivotX = 0;
+	TqInt pivotY = 0;
+	TqFloat pivot = 0;
+	for(TqInt j = 0; j < height; ++j)
+	{
+		for(TqInt i = 0; i < width; ++i)
+		{
+			TqFloat w = filterWeights(support.sx.start + i, support.sy.start + j);
+			if(std::fabs(w) > std::fabs(pivot))
+			{
+				pivot = w;
+				pivotX = i;
+				pivotY = j;
+			}
+		}
+	}
+	if(pivot == 0)
+		return false;
+	xWeights.resize(width);
+	yWeights.resize(height);
+	for(TqInt i = 0; i < width; ++i)
+		xWeights[i] = filterWeights(support.sx.start + i, support.sy.start + pivotY) / pivot;
+	for(TqInt j = 0; j < height; ++j)
+		yWeights[j] = filterWeights(support.sx.start + pivotX, support.sy.start + j);
+	// The weights are normalized, and tiny weights were zeroed on
+	// construction, so an absolute tolerance of that size is appropriate.
+	const TqFloat tol = 2e-5f;
+	for(TqInt j = 0; j < height; ++j)
+	{
+		for(TqInt i = 0; i < width; ++i)
+		{
+			if(std::fabs(filterWeights(support.sx.start + i, support.sy.start + j)
+						- xWeights[i]*yWeights[j]) > tol)
+				return false;
+		}
+	}
+	return true;
+}
+
+/** \brief Determine whether the seperable downsampler handles the wrap modes.
+ *
+ * The seperable downsampler wraps each direction independently, which agrees
+ * with filterTexture() except in the corners where a clamped direction meets
+ * a periodic one, and for truncation.  Leave those to the general code.
+ */
+inline bool seperableWrapModes(const SqWrapModes& wrapModes)
+{
+	if(wrapModes.sWrap == WrapMode_Trunc || wrapModes.tWrap == WrapMode_Trunc)
+		return false;
+	return !( (wrapModes.sWrap == WrapMode_Clamp && wrapModes.tWrap == WrapMode_Periodic)
+			|| (wrapModes.sWrap == WrapMode_Periodic && wrapModes.tWrap == WrapMode_Clamp) );
+}
+
+/** \brief Map a pixel coordinate outside [0,size) back into the image.
+ *
+ * \return The wrapped coordinate, or -1 if the pixel is black.
+ */
+inline TqInt wrapCoord(TqInt x, TqInt size, EqWrapMode wrapMode)
+{
+	if(x >= 0 && x < size)
+		return x;
+	switch(wrapMode)
+	{
+		case WrapMode_Periodic:
+			x %= size;
+			return x < 0 ? x + size : x;
+		case WrapMode_Clamp:
+			return clamp(x, 0, size-1);
+		case WrapMode_Black:
+		default:
+			return -1;
+	}
+}
+
+/** \brief Precomputed taps of a 1D filter for each output pixel.
+ *
+ * Wrapping is resolved up front, so the inner loops just walk a list of
+ * (source index, weight) pairs.
+ */
+class CqFilterTaps
+{
+	public:
+		CqFilterTaps(const std::vector<TqFloat>& weights, TqInt srcSize,
+				TqInt destSize, TqInt mipmapRatio, EqWrapMode wrapMode)
+			: m_begin(destSize+1, 0)
+		{
+			TqInt offset = (static_cast<TqInt>(weights.size())-1) / 2;
+			for(TqInt x = 0; x < destSize; ++x)
+			{
+				for(TqInt i = 0, iEnd = weights.size(); i < iEnd; ++i)
+				{
+					TqInt src = wrapCoord(mipmapRatio*x - offset + i, srcSize, wrapMode);
+					// Black pixels and zero weights contribute nothing.
+					if(src >= 0 && weights[i] != 0)
+					{
+						m_index.push_back(src);
+						m_weight.push_back(weights[i]);
+					}
+				}
+				m_begin[x+1] = m_index.size();
+			}
+		}
+		/// Range of taps for output pixel x.
+		TqInt begin(TqInt x) const { return m_begin[x]; }
+		TqInt end(TqInt x) const { return m_begin[x+1]; }
+		TqInt index(TqInt tap) const { return m_index[tap]; }
+		TqFloat weight(TqInt tap) const { return m_weight[tap]; }
+	private:
+		std::vector<TqInt> m_begin;
+		std::vector<TqInt> m_index;
+		std::vector<TqFloat> m_weight;
+};
+
+/// Filter the rows of a source buffer horizontally into a float buffer.
+template<typename ArrayT>
+class CqHorizontalPass
+{
+	public:
+		CqHorizontalPass(const ArrayT& srcBuf, const CqFilterTaps& taps,
+				TqInt destWidth, std::vector<TqFloat>& dest)
+			: m_srcBuf(srcBuf), m_taps(taps), m_destWidth(destWidth), m_dest(dest)
+		{ }
+		void operator()(TqInt yBegin, TqInt yEnd) const
+		{
+			TqInt numChannels = m_srcBuf.numChannels();
+			for(TqInt y = yBegin; y < yEnd; ++y)
+			{
+				TqFloat* out = &m_dest[y*m_destWidth*numChannels];
+				for(TqInt x = 0; x < m_destWidth; ++x, out += numChannels)
+				{
+					std::fill(out, out + numChannels, 0.0f);
+					for(TqInt t = m_taps.begin(x), tEnd = m_taps.end(x); t < tEnd; ++t)
+					{
+						typename ArrayT::TqSampleVector samples
+							= m_srcBuf(m_taps.index(t), y);
+						TqFloat w = m_taps.weight(t);
+						for(TqInt c = 0; c < numChannels; ++c)
+							out[c] += w*samples[c];
+					}
+				}
+			}
+		}
+	private:
+		const ArrayT& m_srcBuf;
+		const CqFilterTaps& m_taps;
+		TqInt m_destWidth;
+		std::vector<TqFloat>& m_dest;
+};
+
+/** \brief Filter the horizontally filtered rows vertically into the output buffer.
+ *
+ * Source rows are looked up through a table of row pointers, so they needn't
+ * be stored contiguously, or even all be present.  Row y of destBuf receives
+ * output row y + yOffset, allowing the output to be produced in bands.
+ */
+template<typename ArrayT>
+class CqVerticalPass
+{
+	public:
+		CqVerticalPass(const std::vector<const TqFloat*>& srcRows,
+				const CqFilterTaps& taps, ArrayT& destBuf, TqInt yOffset = 0)
+			: m_srcRows(srcRows), m_taps(taps), m_destBuf(destBuf),
+			m_yOffset(yOffset)
+		{ }
+		void operator()(TqInt yBegin, TqInt yEnd) const
+		{
+			TqInt width = m_destBuf.width();
+			TqInt numChannels = m_destBuf.numChannels();
+			TqInt rowSize = width*numChannels;
+			std::vector<TqFloat> row(rowSize);
+			for(TqInt y = yBegin; y < yEnd; ++y)
+			{
+				std::fill(row.begin(), row.end(), 0.0f);
+				for(TqInt t = m_taps.begin(y + m_yOffset),
+						tEnd = m_taps.end(y + m_yOffset); t < tEnd; ++t)
+				{
+					const TqFloat* in = m_srcRows[m_taps.index(t)];
+					TqFloat w = m_taps.weight(t);
+					for(TqInt i = 0; i < rowSize; ++i)
+						row[i] += w*in[i];
+				}
+				for(TqInt x = 0; x < width; ++x)
+					m_destBuf.setPixel(x, y, &row[x*numChannels]);
+			}
+		}
+	private:
+		const std::vector<const TqFloat*>& m_srcRows;
+		const CqFilterTaps& m_taps;
+		ArrayT& m_destBuf;
+		TqInt m_yOffset;
+};
+
+/** \brief Run rowFunc over the rows [0,numRows), split between threads.
+ *
+ * rowFunc(begin, end) is called for disjoint blocks of rows, and must be
+ * safe to call concurrently for different blocks.
+ */
+template<typename RowFuncT>
+void forEachRowBlock(TqInt numRows, const RowFuncT& rowFunc)
+{
+#	ifdef ENABLE_THREADING
+	// Don't bother with threads for small images.
+	const TqInt minRowsPerThread = 32;
+	TqInt numThreads = std::min<TqInt>(boost::thread::hardware_concurrency(),
+			numRows/minRowsPerThread);
+	if(numThreads > 1)
+	{
+		boost::thread_group threads;
+		for(TqInt i = 0; i < numThreads; ++i)
+		{
+			threads.create_thread(boost::bind<void>(boost::cref(rowFunc),
+						numRows*i/numThreads, numRows*(i+1)/numThreads));
+		}
+		threads.join_all();
+		return;
+	}
+#	endif
+	rowFunc(0, numRows);
+}
+
+/** \brief Downsample a buffer for mipmapping via a seperable convolution.
+ *
+ * The image is filtered horizontally into a temporary float buffer, then
+ * vertically into the result, giving a cost per pixel proportional to the
+ * filter width rather than its area.  Both passes are split between threads
+ * over rows when threading is enabled.
+ *
+ * \param srcBuf - input texture buffer.
+ * \param mipmapRatio - scale factor for the new file (0.5 for normal mipmapping)
+ * \param xWeights - horizontal filter weights
+ * \param yWeights - vertical filter weights
+ * \param wrapModes - specify how the texture will be wrapped at the edges.
+ */
+template<typename ArrayT>
+boost::shared_ptr<ArrayT> downsampleSeperable(
+		const ArrayT& srcBuf, TqInt mipmapRatio,
+		const std::vector<TqFloat>& xWeights, const std::vector<TqFloat>& yWeights,
+		const SqWrapModes& wrapModes)
+{
+	TqInt newWidth = lceil(TqFloat(srcBuf.width())/mipmapRatio);
+	TqInt newHeight = lceil(TqFloat(srcBuf.height())/mipmapRatio);
+	TqInt numChannels = srcBuf.numChannels();
+	boost::shared_ptr<ArrayT> destBuf(new ArrayT(newWidth, newHeight, numChannels));
+	CqFilterTaps xTaps(xWeights, srcBuf.width(), newWidth, mipmapRatio,
+			wrapModes.sWrap);
+	CqFilterTaps yTaps(yWeights, srcBuf.height(), newHeight, mipmapRatio,
+			wrapModes.tWrap);
+	// Horizontally filtered source rows.
+	std::vector<TqFloat> tmpBuf(newWidth*srcBuf.height()*numChannels);
+	forEachRowBlock(srcBuf.height(),
+			CqHorizontalPass<ArrayT>(srcBuf, xTaps, newWidth, tmpBuf));
+	std::vector<const TqFloat*> rows(srcBuf.height());
+	for(TqInt y = 0, rowSize = newWidth*numChannels; y < srcBuf.height(); ++y)
+		rows[y] = &tmpBuf[y*rowSize];
+	forEachRowBlock(newHeight, CqVerticalPass<ArrayT>(rows, yTaps, *destBuf));
+	return destBuf;
+}
+
 } // namespace detail
 
 
@@ -217,18 +568,130 @@ boost::shared_ptr<ArrayT> downsample(const ArrayT& srcBuf,
 	TqInt mipmapRatio = 2;
 	TqFloat scale = 1.0f/mipmapRatio;
 
-	/// \todo Optimize for seperable filters.  This should also give some idea
-	/// about how to optimize the analogous filtering operations in the core renderer.
-	//
-	// if(FilterFunctorT::isSeperable()) ...
-
-	// General case: Non-seperable filter.
-
 	CqCachedFilter weights(filterInfo, srcBuf.width() % 2 != 0,
 			srcBuf.height() % 2 != 0, scale);
+	std::vector<TqFloat> xWeights;
+	std::vector<TqFloat> yWeights;
+	if(detail::seperableWrapModes(wrapModes)
+			&& detail::separateFilter(weights, xWeights, yWeights))
+	{
+		return detail::downsampleSeperable(srcBuf, mipmapRatio, xWeights,
+				yWeights, wrapModes);
+	}
+	// General case: Non-seperable filter.
 	return detail::downsampleNonseperable(srcBuf, mipmapRatio, weights, wrapModes);
 }
 
+//------------------------------------------------------------------------------
+// CqBandedDownsampler implementation
+template<typename ArrayT>
+CqBandedDownsampler<ArrayT>::CqBandedDownsampler(TqInt srcWidth, TqInt srcHeight,
+		const SqFilterInfo& filterInfo, const SqWrapModes& wrapModes)
+	: m_srcWidth(srcWidth),
+	m_srcHeight(srcHeight),
+	m_wrapModes(wrapModes),
+	m_xWeights(),
+	m_yWeights(),
+	m_seperable(false)
+{
+	// Use exactly the same weights as downsample() so the results agree.
+	CqCachedFilter weights(filterInfo, srcWidth % 2 != 0, srcHeight % 2 != 0, 0.5f);
+	m_seperable = detail::seperableWrapModes(wrapModes)
+		&& detail::separateFilter(weights, m_xWeights, m_yWeights);
+}
+
+template<typename ArrayT>
+inline bool CqBandedDownsampler<ArrayT>::seperable() const
+{
+	return m_seperable;
+}
+
+template<typename ArrayT>
+inline TqInt CqBandedDownsampler<ArrayT>::width() const
+{
+	return lceil(TqFloat(m_srcWidth)/2);
+}
+
+template<typename ArrayT>
+inline TqInt CqBandedDownsampler<ArrayT>::height() const
+{
+	return lceil(TqFloat(m_srcHeight)/2);
+}
+
+template<typename ArrayT>
+template<typename SrcT, typename SinkT>
+void CqBandedDownsampler<ArrayT>::downsample(const SrcT& src,
+		TqInt numChannels, SinkT& sink, TqInt bandHeight) const
+{
+	assert(m_seperable);
+	const TqInt mipmapRatio = 2;
+	TqInt newWidth = width();
+	TqInt newHeight = height();
+	TqInt rowSize = newWidth*numChannels;
+	TqInt srcBandHeight = mipmapRatio*bandHeight;
+	detail::CqFilterTaps xTaps(m_xWeights, m_srcWidth, newWidth, mipmapRatio,
+			m_wrapModes.sWrap);
+	detail::CqFilterTaps yTaps(m_yWeights, m_srcHeight, newHeight, mipmapRatio,
+			m_wrapModes.tWrap);
+	// The last output row needing each source row, or -1 if none do.
+	std::vector<TqInt> lastUse(m_srcHeight, -1);
+	for(TqInt y = 0; y < newHeight; ++y)
+		for(TqInt t = yTaps.begin(y), tEnd = yTaps.end(y); t < tEnd; ++t)
+			lastUse[yTaps.index(t)] = y;
+	// Horizontally filtered source rows currently held, and pointers to them
+	// indexed by source row for the vertical pass.
+	std::map<TqInt, std::vector<TqFloat> > cachedRows;
+	std::vector<const TqFloat*> rowPtrs(m_srcHeight, static_cast<const TqFloat*>(0));
+	ArrayT srcBand;
+	std::vector<TqFloat> filteredBand;
+	ArrayT destBand;
+	for(TqInt yBegin = 0; yBegin < newHeight; yBegin += bandHeight)
+	{
+		TqInt yEnd = std::min(yBegin + bandHeight, newHeight);
+		// Read in any source rows needed by this band which we don't have.
+		for(TqInt y = yBegin; y < yEnd; ++y)
+		{
+			for(TqInt t = yTaps.begin(y), tEnd = yTaps.end(y); t < tEnd; ++t)
+			{
+				TqInt srcRow = yTaps.index(t);
+				if(rowPtrs[srcRow])
+					continue;
+				TqInt numRows = std::min(srcBandHeight, m_srcHeight - srcRow);
+				src.readPixels(srcBand, srcRow, numRows);
+				filteredBand.resize(numRows*rowSize);
+				detail::forEachRowBlock(numRows, detail::CqHorizontalPass<ArrayT>(
+							srcBand, xTaps, newWidth, filteredBand));
+				for(TqInt i = 0; i < numRows; ++i)
+				{
+					TqInt r = srcRow + i;
+					if(rowPtrs[r] || lastUse[r] < yBegin)
+						continue;
+					std::vector<TqFloat>& row = cachedRows[r];
+					row.assign(filteredBand.begin() + i*rowSize,
+							filteredBand.begin() + (i+1)*rowSize);
+					rowPtrs[r] = &row[0];
+				}
+			}
+		}
+		destBand.resize(newWidth, yEnd - yBegin, numChannels);
+		detail::forEachRowBlock(yEnd - yBegin, detail::CqVerticalPass<ArrayT>(
+					rowPtrs, yTaps, destBand, yBegin));
+		sink(destBand);
+		// Drop rows which no later band needs.
+		for(std::map<TqInt, std::vector<TqFloat> >::iterator i = cachedRows.begin();
+				i != cachedRows.end();)
+		{
+			if(lastUse[i->first] < yEnd)
+			{
+				rowPtrs[i->first] = 0;
+				cachedRows.erase(i++);
+			}
+			else
+				++i;
+		}
+	}
+}
+
 } // namespace Aqsis
 
 #endif // DOWNSAMPLE_H_INCLUDED
@@ -0,0 +1,266 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/** \file
+ *
+ * \brief Unit tests for mipmap downsampling
+ */
+
+#include "downsample.h"
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+using namespace Aqsis;
+
+namespace {
+
+RtFloat boxFilter(RtFloat x, RtFloat y, RtFloat xwidth, RtFloat ywidth)
+{
+	return 1;
+}
+
+RtFloat gaussianFilter(RtFloat x, RtFloat y, RtFloat xwidth, RtFloat ywidth)
+{
+	x *= 2.0f/xwidth;
+	y *= 2.0f/ywidth;
+	return std::exp(-2*(x*x + y*y));
+}
+
+RtFloat sincFilter(RtFloat x, RtFloat y, RtFloat xwidth, RtFloat ywidth)
+{
+	x *= M_PI;
+	y *= M_PI;
+	return (x == 0 ? 1 : std::sin(x)/x) * (y == 0 ? 1 : std::sin(y)/y);
+}
+
+RtFloat diskFilter(RtFloat x, RtFloat y, RtFloat xwidth, RtFloat ywidth)
+{
+	x *= 2.0f/xwidth;
+	y *= 2.0f/ywidth;
+	return std::max(0.0f, 1 - std::sqrt(x*x + y*y));
+}
+
+template<typename T>
+CqTextureBuffer<T> randomBuffer(TqInt width, TqInt height, TqInt numChannels)
+{
+	CqTextureBuffer<T> buf(width, height, numChannels);
+	std::vector<TqFloat> pixel(numChannels);
+	std::srand(42);
+	for(TqInt y = 0; y < height; ++y)
+	{
+		for(TqInt x = 0; x < width; ++x)
+		{
+			for(TqInt c = 0; c < numChannels; ++c)
+				pixel[c] = TqFloat(std::rand())/RAND_MAX;
+			buf.setPixel(x, y, &pixel[0]);
+		}
+	}
+	return buf;
+}
+
+/// Check that the fast path of downsample() agrees with the general one.
+template<typename T>
+void checkDownsampleEquivalent(const CqTextureBuffer<T>& srcBuf,
+		const SqFilterInfo& filterInfo, const SqWrapModes& wrapModes,
+		TqFloat tol)
+{
+	CqCachedFilter weights(filterInfo, srcBuf.width() % 2 != 0,
+			srcBuf.height() % 2 != 0, 0.5f);
+	boost::shared_ptr<CqTextureBuffer<T> > expected
+		= detail::downsampleNonseperable(srcBuf, 2, weights, wrapModes);
+	boost::shared_ptr<CqTextureBuffer<T> > result
+		= downsample(srcBuf, filterInfo, wrapModes);
+	BOOST_REQUIRE_EQUAL(result->width(), expected->width());
+	BOOST_REQUIRE_EQUAL(result->height(), expected->height());
+	TqFloat maxDiff = 0;
+	for(TqInt y = 0; y < result->height(); ++y)
+		for(TqInt x = 0; x < result->width(); ++x)
+			for(TqInt c = 0; c < result->numChannels(); ++c)
+				maxDiff = std::max(maxDiff, std::fabs((*result)(x,y)[c]
+							- (*expected)(x,y)[c]));
+	BOOST_CHECK_SMALL(maxDiff, tol);
+}
+
+/// Texture source reading bands of scanlines from a buffer, counting reads.
+template<typename T>
+class CqBufferSource
+{
+	public:
+		CqBufferSource(const CqTextureBuffer<T>& buf)
+			: m_buf(buf), m_rowsRead(0)
+		{ }
+		void readPixels(CqTextureBuffer<T>& band, TqInt startLine,
+				TqInt numScanlines) const
+		{
+			BOOST_REQUIRE(startLine >= 0);
+			BOOST_REQUIRE(startLine + numScanlines <= m_buf.height());
+			band.resize(m_buf.width(), numScanlines, m_buf.numChannels());
+			TqInt rowBytes = m_buf.width()*m_buf.numChannels()*sizeof(T);
+			std::memcpy(band.rawData(), m_buf.rawData() + startLine*rowBytes,
+					numScanlines*rowBytes);
+			m_rowsRead += numScanlines;
+		}
+		TqInt rowsRead() const { return m_rowsRead; }
+	private:
+		const CqTextureBuffer<T>& m_buf;
+		mutable TqInt m_rowsRead;
+};
+
+/// Sink collecting output bands into a single buffer.
+template<typename T>
+struct SqBandCollector
+{
+	CqTextureBuffer<T> result;
+	TqInt nextRow;
+	TqInt bandHeight;
+	bool bandsOk;
+	SqBandCollector(TqInt width, TqInt height, TqInt numChannels, TqInt bandHeight)
+		: result(width, height, numChannels), nextRow(0),
+		bandHeight(bandHeight), bandsOk(true)
+	{ }
+	void operator()(const CqTextureBuffer<T>& band)
+	{
+		if(band.height() != bandHeight && nextRow + band.height() != result.height())
+			bandsOk = false;
+		TqInt rowBytes = band.width()*band.numChannels()*sizeof(T);
+		std::memcpy(result.rawData() + nextRow*rowBytes, band.rawData(),
+				band.height()*rowBytes);
+		nextRow += band.height();
+	}
+};
+
+/// Check that banded downsampling gives exactly the result of downsample().
+template<typename T>
+void checkBandedEquivalent(const CqTextureBuffer<T>& srcBuf,
+		const SqFilterInfo& filterInfo, const SqWrapModes& wrapModes,
+		TqInt bandHeight)
+{
+	boost::shared_ptr<CqTextureBuffer<T> > expected
+		= downsample(srcBuf, filterInfo, wrapModes);
+	CqBandedDownsampler<CqTextureBuffer<T> > downsampler(srcBuf.width(),
+			srcBuf.height(), filterInfo, wrapModes);
+	BOOST_REQUIRE(downsampler.seperable());
+	BOOST_REQUIRE_EQUAL(downsampler.width(), expected->width());
+	BOOST_REQUIRE_EQUAL(downsampler.height(), expected->height());
+	CqBufferSource<T> src(srcBuf);
+	SqBandCollector<T> sink(downsampler.width(), downsampler.height(),
+			srcBuf.numChannels(), bandHeight);
+	downsampler.downsample(src, srcBuf.numChannels(), sink, bandHeight);
+	BOOST_CHECK_EQUAL(sink.nextRow, expected->height());
+	BOOST_CHECK(sink.bandsOk);
+	// Each source row should be read about once, plus the edge rows for
+	// periodic wrapping.
+	BOOST_CHECK(src.rowsRead() <= srcBuf.height() + 2*bandHeight + 8);
+	TqInt mismatches = 0;
+	for(TqInt y = 0; y < expected->height(); ++y)
+		for(TqInt x = 0; x < expected->width(); ++x)
+			for(TqInt c = 0; c < expected->numChannels(); ++c)
+				if(sink.result(x,y)[c] != (*expected)(x,y)[c])
+					++mismatches;
+	BOOST_CHECK_EQUAL(mismatches, 0);
+}
+
+} // unnamed namespace
+
+BOOST_AUTO_TEST_SUITE(downsample_tests)
+
+BOOST_AUTO_TEST_CASE(separateFilter_test)
+{
+	std::vector<TqFloat> xWeights, yWeights;
+	CqCachedFilter gaussian(SqFilterInfo(gaussianFilter, 4, 2), true, false, 0.5f);
+	BOOST_CHECK(detail::separateFilter(gaussian, xWeights, yWeights));
+	BOOST_CHECK_EQUAL(static_cast<TqInt>(xWeights.size()), gaussian.width());
+	BOOST_CHECK_EQUAL(static_cast<TqInt>(yWeights.size()), gaussian.height());
+	CqCachedFilter disk(SqFilterInfo(diskFilter, 4, 4), false, false, 0.5f);
+	BOOST_CHECK(!detail::separateFilter(disk, xWeights, yWeights));
+}
+
+BOOST_AUTO_TEST_CASE(downsample_separable_equivalence_test)
+{
+	// Odd and even sizes, with enough rows to be split between threads.
+	CqTextureBuffer<TqFloat> floatBuf = randomBuffer<TqFloat>(67, 130, 3);
+	CqTextureBuffer<TqUint8> byteBuf = randomBuffer<TqUint8>(130, 67, 4);
+	RtFilterFunc filters[] = {boxFilter, gaussianFilter, sincFilter};
+	TqFloat widths[] = {2, 3, 4};
+	EqWrapMode modes[] = {WrapMode_Black, WrapMode_Periodic, WrapMode_Clamp};
+	for(TqInt f = 0; f < 3; ++f)
+	{
+		for(TqInt m = 0; m < 3; ++m)
+		{
+			SqFilterInfo filterInfo(filters[f], widths[f], widths[f]);
+			SqWrapModes wrapModes(modes[m], modes[m]);
+			checkDownsampleEquivalent(floatBuf, filterInfo, wrapModes, 1e-4f);
+			// Rounding to 8 bits may differ by one step.
+			checkDownsampleEquivalent(byteBuf, filterInfo, wrapModes, 1.01f/255);
+		}
+	}
+	checkDownsampleEquivalent(floatBuf, SqFilterInfo(gaussianFilter, 2, 2),
+			SqWrapModes(WrapMode_Black, WrapMode_Clamp), 1e-4f);
+}
+
+BOOST_AUTO_TEST_CASE(CqBandedDownsampler_equivalence_test)
+{
+	CqTextureBuffer<TqFloat> floatBuf = randomBuffer<TqFloat>(67, 130, 3);
+	CqTextureBuffer<TqUint16> shortBuf = randomBuffer<TqUint16>(40, 97, 2);
+	RtFilterFunc filters[] = {boxFilter, gaussianFilter, sincFilter};
+	TqFloat widths[] = {2, 3, 6};
+	EqWrapMode modes[] = {WrapMode_Black, WrapMode_Periodic, WrapMode_Clamp};
+	TqInt bandHeights[] = {1, 7, 32, 200};
+	for(TqInt f = 0; f < 3; ++f)
+	{
+		for(TqInt m = 0; m < 3; ++m)
+		{
+			SqFilterInfo filterInfo(filters[f], widths[f], widths[f]);
+			SqWrapModes wrapModes(modes[m], modes[m]);
+			for(TqInt b = 0; b < 4; ++b)
+			{
+				checkBandedEquivalent(floatBuf, filterInfo, wrapModes, bandHeights[b]);
+				checkBandedEquivalent(shortBuf, filterInfo, wrapModes, bandHeights[b]);
+			}
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(CqBandedDownsampler_nonseperable_test)
+{
+	CqBandedDownsampler<CqTextureBuffer<TqFloat> > disk(64, 64,
+			SqFilterInfo(diskFilter, 4, 4), SqWrapModes(WrapMode_Black, WrapMode_Black));
+	BOOST_CHECK(!disk.seperable());
+	CqBandedDownsampler<CqTextureBuffer<TqFloat> > trunc(64, 64,
+			SqFilterInfo(boxFilter, 2, 2), SqWrapModes(WrapMode_Trunc, WrapMode_Trunc));
+	BOOST_CHECK(!trunc.seperable());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
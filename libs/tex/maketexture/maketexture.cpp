@@ -38,7 +38,11 @@
 #include <aqsis/tex/maketexture.h>
 
 #include <algorithm>
+#include <sstream>
 
+#include <boost/filesystem/operations.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 
 #include <aqsis/math/math.h>
@@ -61,21 +65,31 @@ namespace {
 // Helper functions and classes
 //------------------------------------------------------------------------------
 
-/** \brief Downsample the provided buffer into the given output file.
+/// Default limit in megabytes on the image size which is mipmapped in memory.
+const TqFloat defaultMemoryLimitMb = 512;
+
+/** \brief Number of scanlines per band when streaming images.
  *
- * \param buf - Pointer to source data.  This smart pointer is reset to save
- *              memory during the mipmapping process, so make sure a copy of it
- *              is kept elsewhere if desired.
+ * Tiled output must be written in multiples of the tile height, which is set
+ * to 32 in fillOutputHeader().
+ */
+const TqInt streamBandHeight = 64;
+
+/** \brief Write the mipmap levels below the provided buffer to an output file.
+ *
+ * \param buf - Pointer to source data, which should already have been written
+ *              to outFile.  This smart pointer is reset to save memory during
+ *              the mipmapping process, so make sure a copy of it is kept
+ *              elsewhere if desired.
  * \param outFile - output file for the mipmapped data
  * \param filterInfo - information about which filter type and size to use
  * \param wrapModes - specifies how the texture will be wrapped at the edges.
  */
 template<typename ChannelT>
-void downsampleToFile(boost::shared_ptr<CqTextureBuffer<ChannelT> >& buf,
+void writeDownsampledLevels(boost::shared_ptr<CqTextureBuffer<ChannelT> >& buf,
 		IqMultiTexOutputFile& outFile, const SqFilterInfo& filterInfo,
 		const SqWrapModes wrapModes)
 {
-	outFile.writePixels(*buf);
 	typedef CqDownsampleIterator<CqTextureBuffer<ChannelT> > TqDownsampleIter;
 	for(TqDownsampleIter i = ++TqDownsampleIter(buf, filterInfo, wrapModes),
 			end = TqDownsampleIter(); i != end; ++i)
@@ -86,31 +100,275 @@ void downsampleToFile(boost::shared_ptr<CqTextureBuffer<ChannelT> >& buf,
 	}
 }
 
+/** \brief Downsample the provided buffer into the given output file.
+ *
+ * \param buf - Pointer to source data.  This smart pointer is reset to save
+ *              memory during the mipmapping process, so make sure a copy of it
+ *              is kept elsewhere if desired.
+ * \param outFile - output file for the mipmapped data
+ * \param filterInfo - information about which filter type and size to use
+ * \param wrapModes - specifies how the texture will be wrapped at the edges.
+ */
+template<typename ChannelT>
+void downsampleToFile(boost::shared_ptr<CqTextureBuffer<ChannelT> >& buf,
+		IqMultiTexOutputFile& outFile, const SqFilterInfo& filterInfo,
+		const SqWrapModes wrapModes)
+{
+	outFile.writePixels(*buf);
+	writeDownsampledLevels(buf, outFile, filterInfo, wrapModes);
+}
+
+/** Copy pixels of one texture buffer onto part of another.
+ */
+template<typename ChannelT>
+void copyPixels(const CqTextureBuffer<ChannelT>& src, TqInt topLeftX, TqInt topLeftY,
+		CqTextureBuffer<ChannelT>& dest)
+{
+	assert(topLeftX >= 0);
+	assert(topLeftY >= 0);
+	assert(topLeftX + src.width() <= dest.width());
+	assert(topLeftY + src.height() <= dest.height());
+	assert(src.numChannels() == dest.numChannels());
+
+	TqInt srcHeight = src.height();
+	TqInt bytesPerPixel = src.numChannels()*sizeof(ChannelT);
+	TqInt srcRowStride = src.width()*bytesPerPixel;
+	TqInt destRowStride = dest.width()*bytesPerPixel;
+
+	const TqUint8* rawSrc = src.rawData();
+	TqUint8* rawDest = dest.rawData() + destRowStride*topLeftY + topLeftX*bytesPerPixel;
+
+	for(int i = 0; i < srcHeight; ++i)
+	{
+		std::copy(rawSrc, rawSrc+srcRowStride, rawDest);
+		rawDest += destRowStride;
+		rawSrc += srcRowStride;
+	}
+}
+
+/// Remove a temporary file on destruction.
+class CqTempFileRemover : boost::noncopyable
+{
+	public:
+		CqTempFileRemover(const boostfs::path& fileName)
+			: m_fileName(fileName)
+		{ }
+		~CqTempFileRemover()
+		{
+			try
+			{
+				boostfs::remove(m_fileName);
+			}
+			catch(const std::exception& e)
+			{
+				Aqsis::log() << warning << "Could not remove temporary file "
+					<< m_fileName << ": " << e.what() << "\n";
+			}
+		}
+	private:
+		boostfs::path m_fileName;
+};
+
+/** \brief Sink for bands of a streamed mipmap level.
+ *
+ * Each band is written to the mipmap file, and also saved for computing the
+ * next level, either in a temporary file or in memory.
+ */
+template<typename ChannelT>
+class CqMipLevelSink
+{
+	public:
+		CqMipLevelSink(IqMultiTexOutputFile& outFile, IqTexOutputFile* levelFile,
+				CqTextureBuffer<ChannelT>* levelBuf)
+			: m_outFile(outFile),
+			m_levelFile(levelFile),
+			m_levelBuf(levelBuf),
+			m_nextRow(0)
+		{ }
+		void operator()(const CqTextureBuffer<ChannelT>& band)
+		{
+			m_outFile.writePixels(band);
+			if(m_levelFile)
+				m_levelFile->writePixels(band);
+			else
+				copyPixels(band, 0, m_nextRow, *m_levelBuf);
+			m_nextRow += band.height();
+		}
+	private:
+		IqMultiTexOutputFile& m_outFile;
+		IqTexOutputFile* m_levelFile;
+		CqTextureBuffer<ChannelT>* m_levelBuf;
+		TqInt m_nextRow;
+};
+
+/** \brief Create a mipmap from a texture source too large to hold in memory.
+ *
+ * The source is read in bands of scanlines and copied to the top mipmap
+ * level.  Each following level is then computed in bands from the previous
+ * one with CqBandedDownsampler, so only a few bands of each level are ever
+ * in memory.  Levels which are too large for memory are written to a
+ * temporary file next to the output, which is read back to compute the next
+ * level.  Once a level fits in memory, the rest are computed as usual.
+ *
+ * \param texSrc - texture source, providing readPixels(buf, startLine,
+ *                 numScanlines) as IqTexInputFile does.
+ * \param width - width of the source image
+ * \param height - height of the source image
+ * \param numChannels - number of channels in the source image
+ * \param outFile - output file into which texture data will be placed.
+ * \param filterInfo - information about which filter type and size to use
+ * \param wrapModes - specifies how the texture will be wrapped at the edges.
+ * \param memoryLimit - size in bytes of the largest level to hold in memory.
+ */
+template<typename ChannelT, typename TexSrcT>
+void createMipmapStreamed(const TexSrcT& texSrc, TqInt width, TqInt height,
+		TqInt numChannels, IqMultiTexOutputFile& outFile,
+		const SqFilterInfo& filterInfo, const SqWrapModes& wrapModes,
+		std::size_t memoryLimit)
+{
+	typedef CqTextureBuffer<ChannelT> TqBuffer;
+	{
+		TqBuffer band;
+		for(TqInt y = 0; y < height; y += streamBandHeight)
+		{
+			texSrc.readPixels(band, y, std::min(streamBandHeight, height - y));
+			outFile.writePixels(band);
+		}
+	}
+	// Previous level, when held in a temporary file.  The remover is declared
+	// first so that the file is closed before it's removed.
+	boost::scoped_ptr<CqTempFileRemover> levelInRemover;
+	boost::shared_ptr<IqTexInputFile> levelIn;
+	for(TqInt level = 1; width > 1 || height > 1; ++level)
+	{
+		CqBandedDownsampler<TqBuffer> downsampler(width, height, filterInfo,
+				wrapModes);
+		if(!downsampler.seperable())
+		{
+			Aqsis::log() << warning << "Filter or wrap modes can't be used for "
+				"streamed mipmapping; reading " << width << "x" << height
+				<< " mipmap level into memory for " << outFile.fileName() << "\n";
+			boost::shared_ptr<TqBuffer> buf(new TqBuffer());
+			if(levelIn)
+				levelIn->readPixels(*buf);
+			else
+				texSrc.readPixels(*buf, 0, height);
+			writeDownsampledLevels(buf, outFile, filterInfo, wrapModes);
+			return;
+		}
+		TqInt newWidth = downsampler.width();
+		TqInt newHeight = downsampler.height();
+		outFile.newSubImage(newWidth, newHeight);
+		if(static_cast<std::size_t>(newWidth)*newHeight*numChannels*sizeof(ChannelT)
+				<= memoryLimit)
+		{
+			// Small enough to finish off in memory.
+			boost::shared_ptr<TqBuffer> buf(new TqBuffer(newWidth, newHeight,
+						numChannels));
+			CqMipLevelSink<ChannelT> sink(outFile, 0, buf.get());
+			if(levelIn)
+				downsampler.downsample(*levelIn, numChannels, sink, streamBandHeight);
+			else
+				downsampler.downsample(texSrc, numChannels, sink, streamBandHeight);
+			writeDownsampledLevels(buf, outFile, filterInfo, wrapModes);
+			return;
+		}
+		std::ostringstream levelName;
+		levelName << outFile.fileName().string() << ".level" << level << ".tmp";
+		boost::scoped_ptr<CqTempFileRemover> remover(
+				new CqTempFileRemover(levelName.str()));
+		{
+			CqTexFileHeader levelHeader = outFile.header();
+			levelHeader.setWidth(newWidth);
+			levelHeader.setHeight(newHeight);
+			levelHeader.erase<Attr::TileInfo>();
+			levelHeader.set<Attr::Compression>("none");
+			boost::shared_ptr<IqTexOutputFile> levelOut = IqTexOutputFile::open(
+					levelName.str(), ImageFile_Tiff, levelHeader);
+			CqMipLevelSink<ChannelT> sink(outFile, levelOut.get(), 0);
+			if(levelIn)
+				downsampler.downsample(*levelIn, numChannels, sink, streamBandHeight);
+			else
+				downsampler.downsample(texSrc, numChannels, sink, streamBandHeight);
+		}
+		levelIn = IqTexInputFile::open(levelName.str());
+		// The old level file is removed when remover goes out of scope.
+		levelInRemover.swap(remover);
+		width = newWidth;
+		height = newHeight;
+	}
+}
+
 /** \brief Create a mipmap from pixel data in the given input file.
  *
- * ChannelT is the pixel component type.
+ * ChannelT is the pixel component type.  Images larger than memoryLimit are
+ * streamed through createMipmapStreamed() rather than read into memory.
  *
  * \param inFile - input file from which the data should be read
  * \param outFile - name of output file for the mipmapped data
  * \param filterInfo - information about which filter type and size to use
  * \param wrapModes - specifies how the texture will be wrapped at the edges.
+ * \param memoryLimit - size in bytes of the largest image to mipmap in memory
  */
 template<typename TexSrcT, typename ChannelT>
 void createMipmapTyped(const TexSrcT& texSrc, IqMultiTexOutputFile& outFile,
-		const SqFilterInfo& filterInfo, const SqWrapModes wrapModes)
+		const SqFilterInfo& filterInfo, const SqWrapModes wrapModes,
+		std::size_t memoryLimit)
 {
+	const CqTexFileHeader& header = outFile.header();
+	TqInt numChannels = header.channelList().numChannels();
+	if(static_cast<std::size_t>(header.width())*header.height()*numChannels
+			*sizeof(ChannelT) > memoryLimit)
+	{
+		createMipmapStreamed<ChannelT>(texSrc, header.width(), header.height(),
+				numChannels, outFile, filterInfo, wrapModes, memoryLimit);
+		return;
+	}
 	// Read pixels into the input buffer.
 	boost::shared_ptr<CqTextureBuffer<ChannelT> > buf(new CqTextureBuffer<ChannelT>());
 	texSrc.readPixels(*buf);
 	downsampleToFile(buf, outFile, filterInfo, wrapModes);
 }
 
+#ifdef USE_OPENEXR
+/// Texture source converting half data to 32-bit floating point as it's read.
+template<typename TexSrcT>
+class CqHalfToFloatSource
+{
+	public:
+		CqHalfToFloatSource(const TexSrcT& texSrc)
+			: m_texSrc(texSrc)
+		{ }
+		void readPixels(CqTextureBuffer<TqFloat>& buf, TqInt startLine,
+				TqInt numScanlines) const
+		{
+			CqTextureBuffer<half> halfBuf;
+			m_texSrc.readPixels(halfBuf, startLine, numScanlines);
+			buf = halfBuf;
+		}
+	private:
+		const TexSrcT& m_texSrc;
+};
+#endif
+
 /// Specialization for OpenEXR half data format (TIFF can't handle half data)
 template<typename TexSrcT>
 void createMipmapTypedHalf(const TexSrcT& texSrc, IqMultiTexOutputFile& outFile,
-		const SqFilterInfo& filterInfo, const SqWrapModes wrapModes)
+		const SqFilterInfo& filterInfo, const SqWrapModes wrapModes,
+		std::size_t memoryLimit)
 {
 #	ifdef USE_OPENEXR
+	// The output header has already been switched to float data.
+	const CqTexFileHeader& header = outFile.header();
+	TqInt numChannels = header.channelList().numChannels();
+	if(static_cast<std::size_t>(header.width())*header.height()*numChannels
+			*sizeof(TqFloat) > memoryLimit)
+	{
+		createMipmapStreamed<TqFloat>(CqHalfToFloatSource<TexSrcT>(texSrc),
+				header.width(), header.height(), numChannels, outFile,
+				filterInfo, wrapModes, memoryLimit);
+		return;
+	}
 	// Read pixels into the input buffer and convert to 32-bit floating point
 	// since TIFF can't the half data type.
 	CqTextureBuffer<half> halfBuf;
@@ -125,46 +383,57 @@ void createMipmapTypedHalf(const TexSrcT& texSrc, IqMultiTexOutputFile& outFile,
 
 /** \brief Create a mipmap given a texture source and save it to a file.
  *
- * \param texSrc - a "texture source" class.  Needs one method, readPixels().
+ * \param texSrc - a "texture source" class.  Needs readPixels(buf) to read
+ *                 the whole image, and readPixels(buf, startLine,
+ *                 numScanlines) to read a band of scanlines.
  *                 IqTexInputFile is a model of this type.
  * \param chanType - texture channel type of input.
  * \param outFile - output file into which texture data will be placed.
  * \param filterInfo - information about mipmap downsampling filter type and size
  * \param wrapModes - specify how texture will be wrapped at edges during
  *            downsampling.
+ * \param memoryLimit - size in bytes of the largest image to mipmap in memory
  */
 template<typename TexSrcT>
 void createMipmap(const TexSrcT& texSrc, const EqChannelType chanType,
 		IqMultiTexOutputFile& outFile, const SqFilterInfo& filterInfo,
-		const SqWrapModes& wrapModes)
+		const SqWrapModes& wrapModes, std::size_t memoryLimit)
 {
 	// Dispatche to mipmapping function based on the type of the input
 	// texture data.
 	switch(chanType)
 	{
 		case Channel_Float32:
-			createMipmapTyped<TexSrcT,TqFloat>(texSrc, outFile, filterInfo, wrapModes);
+			createMipmapTyped<TexSrcT,TqFloat>(texSrc, outFile, filterInfo, wrapModes,
+					memoryLimit);
 			break;
 		case Channel_Unsigned32:
-			createMipmapTyped<TexSrcT,TqUint32>(texSrc, outFile, filterInfo, wrapModes);
+			createMipmapTyped<TexSrcT,TqUint32>(texSrc, outFile, filterInfo, wrapModes,
+					memoryLimit);
 			break;
 		case Channel_Signed32:
-			createMipmapTyped<TexSrcT,TqInt32>(texSrc, outFile, filterInfo, wrapModes);
+			createMipmapTyped<TexSrcT,TqInt32>(texSrc, outFile, filterInfo, wrapModes,
+					memoryLimit);
 			break;
 		case Channel_Unsigned16:
-			createMipmapTyped<TexSrcT,TqUint16>(texSrc, outFile, filterInfo, wrapModes);
+			createMipmapTyped<TexSrcT,TqUint16>(texSrc, outFile, filterInfo, wrapModes,
+					memoryLimit);
 			break;
 		case Channel_Signed16:
-			createMipmapTyped<TexSrcT,TqInt16>(texSrc, outFile, filterInfo, wrapModes);
+			createMipmapTyped<TexSrcT,TqInt16>(texSrc, outFile, filterInfo, wrapModes,
+					memoryLimit);
 			break;
 		case Channel_Unsigned8:
-			createMipmapTyped<TexSrcT,TqUint8>(texSrc, outFile, filterInfo, wrapModes);
+			createMipmapTyped<TexSrcT,TqUint8>(texSrc, outFile, filterInfo, wrapModes,
+					memoryLimit);
 			break;
 		case Channel_Signed8:
-			createMipmapTyped<TexSrcT,TqInt8>(texSrc, outFile, filterInfo, wrapModes);
+			createMipmapTyped<TexSrcT,TqInt8>(texSrc, outFile, filterInfo, wrapModes,
+					memoryLimit);
 			break;
 		case Channel_Float16:
-			createMipmapTypedHalf(texSrc, outFile, filterInfo, wrapModes);
+			createMipmapTypedHalf(texSrc, outFile, filterInfo, wrapModes,
+					memoryLimit);
 			break;
 		default:
 			AQSIS_THROW_XQERROR(XqBadTexture, EqE_Limit,
@@ -172,34 +441,6 @@ void createMipmap(const TexSrcT& texSrc, const EqChannelType chanType,
 	}
 }
 
-/** Copy pixels of one texture buffer onto part of another.
- */
-template<typename ChannelT>
-void copyPixels(const CqTextureBuffer<ChannelT>& src, TqInt topLeftX, TqInt topLeftY,
-		CqTextureBuffer<ChannelT>& dest)
-{
-	assert(topLeftX >= 0);
-	assert(topLeftY >= 0);
-	assert(topLeftX + src.width() <= dest.width());
-	assert(topLeftY + src.height() <= dest.height());
-	assert(src.numChannels() == dest.numChannels());
-
-	TqInt srcHeight = src.height();
-	TqInt bytesPerPixel = src.numChannels()*sizeof(ChannelT);
-	TqInt srcRowStride = src.width()*bytesPerPixel;
-	TqInt destRowStride = dest.width()*bytesPerPixel;
-
-	const TqUint8* rawSrc = src.rawData();
-	TqUint8* rawDest = dest.rawData() + destRowStride*topLeftY + topLeftX*bytesPerPixel;
-
-	for(int i = 0; i < srcHeight; ++i)
-	{
-		std::copy(rawSrc, rawSrc+srcRowStride, rawDest);
-		rawDest += destRowStride;
-		rawSrc += srcRowStride;
-	}
-}
-
 /** \brief Source class for concatenated cube face environment textures
  *
  * This class is a proxy for a texture input file.  We need it because it's
@@ -253,6 +494,42 @@ class CqCubeFaceTextureSource
 			m_pz.readPixels(tmpBuf); copyPixels(tmpBuf, 2*faceWidth, 0, buf);
 			m_nz.readPixels(tmpBuf); copyPixels(tmpBuf, 2*faceWidth, faceHeight, buf);
 		}
+		/** \brief Read a band of scanlines of the concatenated faces into buf.
+		 *
+		 * \param buf - output buffer for pixel data.
+		 * \param startLine - first scanline of the concatenated image to read
+		 * \param numScanlines - number of scanlines to read.
+		 */
+		template<typename ChannelT>
+		void readPixels(CqTextureBuffer<ChannelT>& buf, TqInt startLine,
+				TqInt numScanlines) const
+		{
+			TqInt faceWidth = m_px.header().width();
+			TqInt faceHeight = m_px.header().height();
+			TqInt numChans = m_px.header().channelList().numChannels();
+			buf.resize(faceWidth*3, numScanlines, numChans);
+			CqTextureBuffer<ChannelT> tmpBuf;
+			TqInt endLine = startLine + numScanlines;
+			// Part of the band in the top row of faces
+			if(startLine < faceHeight)
+			{
+				TqInt n = std::min(endLine, faceHeight) - startLine;
+				m_px.readPixels(tmpBuf, startLine, n); copyPixels(tmpBuf, 0, 0, buf);
+				m_py.readPixels(tmpBuf, startLine, n); copyPixels(tmpBuf, faceWidth, 0, buf);
+				m_pz.readPixels(tmpBuf, startLine, n); copyPixels(tmpBuf, 2*faceWidth, 0, buf);
+			}
+			// Part of the band in the bottom row of faces
+			if(endLine > faceHeight)
+			{
+				TqInt start = std::max(startLine, faceHeight);
+				TqInt n = endLine - start;
+				TqInt y = start - startLine;
+				start -= faceHeight;
+				m_nx.readPixels(tmpBuf, start, n); copyPixels(tmpBuf, 0, y, buf);
+				m_ny.readPixels(tmpBuf, start, n); copyPixels(tmpBuf, faceWidth, y, buf);
+				m_nz.readPixels(tmpBuf, start, n); copyPixels(tmpBuf, 2*faceWidth, y, buf);
+			}
+		}
 };
 
 /** \brief Check that two texture files have compatible width,height and
@@ -328,6 +605,32 @@ void clampFilterWidth(SqFilterInfo& filterInfo, const boostfs::path& outFileName
 	}
 }
 
+/// Get the memory limit for mipmapping in memory from the "memorylimit"
+/// parameter, given in megabytes.
+///
+/// The standard declaration is an integer, but an inline float declaration
+/// is accepted too.
+std::size_t mipmapMemoryLimit(const CqRiParamList& paramList)
+{
+	TqFloat limitMb = defaultMemoryLimitMb;
+	if(const TqFloat* limit = paramList.find<TqFloat>("memorylimit"))
+		limitMb = *limit;
+	else if(const TqInt* limit = paramList.find<TqInt>("memorylimit"))
+		limitMb = static_cast<TqFloat>(*limit);
+	return static_cast<std::size_t>(Aqsis::max(limitMb, 1.0f)*1024*1024);
+}
+
+/// Copy all pixels from inFile to outFile, a band of scanlines at a time.
+void copyPixelsBanded(const IqTexInputFile& inFile, IqTexOutputFile& outFile)
+{
+	TqInt height = inFile.header().height();
+	CqTextureBuffer<TqFloat> band;
+	for(TqInt y = 0; y < height; y += streamBandHeight)
+	{
+		inFile.readPixels(band, y, std::min(streamBandHeight, height - y));
+		outFile.writePixels(band);
+	}
+}
 
 } // unnamed namespace
 
@@ -364,7 +667,7 @@ void makeTexture(const boostfs::path& inFileName, const boostfs::path& outFileNa
 
 	// Create mipmap, saving to the output file.
 	createMipmap(*inFile, inFile->header().channelList().sharedChannelType(),
-			*outFile, filterInfo, wrapModes);
+			*outFile, filterInfo, wrapModes, mipmapMemoryLimit(paramList));
 }
 
 
@@ -406,7 +709,7 @@ void makeCubeFaceEnvironment(
 	// Create mipmap, saving to the output file.
 	createMipmap(CqCubeFaceTextureSource(*inPx, *inNx, *inPy, *inNy, *inPz, *inNz),
 			inPx->header().channelList().sharedChannelType(),
-			*outFile, filterInfo, wrapModes);
+			*outFile, filterInfo, wrapModes, mipmapMemoryLimit(paramList));
 }
 
 
@@ -430,7 +733,7 @@ void makeLatLongEnvironment(const boostfs::path& inFileName,
 
 	// Create mipmap, saving to the output file.
 	createMipmap(*inFile, inFile->header().channelList().sharedChannelType(),
-			*outFile, filterInfo, wrapModes);
+			*outFile, filterInfo, wrapModes, mipmapMemoryLimit(paramList));
 }
 
 
@@ -463,13 +766,10 @@ void makeShadow(const boostfs::path& inFileName, const boostfs::path& outFileNam
 	fillOutputHeader(header, SqWrapModes(WrapMode_Trunc, WrapMode_Trunc),
 			TextureFormat_Shadow, paramList);
 
-	// Read all pixels into a buffer (not particularly memory efficient...)
-	CqTextureBuffer<TqFloat> pixelBuf;
-	inFile->readPixels(pixelBuf);
-	// Open output file and write pixel data.
+	// Open output file and copy the pixel data across.
 	boost::shared_ptr<IqTexOutputFile> outFile
 		= IqTexOutputFile::open(outFileName, ImageFile_Tiff, header);
-	outFile->writePixels(pixelBuf);
+	copyPixelsBanded(*inFile, *outFile);
 }
 
 void makeOcclusion(const std::vector<boostfs::path>& inFiles,
@@ -515,10 +815,8 @@ void makeOcclusion(const std::vector<boostfs::path>& inFiles,
 			outFile->newSubImage(header);
 		}
 
-		// Read all pixels into a buffer and write to output file.
-		CqTextureBuffer<TqFloat> pixelBuf;
-		inFile->readPixels(pixelBuf);
-		outFile->writePixels(pixelBuf);
+		// Copy the pixels to the output file.
+		copyPixelsBanded(*inFile, *outFile);
 	}
 }
 
@@ -13,3 +13,8 @@ make_absolute(maketexture_hdrs ${maketexture_SOURCE_DIR})
 
 include_directories(${maketexture_SOURCE_DIR})
 
+
+set(maketexture_test_srcs
+	downsample_test.cpp
+)
+make_absolute(maketexture_test_srcs ${maketexture_SOURCE_DIR})
@@ -91,6 +91,11 @@ std::ostream& debug(std::ostream& Stream)
 	return Stream;
 }
 
+long& log_level(std::ostream& Stream)
+{
+	return detail::log_level(Stream);
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////
 // tag_buf
 
@@ -0,0 +1,129 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/** \file
+ *
+ * \brief Unit tests for the object pool allocator
+ */
+
+#include <aqsis/util/pool.h>
+
+#include <vector>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+namespace {
+
+struct PooledThing
+{
+	double data[16];
+};
+
+typedef Aqsis::CqObjectPool<PooledThing> PoolType;
+
+/// An odd sized object, which would leave the following ones misaligned if
+/// the slots weren't padded.
+struct OddThing
+{
+	char data[13];
+};
+
+} // unnamed namespace
+
+
+BOOST_AUTO_TEST_SUITE(pool_tests)
+
+BOOST_AUTO_TEST_CASE(CqObjectPool_reuse_test)
+{
+	PoolType pool;
+	void* a = pool.alloc();
+	void* b = pool.alloc();
+	BOOST_CHECK(a != b);
+	pool.free(a);
+	// The most recently freed object is handed out first.
+	BOOST_CHECK_EQUAL(pool.alloc(), a);
+	pool.free(a);
+	pool.free(b);
+
+	TqInt allocated = 0;
+	TqInt recycled = 0;
+	Aqsis::CqObjectPoolBase::chunkCounts(allocated, recycled);
+	BOOST_CHECK_EQUAL(allocated, 1);
+	BOOST_CHECK_EQUAL(recycled, 0);
+}
+
+BOOST_AUTO_TEST_CASE(CqObjectPool_alignment_test)
+{
+	Aqsis::CqObjectPool<OddThing> pool;
+	std::vector<void*> objects;
+	for(int i = 0; i < 100; ++i)
+	{
+		void* p = pool.alloc();
+		BOOST_CHECK_EQUAL(reinterpret_cast<size_t>(p) % sizeof(double), 0u);
+		BOOST_CHECK_EQUAL(reinterpret_cast<size_t>(p) % sizeof(void*), 0u);
+		objects.push_back(p);
+	}
+	for(int i = 0; i < 100; ++i)
+		pool.free(objects[i]);
+}
+
+BOOST_AUTO_TEST_CASE(CqObjectPool_trim_test)
+{
+	PoolType pool;
+	// Allocate enough objects to fill several chunks.
+	std::vector<void*> objects;
+	for(int i = 0; i < 1000; ++i)
+		objects.push_back(pool.alloc());
+	TqInt allocated = 0;
+	TqInt recycled = 0;
+	Aqsis::CqObjectPoolBase::chunkCounts(allocated, recycled);
+	BOOST_REQUIRE(allocated > 2);
+
+	// Chunks with live objects are kept.
+	Aqsis::CqObjectPoolBase::trimAll();
+	Aqsis::CqObjectPoolBase::chunkCounts(allocated, recycled);
+	BOOST_CHECK_EQUAL(recycled, 0);
+
+	// Once everything is freed, all but one chunk is given back.
+	for(int i = 0, nobjs = objects.size(); i < nobjs; ++i)
+		pool.free(objects[i]);
+	Aqsis::CqObjectPoolBase::trimAll();
+	Aqsis::CqObjectPoolBase::chunkCounts(allocated, recycled);
+	BOOST_CHECK_EQUAL(recycled, allocated - 1);
+
+	// The kept chunk is still usable.
+	void* a = pool.alloc();
+	pool.free(a);
+	Aqsis::CqObjectPoolBase::chunkCounts(allocated, recycled);
+	BOOST_CHECK_EQUAL(recycled, allocated - 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -392,6 +392,11 @@ class CqPopenDevice::CqImpl
 				if(nRead > 0)
 					AQSIS_THROW_XQERROR(XqEnvironment, EqE_System, errBuf);
 				::close(parentErrorRead);
+				// Child processes started later shouldn't inherit our ends of
+				// the pipes, or they would keep this child's stdin open after
+				// we close it.
+				::fcntl(parentRead, F_SETFD, FD_CLOEXEC);
+				::fcntl(parentWrite, F_SETFD, FD_CLOEXEC);
 				// Save the file descriptors connected to the child process
 				// stdin and stdout.
 				m_pipeReadFd = parentRead;
@@ -67,6 +67,8 @@ ArgParse::apstringvec g_defines; // Filled in with strings to pass to the prepro
 ArgParse::apstringvec g_includes; // Filled in with strings to pass to the preprocessor
 ArgParse::apstringvec g_undefines; // Filled in with strings to pass to the preprocessor
 ArgParse::apstring g_backendName = "slx"; /// Name for the comipler backend.
+ArgParse::apstring g_nativeCache = "."; /// Directory for compiled native shaders.
+ArgParse::apstring g_nativeCompiler = ""; /// C++ compiler for native shaders.
 
 bool g_dumpsl = 0;
 bool g_cl_no_color = false;
@@ -93,9 +95,12 @@ int main( int argc, const char** argv )
 	ap.argStrings( "I", "%s \aSet path for #include files.", &g_includes );
 	ap.argStrings( "D", "Sym[=value] \adefine symbol <string> to have value <value> (default: 1).", &g_defines );
 	ap.argStrings( "U", "Sym \aUndefine an initial symbol.", &g_undefines );
-	ap.argString( "backend", " %s \aCompiler backend (default %default).  Possibilities include \"slx\" or \"dot\":\a"
+	ap.argString( "backend", " %s \aCompiler backend (default %default).  Possibilities include \"slx\", \"native\" or \"dot\":\a"
 			      "slx - produce a compiled shader (in the aqsis shader VM stack language)\a"
+			      "native - as slx, but also compile the shader to native code where possible\a"
 				  "dot - make a graphviz visualization of the parse tree (useful for debugging only).", &g_backendName );
+	ap.argString( "nativecache", " %s \aDirectory to keep shaders compiled by the native backend (default %default)", &g_nativeCache );
+	ap.argString( "nativecxx", " %s \aC++ compiler for the native backend (default $CXX, or c++)", &g_nativeCompiler );
 	ap.argFlag( "help", "\aPrint this help and exit", &g_help );
 	ap.alias("help", "h");
 	ap.argFlag( "version", "\aPrint version information and exit", &g_version );
@@ -174,6 +179,15 @@ int main( int argc, const char** argv )
 					codeGenerator.reset(new CqCodeGenVM());
 				else if(g_backendName == "dot")
 					codeGenerator.reset(new CqCodeGenGraphviz());
+				else if(g_backendName == "native")
+				{
+					if(g_nativeCompiler.empty())
+					{
+						const char* cxx = getenv("CXX");
+						g_nativeCompiler = cxx ? cxx : "c++";
+					}
+					codeGenerator.reset(new CqCodeGenNative(g_nativeCache, g_nativeCompiler));
+				}
 				else
 				{
 					std::cout << "Unknown backend type: \"" << g_backendName << "\", assuming slx.";
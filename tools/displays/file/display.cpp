@@ -76,7 +76,9 @@ struct SqDisplayInstance
 			m_imageType(Type_File),
 			m_append(0),
 			m_pixelsReceived(0),
-			m_data(0)
+			m_data(0),
+			m_description(),
+			m_startTime(0)
 	{}
 	std::string	m_filename;
 	TqInt		m_width;
@@ -97,39 +99,25 @@ struct SqDisplayInstance
 	// The number of pixels that have already been rendered (used for progress reporting)
 	TqInt		m_pixelsReceived;
 	void*		m_data;
+	// Image description given by the user, if any.
+	std::string	m_description;
+	// Time at which the image was opened, for the default description.
+	time_t		m_startTime;
 };
 //------------------------------------------------------------------------------
 
 
-static char datetime[21];
-static time_t start;
-static std::string description;
-
 //----------------------------------------------------------------------
 /** SaveAsShadowMap() Save as a tiff an shadowmap
 *
 */
 
-void SaveAsShadowMap(const std::string& filename, SqDisplayInstance* image, char *mydescription)
+void SaveAsShadowMap(const std::string& filename, SqDisplayInstance* image, char *mydescription, char* datetime)
 {
 	TqChar version[ 80 ];
 	TqUint twidth = 32;
 	TqUint tlength = 32;
 
-	struct tm *ct;
-	int year;
-
-	time_t long_time;
-
-	time( &long_time );           /* Get time as long integer. */
-	ct = localtime( &long_time ); /* Convert to local time. */
-
-
-	year=1900 + ct->tm_year;
-	sprintf(datetime, "%04d:%02d:%02d %02d:%02d:%02d", year, ct->tm_mon + 1,
-	        ct->tm_mday, ct->tm_hour, ct->tm_min, ct->tm_sec);
-
-
 	const char* mode = (image->m_append)? "a" : "w";
 
 	// Save the shadowmap to a binary file.
@@ -230,6 +218,7 @@ void WriteTIFF(const std::string& filename, SqDisplayInstance* image)
 	uint16 config = PLANARCONFIG_CONTIG;
 	struct tm *ct;
 	char mydescription[80];
+	char datetime[21];
 	int year;
 
 	time_t long_time;
@@ -242,15 +231,15 @@ void WriteTIFF(const std::string& filename, SqDisplayInstance* image)
 	sprintf(datetime, "%04d:%02d:%02d %02d:%02d:%02d", year, ct->tm_mon + 1,
 	        ct->tm_mday, ct->tm_hour, ct->tm_min, ct->tm_sec);
 
-	if (description.empty())
+	if (image->m_description.empty())
 	{
-		double nSecs = difftime(long_time, start);
+		double nSecs = difftime(long_time, image->m_startTime);
 		sprintf(mydescription,"Aqsis Renderer, %d secs rendertime", static_cast<TqInt>(nSecs));
-		start = long_time;
 	}
 	else
 	{
-		strcpy(mydescription, description.c_str());
+		strncpy(mydescription, image->m_description.c_str(), sizeof(mydescription) - 1);
+		mydescription[sizeof(mydescription) - 1] = '\0';
 	}
 
 
@@ -258,7 +247,7 @@ void WriteTIFF(const std::string& filename, SqDisplayInstance* image)
 	// If in "shadowmap" mode, write as a shadowmap.
 	if( image->m_imageType == Type_Shadowmap )
 	{
-		SaveAsShadowMap(filename, image, mydescription);
+		SaveAsShadowMap(filename, image, mydescription, datetime);
 		return;
 	}
 	else if( image->m_imageType == Type_ZFile )
@@ -431,9 +420,9 @@ extern "C" PtDspyError DspyImageOpen(PtDspyImageHandle * image,
 	pImage = new SqDisplayInstance;
 	flagstuff->flags = 0;
 
-	time(&start);
 	if(pImage)
 	{
+		time(&pImage->m_startTime);
 		// Store the instance information so that on re-entry we know which display is being referenced.
 		pImage->m_height = height;
 		pImage->m_width = width;
@@ -565,7 +554,7 @@ extern "C" PtDspyError DspyImageOpen(PtDspyImageHandle * image,
 		{
 			// Do something about it; the user will want to add its copyright notice.
 			if (ydesc && *ydesc)
-				description = ydesc;
+				pImage->m_description = ydesc;
 		}
 	}
 	else
@@ -637,7 +626,6 @@ extern "C" PtDspyError DspyImageClose(PtDspyImageHandle image)
 	// Delete the image structure.
 	if (pImage->m_data)
 		free(pImage->m_data);
-	description = "";
 	delete(pImage);
 
 
@@ -52,6 +52,7 @@
 #include <aqsis/util/logging_streambufs.h>
 #include <aqsis/version.h>
 
+#include <aqsis/riutil/ribparser.h>
 #include <aqsis/riutil/ricxxutil.h>
 #include <aqsis/riutil/ribwriter.h>
 
@@ -232,7 +233,7 @@ int main( int argc, const char** argv )
 		for(ArgParse::apstringvec::const_iterator fileName = fileNames.begin();
 			fileName != fileNames.end(); ++fileName)
 		{
-			std::ifstream file(fileName->c_str(), std::ios::binary);
+			Aqsis::RibInputFile file(fileName->c_str());
 			if(file)
 				writer->parseRib(file, fileName->c_str(),
 								 writer->firstFilter());
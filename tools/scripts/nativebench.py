@@ -0,0 +1,142 @@
+#!/usr/bin/env python
+######################################################################
+# Compare the render times of the shipped shaders compiled for the
+# shader VM and compiled to native code.
+#
+# Each surface and displacement shader in the aqsis shaders directory is
+# compiled twice with aqsl, once with the slx backend and once with the
+# native backend, and a test scene is rendered with each.  Shaders which
+# the native backend can't translate are still listed, since they show
+# what the fallback to the VM costs.
+#
+# Requirements:
+#
+# - Python 2.6 or higher
+# - aqsl and aqsis on the PATH, or given with --aqsl and --aqsis
+#
+# See nativebench.py -h for usage information.
+######################################################################
+
+import sys, os, os.path, shutil, subprocess, tempfile, time, optparse
+
+scene = """
+Format %(res)d %(res)d 1
+PixelSamples 2 2
+ShadingRate %(shadingrate)g
+Option "searchpath" "shader" ["%(shaderpath)s"]
+Display "nativebench.tif" "file" "rgba"
+Projection "perspective" "fov" 40
+Translate 0 0 3
+WorldBegin
+	LightSource "ambientlight" 1 "intensity" 0.2
+	LightSource "distantlight" 2 "from" [-1 1 -1] "to" [0 0 0]
+	Attribute "displacementbound" "sphere" 0.1
+	%(shaders)s
+	Sphere 1 -1 1 360
+WorldEnd
+"""
+
+def run(args, cwd=None):
+    """Run a command, returning its exit status."""
+    devnull = open(os.devnull, "w")
+    try:
+        return subprocess.call(args, cwd=cwd, stdout=devnull, stderr=devnull)
+    finally:
+        devnull.close()
+
+def compileShader(opts, source, outDir, native):
+    """Compile a shader into outDir.  Returns the slx file, or None."""
+    name = os.path.splitext(os.path.basename(source))[0]
+    slx = os.path.join(outDir, name + ".slx")
+    args = [opts.aqsl, "-I", opts.include, "-o", slx]
+    if native:
+        args += ["--backend=native", "--nativecache=" + outDir]
+    if run(args + [source]) != 0 or not os.path.exists(slx):
+        return None
+    return slx
+
+def isNative(slx):
+    for line in open(slx):
+        if line.startswith("NATIVE"):
+            return True
+    return False
+
+def renderTime(opts, workDir, shaderDir, shaders):
+    """Render the scene with the given shaders, returning the best time."""
+    rib = os.path.join(workDir, "nativebench.rib")
+    f = open(rib, "w")
+    f.write(scene % {"res": opts.res, "shadingrate": opts.shadingrate,
+                     "shaderpath": shaderDir + ":" + opts.lightdir,
+                     "shaders": shaders})
+    f.close()
+    best = None
+    for i in range(opts.repeats):
+        start = time.time()
+        if run([opts.aqsis, rib], cwd=workDir) != 0:
+            return None
+        elapsed = time.time() - start
+        if best is None or elapsed < best:
+            best = elapsed
+    return best
+
+def main():
+    parser = optparse.OptionParser(usage="%prog [options] [shader.sl ...]")
+    root = os.path.abspath(os.path.join(os.path.dirname(__file__), "..", ".."))
+    parser.add_option("--aqsl", dest="aqsl", default="aqsl", help="aqsl executable")
+    parser.add_option("--aqsis", dest="aqsis", default="aqsis", help="aqsis executable")
+    parser.add_option("--shaders", dest="shaders", default=os.path.join(root, "shaders"),
+                      help="directory of shaders to compare (default %default)")
+    parser.add_option("--res", dest="res", type="int", default=512,
+                      help="image resolution (default %default)")
+    parser.add_option("--shadingrate", dest="shadingrate", type="float", default=0.5,
+                      help="shading rate (default %default)")
+    parser.add_option("--repeats", dest="repeats", type="int", default=3,
+                      help="renders of each shader, the fastest is reported (default %default)")
+    opts, args = parser.parse_args()
+    opts.include = os.path.join(opts.shaders, "include")
+
+    sources = args
+    if not sources:
+        for kind in ("surface", "displacement"):
+            dir = os.path.join(opts.shaders, kind)
+            sources += [os.path.join(dir, f) for f in sorted(os.listdir(dir))
+                        if f.endswith(".sl")]
+
+    workDir = tempfile.mkdtemp(prefix="nativebench")
+    try:
+        vmDir = os.path.join(workDir, "vm")
+        nativeDir = os.path.join(workDir, "native")
+        opts.lightdir = os.path.join(workDir, "light")
+        for d in (vmDir, nativeDir, opts.lightdir):
+            os.mkdir(d)
+        for light in ("ambientlight", "distantlight"):
+            compileShader(opts, os.path.join(opts.shaders, "light", light + ".sl"),
+                          opts.lightdir, False)
+
+        sys.stdout.write("%-24s %8s %8s %8s  %s\n" % ("shader", "vm", "native", "speedup", "code"))
+        for source in sources:
+            name = os.path.splitext(os.path.basename(source))[0]
+            vmSlx = compileShader(opts, source, vmDir, False)
+            nativeSlx = compileShader(opts, source, nativeDir, True)
+            if not vmSlx or not nativeSlx:
+                sys.stdout.write("%-24s failed to compile\n" % name)
+                continue
+            if os.path.basename(os.path.dirname(source)) == "displacement":
+                shaders = 'Displacement "%s"\n\tSurface "plastic"' % name
+                compileShader(opts, os.path.join(opts.shaders, "surface", "plastic.sl"),
+                              opts.lightdir, False)
+            else:
+                shaders = 'Surface "%s"' % name
+            vmTime = renderTime(opts, workDir, vmDir, shaders)
+            nativeTime = renderTime(opts, workDir, nativeDir, shaders)
+            if vmTime is None or nativeTime is None:
+                sys.stdout.write("%-24s failed to render\n" % name)
+                continue
+            sys.stdout.write("%-24s %8.2f %8.2f %8.2f  %s\n" % (name, vmTime, nativeTime,
+                             vmTime / nativeTime, isNative(nativeSlx) and "native" or "vm"))
+            sys.stdout.flush()
+    finally:
+        shutil.rmtree(workDir)
+
+if __name__ == "__main__":
+    main()
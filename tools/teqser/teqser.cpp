@@ -23,10 +23,18 @@ tiff files.
 		\author Paul C. Gregory (pgregory@aqsis.org)
 */
 
+#include	<algorithm>
+#include	<cctype>
 #include	<cstdio>
 #include	<cstdlib>
 #include	<cstring>
+#include	<fstream>
+#include	<iomanip>
+#include	<iostream>
 #include	<memory>
+#include	<sstream>
+#include	<string>
+#include	<vector>
 
 
 #ifdef	AQSIS_SYSTEM_WIN32
@@ -34,32 +42,64 @@ tiff files.
 #pragma warning (disable : 4100)
 #endif // AQSIS_SYSTEM_WIN32
 
+#include	<boost/cstdint.hpp>
+#include	<boost/date_time/posix_time/posix_time_types.hpp>
+#include	<boost/filesystem/operations.hpp>
+#ifdef ENABLE_THREADING
+#	include	<boost/bind.hpp>
+#	include	<boost/thread/mutex.hpp>
+#	include	<boost/thread/thread.hpp>
+#	include	<boost/thread/tss.hpp>
+#endif
+
 #include	<aqsis/aqsis.h>
 #include	<aqsis/util/logging.h>
 #include 	<aqsis/util/logging_streambufs.h>
 #include	<aqsis/version.h>
 #include	<aqsis/util/argparse.h>
 #include	<aqsis/ri/ri.h>
+#include	<aqsis/riutil/ricxxutil.h>
+#include	<aqsis/tex/maketexture.h>
+#include	<aqsis/util/enum.h>
+
+/// Conversion options, given on the command line or per file in a batch
+/// manifest.
+struct SqTexOptions
+{
+	ArgParse::apflag envcube;
+	ArgParse::apflag envlatl;
+	ArgParse::apflag shadow;
+	ArgParse::apstring swrap;
+	ArgParse::apstring twrap;
+	ArgParse::apstring wrap;
+	ArgParse::apstring filter;
+	ArgParse::apstring resize;
+	ArgParse::apfloat swidth;
+	ArgParse::apfloat twidth;
+	ArgParse::apfloat fov;
+	ArgParse::apfloat width;
+	ArgParse::apstring compress;
+	ArgParse::apfloat quality;
+	ArgParse::apfloat bake;
+	ArgParse::apfloat memorylimit;
+
+	SqTexOptions()
+		: envcube( false ), envlatl( false ), shadow( false ),
+		swrap( "black" ), twrap( "black" ), wrap( "" ), filter( "box" ),
+		resize( "up" ), swidth( 1.0 ), twidth( 1.0 ), fov( 90.0 ),
+		width( -1.0 ), compress( "none" ), quality( 70.0 ), bake( 128.0 ),
+		memorylimit( 512.0 )
+	{ }
+};
 
 bool	g_version = false;
 bool	g_help = false;
-bool	g_envcube = false;
-bool	g_envlatl = false;
-bool	g_shadow = false;
 
 ArgParse::apint g_cl_verbose = 1;
-ArgParse::apstring	g_swrap = "black";
-ArgParse::apstring	g_twrap = "black";
-ArgParse::apstring	g_wrap = "";
-ArgParse::apstring g_filter = "box";
-ArgParse::apstring g_resize = "up";
-ArgParse::apfloat g_swidth = 1.0;
-ArgParse::apfloat g_twidth = 1.0;
-ArgParse::apfloat g_fov = 90.0;
-ArgParse::apfloat g_width = -1.0;
-ArgParse::apstring g_compress = "none";
-ArgParse::apfloat g_quality = 70.0;
-ArgParse::apfloat g_bake = 128.0;
+ArgParse::apstring g_batch = "";
+ArgParse::apint g_threads = 0;
+ArgParse::apstring g_uptodate = "mtime";
+SqTexOptions g_opts;
 
 
 void version( std::ostream& Stream )
@@ -68,162 +108,738 @@ void version( std::ostream& Stream )
 }
 
 
-int main( int argc, const char** argv )
+/// Register the conversion options with the argument parser.
+void addTexOptions( ArgParse& ap, SqTexOptions& opts )
 {
-	ArgParse ap;
-	RtFilterFunc filterfunc;
-	float bake;
-
-	ap.usageHeader( ArgParse::apstring( "Usage: " ) + argv[ 0 ] + " [options] infile outfile" );
-	ap.argFlag( "help", "\aPrint this help and exit", &g_help );
-	ap.alias( "help" , "h" );
-	ap.argFlag( "version", "\aPrint version information and exit", &g_version );
-	ap.argInt( "verbose", "=integer\aSet log output level\n"
-		"\a0 = errors\n"
-		"\a1 = warnings (default)\n"
-		"\a2 = information\n"
-		"\a3 = debug", &g_cl_verbose );
-	ap.alias( "verbose" , "v" );
-	ap.argString( "compression", "=string\a[none|lzw|packbits|deflate] (default: %default)", &g_compress );
-	ap.argFlag( "envcube", " px nx py ny pz nz\aproduce a cubeface environment map from 6 images.", &g_envcube );
-	ap.argFlag( "envlatl", "\aproduce a latlong environment map from an image file.", &g_envlatl );
-	ap.argFlag( "shadow", "\aproduce a shadow map from a z file.", &g_shadow );
-	ap.argString( "swrap", "=string\as wrap [black|periodic|clamp] (default: %default)", &g_swrap );
-	ap.argString( "smode", "=string\a(equivalent to swrap for BMRT compatibility)", &g_swrap );
-	ap.argString( "twrap", "=string\at wrap [black|periodic|clamp] (default: %default)", &g_twrap );
-	ap.argString( "tmode", "=string\a(equivalent to twrap for BMRT compatibility)", &g_swrap );
-	ap.argString( "wrap", "=string\awrap s&t [black|periodic|clamp]", &g_wrap );
-	ap.argString( "mode", "=string\as (equivalent to wrap for BMRT compatibility)", &g_wrap );
-	ap.argString( "filter", "=string\a[box|bessel|catmull-rom|disk|gaussian|sinc|triangle|mitchell] (default: %default)", &g_filter );
-	ap.argFloat( "fov(envcube)", "=float\a[>=0.0f] (default: %default)", &g_fov );
-	ap.argFloat( "swidth", "=float\as width [>0.0f] (default: %default)", &g_swidth );
+	ap.argString( "compression", "=string\a[none|lzw|packbits|deflate] (default: %default)", &opts.compress );
+	ap.argFlag( "envcube", " px nx py ny pz nz\aproduce a cubeface environment map from 6 images.", &opts.envcube );
+	ap.argFlag( "envlatl", "\aproduce a latlong environment map from an image file.", &opts.envlatl );
+	ap.argFlag( "shadow", "\aproduce a shadow map from a z file.", &opts.shadow );
+	ap.argString( "swrap", "=string\as wrap [black|periodic|clamp] (default: %default)", &opts.swrap );
+	ap.argString( "smode", "=string\a(equivalent to swrap for BMRT compatibility)", &opts.swrap );
+	ap.argString( "twrap", "=string\at wrap [black|periodic|clamp] (default: %default)", &opts.twrap );
+	ap.argString( "tmode", "=string\a(equivalent to twrap for BMRT compatibility)", &opts.swrap );
+	ap.argString( "wrap", "=string\awrap s&t [black|periodic|clamp]", &opts.wrap );
+	ap.argString( "mode", "=string\as (equivalent to wrap for BMRT compatibility)", &opts.wrap );
+	ap.argString( "filter", "=string\a[box|bessel|catmull-rom|disk|gaussian|sinc|triangle|mitchell] (default: %default)", &opts.filter );
+	ap.argFloat( "fov(envcube)", "=float\a[>=0.0f] (default: %default)", &opts.fov );
+	ap.argFloat( "swidth", "=float\as width [>0.0f] (default: %default)", &opts.swidth );
 	ap.alias( "swidth", "sfilterwidth" );
-	ap.argFloat( "twidth", "=float\at width [>0.0f] (default: %default)", &g_twidth );
+	ap.argFloat( "twidth", "=float\at width [>0.0f] (default: %default)", &opts.twidth );
 	ap.alias( "twidth", "tfilterwidth" );
-	ap.argFloat( "width", "=float\awidth [>0.0f] set both swidth and twidth (default: %default)", &g_width );
+	ap.argFloat( "width", "=float\awidth [>0.0f] set both swidth and twidth (default: %default)", &opts.width );
 	ap.alias( "width", "filterwidth" );
-	ap.argFloat( "quality", "=float\a[>=1.0f && <= 100.0f] (default: %default)", &g_quality );
-	ap.argFloat( "bake", "=float\a[>=2.0f && <= 2048.0f] (default: %default)", &g_bake );
-	ap.argString( "resize", "=string\a[up|down|round|up-|down-|round-] (default: %default)\n\aNot used, for BMRT compatibility only!", &g_resize );
+	ap.argFloat( "quality", "=float\a[>=1.0f && <= 100.0f] (default: %default)", &opts.quality );
+	ap.argFloat( "bake", "=float\a[>=2.0f && <= 2048.0f] (default: %default)", &opts.bake );
+	ap.argFloat( "memorylimit", "=float\a[>=1.0f] megabytes; larger images are mipmapped in bands (default: %default)", &opts.memorylimit );
+	ap.argString( "resize", "=string\a[up|down|round|up-|down-|round-] (default: %default)\n\aNot used, for BMRT compatibility only!", &opts.resize );
+}
 
 
-	if ( argc > 1 && !ap.parse( argc - 1, argv + 1 ) )
+/** \brief Check the conversion options, replacing bad values with defaults.
+ *
+ * \return false if the options can't be used at all.
+ */
+bool checkTexOptions( SqTexOptions& opts )
+{
+	if ( opts.envcube && opts.shadow )
 	{
-		Aqsis::log() << ap.errmsg() << std::endl << ap.usagemsg();
-		exit( 1 );
+		std::cout << "Specify only one of envcube or shadow" << std::endl;
+		return false;
 	}
 
-	if ( g_version )
+	/* protect the s,t width */
+	if ( opts.swidth < 1.0 )
 	{
-		version( std::cout );
-		exit( 0 );
+		Aqsis::log() << "g_swidth is smaller than 1.0." << " 1.0 will be used instead." << std::endl;
+		opts.swidth = 1.0;
+	}
+	if ( opts.twidth < 1.0 )
+	{
+		Aqsis::log() << "g_twidth is smaller than 1.0." << " 1.0 will be used instead." << std::endl;
+		opts.twidth = 1.0;
 	}
 
-	if ( g_help || ap.leftovers().size() <= 1 )
+	/* protect the s,t wrap mode */
+	if ( !( ( opts.swrap == "black" ) || ( opts.swrap == "periodic" ) || ( opts.swrap == "clamp" ) ) )
 	{
-		std::cout << ap.usagemsg();
-		exit( 0 );
+		Aqsis::log() << "Unknown s wrap mode: " << opts.swrap << ". black will be used instead." << std::endl;
+		opts.swrap = "black";
+	}
+	if ( !( ( opts.twrap == "black" ) || ( opts.twrap == "periodic" ) || ( opts.twrap == "clamp" ) ) )
+	{
+		Aqsis::log() << "Unknown t wrap mode: " << opts.twrap << ". black will be used instead." << std::endl;
+		opts.twrap = "black";
+	}
+	if ( !( ( opts.wrap == "" ) || ( opts.wrap == "black" ) || ( opts.wrap == "periodic" ) || ( opts.wrap == "clamp" ) ) )
+	{
+		Aqsis::log() << "Unknown wrap mode: " << opts.wrap << ". black will be used instead." << std::endl;
+		opts.wrap = "black";
 	}
 
-	if ( g_envcube && g_shadow )
+	/* If wrap is specified, it overrides both s and t */
+	if( opts.wrap != "" )
 	{
-		std::cout << "Specify only one of envcube or shadow" << std::endl;
-		exit( 1 );
+		opts.twrap = opts.wrap;
+		opts.swrap = opts.wrap;
 	}
 
+	/* Need to set both st width ? */
+	if ( opts.width > 0.0 )
+	{
+		opts.twidth = opts.swidth = opts.width;
+	}
 
-	/* find the pixel's filter function */
-	filterfunc = RiBoxFilter;
-	if ( g_filter == "box" )
-		filterfunc = RiBoxFilter;
-	else if ( g_filter == "mitchell" )
-		filterfunc = RiMitchellFilter;
-	else if ( g_filter == "sinc" )
-		filterfunc = RiSincFilter;
-	else if ( g_filter == "catmull-rom" )
-		filterfunc = RiCatmullRomFilter;
-	else if ( g_filter == "disk" )
-		filterfunc = RiDiskFilter;
-	else if ( g_filter == "bessel" )
-		filterfunc = RiBesselFilter;
-	else if ( g_filter == "triangle" )
-		filterfunc = RiTriangleFilter;
-	else if ( g_filter == "gaussian" )
-		filterfunc = RiGaussianFilter;
+	/* protect the compression mode */
+	if ( !( ( opts.compress == "deflate" ) ||
+	        ( opts.compress == "lzw" ) ||
+	        ( opts.compress == "none" ) ||
+	        ( opts.compress == "packbits" )
+	      )
+	   )
+	{
+		Aqsis::log() << "Unknown compression mode: " << opts.compress << ". none." << std::endl;
+		opts.compress = "none";
+	}
 
+	/* protect the quality mode */
+	if ( opts.quality < 1.0f )
+		opts.quality = 1.0;
+	if ( opts.quality > 100.0f )
+		opts.quality = 100.0;
 
+	/* protect the memory limit */
+	if ( opts.memorylimit < 1.0f )
+		opts.memorylimit = 1.0;
 
-	/* protect the s,t width */
-	if ( g_swidth < 1.0 )
+	/* protect the bake mode */
+	if ( opts.bake < 2.0f )
+		opts.bake = 2.0;
+	if ( opts.bake > 2048.0f )
+		opts.bake = 2048.0;
+
+	return true;
+}
+
+
+/// Check that the number of files matches the conversion type.
+bool checkFileCount( const SqTexOptions& opts, const std::vector<std::string>& files )
+{
+	if ( opts.envcube && files.size() != 7 )
 	{
-		Aqsis::log() << "g_swidth is smaller than 1.0." << " 1.0 will be used instead." << std::endl;
-		g_swidth = 1.0;
+		Aqsis::log() << "Need 6 images for cubic environment map" << std::endl;
+		return false;
 	}
-	if ( g_twidth < 1.0 )
+	if ( !opts.envcube && files.size() != 2 )
 	{
-		Aqsis::log() << "g_twidth is smaller than 1.0." << " 1.0 will be used instead." << std::endl;
-		g_twidth = 1.0;
+		Aqsis::log() << "Need one input and one output file" << std::endl;
+		return false;
 	}
+	return true;
+}
 
-	/* protect the s,t wrap mode */
-	if ( !( ( g_swrap == "black" ) || ( g_swrap == "periodic" ) || ( g_swrap == "clamp" ) ) )
+
+/// Find the pixel filter function with the given name.
+RtFilterFunc filterFunction( const std::string& name )
+{
+	if ( name == "mitchell" )
+		return RiMitchellFilter;
+	else if ( name == "sinc" )
+		return RiSincFilter;
+	else if ( name == "catmull-rom" )
+		return RiCatmullRomFilter;
+	else if ( name == "disk" )
+		return RiDiskFilter;
+	else if ( name == "bessel" )
+		return RiBesselFilter;
+	else if ( name == "triangle" )
+		return RiTriangleFilter;
+	else if ( name == "gaussian" )
+		return RiGaussianFilter;
+	return RiBoxFilter;
+}
+
+
+/** \brief Convert a set of files as described by the conversion options.
+ *
+ * The texture library is called directly rather than through the RI, so
+ * several conversions may run at once on different threads.  Errors are
+ * reported by throwing.
+ *
+ * \param opts - checked conversion options
+ * \param files - input files followed by the output file
+ */
+void convertFiles( const SqTexOptions& opts, const std::vector<std::string>& files )
+{
+	RtConstString compression = opts.compress.c_str();
+	Aqsis::ParamListBuilder params;
+	params( "compression", compression )
+	      ( "quality", static_cast<RtFloat>( opts.quality ) )
+	      ( "memorylimit", static_cast<RtFloat>( opts.memorylimit ) );
+	if ( !opts.envcube && !opts.envlatl && !opts.shadow )
+		params( "bake", static_cast<RtFloat>( opts.bake ) );
+	Aqsis::Ri::ParamList pList = params;
+	Aqsis::CqRiParamList paramList( pList );
+	Aqsis::SqFilterInfo filterInfo( filterFunction( opts.filter ),
+	                                opts.swidth, opts.twidth );
+
+	if ( opts.envcube )
 	{
-		Aqsis::log() << "Unknown s wrap mode: " << g_swrap << ". black will be used instead." << std::endl;
-		g_swrap = "black";
+		Aqsis::makeCubeFaceEnvironment( files[ 0 ], files[ 1 ], files[ 2 ],
+		                                files[ 3 ], files[ 4 ], files[ 5 ], files[ 6 ],
+		                                opts.fov, filterInfo, paramList );
 	}
-	if ( !( ( g_twrap == "black" ) || ( g_twrap == "periodic" ) || ( g_twrap == "clamp" ) ) )
+	else if ( opts.shadow )
 	{
-		Aqsis::log() << "Unknown t wrap mode: " << g_twrap << ". black will be used instead." << std::endl;
-		g_twrap = "black";
+		Aqsis::makeShadow( files[ 0 ], files[ 1 ], paramList );
 	}
-	if ( !( ( g_wrap == "" ) || ( g_wrap == "black" ) || ( g_wrap == "periodic" ) || ( g_wrap == "clamp" ) ) )
+	else if ( opts.envlatl )
 	{
-		Aqsis::log() << "Unknown wrap mode: " << g_wrap << ". black will be used instead." << std::endl;
-		g_wrap = "black";
+		Aqsis::makeLatLongEnvironment( files[ 0 ], files[ 1 ], filterInfo, paramList );
 	}
+	else
+	{
+		Aqsis::SqWrapModes wrapModes(
+		    Aqsis::enumCast<Aqsis::EqWrapMode>( opts.swrap ),
+		    Aqsis::enumCast<Aqsis::EqWrapMode>( opts.twrap ) );
+		Aqsis::makeTexture( files[ 0 ], files[ 1 ], filterInfo, wrapModes, paramList );
+	}
+}
 
-	/* If wrap is specified, it overrides both s and t */
-	if( g_wrap != "" )
+
+//------------------------------------------------------------------------------
+// Batch conversion
+
+/// A single conversion from a batch manifest.
+struct SqBatchJob
+{
+	enum EqStatus
 	{
-		g_twrap = g_wrap;
-		g_swrap = g_wrap;
+		Status_Pending,
+		Status_Converted,
+		Status_UpToDate,
+		Status_Failed
+	};
+
+	SqTexOptions opts;
+	/// Input files followed by the output file
+	std::vector<std::string> files;
+	EqStatus status;
+	/// Wall clock conversion time in seconds
+	double seconds;
+	/// Total size of the input files in bytes
+	boost::uintmax_t inputBytes;
+	std::string error;
+
+	SqBatchJob()
+		: opts(), files(), status( Status_Pending ), seconds( 0 ),
+		inputBytes( 0 ), error()
+	{ }
+};
+
+
+/** \brief Split a manifest line into arguments.
+ *
+ * Arguments are separated by whitespace; double quotes may be used around
+ * arguments containing spaces.
+ */
+std::vector<std::string> splitManifestLine( const std::string& line )
+{
+	std::vector<std::string> args;
+	std::string arg;
+	bool inArg = false;
+	bool inQuotes = false;
+	for ( std::string::size_type i = 0; i < line.size(); ++i )
+	{
+		char c = line[ i ];
+		if ( c == '"' )
+		{
+			inQuotes = !inQuotes;
+			inArg = true;
+		}
+		else if ( !inQuotes && std::isspace( static_cast<unsigned char>( c ) ) )
+		{
+			if ( inArg )
+				args.push_back( arg );
+			arg.clear();
+			inArg = false;
+		}
+		else
+		{
+			arg += c;
+			inArg = true;
+		}
 	}
+	if ( inArg )
+		args.push_back( arg );
+	return args;
+}
 
-	/* Need to set both st width ? */
-	if ( g_width > 0.0 )
+
+/** \brief Read the conversions from a batch manifest.
+ *
+ * Each non-empty line of the manifest holds the options and files for one
+ * conversion, exactly as they'd be given to teqser on the command line.
+ * Options given on the command line act as defaults for every line.  Lines
+ * starting with '#' are comments.
+ *
+ * \return false if the manifest couldn't be read or contained errors.
+ */
+bool readManifest( const std::string& fileName, const SqTexOptions& defaults,
+                   std::vector<SqBatchJob>& jobs )
+{
+	std::ifstream manifest( fileName.c_str() );
+	if ( !manifest )
 	{
-		g_twidth = g_swidth = g_width;
+		Aqsis::log() << Aqsis::error << "Could not open batch manifest \""
+		<< fileName << "\"" << std::endl;
+		return false;
+	}
+	bool ok = true;
+	std::string line;
+	for ( int lineNum = 1; std::getline( manifest, line ); ++lineNum )
+	{
+		std::vector<std::string> args = splitManifestLine( line );
+		if ( args.empty() || args[ 0 ][ 0 ] == '#' )
+			continue;
+		SqBatchJob job;
+		job.opts = defaults;
+		ArgParse ap;
+		addTexOptions( ap, job.opts );
+		std::vector<const char*> argv;
+		for ( std::vector<std::string>::size_type i = 0; i < args.size(); ++i )
+			argv.push_back( args[ i ].c_str() );
+		if ( !ap.parse( argv.size(), &argv[ 0 ] ) )
+		{
+			Aqsis::log() << Aqsis::error << fileName << ":" << lineNum << ": "
+			<< ap.errmsg() << std::endl;
+			ok = false;
+			continue;
+		}
+		job.files = ap.leftovers();
+		if ( !checkTexOptions( job.opts ) || !checkFileCount( job.opts, job.files ) )
+		{
+			Aqsis::log() << Aqsis::error << fileName << ":" << lineNum
+			<< ": bad conversion" << std::endl;
+			ok = false;
+			continue;
+		}
+		jobs.push_back( job );
 	}
+	return ok;
+}
 
-	/* protect the compression mode */
-	if ( !( ( g_compress == "deflate" ) ||
-	        ( g_compress == "lzw" ) ||
-	        ( g_compress == "none" ) ||
-	        ( g_compress == "packbits" )
-	      )
-	   )
+
+/// 64 bit FNV-1a hash.
+class CqContentHash
+{
+	public:
+		CqContentHash() : m_hash( 14695981039346656037ULL ) {}
+		void add( const char* data, std::size_t size )
+		{
+			for ( std::size_t i = 0; i < size; ++i )
+			{
+				m_hash ^= static_cast<unsigned char>( data[ i ] );
+				m_hash *= 1099511628211ULL;
+			}
+		}
+		void add( const std::string& str )
+		{
+			add( str.c_str(), str.size() + 1 );
+		}
+		/// Add the contents of a file, returning false if it can't be read.
+		bool addFile( const std::string& fileName )
+		{
+			std::ifstream in( fileName.c_str(), std::ios::binary );
+			if ( !in )
+				return false;
+			std::vector<char> buf( 1 << 16 );
+			while ( in )
+			{
+				in.read( &buf[ 0 ], buf.size() );
+				add( &buf[ 0 ], in.gcount() );
+			}
+			return true;
+		}
+		std::string str() const
+		{
+			std::ostringstream out;
+			out << std::hex << std::setfill( '0' ) << std::setw( 16 ) << m_hash;
+			return out.str();
+		}
+	private:
+		boost::uint64_t m_hash;
+};
+
+
+/** \brief Hash the inputs and options of a conversion.
+ *
+ * \return the hash, or an empty string if an input couldn't be read.
+ */
+std::string jobHash( const SqBatchJob& job )
+{
+	const SqTexOptions& o = job.opts;
+	std::ostringstream optStr;
+	optStr << o.envcube << o.envlatl << o.shadow << " " << o.swrap << " "
+	       << o.twrap << " " << o.filter << " " << o.swidth << " " << o.twidth
+	       << " " << o.fov << " " << o.compress << " " << o.quality << " "
+	       << o.bake << " " << AQSIS_VERSION_STR_FULL;
+	CqContentHash hash;
+	hash.add( optStr.str() );
+	for ( std::vector<std::string>::size_type i = 0; i + 1 < job.files.size(); ++i )
 	{
-		Aqsis::log() << "Unknown compression mode: " << g_compress << ". none." << std::endl;
-		g_compress = "none";
+		if ( !hash.addFile( job.files[ i ] ) )
+			return std::string();
 	}
+	return hash.str();
+}
 
-	/* protect the quality mode */
-	if ( g_quality < 1.0f )
-		g_quality = 1.0;
-	if ( g_quality > 100.0f )
-		g_quality = 100.0;
 
-	/* protect the bake mode */
-	if ( g_bake < 2.0f )
-		g_bake = 2.0;
-	if ( g_bake > 2048.0f )
-		g_bake = 2048.0;
+/// File holding the hash of the conversion which produced an output file.
+std::string hashFileName( const SqBatchJob& job )
+{
+	return job.files.back() + ".teqserhash";
+}
 
-	char *compression = ( char * ) g_compress.c_str();
-	float quality = ( float ) g_quality;
+
+/** \brief Determine whether the output of a conversion is up to date.
+ *
+ * \param job - conversion to check
+ * \param mode - "mtime" to compare modification times, "hash" to compare a
+ *               hash of the inputs and options with the one saved after the
+ *               last conversion, or "none" to always convert.
+ * \param hash - returns the job hash in "hash" mode
+ */
+bool upToDate( const SqBatchJob& job, const std::string& mode, std::string& hash )
+{
+	namespace fs = boost::filesystem;
+	const std::string& outName = job.files.back();
+	if ( mode == "none" || !fs::exists( outName ) )
+	{
+		if ( mode == "hash" )
+			hash = jobHash( job );
+		return false;
+	}
+	if ( mode == "hash" )
+	{
+		hash = jobHash( job );
+		std::ifstream hashFile( hashFileName( job ).c_str() );
+		std::string oldHash;
+		return !hash.empty() && hashFile >> oldHash && oldHash == hash;
+	}
+	std::time_t outTime = fs::last_write_time( outName );
+	for ( std::vector<std::string>::size_type i = 0; i + 1 < job.files.size(); ++i )
+	{
+		if ( !fs::exists( job.files[ i ] ) || fs::last_write_time( job.files[ i ] ) > outTime )
+			return false;
+	}
+	return true;
+}
 
 
-	std::auto_ptr<std::streambuf> show_level( new Aqsis::show_level_buf(Aqsis::log()) );
+#ifdef ENABLE_THREADING
+/** \brief Stream buffer which passes on log output a whole line at a time.
+ *
+ * The texture library logs warnings as it converts, so the threads of a batch
+ * all write to Aqsis::log().  While installed on the log, the output of each
+ * thread is gathered until the end of a line, along with the log level when
+ * it started.  Complete lines are filtered and labelled with their level on a
+ * stream of the buffer's own, under a lock, so the text of different lines is
+ * never mixed.  The level itself is still set on the shared log stream, so a
+ * line started just as another thread sets a level may be given that level.
+ */
+class CqLineLogBuf : public std::streambuf
+{
+	public:
+		/// Install on stream, showing messages at or above the given level.
+		CqLineLogBuf( std::ostream& stream, Aqsis::log_level_t level )
+			: m_stream( stream ),
+			m_streambuf( stream.rdbuf() ),
+			m_out( stream.rdbuf() ),
+			m_showLevel( m_out ),
+			m_filterLevel( level, m_out )
+		{
+			setp( 0, 0 );
+			m_stream.rdbuf( this );
+		}
+		~CqLineLogBuf()
+		{
+			m_stream.rdbuf( m_streambuf );
+		}
+
+	protected:
+		int overflow( int c )
+		{
+			if ( c == EOF )
+				return 0;
+			SqLine& line = threadLine();
+			if ( line.text.empty() )
+				line.level = Aqsis::log_level( m_stream );
+			line.text += static_cast<char>( c );
+			if ( c == '\n' && !writeLine( line ) )
+				return EOF;
+			return c;
+		}
+		/// The log is flushed after every insertion, so only whole lines are written.
+		int sync()
+		{
+			return 0;
+		}
+
+	private:
+		/// Output of a single thread since its last complete line
+		struct SqLine
+		{
+			long level;
+			std::string text;
+		};
+
+		SqLine& threadLine()
+		{
+			SqLine* line = m_line.get();
+			if ( !line )
+			{
+				line = new SqLine();
+				m_line.reset( line );
+			}
+			return *line;
+		}
+
+		bool writeLine( SqLine& line )
+		{
+			boost::mutex::scoped_lock lock( m_mutex );
+			Aqsis::log_level( m_out ) = line.level;
+			m_out.write( line.text.data(), line.text.size() );
+			m_out.flush();
+			line.text.clear();
+			return m_out.good();
+		}
+
+		std::ostream& m_stream;
+		std::streambuf* const m_streambuf;
+		/// Stream the complete lines are written to, with its own level.
+		std::ostream m_out;
+		Aqsis::show_level_buf m_showLevel;
+		Aqsis::filter_by_level_buf m_filterLevel;
+		boost::thread_specific_ptr<SqLine> m_line;
+		boost::mutex m_mutex;
+};
+#endif
+
+
+/** \brief Runs the jobs of a batch, possibly on several threads.
+ *
+ * Each thread repeatedly takes the next unstarted job.  A line is printed as
+ * each job completes, with its conversion time and input throughput.
+ */
+class CqBatchRunner
+{
+	public:
+		CqBatchRunner( std::vector<SqBatchJob>& jobs, const std::string& upToDateMode )
+			: m_jobs( jobs ),
+			m_upToDateMode( upToDateMode ),
+			m_nextJob( 0 )
+		{ }
+
+		/// Run jobs until none remain.
+		void operator()()
+		{
+			while ( SqBatchJob* job = nextJob() )
+			{
+				runJob( *job );
+				report( *job );
+			}
+		}
+
+	private:
+		SqBatchJob* nextJob()
+		{
+#			ifdef ENABLE_THREADING
+			boost::mutex::scoped_lock lock( m_mutex );
+#			endif
+			if ( m_nextJob >= m_jobs.size() )
+				return 0;
+			return &m_jobs[ m_nextJob++ ];
+		}
+
+		void runJob( SqBatchJob& job )
+		{
+			namespace pt = boost::posix_time;
+			pt::ptime startTime = pt::microsec_clock::universal_time();
+			try
+			{
+				for ( std::vector<std::string>::size_type i = 0; i + 1 < job.files.size(); ++i )
+				{
+					if ( boost::filesystem::exists( job.files[ i ] ) )
+						job.inputBytes += boost::filesystem::file_size( job.files[ i ] );
+				}
+				std::string hash;
+				if ( upToDate( job, m_upToDateMode, hash ) )
+				{
+					job.status = SqBatchJob::Status_UpToDate;
+					return;
+				}
+				convertFiles( job.opts, job.files );
+				if ( !hash.empty() )
+				{
+					std::ofstream hashFile( hashFileName( job ).c_str() );
+					hashFile << hash << "\n";
+				}
+				job.status = SqBatchJob::Status_Converted;
+			}
+			catch ( const std::exception& e )
+			{
+				job.status = SqBatchJob::Status_Failed;
+				job.error = e.what();
+			}
+			job.seconds = ( pt::microsec_clock::universal_time() - startTime )
+			              .total_microseconds() * 1e-6;
+		}
+
+		void report( const SqBatchJob& job )
+		{
+#			ifdef ENABLE_THREADING
+			boost::mutex::scoped_lock lock( m_mutex );
+#			endif
+			const std::string& outName = job.files.back();
+			switch ( job.status )
+			{
+				case SqBatchJob::Status_Converted:
+					std::cout << "converted " << std::fixed << std::setprecision( 2 )
+					<< std::setw( 8 ) << job.seconds << "s "
+					<< std::setw( 8 ) << throughput( job.inputBytes, job.seconds )
+					<< " MB/s  " << outName << std::endl;
+					break;
+				case SqBatchJob::Status_UpToDate:
+					std::cout << "up to date " << outName << std::endl;
+					break;
+				case SqBatchJob::Status_Failed:
+					Aqsis::log() << Aqsis::error << "failed " << outName << ": "
+					<< job.error << std::endl;
+					break;
+				default:
+					break;
+			}
+		}
+
+	public:
+		/// Throughput in megabytes per second
+		static double throughput( boost::uintmax_t bytes, double seconds )
+		{
+			return seconds > 0 ? bytes / ( 1024.0 * 1024.0 ) / seconds : 0;
+		}
+
+	private:
+		std::vector<SqBatchJob>& m_jobs;
+		std::string m_upToDateMode;
+		std::vector<SqBatchJob>::size_type m_nextJob;
+#		ifdef ENABLE_THREADING
+		boost::mutex m_mutex;
+#		endif
+};
+
+
+/** \brief Convert all the files listed in a batch manifest.
+ *
+ * \return the process exit status.
+ */
+int runBatch( const std::string& manifestName, const SqTexOptions& defaults )
+{
+	if ( !( g_uptodate == "mtime" || g_uptodate == "hash" || g_uptodate == "none" ) )
+	{
+		Aqsis::log() << "Unknown up to date check: " << g_uptodate << ". mtime will be used instead." << std::endl;
+		g_uptodate = "mtime";
+	}
+	std::vector<SqBatchJob> jobs;
+	if ( !readManifest( manifestName, defaults, jobs ) )
+		return 1;
+
+	namespace pt = boost::posix_time;
+	pt::ptime startTime = pt::microsec_clock::universal_time();
+	CqBatchRunner runner( jobs, g_uptodate );
+#	ifdef ENABLE_THREADING
+	int numThreads = g_threads > 0 ? g_threads : boost::thread::hardware_concurrency();
+	numThreads = std::max( 1, std::min<int>( numThreads, jobs.size() ) );
+	boost::thread_group threads;
+	for ( int i = 1; i < numThreads; ++i )
+		threads.create_thread( boost::bind( &CqBatchRunner::operator(), &runner ) );
+	runner();
+	threads.join_all();
+#	else
+	runner();
+#	endif
+	double seconds = ( pt::microsec_clock::universal_time() - startTime )
+	                 .total_microseconds() * 1e-6;
+
+	int converted = 0;
+	int current = 0;
+	int failed = 0;
+	boost::uintmax_t convertedBytes = 0;
+	for ( std::vector<SqBatchJob>::size_type i = 0; i < jobs.size(); ++i )
+	{
+		switch ( jobs[ i ].status )
+		{
+			case SqBatchJob::Status_Converted:
+				++converted;
+				convertedBytes += jobs[ i ].inputBytes;
+				break;
+			case SqBatchJob::Status_UpToDate:
+				++current;
+				break;
+			default:
+				++failed;
+				break;
+		}
+	}
+	std::cout << converted << " converted, " << current << " up to date, "
+	<< failed << " failed in " << std::fixed << std::setprecision( 2 )
+	<< seconds << "s (" << convertedBytes / ( 1024.0 * 1024.0 ) << " MB, "
+	<< CqBatchRunner::throughput( convertedBytes, seconds ) << " MB/s)" << std::endl;
+	return failed > 0 ? 1 : 0;
+}
+
+
+int main( int argc, const char** argv )
+{
+	ArgParse ap;
+
+	ap.usageHeader( ArgParse::apstring( "Usage: " ) + argv[ 0 ] + " [options] infile outfile\n"
+	                "       " + argv[ 0 ] + " [options] -batch=manifest" );
+	ap.argFlag( "help", "\aPrint this help and exit", &g_help );
+	ap.alias( "help" , "h" );
+	ap.argFlag( "version", "\aPrint version information and exit", &g_version );
+	ap.argInt( "verbose", "=integer\aSet log output level\n"
+		"\a0 = errors\n"
+		"\a1 = warnings (default)\n"
+		"\a2 = information\n"
+		"\a3 = debug", &g_cl_verbose );
+	ap.alias( "verbose" , "v" );
+	addTexOptions( ap, g_opts );
+	ap.argString( "batch", "=string\aconvert each file listed in a manifest.  Each line holds the options\n"
+		"\aand files for one conversion, as given on the command line;  command\n"
+		"\aline options are the defaults.", &g_batch );
+	ap.argInt( "threads", "=integer\anumber of concurrent conversions in batch mode (default: one per core)", &g_threads );
+	ap.argString( "uptodate", "=string\a[mtime|hash|none] skip batch outputs which are up to date (default: %default)", &g_uptodate );
+
+
+	if ( argc > 1 && !ap.parse( argc - 1, argv + 1 ) )
+	{
+		Aqsis::log() << ap.errmsg() << std::endl << ap.usagemsg();
+		exit( 1 );
+	}
+
+	if ( g_version )
+	{
+		version( std::cout );
+		exit( 0 );
+	}
+
+	if ( g_help || ( g_batch.empty() && ap.leftovers().size() <= 1 ) )
+	{
+		std::cout << ap.usagemsg();
+		exit( 0 );
+	}
+
 	Aqsis::log_level_t level = Aqsis::ERROR;
 	if( g_cl_verbose > 0 )
 		level = Aqsis::WARNING;
@@ -231,93 +847,59 @@ int main( int argc, const char** argv )
 		level = Aqsis::INFO;
 	if( g_cl_verbose > 2 )
 		level = Aqsis::DEBUG;
+#	ifdef ENABLE_THREADING
+	// The conversions of a batch may log from several threads at once.
+	CqLineLogBuf line_log( Aqsis::log(), level );
+#	else
+	std::auto_ptr<std::streambuf> show_level( new Aqsis::show_level_buf(Aqsis::log()) );
 	std::auto_ptr<std::streambuf> filter_level( new Aqsis::filter_by_level_buf(level, Aqsis::log()) );
+#	endif
 
-	RiBegin(RI_NULL);
+	if ( !g_batch.empty() )
+		return runBatch( g_batch, g_opts );
 
-	if ( g_envcube )
-	{
-		if ( ap.leftovers().size() != 7 )
-		{
-			Aqsis::log() << "Need 6 images for cubic environment map" << std::endl;
-			return ( -1 );
-		}
+	SqTexOptions opts = g_opts;
+	if ( !checkTexOptions( opts ) )
+		exit( 1 );
+	const std::vector<std::string>& files = ap.leftovers();
+	if ( !checkFileCount( opts, files ) )
+		return ( -1 );
 
+	if ( opts.envcube )
+	{
 		printf( "CubeFace Environment %s %s %s %s %s %s ----> %s \n\t\"fov\"= %4.1f\n\t\"filter\"= %s \n\t\"swidth\"= %4.1f\n\t\"twidth\"= %4.1f\n\t\"compression\" = %s\n",
-		        const_cast<char*>(ap.leftovers() [ 0 ].c_str()),
-		        const_cast<char*>(ap.leftovers() [ 1 ].c_str()),
-		        const_cast<char*>(ap.leftovers() [ 2 ].c_str()),
-		        const_cast<char*>(ap.leftovers() [ 3 ].c_str()),
-		        const_cast<char*>(ap.leftovers() [ 4 ].c_str()),
-		        const_cast<char*>(ap.leftovers() [ 5 ].c_str()),
-		        const_cast<char*>(ap.leftovers() [ 6 ].c_str()),
-		        g_fov,
-		        g_filter.c_str(),
-		        g_swidth,
-		        g_twidth,
-		        ( char* ) g_compress.c_str()
-		      );
-
-		RiMakeCubeFaceEnvironment(
-		    const_cast<char*>(ap.leftovers() [ 0 ].c_str()),
-		    const_cast<char*>(ap.leftovers() [ 1 ].c_str()),
-		    const_cast<char*>(ap.leftovers() [ 2 ].c_str()),
-		    const_cast<char*>(ap.leftovers() [ 3 ].c_str()),
-		    const_cast<char*>(ap.leftovers() [ 4 ].c_str()),
-		    const_cast<char*>(ap.leftovers() [ 5 ].c_str()),
-		    const_cast<char*>(ap.leftovers() [ 6 ].c_str()),
-		    g_fov,
-		    filterfunc,
-		    ( float ) g_swidth,
-		    ( float ) g_twidth,
-		    "compression",
-		    &compression,
-		    "quality",
-		    &quality,
-		    RI_NULL );
-	}
-	else if ( g_shadow )
+		        files[ 0 ].c_str(), files[ 1 ].c_str(), files[ 2 ].c_str(),
+		        files[ 3 ].c_str(), files[ 4 ].c_str(), files[ 5 ].c_str(),
+		        files[ 6 ].c_str(), opts.fov, opts.filter.c_str(),
+		        opts.swidth, opts.twidth, opts.compress.c_str() );
+	}
+	else if ( opts.shadow )
 	{
 		printf( "Shadow %s ----> %s \n\t\"compression\" = %s\n",
-		        ( char* ) ap.leftovers() [ 0 ].c_str(),
-		        ( char* ) ap.leftovers() [ 1 ].c_str(),
-		        ( char* ) g_compress.c_str() );
-
-
-
-		RiMakeShadow( ( char* ) ap.leftovers() [ 0 ].c_str(), ( char* ) ap.leftovers() [ 1 ].c_str(), ( float ) g_twidth, "compression", &compression, "quality", &quality, RI_NULL );
+		        files[ 0 ].c_str(), files[ 1 ].c_str(), opts.compress.c_str() );
 	}
-	else if ( g_envlatl )
+	else if ( opts.envlatl )
 	{
 		printf( "LatLong Environment %s ----> %s \n\t\"compression\" = %s \n",
-		        ( char* ) ap.leftovers() [ 0 ].c_str(),
-		        ( char* ) ap.leftovers() [ 1 ].c_str(),
-		        ( char* ) g_compress.c_str() );
-
-		RiMakeLatLongEnvironment( ( char* ) ap.leftovers() [ 0 ].c_str(), ( char* ) ap.leftovers() [ 1 ].c_str(), filterfunc,
-		                          ( float ) g_swidth, ( float ) g_twidth, "compression", &compression, "quality", &quality, RI_NULL );
+		        files[ 0 ].c_str(), files[ 1 ].c_str(), opts.compress.c_str() );
 	}
 	else
 	{
 		printf( "Texture %s ----> %s \n\t\"swrap\"= %s \n\t\"twrap\"= %s \n\t\"filter\"= %s \n\t\"swidth\"= %4.1f\n\t\"twidth\"= %4.1f\n\t\"compression\" = %s\n",
-		        ( char* ) ap.leftovers() [ 0 ].c_str(),
-		        ( char* ) ap.leftovers() [ 1 ].c_str(),
-		        ( char* ) g_swrap.c_str(),
-		        ( char* ) g_twrap.c_str(),
-		        ( char* ) g_filter.c_str(),
-		        g_swidth,
-		        g_twidth,
-		        compression
-		      );
-
- 		bake = g_bake;
-
-		RiMakeTexture( ( char* ) ap.leftovers() [ 0 ].c_str(), ( char* ) ap.leftovers() [ 1 ].c_str(),
-		               ( char* ) g_swrap.c_str(), ( char* ) g_twrap.c_str(), filterfunc,
-		               ( float ) g_swidth, ( float ) g_twidth, "compression", &compression, "quality", &quality, "float bake", &bake, RI_NULL );
+		        files[ 0 ].c_str(), files[ 1 ].c_str(), opts.swrap.c_str(),
+		        opts.twrap.c_str(), opts.filter.c_str(), opts.swidth,
+		        opts.twidth, opts.compress.c_str() );
 	}
 
-	RiEnd();
+	try
+	{
+		convertFiles( opts, files );
+	}
+	catch ( const std::exception& e )
+	{
+		Aqsis::log() << Aqsis::error << e.what() << std::endl;
+		return ( 1 );
+	}
 
 	return ( 0 );
 }